@@ -4,13 +4,116 @@
 // License, v. 2.0. If a copy of the MPL was not distributed with this
 // file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
+#include "async.h"
+
 #include <iostream>
 
+#include <algorithm>
+#include <cstdio>
+#include <fstream>
+#include <map>
+#include <set>
+#include <string>
+#include <tuple>
+#include <utility>
+
 #include <thread>
 
+#if defined(__linux__)
+#include <dirent.h>
+#include <pthread.h>
+#include <sched.h>
+#endif
+
 #include "absl/flags/flag.h"
 
 ABSL_FLAG(unsigned, workers, 0, "number of mining threads to spawn");
+ABSL_FLAG(std::string, affinity, "none", "how to pin worker threads to CPUs: \"none\", \"compact\" (fill the SMT siblings of each core first), \"scatter\" (spread threads across sockets and cores), or \"physical\" (like scatter, but at most one thread per physical core)");
+
+namespace {
+
+/** Where a logical CPU sits in the machine's topology. */
+struct CpuInfo {
+    int cpu;
+    int node;
+    int package;
+    int core;
+    /** Index of this CPU among the SMT siblings of its core. */
+    int thread;
+};
+
+#if defined(__linux__)
+int read_sysfs_int(const std::string& path, int fallback)
+{
+    std::ifstream file(path);
+    int value;
+    if (file >> value) {
+        return value;
+    }
+    return fallback;
+}
+
+/** The NUMA node of the given CPU, from the nodeN link in its sysfs
+ *  directory, or 0 on machines without NUMA support. */
+int get_cpu_node(int cpu)
+{
+    int node = 0;
+    const std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    if (DIR* dir = opendir(path.c_str())) {
+        while (struct dirent* entry = readdir(dir)) {
+            if (sscanf(entry->d_name, "node%d", &node) == 1) {
+                break;
+            }
+        }
+        closedir(dir);
+    }
+    return node;
+}
+#endif
+
+/**
+ * Returns the topology of the CPUs this process is allowed to run on, as
+ * restricted by e.g. taskset or cgroups.  Returns an empty vector if this
+ * could not be determined.
+ */
+std::vector<CpuInfo> get_cpu_topology()
+{
+    std::vector<CpuInfo> cpus;
+#if defined(__linux__)
+    cpu_set_t allowed;
+    CPU_ZERO(&allowed);
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0) {
+        return cpus;
+    }
+    std::map<std::pair<int, int>, int> threads_per_core;
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+        if (!CPU_ISSET(cpu, &allowed)) {
+            continue;
+        }
+        const std::string path = "/sys/devices/system/cpu/cpu" + std::to_string(cpu) + "/topology/";
+        CpuInfo info;
+        info.cpu = cpu;
+        info.node = get_cpu_node(cpu);
+        info.package = read_sysfs_int(path + "physical_package_id", 0);
+        // Without topology information every CPU is its own core.
+        info.core = read_sysfs_int(path + "core_id", cpu);
+        info.thread = threads_per_core[{info.package, info.core}]++;
+        cpus.push_back(info);
+    }
+#endif
+    return cpus;
+}
+
+} // namespace
+
+int get_num_physical_cores()
+{
+    std::set<std::pair<int, int>> cores;
+    for (const CpuInfo& info : get_cpu_topology()) {
+        cores.insert({info.package, info.core});
+    }
+    return cores.size();
+}
 
 int get_num_workers()
 {
@@ -19,6 +122,13 @@ int get_num_workers()
         std::cerr << "Error: --workers cannot be larger than 1024" << std::endl;
         return 1;
     }
+    if (num_workers == 0 && absl::GetFlag(FLAGS_affinity) == "physical") {
+        // Only one thread per core is wanted, so SMT siblings don't count.
+        num_workers = get_num_physical_cores();
+        if (num_workers != 0) {
+            std::cout << "Auto-detected the number of physical cores to be " << num_workers << std::endl;
+        }
+    }
     if (num_workers == 0) {
         num_workers = std::thread::hardware_concurrency();
         if (num_workers != 0) {
@@ -31,4 +141,66 @@ int get_num_workers()
     return num_workers;
 }
 
+std::vector<int> get_affinity_cpus()
+{
+    const std::string mode = absl::GetFlag(FLAGS_affinity);
+    if (mode == "none") {
+        return {};
+    }
+    if (mode != "compact" && mode != "scatter" && mode != "physical") {
+        std::cerr << "Warning: unknown --affinity mode '" << mode << "'; threads will not be pinned" << std::endl;
+        return {};
+    }
+    std::vector<CpuInfo> cpus = get_cpu_topology();
+    if (cpus.empty()) {
+        std::cerr << "Warning: could not determine the CPU topology; threads will not be pinned" << std::endl;
+        return {};
+    }
+
+    if (mode == "compact") {
+        // Neighbouring workers share a core, then a socket, so that a
+        // partial set of workers occupies as few sockets as possible.
+        std::sort(cpus.begin(), cpus.end(), [](const CpuInfo& a, const CpuInfo& b) {
+            return std::tie(a.node, a.package, a.core, a.thread) < std::tie(b.node, b.package, b.core, b.thread);
+        });
+    } else {
+        // Deal the cores out to the sockets in turn, and only give a core a
+        // second thread once every core has one.
+        std::map<std::pair<int, int>, int> core_rank;
+        std::map<int, int> cores_per_package;
+        for (const CpuInfo& info : cpus) {
+            if (info.thread == 0) {
+                core_rank[{info.package, info.core}] = cores_per_package[info.package]++;
+            }
+        }
+        std::sort(cpus.begin(), cpus.end(), [&](const CpuInfo& a, const CpuInfo& b) {
+            const int rank_a = core_rank[{a.package, a.core}];
+            const int rank_b = core_rank[{b.package, b.core}];
+            return std::tie(a.thread, rank_a, a.package) < std::tie(b.thread, rank_b, b.package);
+        });
+        if (mode == "physical") {
+            cpus.erase(std::remove_if(cpus.begin(), cpus.end(), [](const CpuInfo& info) { return info.thread != 0; }), cpus.end());
+        }
+    }
+
+    std::vector<int> ret;
+    for (const CpuInfo& info : cpus) {
+        ret.push_back(info.cpu);
+    }
+    return ret;
+}
+
+bool pin_current_thread(int cpu)
+{
+#if defined(__linux__)
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) == 0;
+#else
+    (void)cpu;
+    return false;
+#endif
+}
+
 // End of File
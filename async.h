@@ -7,8 +7,26 @@
 #if !defined(ASYNC_H)
 #define ASYNC_H
 
+#include <vector>
+
 int get_num_workers();
 
+/** Returns the number of physical cores available to this process, not
+ *  counting SMT siblings, or 0 if this could not be determined. */
+int get_num_physical_cores();
+
+/**
+ * Returns the logical CPUs to pin worker threads to, in order, as selected
+ * by --affinity: worker i should be pinned to the CPU at index i modulo the
+ * size of the vector.  Returns an empty vector if threads are not to be
+ * pinned.
+ */
+std::vector<int> get_affinity_cpus();
+
+/** Pin the calling thread to the given logical CPU.  Returns false on
+ *  failure, or on platforms without thread affinity support. */
+bool pin_current_thread(int cpu);
+
 #endif // !defined(ASYNC_H)
 
 // End of File
@@ -0,0 +1,341 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "auditlog.h"
+
+#include <chrono>
+#include <fstream>
+#include <set>
+#include <sstream>
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "absl/strings/escaping.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_format.h"
+#include "absl/strings/string_view.h"
+
+#include <libpq-fe.h>
+
+#include "logger.h"
+
+namespace {
+
+bool WriteAll(int fd, const std::string& data)
+{
+    size_t pos = 0;
+    while (pos < data.size()) {
+        ssize_t n = write(fd, data.data() + pos, data.size() - pos);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        pos += n;
+    }
+    return true;
+}
+
+bool SyncData(int fd)
+{
+#if defined(__APPLE__)
+    return fsync(fd) == 0;
+#else
+    return fdatasync(fd) == 0;
+#endif
+}
+
+void AppendBytea(std::string& line, const std::vector<char>& bytes)
+{
+    // In COPY text format the backslash of the hex escape is itself escaped.
+    absl::StrAppend(&line, "\\\\x", absl::BytesToHexString(absl::string_view(bytes.data(), bytes.size())));
+}
+
+} // anonymous namespace
+
+AuditLog::~AuditLog()
+{
+    Close();
+}
+
+bool AuditLog::Open(const std::string& path, const std::string& conninfo)
+{
+    if (m_open) {
+        return false;
+    }
+    m_fd = open(path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0600);
+    if (m_fd < 0) {
+        LogError() << "Unable to open audit log " << path << ": " << strerror(errno);
+        return false;
+    }
+    m_path = path;
+    m_conninfo = conninfo;
+    m_stop = false;
+    m_stop_load = false;
+    m_open = true;
+    m_sync_thread = std::thread(&AuditLog::SyncLoop, this);
+    m_load_thread = std::thread(&AuditLog::LoadLoop, this);
+    return true;
+}
+
+void AuditLog::Close()
+{
+    if (!m_open) {
+        return;
+    }
+    // Sync whatever has been appended, and then load it.
+    {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    m_sync_thread.join();
+    {
+        const std::lock_guard<std::mutex> lock(m_load_mutex);
+        m_stop_load = true;
+    }
+    m_load_cv.notify_all();
+    m_load_thread.join();
+    if (m_conn) {
+        PQfinish(m_conn);
+        m_conn = nullptr;
+    }
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+    m_fd = -1;
+    m_open = false;
+}
+
+void AuditLog::Append(const Record& record, std::function<void (bool)> done)
+{
+    {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        m_pending.push_back({Format(record), std::move(done)});
+    }
+    m_cv.notify_one();
+}
+
+std::string AuditLog::Format(const Record& record)
+{
+    std::string line;
+    line.reserve(64 + 2 * (record.input_hashes.size() + record.output_hashes.size()) + record.input_amounts.size() + record.output_amounts.size());
+    absl::StrAppend(&line, absl::ToUnixNanos(record.received), "\t", static_cast<int>(record.kind), "\t");
+    AppendBytea(line, record.input_hashes);
+    absl::StrAppend(&line, "\t", record.input_amounts.empty() ? "{}" : record.input_amounts, "\t");
+    AppendBytea(line, record.output_hashes);
+    absl::StrAppend(&line, "\t", record.output_amounts.empty() ? "{}" : record.output_amounts, "\n");
+    return line;
+}
+
+std::string AuditLog::PartitionName(absl::CivilMonth month)
+{
+    return absl::StrFormat("AuditLog_%04d_%02d", month.year(), month.month());
+}
+
+std::string AuditLog::CreatePartitionSql(absl::CivilMonth month)
+{
+    const absl::TimeZone utc = absl::UTCTimeZone();
+    return absl::StrCat(
+        "CREATE TABLE IF NOT EXISTS \"", PartitionName(month), "\" PARTITION OF \"AuditLog\" FOR VALUES FROM (",
+        absl::ToUnixNanos(absl::FromCivil(month, utc)), ") TO (",
+        absl::ToUnixNanos(absl::FromCivil(month + 1, utc)), ")");
+}
+
+void AuditLog::SyncLoop()
+{
+    while (true) {
+        std::deque<Pending> batch;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this] { return m_stop || !m_pending.empty(); });
+            if (m_pending.empty()) {
+                return;
+            }
+            batch.swap(m_pending);
+        }
+
+        // Everything that was appended while the last batch was being synced
+        // is written, and synced, together.
+        std::string data;
+        for (const Pending& pending : batch) {
+            data += pending.line;
+        }
+        bool ok;
+        {
+            const std::lock_guard<std::mutex> lock(m_file_mutex);
+            if (m_fd < 0) {
+                m_fd = open(m_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0600);
+            }
+            ok = m_fd >= 0 && WriteAll(m_fd, data) && SyncData(m_fd);
+        }
+        if (!ok) {
+            LogError() << "Unable to write to audit log " << m_path << ": " << strerror(errno);
+        }
+        for (const Pending& pending : batch) {
+            pending.done(ok);
+        }
+    }
+}
+
+void AuditLog::LoadLoop()
+{
+    while (true) {
+        bool stopping;
+        {
+            std::unique_lock<std::mutex> lock(m_load_mutex);
+            m_load_cv.wait_for(lock, absl::ToChronoSeconds(k_load_interval), [this] { return m_stop_load; });
+            stopping = m_stop_load;
+        }
+        // A previous rotation which failed to load is retried before the log
+        // is rotated again, so that records are loaded in order.
+        if (LoadRotated()) {
+            bool rotated;
+            {
+                const std::lock_guard<std::mutex> lock(m_file_mutex);
+                rotated = Rotate();
+            }
+            if (rotated) {
+                LoadRotated();
+            }
+        }
+        if (stopping) {
+            return;
+        }
+    }
+}
+
+bool AuditLog::Rotate()
+{
+    struct stat st;
+    if (m_fd < 0 || fstat(m_fd, &st) != 0 || st.st_size == 0) {
+        return false;
+    }
+    const std::string loading = m_path + ".loading";
+    if (rename(m_path.c_str(), loading.c_str()) != 0) {
+        LogError() << "Unable to rotate audit log " << m_path << ": " << strerror(errno);
+        return false;
+    }
+    int fd = open(m_path.c_str(), O_WRONLY | O_APPEND | O_CREAT, 0600);
+    if (fd < 0) {
+        LogError() << "Unable to open audit log " << m_path << ": " << strerror(errno);
+        // Carry on with the old file, and try again next time.
+        if (rename(loading.c_str(), m_path.c_str()) == 0) {
+            return false;
+        }
+        // Or else it is reopened before the next write.
+        LogError() << "Unable to restore audit log " << m_path << ": " << strerror(errno);
+    }
+    close(m_fd);
+    m_fd = fd;
+    return true;
+}
+
+bool AuditLog::LoadRotated()
+{
+    const std::string loading = m_path + ".loading";
+    std::ifstream file(loading, std::ios::binary);
+    if (!file) {
+        // Nothing waiting to be loaded.
+        return true;
+    }
+    std::stringstream ss;
+    ss << file.rdbuf();
+    std::string data = ss.str();
+    // A line which was only partially written before a crash was never
+    // reported as synced, so its request failed and it is dropped.
+    data.resize(data.rfind('\n') == std::string::npos ? 0 : data.rfind('\n') + 1);
+    if (!data.empty() && !Copy(data)) {
+        return false;
+    }
+    if (unlink(loading.c_str()) != 0) {
+        LogError() << "Unable to remove loaded audit log " << loading << ": " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+bool AuditLog::Copy(const std::string& data)
+{
+    if (m_conn && PQstatus(m_conn) != CONNECTION_OK) {
+        PQfinish(m_conn);
+        m_conn = nullptr;
+    }
+    if (!m_conn) {
+        m_conn = PQconnectdb(m_conninfo.c_str());
+        if (PQstatus(m_conn) != CONNECTION_OK) {
+            LogError() << "Unable to connect to database to load audit log: " << PQerrorMessage(m_conn);
+            PQfinish(m_conn);
+            m_conn = nullptr;
+            return false;
+        }
+    }
+
+    // Records are routed to the partition for the month they were received
+    // in, which has to exist beforehand.
+    std::set<absl::CivilMonth> months;
+    for (size_t pos = 0; pos < data.size(); pos = data.find('\n', pos) + 1) {
+        int64_t received;
+        if (!absl::SimpleAtoi(absl::string_view(data).substr(pos, data.find('\t', pos) - pos), &received)) {
+            LogError() << "Malformed record in audit log " << m_path << ".loading";
+            return false;
+        }
+        months.insert(absl::ToCivilMonth(absl::FromUnixNanos(received), absl::UTCTimeZone()));
+    }
+    for (absl::CivilMonth month : months) {
+        const std::string sql = CreatePartitionSql(month);
+        PGresult* res = PQexec(m_conn, sql.c_str());
+        const bool ok = PQresultStatus(res) == PGRES_COMMAND_OK;
+        if (!ok) {
+            LogError() << PQerrorMessage(m_conn);
+            LogError() << "Offending SQL: " << sql;
+        }
+        PQclear(res);
+        if (!ok) {
+            return false;
+        }
+    }
+
+    static const std::string sql = "COPY \"AuditLog\" (\"received\", \"kind\", \"input_hashes\", \"input_amounts\", \"output_hashes\", \"output_amounts\") FROM STDIN";
+    PGresult* res = PQexec(m_conn, sql.c_str());
+    const bool copying = PQresultStatus(res) == PGRES_COPY_IN;
+    PQclear(res);
+    if (!copying || PQputCopyData(m_conn, data.data(), static_cast<int>(data.size())) != 1 || PQputCopyEnd(m_conn, nullptr) != 1) {
+        LogError() << PQerrorMessage(m_conn);
+        LogError() << "Offending SQL: " << sql;
+        // Drain the results, so that the connection can be reused.
+        while ((res = PQgetResult(m_conn))) {
+            PQclear(res);
+        }
+        return false;
+    }
+    bool ok = true;
+    while ((res = PQgetResult(m_conn))) {
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            LogError() << PQerrorMessage(m_conn);
+            LogError() << "Offending SQL: " << sql;
+            ok = false;
+        }
+        PQclear(res);
+    }
+    return ok;
+}
+
+namespace webcash {
+    AuditLog& audit()
+    {
+        static AuditLog log;
+        return log;
+    }
+} // webcash
+
+// End of File
@@ -0,0 +1,150 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef AUDITLOG_H
+#define AUDITLOG_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "absl/time/civil_time.h"
+#include "absl/time/time.h"
+
+// From libpq-fe.h
+struct pg_conn;
+
+/**
+ * A durable local log of replacements and burns, which a background thread
+ * bulk-loads into the time-partitioned "AuditLog" table with COPY.  Used with
+ * --audit_log in place of writing the Replacements, Burns and per-hash audit
+ * tables within each request's transaction.
+ *
+ * Records are appended to the file at path, and are synced to disk in groups,
+ * so that concurrent appends share an fdatasync.  The loader periodically
+ * renames the file to path.loading, starts a new one, and loads the renamed
+ * file into the database, deleting it once the COPY has succeeded.  A log
+ * left over from a previous run is loaded the same way.  Records are loaded
+ * at least once: a crash between the COPY and the deletion loads the file
+ * again on restart.
+ *
+ * Records are appended once the replacement or burn they describe has
+ * committed, so the log never holds one which was rolled back.  A crash,
+ * or a failure to write, between the commit and the sync loses the record,
+ * which is logged but can't fail the request.
+ */
+class AuditLog {
+public:
+    enum class Kind : int {
+        REPLACE = 1,
+        BURN = 2,
+    };
+
+    struct Record {
+        absl::Time received;
+        Kind kind;
+        // Concatenated 32-byte hashes, and the matching amounts as a Postgres
+        // BIGINT[] literal, as bound to the replacement statements.
+        std::vector<char> input_hashes;
+        std::string input_amounts;
+        std::vector<char> output_hashes;
+        std::string output_amounts;
+    };
+
+    /** How often the log is rotated and loaded into the database. */
+    const absl::Duration k_load_interval = absl::Seconds(1);
+
+    AuditLog() = default;
+    ~AuditLog();
+    // Non-copyable:
+    AuditLog(const AuditLog&) = delete;
+    AuditLog& operator=(const AuditLog&) = delete;
+
+    /** Opens (or creates) the log at path and starts the background threads,
+     *  which load it into the database at conninfo (a libpq connection
+     *  string).  Returns false if the log can't be opened. */
+    bool Open(const std::string& path, const std::string& conninfo);
+
+    /** Syncs and loads whatever has been appended, then stops the background
+     *  threads. */
+    void Close();
+
+    bool IsOpen() const { return m_open.load(); }
+
+    /** Appends a record, calling done with whether it was written, once it
+     *  has been synced to disk.  done is called from the sync thread. */
+    void Append(const Record& record, std::function<void (bool)> done);
+
+    /** The record as a line of COPY text format. */
+    static std::string Format(const Record& record);
+
+    /** The partitions are named after, and hold the records received in, a
+     *  calendar month (UTC). */
+    static std::string PartitionName(absl::CivilMonth month);
+    static std::string CreatePartitionSql(absl::CivilMonth month);
+
+private:
+    struct Pending {
+        std::string line;
+        std::function<void (bool)> done;
+    };
+
+    void SyncLoop();
+    void LoadLoop();
+    /** Renames the log to path.loading and starts a new one, unless a
+     *  previous rotation hasn't been loaded yet.  If the new one can't be
+     *  opened the rename is undone.  Requires m_file_mutex. */
+    bool Rotate();
+    /** Loads path.loading, if it exists, and deletes it if successful. */
+    bool LoadRotated();
+    /** COPYs the lines of data, creating any partitions they need. */
+    bool Copy(const std::string& data);
+
+    std::string m_path;
+    std::string m_conninfo;
+    std::atomic<bool> m_open{false};
+    std::atomic<bool> m_stop{false};
+    std::thread m_sync_thread;
+    std::thread m_load_thread;
+
+    /** Guards m_pending, and wakes up the sync thread. */
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<Pending> m_pending;
+
+    /** Guards m_fd, which is written by the sync thread and replaced when the
+     *  log is rotated.  -1 if the log couldn't be reopened, in which case the
+     *  sync thread tries again before each write. */
+    std::mutex m_file_mutex;
+    int m_fd = -1;
+
+    /** Guards m_stop_load, and wakes up the load thread early, once the sync
+     *  thread has stopped. */
+    std::mutex m_load_mutex;
+    std::condition_variable m_load_cv;
+    bool m_stop_load = false;
+
+    /** The load thread's connection to the database. */
+    pg_conn* m_conn = nullptr;
+};
+
+namespace webcash {
+    /** The audit log of the running server, if --audit_log is set. */
+    AuditLog& audit();
+} // webcash
+
+#endif // AUDITLOG_H
+
+// End of File
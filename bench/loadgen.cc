@@ -0,0 +1,400 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <iomanip>
+#include <iostream>
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <deque>
+#include <functional>
+#include <future>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+#include "absl/strings/escaping.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
+#include "absl/strings/string_view.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+#include <drogon/HttpAppFramework.h>
+
+#include <httplib.h>
+
+#include "async.h"
+#include "crypto/sha256.h"
+#include "random.h"
+#include "server.h"
+#include "webcash.h"
+
+ABSL_FLAG(std::string, server, "", "URL of a running webcashd to put under load (e.g. \"http://localhost:8000\"), or empty to start an in-process server on 127.0.0.1:8000, which resets the local database");
+ABSL_FLAG(std::string, seed, "", "with --server, a secret webcash claim code from which the clients' outputs are funded");
+ABSL_FLAG(unsigned, clients, 16, "number of concurrent keep-alive clients");
+ABSL_FLAG(unsigned, duration, 30, "number of seconds to apply load for");
+ABSL_FLAG(unsigned, utxos, 4, "number of unspent outputs seeded for each client, at least 2");
+ABSL_FLAG(std::string, mix, "replace=60,health_check=20,target=10,stats=5,mining_report=5", "relative weights of the requests made, by endpoint");
+ABSL_FLAG(unsigned, threads, 0, "number of worker threads of the in-process server, or 0 for one per core");
+ABSL_FLAG(unsigned, dbconnections, 0, "number of database connections of the in-process server, or 0 for one per worker thread");
+ABSL_FLAG(bool, single_statement_replace, false, "have the in-process server make each replacement with a single call to a stored procedure");
+ABSL_FLAG(std::string, redis, "", "address (ip:port) of a Redis server for the in-process server to keep the set of spent hashes in");
+
+namespace {
+
+enum Endpoint {
+    REPLACE,
+    MINING_REPORT,
+    HEALTH_CHECK,
+    TARGET,
+    STATS,
+    NUM_ENDPOINTS,
+};
+
+const std::array<const char*, NUM_ENDPOINTS> ENDPOINT_NAMES = {
+    "replace",
+    "mining_report",
+    "health_check",
+    "target",
+    "stats",
+};
+
+const std::array<const char*, NUM_ENDPOINTS> ENDPOINT_PATHS = {
+    "/api/v1/replace",
+    "/api/v1/mining_report",
+    "/api/v1/health_check",
+    "/api/v1/target",
+    "/stats",
+};
+
+// A mining report which is valid at the initial difficulty, and which pays
+// SEED_SECRET.  An in-process server accepts it once, to fund the clients;
+// after that it is rejected as a duplicate, but only after the server has
+// validated it and consulted the database, which is the load measured.
+const std::string MINING_REPORT_PREIMAGE = absl::Base64Escape("{\"legalese\": {\"terms\": true}, \"webcash\": [\"e190000:secret:b0e7525b420bc6efa5c356d0bb707d96a9d599c5c218134bd0f1dc5cf107e213\", \"e10000:secret:301b4fe3587ac6a871c6c7d4e06595d4eab9572a0515fe7295067d4e52772ed2\"], \"subsidy\": [\"e10000:secret:301b4fe3587ac6a871c6c7d4e06595d4eab9572a0515fe7295067d4e52772ed2\"], \"difficulty\": 28, \"nonce\":      1366624}");
+const std::string SEED_SECRET = "e190000:secret:b0e7525b420bc6efa5c356d0bb707d96a9d599c5c218134bd0f1dc5cf107e213";
+
+const std::string LEGALESE = "\"legalese\": {\"terms\": true}";
+
+std::string to_std_string(const SecretWebcash& wc)
+{
+    const SecureString str = to_string(wc);
+    return std::string(str.begin(), str.end());
+}
+
+SecretWebcash new_secret(Amount amount)
+{
+    return SecretWebcash(absl::BytesToHexString(absl::string_view((char*)GetRandHash().begin(), 32)), amount);
+}
+
+std::string replace_request(const std::vector<SecretWebcash>& inputs, const std::vector<SecretWebcash>& outputs)
+{
+    std::vector<std::string> in, out;
+    for (const SecretWebcash& wc : inputs) {
+        in.push_back(to_std_string(wc));
+    }
+    for (const SecretWebcash& wc : outputs) {
+        out.push_back(to_std_string(wc));
+    }
+    return absl::StrCat("{", LEGALESE, ","
+        "\"webcashes\": [\"", absl::StrJoin(in, "\",\""), "\"],"
+        "\"new_webcashes\": [\"", absl::StrJoin(out, "\",\""), "\"]"
+    "}");
+}
+
+std::unique_ptr<httplib::Client> make_client(const std::string& url)
+{
+    auto cli = std::make_unique<httplib::Client>(url);
+    cli->set_keep_alive(true);
+    cli->set_read_timeout(60, 0); // 60 seconds
+    cli->set_write_timeout(60, 0); // 60 seconds
+    return cli;
+}
+
+bool parse_mix(const std::string& mix, std::array<double, NUM_ENDPOINTS>& weights)
+{
+    weights.fill(0.0);
+    for (absl::string_view item : absl::StrSplit(mix, ',', absl::SkipEmpty())) {
+        std::vector<absl::string_view> parts = absl::StrSplit(item, '=');
+        double weight;
+        if (parts.size() != 2 || !absl::SimpleAtod(parts[1], &weight) || weight < 0.0) {
+            return false;
+        }
+        auto itr = std::find(ENDPOINT_NAMES.begin(), ENDPOINT_NAMES.end(), parts[0]);
+        if (itr == ENDPOINT_NAMES.end()) {
+            return false;
+        }
+        weights[itr - ENDPOINT_NAMES.begin()] = weight;
+    }
+    return std::any_of(weights.begin(), weights.end(), [](double w) { return w > 0.0; });
+}
+
+std::thread g_event_loop_thread;
+
+/** Start a server in this process, as bench/server.cc does, with an empty
+ *  database. */
+void start_server()
+{
+    std::promise<void> running;
+    std::future<void> started = running.get_future();
+    g_event_loop_thread = std::thread([&]() {
+        // Disable logging
+        webcash::state().logging = false;
+        webcash::state().single_statement_replace = absl::GetFlag(FLAGS_single_statement_replace);
+        const unsigned threads = absl::GetFlag(FLAGS_threads) ? absl::GetFlag(FLAGS_threads) : get_num_workers();
+        const unsigned connections = absl::GetFlag(FLAGS_dbconnections) ? absl::GetFlag(FLAGS_dbconnections) : threads;
+        if (!absl::GetFlag(FLAGS_redis).empty()) {
+            webcash::state().redis = webcash::connectRedis(absl::GetFlag(FLAGS_redis), connections);
+        }
+        drogon::app().createDbClient(
+            "postgresql", // dbType
+            "localhost", // host
+            5432,        // port
+            "postgres",  // databaseName
+            "postgres",  // username
+            "mysecretpassword", // password
+            connections, // connectionNum
+            "webcashd_loadgen", // filename
+            "default",   // name
+            false,       // isFast
+            "utf8",      // characterSet
+            10.0         // timeout
+        );
+        webcash::upgradeDb();
+        drogon::app().setThreadNum(threads);
+        drogon::app().addListener("127.0.0.1", 8000);
+        drogon::app().getLoop()->queueInLoop([&running]() {
+            running.set_value();
+        });
+        drogon::app().run();
+    });
+    started.get();
+    webcash::resetDb();
+}
+
+void stop_server()
+{
+    drogon::app().getLoop()->queueInLoop([]() {
+        drogon::app().quit();
+    });
+    g_event_loop_thread.join();
+}
+
+/** Split the seed into utxos outputs for each of the clients.  Whatever
+ *  doesn't divide evenly goes to an extra output that is not used. */
+bool seed_utxos(httplib::Client& cli, const SecretWebcash& seed, unsigned clients, unsigned utxos, std::vector<std::deque<SecretWebcash>>& wallets)
+{
+    const int64_t n = (int64_t)clients * utxos;
+    const Amount each(seed.amount.i64 / n);
+    if (each.i64 < 1) {
+        std::cerr << "Error: seed webcash is too small to split into " << n << " outputs" << std::endl;
+        return false;
+    }
+    std::vector<SecretWebcash> outputs;
+    wallets.assign(clients, {});
+    for (unsigned i = 0; i < clients; ++i) {
+        for (unsigned j = 0; j < utxos; ++j) {
+            wallets[i].push_back(new_secret(each));
+            outputs.push_back(wallets[i].back());
+        }
+    }
+    const Amount change = seed.amount - Amount(each.i64 * n);
+    if (change.i64 > 0) {
+        outputs.push_back(new_secret(change));
+    }
+    auto r = cli.Post("/api/v1/replace", replace_request({seed}, outputs), "application/json");
+    if (!r || r->status != 200) {
+        std::cerr << "Error: unable to seed the clients' outputs: " << (r ? r->body : httplib::to_string(r.error())) << std::endl;
+        return false;
+    }
+    return true;
+}
+
+struct ClientResult {
+    std::array<std::vector<int64_t>, NUM_ENDPOINTS> latency_us;
+    std::array<int64_t, NUM_ENDPOINTS> errors{};
+};
+
+void run_client(const std::string& url, std::deque<SecretWebcash>& utxos, const std::array<double, NUM_ENDPOINTS>& weights, const std::atomic<bool>& stop, ClientResult& result)
+{
+    auto cli = make_client(url);
+    std::mt19937_64 rng(GetRandHash().GetUint64(0));
+    std::discrete_distribution<int> choose(weights.begin(), weights.end());
+    const std::string mining_report = absl::StrCat("{\"preimage\": \"", MINING_REPORT_PREIMAGE, "\",", LEGALESE, "}");
+
+    while (!stop) {
+        const int endpoint = choose(rng);
+        // Build the request before starting the clock.
+        std::string body;
+        std::vector<SecretWebcash> outputs;
+        switch (endpoint) {
+        case REPLACE: {
+            // Swap the two oldest outputs for fresh ones of the same value.
+            std::vector<SecretWebcash> inputs(utxos.begin(), utxos.begin() + 2);
+            for (const SecretWebcash& wc : inputs) {
+                outputs.push_back(new_secret(wc.amount));
+            }
+            body = replace_request(inputs, outputs);
+            break;
+        }
+        case MINING_REPORT:
+            body = mining_report;
+            break;
+        case HEALTH_CHECK: {
+            std::vector<std::string> pks;
+            for (const SecretWebcash& wc : utxos) {
+                pks.push_back(to_string(PublicWebcash(wc)));
+            }
+            body = absl::StrCat("[\"", absl::StrJoin(pks, "\",\""), "\"]");
+            break;
+        }
+        }
+
+        const absl::Time begin = absl::Now();
+        auto r = body.empty()
+            ? cli->Get(ENDPOINT_PATHS[endpoint])
+            : cli->Post(ENDPOINT_PATHS[endpoint], body, "application/json");
+        const absl::Time end = absl::Now();
+        result.latency_us[endpoint].push_back(absl::ToInt64Microseconds(end - begin));
+
+        if (!r || r->status != 200) {
+            ++result.errors[endpoint];
+            continue;
+        }
+        if (endpoint == REPLACE) {
+            utxos.erase(utxos.begin(), utxos.begin() + 2);
+            utxos.insert(utxos.end(), outputs.begin(), outputs.end());
+        }
+    }
+}
+
+int64_t percentile(const std::vector<int64_t>& sorted, double p)
+{
+    if (sorted.empty()) {
+        return 0;
+    }
+    size_t i = (size_t)std::ceil(p * sorted.size());
+    return sorted[std::min(std::max(i, (size_t)1), sorted.size()) - 1];
+}
+
+void report(const std::vector<ClientResult>& results, absl::Duration elapsed)
+{
+    const double seconds = absl::ToDoubleSeconds(elapsed);
+    std::cout << std::left << std::setw(16) << "endpoint" << std::right
+              << std::setw(10) << "requests" << std::setw(10) << "errors" << std::setw(12) << "req/s"
+              << std::setw(12) << "p50 ms" << std::setw(12) << "p99 ms" << std::setw(12) << "p999 ms" << std::endl;
+    int64_t total = 0;
+    for (int e = 0; e < NUM_ENDPOINTS; ++e) {
+        std::vector<int64_t> latency;
+        int64_t errors = 0;
+        for (const ClientResult& result : results) {
+            latency.insert(latency.end(), result.latency_us[e].begin(), result.latency_us[e].end());
+            errors += result.errors[e];
+        }
+        if (latency.empty()) {
+            continue;
+        }
+        std::sort(latency.begin(), latency.end());
+        total += latency.size();
+        std::cout << std::left << std::setw(16) << ENDPOINT_NAMES[e] << std::right << std::fixed
+                  << std::setw(10) << latency.size() << std::setw(10) << errors
+                  << std::setw(12) << std::setprecision(1) << (latency.size() / seconds)
+                  << std::setprecision(3)
+                  << std::setw(12) << (percentile(latency, 0.50) / 1e3)
+                  << std::setw(12) << (percentile(latency, 0.99) / 1e3)
+                  << std::setw(12) << (percentile(latency, 0.999) / 1e3) << std::endl;
+    }
+    std::cout << std::left << std::setw(16) << "total" << std::right
+              << std::setw(10) << total << std::setw(10) << ""
+              << std::setw(12) << std::setprecision(1) << (total / seconds) << std::endl;
+}
+
+} // namespace
+
+int main(int argc, char **argv)
+{
+    absl::SetProgramUsageMessage(absl::StrCat("Load generator for webcashd.  Replays a mix of API requests from many concurrent clients and reports the throughput and latency percentiles of each endpoint.  Replayed mining reports are rejected as duplicates, and count as errors.\n", argv[0]));
+    absl::ParseCommandLine(argc, argv);
+
+    const unsigned clients = absl::GetFlag(FLAGS_clients);
+    const unsigned utxos = absl::GetFlag(FLAGS_utxos);
+    if (clients < 1 || utxos < 2) {
+        std::cerr << "Error: need at least one client and two outputs per client" << std::endl;
+        return 1;
+    }
+    std::array<double, NUM_ENDPOINTS> weights;
+    if (!parse_mix(absl::GetFlag(FLAGS_mix), weights)) {
+        std::cerr << "Error: can't parse --mix=" << absl::GetFlag(FLAGS_mix) << "; expected e.g. \"replace=60,health_check=20,target=10,stats=5,mining_report=5\"" << std::endl;
+        return 1;
+    }
+
+    SHA256AutoDetect();
+
+    std::string url = absl::GetFlag(FLAGS_server);
+    SecretWebcash seed;
+    const bool in_process = url.empty();
+    if (in_process) {
+        url = "http://127.0.0.1:8000";
+        start_server();
+        // Mine the seed, so the database starts with just the clients'
+        // outputs.
+        auto cli = make_client(url);
+        auto r = cli->Post("/api/v1/mining_report", absl::StrCat("{\"preimage\": \"", MINING_REPORT_PREIMAGE, "\",", LEGALESE, "}"), "application/json");
+        if (!r || r->status != 200) {
+            std::cerr << "Error: in-process server rejected the seed mining report" << std::endl;
+            stop_server();
+            return 1;
+        }
+        seed.parse(SEED_SECRET);
+    } else if (!seed.parse(absl::GetFlag(FLAGS_seed))) {
+        std::cerr << "Error: --server requires a valid --seed secret webcash" << std::endl;
+        return 1;
+    }
+
+    std::vector<std::deque<SecretWebcash>> wallets;
+    {
+        auto cli = make_client(url);
+        if (!seed_utxos(*cli, seed, clients, utxos, wallets)) {
+            if (in_process) {
+                stop_server();
+            }
+            return 1;
+        }
+    }
+
+    std::cout << "Running " << clients << " clients against " << url << " for " << absl::GetFlag(FLAGS_duration) << " seconds..." << std::endl;
+    std::atomic<bool> stop{false};
+    std::vector<ClientResult> results(clients);
+    std::vector<std::thread> threads;
+    const absl::Time begin = absl::Now();
+    for (unsigned i = 0; i < clients; ++i) {
+        threads.emplace_back(run_client, url, std::ref(wallets[i]), std::cref(weights), std::cref(stop), std::ref(results[i]));
+    }
+    absl::SleepFor(absl::Seconds(absl::GetFlag(FLAGS_duration)));
+    stop = true;
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    const absl::Time end = absl::Now();
+
+    report(results, end - begin);
+
+    if (in_process) {
+        stop_server();
+    }
+    return 0;
+}
+
+// End of File
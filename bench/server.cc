@@ -6,6 +6,7 @@
 
 #include <benchmark/benchmark.h>
 
+#include <cstdlib>
 #include <future>
 #include <thread>
 #include <vector>
@@ -24,6 +25,7 @@
 #include "crypto/sha256.h"
 #include "random.h"
 #include "server.h"
+#include "sqlitestorage.h"
 #include "webcash.h"
 
 using Json::ValueType::objectValue;
@@ -46,22 +48,32 @@ static void SetupServer(const benchmark::State& state) {
     g_event_loop_thread = std::thread([&]() {
         // Disable logging
         webcash::state().logging = false;
-        // Create the database connection
         int num_workers = get_num_workers();
-        drogon::app().createDbClient(
-            "postgresql", // dbType
-            "localhost", // host
-            5432,        // port
-            "postgres",  // databaseName
-            "postgres",  // username
-            "mysecretpassword", // password
-            num_workers, // connectionNum
-            "bench_webcash", // filename
-            "default",   // name
-            false,       // isFast
-            "utf8",      // characterSet
-            10.0         // timeout
-        );
+        // Keep the server's state in an embedded SQLite database, so that no
+        // database server is needed, unless WEBCASHD_POSTGRES is set.
+        if (!std::getenv("WEBCASHD_POSTGRES")) {
+            auto storage = std::make_shared<SqliteStorage>();
+            if (!storage->Open("bench_webcash.db")) {
+                std::abort();
+            }
+            webcash::state().storage = storage;
+        } else {
+            // Create the database connection
+            drogon::app().createDbClient(
+                "postgresql", // dbType
+                "localhost", // host
+                5432,        // port
+                "postgres",  // databaseName
+                "postgres",  // username
+                "mysecretpassword", // password
+                num_workers, // connectionNum
+                "bench_webcash", // filename
+                "default",   // name
+                false,       // isFast
+                "utf8",      // characterSet
+                10.0         // timeout
+            );
+        }
         // Setup the database
         webcash::upgradeDb();
         // Configure the number of worker threads
@@ -0,0 +1,179 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <benchmark/benchmark.h>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "crypto/sha256.h"
+
+using namespace sha256_implementation;
+
+// The implementations each benchmark is run with, as the first argument.
+// SHA256AutoDetect() falls back to the best permitted one that the CPU
+// supports, which is reported as the benchmark's label.
+static const int64_t IMPLEMENTATIONS[] = {STANDARD, USE_SSE4, USE_SSE4_AND_AVX2, USE_SSE4_AND_SHANI, USE_ALL};
+
+static void UseImplementations(benchmark::internal::Benchmark* b, const std::vector<int64_t>& sizes) {
+    for (int64_t impl : IMPLEMENTATIONS) {
+        for (int64_t size : sizes) {
+            b->Args({impl, size});
+        }
+    }
+}
+
+static void SelectImplementation(benchmark::State& state) {
+    state.SetLabel(SHA256AutoDetect((UseImplementation)state.range(0)));
+}
+
+static void SetHashRate(benchmark::State& state, int64_t hashes_per_iteration) {
+    state.counters["hashes/s"] = benchmark::Counter((double)hashes_per_iteration * state.iterations(), benchmark::Counter::kIsRate);
+}
+
+// A midstate over 64 bytes of preimage prefix, as the miner uses.
+static CSHA256 GetPrefix() {
+    unsigned char prefix[64];
+    for (int i = 0; i < 64; ++i) {
+        prefix[i] = 'A' + (i % 26);
+    }
+    CSHA256 midstate;
+    midstate.Write(prefix, sizeof(prefix));
+    return midstate;
+}
+
+// 1000 4-byte nonces, standing in for the base64 of "000" to "999".
+static std::vector<unsigned char> GetNonces() {
+    std::vector<unsigned char> nonces(4 * 1000);
+    for (size_t i = 0; i < nonces.size(); ++i) {
+        nonces[i] = 'a' + (i % 26);
+    }
+    return nonces;
+}
+
+static const unsigned char FINAL[] = "fQ==";
+
+static void SHA256_Midstate(benchmark::State& state) {
+    SelectImplementation(state);
+    const size_t blocks = state.range(1);
+    std::vector<unsigned char> in(64 * blocks, 0x5a);
+    std::vector<unsigned char> out(32 * blocks);
+    uint32_t midstate[8] = {0x6a09e667ul, 0xbb67ae85ul, 0x3c6ef372ul, 0xa54ff53aul, 0x510e527ful, 0x9b05688cul, 0x1f83d9abul, 0x5be0cd19ul};
+    for (auto _ : state) {
+        SHA256Midstate(out.data(), midstate, in.data(), blocks);
+        benchmark::DoNotOptimize(out.data());
+    }
+    SetHashRate(state, blocks);
+}
+BENCHMARK(SHA256_Midstate)->ArgNames({"impl", "blocks"})->Apply([](benchmark::internal::Benchmark* b) { UseImplementations(b, {1, 2, 4, 8, 16}); });
+
+static void SHA256_D64(benchmark::State& state) {
+    SelectImplementation(state);
+    const size_t blocks = state.range(1);
+    std::vector<unsigned char> in(64 * blocks, 0x5a);
+    std::vector<unsigned char> out(32 * blocks);
+    for (auto _ : state) {
+        SHA256D64(out.data(), in.data(), blocks);
+        benchmark::DoNotOptimize(out.data());
+    }
+    SetHashRate(state, blocks);
+}
+BENCHMARK(SHA256_D64)->ArgNames({"impl", "blocks"})->Apply([](benchmark::internal::Benchmark* b) { UseImplementations(b, {1, 4, 8, 16}); });
+
+static void SHA256_WriteAndFinalize8(benchmark::State& state) {
+    SelectImplementation(state);
+    const CSHA256 midstate = GetPrefix();
+    const std::vector<unsigned char> nonces = GetNonces();
+    unsigned char hashes[CSHA256::OUTPUT_SIZE * 8];
+    for (auto _ : state) {
+        CSHA256(midstate).WriteAndFinalize8(nonces.data(), nonces.data() + 4, FINAL, hashes);
+        benchmark::DoNotOptimize(hashes);
+    }
+    SetHashRate(state, 8);
+}
+BENCHMARK(SHA256_WriteAndFinalize8)->ArgNames({"impl", "lanes"})->Apply([](benchmark::internal::Benchmark* b) { UseImplementations(b, {8}); });
+
+static void SHA256_WriteAndFinalize16(benchmark::State& state) {
+    SelectImplementation(state);
+    const CSHA256 midstate = GetPrefix();
+    const std::vector<unsigned char> nonces = GetNonces();
+    unsigned char hashes[CSHA256::OUTPUT_SIZE * 16];
+    for (auto _ : state) {
+        CSHA256(midstate).WriteAndFinalize16(nonces.data(), nonces.data() + 4, FINAL, hashes);
+        benchmark::DoNotOptimize(hashes);
+    }
+    SetHashRate(state, 16);
+}
+BENCHMARK(SHA256_WriteAndFinalize16)->ArgNames({"impl", "lanes"})->Apply([](benchmark::internal::Benchmark* b) { UseImplementations(b, {16}); });
+
+// Each of the mining kernels on its own, with every implementation enabled
+// so that all the kernels the CPU supports are available.
+static void SHA256_MiningKernel(benchmark::State& state) {
+    SHA256AutoDetect();
+    const std::vector<SHA256MiningKernel>& kernels = SHA256MiningKernels();
+    if ((size_t)state.range(0) >= kernels.size()) {
+        state.SkipWithError("kernel not supported by this CPU");
+        for (auto _ : state) {
+        }
+        return;
+    }
+    const SHA256MiningKernel& kernel = kernels[state.range(0)];
+    state.SetLabel(kernel.name);
+    const CSHA256 midstate = GetPrefix();
+    const std::vector<unsigned char> nonces = GetNonces();
+    SHA256NoncePrecomp pre;
+    midstate.PrecomputeNonce1(nonces.data(), FINAL, pre);
+    std::vector<uint32_t> words(kernel.lanes);
+    for (auto _ : state) {
+        kernel.transform(words.data(), pre, nonces.data());
+        benchmark::DoNotOptimize(words.data());
+    }
+    SetHashRate(state, kernel.lanes);
+}
+BENCHMARK(SHA256_MiningKernel)->ArgName("kernel")->DenseRange(0, 3);
+
+// One pass of the miner's inner loop: a first nonce, then all 1000 second
+// nonces in batches, filtering on the first word and checking the full hash
+// of the candidates against the difficulty.
+static void SHA256_MiningBatch(benchmark::State& state) {
+    SHA256AutoDetect();
+    const SHA256MiningKernel& kernel = SHA256MiningKernels().front();
+    const size_t batch = state.range(0);
+    const unsigned difficulty = 24;
+    state.SetLabel(kernel.name);
+    const CSHA256 midstate = GetPrefix();
+    const std::vector<unsigned char> nonces = GetNonces();
+    std::vector<uint32_t> words(batch);
+    SHA256NoncePrecomp pre;
+    int i = 0;
+    int64_t solutions = 0;
+    for (auto _ : state) {
+        midstate.PrecomputeNonce1(nonces.data() + 4*i, FINAL, pre);
+        for (size_t j = 0; j < 1000; j += batch) {
+            const size_t n = std::min(batch, 1000 - j);
+            SHA256Nonce2FirstWord(kernel, words.data(), pre, nonces.data() + 4*j, n);
+            for (size_t k = 0; k < n; ++k) {
+                if (words[k] >> 16) {
+                    continue;
+                }
+                unsigned char hash[CSHA256::OUTPUT_SIZE];
+                CSHA256(midstate).Write(nonces.data() + 4*i, 4).Write(nonces.data() + 4*(j+k), 4).Write(FINAL, 4).Finalize(hash);
+                unsigned zeros = 0;
+                while (zeros < 8 * sizeof(hash) && !(hash[zeros / 8] & (0x80 >> (zeros % 8)))) {
+                    ++zeros;
+                }
+                solutions += (zeros >= difficulty);
+            }
+        }
+        i = (i + 1) % 1000;
+    }
+    benchmark::DoNotOptimize(solutions);
+    SetHashRate(state, 1000);
+}
+BENCHMARK(SHA256_MiningBatch)->ArgName("batch")->Arg(40)->Arg(200)->Arg(1000);
+
+// End of File
@@ -0,0 +1,82 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <benchmark/benchmark.h>
+
+#include <map>
+#include <set>
+#include <vector>
+
+#include "random.h"
+#include "uint256.h"
+#include "uint256map.h"
+#include "webcash.h"
+
+static std::vector<uint256> RandomHashes(size_t count)
+{
+    FastRandomContext rng(true);
+    std::vector<uint256> hashes;
+    hashes.reserve(count);
+    for (size_t i = 0; i < count; ++i) {
+        hashes.push_back(rng.rand256());
+    }
+    return hashes;
+}
+
+// Fills a map with as many entries as there are in a request, and looks each
+// of them up, as is done with the unspent outputs of a health check.
+template <typename Map>
+static void FillAndFind(benchmark::State& state)
+{
+    const std::vector<uint256> hashes = RandomHashes(state.range(0));
+    for (auto _ : state) {
+        Map map;
+        for (const uint256& hash : hashes) {
+            map[hash] = Amount(1);
+        }
+        for (const uint256& hash : hashes) {
+            benchmark::DoNotOptimize(map.find(hash));
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * hashes.size());
+}
+
+static void Uint256_std_map(benchmark::State& state) {
+    FillAndFind<std::map<uint256, Amount>>(state);
+}
+BENCHMARK(Uint256_std_map)->ArgName("entries")->Arg(10)->Arg(100)->Arg(1000);
+
+static void Uint256_flat_map(benchmark::State& state) {
+    FillAndFind<Uint256Map<Amount>>(state);
+}
+BENCHMARK(Uint256_flat_map)->ArgName("entries")->Arg(10)->Arg(100)->Arg(1000);
+
+// Looks up hashes, half of which are absent, in a set which is filled once, as
+// is done with the spent hashes of the UTXO cache.
+template <typename Set>
+static void Lookup(benchmark::State& state)
+{
+    const std::vector<uint256> hashes = RandomHashes(2 * state.range(0));
+    const Set set(hashes.begin(), hashes.begin() + state.range(0));
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(set.count(hashes[i]));
+        i = (i + 1) % hashes.size();
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+static void Uint256_std_set_find(benchmark::State& state) {
+    Lookup<std::set<uint256>>(state);
+}
+BENCHMARK(Uint256_std_set_find)->ArgName("entries")->Arg(10)->Arg(100)->Arg(1000);
+
+static void Uint256_flat_set_find(benchmark::State& state) {
+    Lookup<Uint256Set>(state);
+}
+BENCHMARK(Uint256_flat_set_find)->ArgName("entries")->Arg(10)->Arg(100)->Arg(1000);
+
+// End of File
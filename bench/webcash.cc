@@ -6,8 +6,13 @@
 
 #include <benchmark/benchmark.h>
 
+#include <algorithm>
+#include <string>
+
 #include "webcash.h"
 
+#include "absl/strings/escaping.h"
+
 // Benchmark serialization and deserialization of SecretWebcash
 static void SecretWebcash_to_string(benchmark::State& state) {
     using std::to_string;
@@ -71,6 +76,63 @@ static void PublicWebcash_round_trip(benchmark::State& state) {
 }
 BENCHMARK(PublicWebcash_round_trip);
 
+// The general-purpose absl hex routines, which PublicWebcash used before it
+// had its own, for comparison with PublicWebcash_parse and _to_chars.
+static void PublicWebcash_hex_absl_decode(benchmark::State& state) {
+    const std::string hex = "9a8a1ac24dd10f243c9ac05eb7093d130a032d5a31ae648014a33f8e02d47fcf";
+    uint256 pk;
+    for (auto _ : state) {
+        if (is_uint256(hex)) {
+            const std::string bytes = absl::HexStringToBytes(hex);
+            std::copy(bytes.begin(), bytes.end(), pk.begin());
+        }
+        benchmark::DoNotOptimize(pk);
+    }
+}
+BENCHMARK(PublicWebcash_hex_absl_decode);
+
+static void PublicWebcash_hex_absl_encode(benchmark::State& state) {
+    PublicWebcash wc;
+    assert(wc.parse("e190000:public:9a8a1ac24dd10f243c9ac05eb7093d130a032d5a31ae648014a33f8e02d47fcf"));
+    std::string hex;
+    for (auto _ : state) {
+        hex = absl::BytesToHexString(absl::string_view((const char*)wc.pk.data(), wc.pk.size()));
+        benchmark::DoNotOptimize(hex);
+    }
+}
+BENCHMARK(PublicWebcash_hex_absl_encode);
+
+static void SecretWebcash_to_chars(benchmark::State& state) {
+    SecretWebcash wc;
+    assert(wc.parse("e190000:secret:f9328d45619ccc052cd96c9408e322fd2ad60adc85d303e771f6b153ab2ed089"));
+    std::string buf(max_chars(wc), '\0');
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(to_chars(&buf[0], wc));
+    }
+}
+BENCHMARK(SecretWebcash_to_chars);
+
+static void PublicWebcash_to_chars(benchmark::State& state) {
+    PublicWebcash wc;
+    assert(wc.parse("e190000:public:9a8a1ac24dd10f243c9ac05eb7093d130a032d5a31ae648014a33f8e02d47fcf"));
+    char buf[MAX_PUBLIC_WEBCASH_CHARS];
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(to_chars(buf, wc));
+    }
+}
+BENCHMARK(PublicWebcash_to_chars);
+
+// Whole amounts take Amount::parse's fast path; others the general parser.
+static void Amount_parse(benchmark::State& state, const char* str) {
+    Amount amount;
+    const std::string amount_str(str);
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(amount.parse(amount_str));
+    }
+}
+BENCHMARK_CAPTURE(Amount_parse, whole, "190000");
+BENCHMARK_CAPTURE(Amount_parse, fractional, "190000.12345678");
+
 static void PublicWebcash_from_secret(benchmark::State& state) {
     SHA256AutoDetect();
     SecretWebcash sk;
@@ -82,4 +144,14 @@ static void PublicWebcash_from_secret(benchmark::State& state) {
 }
 BENCHMARK(PublicWebcash_from_secret);
 
+// Allocation of secrets from the locked pool, by several threads at once, as
+// when the server parses the secrets of concurrent requests.
+static void SecureString_alloc(benchmark::State& state) {
+    for (auto _ : state) {
+        SecureString sk(96, 's');
+        benchmark::DoNotOptimize(sk.data());
+    }
+}
+BENCHMARK(SecureString_alloc)->ThreadRange(1, 8);
+
 // End of File
@@ -0,0 +1,69 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "bloom.h"
+
+#include <math.h>
+
+#include <algorithm>
+
+void BloomFilter::Reset(size_t num_elements, double fp_rate)
+{
+    // The optimal size and number of probes for the given false-positive rate.
+    static const double ln2 = log(2.0);
+    num_elements = std::max<size_t>(num_elements, 1);
+    double bits = -static_cast<double>(num_elements) * log(fp_rate) / (ln2 * ln2);
+    size_t num_words = std::max<size_t>(static_cast<size_t>(bits / 64.0) + 1, 1);
+    auto table = std::make_shared<Table>();
+    table->words.reset(new std::atomic<uint64_t>[num_words]());
+    table->num_bits = 64 * static_cast<uint64_t>(num_words);
+    table->num_probes = std::min(std::max(static_cast<unsigned>(round(bits / num_elements * ln2)), 1U), 16U);
+    // Not ready before the new table is visible, so that it isn't consulted
+    // until loaded.
+    m_ready.store(false);
+    std::atomic_store(&m_table, std::shared_ptr<const Table>(std::move(table)));
+}
+
+void BloomFilter::SetReady()
+{
+    m_ready.store(true);
+}
+
+void BloomFilter::Insert(const uint256& hash)
+{
+    const std::shared_ptr<const Table> table = std::atomic_load(&m_table);
+    if (!table) {
+        return;
+    }
+    // Double hashing, with two independent 64-bit words of the hash.
+    const uint64_t h1 = hash.GetUint64(0);
+    const uint64_t h2 = hash.GetUint64(1) | 1;
+    for (unsigned i = 0; i < table->num_probes; ++i) {
+        uint64_t bit = (h1 + i * h2) % table->num_bits;
+        table->words[bit / 64].fetch_or(uint64_t{1} << (bit % 64), std::memory_order_relaxed);
+    }
+}
+
+bool BloomFilter::Contains(const uint256& hash) const
+{
+    // The table is loaded first, so that a new one is never seen with the
+    // readiness of the old.
+    const std::shared_ptr<const Table> table = std::atomic_load(&m_table);
+    if (!table || !m_ready.load()) {
+        return true;
+    }
+    const uint64_t h1 = hash.GetUint64(0);
+    const uint64_t h2 = hash.GetUint64(1) | 1;
+    for (unsigned i = 0; i < table->num_probes; ++i) {
+        uint64_t bit = (h1 + i * h2) % table->num_bits;
+        if (!(table->words[bit / 64].load(std::memory_order_relaxed) & (uint64_t{1} << (bit % 64)))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// End of File
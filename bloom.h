@@ -0,0 +1,63 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef BLOOM_H
+#define BLOOM_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+
+#include "uint256.h"
+
+/**
+ * A Bloom filter over SHA256 hashes, used to answer "definitely not seen"
+ * without a trip to the database.  Since the keys are already uniformly
+ * distributed, the probe positions are derived directly from the bits of the
+ * hash rather than by rehashing.
+ *
+ * Insert and Contains may be called concurrently with each other and with
+ * Reset, which publishes a new table rather than resizing the old one, so that
+ * the filter can be loaded while requests are served.  An Insert which races
+ * with Reset may land in the old table.
+ */
+class BloomFilter {
+public:
+    BloomFilter() = default;
+    // Non-copyable:
+    BloomFilter(const BloomFilter&) = delete;
+    BloomFilter& operator=(const BloomFilter&) = delete;
+
+    /** Empty the filter, sizing it to hold num_elements hashes with the given
+     *  false-positive rate.  Contains answers true until SetReady(). */
+    void Reset(size_t num_elements, double fp_rate);
+
+    /** Called once every hash from before the Reset has been inserted. */
+    void SetReady();
+
+    void Insert(const uint256& hash);
+
+    /** False only if hash has certainly not been inserted.  Always true for a
+     *  filter which hasn't been sized by Reset, or is still being loaded. */
+    bool Contains(const uint256& hash) const;
+
+private:
+    struct Table {
+        std::unique_ptr<std::atomic<uint64_t>[]> words;
+        uint64_t num_bits = 0;
+        unsigned num_probes = 0;
+    };
+
+    // Only accessed with std::atomic_load and std::atomic_store.
+    std::shared_ptr<const Table> m_table;
+    std::atomic<bool> m_ready{false};
+};
+
+#endif // BLOOM_H
+
+// End of File
@@ -0,0 +1,490 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "coordinator.h"
+
+#include <iostream>
+
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+namespace {
+
+/** Messages are small, so anything larger is a protocol error. */
+const uint32_t MAX_MESSAGE_SIZE = 64 * 1024;
+
+/** How long a send to a stalled peer may block before the connection is
+ *  dropped. */
+const int SEND_TIMEOUT_SECONDS = 10;
+
+const absl::Duration RECONNECT_MIN = absl::Seconds(1);
+const absl::Duration RECONNECT_MAX = absl::Seconds(60);
+
+void put_uint32(std::string& out, uint32_t v)
+{
+    for (int i = 3; i >= 0; --i) {
+        out.push_back((char)(v >> (8 * i)));
+    }
+}
+
+void put_uint64(std::string& out, uint64_t v)
+{
+    put_uint32(out, (uint32_t)(v >> 32));
+    put_uint32(out, (uint32_t)v);
+}
+
+uint32_t get_uint32(const std::string& in, size_t pos)
+{
+    uint32_t v = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        v = (v << 8) | (unsigned char)in[pos + i];
+    }
+    return v;
+}
+
+uint64_t get_uint64(const std::string& in, size_t pos)
+{
+    return ((uint64_t)get_uint32(in, pos) << 32) | get_uint32(in, pos + 4);
+}
+
+bool write_all(int fd, const char* data, size_t len)
+{
+    while (len) {
+        const ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool read_all(int fd, char* data, size_t len)
+{
+    while (len) {
+        const ssize_t n = recv(fd, data, len, 0);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool send_message(int fd, CoordinatorMessage type, const std::string& payload)
+{
+    std::string msg;
+    msg.reserve(5 + payload.size());
+    put_uint32(msg, 1 + payload.size());
+    msg.push_back((char)type);
+    msg += payload;
+    return write_all(fd, msg.data(), msg.size());
+}
+
+bool recv_message(int fd, CoordinatorMessage& type, std::string& payload)
+{
+    std::string header(5, '\0');
+    if (!read_all(fd, &header[0], header.size())) {
+        return false;
+    }
+    const uint32_t len = get_uint32(header, 0);
+    if (len < 1 || len > MAX_MESSAGE_SIZE) {
+        return false;
+    }
+    type = (CoordinatorMessage)header[4];
+    payload.resize(len - 1);
+    return payload.empty() || read_all(fd, &payload[0], payload.size());
+}
+
+void configure_socket(int fd)
+{
+    // Messages are latency sensitive and far smaller than a packet.
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    struct timeval tv = {SEND_TIMEOUT_SECONDS, 0};
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+}
+
+/** Returns a connected socket, or -1 on failure. */
+int connect_to(const std::string& host, int port)
+{
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    struct addrinfo* res = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0) {
+        return -1;
+    }
+    int fd = -1;
+    for (struct addrinfo* ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(fd);
+        fd = -1;
+    }
+    freeaddrinfo(res);
+    if (fd >= 0) {
+        configure_socket(fd);
+    }
+    return fd;
+}
+
+} // namespace
+
+CoordinatorServer::CoordinatorServer(WorkFunc make_work, SolutionFunc on_solution)
+    : m_make_work(std::move(make_work))
+    , m_on_solution(std::move(on_solution))
+{
+}
+
+CoordinatorServer::~CoordinatorServer()
+{
+    Stop();
+}
+
+bool CoordinatorServer::Listen(const std::string& host, int port)
+{
+    struct addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    struct addrinfo* res = nullptr;
+    if (getaddrinfo(host.empty() ? nullptr : host.c_str(), std::to_string(port).c_str(), &hints, &res) != 0) {
+        std::cerr << "Error: unable to resolve coordinator address '" << host << "'" << std::endl;
+        return false;
+    }
+    for (struct addrinfo* ai = res; ai && m_listen_fd < 0; ai = ai->ai_next) {
+        int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) {
+            continue;
+        }
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 && listen(fd, SOMAXCONN) == 0) {
+            m_listen_fd = fd;
+        } else {
+            close(fd);
+        }
+    }
+    freeaddrinfo(res);
+    if (m_listen_fd < 0) {
+        std::cerr << "Error: unable to listen for mining agents on " << host << ":" << port << std::endl;
+        return false;
+    }
+    m_accept_thread = std::thread(&CoordinatorServer::AcceptLoop, this);
+    return true;
+}
+
+void CoordinatorServer::AcceptLoop()
+{
+    while (!m_stop) {
+        const int fd = accept(m_listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+        if (m_stop) {
+            close(fd);
+            break;
+        }
+        configure_socket(fd);
+
+        std::shared_ptr<Agent> agent = std::make_shared<Agent>();
+        agent->fd = fd;
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        Reap();
+        // Agents learn the difficulty before asking for any work.
+        if (!SendSettings(*agent, m_epoch, m_difficulty)) {
+            close(fd);
+            continue;
+        }
+        agent->thread = std::thread(&CoordinatorServer::Serve, this, agent);
+        m_agents.push_back(agent);
+    }
+}
+
+void CoordinatorServer::Serve(std::shared_ptr<Agent> agent)
+{
+    CoordinatorMessage type;
+    std::string payload;
+    while (!m_stop && recv_message(agent->fd, type, payload)) {
+        if (type == CoordinatorMessage::GET_WORK) {
+            const CoordinatorWork work = m_make_work();
+            std::string reply;
+            put_uint64(reply, work.id);
+            put_uint64(reply, work.epoch);
+            reply += work.prefix_b64;
+            const std::lock_guard<std::mutex> lock(agent->write_mutex);
+            if (!send_message(agent->fd, CoordinatorMessage::WORK, reply)) {
+                break;
+            }
+        } else if (type == CoordinatorMessage::SOLUTION && payload.size() > 8) {
+            m_on_solution(get_uint64(payload, 0), payload.substr(8));
+        } else {
+            std::cerr << "Error: protocol violation by mining agent; disconnecting" << std::endl;
+            break;
+        }
+    }
+    {
+        const std::lock_guard<std::mutex> lock(agent->write_mutex);
+        close(agent->fd);
+        agent->fd = -1;
+    }
+    agent->done = true;
+}
+
+bool CoordinatorServer::SendSettings(Agent& agent, uint64_t epoch, unsigned difficulty)
+{
+    std::string payload;
+    put_uint64(payload, epoch);
+    put_uint32(payload, difficulty);
+    const std::lock_guard<std::mutex> lock(agent.write_mutex);
+    if (agent.fd < 0) {
+        return false;
+    }
+    if (!send_message(agent.fd, CoordinatorMessage::SETTINGS, payload)) {
+        // Wake up the agent's thread, which closes the connection.
+        shutdown(agent.fd, SHUT_RDWR);
+        return false;
+    }
+    return true;
+}
+
+void CoordinatorServer::Broadcast(uint64_t epoch, unsigned difficulty)
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    if (epoch < m_epoch) {
+        return;
+    }
+    m_epoch = epoch;
+    m_difficulty = difficulty;
+    for (const std::shared_ptr<Agent>& agent : m_agents) {
+        if (!agent->done) {
+            SendSettings(*agent, epoch, difficulty);
+        }
+    }
+}
+
+size_t CoordinatorServer::NumAgents() const
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    return std::count_if(m_agents.begin(), m_agents.end(), [](const std::shared_ptr<Agent>& agent) { return !agent->done; });
+}
+
+void CoordinatorServer::Reap()
+{
+    for (auto it = m_agents.begin(); it != m_agents.end();) {
+        if ((*it)->done) {
+            (*it)->thread.join();
+            it = m_agents.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void CoordinatorServer::Stop()
+{
+    if (m_stop.exchange(true)) {
+        return;
+    }
+    if (m_listen_fd >= 0) {
+        // Wakes up the accept() call.
+        shutdown(m_listen_fd, SHUT_RDWR);
+        m_accept_thread.join();
+        close(m_listen_fd);
+        m_listen_fd = -1;
+    }
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    for (const std::shared_ptr<Agent>& agent : m_agents) {
+        const std::lock_guard<std::mutex> agent_lock(agent->write_mutex);
+        if (agent->fd >= 0) {
+            shutdown(agent->fd, SHUT_RDWR);
+        }
+    }
+    for (const std::shared_ptr<Agent>& agent : m_agents) {
+        agent->thread.join();
+    }
+    m_agents.clear();
+}
+
+CoordinatorClient::CoordinatorClient(const std::string& host, int port, SettingsFunc on_settings)
+    : m_host(host)
+    , m_port(port)
+    , m_on_settings(std::move(on_settings))
+{
+    m_thread = std::thread(&CoordinatorClient::ConnectionLoop, this);
+}
+
+CoordinatorClient::~CoordinatorClient()
+{
+    Stop();
+}
+
+void CoordinatorClient::ConnectionLoop()
+{
+    absl::Duration backoff = RECONNECT_MIN;
+    while (true) {
+        const int fd = connect_to(m_host, m_port);
+        std::deque<std::pair<uint64_t, std::string>> unsent;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            if (fd < 0) {
+                std::cerr << "Error: unable to connect to coordinator at " << m_host << ":" << m_port << "; retrying in " << absl::FormatDuration(backoff) << std::endl;
+                if (m_cv.wait_for(lock, absl::ToChronoNanoseconds(backoff), [this] { return m_stop; })) {
+                    return;
+                }
+                backoff = std::min(2 * backoff, RECONNECT_MAX);
+                continue;
+            }
+            if (m_stop) {
+                close(fd);
+                return;
+            }
+            backoff = RECONNECT_MIN;
+            m_fd = fd;
+            ++m_generation;
+            // Outstanding requests for work were lost with the old
+            // connection, and are re-sent by GetWork().
+            unsent.swap(m_unsent);
+        }
+        m_cv.notify_all();
+        std::cout << "Connected to coordinator at " << m_host << ":" << m_port << std::endl;
+        for (const auto& solution : unsent) {
+            SubmitSolution(solution.first, solution.second);
+        }
+
+        CoordinatorMessage type;
+        std::string payload;
+        while (recv_message(fd, type, payload)) {
+            if (type == CoordinatorMessage::SETTINGS && payload.size() == 12) {
+                m_on_settings(get_uint64(payload, 0), get_uint32(payload, 8));
+            } else if (type == CoordinatorMessage::WORK && payload.size() > 16) {
+                {
+                    const std::lock_guard<std::mutex> lock(m_mutex);
+                    m_work.push_back({get_uint64(payload, 0), get_uint64(payload, 8), payload.substr(16)});
+                }
+                m_cv.notify_all();
+            } else {
+                std::cerr << "Error: protocol violation by coordinator; disconnecting" << std::endl;
+                break;
+            }
+        }
+
+        {
+            const std::lock_guard<std::mutex> lock(m_mutex);
+            m_fd = -1;
+        }
+        {
+            // Wait for any in-progress write to finish before closing.
+            const std::lock_guard<std::mutex> lock(m_write_mutex);
+            close(fd);
+        }
+        m_cv.notify_all();
+        {
+            const std::lock_guard<std::mutex> lock(m_mutex);
+            if (m_stop) {
+                return;
+            }
+        }
+        std::cerr << "Error: lost connection to coordinator; reconnecting" << std::endl;
+    }
+}
+
+bool CoordinatorClient::Send(CoordinatorMessage type, const std::string& payload)
+{
+    const std::lock_guard<std::mutex> write_lock(m_write_mutex);
+    int fd;
+    {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        fd = m_fd;
+    }
+    return fd >= 0 && send_message(fd, type, payload);
+}
+
+std::optional<CoordinatorWork> CoordinatorClient::GetWork()
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    // The connection on which our request was sent, or zero if none.
+    uint64_t requested = 0;
+    while (!m_stop) {
+        if (!m_work.empty()) {
+            CoordinatorWork work = std::move(m_work.front());
+            m_work.pop_front();
+            return work;
+        }
+        if (m_fd >= 0 && requested != m_generation) {
+            // Any reply will do, as all work units are alike.
+            requested = m_generation;
+            lock.unlock();
+            Send(CoordinatorMessage::GET_WORK, "");
+            lock.lock();
+            continue;
+        }
+        m_cv.wait(lock);
+    }
+    return std::nullopt;
+}
+
+void CoordinatorClient::SubmitSolution(uint64_t id, const std::string& preimage)
+{
+    std::string payload;
+    put_uint64(payload, id);
+    payload += preimage;
+    while (true) {
+        uint64_t generation;
+        {
+            const std::lock_guard<std::mutex> lock(m_mutex);
+            generation = m_generation;
+        }
+        if (Send(CoordinatorMessage::SOLUTION, payload)) {
+            return;
+        }
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        // Retry if we raced with a reconnection, or else queue the solution
+        // for the next one.
+        if (m_fd < 0 || m_generation == generation) {
+            m_unsent.emplace_back(id, preimage);
+            return;
+        }
+    }
+}
+
+void CoordinatorClient::Stop()
+{
+    {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_stop) {
+            return;
+        }
+        m_stop = true;
+        if (m_fd >= 0) {
+            // Wakes up the connection thread.
+            shutdown(m_fd, SHUT_RDWR);
+        }
+    }
+    m_cv.notify_all();
+    m_thread.join();
+}
+
+// End of File
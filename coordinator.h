@@ -0,0 +1,159 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef COORDINATOR_H
+#define COORDINATOR_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <utility>
+
+/**
+ * The protocol spoken between a coordinator (webminer --serve) and its
+ * mining agents (webminer --coordinator) over TCP.  Each message is a 4-byte
+ * big-endian length, counting the type byte and the payload, followed by the
+ * type byte and the payload.  Integers in payloads are big-endian.
+ */
+enum class CoordinatorMessage : uint8_t {
+    /** Agent to coordinator: request a work unit.  No payload. */
+    GET_WORK = 1,
+    /** Coordinator to agent: the 8-byte work id, the 8-byte epoch, and then
+     *  the base64-encoded preimage prefix. */
+    WORK = 2,
+    /** Agent to coordinator: the 8-byte work id, and then the preimage. */
+    SOLUTION = 3,
+    /** Coordinator to agent: the 8-byte epoch and the 4-byte difficulty.
+     *  Sent on connection and whenever the settings change. */
+    SETTINGS = 4,
+};
+
+/** A work unit as handed out by the coordinator. */
+struct CoordinatorWork {
+    uint64_t id;
+    /** Work from an epoch other than that of the latest SETTINGS is stale. */
+    uint64_t epoch;
+    std::string prefix_b64;
+};
+
+/**
+ * The coordinator's side: accepts agent connections, answers their requests
+ * for work and passes on their solutions, with one thread per agent.
+ */
+class CoordinatorServer {
+public:
+    /** Called from the agent threads, so both must be thread-safe. */
+    using WorkFunc = std::function<CoordinatorWork()>;
+    using SolutionFunc = std::function<void(uint64_t id, const std::string& preimage)>;
+
+    CoordinatorServer(WorkFunc make_work, SolutionFunc on_solution);
+    ~CoordinatorServer();
+
+    CoordinatorServer(const CoordinatorServer&) = delete;
+    CoordinatorServer& operator=(const CoordinatorServer&) = delete;
+
+    /** Start accepting agents on the given address.  Returns false if the
+     *  address can't be listened on. */
+    bool Listen(const std::string& host, int port);
+
+    /** Send the current settings to every agent, and to agents which
+     *  connect later.  Settings from an older epoch than the last are
+     *  ignored, so concurrent callers can't roll the agents back. */
+    void Broadcast(uint64_t epoch, unsigned difficulty);
+
+    /** The number of agents currently connected. */
+    size_t NumAgents() const;
+
+    /** Disconnect all agents and stop listening. */
+    void Stop();
+
+private:
+    struct Agent {
+        int fd;
+        /** Serializes writes to fd, and guards closing it. */
+        std::mutex write_mutex;
+        std::atomic<bool> done{false};
+        std::thread thread;
+    };
+
+    void AcceptLoop();
+    void Serve(std::shared_ptr<Agent> agent);
+    bool SendSettings(Agent& agent, uint64_t epoch, unsigned difficulty);
+    /** Joins the threads of disconnected agents.  Requires m_mutex. */
+    void Reap();
+
+    WorkFunc m_make_work;
+    SolutionFunc m_on_solution;
+
+    int m_listen_fd = -1;
+    std::atomic<bool> m_stop{false};
+    std::thread m_accept_thread;
+
+    mutable std::mutex m_mutex;
+    std::list<std::shared_ptr<Agent>> m_agents;
+    uint64_t m_epoch = 0;
+    unsigned m_difficulty = 0;
+};
+
+/**
+ * The agent's side: keeps a connection to the coordinator, reconnecting
+ * with backoff if it's lost, and fetches work and returns solutions over it.
+ */
+class CoordinatorClient {
+public:
+    /** Called from the connection thread for each SETTINGS message.  Work
+     *  from any other epoch than the latest settings' is stale. */
+    using SettingsFunc = std::function<void(uint64_t epoch, unsigned difficulty)>;
+
+    CoordinatorClient(const std::string& host, int port, SettingsFunc on_settings);
+    ~CoordinatorClient();
+
+    CoordinatorClient(const CoordinatorClient&) = delete;
+    CoordinatorClient& operator=(const CoordinatorClient&) = delete;
+
+    /** Block until the coordinator hands out a work unit.  Returns
+     *  std::nullopt only once the client is stopped. */
+    std::optional<CoordinatorWork> GetWork();
+
+    /** Send a solution to the coordinator.  If the connection is down, the
+     *  solution is sent once it has been re-established. */
+    void SubmitSolution(uint64_t id, const std::string& preimage);
+
+    void Stop();
+
+private:
+    void ConnectionLoop();
+    bool Send(CoordinatorMessage type, const std::string& payload);
+
+    const std::string m_host;
+    const int m_port;
+    SettingsFunc m_on_settings;
+
+    /** Serializes writes to the connection.  Acquired before m_mutex. */
+    std::mutex m_write_mutex;
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    bool m_stop = false;
+    int m_fd = -1;
+    /** Incremented on each (re)connection. */
+    uint64_t m_generation = 0;
+    std::deque<CoordinatorWork> m_work;
+    std::deque<std::pair<uint64_t, std::string>> m_unsent;
+    std::thread m_thread;
+};
+
+#endif // COORDINATOR_H
+
+// End of File
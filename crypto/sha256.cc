@@ -8,7 +8,10 @@
 #include "crypto/sha256.h"
 #include "crypto/common.h"
 
+#include <algorithm>
 #include <array>
+#include <vector>
+#include <utility>
 
 #include <assert.h>
 #include <string.h>
@@ -35,6 +38,9 @@ void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks);
 namespace sha256multi_sse41
 {
 void Transform_4way(unsigned char* out, const uint32_t* s, const unsigned char* in);
+void TransformFilter_4way(uint32_t* out, const uint32_t* s, const unsigned char* in);
+void TransformStates_4way(unsigned char* out, const uint32_t* s, const unsigned char* in);
+void TransformStatesFilter_4way(uint32_t* out, const uint32_t* s, const unsigned char* in);
 }
 
 namespace sha256d64_sse41
@@ -45,12 +51,31 @@ void Transform_4way(unsigned char* out, const unsigned char* in);
 namespace sha256multi_avx2
 {
 void Transform_8way(unsigned char* out, const uint32_t* s, const unsigned char* in);
+void TransformFilter_8way(uint32_t* out, const uint32_t* s, const unsigned char* in);
+void TransformStates_8way(unsigned char* out, const uint32_t* s, const unsigned char* in);
+void TransformStatesFilter_8way(uint32_t* out, const uint32_t* s, const unsigned char* in);
+}
+namespace sha256mine_avx2
+{
+void Transform_8way(uint32_t* out, const SHA256NoncePrecomp& pre, const unsigned char* nonce2);
 }
 namespace sha256d64_avx2
 {
 void Transform_8way(unsigned char* out, const unsigned char* in);
 }
 
+namespace sha256multi_avx512
+{
+void Transform_16way(unsigned char* out, const uint32_t* s, const unsigned char* in);
+void TransformFilter_16way(uint32_t* out, const uint32_t* s, const unsigned char* in);
+void TransformStates_16way(unsigned char* out, const uint32_t* s, const unsigned char* in);
+void TransformStatesFilter_16way(uint32_t* out, const uint32_t* s, const unsigned char* in);
+}
+namespace sha256mine_avx512
+{
+void Transform_16way(uint32_t* out, const SHA256NoncePrecomp& pre, const unsigned char* nonce2);
+}
+
 namespace sha256d64_shani
 {
 void Transform_2way(unsigned char* out, const unsigned char* in);
@@ -61,6 +86,15 @@ namespace sha256_shani
 void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks);
 }
 
+namespace sha256multi_shani
+{
+void Transform_2way(unsigned char* out, const uint32_t* s, const unsigned char* in);
+void Transform_4way(unsigned char* out, const uint32_t* s, const unsigned char* in);
+void TransformFilter_4way(uint32_t* out, const uint32_t* s, const unsigned char* in);
+void TransformStates_4way(unsigned char* out, const uint32_t* s, const unsigned char* in);
+void TransformStatesFilter_4way(uint32_t* out, const uint32_t* s, const unsigned char* in);
+}
+
 namespace sha256d64_armv8
 {
 void Transform_2way(unsigned char* out, const unsigned char* in);
@@ -71,6 +105,15 @@ namespace sha256_armv8
 void Transform(uint32_t* s, const unsigned char* chunk, size_t blocks);
 }
 
+namespace sha256multi_armv8
+{
+void Transform_2way(unsigned char* out, const uint32_t* s, const unsigned char* in);
+void Transform_4way(unsigned char* out, const uint32_t* s, const unsigned char* in);
+void TransformFilter_4way(uint32_t* out, const uint32_t* s, const unsigned char* in);
+void TransformStates_4way(unsigned char* out, const uint32_t* s, const unsigned char* in);
+void TransformStatesFilter_4way(uint32_t* out, const uint32_t* s, const unsigned char* in);
+}
+
 // Internal implementation code.
 namespace
 {
@@ -448,7 +491,9 @@ void TransformD64(unsigned char* out, const unsigned char* in)
 
 typedef void (*TransformType)(uint32_t*, const unsigned char*, size_t);
 typedef void (*TransformMultiType)(unsigned char*, const uint32_t*, const unsigned char*);
+typedef void (*TransformFilterType)(uint32_t*, const uint32_t*, const unsigned char*);
 typedef void (*TransformD64Type)(unsigned char*, const unsigned char*);
+typedef void (*TransformNonce2Type)(uint32_t*, const SHA256NoncePrecomp&, const unsigned char*);
 
 template<TransformType tr>
 void TransformD64Wrapper(unsigned char* out, const unsigned char* in)
@@ -493,10 +538,58 @@ TransformType Transform = sha256::Transform;
 TransformMultiType Transform_2way = nullptr;
 TransformMultiType Transform_4way = nullptr;
 TransformMultiType Transform_8way = nullptr;
+TransformMultiType Transform_16way = nullptr;
+TransformFilterType TransformFilter_4way = nullptr;
+TransformFilterType TransformFilter_8way = nullptr;
+TransformFilterType TransformFilter_16way = nullptr;
+// Like the above, but with a separate midstate for each lane.
+TransformMultiType TransformStates_4way = nullptr;
+TransformMultiType TransformStates_8way = nullptr;
+TransformMultiType TransformStates_16way = nullptr;
+TransformFilterType TransformStatesFilter_4way = nullptr;
+TransformFilterType TransformStatesFilter_8way = nullptr;
+TransformFilterType TransformStatesFilter_16way = nullptr;
 TransformD64Type TransformD64 = sha256::TransformD64;
 TransformD64Type TransformD64_2way = nullptr;
 TransformD64Type TransformD64_4way = nullptr;
 TransformD64Type TransformD64_8way = nullptr;
+TransformNonce2Type TransformNonce2_8way = nullptr;
+TransformNonce2Type TransformNonce2_16way = nullptr;
+std::vector<SHA256MiningKernel> MiningKernels;
+
+/** Build the final blocks hashed by the mining kernels, for count nonce2 values. */
+void FillNonce2Blocks(unsigned char* blocks, const SHA256NoncePrecomp& pre, const unsigned char* nonce2, size_t count)
+{
+    memset(blocks, 0, count*64);
+    for (size_t i = 0; i < count; ++i) {
+        WriteBE32(blocks + i*64 + 0, pre.w0);
+        std::copy(nonce2 + i*4, nonce2 + i*4 + 4, blocks + i*64 + 4);
+        WriteBE32(blocks + i*64 + 8, pre.w2);
+        blocks[i*64 + 12] = 0x80; // padding byte
+        WriteBE32(blocks + i*64 + 56, pre.w14);
+        WriteBE32(blocks + i*64 + 60, pre.w15);
+    }
+}
+
+/** Adapt a multi-way filter transform to the mining kernel interface. */
+template<TransformFilterType tr, size_t N>
+void TransformNonce2Filter(uint32_t* out, const SHA256NoncePrecomp& pre, const unsigned char* nonce2)
+{
+    std::array<unsigned char, N*64> blocks;
+    FillNonce2Blocks(blocks.data(), pre, nonce2, N);
+    tr(out, pre.s, blocks.data());
+}
+
+/** Mining kernel using the single-block Transform(). */
+void TransformNonce2Scalar(uint32_t* out, const SHA256NoncePrecomp& pre, const unsigned char* nonce2)
+{
+    unsigned char block[64];
+    FillNonce2Blocks(block, pre, nonce2, 1);
+    uint32_t s[8];
+    std::copy(pre.s, pre.s + 8, s);
+    Transform(s, block, 1);
+    *out = s[0];
+}
 
 #ifndef NDEBUG
 bool SelfTest() {
@@ -581,6 +674,117 @@ bool SelfTest() {
         if (!std::equal(out, out + 256, result_d64)) return false;
     }
 
+    // Test the multi-way midstate transforms against (the already tested)
+    // Transform(), using the state after the first block as the midstate
+    // and the 8 blocks of input data, repeated, as the final blocks.
+    unsigned char blocks[16*64];
+    unsigned char expected[16*32];
+    for (int i = 0; i < 16; ++i) {
+        std::copy(data + 1 + 64*(i % 8), data + 1 + 64*(i % 8) + 64, blocks + 64*i);
+        uint32_t state[8];
+        std::copy(result[1], result[1] + 8, state);
+        Transform(state, blocks + 64*i, 1);
+        for (int j = 0; j < 8; ++j) {
+            WriteBE32(expected + 32*i + 4*j, state[j]);
+        }
+    }
+    const std::pair<TransformMultiType, size_t> multi[] = {
+        {Transform_2way, 2},
+        {Transform_4way, 4},
+        {Transform_8way, 8},
+        {Transform_16way, 16},
+    };
+    for (const auto& [tr, ways] : multi) {
+        if (tr) {
+            unsigned char out[16*32];
+            tr(out, result[1], blocks);
+            if (!std::equal(out, out + 32*ways, expected)) return false;
+        }
+    }
+    const std::pair<TransformFilterType, size_t> filter[] = {
+        {TransformFilter_4way, 4},
+        {TransformFilter_8way, 8},
+        {TransformFilter_16way, 16},
+    };
+    for (const auto& [tr, ways] : filter) {
+        if (tr) {
+            uint32_t out[16];
+            tr(out, result[1], blocks);
+            for (size_t i = 0; i < ways; ++i) {
+                if (out[i] != ReadBE32(expected + 32*i)) return false;
+            }
+        }
+    }
+
+    // Test the per-lane midstate transforms the same way, but with each
+    // lane starting from a different one of the states in result.
+    uint32_t states[16*8];
+    for (int i = 0; i < 16; ++i) {
+        std::copy(result[i % 9], result[i % 9] + 8, states + 8*i);
+        uint32_t state[8];
+        std::copy(states + 8*i, states + 8*i + 8, state);
+        Transform(state, blocks + 64*i, 1);
+        for (int j = 0; j < 8; ++j) {
+            WriteBE32(expected + 32*i + 4*j, state[j]);
+        }
+    }
+    const std::pair<TransformMultiType, size_t> multi_states[] = {
+        {TransformStates_4way, 4},
+        {TransformStates_8way, 8},
+        {TransformStates_16way, 16},
+    };
+    for (const auto& [tr, ways] : multi_states) {
+        if (tr) {
+            unsigned char out[16*32];
+            tr(out, states, blocks);
+            if (!std::equal(out, out + 32*ways, expected)) return false;
+        }
+    }
+    const std::pair<TransformFilterType, size_t> filter_states[] = {
+        {TransformStatesFilter_4way, 4},
+        {TransformStatesFilter_8way, 8},
+        {TransformStatesFilter_16way, 16},
+    };
+    for (const auto& [tr, ways] : filter_states) {
+        if (tr) {
+            uint32_t out[16];
+            tr(out, states, blocks);
+            for (size_t i = 0; i < ways; ++i) {
+                if (out[i] != ReadBE32(expected + 32*i)) return false;
+            }
+        }
+    }
+
+    // Test the mining kernels against CSHA256, hashing the first block of
+    // data followed by 4-byte nonces and final word taken from the rest.
+    CSHA256 midstate;
+    midstate.Write(data + 1, 64);
+    SHA256NoncePrecomp pre;
+    midstate.PrecomputeNonce1(data + 65, data + 69, pre);
+    const std::pair<TransformNonce2Type, size_t> mine[] = {
+        {TransformNonce2_8way, 8},
+        {TransformNonce2_16way, 16},
+    };
+    uint32_t expected_words[16];
+    for (size_t i = 0; i < 16; ++i) {
+        unsigned char hash[32];
+        CSHA256(midstate).Write(data + 65, 4).Write(data + 73 + 4*i, 4).Write(data + 69, 4).Finalize(hash);
+        expected_words[i] = ReadBE32(hash);
+    }
+    for (const auto& [tr, ways] : mine) {
+        if (tr) {
+            uint32_t out[16];
+            tr(out, pre, data + 73);
+            if (!std::equal(out, out + ways, expected_words)) return false;
+        }
+    }
+    // An odd count exercises the handling of partial batches.
+    for (const SHA256MiningKernel& kernel : MiningKernels) {
+        uint32_t out[13];
+        SHA256Nonce2FirstWord(kernel, out, pre, data + 73, 13);
+        if (!std::equal(out, out + 13, expected_words)) return false;
+    }
+
     return true;
 }
 #endif // NDEBUG
@@ -593,28 +797,52 @@ bool AVXEnabled()
     __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
     return (a & 6) == 6;
 }
+
+/** Check whether the OS has enabled AVX-512 opmask and ZMM registers. */
+bool AVX512Enabled()
+{
+    uint32_t a, d;
+    __asm__("xgetbv" : "=a"(a), "=d"(d) : "c"(0));
+    return (a & 0xe6) == 0xe6;
+}
 #endif
 } // namespace
 
 
-std::string SHA256AutoDetect()
+std::string SHA256AutoDetect(sha256_implementation::UseImplementation use_implementation)
 {
+    (void)use_implementation;
     std::string ret = "standard";
+    // Undo any previous choice.
+    Transform = sha256::Transform;
+    Transform_2way = Transform_4way = Transform_8way = Transform_16way = nullptr;
+    TransformFilter_4way = TransformFilter_8way = TransformFilter_16way = nullptr;
+    TransformStates_4way = TransformStates_8way = TransformStates_16way = nullptr;
+    TransformStatesFilter_4way = TransformStatesFilter_8way = TransformStatesFilter_16way = nullptr;
+    TransformD64 = sha256::TransformD64;
+    TransformD64_2way = TransformD64_4way = TransformD64_8way = nullptr;
+    TransformNonce2_8way = TransformNonce2_16way = nullptr;
+    MiningKernels.clear();
 #if defined(HAVE_GETCPUID)
     bool have_sse4 = false;
     bool have_xsave = false;
     bool have_avx = false;
     bool have_avx2 = false;
+    bool have_avx512 = false;
     bool have_shani = false;
     bool enabled_avx = false;
+    bool enabled_avx512 = false;
 
     (void)AVXEnabled;
+    (void)AVX512Enabled;
     (void)have_sse4;
     (void)have_avx;
     (void)have_xsave;
     (void)have_avx2;
+    (void)have_avx512;
     (void)have_shani;
     (void)enabled_avx;
+    (void)enabled_avx512;
 
     uint32_t eax, ebx, ecx, edx;
     GetCPUID(1, 0, eax, ebx, ecx, edx);
@@ -623,19 +851,58 @@ std::string SHA256AutoDetect()
     have_avx = (ecx >> 28) & 1;
     if (have_xsave && have_avx) {
         enabled_avx = AVXEnabled();
+        enabled_avx512 = AVX512Enabled();
     }
     if (have_sse4) {
         GetCPUID(7, 0, eax, ebx, ecx, edx);
         have_avx2 = (ebx >> 5) & 1;
+        have_avx512 = (ebx >> 16) & 1;
         have_shani = (ebx >> 29) & 1;
     }
 
+    if (!(use_implementation & sha256_implementation::USE_SHANI)) {
+        have_shani = false;
+    }
+    if (!(use_implementation & sha256_implementation::USE_AVX512)) {
+        have_avx512 = false;
+    }
+    if (!(use_implementation & sha256_implementation::USE_AVX2)) {
+        have_avx2 = false;
+    }
+    if (!(use_implementation & sha256_implementation::USE_SSE4)) {
+        have_sse4 = false;
+    }
+
+#if !defined(BUILD_BITCOIN_INTERNAL)
+    // Every supported mining kernel is registered, even those superseded
+    // below, so that the miner can benchmark them against each other.
+    if (have_avx512 && have_avx && enabled_avx && enabled_avx512) {
+        MiningKernels.push_back({"avx512", 16, sha256mine_avx512::Transform_16way});
+    }
+    if (have_shani) {
+        MiningKernels.push_back({"shani", 4, TransformNonce2Filter<sha256multi_shani::TransformFilter_4way, 4>});
+    }
+    if (have_avx2 && have_avx && enabled_avx) {
+        MiningKernels.push_back({"avx2", 8, sha256mine_avx2::Transform_8way});
+    }
+    if (have_sse4) {
+        MiningKernels.push_back({"sse41", 4, TransformNonce2Filter<sha256multi_sse41::TransformFilter_4way, 4>});
+    }
+#endif
+
 #if !defined(BUILD_BITCOIN_INTERNAL)
     if (have_shani) {
         Transform = sha256_shani::Transform;
         TransformD64 = TransformD64Wrapper<sha256_shani::Transform>;
         TransformD64_2way = sha256d64_shani::Transform_2way;
-        ret = "shani(1way,2way)";
+        // Interleaved SHA-NI beats AVX2 for the midstate transforms too, so
+        // the multi-way kernels are taken from here rather than AVX2.
+        Transform_2way = sha256multi_shani::Transform_2way;
+        Transform_4way = sha256multi_shani::Transform_4way;
+        TransformFilter_4way = sha256multi_shani::TransformFilter_4way;
+        TransformStates_4way = sha256multi_shani::TransformStates_4way;
+        TransformStatesFilter_4way = sha256multi_shani::TransformStatesFilter_4way;
+        ret = "shani(1way,2way,4way)";
         have_sse4 = false; // Disable SSE4/AVX2;
         have_avx2 = false;
     }
@@ -649,6 +916,9 @@ std::string SHA256AutoDetect()
 #endif
 #if !defined(BUILD_BITCOIN_INTERNAL)
         Transform_4way = sha256multi_sse41::Transform_4way;
+        TransformFilter_4way = sha256multi_sse41::TransformFilter_4way;
+        TransformStates_4way = sha256multi_sse41::TransformStates_4way;
+        TransformStatesFilter_4way = sha256multi_sse41::TransformStatesFilter_4way;
         TransformD64_4way = sha256d64_sse41::Transform_4way;
         ret += ",sse41(4way)";
 #endif
@@ -657,11 +927,29 @@ std::string SHA256AutoDetect()
 #if !defined(BUILD_BITCOIN_INTERNAL)
     if (have_avx2 && have_avx && enabled_avx) {
         Transform_8way = sha256multi_avx2::Transform_8way;
+        TransformFilter_8way = sha256multi_avx2::TransformFilter_8way;
+        TransformStates_8way = sha256multi_avx2::TransformStates_8way;
+        TransformStatesFilter_8way = sha256multi_avx2::TransformStatesFilter_8way;
+        TransformNonce2_8way = sha256mine_avx2::Transform_8way;
         TransformD64_8way = sha256d64_avx2::Transform_8way;
         ret += ",avx2(8way)";
     }
 #endif
 
+#if !defined(BUILD_BITCOIN_INTERNAL)
+    // The 16-way midstate transform is only used for mining, where it is
+    // faster than SHA-NI.  Unlike AVX2 it is therefore not disabled along with
+    // it, and it is named last, once the base implementation has been chosen.
+    if (have_avx512 && have_avx && enabled_avx && enabled_avx512) {
+        Transform_16way = sha256multi_avx512::Transform_16way;
+        TransformFilter_16way = sha256multi_avx512::TransformFilter_16way;
+        TransformStates_16way = sha256multi_avx512::TransformStates_16way;
+        TransformStatesFilter_16way = sha256multi_avx512::TransformStatesFilter_16way;
+        TransformNonce2_16way = sha256mine_avx512::Transform_16way;
+        ret += ",avx512(16way)";
+    }
+#endif
+
 #elif defined(__aarch64__)
     bool have_arm_shani = false;
 
@@ -686,14 +974,26 @@ std::string SHA256AutoDetect()
     }
 #endif
 
+    if (!(use_implementation & sha256_implementation::USE_SHANI)) {
+        have_arm_shani = false;
+    }
+
     if (have_arm_shani) {
         Transform = sha256_armv8::Transform;
         TransformD64 = TransformD64Wrapper<sha256_armv8::Transform>;
         TransformD64_2way = sha256d64_armv8::Transform_2way;
-        ret = "armv8(1way,2way)";
+        Transform_2way = sha256multi_armv8::Transform_2way;
+        Transform_4way = sha256multi_armv8::Transform_4way;
+        TransformFilter_4way = sha256multi_armv8::TransformFilter_4way;
+        TransformStates_4way = sha256multi_armv8::TransformStates_4way;
+        TransformStatesFilter_4way = sha256multi_armv8::TransformStatesFilter_4way;
+        ret = "armv8(1way,2way,4way)";
+        MiningKernels.push_back({"armv8", 4, TransformNonce2Filter<sha256multi_armv8::TransformFilter_4way, 4>});
     }
 #endif
 
+    MiningKernels.push_back({"scalar", 1, TransformNonce2Scalar});
+
     assert(SelfTest());
     return ret;
 }
@@ -731,18 +1031,109 @@ CSHA256& CSHA256::Write(const unsigned char* data, size_t len)
     return *this;
 }
 
-void CSHA256::WriteAndFinalize8(const unsigned char* nonce1, const unsigned char* nonce2, const unsigned char* final, unsigned char hashes[OUTPUT_SIZE*8])
+template<size_t N>
+void CSHA256::FillFinalBlocks(unsigned char* blocks, const unsigned char* nonce1, const unsigned char* nonce2, const unsigned char* final) const
 {
-    std::array<unsigned char, 8*64> blocks = {};
-    for (int i = 0; i < 8; ++i) {
-        std::copy(nonce1, nonce1 + 4, blocks.begin() + i*64 + 0);
-        std::copy(nonce2, nonce2 + 4, blocks.begin() + i*64 + 4);
-        std::copy(final, final + 4, blocks.begin() + i*64 + 8);
+    memset(blocks, 0, N*64);
+    for (size_t i = 0; i < N; ++i) {
+        std::copy(nonce1, nonce1 + 4, blocks + i*64 + 0);
+        std::copy(nonce2, nonce2 + 4, blocks + i*64 + 4);
+        std::copy(final, final + 4, blocks + i*64 + 8);
         blocks[i*64 + 12] = 0x80; // padding byte
-        WriteBE64(blocks.data() + i*64 + 56, (bytes + 12) << 3);
+        WriteBE64(blocks + i*64 + 56, (bytes + 12) << 3);
         nonce2 += 4;
     }
-    SHA256Midstate(hashes, s, blocks.data(), 8);
+}
+
+template<size_t N>
+void CSHA256::WriteAndFinalizeN(const unsigned char* nonce1, const unsigned char* nonce2, const unsigned char* final, unsigned char* hashes)
+{
+    std::array<unsigned char, N*64> blocks;
+    FillFinalBlocks<N>(blocks.data(), nonce1, nonce2, final);
+    SHA256Midstate(hashes, s, blocks.data(), N);
+}
+
+template<size_t N>
+void CSHA256::WriteAndFilterN(const unsigned char* nonce1, const unsigned char* nonce2, const unsigned char* final, uint32_t* words)
+{
+    std::array<unsigned char, N*64> blocks;
+    FillFinalBlocks<N>(blocks.data(), nonce1, nonce2, final);
+    SHA256MidstateFirstWord(words, s, blocks.data(), N);
+}
+
+void CSHA256::FinalizeSuffixes(const unsigned char* suffixes, size_t len, size_t count, unsigned char* hashes) const
+{
+    assert(bytes % 64 == 0 && len <= 55);
+    std::vector<unsigned char> blocks(count * 64, 0);
+    for (size_t i = 0; i < count; ++i) {
+        std::copy(suffixes + i*len, suffixes + (i+1)*len, blocks.data() + i*64);
+        blocks[i*64 + len] = 0x80; // padding byte
+        WriteBE64(blocks.data() + i*64 + 56, (bytes + len) << 3);
+    }
+    SHA256Midstate(hashes, s, blocks.data(), count);
+}
+
+void CSHA256::WriteAndFinalize8(const unsigned char* nonce1, const unsigned char* nonce2, const unsigned char* final, unsigned char hashes[OUTPUT_SIZE*8])
+{
+    WriteAndFinalizeN<8>(nonce1, nonce2, final, hashes);
+}
+
+void CSHA256::WriteAndFinalize16(const unsigned char* nonce1, const unsigned char* nonce2, const unsigned char* final, unsigned char hashes[OUTPUT_SIZE*16])
+{
+    WriteAndFinalizeN<16>(nonce1, nonce2, final, hashes);
+}
+
+void CSHA256::WriteAndFilter8(const unsigned char* nonce1, const unsigned char* nonce2, const unsigned char* final, uint32_t words[8])
+{
+    WriteAndFilterN<8>(nonce1, nonce2, final, words);
+}
+
+void CSHA256::WriteAndFilter16(const unsigned char* nonce1, const unsigned char* nonce2, const unsigned char* final, uint32_t words[16])
+{
+    WriteAndFilterN<16>(nonce1, nonce2, final, words);
+}
+
+void CSHA256::PrecomputeNonce1(const unsigned char* nonce1, const unsigned char* final, SHA256NoncePrecomp& pre) const
+{
+    using namespace sha256;
+
+    std::copy(s, s + 8, pre.s);
+    const uint64_t bits = (bytes + 12) << 3;
+    pre.w0 = ReadBE32(nonce1);
+    pre.w2 = ReadBE32(final);
+    pre.w14 = bits >> 32;
+    pre.w15 = bits & 0xfffffffful;
+
+    uint32_t a = s[0], b = s[1], c = s[2], d = s[3], e = s[4], f = s[5], g = s[6], h = s[7];
+
+    // Round 0 only depends on nonce1.
+    Round(a, b, c, d, e, f, g, h, 0x428a2f98ul + pre.w0);
+
+    // Round 1 only depends on nonce2 through W1, which the mining kernels
+    // add to both of the updated words.
+    uint32_t t1 = g + Sigma1(d) + Ch(d, e, f) + 0x71374491ul;
+    uint32_t t2 = Sigma0(h) + Maj(h, a, b);
+    c += t1;
+    g = t1 + t2;
+
+    pre.a = a;
+    pre.b = b;
+    pre.c = c;
+    pre.d = d;
+    pre.e = e;
+    pre.g = g;
+    pre.h = h;
+
+    // Round 2's t1 = f + Sigma1(c) + Ch(c, d, e) + K2 + W2, which depends on
+    // nonce2 through c only.
+    pre.k2 = f + 0xb5c0fbcful + pre.w2;
+
+    // Message schedule, with W3 = 0x80000000 and W4..W13 = 0.
+    pre.w16 = pre.w0 + sigma1(pre.w14);
+    pre.w17 = sigma0(pre.w2) + sigma1(pre.w15);
+    pre.w18 = pre.w2 + sigma0(0x80000000ul);
+    pre.w29 = sigma0(pre.w14);
+    pre.w30 = pre.w14 + sigma0(pre.w15);
 }
 
 void CSHA256::Finalize(unsigned char hash[OUTPUT_SIZE])
@@ -803,8 +1194,54 @@ void SHA256D64(unsigned char* out, const unsigned char* in, size_t blocks)
     }
 }
 
+void SHA256Hash64(unsigned char* out, const unsigned char* in, size_t blocks)
+{
+    // The first block of each message is hashed from the initial state, and
+    // the second, which is nothing but the padding for a 64-byte message,
+    // from each message's own intermediate state.  Messages are taken a
+    // bounded number at a time to keep the scratch space on the stack.
+    static const size_t CHUNK = 64;
+    uint32_t iv[8];
+    sha256::Initialize(iv);
+    unsigned char padding[64 * CHUNK] = {};
+    for (size_t i = 0; i < CHUNK; ++i) {
+        padding[64*i] = 0x80;
+        WriteBE64(padding + 64*i + 56, 64 << 3);
+    }
+    unsigned char inner[32 * CHUNK];
+    uint32_t midstates[8 * CHUNK];
+    while (blocks) {
+        const size_t n = std::min(blocks, CHUNK);
+        SHA256Midstate(inner, iv, in, n);
+        for (size_t i = 0; i < 8 * n; ++i) {
+            midstates[i] = ReadBE32(inner + 4*i);
+        }
+        SHA256Midstates(out, midstates, padding, n);
+        out += 32 * n;
+        in += 64 * n;
+        blocks -= n;
+    }
+}
+
+size_t SHA256MidstateLanes()
+{
+    if (Transform_16way) return 16;
+    if (Transform_8way) return 8;
+    if (Transform_4way) return 4;
+    if (Transform_2way) return 2;
+    return 1;
+}
+
 void SHA256Midstate(unsigned char* out, const uint32_t* midstate, const unsigned char* in, size_t blocks)
 {
+    if (Transform_16way) {
+        while (blocks >= 16) {
+            Transform_16way(out, midstate, in);
+            out += 512;
+            in += 1024;
+            blocks -= 16;
+        }
+    }
     if (Transform_8way) {
         while (blocks >= 8) {
             Transform_8way(out, midstate, in);
@@ -842,4 +1279,179 @@ void SHA256Midstate(unsigned char* out, const uint32_t* midstate, const unsigned
     }
 }
 
+void SHA256MidstateFirstWord(uint32_t* out, const uint32_t* midstate, const unsigned char* in, size_t blocks)
+{
+    if (TransformFilter_16way) {
+        while (blocks >= 16) {
+            TransformFilter_16way(out, midstate, in);
+            out += 16;
+            in += 1024;
+            blocks -= 16;
+        }
+    }
+    if (TransformFilter_8way) {
+        while (blocks >= 8) {
+            TransformFilter_8way(out, midstate, in);
+            out += 8;
+            in += 512;
+            blocks -= 8;
+        }
+    }
+    if (TransformFilter_4way) {
+        while (blocks >= 4) {
+            TransformFilter_4way(out, midstate, in);
+            out += 4;
+            in += 256;
+            blocks -= 4;
+        }
+    }
+    while (blocks) {
+        std::array<uint32_t, 8> s;
+        std::copy(midstate, midstate + 8, s.data());
+        Transform(s.data(), in, 1);
+        *out = s[0];
+        ++out;
+        in += 64;
+        --blocks;
+    }
+}
+
+void SHA256Midstates(unsigned char* out, const uint32_t* midstates, const unsigned char* in, size_t blocks)
+{
+    if (TransformStates_16way) {
+        while (blocks >= 16) {
+            TransformStates_16way(out, midstates, in);
+            out += 512;
+            midstates += 128;
+            in += 1024;
+            blocks -= 16;
+        }
+    }
+    if (TransformStates_8way) {
+        while (blocks >= 8) {
+            TransformStates_8way(out, midstates, in);
+            out += 256;
+            midstates += 64;
+            in += 512;
+            blocks -= 8;
+        }
+    }
+    if (TransformStates_4way) {
+        while (blocks >= 4) {
+            TransformStates_4way(out, midstates, in);
+            out += 128;
+            midstates += 32;
+            in += 256;
+            blocks -= 4;
+        }
+    }
+    while (blocks) {
+        std::array<uint32_t, 8> s;
+        std::copy(midstates, midstates + 8, s.data());
+        Transform(s.data(), in, 1);
+        for (int i = 0; i < 8; ++i) {
+            WriteBE32(out, s[i]);
+            out += 4;
+        }
+        midstates += 8;
+        in += 64;
+        --blocks;
+    }
+}
+
+void SHA256MidstatesFirstWord(uint32_t* out, const uint32_t* midstates, const unsigned char* in, size_t blocks)
+{
+    if (TransformStatesFilter_16way) {
+        while (blocks >= 16) {
+            TransformStatesFilter_16way(out, midstates, in);
+            out += 16;
+            midstates += 128;
+            in += 1024;
+            blocks -= 16;
+        }
+    }
+    if (TransformStatesFilter_8way) {
+        while (blocks >= 8) {
+            TransformStatesFilter_8way(out, midstates, in);
+            out += 8;
+            midstates += 64;
+            in += 512;
+            blocks -= 8;
+        }
+    }
+    if (TransformStatesFilter_4way) {
+        while (blocks >= 4) {
+            TransformStatesFilter_4way(out, midstates, in);
+            out += 4;
+            midstates += 32;
+            in += 256;
+            blocks -= 4;
+        }
+    }
+    while (blocks) {
+        std::array<uint32_t, 8> s;
+        std::copy(midstates, midstates + 8, s.data());
+        Transform(s.data(), in, 1);
+        *out = s[0];
+        ++out;
+        midstates += 8;
+        in += 64;
+        --blocks;
+    }
+}
+
+void SHA256Nonce2FirstWord(uint32_t* out, const SHA256NoncePrecomp& pre, const unsigned char* nonce2, size_t count)
+{
+    if (TransformNonce2_16way) {
+        while (count >= 16) {
+            TransformNonce2_16way(out, pre, nonce2);
+            out += 16;
+            nonce2 += 64;
+            count -= 16;
+        }
+    }
+    if (TransformNonce2_8way) {
+        while (count >= 8) {
+            TransformNonce2_8way(out, pre, nonce2);
+            out += 8;
+            nonce2 += 32;
+            count -= 8;
+        }
+    }
+    // Build the remaining blocks and fall back to the generic kernels.
+    while (count) {
+        const size_t n = std::min<size_t>(count, 16);
+        std::array<unsigned char, 16*64> blocks;
+        FillNonce2Blocks(blocks.data(), pre, nonce2, n);
+        SHA256MidstateFirstWord(out, pre.s, blocks.data(), n);
+        out += n;
+        nonce2 += n*4;
+        count -= n;
+    }
+}
+
+const std::vector<SHA256MiningKernel>& SHA256MiningKernels()
+{
+    return MiningKernels;
+}
+
+void SHA256Nonce2FirstWord(const SHA256MiningKernel& kernel, uint32_t* out, const SHA256NoncePrecomp& pre, const unsigned char* nonce2, size_t count)
+{
+    while (count >= kernel.lanes) {
+        kernel.transform(out, pre, nonce2);
+        out += kernel.lanes;
+        nonce2 += 4*kernel.lanes;
+        count -= kernel.lanes;
+    }
+    if (count) {
+        // Pad the final, partial batch out to the kernel's width.
+        unsigned char buf[4*64] = {0};
+        uint32_t words[64];
+        assert(kernel.lanes <= 64);
+        std::copy(nonce2, nonce2 + 4*count, buf);
+        kernel.transform(words, pre, buf);
+        std::copy(words, words + count, out);
+    }
+}
+
 // End of File
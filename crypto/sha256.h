@@ -11,6 +11,24 @@
 #include <stdint.h>
 #include <stdlib.h>
 #include <string>
+#include <vector>
+
+/** Work shared by every mining hash with the same midstate and first nonce
+ *  word.  Computed by CSHA256::PrecomputeNonce1() and used by
+ *  SHA256Nonce2FirstWord(). */
+struct SHA256NoncePrecomp {
+    // The midstate, which is added back in at the end.
+    uint32_t s[8];
+    // Message words which don't depend on nonce2.
+    uint32_t w0, w2, w14, w15;
+    // Working variables after rounds 0 and 1, minus the contribution of W1
+    // to c and g.  (f is unused, as round 2 overwrites it.)
+    uint32_t a, b, c, d, e, g, h;
+    // The part of round 2's t1 which doesn't depend on nonce2.
+    uint32_t k2;
+    // The parts of the message schedule which don't depend on nonce2.
+    uint32_t w16, w17, w18, w29, w30;
+};
 
 /** A hasher class for SHA-256. */
 class CSHA256
@@ -20,6 +38,13 @@ private:
     unsigned char buf[64];
     uint64_t bytes;
 
+    template<size_t N>
+    void FillFinalBlocks(unsigned char* blocks, const unsigned char* nonce1, const unsigned char* nonce2, const unsigned char* final) const;
+    template<size_t N>
+    void WriteAndFinalizeN(const unsigned char* nonce1, const unsigned char* nonce2, const unsigned char* final, unsigned char* hashes);
+    template<size_t N>
+    void WriteAndFilterN(const unsigned char* nonce1, const unsigned char* nonce2, const unsigned char* final, uint32_t* words);
+
 public:
     static const size_t OUTPUT_SIZE = 32;
 
@@ -27,13 +52,44 @@ public:
     CSHA256& Write(const unsigned char* data, size_t len);
     void Finalize(unsigned char hash[OUTPUT_SIZE]);
     void WriteAndFinalize8(const unsigned char* nonce1, const unsigned char* nonce2, const unsigned char* final, unsigned char hash[OUTPUT_SIZE*8]);
+    void WriteAndFinalize16(const unsigned char* nonce1, const unsigned char* nonce2, const unsigned char* final, unsigned char hash[OUTPUT_SIZE*16]);
+    /** Like WriteAndFinalize8/16, but only compute the first 32-bit word of
+     *  each digest, as a native integer (i.e. ReadBE32 of the hash).  Used to
+     *  cheaply filter mining candidates before computing the full hash. */
+    void WriteAndFilter8(const unsigned char* nonce1, const unsigned char* nonce2, const unsigned char* final, uint32_t words[8]);
+    void WriteAndFilter16(const unsigned char* nonce1, const unsigned char* nonce2, const unsigned char* final, uint32_t words[16]);
+    /** Precompute everything about the final block nonce1 || nonce2 ||
+     *  final which does not depend on nonce2. */
+    void PrecomputeNonce1(const unsigned char* nonce1, const unsigned char* final, SHA256NoncePrecomp& pre) const;
+    /** Compute the hashes of count messages which each continue from this
+     *  state with their own len-byte suffix, stored one after another.  The
+     *  data written so far must be a multiple of 64 bytes, and len at most
+     *  55, so that each message ends in a single block; the blocks are then
+     *  hashed in parallel. */
+    void FinalizeSuffixes(const unsigned char* suffixes, size_t len, size_t count, unsigned char* hashes) const;
     CSHA256& Reset();
 };
 
-/** Autodetect the best available SHA256 implementation.
+namespace sha256_implementation {
+/** Which implementations SHA256AutoDetect() may choose from, e.g. to
+ *  benchmark each of them in turn. */
+enum UseImplementation : uint8_t {
+    STANDARD = 0,
+    USE_SSE4 = 1 << 0,
+    USE_AVX2 = 1 << 1,
+    USE_SHANI = 1 << 2,
+    USE_AVX512 = 1 << 3,
+    USE_SSE4_AND_AVX2 = USE_SSE4 | USE_AVX2,
+    USE_SSE4_AND_SHANI = USE_SSE4 | USE_SHANI,
+    USE_ALL = USE_SSE4 | USE_AVX2 | USE_SHANI | USE_AVX512,
+};
+}
+
+/** Autodetect the best available SHA256 implementation, out of those
+ *  permitted by use_implementation.  May be called again to choose again.
  *  Returns the name of the implementation.
  */
-std::string SHA256AutoDetect();
+std::string SHA256AutoDetect(sha256_implementation::UseImplementation use_implementation = sha256_implementation::USE_ALL);
 
 /** Compute multiple double-SHA256's of 64-byte blobs.
  *  output:  pointer to a blocks*32 byte output buffer
@@ -42,8 +98,67 @@ std::string SHA256AutoDetect();
  */
 void SHA256D64(unsigned char* output, const unsigned char* input, size_t blocks);
 
+/** Compute multiple SHA256's of 64-byte blobs, such as the hex-encoded
+ *  secrets of webcash, using the multi-way transforms.
+ *  output:  pointer to a blocks*32 byte output buffer
+ *  input:   pointer to a blocks*64 byte input buffer
+ *  blocks:  the number of hashes to compute.
+ */
+void SHA256Hash64(unsigned char* output, const unsigned char* input, size_t blocks);
+
 void SHA256Midstate(unsigned char* out, const uint32_t* midstate, const unsigned char* in, size_t blocks);
 
+/** Like SHA256Midstate, but only output the first 32-bit word of each
+ *  resulting state.
+ *  out:     pointer to a blocks-long output array
+ */
+void SHA256MidstateFirstWord(uint32_t* out, const uint32_t* midstate, const unsigned char* in, size_t blocks);
+
+/** Like SHA256Midstate, but with a separate midstate for each block, so
+ *  that blocks of unrelated messages can be hashed together.
+ *  midstates: pointer to blocks*8 words, with block i's midstate at
+ *             midstates[8*i..8*i+7]
+ */
+void SHA256Midstates(unsigned char* out, const uint32_t* midstates, const unsigned char* in, size_t blocks);
+
+/** Like SHA256MidstateFirstWord, but with a separate midstate for each
+ *  block, as in SHA256Midstates.
+ */
+void SHA256MidstatesFirstWord(uint32_t* out, const uint32_t* midstates, const unsigned char* in, size_t blocks);
+
+/** Compute the first word of the hash of midstate || nonce1 || nonce2 ||
+ *  final, for count consecutive 4-byte nonce2 values.
+ *  out:     pointer to a count-long output array
+ *  pre:     state precomputed from midstate, nonce1 and final
+ *  nonce2:  pointer to count*4 bytes of nonces
+ */
+void SHA256Nonce2FirstWord(uint32_t* out, const SHA256NoncePrecomp& pre, const unsigned char* nonce2, size_t count);
+
+/** A kernel for the inner mining loop: computes the first word of the
+ *  hash for lanes consecutive nonce2 values, like SHA256Nonce2FirstWord().
+ */
+struct SHA256MiningKernel {
+    const char* name;
+    size_t lanes;
+    void (*transform)(uint32_t* out, const SHA256NoncePrecomp& pre, const unsigned char* nonce2);
+};
+
+/** Return every mining kernel this CPU supports, regardless of which
+ *  implementation SHA256AutoDetect() prefers.  The kernel used by
+ *  SHA256Nonce2FirstWord() is first, and a scalar kernel is always last.
+ */
+const std::vector<SHA256MiningKernel>& SHA256MiningKernels();
+
+/** Like SHA256Nonce2FirstWord(), but using the given kernel.  count need
+ *  not be a multiple of the kernel's lane count.
+ */
+void SHA256Nonce2FirstWord(const SHA256MiningKernel& kernel, uint32_t* out, const SHA256NoncePrecomp& pre, const unsigned char* nonce2, size_t count);
+
+/** Return the number of blocks processed in parallel by the widest
+ *  multi-way midstate transform selected by SHA256AutoDetect().
+ */
+size_t SHA256MidstateLanes();
+
 #endif // BITCOIN_CRYPTO_SHA256_H
 
 // End of File
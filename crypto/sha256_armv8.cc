@@ -32,6 +32,7 @@
 # endif
 
 #include <array>
+#include <utility>
 
 #include <stddef.h>
 
@@ -916,6 +917,125 @@ void Transform_2way(unsigned char* output, const unsigned char* input)
 }
 } // sha256d64_armv8
 
+namespace sha256multi_armv8 {
+
+namespace {
+
+template<typename F, int... I>
+inline __attribute__((always_inline)) void Interleave(F&& f, std::integer_sequence<int, I...>)
+{
+    (f(I), ...);
+}
+
+/** Apply f to each of 0..N-1, unrolled at compile time. */
+template<int N, typename F>
+inline __attribute__((always_inline)) void Interleave(F&& f)
+{
+    Interleave(f, std::make_integer_sequence<int, N>());
+}
+
+/**
+ * Transform N independent 64-byte blocks, interleaving the instruction
+ * streams to hide the latency of the SHA2 instructions.  Every lane starts
+ * from the same midstate, or if PerLane is set, lane i starts from
+ * state[8*i..8*i+7].  The midstate is added back in before returning.
+ */
+template<int N, bool PerLane>
+inline __attribute__((always_inline)) void MidstateRounds(uint32x4_t (&STATE0)[N], uint32x4_t (&STATE1)[N], const uint32_t* state, const unsigned char* input)
+{
+    uint32x4_t MSG[N][4];
+    uint32x4_t TMP0, TMP2;
+
+    // Load state
+    uint32x4_t ABEF_SAVE[N], CDGH_SAVE[N];
+    Interleave<N>([&](int i) {
+        ABEF_SAVE[i] = vld1q_u32(&state[PerLane ? 8*i : 0]);
+        CDGH_SAVE[i] = vld1q_u32(&state[PerLane ? 8*i + 4 : 4]);
+        STATE0[i] = ABEF_SAVE[i];
+        STATE1[i] = CDGH_SAVE[i];
+    });
+
+    // Load and convert input data to Big Endian
+    Interleave<N>([&](int i) {
+        Interleave<4>([&](int j) {
+            MSG[i][j] = vreinterpretq_u32_u8(vrev32q_u8(vld1q_u8(input + 64*i + 16*j)));
+        });
+    });
+
+    // Rounds 1-48 update the message schedule, rounds 49-64 don't.
+    Interleave<16>([&](int r) {
+        const uint32x4_t K4 = vld1q_u32(&K[4*r]);
+        Interleave<N>([&](int i) {
+            uint32x4_t (&M)[4] = MSG[i];
+            TMP0 = vaddq_u32(M[r % 4], K4);
+            TMP2 = STATE0[i];
+            if (r < 12) M[r % 4] = vsha256su0q_u32(M[r % 4], M[(r + 1) % 4]);
+            STATE0[i] = vsha256hq_u32(STATE0[i], STATE1[i], TMP0);
+            STATE1[i] = vsha256h2q_u32(STATE1[i], TMP2, TMP0);
+            if (r < 12) M[r % 4] = vsha256su1q_u32(M[r % 4], M[(r + 2) % 4], M[(r + 3) % 4]);
+        });
+    });
+
+    // Update state
+    Interleave<N>([&](int i) {
+        STATE0[i] = vaddq_u32(STATE0[i], ABEF_SAVE[i]);
+        STATE1[i] = vaddq_u32(STATE1[i], CDGH_SAVE[i]);
+    });
+}
+
+template<int N, bool PerLane = false>
+inline __attribute__((always_inline)) void Transform(unsigned char* output, const uint32_t* state, const unsigned char* input)
+{
+    uint32x4_t STATE0[N], STATE1[N];
+    MidstateRounds<N, PerLane>(STATE0, STATE1, state, input);
+
+    // Store result
+    Interleave<N>([&](int i) {
+        vst1q_u8(output + 32*i, vrev32q_u8(vreinterpretq_u8_u32(STATE0[i])));
+        vst1q_u8(output + 32*i + 16, vrev32q_u8(vreinterpretq_u8_u32(STATE1[i])));
+    });
+}
+
+template<int N, bool PerLane = false>
+inline __attribute__((always_inline)) void TransformFilter(uint32_t* output, const uint32_t* state, const unsigned char* input)
+{
+    uint32x4_t STATE0[N], STATE1[N];
+    MidstateRounds<N, PerLane>(STATE0, STATE1, state, input);
+
+    // Store the first word of each hash
+    Interleave<N>([&](int i) {
+        output[i] = vgetq_lane_u32(STATE0[i], 0);
+    });
+}
+
+} // anonymous
+
+void Transform_2way(unsigned char* output, const uint32_t* state, const unsigned char* input)
+{
+    Transform<2>(output, state, input);
+}
+
+void Transform_4way(unsigned char* output, const uint32_t* state, const unsigned char* input)
+{
+    Transform<4>(output, state, input);
+}
+
+void TransformFilter_4way(uint32_t* output, const uint32_t* state, const unsigned char* input)
+{
+    TransformFilter<4>(output, state, input);
+}
+
+void TransformStates_4way(unsigned char* output, const uint32_t* state, const unsigned char* input)
+{
+    Transform<4, true>(output, state, input);
+}
+
+void TransformStatesFilter_4way(uint32_t* output, const uint32_t* state, const unsigned char* input)
+{
+    TransformFilter<4, true>(output, state, input);
+}
+} // sha256multi_armv8
+
 #endif // ARM
 
 // End of File
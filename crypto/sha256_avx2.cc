@@ -11,6 +11,7 @@
 #include <immintrin.h>
 
 #include "crypto/common.h"
+#include "crypto/sha256.h"
 
 namespace {
 
@@ -72,22 +73,22 @@ void inline Write8(unsigned char* out, int offset, __m256i v) {
     WriteLE32(out + 224 + offset, _mm256_extract_epi32(v, 0));
 }
 
+/** Load a separate midstate into each lane, where lane i's state is
+ *  s[8*i..8*i+7]. */
+void inline __attribute__((always_inline)) LoadMidstates(__m256i* v, const uint32_t* s)
+{
+    // Lane 0 is the most significant element, as in Read8().
+    const __m256i index = _mm256_set_epi32(0, 8, 16, 24, 32, 40, 48, 56);
+    for (int i = 0; i < 8; ++i) {
+        v[i] = _mm256_i32gather_epi32((const int*)(s + i), index, 4);
+    }
 }
 
-namespace sha256multi_avx2 {
-
-void Transform_8way(unsigned char* out, const uint32_t* s, const unsigned char* in)
+/** Perform the 64 rounds of a midstate transform, starting from the
+ *  midstate in a..h and leaving the working variables (before the final
+ *  addition of the midstate) in a..h. */
+void inline __attribute__((always_inline)) MidstateRounds(__m256i& a, __m256i& b, __m256i& c, __m256i& d, __m256i& e, __m256i& f, __m256i& g, __m256i& h, const unsigned char* in)
 {
-    // Transform 1
-    __m256i a = K(s[0]);
-    __m256i b = K(s[1]);
-    __m256i c = K(s[2]);
-    __m256i d = K(s[3]);
-    __m256i e = K(s[4]);
-    __m256i f = K(s[5]);
-    __m256i g = K(s[6]);
-    __m256i h = K(s[7]);
-
     __m256i w0, w1, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
 
     Round(a, b, c, d, e, f, g, h, Add(K(0x428a2f98ul), w0 = Read8(in, 0)));
@@ -154,6 +155,16 @@ void Transform_8way(unsigned char* out, const uint32_t* s, const unsigned char*
     Round(d, e, f, g, h, a, b, c, Add(K(0xa4506cebul), Inc(w13, sigma1(w11), w6, sigma0(w14))));
     Round(c, d, e, f, g, h, a, b, Add(K(0xbef9a3f7ul), Inc(w14, sigma1(w12), w7, sigma0(w15))));
     Round(b, c, d, e, f, g, h, a, Add(K(0xc67178f2ul), Inc(w15, sigma1(w13), w8, sigma0(w0))));
+}
+
+}
+
+namespace sha256multi_avx2 {
+
+void Transform_8way(unsigned char* out, const uint32_t* s, const unsigned char* in)
+{
+    __m256i a = K(s[0]), b = K(s[1]), c = K(s[2]), d = K(s[3]), e = K(s[4]), f = K(s[5]), g = K(s[6]), h = K(s[7]);
+    MidstateRounds(a, b, c, d, e, f, g, h, in);
 
     // Output
     Write8(out, 0, Add(a, K(s[0])));
@@ -166,6 +177,147 @@ void Transform_8way(unsigned char* out, const uint32_t* s, const unsigned char*
     Write8(out, 28, Add(h, K(s[7])));
 }
 
+void TransformFilter_8way(uint32_t* out, const uint32_t* s, const unsigned char* in)
+{
+    __m256i a = K(s[0]), b = K(s[1]), c = K(s[2]), d = K(s[3]), e = K(s[4]), f = K(s[5]), g = K(s[6]), h = K(s[7]);
+    MidstateRounds(a, b, c, d, e, f, g, h, in);
+
+    // Only the first word of each digest is needed, so the compiler is
+    // free to drop everything that does not contribute to it.
+    alignas(32) uint32_t tmp[8];
+    _mm256_store_si256((__m256i*)tmp, Add(a, K(s[0])));
+    for (int i = 0; i < 8; ++i) {
+        out[i] = tmp[7 - i];
+    }
+}
+
+void TransformStates_8way(unsigned char* out, const uint32_t* s, const unsigned char* in)
+{
+    __m256i v[8];
+    LoadMidstates(v, s);
+    __m256i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+    MidstateRounds(a, b, c, d, e, f, g, h, in);
+
+    // Output
+    Write8(out, 0, Add(a, v[0]));
+    Write8(out, 4, Add(b, v[1]));
+    Write8(out, 8, Add(c, v[2]));
+    Write8(out, 12, Add(d, v[3]));
+    Write8(out, 16, Add(e, v[4]));
+    Write8(out, 20, Add(f, v[5]));
+    Write8(out, 24, Add(g, v[6]));
+    Write8(out, 28, Add(h, v[7]));
+}
+
+void TransformStatesFilter_8way(uint32_t* out, const uint32_t* s, const unsigned char* in)
+{
+    __m256i v[8];
+    LoadMidstates(v, s);
+    __m256i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+    MidstateRounds(a, b, c, d, e, f, g, h, in);
+
+    alignas(32) uint32_t tmp[8];
+    _mm256_store_si256((__m256i*)tmp, Add(a, v[0]));
+    for (int i = 0; i < 8; ++i) {
+        out[i] = tmp[7 - i];
+    }
+}
+
+}
+
+namespace sha256mine_avx2 {
+
+void Transform_8way(uint32_t* out, const SHA256NoncePrecomp& pre, const unsigned char* nonce2)
+{
+    // W1 holds nonce2, which is the only message word that differs between
+    // lanes.  Round 2 uses it for the first time through the state, so the
+    // state after rounds 0 and 1 is read from the precomputed values (with
+    // W1 added in), and only the lane-dependent part of round 2 is done here.
+    __m256i w1 = _mm256_shuffle_epi8(_mm256_loadu_si256((const __m256i*)nonce2), _mm256_set_epi32(0x0C0D0E0FUL, 0x08090A0BUL, 0x04050607UL, 0x00010203UL, 0x0C0D0E0FUL, 0x08090A0BUL, 0x04050607UL, 0x00010203UL));
+
+    __m256i a = K(pre.a);
+    __m256i b = K(pre.b);
+    __m256i c = Add(K(pre.c), w1);
+    __m256i d = K(pre.d);
+    __m256i e = K(pre.e);
+    __m256i f;
+    __m256i g = Add(K(pre.g), w1);
+    __m256i h = K(pre.h);
+
+    __m256i w0, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
+
+    __m256i t1 = Add(K(pre.k2), Sigma1(c), Ch(c, d, e));
+    __m256i t2 = Add(Sigma0(g), Maj(g, h, a));
+    b = Add(b, t1);
+    f = Add(t1, t2);
+
+    // W3 through W15 are the fixed padding and length of the final block.
+    Round(f, g, h, a, b, c, d, e, K(0x69b5dba5ul)); // W3 = 0x80000000
+    Round(e, f, g, h, a, b, c, d, K(0x3956c25bul));
+    Round(d, e, f, g, h, a, b, c, K(0x59f111f1ul));
+    Round(c, d, e, f, g, h, a, b, K(0x923f82a4ul));
+    Round(b, c, d, e, f, g, h, a, K(0xab1c5ed5ul));
+    Round(a, b, c, d, e, f, g, h, K(0xd807aa98ul));
+    Round(h, a, b, c, d, e, f, g, K(0x12835b01ul));
+    Round(g, h, a, b, c, d, e, f, K(0x243185beul));
+    Round(f, g, h, a, b, c, d, e, K(0x550c7dc3ul));
+    Round(e, f, g, h, a, b, c, d, K(0x72be5d74ul));
+    Round(d, e, f, g, h, a, b, c, K(0x80deb1feul));
+    Round(c, d, e, f, g, h, a, b, K(0x9bdc06a7ul + pre.w14));
+    Round(b, c, d, e, f, g, h, a, K(0xc19bf174ul + pre.w15));
+    Round(a, b, c, d, e, f, g, h, Add(K(0xe49b69c1ul), w0 = Add(K(pre.w16), sigma0(w1))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0xefbe4786ul), Inc(w1, K(pre.w17))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0x0fc19dc6ul), w2 = Add(K(pre.w18), sigma1(w0))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0x240ca1ccul), w3 = Add(K(0x80000000ul), sigma1(w1))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x2de92c6ful), w4 = sigma1(w2)));
+    Round(d, e, f, g, h, a, b, c, Add(K(0x4a7484aaul), w5 = sigma1(w3)));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x5cb0a9dcul), w6 = Add(K(pre.w15), sigma1(w4))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0x76f988daul), w7 = Add(w0, sigma1(w5))));
+    Round(a, b, c, d, e, f, g, h, Add(K(0x983e5152ul), w8 = Add(w1, sigma1(w6))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0xa831c66dul), w9 = Add(w2, sigma1(w7))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0xb00327c8ul), w10 = Add(w3, sigma1(w8))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0xbf597fc7ul), w11 = Add(w4, sigma1(w9))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0xc6e00bf3ul), w12 = Add(w5, sigma1(w10))));
+    Round(d, e, f, g, h, a, b, c, Add(K(0xd5a79147ul), w13 = Add(K(pre.w29), w6, sigma1(w11))));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x06ca6351ul), w14 = Add(K(pre.w30), w7, sigma1(w12))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0x14292967ul), w15 = Add(K(pre.w15), sigma0(w0), w8, sigma1(w13))));
+    Round(a, b, c, d, e, f, g, h, Add(K(0x27b70a85ul), Inc(w0, sigma1(w14), w9, sigma0(w1))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0x2e1b2138ul), Inc(w1, sigma1(w15), w10, sigma0(w2))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0x4d2c6dfcul), Inc(w2, sigma1(w0), w11, sigma0(w3))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0x53380d13ul), Inc(w3, sigma1(w1), w12, sigma0(w4))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x650a7354ul), Inc(w4, sigma1(w2), w13, sigma0(w5))));
+    Round(d, e, f, g, h, a, b, c, Add(K(0x766a0abbul), Inc(w5, sigma1(w3), w14, sigma0(w6))));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x81c2c92eul), Inc(w6, sigma1(w4), w15, sigma0(w7))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0x92722c85ul), Inc(w7, sigma1(w5), w0, sigma0(w8))));
+    Round(a, b, c, d, e, f, g, h, Add(K(0xa2bfe8a1ul), Inc(w8, sigma1(w6), w1, sigma0(w9))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0xa81a664bul), Inc(w9, sigma1(w7), w2, sigma0(w10))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0xc24b8b70ul), Inc(w10, sigma1(w8), w3, sigma0(w11))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0xc76c51a3ul), Inc(w11, sigma1(w9), w4, sigma0(w12))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0xd192e819ul), Inc(w12, sigma1(w10), w5, sigma0(w13))));
+    Round(d, e, f, g, h, a, b, c, Add(K(0xd6990624ul), Inc(w13, sigma1(w11), w6, sigma0(w14))));
+    Round(c, d, e, f, g, h, a, b, Add(K(0xf40e3585ul), Inc(w14, sigma1(w12), w7, sigma0(w15))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0x106aa070ul), Inc(w15, sigma1(w13), w8, sigma0(w0))));
+    Round(a, b, c, d, e, f, g, h, Add(K(0x19a4c116ul), Inc(w0, sigma1(w14), w9, sigma0(w1))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0x1e376c08ul), Inc(w1, sigma1(w15), w10, sigma0(w2))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0x2748774cul), Inc(w2, sigma1(w0), w11, sigma0(w3))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0x34b0bcb5ul), Inc(w3, sigma1(w1), w12, sigma0(w4))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x391c0cb3ul), Inc(w4, sigma1(w2), w13, sigma0(w5))));
+    Round(d, e, f, g, h, a, b, c, Add(K(0x4ed8aa4aul), Inc(w5, sigma1(w3), w14, sigma0(w6))));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x5b9cca4ful), Inc(w6, sigma1(w4), w15, sigma0(w7))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0x682e6ff3ul), Inc(w7, sigma1(w5), w0, sigma0(w8))));
+    Round(a, b, c, d, e, f, g, h, Add(K(0x748f82eeul), Inc(w8, sigma1(w6), w1, sigma0(w9))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0x78a5636ful), Inc(w9, sigma1(w7), w2, sigma0(w10))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0x84c87814ul), Inc(w10, sigma1(w8), w3, sigma0(w11))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0x8cc70208ul), Inc(w11, sigma1(w9), w4, sigma0(w12))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x90befffaul), Inc(w12, sigma1(w10), w5, sigma0(w13))));
+    Round(d, e, f, g, h, a, b, c, Add(K(0xa4506cebul), Inc(w13, sigma1(w11), w6, sigma0(w14))));
+    Round(c, d, e, f, g, h, a, b, Add(K(0xbef9a3f7ul), Inc(w14, sigma1(w12), w7, sigma0(w15))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0xc67178f2ul), Inc(w15, sigma1(w13), w8, sigma0(w0))));
+
+    // Output
+    _mm256_storeu_si256((__m256i*)out, Add(a, K(pre.s[0])));
+}
+
 }
 
 namespace sha256d64_avx2 {
@@ -0,0 +1,321 @@
+// Copyright (c) 2017-2019 The Bitcoin Core developers
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#if defined(__x86_64__) || defined(__amd64__)
+
+#include <stdint.h>
+#include <immintrin.h>
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+
+namespace {
+
+__m512i inline K(uint32_t x) { return _mm512_set1_epi32(x); }
+
+__m512i inline Add(__m512i x, __m512i y) { return _mm512_add_epi32(x, y); }
+__m512i inline Add(__m512i x, __m512i y, __m512i z) { return Add(Add(x, y), z); }
+__m512i inline Add(__m512i x, __m512i y, __m512i z, __m512i w) { return Add(Add(x, y), Add(z, w)); }
+__m512i inline Add(__m512i x, __m512i y, __m512i z, __m512i w, __m512i v) { return Add(Add(x, y, z), Add(w, v)); }
+__m512i inline Inc(__m512i& x, __m512i y) { x = Add(x, y); return x; }
+__m512i inline Inc(__m512i& x, __m512i y, __m512i z) { x = Add(x, y, z); return x; }
+__m512i inline Inc(__m512i& x, __m512i y, __m512i z, __m512i w) { x = Add(x, y, z, w); return x; }
+// AVX-512 has native three-input bitwise logic and 32-bit rotates, which
+// together remove most of the work in the round function.
+__m512i inline Xor(__m512i x, __m512i y, __m512i z) { return _mm512_ternarylogic_epi32(x, y, z, 0x96); }
+__m512i inline RoR(__m512i x, int n) { return _mm512_ror_epi32(x, n); }
+__m512i inline ShR(__m512i x, int n) { return _mm512_srli_epi32(x, n); }
+
+__m512i inline Ch(__m512i x, __m512i y, __m512i z) { return _mm512_ternarylogic_epi32(x, y, z, 0xca); }
+__m512i inline Maj(__m512i x, __m512i y, __m512i z) { return _mm512_ternarylogic_epi32(x, y, z, 0xe8); }
+__m512i inline Sigma0(__m512i x) { return Xor(RoR(x, 2), RoR(x, 13), RoR(x, 22)); }
+__m512i inline Sigma1(__m512i x) { return Xor(RoR(x, 6), RoR(x, 11), RoR(x, 25)); }
+__m512i inline sigma0(__m512i x) { return Xor(RoR(x, 7), RoR(x, 18), ShR(x, 3)); }
+__m512i inline sigma1(__m512i x) { return Xor(RoR(x, 17), RoR(x, 19), ShR(x, 10)); }
+
+/** One round of SHA-256. */
+void inline __attribute__((always_inline)) Round(__m512i a, __m512i b, __m512i c, __m512i& d, __m512i e, __m512i f, __m512i g, __m512i& h, __m512i k)
+{
+    __m512i t1 = Add(h, Sigma1(e), Ch(e, f, g), k);
+    __m512i t2 = Add(Sigma0(a), Maj(a, b, c));
+    d = Add(d, t1);
+    h = Add(t1, t2);
+}
+
+__m512i inline Read16(const unsigned char* chunk, int offset) {
+    return _mm512_setr_epi32(
+        ReadBE32(chunk + 0 + offset),
+        ReadBE32(chunk + 64 + offset),
+        ReadBE32(chunk + 128 + offset),
+        ReadBE32(chunk + 192 + offset),
+        ReadBE32(chunk + 256 + offset),
+        ReadBE32(chunk + 320 + offset),
+        ReadBE32(chunk + 384 + offset),
+        ReadBE32(chunk + 448 + offset),
+        ReadBE32(chunk + 512 + offset),
+        ReadBE32(chunk + 576 + offset),
+        ReadBE32(chunk + 640 + offset),
+        ReadBE32(chunk + 704 + offset),
+        ReadBE32(chunk + 768 + offset),
+        ReadBE32(chunk + 832 + offset),
+        ReadBE32(chunk + 896 + offset),
+        ReadBE32(chunk + 960 + offset)
+    );
+}
+
+/** Reverse the byte order of each 32-bit lane, without needing AVX-512BW. */
+__m512i inline ByteSwap(__m512i x) { return _mm512_ternarylogic_epi32(K(0xff00ff00ul), RoR(x, 8), RoR(x, 24), 0xca); }
+
+void inline Write16(unsigned char* out, int offset, __m512i v) {
+    alignas(64) uint32_t tmp[16];
+    _mm512_store_si512((__m512i*)tmp, v);
+    for (int i = 0; i < 16; ++i) {
+        WriteBE32(out + 32*i + offset, tmp[i]);
+    }
+}
+
+/** Load a separate midstate into each lane, where lane i's state is
+ *  s[8*i..8*i+7]. */
+void inline __attribute__((always_inline)) LoadMidstates(__m512i* v, const uint32_t* s)
+{
+    const __m512i index = _mm512_setr_epi32(0, 8, 16, 24, 32, 40, 48, 56, 64, 72, 80, 88, 96, 104, 112, 120);
+    for (int i = 0; i < 8; ++i) {
+        v[i] = _mm512_i32gather_epi32(index, (const int*)(s + i), 4);
+    }
+}
+
+/** Perform the 64 rounds of a midstate transform, starting from the
+ *  midstate in a..h and leaving the working variables (before the final
+ *  addition of the midstate) in a..h. */
+void inline __attribute__((always_inline)) MidstateRounds(__m512i& a, __m512i& b, __m512i& c, __m512i& d, __m512i& e, __m512i& f, __m512i& g, __m512i& h, const unsigned char* in)
+{
+    __m512i w0, w1, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
+
+    Round(a, b, c, d, e, f, g, h, Add(K(0x428a2f98ul), w0 = Read16(in, 0)));
+    Round(h, a, b, c, d, e, f, g, Add(K(0x71374491ul), w1 = Read16(in, 4)));
+    Round(g, h, a, b, c, d, e, f, Add(K(0xb5c0fbcful), w2 = Read16(in, 8)));
+    Round(f, g, h, a, b, c, d, e, Add(K(0xe9b5dba5ul), w3 = Read16(in, 12)));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x3956c25bul), w4 = Read16(in, 16)));
+    Round(d, e, f, g, h, a, b, c, Add(K(0x59f111f1ul), w5 = Read16(in, 20)));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x923f82a4ul), w6 = Read16(in, 24)));
+    Round(b, c, d, e, f, g, h, a, Add(K(0xab1c5ed5ul), w7 = Read16(in, 28)));
+    Round(a, b, c, d, e, f, g, h, Add(K(0xd807aa98ul), w8 = Read16(in, 32)));
+    Round(h, a, b, c, d, e, f, g, Add(K(0x12835b01ul), w9 = Read16(in, 36)));
+    Round(g, h, a, b, c, d, e, f, Add(K(0x243185beul), w10 = Read16(in, 40)));
+    Round(f, g, h, a, b, c, d, e, Add(K(0x550c7dc3ul), w11 = Read16(in, 44)));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x72be5d74ul), w12 = Read16(in, 48)));
+    Round(d, e, f, g, h, a, b, c, Add(K(0x80deb1feul), w13 = Read16(in, 52)));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x9bdc06a7ul), w14 = Read16(in, 56)));
+    Round(b, c, d, e, f, g, h, a, Add(K(0xc19bf174ul), w15 = Read16(in, 60)));
+    Round(a, b, c, d, e, f, g, h, Add(K(0xe49b69c1ul), Inc(w0, sigma1(w14), w9, sigma0(w1))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0xefbe4786ul), Inc(w1, sigma1(w15), w10, sigma0(w2))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0x0fc19dc6ul), Inc(w2, sigma1(w0), w11, sigma0(w3))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0x240ca1ccul), Inc(w3, sigma1(w1), w12, sigma0(w4))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x2de92c6ful), Inc(w4, sigma1(w2), w13, sigma0(w5))));
+    Round(d, e, f, g, h, a, b, c, Add(K(0x4a7484aaul), Inc(w5, sigma1(w3), w14, sigma0(w6))));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x5cb0a9dcul), Inc(w6, sigma1(w4), w15, sigma0(w7))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0x76f988daul), Inc(w7, sigma1(w5), w0, sigma0(w8))));
+    Round(a, b, c, d, e, f, g, h, Add(K(0x983e5152ul), Inc(w8, sigma1(w6), w1, sigma0(w9))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0xa831c66dul), Inc(w9, sigma1(w7), w2, sigma0(w10))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0xb00327c8ul), Inc(w10, sigma1(w8), w3, sigma0(w11))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0xbf597fc7ul), Inc(w11, sigma1(w9), w4, sigma0(w12))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0xc6e00bf3ul), Inc(w12, sigma1(w10), w5, sigma0(w13))));
+    Round(d, e, f, g, h, a, b, c, Add(K(0xd5a79147ul), Inc(w13, sigma1(w11), w6, sigma0(w14))));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x06ca6351ul), Inc(w14, sigma1(w12), w7, sigma0(w15))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0x14292967ul), Inc(w15, sigma1(w13), w8, sigma0(w0))));
+    Round(a, b, c, d, e, f, g, h, Add(K(0x27b70a85ul), Inc(w0, sigma1(w14), w9, sigma0(w1))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0x2e1b2138ul), Inc(w1, sigma1(w15), w10, sigma0(w2))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0x4d2c6dfcul), Inc(w2, sigma1(w0), w11, sigma0(w3))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0x53380d13ul), Inc(w3, sigma1(w1), w12, sigma0(w4))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x650a7354ul), Inc(w4, sigma1(w2), w13, sigma0(w5))));
+    Round(d, e, f, g, h, a, b, c, Add(K(0x766a0abbul), Inc(w5, sigma1(w3), w14, sigma0(w6))));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x81c2c92eul), Inc(w6, sigma1(w4), w15, sigma0(w7))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0x92722c85ul), Inc(w7, sigma1(w5), w0, sigma0(w8))));
+    Round(a, b, c, d, e, f, g, h, Add(K(0xa2bfe8a1ul), Inc(w8, sigma1(w6), w1, sigma0(w9))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0xa81a664bul), Inc(w9, sigma1(w7), w2, sigma0(w10))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0xc24b8b70ul), Inc(w10, sigma1(w8), w3, sigma0(w11))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0xc76c51a3ul), Inc(w11, sigma1(w9), w4, sigma0(w12))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0xd192e819ul), Inc(w12, sigma1(w10), w5, sigma0(w13))));
+    Round(d, e, f, g, h, a, b, c, Add(K(0xd6990624ul), Inc(w13, sigma1(w11), w6, sigma0(w14))));
+    Round(c, d, e, f, g, h, a, b, Add(K(0xf40e3585ul), Inc(w14, sigma1(w12), w7, sigma0(w15))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0x106aa070ul), Inc(w15, sigma1(w13), w8, sigma0(w0))));
+    Round(a, b, c, d, e, f, g, h, Add(K(0x19a4c116ul), Inc(w0, sigma1(w14), w9, sigma0(w1))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0x1e376c08ul), Inc(w1, sigma1(w15), w10, sigma0(w2))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0x2748774cul), Inc(w2, sigma1(w0), w11, sigma0(w3))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0x34b0bcb5ul), Inc(w3, sigma1(w1), w12, sigma0(w4))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x391c0cb3ul), Inc(w4, sigma1(w2), w13, sigma0(w5))));
+    Round(d, e, f, g, h, a, b, c, Add(K(0x4ed8aa4aul), Inc(w5, sigma1(w3), w14, sigma0(w6))));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x5b9cca4ful), Inc(w6, sigma1(w4), w15, sigma0(w7))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0x682e6ff3ul), Inc(w7, sigma1(w5), w0, sigma0(w8))));
+    Round(a, b, c, d, e, f, g, h, Add(K(0x748f82eeul), Inc(w8, sigma1(w6), w1, sigma0(w9))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0x78a5636ful), Inc(w9, sigma1(w7), w2, sigma0(w10))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0x84c87814ul), Inc(w10, sigma1(w8), w3, sigma0(w11))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0x8cc70208ul), Inc(w11, sigma1(w9), w4, sigma0(w12))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x90befffaul), Inc(w12, sigma1(w10), w5, sigma0(w13))));
+    Round(d, e, f, g, h, a, b, c, Add(K(0xa4506cebul), Inc(w13, sigma1(w11), w6, sigma0(w14))));
+    Round(c, d, e, f, g, h, a, b, Add(K(0xbef9a3f7ul), Inc(w14, sigma1(w12), w7, sigma0(w15))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0xc67178f2ul), Inc(w15, sigma1(w13), w8, sigma0(w0))));
+}
+
+}
+
+namespace sha256multi_avx512 {
+
+void Transform_16way(unsigned char* out, const uint32_t* s, const unsigned char* in)
+{
+    __m512i a = K(s[0]), b = K(s[1]), c = K(s[2]), d = K(s[3]), e = K(s[4]), f = K(s[5]), g = K(s[6]), h = K(s[7]);
+    MidstateRounds(a, b, c, d, e, f, g, h, in);
+
+    // Output
+    Write16(out, 0, Add(a, K(s[0])));
+    Write16(out, 4, Add(b, K(s[1])));
+    Write16(out, 8, Add(c, K(s[2])));
+    Write16(out, 12, Add(d, K(s[3])));
+    Write16(out, 16, Add(e, K(s[4])));
+    Write16(out, 20, Add(f, K(s[5])));
+    Write16(out, 24, Add(g, K(s[6])));
+    Write16(out, 28, Add(h, K(s[7])));
+}
+
+void TransformFilter_16way(uint32_t* out, const uint32_t* s, const unsigned char* in)
+{
+    __m512i a = K(s[0]), b = K(s[1]), c = K(s[2]), d = K(s[3]), e = K(s[4]), f = K(s[5]), g = K(s[6]), h = K(s[7]);
+    MidstateRounds(a, b, c, d, e, f, g, h, in);
+
+    // Only the first word of each digest is needed, so the compiler is
+    // free to drop everything that does not contribute to it.
+    _mm512_storeu_si512((__m512i*)out, Add(a, K(s[0])));
+}
+
+void TransformStates_16way(unsigned char* out, const uint32_t* s, const unsigned char* in)
+{
+    __m512i v[8];
+    LoadMidstates(v, s);
+    __m512i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+    MidstateRounds(a, b, c, d, e, f, g, h, in);
+
+    // Output
+    Write16(out, 0, Add(a, v[0]));
+    Write16(out, 4, Add(b, v[1]));
+    Write16(out, 8, Add(c, v[2]));
+    Write16(out, 12, Add(d, v[3]));
+    Write16(out, 16, Add(e, v[4]));
+    Write16(out, 20, Add(f, v[5]));
+    Write16(out, 24, Add(g, v[6]));
+    Write16(out, 28, Add(h, v[7]));
+}
+
+void TransformStatesFilter_16way(uint32_t* out, const uint32_t* s, const unsigned char* in)
+{
+    __m512i v[8];
+    LoadMidstates(v, s);
+    __m512i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+    MidstateRounds(a, b, c, d, e, f, g, h, in);
+
+    _mm512_storeu_si512((__m512i*)out, Add(a, v[0]));
+}
+
+}
+
+namespace sha256mine_avx512 {
+
+void Transform_16way(uint32_t* out, const SHA256NoncePrecomp& pre, const unsigned char* nonce2)
+{
+    // W1 holds nonce2, which is the only message word that differs between
+    // lanes.  Round 2 uses it for the first time through the state, so the
+    // state after rounds 0 and 1 is read from the precomputed values (with
+    // W1 added in), and only the lane-dependent part of round 2 is done here.
+    __m512i w1 = ByteSwap(_mm512_loadu_si512((const __m512i*)nonce2));
+
+    __m512i a = K(pre.a);
+    __m512i b = K(pre.b);
+    __m512i c = Add(K(pre.c), w1);
+    __m512i d = K(pre.d);
+    __m512i e = K(pre.e);
+    __m512i f;
+    __m512i g = Add(K(pre.g), w1);
+    __m512i h = K(pre.h);
+
+    __m512i w0, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
+
+    __m512i t1 = Add(K(pre.k2), Sigma1(c), Ch(c, d, e));
+    __m512i t2 = Add(Sigma0(g), Maj(g, h, a));
+    b = Add(b, t1);
+    f = Add(t1, t2);
+
+    // W3 through W15 are the fixed padding and length of the final block.
+    Round(f, g, h, a, b, c, d, e, K(0x69b5dba5ul)); // W3 = 0x80000000
+    Round(e, f, g, h, a, b, c, d, K(0x3956c25bul));
+    Round(d, e, f, g, h, a, b, c, K(0x59f111f1ul));
+    Round(c, d, e, f, g, h, a, b, K(0x923f82a4ul));
+    Round(b, c, d, e, f, g, h, a, K(0xab1c5ed5ul));
+    Round(a, b, c, d, e, f, g, h, K(0xd807aa98ul));
+    Round(h, a, b, c, d, e, f, g, K(0x12835b01ul));
+    Round(g, h, a, b, c, d, e, f, K(0x243185beul));
+    Round(f, g, h, a, b, c, d, e, K(0x550c7dc3ul));
+    Round(e, f, g, h, a, b, c, d, K(0x72be5d74ul));
+    Round(d, e, f, g, h, a, b, c, K(0x80deb1feul));
+    Round(c, d, e, f, g, h, a, b, K(0x9bdc06a7ul + pre.w14));
+    Round(b, c, d, e, f, g, h, a, K(0xc19bf174ul + pre.w15));
+    Round(a, b, c, d, e, f, g, h, Add(K(0xe49b69c1ul), w0 = Add(K(pre.w16), sigma0(w1))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0xefbe4786ul), Inc(w1, K(pre.w17))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0x0fc19dc6ul), w2 = Add(K(pre.w18), sigma1(w0))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0x240ca1ccul), w3 = Add(K(0x80000000ul), sigma1(w1))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x2de92c6ful), w4 = sigma1(w2)));
+    Round(d, e, f, g, h, a, b, c, Add(K(0x4a7484aaul), w5 = sigma1(w3)));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x5cb0a9dcul), w6 = Add(K(pre.w15), sigma1(w4))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0x76f988daul), w7 = Add(w0, sigma1(w5))));
+    Round(a, b, c, d, e, f, g, h, Add(K(0x983e5152ul), w8 = Add(w1, sigma1(w6))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0xa831c66dul), w9 = Add(w2, sigma1(w7))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0xb00327c8ul), w10 = Add(w3, sigma1(w8))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0xbf597fc7ul), w11 = Add(w4, sigma1(w9))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0xc6e00bf3ul), w12 = Add(w5, sigma1(w10))));
+    Round(d, e, f, g, h, a, b, c, Add(K(0xd5a79147ul), w13 = Add(K(pre.w29), w6, sigma1(w11))));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x06ca6351ul), w14 = Add(K(pre.w30), w7, sigma1(w12))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0x14292967ul), w15 = Add(K(pre.w15), sigma0(w0), w8, sigma1(w13))));
+    Round(a, b, c, d, e, f, g, h, Add(K(0x27b70a85ul), Inc(w0, sigma1(w14), w9, sigma0(w1))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0x2e1b2138ul), Inc(w1, sigma1(w15), w10, sigma0(w2))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0x4d2c6dfcul), Inc(w2, sigma1(w0), w11, sigma0(w3))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0x53380d13ul), Inc(w3, sigma1(w1), w12, sigma0(w4))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x650a7354ul), Inc(w4, sigma1(w2), w13, sigma0(w5))));
+    Round(d, e, f, g, h, a, b, c, Add(K(0x766a0abbul), Inc(w5, sigma1(w3), w14, sigma0(w6))));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x81c2c92eul), Inc(w6, sigma1(w4), w15, sigma0(w7))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0x92722c85ul), Inc(w7, sigma1(w5), w0, sigma0(w8))));
+    Round(a, b, c, d, e, f, g, h, Add(K(0xa2bfe8a1ul), Inc(w8, sigma1(w6), w1, sigma0(w9))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0xa81a664bul), Inc(w9, sigma1(w7), w2, sigma0(w10))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0xc24b8b70ul), Inc(w10, sigma1(w8), w3, sigma0(w11))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0xc76c51a3ul), Inc(w11, sigma1(w9), w4, sigma0(w12))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0xd192e819ul), Inc(w12, sigma1(w10), w5, sigma0(w13))));
+    Round(d, e, f, g, h, a, b, c, Add(K(0xd6990624ul), Inc(w13, sigma1(w11), w6, sigma0(w14))));
+    Round(c, d, e, f, g, h, a, b, Add(K(0xf40e3585ul), Inc(w14, sigma1(w12), w7, sigma0(w15))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0x106aa070ul), Inc(w15, sigma1(w13), w8, sigma0(w0))));
+    Round(a, b, c, d, e, f, g, h, Add(K(0x19a4c116ul), Inc(w0, sigma1(w14), w9, sigma0(w1))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0x1e376c08ul), Inc(w1, sigma1(w15), w10, sigma0(w2))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0x2748774cul), Inc(w2, sigma1(w0), w11, sigma0(w3))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0x34b0bcb5ul), Inc(w3, sigma1(w1), w12, sigma0(w4))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x391c0cb3ul), Inc(w4, sigma1(w2), w13, sigma0(w5))));
+    Round(d, e, f, g, h, a, b, c, Add(K(0x4ed8aa4aul), Inc(w5, sigma1(w3), w14, sigma0(w6))));
+    Round(c, d, e, f, g, h, a, b, Add(K(0x5b9cca4ful), Inc(w6, sigma1(w4), w15, sigma0(w7))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0x682e6ff3ul), Inc(w7, sigma1(w5), w0, sigma0(w8))));
+    Round(a, b, c, d, e, f, g, h, Add(K(0x748f82eeul), Inc(w8, sigma1(w6), w1, sigma0(w9))));
+    Round(h, a, b, c, d, e, f, g, Add(K(0x78a5636ful), Inc(w9, sigma1(w7), w2, sigma0(w10))));
+    Round(g, h, a, b, c, d, e, f, Add(K(0x84c87814ul), Inc(w10, sigma1(w8), w3, sigma0(w11))));
+    Round(f, g, h, a, b, c, d, e, Add(K(0x8cc70208ul), Inc(w11, sigma1(w9), w4, sigma0(w12))));
+    Round(e, f, g, h, a, b, c, d, Add(K(0x90befffaul), Inc(w12, sigma1(w10), w5, sigma0(w13))));
+    Round(d, e, f, g, h, a, b, c, Add(K(0xa4506cebul), Inc(w13, sigma1(w11), w6, sigma0(w14))));
+    Round(c, d, e, f, g, h, a, b, Add(K(0xbef9a3f7ul), Inc(w14, sigma1(w12), w7, sigma0(w15))));
+    Round(b, c, d, e, f, g, h, a, Add(K(0xc67178f2ul), Inc(w15, sigma1(w13), w8, sigma0(w0))));
+
+    // Output
+    _mm512_storeu_si512((__m512i*)out, Add(a, K(pre.s[0])));
+}
+
+}
+
+#endif
+
+// End of File
@@ -14,6 +14,8 @@
 #include <stdint.h>
 #include <immintrin.h>
 
+#include <utility>
+
 namespace {
 
 alignas(__m128i) const uint8_t MASK[16] = {0x03, 0x02, 0x01, 0x00, 0x07, 0x06, 0x05, 0x04, 0x0b, 0x0a, 0x09, 0x08, 0x0f, 0x0e, 0x0d, 0x0c};
@@ -356,6 +358,163 @@ void Transform_2way(unsigned char* out, const unsigned char* in)
 
 }
 
+namespace sha256multi_shani {
+
+namespace {
+
+template<typename F, int... I>
+void inline __attribute__((always_inline)) Interleave(F&& f, std::integer_sequence<int, I...>)
+{
+    (f(I), ...);
+}
+
+/** Apply f to each of the lanes 0..N-1, unrolled at compile time. */
+template<int N, typename F>
+void inline __attribute__((always_inline)) Interleave(F&& f)
+{
+    Interleave(f, std::make_integer_sequence<int, N>());
+}
+
+/** Load the same midstate into each of N interleaved SHA-NI states. */
+template<int N>
+void inline __attribute__((always_inline)) LoadMidstate(__m128i (&s0)[N], __m128i (&s1)[N], const uint32_t* s)
+{
+    __m128i t0 = _mm_loadu_si128((const __m128i*)s);
+    __m128i t1 = _mm_loadu_si128((const __m128i*)(s + 4));
+    Shuffle(t0, t1);
+    Interleave<N>([&](int i) {
+        s0[i] = t0;
+        s1[i] = t1;
+    });
+}
+
+/** Load a separate midstate into each of N interleaved SHA-NI states, where
+ *  lane i's state is s[8*i..8*i+7]. */
+template<int N>
+void inline __attribute__((always_inline)) LoadMidstates(__m128i (&s0)[N], __m128i (&s1)[N], const uint32_t* s)
+{
+    Interleave<N>([&](int i) {
+        s0[i] = _mm_loadu_si128((const __m128i*)(s + 8*i));
+        s1[i] = _mm_loadu_si128((const __m128i*)(s + 8*i + 4));
+        Shuffle(s0[i], s1[i]);
+    });
+}
+
+/** Load the midstate(s) for a transform: shared by all lanes, or one per
+ *  lane if PerLane is set. */
+template<bool PerLane, int N>
+void inline __attribute__((always_inline)) LoadStates(__m128i (&s0)[N], __m128i (&s1)[N], const uint32_t* s)
+{
+    if constexpr (PerLane) {
+        LoadMidstates(s0, s1, s);
+    } else {
+        LoadMidstate(s0, s1, s);
+    }
+}
+
+/**
+ * Transform N independent 64-byte blocks starting from the states in s0/s1,
+ * interleaving the instruction streams to hide the latency of the SHA
+ * instructions.  The midstate is added back in and the result unshuffled.
+ */
+template<int N>
+void inline __attribute__((always_inline)) MidstateRounds(__m128i (&s0)[N], __m128i (&s1)[N], const unsigned char* in)
+{
+    __m128i m0[N], m1[N], m2[N], m3[N], so0[N], so1[N];
+    Interleave<N>([&](int i) { so0[i] = s0[i]; so1[i] = s1[i]; });
+    Interleave<N>([&](int i) { m0[i] = Load(in + 64*i); });
+    Interleave<N>([&](int i) { QuadRound(s0[i], s1[i], m0[i], 0xe9b5dba5b5c0fbcfull, 0x71374491428a2f98ull); });
+    Interleave<N>([&](int i) { m1[i] = Load(in + 64*i + 16); });
+    Interleave<N>([&](int i) { QuadRound(s0[i], s1[i], m1[i], 0xab1c5ed5923f82a4ull, 0x59f111f13956c25bull); });
+    Interleave<N>([&](int i) { ShiftMessageA(m0[i], m1[i]); });
+    Interleave<N>([&](int i) { m2[i] = Load(in + 64*i + 32); });
+    Interleave<N>([&](int i) { QuadRound(s0[i], s1[i], m2[i], 0x550c7dc3243185beull, 0x12835b01d807aa98ull); });
+    Interleave<N>([&](int i) { ShiftMessageA(m1[i], m2[i]); });
+    Interleave<N>([&](int i) { m3[i] = Load(in + 64*i + 48); });
+    Interleave<N>([&](int i) { QuadRound(s0[i], s1[i], m3[i], 0xc19bf1749bdc06a7ull, 0x80deb1fe72be5d74ull); });
+    Interleave<N>([&](int i) { ShiftMessageB(m2[i], m3[i], m0[i]); });
+    Interleave<N>([&](int i) { QuadRound(s0[i], s1[i], m0[i], 0x240ca1cc0fc19dc6ull, 0xefbe4786E49b69c1ull); });
+    Interleave<N>([&](int i) { ShiftMessageB(m3[i], m0[i], m1[i]); });
+    Interleave<N>([&](int i) { QuadRound(s0[i], s1[i], m1[i], 0x76f988da5cb0a9dcull, 0x4a7484aa2de92c6full); });
+    Interleave<N>([&](int i) { ShiftMessageB(m0[i], m1[i], m2[i]); });
+    Interleave<N>([&](int i) { QuadRound(s0[i], s1[i], m2[i], 0xbf597fc7b00327c8ull, 0xa831c66d983e5152ull); });
+    Interleave<N>([&](int i) { ShiftMessageB(m1[i], m2[i], m3[i]); });
+    Interleave<N>([&](int i) { QuadRound(s0[i], s1[i], m3[i], 0x1429296706ca6351ull, 0xd5a79147c6e00bf3ull); });
+    Interleave<N>([&](int i) { ShiftMessageB(m2[i], m3[i], m0[i]); });
+    Interleave<N>([&](int i) { QuadRound(s0[i], s1[i], m0[i], 0x53380d134d2c6dfcull, 0x2e1b213827b70a85ull); });
+    Interleave<N>([&](int i) { ShiftMessageB(m3[i], m0[i], m1[i]); });
+    Interleave<N>([&](int i) { QuadRound(s0[i], s1[i], m1[i], 0x92722c8581c2c92eull, 0x766a0abb650a7354ull); });
+    Interleave<N>([&](int i) { ShiftMessageB(m0[i], m1[i], m2[i]); });
+    Interleave<N>([&](int i) { QuadRound(s0[i], s1[i], m2[i], 0xc76c51A3c24b8b70ull, 0xa81a664ba2bfe8a1ull); });
+    Interleave<N>([&](int i) { ShiftMessageB(m1[i], m2[i], m3[i]); });
+    Interleave<N>([&](int i) { QuadRound(s0[i], s1[i], m3[i], 0x106aa070f40e3585ull, 0xd6990624d192e819ull); });
+    Interleave<N>([&](int i) { ShiftMessageB(m2[i], m3[i], m0[i]); });
+    Interleave<N>([&](int i) { QuadRound(s0[i], s1[i], m0[i], 0x34b0bcb52748774cull, 0x1e376c0819a4c116ull); });
+    Interleave<N>([&](int i) { ShiftMessageB(m3[i], m0[i], m1[i]); });
+    Interleave<N>([&](int i) { QuadRound(s0[i], s1[i], m1[i], 0x682e6ff35b9cca4full, 0x4ed8aa4a391c0cb3ull); });
+    Interleave<N>([&](int i) { ShiftMessageC(m0[i], m1[i], m2[i]); });
+    Interleave<N>([&](int i) { QuadRound(s0[i], s1[i], m2[i], 0x8cc7020884c87814ull, 0x78a5636f748f82eeull); });
+    Interleave<N>([&](int i) { ShiftMessageC(m1[i], m2[i], m3[i]); });
+    Interleave<N>([&](int i) { QuadRound(s0[i], s1[i], m3[i], 0xc67178f2bef9A3f7ull, 0xa4506ceb90befffaull); });
+    Interleave<N>([&](int i) {
+        s0[i] = _mm_add_epi32(s0[i], so0[i]);
+        s1[i] = _mm_add_epi32(s1[i], so1[i]);
+        Unshuffle(s0[i], s1[i]);
+    });
+}
+
+template<int N, bool PerLane = false>
+void inline __attribute__((always_inline)) Transform(unsigned char* out, const uint32_t* s, const unsigned char* in)
+{
+    __m128i s0[N], s1[N];
+    LoadStates<PerLane>(s0, s1, s);
+    MidstateRounds(s0, s1, in);
+    Interleave<N>([&](int i) {
+        Save(out + 32*i, s0[i]);
+        Save(out + 32*i + 16, s1[i]);
+    });
+}
+
+template<int N, bool PerLane = false>
+void inline __attribute__((always_inline)) TransformFilter(uint32_t* out, const uint32_t* s, const unsigned char* in)
+{
+    __m128i s0[N], s1[N];
+    LoadStates<PerLane>(s0, s1, s);
+    MidstateRounds(s0, s1, in);
+    Interleave<N>([&](int i) {
+        out[i] = _mm_cvtsi128_si32(s0[i]);
+    });
+}
+
+}
+
+void Transform_2way(unsigned char* out, const uint32_t* s, const unsigned char* in)
+{
+    Transform<2>(out, s, in);
+}
+
+void Transform_4way(unsigned char* out, const uint32_t* s, const unsigned char* in)
+{
+    Transform<4>(out, s, in);
+}
+
+void TransformFilter_4way(uint32_t* out, const uint32_t* s, const unsigned char* in)
+{
+    TransformFilter<4>(out, s, in);
+}
+
+void TransformStates_4way(unsigned char* out, const uint32_t* s, const unsigned char* in)
+{
+    Transform<4, true>(out, s, in);
+}
+
+void TransformStatesFilter_4way(uint32_t* out, const uint32_t* s, const unsigned char* in)
+{
+    TransformFilter<4, true>(out, s, in);
+}
+
+}
+
 #endif
 
 // End of File
@@ -64,22 +64,21 @@ void inline Write4(unsigned char* out, int offset, __m128i v) {
     WriteLE32(out + 96 + offset, _mm_extract_epi32(v, 0));
 }
 
+/** Load a separate midstate into each lane, where lane i's state is
+ *  s[8*i..8*i+7]. */
+void inline __attribute__((always_inline)) LoadMidstates(__m128i* v, const uint32_t* s)
+{
+    // Lane 0 is the most significant element, as in Read4().
+    for (int i = 0; i < 8; ++i) {
+        v[i] = _mm_set_epi32(s[i], s[8 + i], s[16 + i], s[24 + i]);
+    }
 }
 
-namespace sha256multi_sse41 {
-
-void Transform_4way(unsigned char* out, const uint32_t* s, const unsigned char* in)
+/** Perform the 64 rounds of a midstate transform, starting from the
+ *  midstate in a..h and leaving the working variables (before the final
+ *  addition of the midstate) in a..h. */
+void inline __attribute__((always_inline)) MidstateRounds(__m128i& a, __m128i& b, __m128i& c, __m128i& d, __m128i& e, __m128i& f, __m128i& g, __m128i& h, const unsigned char* in)
 {
-    // Transform 1
-    __m128i a = K(s[0]);
-    __m128i b = K(s[1]);
-    __m128i c = K(s[2]);
-    __m128i d = K(s[3]);
-    __m128i e = K(s[4]);
-    __m128i f = K(s[5]);
-    __m128i g = K(s[6]);
-    __m128i h = K(s[7]);
-
     __m128i w0, w1, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
 
     Round(a, b, c, d, e, f, g, h, Add(K(0x428a2f98ul), w0 = Read4(in, 0)));
@@ -146,6 +145,16 @@ void Transform_4way(unsigned char* out, const uint32_t* s, const unsigned char*
     Round(d, e, f, g, h, a, b, c, Add(K(0xa4506cebul), Inc(w13, sigma1(w11), w6, sigma0(w14))));
     Round(c, d, e, f, g, h, a, b, Add(K(0xbef9a3f7ul), Inc(w14, sigma1(w12), w7, sigma0(w15))));
     Round(b, c, d, e, f, g, h, a, Add(K(0xc67178f2ul), Inc(w15, sigma1(w13), w8, sigma0(w0))));
+}
+
+}
+
+namespace sha256multi_sse41 {
+
+void Transform_4way(unsigned char* out, const uint32_t* s, const unsigned char* in)
+{
+    __m128i a = K(s[0]), b = K(s[1]), c = K(s[2]), d = K(s[3]), e = K(s[4]), f = K(s[5]), g = K(s[6]), h = K(s[7]);
+    MidstateRounds(a, b, c, d, e, f, g, h, in);
 
     // Output
     Write4(out, 0, Add(a, K(s[0])));
@@ -158,6 +167,52 @@ void Transform_4way(unsigned char* out, const uint32_t* s, const unsigned char*
     Write4(out, 28, Add(h, K(s[7])));
 }
 
+void TransformFilter_4way(uint32_t* out, const uint32_t* s, const unsigned char* in)
+{
+    __m128i a = K(s[0]), b = K(s[1]), c = K(s[2]), d = K(s[3]), e = K(s[4]), f = K(s[5]), g = K(s[6]), h = K(s[7]);
+    MidstateRounds(a, b, c, d, e, f, g, h, in);
+
+    // Only the first word of each digest is needed, so the compiler is
+    // free to drop everything that does not contribute to it.
+    alignas(16) uint32_t tmp[4];
+    _mm_store_si128((__m128i*)tmp, Add(a, K(s[0])));
+    for (int i = 0; i < 4; ++i) {
+        out[i] = tmp[3 - i];
+    }
+}
+
+void TransformStates_4way(unsigned char* out, const uint32_t* s, const unsigned char* in)
+{
+    __m128i v[8];
+    LoadMidstates(v, s);
+    __m128i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+    MidstateRounds(a, b, c, d, e, f, g, h, in);
+
+    // Output
+    Write4(out, 0, Add(a, v[0]));
+    Write4(out, 4, Add(b, v[1]));
+    Write4(out, 8, Add(c, v[2]));
+    Write4(out, 12, Add(d, v[3]));
+    Write4(out, 16, Add(e, v[4]));
+    Write4(out, 20, Add(f, v[5]));
+    Write4(out, 24, Add(g, v[6]));
+    Write4(out, 28, Add(h, v[7]));
+}
+
+void TransformStatesFilter_4way(uint32_t* out, const uint32_t* s, const unsigned char* in)
+{
+    __m128i v[8];
+    LoadMidstates(v, s);
+    __m128i a = v[0], b = v[1], c = v[2], d = v[3], e = v[4], f = v[5], g = v[6], h = v[7];
+    MidstateRounds(a, b, c, d, e, f, g, h, in);
+
+    alignas(16) uint32_t tmp[4];
+    _mm_store_si128((__m128i*)tmp, Add(a, v[0]));
+    for (int i = 0; i < 4; ++i) {
+        out[i] = tmp[3 - i];
+    }
+}
+
 }
 
 namespace sha256d64_sse41 {
@@ -0,0 +1,212 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "engine.h"
+
+#include <iostream>
+
+#include <algorithm>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <atomic>
+#include <thread>
+
+#include "absl/flags/flag.h"
+#include "absl/strings/match.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
+#include "absl/time/clock.h"
+
+ABSL_FLAG(std::string, engine, "auto", "mining engine to use, as kernel[:batch] (e.g. \"avx2:200\"), or \"auto\" to benchmark the available engines on startup");
+ABSL_FLAG(std::string, enginecache, "engine.cache", "file in which to remember the result of the engine benchmark between runs, or empty to always benchmark");
+
+namespace {
+
+/** The batch sizes tried by the autotuner.  The first is the default. */
+const size_t BATCH_SIZES[] = {200, 40, 1000};
+
+/** How long each engine is measured by the autotuner. */
+const absl::Duration TUNE_DURATION = absl::Seconds(1);
+
+/**
+ * Identifies the hardware and configuration the engine was tuned for.  A
+ * cached result is only reused if the key matches.
+ */
+std::string get_cache_key(int num_workers)
+{
+    std::vector<std::string> names;
+    for (const SHA256MiningKernel& kernel : SHA256MiningKernels()) {
+        names.push_back(kernel.name);
+    }
+    return absl::StrCat("kernels=", absl::StrJoin(names, ","), ",threads=", std::thread::hardware_concurrency(), ",workers=", num_workers);
+}
+
+std::optional<MiningEngine> read_cache(const std::string& filename, const std::string& key)
+{
+    std::ifstream file(filename);
+    std::string line;
+    while (std::getline(file, line)) {
+        std::vector<std::string> fields = absl::StrSplit(line, ' ');
+        if (fields.size() == 2 && fields[0] == key) {
+            return parse_mining_engine(fields[1]);
+        }
+    }
+    return std::nullopt;
+}
+
+void write_cache(const std::string& filename, const std::string& key, const MiningEngine& engine)
+{
+    // Keep the results for other configurations, e.g. for different
+    // numbers of workers.
+    std::vector<std::string> lines;
+    {
+        std::ifstream file(filename);
+        std::string line;
+        while (std::getline(file, line)) {
+            if (!absl::StartsWith(line, key + " ")) {
+                lines.push_back(line);
+            }
+        }
+    }
+    lines.push_back(absl::StrCat(key, " ", to_string(engine)));
+    std::ofstream file(filename, std::ofstream::trunc);
+    for (const std::string& line : lines) {
+        file << line << std::endl;
+    }
+    if (!file) {
+        std::cerr << "Warning: unable to write mining engine cache '" << filename << "'" << std::endl;
+    }
+}
+
+} // namespace
+
+std::string to_string(const MiningEngine& engine)
+{
+    return absl::StrCat(engine.kernel.name, ":", engine.batch);
+}
+
+std::optional<MiningEngine> parse_mining_engine(const std::string& name)
+{
+    std::vector<std::string> parts = absl::StrSplit(name, ':');
+    if (parts.empty() || parts.size() > 2) {
+        return std::nullopt;
+    }
+    size_t batch = BATCH_SIZES[0];
+    if (parts.size() == 2 && (!absl::SimpleAtoi(parts[1], &batch) || batch == 0 || batch > 1000)) {
+        return std::nullopt;
+    }
+    for (const SHA256MiningKernel& kernel : SHA256MiningKernels()) {
+        if (parts[0] == kernel.name) {
+            return MiningEngine{kernel, batch};
+        }
+    }
+    return std::nullopt;
+}
+
+double benchmark_mining_engine(const MiningEngine& engine, int num_workers, absl::Duration duration)
+{
+    // Hash as the mining loop does, with an arbitrary midstate and nonces.
+    unsigned char prefix[64];
+    for (int i = 0; i < 64; ++i) {
+        prefix[i] = 'A' + (i % 26);
+    }
+    CSHA256 midstate;
+    midstate.Write(prefix, sizeof(prefix));
+    std::vector<unsigned char> nonces(4 * 1000);
+    for (size_t i = 0; i < nonces.size(); ++i) {
+        nonces[i] = 'a' + (i % 26);
+    }
+    static const unsigned char final[] = "fQ==";
+
+    std::atomic<bool> stop{false};
+    std::atomic<int64_t> attempts{0};
+    auto worker = [&]() {
+        std::vector<uint32_t> words(engine.batch);
+        SHA256NoncePrecomp pre;
+        int64_t count = 0;
+        for (int i = 0; !stop; i = (i + 1) % 1000) {
+            midstate.PrecomputeNonce1(nonces.data() + 4*i, final, pre);
+            for (size_t j = 0; j < 1000; j += engine.batch) {
+                const size_t n = std::min(engine.batch, 1000 - j);
+                SHA256Nonce2FirstWord(engine.kernel, words.data(), pre, nonces.data() + 4*j, n);
+                count += n;
+            }
+        }
+        attempts += count;
+    };
+
+    std::vector<std::thread> threads;
+    const absl::Time begin = absl::Now();
+    for (int i = 0; i < num_workers; ++i) {
+        threads.emplace_back(worker);
+    }
+    absl::SleepFor(duration);
+    stop = true;
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    const absl::Time end = absl::Now();
+    return attempts / absl::ToDoubleSeconds(end - begin);
+}
+
+std::optional<MiningEngine> select_mining_engine(int num_workers)
+{
+    const std::string engine_flag = absl::GetFlag(FLAGS_engine);
+    if (engine_flag != "auto") {
+        std::optional<MiningEngine> engine = parse_mining_engine(engine_flag);
+        if (!engine) {
+            std::vector<std::string> names;
+            for (const SHA256MiningKernel& kernel : SHA256MiningKernels()) {
+                names.push_back(kernel.name);
+            }
+            std::cerr << "Error: unknown mining engine '" << engine_flag << "'; available kernels are " << absl::StrJoin(names, ", ") << std::endl;
+        }
+        return engine;
+    }
+
+    const std::string cache_filename = absl::GetFlag(FLAGS_enginecache);
+    const std::string key = get_cache_key(num_workers);
+    if (!cache_filename.empty()) {
+        std::optional<MiningEngine> engine = read_cache(cache_filename, key);
+        if (engine) {
+            std::cout << "Using mining engine '" << to_string(*engine) << "' from " << cache_filename << std::endl;
+            return engine;
+        }
+    }
+
+    // Find the fastest kernel at the default batch size, then the best
+    // batch size for that kernel.
+    std::cout << "Benchmarking mining engines with " << num_workers << " threads..." << std::endl;
+    std::optional<MiningEngine> best;
+    double best_speed = 0.0;
+    auto measure = [&](const MiningEngine& engine) {
+        const double speed = benchmark_mining_engine(engine, num_workers, TUNE_DURATION);
+        std::cout << "  " << to_string(engine) << ": " << (speed / 1e6) << " Mhps" << std::endl;
+        if (!best || speed > best_speed) {
+            best = engine;
+            best_speed = speed;
+        }
+    };
+    for (const SHA256MiningKernel& kernel : SHA256MiningKernels()) {
+        measure({kernel, BATCH_SIZES[0]});
+    }
+    const SHA256MiningKernel kernel = best->kernel;
+    for (size_t i = 1; i < sizeof(BATCH_SIZES) / sizeof(BATCH_SIZES[0]); ++i) {
+        measure({kernel, BATCH_SIZES[i]});
+    }
+    std::cout << "Selected mining engine '" << to_string(*best) << "'" << std::endl;
+
+    if (!cache_filename.empty()) {
+        write_cache(cache_filename, key, *best);
+    }
+    return best;
+}
+
+// End of File
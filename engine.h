@@ -0,0 +1,48 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef ENGINE_H
+#define ENGINE_H
+
+#include <stddef.h>
+
+#include <optional>
+#include <string>
+
+#include "absl/time/time.h"
+
+#include "crypto/sha256.h"
+
+/** How the mining loop hashes: which kernel, and how many nonces per batch. */
+struct MiningEngine {
+    SHA256MiningKernel kernel;
+    size_t batch;
+};
+
+/** The engine's name as accepted by --engine, e.g. "avx2:200". */
+std::string to_string(const MiningEngine& engine);
+
+/** Parse an engine name of the form "kernel" or "kernel:batch". */
+std::optional<MiningEngine> parse_mining_engine(const std::string& name);
+
+/**
+ * Measure the hash rate of the given engine, in hashes per second, with
+ * num_workers threads hashing in parallel for the given duration.
+ */
+double benchmark_mining_engine(const MiningEngine& engine, int num_workers, absl::Duration duration);
+
+/**
+ * Choose the engine for the mining threads: the one pinned with --engine,
+ * or else the result of a previous run cached in --enginecache, or else the
+ * fastest engine as measured with num_workers threads.  Requires that
+ * SHA256AutoDetect() has already been called.  Returns std::nullopt if
+ * --engine names an unknown engine.
+ */
+std::optional<MiningEngine> select_mining_engine(int num_workers);
+
+#endif // ENGINE_H
+
+// End of File
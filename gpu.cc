@@ -0,0 +1,383 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "gpu.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#define CL_TARGET_OPENCL_VERSION 120
+#if defined(__APPLE__)
+#include <OpenCL/opencl.h>
+#else
+#include <CL/cl.h>
+#endif
+
+#include "absl/strings/str_cat.h"
+
+#include "crypto/common.h"
+#include "crypto/sha256.h"
+
+namespace {
+
+/**
+ * The search kernel.  This is the scalar form of the sha256mine_*
+ * kernels: each work item takes the state after round 2 from the host's
+ * precomputation for its first nonce (the y coordinate), adds in the
+ * second nonce (the x coordinate) and runs the remaining rounds.
+ */
+const char* const SEARCH_KERNEL = R"(
+#define ROTR(x, n) rotate((x), (uint)(32 - (n)))
+#define Ch(x, y, z) bitselect((z), (y), (x))
+#define Maj(x, y, z) bitselect((x), (y), (z) ^ (x))
+#define Sigma0(x) (ROTR((x), 2) ^ ROTR((x), 13) ^ ROTR((x), 22))
+#define Sigma1(x) (ROTR((x), 6) ^ ROTR((x), 11) ^ ROTR((x), 25))
+#define sigma0(x) (ROTR((x), 7) ^ ROTR((x), 18) ^ ((x) >> 3))
+#define sigma1(x) (ROTR((x), 17) ^ ROTR((x), 19) ^ ((x) >> 10))
+
+#define Round(a, b, c, d, e, f, g, h, k) \
+    { \
+        uint t1 = (h) + Sigma1(e) + Ch((e), (f), (g)) + (k); \
+        uint t2 = Sigma0(a) + Maj((a), (b), (c)); \
+        (d) += t1; \
+        (h) = t1 + t2; \
+    }
+
+/* Layout of the per-nonce1 precomputation, see PackPrecomp(). */
+#define PRE_S0 0
+#define PRE_A 1
+#define PRE_B 2
+#define PRE_C 3
+#define PRE_D 4
+#define PRE_E 5
+#define PRE_G 6
+#define PRE_H 7
+#define PRE_K2 8
+#define PRE_W14 9
+#define PRE_W15 10
+#define PRE_W16 11
+#define PRE_W17 12
+#define PRE_W18 13
+#define PRE_W29 14
+#define PRE_W30 15
+#define PRE_WORDS 16
+
+__kernel void search(__global const uint* pre, __global const uint* nonce2, uint mask, __global uint* num_out, __global uint2* out, uint max_out)
+{
+    const uint j = get_global_id(0);
+    const uint i = get_global_id(1);
+    __global const uint* p = pre + PRE_WORDS * i;
+
+    uint w0, w1, w2, w3, w4, w5, w6, w7, w8, w9, w10, w11, w12, w13, w14, w15;
+    w1 = nonce2[j];
+
+    uint a = p[PRE_A];
+    uint b = p[PRE_B];
+    uint c = p[PRE_C] + w1;
+    uint d = p[PRE_D];
+    uint e = p[PRE_E];
+    uint f;
+    uint g = p[PRE_G] + w1;
+    uint h = p[PRE_H];
+
+    {
+        uint t1 = p[PRE_K2] + Sigma1(c) + Ch(c, d, e);
+        uint t2 = Sigma0(g) + Maj(g, h, a);
+        b += t1;
+        f = t1 + t2;
+    }
+
+    Round(f, g, h, a, b, c, d, e, 0x69b5dba5u);
+    Round(e, f, g, h, a, b, c, d, 0x3956c25bu);
+    Round(d, e, f, g, h, a, b, c, 0x59f111f1u);
+    Round(c, d, e, f, g, h, a, b, 0x923f82a4u);
+    Round(b, c, d, e, f, g, h, a, 0xab1c5ed5u);
+    Round(a, b, c, d, e, f, g, h, 0xd807aa98u);
+    Round(h, a, b, c, d, e, f, g, 0x12835b01u);
+    Round(g, h, a, b, c, d, e, f, 0x243185beu);
+    Round(f, g, h, a, b, c, d, e, 0x550c7dc3u);
+    Round(e, f, g, h, a, b, c, d, 0x72be5d74u);
+    Round(d, e, f, g, h, a, b, c, 0x80deb1feu);
+    Round(c, d, e, f, g, h, a, b, 0x9bdc06a7u + p[PRE_W14]);
+    Round(b, c, d, e, f, g, h, a, 0xc19bf174u + p[PRE_W15]);
+    Round(a, b, c, d, e, f, g, h, 0xe49b69c1u + (w0 = p[PRE_W16] + sigma0(w1)));
+    Round(h, a, b, c, d, e, f, g, 0xefbe4786u + (w1 += p[PRE_W17]));
+    Round(g, h, a, b, c, d, e, f, 0x0fc19dc6u + (w2 = p[PRE_W18] + sigma1(w0)));
+    Round(f, g, h, a, b, c, d, e, 0x240ca1ccu + (w3 = 0x80000000u + sigma1(w1)));
+    Round(e, f, g, h, a, b, c, d, 0x2de92c6fu + (w4 = sigma1(w2)));
+    Round(d, e, f, g, h, a, b, c, 0x4a7484aau + (w5 = sigma1(w3)));
+    Round(c, d, e, f, g, h, a, b, 0x5cb0a9dcu + (w6 = p[PRE_W15] + sigma1(w4)));
+    Round(b, c, d, e, f, g, h, a, 0x76f988dau + (w7 = w0 + sigma1(w5)));
+    Round(a, b, c, d, e, f, g, h, 0x983e5152u + (w8 = w1 + sigma1(w6)));
+    Round(h, a, b, c, d, e, f, g, 0xa831c66du + (w9 = w2 + sigma1(w7)));
+    Round(g, h, a, b, c, d, e, f, 0xb00327c8u + (w10 = w3 + sigma1(w8)));
+    Round(f, g, h, a, b, c, d, e, 0xbf597fc7u + (w11 = w4 + sigma1(w9)));
+    Round(e, f, g, h, a, b, c, d, 0xc6e00bf3u + (w12 = w5 + sigma1(w10)));
+    Round(d, e, f, g, h, a, b, c, 0xd5a79147u + (w13 = p[PRE_W29] + w6 + sigma1(w11)));
+    Round(c, d, e, f, g, h, a, b, 0x06ca6351u + (w14 = p[PRE_W30] + w7 + sigma1(w12)));
+    Round(b, c, d, e, f, g, h, a, 0x14292967u + (w15 = p[PRE_W15] + sigma0(w0) + w8 + sigma1(w13)));
+    Round(a, b, c, d, e, f, g, h, 0x27b70a85u + (w0 += sigma1(w14) + w9 + sigma0(w1)));
+    Round(h, a, b, c, d, e, f, g, 0x2e1b2138u + (w1 += sigma1(w15) + w10 + sigma0(w2)));
+    Round(g, h, a, b, c, d, e, f, 0x4d2c6dfcu + (w2 += sigma1(w0) + w11 + sigma0(w3)));
+    Round(f, g, h, a, b, c, d, e, 0x53380d13u + (w3 += sigma1(w1) + w12 + sigma0(w4)));
+    Round(e, f, g, h, a, b, c, d, 0x650a7354u + (w4 += sigma1(w2) + w13 + sigma0(w5)));
+    Round(d, e, f, g, h, a, b, c, 0x766a0abbu + (w5 += sigma1(w3) + w14 + sigma0(w6)));
+    Round(c, d, e, f, g, h, a, b, 0x81c2c92eu + (w6 += sigma1(w4) + w15 + sigma0(w7)));
+    Round(b, c, d, e, f, g, h, a, 0x92722c85u + (w7 += sigma1(w5) + w0 + sigma0(w8)));
+    Round(a, b, c, d, e, f, g, h, 0xa2bfe8a1u + (w8 += sigma1(w6) + w1 + sigma0(w9)));
+    Round(h, a, b, c, d, e, f, g, 0xa81a664bu + (w9 += sigma1(w7) + w2 + sigma0(w10)));
+    Round(g, h, a, b, c, d, e, f, 0xc24b8b70u + (w10 += sigma1(w8) + w3 + sigma0(w11)));
+    Round(f, g, h, a, b, c, d, e, 0xc76c51a3u + (w11 += sigma1(w9) + w4 + sigma0(w12)));
+    Round(e, f, g, h, a, b, c, d, 0xd192e819u + (w12 += sigma1(w10) + w5 + sigma0(w13)));
+    Round(d, e, f, g, h, a, b, c, 0xd6990624u + (w13 += sigma1(w11) + w6 + sigma0(w14)));
+    Round(c, d, e, f, g, h, a, b, 0xf40e3585u + (w14 += sigma1(w12) + w7 + sigma0(w15)));
+    Round(b, c, d, e, f, g, h, a, 0x106aa070u + (w15 += sigma1(w13) + w8 + sigma0(w0)));
+    Round(a, b, c, d, e, f, g, h, 0x19a4c116u + (w0 += sigma1(w14) + w9 + sigma0(w1)));
+    Round(h, a, b, c, d, e, f, g, 0x1e376c08u + (w1 += sigma1(w15) + w10 + sigma0(w2)));
+    Round(g, h, a, b, c, d, e, f, 0x2748774cu + (w2 += sigma1(w0) + w11 + sigma0(w3)));
+    Round(f, g, h, a, b, c, d, e, 0x34b0bcb5u + (w3 += sigma1(w1) + w12 + sigma0(w4)));
+    Round(e, f, g, h, a, b, c, d, 0x391c0cb3u + (w4 += sigma1(w2) + w13 + sigma0(w5)));
+    Round(d, e, f, g, h, a, b, c, 0x4ed8aa4au + (w5 += sigma1(w3) + w14 + sigma0(w6)));
+    Round(c, d, e, f, g, h, a, b, 0x5b9cca4fu + (w6 += sigma1(w4) + w15 + sigma0(w7)));
+    Round(b, c, d, e, f, g, h, a, 0x682e6ff3u + (w7 += sigma1(w5) + w0 + sigma0(w8)));
+    Round(a, b, c, d, e, f, g, h, 0x748f82eeu + (w8 += sigma1(w6) + w1 + sigma0(w9)));
+    Round(h, a, b, c, d, e, f, g, 0x78a5636fu + (w9 += sigma1(w7) + w2 + sigma0(w10)));
+    Round(g, h, a, b, c, d, e, f, 0x84c87814u + (w10 += sigma1(w8) + w3 + sigma0(w11)));
+    Round(f, g, h, a, b, c, d, e, 0x8cc70208u + (w11 += sigma1(w9) + w4 + sigma0(w12)));
+    Round(e, f, g, h, a, b, c, d, 0x90befffau + (w12 += sigma1(w10) + w5 + sigma0(w13)));
+    Round(d, e, f, g, h, a, b, c, 0xa4506cebu + (w13 += sigma1(w11) + w6 + sigma0(w14)));
+    Round(c, d, e, f, g, h, a, b, 0xbef9a3f7u + (w14 += sigma1(w12) + w7 + sigma0(w15)));
+    Round(b, c, d, e, f, g, h, a, 0xc67178f2u + (w15 += sigma1(w13) + w8 + sigma0(w0)));
+
+    if (!((a + p[PRE_S0]) & mask)) {
+        uint n = atomic_inc(num_out);
+        if (n < max_out) {
+            out[n] = (uint2)(i, j);
+        }
+    }
+}
+)";
+
+/** Number of words per first nonce in the kernel's precomputation buffer. */
+constexpr size_t PRE_WORDS = 16;
+
+/** Maximum number of candidates returned by a single kernel launch. */
+constexpr cl_uint MAX_CANDIDATES = 4096;
+
+void PackPrecomp(cl_uint* out, const SHA256NoncePrecomp& pre)
+{
+    out[0] = pre.s[0];
+    out[1] = pre.a;
+    out[2] = pre.b;
+    out[3] = pre.c;
+    out[4] = pre.d;
+    out[5] = pre.e;
+    out[6] = pre.g;
+    out[7] = pre.h;
+    out[8] = pre.k2;
+    out[9] = pre.w14;
+    out[10] = pre.w15;
+    out[11] = pre.w16;
+    out[12] = pre.w17;
+    out[13] = pre.w18;
+    out[14] = pre.w29;
+    out[15] = pre.w30;
+}
+
+void Check(cl_int err, const char* what)
+{
+    if (err != CL_SUCCESS) {
+        throw std::runtime_error(absl::StrCat("OpenCL error ", err, " in ", what));
+    }
+}
+
+std::vector<cl_device_id> GetDevices()
+{
+    std::vector<cl_device_id> ret;
+    cl_uint num_platforms = 0;
+    if (clGetPlatformIDs(0, nullptr, &num_platforms) != CL_SUCCESS || num_platforms == 0) {
+        return ret;
+    }
+    std::vector<cl_platform_id> platforms(num_platforms);
+    Check(clGetPlatformIDs(num_platforms, platforms.data(), nullptr), "clGetPlatformIDs");
+    for (cl_platform_id platform : platforms) {
+        cl_uint num_devices = 0;
+        if (clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, 0, nullptr, &num_devices) != CL_SUCCESS || num_devices == 0) {
+            continue;
+        }
+        std::vector<cl_device_id> devices(num_devices);
+        Check(clGetDeviceIDs(platform, CL_DEVICE_TYPE_ALL, num_devices, devices.data(), nullptr), "clGetDeviceIDs");
+        ret.insert(ret.end(), devices.begin(), devices.end());
+    }
+    return ret;
+}
+
+std::string GetDeviceString(cl_device_id device, cl_device_info param)
+{
+    size_t size = 0;
+    Check(clGetDeviceInfo(device, param, 0, nullptr, &size), "clGetDeviceInfo");
+    std::string ret(size, '\0');
+    Check(clGetDeviceInfo(device, param, size, &ret[0], nullptr), "clGetDeviceInfo");
+    while (!ret.empty() && ret.back() == '\0') {
+        ret.pop_back();
+    }
+    return ret;
+}
+
+std::string GetDeviceName(cl_device_id device)
+{
+    return absl::StrCat(GetDeviceString(device, CL_DEVICE_VENDOR), " ", GetDeviceString(device, CL_DEVICE_NAME));
+}
+
+} // namespace
+
+struct GpuMiner::Impl {
+    std::string name;
+    cl_device_id device = nullptr;
+    cl_context context = nullptr;
+    cl_command_queue queue = nullptr;
+    cl_program program = nullptr;
+    cl_kernel kernel = nullptr;
+    cl_mem pre = nullptr;
+    size_t pre_capacity = 0;
+    cl_mem nonce2 = nullptr;
+    size_t nonce2_capacity = 0;
+    cl_mem num_out = nullptr;
+    cl_mem out = nullptr;
+
+    ~Impl()
+    {
+        if (out) clReleaseMemObject(out);
+        if (num_out) clReleaseMemObject(num_out);
+        if (nonce2) clReleaseMemObject(nonce2);
+        if (pre) clReleaseMemObject(pre);
+        if (kernel) clReleaseKernel(kernel);
+        if (program) clReleaseProgram(program);
+        if (queue) clReleaseCommandQueue(queue);
+        if (context) clReleaseContext(context);
+    }
+
+    /** Make sure buf holds at least size bytes, reallocating if necessary. */
+    void Reserve(cl_mem& buf, size_t& capacity, size_t size, cl_mem_flags flags)
+    {
+        if (buf && capacity >= size) {
+            return;
+        }
+        if (buf) {
+            clReleaseMemObject(buf);
+            buf = nullptr;
+        }
+        cl_int err;
+        buf = clCreateBuffer(context, flags, size, nullptr, &err);
+        Check(err, "clCreateBuffer");
+        capacity = size;
+    }
+};
+
+std::vector<std::string> GpuMiner::ListDevices()
+{
+    std::vector<std::string> ret;
+    for (cl_device_id device : GetDevices()) {
+        ret.push_back(GetDeviceName(device));
+    }
+    return ret;
+}
+
+GpuMiner::GpuMiner(unsigned index) : m_impl(new Impl)
+{
+    const std::vector<cl_device_id> devices = GetDevices();
+    if (index >= devices.size()) {
+        throw std::runtime_error(absl::StrCat("OpenCL device ", index, " does not exist (found ", devices.size(), " devices)"));
+    }
+    Impl& impl = *m_impl;
+    impl.device = devices[index];
+    impl.name = GetDeviceName(impl.device);
+
+    cl_int err;
+    impl.context = clCreateContext(nullptr, 1, &impl.device, nullptr, nullptr, &err);
+    Check(err, "clCreateContext");
+    impl.queue = clCreateCommandQueue(impl.context, impl.device, 0, &err);
+    Check(err, "clCreateCommandQueue");
+
+    const char* source = SEARCH_KERNEL;
+    impl.program = clCreateProgramWithSource(impl.context, 1, &source, nullptr, &err);
+    Check(err, "clCreateProgramWithSource");
+    if (clBuildProgram(impl.program, 1, &impl.device, "", nullptr, nullptr) != CL_SUCCESS) {
+        size_t size = 0;
+        clGetProgramBuildInfo(impl.program, impl.device, CL_PROGRAM_BUILD_LOG, 0, nullptr, &size);
+        std::string log(size, '\0');
+        clGetProgramBuildInfo(impl.program, impl.device, CL_PROGRAM_BUILD_LOG, size, &log[0], nullptr);
+        throw std::runtime_error(absl::StrCat("Unable to build OpenCL kernel for ", impl.name, ": ", log));
+    }
+    impl.kernel = clCreateKernel(impl.program, "search", &err);
+    Check(err, "clCreateKernel");
+
+    impl.num_out = clCreateBuffer(impl.context, CL_MEM_READ_WRITE, sizeof(cl_uint), nullptr, &err);
+    Check(err, "clCreateBuffer");
+    impl.out = clCreateBuffer(impl.context, CL_MEM_WRITE_ONLY, MAX_CANDIDATES * sizeof(cl_uint2), nullptr, &err);
+    Check(err, "clCreateBuffer");
+}
+
+GpuMiner::~GpuMiner() = default;
+
+const std::string& GpuMiner::GetName() const
+{
+    return m_impl->name;
+}
+
+std::vector<GpuCandidate> GpuMiner::Search(const std::vector<SHA256NoncePrecomp>& pre, const unsigned char* nonce2, size_t count, unsigned zero_bits)
+{
+    Impl& impl = *m_impl;
+    std::vector<GpuCandidate> ret;
+    if (pre.empty() || !count) {
+        return ret;
+    }
+
+    std::vector<cl_uint> pre_words(PRE_WORDS * pre.size());
+    for (size_t i = 0; i < pre.size(); ++i) {
+        PackPrecomp(pre_words.data() + PRE_WORDS * i, pre[i]);
+    }
+    std::vector<cl_uint> nonce2_words(count);
+    for (size_t j = 0; j < count; ++j) {
+        nonce2_words[j] = ReadBE32(nonce2 + 4*j);
+    }
+    const cl_uint mask = zero_bits >= 32 ? 0xffffffff : ~(0xffffffff >> zero_bits);
+    const cl_uint max_out = MAX_CANDIDATES;
+    const cl_uint zero = 0;
+
+    impl.Reserve(impl.pre, impl.pre_capacity, pre_words.size() * sizeof(cl_uint), CL_MEM_READ_ONLY);
+    impl.Reserve(impl.nonce2, impl.nonce2_capacity, nonce2_words.size() * sizeof(cl_uint), CL_MEM_READ_ONLY);
+    Check(clEnqueueWriteBuffer(impl.queue, impl.pre, CL_FALSE, 0, pre_words.size() * sizeof(cl_uint), pre_words.data(), 0, nullptr, nullptr), "clEnqueueWriteBuffer");
+    Check(clEnqueueWriteBuffer(impl.queue, impl.nonce2, CL_FALSE, 0, nonce2_words.size() * sizeof(cl_uint), nonce2_words.data(), 0, nullptr, nullptr), "clEnqueueWriteBuffer");
+    Check(clEnqueueWriteBuffer(impl.queue, impl.num_out, CL_FALSE, 0, sizeof(cl_uint), &zero, 0, nullptr, nullptr), "clEnqueueWriteBuffer");
+
+    Check(clSetKernelArg(impl.kernel, 0, sizeof(cl_mem), &impl.pre), "clSetKernelArg");
+    Check(clSetKernelArg(impl.kernel, 1, sizeof(cl_mem), &impl.nonce2), "clSetKernelArg");
+    Check(clSetKernelArg(impl.kernel, 2, sizeof(cl_uint), &mask), "clSetKernelArg");
+    Check(clSetKernelArg(impl.kernel, 3, sizeof(cl_mem), &impl.num_out), "clSetKernelArg");
+    Check(clSetKernelArg(impl.kernel, 4, sizeof(cl_mem), &impl.out), "clSetKernelArg");
+    Check(clSetKernelArg(impl.kernel, 5, sizeof(cl_uint), &max_out), "clSetKernelArg");
+    const size_t global[2] = {count, pre.size()};
+    Check(clEnqueueNDRangeKernel(impl.queue, impl.kernel, 2, nullptr, global, nullptr, 0, nullptr, nullptr), "clEnqueueNDRangeKernel");
+
+    // Blocking reads wait for the kernel to complete (the queue is in-order).
+    cl_uint num_out = 0;
+    Check(clEnqueueReadBuffer(impl.queue, impl.num_out, CL_TRUE, 0, sizeof(cl_uint), &num_out, 0, nullptr, nullptr), "clEnqueueReadBuffer");
+    // Any candidates beyond the buffer size are dropped.  At any realistic
+    // difficulty this is astronomically unlikely, and only costs work.
+    num_out = std::min(num_out, max_out);
+    if (num_out) {
+        std::vector<cl_uint2> out(num_out);
+        Check(clEnqueueReadBuffer(impl.queue, impl.out, CL_TRUE, 0, num_out * sizeof(cl_uint2), out.data(), 0, nullptr, nullptr), "clEnqueueReadBuffer");
+        ret.reserve(num_out);
+        for (const cl_uint2& c : out) {
+            ret.push_back({c.s[0], c.s[1]});
+        }
+    }
+    return ret;
+}
+
+// End of File
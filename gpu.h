@@ -0,0 +1,69 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef GPU_H
+#define GPU_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <memory>
+#include <string>
+#include <vector>
+
+struct SHA256NoncePrecomp;
+
+/** A candidate found by GpuMiner::Search(). */
+struct GpuCandidate {
+    /** Index into the vector of first-nonce precomputations. */
+    uint32_t nonce1;
+    /** Index into the table of second nonces. */
+    uint32_t nonce2;
+};
+
+/**
+ * Runs the nonce search of the mining loop on an OpenCL device.
+ *
+ * The host computes the midstate and, for each first nonce, the
+ * SHA256NoncePrecomp, exactly as the CPU mining threads do.  The device then
+ * hashes every combination of those with the table of second nonces and
+ * returns the combinations whose hashes have the requested number of leading
+ * zero bits (up to 32).  Candidates are meant to be re-checked on the host.
+ */
+class GpuMiner {
+public:
+    /** Returns a description of each OpenCL device, in index order. */
+    static std::vector<std::string> ListDevices();
+
+    /**
+     * Opens the OpenCL device with the given index (as in ListDevices()) and
+     * builds the search kernel.  Throws std::runtime_error on failure.
+     */
+    explicit GpuMiner(unsigned device);
+    ~GpuMiner();
+
+    GpuMiner(const GpuMiner&) = delete;
+    GpuMiner& operator=(const GpuMiner&) = delete;
+
+    /** A description of the device in use. */
+    const std::string& GetName() const;
+
+    /**
+     * Hash each of the precomputed first nonces against each of the count
+     * 4-byte second nonces, and return the candidates whose hashes begin
+     * with at least zero_bits zero bits.  Throws std::runtime_error if the
+     * device reports an error.
+     */
+    std::vector<GpuCandidate> Search(const std::vector<SHA256NoncePrecomp>& pre, const unsigned char* nonce2, size_t count, unsigned zero_bits);
+
+private:
+    struct Impl;
+    std::unique_ptr<Impl> m_impl;
+};
+
+#endif // GPU_H
+
+// End of File
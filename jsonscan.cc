@@ -0,0 +1,325 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "jsonscan.h"
+
+#include <stdint.h>
+
+namespace {
+
+int HexDigit(char c)
+{
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+void AppendUtf8(std::string& out, uint32_t cp)
+{
+    if (cp < 0x80) {
+        out.push_back(static_cast<char>(cp));
+    } else if (cp < 0x800) {
+        out.push_back(static_cast<char>(0xc0 | (cp >> 6)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+    } else if (cp < 0x10000) {
+        out.push_back(static_cast<char>(0xe0 | (cp >> 12)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+    } else {
+        out.push_back(static_cast<char>(0xf0 | (cp >> 18)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 12) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | ((cp >> 6) & 0x3f)));
+        out.push_back(static_cast<char>(0x80 | (cp & 0x3f)));
+    }
+}
+
+} // anonymous namespace
+
+void JsonScanner::SkipWhitespace()
+{
+    while (m_pos < m_in.size()) {
+        const char c = m_in[m_pos];
+        if (c != ' ' && c != '\t' && c != '\n' && c != '\r') {
+            break;
+        }
+        ++m_pos;
+    }
+}
+
+char JsonScanner::Peek()
+{
+    if (!m_ok) {
+        return '\0';
+    }
+    SkipWhitespace();
+    return m_pos < m_in.size() ? m_in[m_pos] : '\0';
+}
+
+bool JsonScanner::AtEnd()
+{
+    SkipWhitespace();
+    return m_ok && m_pos == m_in.size();
+}
+
+bool JsonScanner::Separator()
+{
+    if (m_first) {
+        m_first = false;
+        return true;
+    }
+    if (Peek() != ',') {
+        return Fail();
+    }
+    ++m_pos;
+    return true;
+}
+
+bool JsonScanner::BeginObject()
+{
+    if (Peek() != '{' || m_depth >= MAX_DEPTH) {
+        return Fail();
+    }
+    ++m_pos;
+    ++m_depth;
+    m_first = true;
+    return true;
+}
+
+bool JsonScanner::NextMember(absl::string_view& key)
+{
+    if (Peek() == '}') {
+        ++m_pos;
+        --m_depth;
+        m_first = false;
+        return false;
+    }
+    if (!Separator() || !ReadString(key) || Peek() != ':') {
+        return Fail();
+    }
+    ++m_pos;
+    return true;
+}
+
+bool JsonScanner::BeginArray()
+{
+    if (Peek() != '[' || m_depth >= MAX_DEPTH) {
+        return Fail();
+    }
+    ++m_pos;
+    ++m_depth;
+    m_first = true;
+    return true;
+}
+
+bool JsonScanner::NextElement()
+{
+    if (Peek() == ']') {
+        ++m_pos;
+        --m_depth;
+        m_first = false;
+        return false;
+    }
+    return m_ok && Separator();
+}
+
+bool JsonScanner::ReadString(absl::string_view& str)
+{
+    if (Peek() != '"') {
+        return Fail();
+    }
+    const size_t begin = ++m_pos;
+    while (m_pos < m_in.size()) {
+        const char c = m_in[m_pos];
+        if (c == '"') {
+            str = m_in.substr(begin, m_pos - begin);
+            ++m_pos;
+            return true;
+        }
+        if (c == '\\') {
+            return Unescape(begin, str);
+        }
+        if (static_cast<unsigned char>(c) < 0x20) {
+            return Fail(); // unescaped control character
+        }
+        ++m_pos;
+    }
+    return Fail(); // unterminated
+}
+
+bool JsonScanner::Unescape(size_t begin, absl::string_view& str)
+{
+    m_unescaped.emplace_back(m_in.substr(begin, m_pos - begin));
+    std::string& out = m_unescaped.back();
+    while (m_pos < m_in.size()) {
+        char c = m_in[m_pos++];
+        if (c == '"') {
+            str = out;
+            return true;
+        }
+        if (static_cast<unsigned char>(c) < 0x20) {
+            return Fail();
+        }
+        if (c != '\\') {
+            out.push_back(c);
+            continue;
+        }
+        if (m_pos >= m_in.size()) {
+            return Fail();
+        }
+        switch (c = m_in[m_pos++]) {
+            case '"': case '\\': case '/': out.push_back(c); break;
+            case 'b': out.push_back('\b'); break;
+            case 'f': out.push_back('\f'); break;
+            case 'n': out.push_back('\n'); break;
+            case 'r': out.push_back('\r'); break;
+            case 't': out.push_back('\t'); break;
+            case 'u': {
+                uint32_t cp = 0;
+                for (int n = 0; n < 2; ++n) {
+                    if (m_pos + 4 > m_in.size()) {
+                        return Fail();
+                    }
+                    uint32_t unit = 0;
+                    for (int i = 0; i < 4; ++i) {
+                        const int d = HexDigit(m_in[m_pos++]);
+                        if (d < 0) {
+                            return Fail();
+                        }
+                        unit = (unit << 4) | d;
+                    }
+                    if (n == 0 && unit >= 0xd800 && unit < 0xdc00) {
+                        // A high surrogate, which must be followed by an
+                        // escaped low surrogate.
+                        if (m_pos + 2 > m_in.size() || m_in[m_pos] != '\\' || m_in[m_pos + 1] != 'u') {
+                            return Fail();
+                        }
+                        m_pos += 2;
+                        cp = unit;
+                        continue;
+                    }
+                    if (n == 1) {
+                        if (unit < 0xdc00 || unit >= 0xe000) {
+                            return Fail();
+                        }
+                        cp = 0x10000 + ((cp - 0xd800) << 10) + (unit - 0xdc00);
+                    } else {
+                        cp = unit;
+                    }
+                    break;
+                }
+                AppendUtf8(out, cp);
+                break;
+            }
+            default:
+                return Fail();
+        }
+    }
+    return Fail(); // unterminated
+}
+
+bool JsonScanner::ReadNumber(absl::string_view& text)
+{
+    Peek();
+    const size_t begin = m_pos;
+    auto digits = [this]() {
+        const size_t start = m_pos;
+        while (m_pos < m_in.size() && m_in[m_pos] >= '0' && m_in[m_pos] <= '9') {
+            ++m_pos;
+        }
+        return m_pos > start;
+    };
+    if (m_pos < m_in.size() && m_in[m_pos] == '-') {
+        ++m_pos;
+    }
+    if (m_pos < m_in.size() && m_in[m_pos] == '0') {
+        ++m_pos;
+    } else if (!digits()) {
+        return Fail();
+    }
+    if (m_pos < m_in.size() && m_in[m_pos] == '.') {
+        ++m_pos;
+        if (!digits()) {
+            return Fail();
+        }
+    }
+    if (m_pos < m_in.size() && (m_in[m_pos] == 'e' || m_in[m_pos] == 'E')) {
+        ++m_pos;
+        if (m_pos < m_in.size() && (m_in[m_pos] == '+' || m_in[m_pos] == '-')) {
+            ++m_pos;
+        }
+        if (!digits()) {
+            return Fail();
+        }
+    }
+    text = m_in.substr(begin, m_pos - begin);
+    return m_ok;
+}
+
+bool JsonScanner::Literal(absl::string_view literal)
+{
+    if (m_in.substr(m_pos, literal.size()) != literal) {
+        return Fail();
+    }
+    m_pos += literal.size();
+    return true;
+}
+
+bool JsonScanner::ReadBool(bool& value)
+{
+    switch (Peek()) {
+        case 't': value = true; return Literal("true");
+        case 'f': value = false; return Literal("false");
+        default: return Fail();
+    }
+}
+
+bool JsonScanner::ReadNull()
+{
+    if (Peek() != 'n') {
+        return Fail();
+    }
+    return Literal("null");
+}
+
+bool JsonScanner::SkipValue()
+{
+    absl::string_view ignored;
+    bool ignored_bool;
+    switch (Peek()) {
+        case '{':
+            if (!BeginObject()) {
+                return false;
+            }
+            while (NextMember(ignored)) {
+                if (!SkipValue()) {
+                    return false;
+                }
+            }
+            return m_ok;
+        case '[':
+            if (!BeginArray()) {
+                return false;
+            }
+            while (NextElement()) {
+                if (!SkipValue()) {
+                    return false;
+                }
+            }
+            return m_ok;
+        case '"':
+            return ReadString(ignored);
+        case 't':
+        case 'f':
+            return ReadBool(ignored_bool);
+        case 'n':
+            return ReadNull();
+        default:
+            return ReadNumber(ignored);
+    }
+}
+
+// End of File
@@ -0,0 +1,101 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef JSONSCAN_H
+#define JSONSCAN_H
+
+#include <stddef.h>
+
+#include <deque>
+#include <string>
+
+#include "absl/strings/string_view.h"
+
+/**
+ * A pull parser for JSON text, which reads values in place from the input
+ * rather than building a document, for requests whose shape is known ahead
+ * of time.  Strings are returned as views into the input, except for those
+ * containing escapes, which are unescaped into storage owned by the scanner.
+ * Either way they remain valid for the lifetime of the scanner (and of the
+ * input).
+ *
+ * Objects are read member by member:
+ *
+ *     if (!in.BeginObject()) return false;
+ *     absl::string_view key;
+ *     while (in.NextMember(key)) {
+ *         if (key == "field") { ...read the value... }
+ *         else if (!in.SkipValue()) return false;
+ *     }
+ *     if (!in.ok()) return false;
+ *
+ * and arrays likewise with BeginArray and NextElement.  Once a syntax error
+ * is encountered every call fails, and ok() returns false.
+ */
+class JsonScanner {
+public:
+    /** The deepest nesting of arrays and objects which is accepted. */
+    static const unsigned MAX_DEPTH = 64;
+
+    explicit JsonScanner(absl::string_view in) : m_in(in) {}
+
+    // Non-copyable:
+    JsonScanner(const JsonScanner&) = delete;
+    JsonScanner& operator=(const JsonScanner&) = delete;
+
+    bool ok() const { return m_ok; }
+
+    /** The first character of the next value, without consuming it, or NUL at
+     *  the end of the input.  E.g. '"' for a string, or '{' for an object. */
+    char Peek();
+
+    /** True if the rest of the input is whitespace. */
+    bool AtEnd();
+
+    bool BeginObject();
+    /** Reads the key of the next member of the current object, which is then
+     *  followed by its value.  Returns false at the end of the object, or on
+     *  error. */
+    bool NextMember(absl::string_view& key);
+
+    bool BeginArray();
+    /** Returns true if the current array has another element, which is then
+     *  to be read, or false at the end of the array, or on error. */
+    bool NextElement();
+
+    bool ReadString(absl::string_view& str);
+    /** Reads a number, returning its text for the caller to convert. */
+    bool ReadNumber(absl::string_view& text);
+    bool ReadBool(bool& value);
+    bool ReadNull();
+
+    /** Reads and discards the next value, of whatever type. */
+    bool SkipValue();
+
+private:
+    bool Fail() { m_ok = false; return false; }
+    void SkipWhitespace();
+    /** Reads the comma which separates the members or elements of the current
+     *  object or array, unless at the first one. */
+    bool Separator();
+    bool Literal(absl::string_view literal);
+    bool Unescape(size_t begin, absl::string_view& str);
+
+    absl::string_view m_in;
+    size_t m_pos = 0;
+    bool m_ok = true;
+    // Set at the opening of an object or array, until its first member or
+    // element has been read.
+    bool m_first = false;
+    unsigned m_depth = 0;
+    // Storage for strings which contained escapes.  A deque, so that earlier
+    // strings don't move as more are added.
+    std::deque<std::string> m_unescaped;
+};
+
+#endif // JSONSCAN_H
+
+// End of File
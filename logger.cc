@@ -0,0 +1,211 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "logger.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "absl/strings/str_cat.h"
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+struct Logger::Slot {
+    std::atomic<uint64_t> seq{0};
+    LogLevel level = LogLevel::INFO;
+    uint32_t size = 0;
+    char text[k_slot_size - 16];
+};
+
+struct Logger::Site {
+    // The second of the current window, and how many messages have been
+    // logged and suppressed within it.
+    std::atomic<int64_t> second{0};
+    std::atomic<unsigned> count{0};
+    std::atomic<uint64_t> suppressed{0};
+};
+
+Logger::Logger()
+    : m_slots(new Slot[k_num_slots])
+    , m_sites(new Site[k_num_sites])
+{
+    for (size_t i = 0; i < k_num_slots; ++i) {
+        m_slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+    std::thread(&Logger::WriterLoop, this).detach();
+}
+
+bool Logger::Admit(uint64_t site, uint64_t& suppressed)
+{
+    Site& s = m_sites[site % k_num_sites];
+    const int64_t now = absl::ToUnixSeconds(absl::Now());
+    int64_t second = s.second.load(std::memory_order_relaxed);
+    if (second != now && s.second.compare_exchange_strong(second, now, std::memory_order_relaxed)) {
+        s.count.store(0, std::memory_order_relaxed);
+    }
+    if (s.count.fetch_add(1, std::memory_order_relaxed) < k_max_per_second) {
+        suppressed = s.suppressed.exchange(0, std::memory_order_relaxed);
+        return true;
+    }
+    s.suppressed.fetch_add(1, std::memory_order_relaxed);
+    return false;
+}
+
+void Logger::Write(LogLevel level, absl::string_view message)
+{
+    if (!IsEnabled(level)) {
+        return;
+    }
+    while (!message.empty() && message.back() == '\n') {
+        message.remove_suffix(1);
+    }
+
+    // Claim the slot at the next position, once it has been read at the
+    // position one lap ago.  If it hasn't, the ring is full.
+    uint64_t pos = m_write_pos.load(std::memory_order_relaxed);
+    Slot* slot;
+    while (true) {
+        slot = &m_slots[pos % k_num_slots];
+        const int64_t diff = static_cast<int64_t>(slot->seq.load(std::memory_order_acquire) - pos);
+        if (diff == 0) {
+            if (m_write_pos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                break;
+            }
+        } else if (diff < 0) {
+            m_dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        } else {
+            pos = m_write_pos.load(std::memory_order_relaxed);
+        }
+    }
+
+    slot->level = level;
+    if (message.size() <= sizeof(slot->text)) {
+        memcpy(slot->text, message.data(), message.size());
+        slot->size = message.size();
+    } else {
+        // Keep the start of the message, which says what it is about.
+        const std::string suffix = absl::StrCat("... (", message.size(), " bytes)");
+        const size_t keep = sizeof(slot->text) - suffix.size();
+        memcpy(slot->text, message.data(), keep);
+        memcpy(slot->text + keep, suffix.data(), suffix.size());
+        slot->size = sizeof(slot->text);
+    }
+    slot->seq.store(pos + 1, std::memory_order_release);
+}
+
+bool Logger::Drain()
+{
+    std::string out, err;
+    uint64_t pos = m_read_pos.load(std::memory_order_relaxed);
+    while (true) {
+        Slot& slot = m_slots[pos % k_num_slots];
+        if (slot.seq.load(std::memory_order_acquire) != pos + 1) {
+            break;
+        }
+        std::string& buf = (slot.level >= LogLevel::WARNING) ? err : out;
+        if (slot.level == LogLevel::ERROR) {
+            buf.append("error: ");
+        } else if (slot.level == LogLevel::WARNING) {
+            buf.append("warning: ");
+        }
+        buf.append(slot.text, slot.size);
+        buf.push_back('\n');
+        // Free the slot for the next lap.
+        slot.seq.store(pos + k_num_slots, std::memory_order_release);
+        ++pos;
+    }
+    const uint64_t dropped = m_dropped.exchange(0, std::memory_order_relaxed);
+    if (dropped) {
+        absl::StrAppend(&err, "warning: Dropped ", dropped, " log messages.\n");
+    }
+    if (!out.empty()) {
+        fwrite(out.data(), 1, out.size(), stdout);
+        fflush(stdout);
+    }
+    if (!err.empty()) {
+        fwrite(err.data(), 1, err.size(), stderr);
+        fflush(stderr);
+    }
+    // Only now is everything up to pos written, as far as Flush is concerned.
+    m_read_pos.store(pos, std::memory_order_release);
+    return !out.empty() || !err.empty();
+}
+
+void Logger::WriterLoop()
+{
+    // Poll, backing off while idle, so that producers never have to wake the
+    // writer up.
+    std::chrono::microseconds wait(0);
+    while (true) {
+        if (Drain()) {
+            wait = std::chrono::microseconds(0);
+            continue;
+        }
+        wait = std::min(wait + std::chrono::microseconds(500), std::chrono::microseconds(10000));
+        std::this_thread::sleep_for(wait);
+    }
+}
+
+void Logger::Flush()
+{
+    const uint64_t target = m_write_pos.load(std::memory_order_relaxed);
+    while (m_read_pos.load(std::memory_order_acquire) < target) {
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+}
+
+LogLine::LogLine(LogLevel level, const char* file, int line)
+    : m_level(level)
+{
+    Logger& logger = webcash::logger();
+    if (!logger.IsEnabled(level)) {
+        return;
+    }
+    if (level >= LogLevel::WARNING) {
+        // The file name is a string literal, so its address identifies the
+        // file.
+        const uint64_t site = reinterpret_cast<uintptr_t>(file) + static_cast<uint64_t>(line) * 0x9e3779b97f4a7c15ULL;
+        if (!logger.Admit(site ^ (site >> 29), m_suppressed)) {
+            return;
+        }
+    }
+    m_stream.reset(new std::ostringstream);
+}
+
+LogLine::~LogLine()
+{
+    if (!m_stream) {
+        return;
+    }
+    std::string message = m_stream->str();
+    while (!message.empty() && message.back() == '\n') {
+        message.pop_back();
+    }
+    if (m_suppressed) {
+        absl::StrAppend(&message, " (suppressed ", m_suppressed, " similar messages)");
+    }
+    webcash::logger().Write(m_level, message);
+}
+
+namespace webcash {
+    Logger& logger()
+    {
+        static Logger* const logger = []() {
+            Logger* logger = new Logger;
+            std::atexit([]() { webcash::logger().Flush(); });
+            return logger;
+        }();
+        return *logger;
+    }
+} // webcash
+
+// End of File
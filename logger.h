@@ -0,0 +1,146 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef LOGGER_H
+#define LOGGER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <memory>
+#include <ostream>
+#include <sstream>
+#include <string>
+
+#include "absl/strings/string_view.h"
+
+enum class LogLevel : int {
+    VERBOSE = 0,
+    INFO = 1,
+    WARNING = 2,
+    ERROR = 3,
+};
+
+/**
+ * Writes log messages from a background thread, so that logging never blocks
+ * the caller on terminal or file I/O.  Messages are copied into a bounded
+ * lock-free ring of fixed-size slots, which the writer drains in batches,
+ * writing informational messages to stdout and warnings and errors to stderr
+ * with one write each per batch.
+ *
+ * Messages longer than a slot are truncated, and if the ring is full they are
+ * dropped, and counted, rather than waited on.  Warnings and errors are also
+ * rate limited by the line of code which logs them, so that a flood of bad
+ * requests logs a few lines a second rather than a line per request.
+ */
+class Logger {
+public:
+    /** The size of a slot, which bounds the length of a message. */
+    static const size_t k_slot_size = 1024;
+    /** The number of slots in the ring. */
+    static const size_t k_num_slots = 4096;
+    /** Most warnings and errors logged each second by a line of code. */
+    static const unsigned k_max_per_second = 10;
+
+    Logger();
+    // Non-copyable:
+    Logger(const Logger&) = delete;
+    Logger& operator=(const Logger&) = delete;
+
+    /** Messages below level are discarded.  LogLevel::INFO by default. */
+    void SetLevel(LogLevel level) { m_level.store(static_cast<int>(level)); }
+    bool IsEnabled(LogLevel level) const { return static_cast<int>(level) >= m_level.load(std::memory_order_relaxed); }
+
+    /** Whether a warning or error from the source line identified by site
+     *  may be logged now, under the rate limit.  If so, and others from it
+     *  were suppressed since it last was, suppressed is set to how many. */
+    bool Admit(uint64_t site, uint64_t& suppressed);
+
+    /** Queues a message to be written, without its trailing newline. */
+    void Write(LogLevel level, absl::string_view message);
+
+    /** Waits until everything queued so far has been written. */
+    void Flush();
+
+private:
+    struct Slot;
+    struct Site;
+
+    void WriterLoop();
+    /** Writes out whatever is queued, returning whether there was any. */
+    bool Drain();
+
+    std::atomic<int> m_level{static_cast<int>(LogLevel::INFO)};
+
+    /** The ring, as a bounded multi-producer queue.  Each slot's sequence
+     *  number says whether it is free to be written at a given position, or
+     *  has been written and is ready to be read. */
+    std::unique_ptr<Slot[]> m_slots;
+    std::atomic<uint64_t> m_write_pos{0};
+    std::atomic<uint64_t> m_read_pos{0};
+    std::atomic<uint64_t> m_dropped{0};
+
+    /** The rate limit of each source line, by hash. */
+    static const size_t k_num_sites = 1024;
+    std::unique_ptr<Site[]> m_sites;
+};
+
+namespace webcash {
+    /** The logger of the running process.  It is never destroyed, so that
+     *  messages can still be logged from other threads and static destructors
+     *  at exit, and whatever is queued is written by an atexit handler. */
+    Logger& logger();
+} // webcash
+
+/**
+ * A message under construction, which is written to webcash::logger() when it
+ * goes out of scope, e.g.
+ *
+ *     LogError() << "Offending SQL: " << sql;
+ *
+ * Nothing is formatted if the message is below the logger's level, or is
+ * suppressed by the rate limit.
+ */
+class LogLine {
+public:
+    LogLine(LogLevel level, const char* file, int line);
+    ~LogLine();
+    // Non-copyable:
+    LogLine(const LogLine&) = delete;
+    LogLine& operator=(const LogLine&) = delete;
+
+    template <typename T>
+    LogLine& operator<<(const T& value) {
+        if (m_stream) {
+            *m_stream << value;
+        }
+        return *this;
+    }
+
+    // For std::endl and the like.
+    LogLine& operator<<(std::ostream& (*manip)(std::ostream&)) {
+        if (m_stream) {
+            *m_stream << manip;
+        }
+        return *this;
+    }
+
+private:
+    LogLevel m_level;
+    uint64_t m_suppressed = 0;
+    std::unique_ptr<std::ostringstream> m_stream;
+};
+
+// The call site is passed implicitly, to rate limit each line of code.
+inline LogLine LogVerbose(const char* file = __builtin_FILE(), int line = __builtin_LINE()) { return LogLine(LogLevel::VERBOSE, file, line); }
+inline LogLine LogInfo(const char* file = __builtin_FILE(), int line = __builtin_LINE()) { return LogLine(LogLevel::INFO, file, line); }
+inline LogLine LogWarning(const char* file = __builtin_FILE(), int line = __builtin_LINE()) { return LogLine(LogLevel::WARNING, file, line); }
+inline LogLine LogError(const char* file = __builtin_FILE(), int line = __builtin_LINE()) { return LogLine(LogLevel::ERROR, file, line); }
+
+#endif // LOGGER_H
+
+// End of File
@@ -0,0 +1,221 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "metrics.h"
+
+#include "absl/strings/str_cat.h"
+
+namespace {
+
+std::string EscapeLabel(const std::string& value)
+{
+    std::string out;
+    out.reserve(value.size());
+    for (char c : value) {
+        if (c == '\\' || c == '"') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if (c == '\n') {
+            out += "\\n";
+        } else {
+            out.push_back(c);
+        }
+    }
+    return out;
+}
+
+void Header(std::string& out, const char* name, const char* type, const char* help)
+{
+    absl::StrAppend(&out, "# HELP ", name, " ", help, "\n# TYPE ", name, " ", type, "\n");
+}
+
+} // anonymous namespace
+
+HashCounter* MinerMetrics::AddThread(const std::string& name)
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    m_threads.emplace_back();
+    m_threads.back().name = name;
+    return &m_threads.back().counter;
+}
+
+int64_t MinerMetrics::Sample(absl::Time now)
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    const double seconds = absl::ToDoubleSeconds(now - m_last_sample);
+    int64_t total = 0;
+    for (Thread& thread : m_threads) {
+        const int64_t count = thread.counter.Get();
+        const int64_t delta = count - thread.last_count;
+        thread.last_count = count;
+        thread.hashrate = seconds > 0.0 ? delta / seconds : 0.0;
+        total += delta;
+    }
+    m_hashrate = seconds > 0.0 ? total / seconds : 0.0;
+    m_last_sample = now;
+    return total;
+}
+
+std::vector<std::pair<std::string, double>> MinerMetrics::GetThreadHashrates() const
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    std::vector<std::pair<std::string, double>> res;
+    for (const Thread& thread : m_threads) {
+        res.emplace_back(thread.name, thread.hashrate);
+    }
+    return res;
+}
+
+double MinerMetrics::GetHashrate() const
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    return m_hashrate;
+}
+
+void MinerMetrics::AddSubmitLatency(absl::Duration latency)
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    m_submit_latency_sum += absl::ToDoubleSeconds(latency);
+    ++m_submit_latency_count;
+}
+
+std::string MinerMetrics::Render() const
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    std::string out;
+    auto header = [&](const char* name, const char* type, const char* help) {
+        Header(out, name, type, help);
+    };
+
+    header("webminer_hashes_total", "counter", "Hashes computed by each mining thread.");
+    for (const Thread& thread : m_threads) {
+        absl::StrAppend(&out, "webminer_hashes_total{thread=\"", thread.name, "\"} ", thread.counter.Get(), "\n");
+    }
+    header("webminer_thread_hashrate", "gauge", "Hashes per second of each mining thread, over the last sampling interval.");
+    for (const Thread& thread : m_threads) {
+        absl::StrAppend(&out, "webminer_thread_hashrate{thread=\"", thread.name, "\"} ", thread.hashrate, "\n");
+    }
+    header("webminer_hashrate", "gauge", "Hashes per second of all mining threads, over the last sampling interval.");
+    absl::StrAppend(&out, "webminer_hashrate ", m_hashrate, "\n");
+    header("webminer_difficulty", "gauge", "Current mining difficulty, in leading zero bits.");
+    absl::StrAppend(&out, "webminer_difficulty ", difficulty.load(), "\n");
+    header("webminer_candidates_total", "counter", "Hashes passing the mining kernel's filter, which were checked against the difficulty.");
+    absl::StrAppend(&out, "webminer_candidates_total ", candidates.load(), "\n");
+    header("webminer_solutions_total", "counter", "Proof-of-work solutions found.");
+    absl::StrAppend(&out, "webminer_solutions_total ", solutions.load(), "\n");
+    header("webminer_submissions_total", "counter", "Mining reports accepted by the server.");
+    absl::StrAppend(&out, "webminer_submissions_total ", submissions.load(), "\n");
+    header("webminer_stale_total", "counter", "Solutions not submitted because the difficulty had increased.");
+    absl::StrAppend(&out, "webminer_stale_total ", stale.load(), "\n");
+    header("webminer_orphans_total", "counter", "Mining reports rejected by the server.");
+    absl::StrAppend(&out, "webminer_orphans_total ", orphans.load(), "\n");
+    header("webminer_submit_errors_total", "counter", "Mining reports which failed with a network error, and were retried.");
+    absl::StrAppend(&out, "webminer_submit_errors_total ", submit_errors.load(), "\n");
+    header("webminer_submit_latency_seconds", "summary", "Time taken by mining report requests.");
+    absl::StrAppend(&out, "webminer_submit_latency_seconds_sum ", m_submit_latency_sum, "\n");
+    absl::StrAppend(&out, "webminer_submit_latency_seconds_count ", m_submit_latency_count, "\n");
+    return out;
+}
+
+void LatencyHistogram::Record(absl::Duration latency)
+{
+    int64_t n = absl::ToInt64Microseconds(latency) / 100;
+    size_t bucket = 0;
+    while (n > 0 && bucket < k_num_buckets - 1) {
+        n >>= 1;
+        ++bucket;
+    }
+    m_buckets[bucket].fetch_add(1, std::memory_order_relaxed);
+    m_count.fetch_add(1, std::memory_order_relaxed);
+    m_sum_ns.fetch_add(absl::ToInt64Nanoseconds(latency), std::memory_order_relaxed);
+}
+
+void LatencyHistogram::Render(std::string& out, const std::string& name, const std::string& labels) const
+{
+    const std::string sep = labels.empty() ? "" : ",";
+    int64_t cumulative = 0;
+    double bound = k_first_bound;
+    for (size_t i = 0; i < k_num_buckets; ++i, bound *= 2) {
+        cumulative += m_buckets[i].load(std::memory_order_relaxed);
+        const std::string le = (i == k_num_buckets - 1) ? "+Inf" : absl::StrCat(bound);
+        absl::StrAppend(&out, name, "_bucket{", labels, sep, "le=\"", le, "\"} ", cumulative, "\n");
+    }
+    const std::string braces = labels.empty() ? "" : absl::StrCat("{", labels, "}");
+    absl::StrAppend(&out, name, "_sum", braces, " ", m_sum_ns.load(std::memory_order_relaxed) / 1e9, "\n");
+    absl::StrAppend(&out, name, "_count", braces, " ", m_count.load(std::memory_order_relaxed), "\n");
+}
+
+void ServerMetrics::Endpoint::Add(int status, absl::Duration duration)
+{
+    switch (status) {
+        case 200: ok.fetch_add(1, std::memory_order_relaxed); break;
+        case 500: error.fetch_add(1, std::memory_order_relaxed); break;
+        case 503: busy.fetch_add(1, std::memory_order_relaxed); break;
+        default: other.fetch_add(1, std::memory_order_relaxed); break;
+    }
+    latency.Record(duration);
+}
+
+ServerMetrics::Endpoint* ServerMetrics::GetEndpoint(const std::string& endpoint)
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    auto& ptr = m_endpoints[endpoint];
+    if (!ptr) {
+        ptr.reset(new Endpoint());
+    }
+    return ptr.get();
+}
+
+LatencyHistogram* ServerMetrics::GetStage(const std::string& endpoint, const std::string& stage)
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    auto& ptr = m_stages[{endpoint, stage}];
+    if (!ptr) {
+        ptr.reset(new LatencyHistogram());
+    }
+    return ptr.get();
+}
+
+void ServerMetrics::AddError(const std::string& error)
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    ++m_errors[error];
+}
+
+std::string ServerMetrics::Render() const
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    std::string out;
+
+    Header(out, "webcashd_requests_total", "counter", "Requests answered by each endpoint, by HTTP status code.");
+    for (const auto& item : m_endpoints) {
+        const std::string endpoint = EscapeLabel(item.first);
+        const std::pair<const char*, const std::atomic<int64_t>*> codes[] = {
+            {"200", &item.second->ok},
+            {"500", &item.second->error},
+            {"503", &item.second->busy},
+            {"other", &item.second->other},
+        };
+        for (const auto& code : codes) {
+            absl::StrAppend(&out, "webcashd_requests_total{endpoint=\"", endpoint, "\",code=\"", code.first, "\"} ", code.second->load(std::memory_order_relaxed), "\n");
+        }
+    }
+    Header(out, "webcashd_request_seconds", "histogram", "Time from receipt of each request to its response, by endpoint.");
+    for (const auto& item : m_endpoints) {
+        item.second->latency.Render(out, "webcashd_request_seconds", absl::StrCat("endpoint=\"", EscapeLabel(item.first), "\""));
+    }
+    Header(out, "webcashd_stage_seconds", "histogram", "Time taken by each stage of handling a request, by endpoint and stage.");
+    for (const auto& item : m_stages) {
+        item.second->Render(out, "webcashd_stage_seconds", absl::StrCat("endpoint=\"", EscapeLabel(item.first.first), "\",stage=\"", EscapeLabel(item.first.second), "\""));
+    }
+    Header(out, "webcashd_errors_total", "counter", "Errors returned to callers, by message.");
+    for (const auto& item : m_errors) {
+        absl::StrAppend(&out, "webcashd_errors_total{error=\"", EscapeLabel(item.first), "\"} ", item.second, "\n");
+    }
+    return out;
+}
+
+// End of File
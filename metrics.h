@@ -0,0 +1,179 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "absl/time/clock.h"
+#include "absl/time/time.h"
+
+/**
+ * Counts the hashes computed by a single mining thread.  Each counter has a
+ * cache line to itself, and only the owning thread writes to it, so that the
+ * mining threads never contend with each other.
+ */
+class alignas(64) HashCounter {
+public:
+    /** Must only be called from the thread that owns this counter. */
+    void Add(int64_t n)
+    {
+        // There is a single writer, so no atomic read-modify-write is needed.
+        m_count.store(m_count.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    int64_t Get() const { return m_count.load(std::memory_order_relaxed); }
+
+private:
+    std::atomic<int64_t> m_count{0};
+};
+
+/**
+ * The miner's statistics: per-thread hash counts and hashrates, plus the
+ * event counters reported by the server communication thread.
+ */
+class MinerMetrics {
+public:
+    /** Register a mining thread under the given name, returning its counter.
+     *  The counter lives as long as this object. */
+    HashCounter* AddThread(const std::string& name);
+
+    /**
+     * Total the hash counters, and update the hashrates to those seen since
+     * the previous call.  Returns the number of hashes computed in that time.
+     */
+    int64_t Sample(absl::Time now);
+
+    /** Render all metrics in the Prometheus text exposition format. */
+    std::string Render() const;
+
+    /** The hashrate of each thread, by name, and of all threads together,
+     *  as of the last call to Sample(). */
+    std::vector<std::pair<std::string, double>> GetThreadHashrates() const;
+    double GetHashrate() const;
+
+    std::atomic<unsigned> difficulty{0};
+    /** Hashes passing the mining kernels' filter, which are re-hashed in
+     *  full to compare against the difficulty. */
+    std::atomic<int64_t> candidates{0};
+    std::atomic<int64_t> solutions{0};
+    std::atomic<int64_t> submissions{0};
+    std::atomic<int64_t> stale{0};
+    std::atomic<int64_t> orphans{0};
+    std::atomic<int64_t> submit_errors{0};
+
+    /** Record the time taken by one mining report. */
+    void AddSubmitLatency(absl::Duration latency);
+
+private:
+    struct Thread {
+        std::string name;
+        HashCounter counter;
+        int64_t last_count = 0;
+        double hashrate = 0.0;
+    };
+
+    mutable std::mutex m_mutex;
+    // A deque, so that counters don't move as threads are added.
+    std::deque<Thread> m_threads;
+    absl::Time m_last_sample = absl::InfinitePast();
+    double m_hashrate = 0.0;
+    double m_submit_latency_sum = 0.0;
+    int64_t m_submit_latency_count = 0;
+};
+
+/**
+ * A histogram of durations, which any thread can record to without locking.
+ * The buckets double in size, from 100us up to 6.5s, plus one for anything
+ * longer.
+ */
+class LatencyHistogram {
+public:
+    static const size_t k_num_buckets = 18;
+    static constexpr double k_first_bound = 0.0001; // seconds
+
+    void Record(absl::Duration latency);
+
+    /** Append the histogram's series, as a Prometheus histogram called name,
+     *  with the given labels (e.g. "endpoint=\"replace\"", or empty). */
+    void Render(std::string& out, const std::string& name, const std::string& labels) const;
+
+private:
+    std::atomic<int64_t> m_buckets[k_num_buckets] = {};
+    std::atomic<int64_t> m_count{0};
+    std::atomic<int64_t> m_sum_ns{0};
+};
+
+/**
+ * Times the successive stages of handling a request.  Each stage is timed
+ * from the end of the one before, so that time spent waiting in between
+ * (e.g. for a database connection) is charged to the stage that waited.
+ */
+class StageTimer {
+public:
+    void Start(absl::Time now = absl::Now()) { m_last = now; }
+
+    /** Record the time since the previous stage ended, or since Start(). */
+    void End(LatencyHistogram* stage)
+    {
+        const absl::Time now = absl::Now();
+        stage->Record(now - m_last);
+        m_last = now;
+    }
+
+private:
+    absl::Time m_last = absl::Now();
+};
+
+/**
+ * The server's statistics: the outcomes and latency of the requests to each
+ * endpoint, the latency of each stage of handling them, and a count of each
+ * error returned.  Endpoints and stages are registered on first use, and
+ * live as long as this object, so callers look them up once and keep the
+ * pointer; recording to them doesn't lock.
+ */
+class ServerMetrics {
+public:
+    struct Endpoint {
+        LatencyHistogram latency;
+        // By HTTP status code of the response.
+        std::atomic<int64_t> ok{0}; // 200
+        std::atomic<int64_t> error{0}; // 500 (JSONRPCError)
+        std::atomic<int64_t> busy{0}; // 503 (turned away by admission control)
+        std::atomic<int64_t> other{0};
+
+        void Add(int status, absl::Duration latency);
+    };
+
+    Endpoint* GetEndpoint(const std::string& endpoint);
+    LatencyHistogram* GetStage(const std::string& endpoint, const std::string& stage);
+
+    /** Count an error returned to a caller, by its message. */
+    void AddError(const std::string& error);
+
+    /** Render all metrics in the Prometheus text exposition format. */
+    std::string Render() const;
+
+private:
+    mutable std::mutex m_mutex;
+    std::map<std::string, std::unique_ptr<Endpoint>> m_endpoints;
+    std::map<std::pair<std::string, std::string>, std::unique_ptr<LatencyHistogram>> m_stages;
+    std::map<std::string, int64_t> m_errors;
+};
+
+#endif // METRICS_H
+
+// End of File
@@ -30,6 +30,7 @@
 
 #include <stdlib.h>
 #include <unistd.h>
+#include <atomic>
 #include <iostream>
 #include <thread>
 
@@ -592,9 +593,66 @@ static void ProcRand(unsigned char* out, int num, RNGLevel level) noexcept
     }
 }
 
+/** Incremented by RandAddPeriodic(), to make every thread's DRBG re-key. */
+static std::atomic<uint64_t> g_drbg_epoch{0};
+
+namespace {
+
+class ThreadDRBG {
+    ChaCha20 m_rng;
+    bool m_seeded = false;
+    uint64_t m_epoch = 0;
+    size_t m_output = 0;
+
+    void Reseed() noexcept
+    {
+        unsigned char seed[32];
+        m_epoch = g_drbg_epoch.load(std::memory_order_acquire);
+        ProcRand(seed, sizeof(seed), RNGLevel::SLOW);
+        m_rng.SetKey(seed, sizeof(seed));
+        memory_cleanse(seed, sizeof(seed));
+        m_seeded = true;
+        m_output = 0;
+    }
+
+public:
+    ~ThreadDRBG()
+    {
+        memory_cleanse(&m_rng, sizeof(m_rng));
+    }
+
+    void Fill(unsigned char* out, size_t num) noexcept
+    {
+        if (!m_seeded || m_output >= DRBG_RESEED_BYTES || m_epoch != g_drbg_epoch.load(std::memory_order_acquire)) {
+            Reseed();
+        }
+        // Output, and then replace the key with more of the keystream.
+        if (num) {
+            m_rng.Keystream(out, num);
+        }
+        unsigned char key[32];
+        m_rng.Keystream(key, sizeof(key));
+        m_rng.SetKey(key, sizeof(key));
+        memory_cleanse(key, sizeof(key));
+        m_output += num;
+    }
+};
+
+} // namespace
+
 void GetRandBytes(unsigned char* buf, int num) noexcept { ProcRand(buf, num, RNGLevel::FAST); }
 void GetStrongRandBytes(unsigned char* buf, int num) noexcept { ProcRand(buf, num, RNGLevel::SLOW); }
-void RandAddPeriodic() noexcept { ProcRand(nullptr, 0, RNGLevel::PERIODIC); }
+void GetBulkRandBytes(unsigned char* buf, size_t num) noexcept
+{
+    static thread_local ThreadDRBG drbg;
+    drbg.Fill(buf, num);
+}
+void RandAddPeriodic() noexcept
+{
+    ProcRand(nullptr, 0, RNGLevel::PERIODIC);
+    // Have the DRBGs pick up the new entropy.
+    g_drbg_epoch.fetch_add(1, std::memory_order_release);
+}
 void RandAddEvent(const uint32_t event_info) noexcept { GetRNGState().AddEvent(event_info); }
 
 bool g_mock_deterministic_tests{false};
@@ -692,6 +750,15 @@ bool Random_SanityCheck()
     to_add.Write((const unsigned char*)&stop, sizeof(stop));
     GetRNGState().MixExtract(nullptr, 0, std::move(to_add), false);
 
+    // The DRBG is keyed from the state just checked, but make sure it isn't
+    // stuck producing the same output.
+    unsigned char bulk[2][32];
+    GetBulkRandBytes(bulk[0], 32);
+    GetBulkRandBytes(bulk[1], 32);
+    const bool distinct = memcmp(bulk[0], bulk[1], 32) != 0;
+    memory_cleanse(bulk, sizeof(bulk));
+    if (!distinct) return false;
+
     return true;
 }
 
@@ -98,6 +98,23 @@ uint256 GetRandHash() noexcept;
  */
 void GetStrongRandBytes(unsigned char* buf, int num) noexcept;
 
+/**
+ * Generate random data from a per-thread ChaCha20 DRBG, for when many secrets
+ * are needed.  Each thread's DRBG is keyed from GetStrongRandBytes() on first
+ * use, and re-keyed from it after every RandAddPeriodic() call and after
+ * every DRBG_RESEED_BYTES of output.  The key is replaced from the keystream
+ * after every call, so earlier output can't be recovered from the state.
+ *
+ * Any amount of output can be requested at once, and threads never contend
+ * with each other except when re-keying.
+ *
+ * Thread-safe.
+ */
+void GetBulkRandBytes(unsigned char* buf, size_t num) noexcept;
+
+/** The amount of GetBulkRandBytes() output after which a thread re-keys. */
+static const size_t DRBG_RESEED_BYTES = 1 << 20;
+
 /**
  * Gather entropy from various expensive sources, and feed them to the PRNG state.
  *
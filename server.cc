@@ -7,27 +7,46 @@
 #include "server.h"
 
 #include <stdint.h>
+#include <stdio.h>
 
+#include <algorithm>
 #include <atomic>
+#include <cmath>
+#include <fstream>
 #include <functional>
+#include <future>
+#include <iterator>
+#include <limits>
 #include <map>
 #include <set>
 #include <string>
+#include <thread>
 #include <utility>
 #include <vector>
 
 #include "absl/numeric/int128.h"
+#include "absl/strings/escaping.h"
+#include "absl/strings/numbers.h"
+#include "absl/strings/match.h"
+#include "absl/strings/str_cat.h"
 
+#include "absl/time/civil_time.h"
 #include "absl/time/clock.h"
 #include "absl/time/time.h"
 
 #include <drogon/HttpController.h>
 #include <drogon/HttpSimpleController.h>
+#include <drogon/nosql/RedisClient.h>
 #include <drogon/orm/Exception.h>
 
 #include <json/json.h>
 
+#include "auditlog.h"
+#include "logger.h"
 #include "uint256.h"
+#include "util/lockstats.h"
+#include "utxocache.h"
+#include "utxosnapshot.h"
 #include "webcash.h"
 
 using std::to_string;
@@ -42,18 +61,83 @@ using drogon::orm::DbClient;
 using drogon::orm::DrogonDbException;
 using drogon::orm::Result;
 using drogon::orm::Transaction;
+using drogon::nosql::RedisException;
+using drogon::nosql::RedisResult;
+using drogon::nosql::RedisResultType;
 
 using Json::ValueType::nullValue;
 using Json::ValueType::objectValue;
 
+// With --redis, the set of spent hashes is kept in Redis under this key,
+// rather than in the SpentHashes table.
+static const std::string k_redis_spent_hashes = "SpentHashes";
+
+// Formats a command on the spent hashes set, e.g. SADD or SMISMEMBER, with the
+// hashes as its members.  Commands are formatted by hiredis from text, so the
+// hashes are hex-encoded.
+static std::string RedisSpentHashesCommand(const std::string& verb, const std::vector<uint256>& hashes)
+{
+    std::string cmd;
+    cmd.reserve(verb.size() + k_redis_spent_hashes.size() + 65 * hashes.size() + 1);
+    absl::StrAppend(&cmd, verb, " ", k_redis_spent_hashes);
+    for (const uint256& hash : hashes) {
+        absl::StrAppend(&cmd, " ", absl::BytesToHexString(absl::string_view((const char*)hash.begin(), 32)));
+    }
+    return cmd;
+}
+
+// The counters reported by /stats are kept in the one-row Summary table, so
+// that startup needn't count the rows of every table.  Rather than update that
+// row, which would serialize every replacement on its lock, each transaction
+// which changes a counter inserts its changes into SummaryDeltas, and these are
+// periodically folded into the Summary row.  The columns of both, in order, are
+// num_reports, num_replace, num_burn, num_unspent and total_destroyed.
+static const std::string k_sql_record_summary = "INSERT INTO \"SummaryDeltas\" (\"num_reports\", \"num_replace\", \"num_burn\", \"num_unspent\", \"total_destroyed\") VALUES($1::BIGINT, $2::BIGINT, $3::BIGINT, $4::BIGINT, $5::BIGINT)";
+static const std::string k_sql_compact_summary =
+    "WITH \"Deltas\" AS (DELETE FROM \"SummaryDeltas\" RETURNING *) "
+    "UPDATE \"Summary\" SET "
+        "\"num_reports\" = \"Summary\".\"num_reports\" + \"Total\".\"num_reports\", "
+        "\"num_replace\" = \"Summary\".\"num_replace\" + \"Total\".\"num_replace\", "
+        "\"num_burn\" = \"Summary\".\"num_burn\" + \"Total\".\"num_burn\", "
+        "\"num_unspent\" = \"Summary\".\"num_unspent\" + \"Total\".\"num_unspent\", "
+        "\"total_destroyed\" = \"Summary\".\"total_destroyed\" + \"Total\".\"total_destroyed\" "
+    "FROM (SELECT COALESCE(SUM(\"num_reports\"), 0) AS \"num_reports\", COALESCE(SUM(\"num_replace\"), 0) AS \"num_replace\", COALESCE(SUM(\"num_burn\"), 0) AS \"num_burn\", COALESCE(SUM(\"num_unspent\"), 0) AS \"num_unspent\", COALESCE(SUM(\"total_destroyed\"), 0) AS \"total_destroyed\" FROM \"Deltas\") AS \"Total\"";
+static const std::string k_sql_read_summary =
+    "SELECT \"Summary\".\"num_reports\" + COALESCE(SUM(\"SummaryDeltas\".\"num_reports\"), 0), "
+        "\"Summary\".\"num_replace\" + COALESCE(SUM(\"SummaryDeltas\".\"num_replace\"), 0), "
+        "\"Summary\".\"num_burn\" + COALESCE(SUM(\"SummaryDeltas\".\"num_burn\"), 0), "
+        "\"Summary\".\"num_unspent\" + COALESCE(SUM(\"SummaryDeltas\".\"num_unspent\"), 0), "
+        "\"Summary\".\"total_destroyed\" + COALESCE(SUM(\"SummaryDeltas\".\"total_destroyed\"), 0) "
+    "FROM \"Summary\" LEFT JOIN \"SummaryDeltas\" ON TRUE "
+    "GROUP BY \"Summary\".\"num_reports\", \"Summary\".\"num_replace\", \"Summary\".\"num_burn\", \"Summary\".\"num_unspent\", \"Summary\".\"total_destroyed\"";
+// The same counters, counted from the tables themselves.  Used to seed the
+// Summary of a database which predates it, and by --reconcile_summary.
+static const std::string k_sql_count_summary = absl::StrCat(
+    "SELECT (SELECT COUNT(1) FROM \"MiningReports\"), "
+        "(SELECT COUNT(1) FROM \"Replacements\") + (SELECT COUNT(1) FROM \"AuditLog\" WHERE \"kind\" = ", static_cast<int>(AuditLog::Kind::REPLACE), "), "
+        "(SELECT COUNT(1) FROM \"Burns\") + (SELECT COUNT(1) FROM \"AuditLog\" WHERE \"kind\" = ", static_cast<int>(AuditLog::Kind::BURN), "), "
+        "(SELECT COUNT(1) FROM \"UnspentOutputs\"), "
+        "(SELECT COALESCE(SUM(\"amount\"), 0) FROM \"BurnInputs\") + (SELECT COALESCE(SUM(\"amount\"), 0) FROM \"AuditLog\", unnest(\"input_amounts\") AS \"amount\" WHERE \"kind\" = ", static_cast<int>(AuditLog::Kind::BURN), ")");
+
 namespace webcash {
-static void _upgradeDb()
+// The size of the preimage filter, which leaves room for growth since it
+// isn't resized while the server is running.
+static size_t PreimageFilterSize(uint64_t num_reports)
+{
+    return std::max<size_t>(2 * num_reports, 1 << 20);
+}
+
+// Creates or upgrades the tables and functions of a database.  With --shards,
+// each shard has the same schema as the database itself, although only the
+// tables of unspent outputs, spent hashes, replacements and burns are used.
+static void _upgradeSchema(const std::shared_ptr<DbClient>& db)
 {
-    const std::array<std::string, 8> create_tables = {
+    const std::array<std::string, 12> create_tables = {
         "CREATE TABLE IF NOT EXISTS \"MiningReports\"("
             "\"id\" BIGSERIAL PRIMARY KEY NOT NULL,"
             "\"received\" BIGINT NOT NULL,"
-            "\"preimage\" TEXT UNIQUE NOT NULL,"
+            "\"preimage\" TEXT NOT NULL,"
+            "\"preimage_hash\" BYTEA UNIQUE NOT NULL,"
             "\"difficulty\" SMALLINT NOT NULL,"
             "\"next_difficulty\" SMALLINT NOT NULL,"
             "\"aggregate_work\" DOUBLE PRECISION NOT NULL)",
@@ -91,146 +175,697 @@ static void _upgradeDb()
         "CREATE TABLE IF NOT EXISTS \"SpentHashes\"(" // FIXME: This should eventually
             "\"id\" BIGSERIAL PRIMARY KEY NOT NULL,"  //        be moved to redis?
             "\"hash\" BYTEA UNIQUE NOT NULL)",
+        // With --audit_log, replacements and burns are instead recorded here,
+        // one row each, by bulk loads from the local audit log.  There are no
+        // keys or indexes to maintain, and old partitions can be detached or
+        // archived as a whole.
+        "CREATE TABLE IF NOT EXISTS \"AuditLog\"("
+            "\"received\" BIGINT NOT NULL,"
+            "\"kind\" SMALLINT NOT NULL,"
+            "\"input_hashes\" BYTEA NOT NULL,"
+            "\"input_amounts\" BIGINT[] NOT NULL,"
+            "\"output_hashes\" BYTEA NOT NULL,"
+            "\"output_amounts\" BIGINT[] NOT NULL) "
+            "PARTITION BY RANGE (\"received\")",
+        // With --shards, the transactions which have been prepared on every
+        // shard they touch and are to be committed (see ShardSet::commit).
+        "CREATE TABLE IF NOT EXISTS \"ShardCommits\"("
+            "\"gid\" TEXT PRIMARY KEY NOT NULL)",
+        // The counters of the tables above (see k_sql_record_summary).
+        "CREATE TABLE IF NOT EXISTS \"Summary\"("
+            "\"num_reports\" BIGINT NOT NULL,"
+            "\"num_replace\" BIGINT NOT NULL,"
+            "\"num_burn\" BIGINT NOT NULL,"
+            "\"num_unspent\" BIGINT NOT NULL,"
+            "\"total_destroyed\" NUMERIC NOT NULL)",
+        "CREATE TABLE IF NOT EXISTS \"SummaryDeltas\"("
+            "\"num_reports\" BIGINT NOT NULL,"
+            "\"num_replace\" BIGINT NOT NULL,"
+            "\"num_burn\" BIGINT NOT NULL,"
+            "\"num_unspent\" BIGINT NOT NULL,"
+            "\"total_destroyed\" BIGINT NOT NULL)",
     };
-    auto db = drogon::app().getDbClient();
-    assert(db);
     for (const std::string& sql : create_tables) {
         try {
             db->execSqlSync(sql);
         } catch (const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << sql << std::endl;
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
             drogon::app().quit();
         }
     }
-    {
-        static const std::string sql = "SELECT COUNT(1) FROM \"MiningReports\"";
+    // Bring tables created by earlier versions up to date.  Each of these is a
+    // no-op if it has already been applied.
+    const std::array<std::string, 5> migrations = {
+        // Mining reports are uniquely indexed by the 32-byte SHA256 hash of
+        // the preimage, rather than by the much longer preimage itself.
+        "ALTER TABLE \"MiningReports\" ADD COLUMN IF NOT EXISTS \"preimage_hash\" BYTEA",
+        "UPDATE \"MiningReports\" SET \"preimage_hash\"=sha256(convert_to(\"preimage\", 'UTF8')) WHERE \"preimage_hash\" IS NULL",
+        "ALTER TABLE \"MiningReports\" ALTER COLUMN \"preimage_hash\" SET NOT NULL",
+        "CREATE UNIQUE INDEX IF NOT EXISTS \"MiningReports_preimage_hash_key\" ON \"MiningReports\"(\"preimage_hash\")",
+        "ALTER TABLE \"MiningReports\" DROP CONSTRAINT IF EXISTS \"MiningReports_preimage_key\"",
+    };
+    for (const std::string& sql : migrations) {
         try {
-            const Result r = db->execSqlSync(sql);
-            if (r.empty() || !r[0].size()) {
-                std::cerr << "error: Expected one row of one column containing count.  Got something else." << std::endl;
-                std::cerr << "error: Offending SQL: " << sql << std::endl;
-                drogon::app().quit();
-            }
-            unsigned num_reports = r[0][0].as<unsigned>();
-            if (webcash::state().logging) {
-                std::stringstream ss;
-                ss << "Loaded " << num_reports << " mining reports." << std::endl;
-                std::cout << ss.str();
-            }
-            webcash::state().num_reports.store(num_reports);
+            db->execSqlSync(sql);
         } catch (const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << sql << std::endl;
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
             drogon::app().quit();
         }
     }
     {
-        static const std::string sql = "SELECT COUNT(1) FROM \"Replacements\"";
+        // The audit log loader creates partitions as they are needed, but
+        // having the next one ready keeps that off the first load of a month.
+        const absl::CivilMonth month = absl::ToCivilMonth(absl::Now(), absl::UTCTimeZone());
+        for (const std::string& sql : {AuditLog::CreatePartitionSql(month), AuditLog::CreatePartitionSql(month + 1)}) {
+            try {
+                db->execSqlSync(sql);
+            } catch (const DrogonDbException &e) {
+                LogError() << e.base().what();
+                LogError() << "Offending SQL: " << sql;
+                drogon::app().quit();
+            }
+        }
+    }
+    {
+        // The counters of a database which predates the Summary table are
+        // counted, this once, from the tables themselves.
+        static const std::string sql = "SELECT COUNT(1) FROM \"Summary\"";
+        static const std::string sql_seed = "INSERT INTO \"Summary\" (\"num_reports\", \"num_replace\", \"num_burn\", \"num_unspent\", \"total_destroyed\") " + k_sql_count_summary;
         try {
             const Result r = db->execSqlSync(sql);
             if (r.empty() || !r[0].size()) {
-                std::cerr << "error: Expected one row of one column containing count.  Got something else." << std::endl;
-                std::cerr << "error: Offending SQL: " << sql << std::endl;
+                LogError() << "Expected one row of one column containing count.  Got something else.";
+                LogError() << "Offending SQL: " << sql;
                 drogon::app().quit();
+                return;
             }
-            unsigned num_replace = r[0][0].as<unsigned>();
-            if (webcash::state().logging) {
-                std::stringstream ss;
-                ss << "Loaded " << num_replace << " transactions." << std::endl;
-                std::cout << ss.str();
+            if (!r[0][0].as<int64_t>()) {
+                try {
+                    db->execSqlSync(sql_seed);
+                } catch (const DrogonDbException &e) {
+                    LogError() << e.base().what();
+                    LogError() << "Offending SQL: " << sql_seed;
+                    drogon::app().quit();
+                }
             }
-            webcash::state().num_replace.store(num_replace);
         } catch (const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << sql << std::endl;
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
             drogon::app().quit();
         }
     }
     {
-        static const std::string sql = "SELECT COUNT(1) FROM \"Burns\"";
+        // Sets of hashes are passed to queries as a single binary parameter
+        // holding the concatenated 32-byte hashes, which this function turns
+        // back into an array.
+        static const std::string sql =
+            "CREATE OR REPLACE FUNCTION \"unpack_hashes\"(\"packed\" BYTEA) RETURNS BYTEA[] AS $$ "
+                "SELECT COALESCE(array_agg(substring(\"packed\" FROM \"i\" * 32 + 1 FOR 32) ORDER BY \"i\"), '{}') "
+                "FROM generate_series(0, length(\"packed\") / 32 - 1) AS \"i\" "
+            "$$ LANGUAGE SQL IMMUTABLE STRICT";
         try {
-            const Result r = db->execSqlSync(sql);
-            if (r.empty() || !r[0].size()) {
-                std::cerr << "error: Expected one row of one column containing count.  Got something else." << std::endl;
-                std::cerr << "error: Offending SQL: " << sql << std::endl;
+            db->execSqlSync(sql);
+        } catch (const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
+            drogon::app().quit();
+        }
+    }
+    {
+        // Validates and applies a replacement in a single call, for use with
+        // --single_statement_replace.  Returns "success", or the error to
+        // report to the caller, in which case nothing has been changed.  The
+        // inputs are locked before they are checked, so that concurrent
+        // replacements of the same input are serialized.  The spent hashes
+        // are only recorded if _record_spends is set, as they are otherwise
+        // kept in Redis, and the audit records only if _record_audit is set,
+        // as they are otherwise written to the local audit log.  The change
+        // in unspent outputs is recorded in SummaryDeltas, along with the
+        // given changes to the other counters.
+        const std::array<std::string, 3> sql_drop = {
+            "DROP FUNCTION IF EXISTS \"replace_webcash\"(BYTEA, BIGINT[], BYTEA, BIGINT[], BIGINT)",
+            "DROP FUNCTION IF EXISTS \"replace_webcash\"(BYTEA, BIGINT[], BYTEA, BIGINT[], BIGINT, BOOLEAN)",
+            "DROP FUNCTION IF EXISTS \"replace_webcash\"(BYTEA, BIGINT[], BYTEA, BIGINT[], BIGINT, BOOLEAN, BOOLEAN)",
+        };
+        for (const std::string& sql : sql_drop) {
+            try {
+                db->execSqlSync(sql);
+            } catch (const DrogonDbException &e) {
+                LogError() << e.base().what();
+                LogError() << "Offending SQL: " << sql;
                 drogon::app().quit();
             }
-            unsigned num_burn = r[0][0].as<unsigned>();
-            if (webcash::state().logging) {
-                std::stringstream ss;
-                ss << "Loaded " << num_burn << " burns." << std::endl;
-                std::cout << ss.str();
-            }
-            webcash::state().num_burn.store(num_burn);
+        }
+        static const std::string sql =
+            "CREATE OR REPLACE FUNCTION \"replace_webcash\"(\"_input_hashes\" BYTEA, \"_input_amounts\" BIGINT[], \"_output_hashes\" BYTEA, \"_output_amounts\" BIGINT[], \"_received\" BIGINT, \"_record_spends\" BOOLEAN, \"_record_audit\" BOOLEAN, \"_num_replace\" BIGINT, \"_num_burn\" BIGINT, \"_total_destroyed\" BIGINT) RETURNS TEXT AS $$ "
+            "DECLARE "
+                "\"_inputs\" BYTEA[] := unpack_hashes(\"_input_hashes\"); "
+                "\"_outputs\" BYTEA[] := unpack_hashes(\"_output_hashes\"); "
+                "\"_id\" BIGINT; "
+            "BEGIN "
+                "IF (SELECT COUNT(1) FROM (SELECT 1 FROM \"UnspentOutputs\" INNER JOIN unnest(\"_inputs\", \"_input_amounts\") AS \"InputHashAmount\"(\"hash\",\"amount\") ON \"UnspentOutputs\".\"hash\"=\"InputHashAmount\".\"hash\" AND \"UnspentOutputs\".\"amount\"=\"InputHashAmount\".\"amount\" FOR UPDATE OF \"UnspentOutputs\") AS \"Locked\") <> cardinality(\"_inputs\") THEN "
+                    "RETURN 'input(s) not found'; "
+                "END IF; "
+                "IF EXISTS (SELECT 1 FROM \"UnspentOutputs\" WHERE \"hash\" = ANY(\"_outputs\")) THEN "
+                    "RETURN 'output(s) already exists'; "
+                "END IF; "
+                "IF \"_record_spends\" THEN "
+                    "INSERT INTO \"SpentHashes\" (\"hash\") SELECT unnest(\"_inputs\") ON CONFLICT DO NOTHING; "
+                "END IF; "
+                "DELETE FROM \"UnspentOutputs\" WHERE \"hash\" = ANY(\"_inputs\"); "
+                "INSERT INTO \"UnspentOutputs\" (\"hash\", \"amount\") SELECT * FROM unnest(\"_outputs\", \"_output_amounts\"); "
+                "IF \"_record_audit\" THEN "
+                    "INSERT INTO \"Replacements\" (\"received\") VALUES(\"_received\") RETURNING \"id\" INTO \"_id\"; "
+                    "INSERT INTO \"ReplacementInputs\" (\"replacement_id\", \"hash\", \"amount\") SELECT \"_id\", * FROM unnest(\"_inputs\", \"_input_amounts\"); "
+                    "INSERT INTO \"ReplacementOutputs\" (\"replacement_id\", \"hash\", \"amount\") SELECT \"_id\", * FROM unnest(\"_outputs\", \"_output_amounts\"); "
+                "END IF; "
+                "INSERT INTO \"SummaryDeltas\" (\"num_reports\", \"num_replace\", \"num_burn\", \"num_unspent\", \"total_destroyed\") VALUES(0, \"_num_replace\", \"_num_burn\", cardinality(\"_outputs\") - cardinality(\"_inputs\"), \"_total_destroyed\"); "
+                "RETURN 'success'; "
+            "END "
+            "$$ LANGUAGE plpgsql";
+        try {
+            db->execSqlSync(sql);
         } catch (const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << sql << std::endl;
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
             drogon::app().quit();
         }
     }
     {
-        static const std::string sql = "SELECT COUNT(1) FROM \"UnspentOutputs\"";
+        // Applies one replacement or burn of a batch committed together by
+        // --group_commit.  replace_webcash() is called within an exception
+        // block, and so within a savepoint of its own, so that an error rolls
+        // back only this request, and is returned as "sql error: " and the
+        // message rather than aborting the others.  The audit records of a
+        // burn, if _record_audit is set, are written here, as replace_webcash()
+        // would record them as a replacement.
+        static const std::string sql =
+            "CREATE OR REPLACE FUNCTION \"try_replace_webcash\"(\"_input_hashes\" BYTEA, \"_input_amounts\" BIGINT[], \"_output_hashes\" BYTEA, \"_output_amounts\" BIGINT[], \"_received\" BIGINT, \"_record_spends\" BOOLEAN, \"_record_audit\" BOOLEAN, \"_num_replace\" BIGINT, \"_num_burn\" BIGINT, \"_total_destroyed\" BIGINT, \"_is_burn\" BOOLEAN) RETURNS TEXT AS $$ "
+            "DECLARE "
+                "\"_status\" TEXT; "
+                "\"_id\" BIGINT; "
+            "BEGIN "
+                "\"_status\" := replace_webcash(\"_input_hashes\", \"_input_amounts\", \"_output_hashes\", \"_output_amounts\", \"_received\", \"_record_spends\", \"_record_audit\" AND NOT \"_is_burn\", \"_num_replace\", \"_num_burn\", \"_total_destroyed\"); "
+                "IF \"_status\" = 'success' AND \"_record_audit\" AND \"_is_burn\" THEN "
+                    "INSERT INTO \"Burns\" (\"received\") VALUES(\"_received\") RETURNING \"id\" INTO \"_id\"; "
+                    "INSERT INTO \"BurnInputs\" (\"burn_id\", \"hash\", \"amount\") SELECT \"_id\", * FROM unnest(unpack_hashes(\"_input_hashes\"), \"_input_amounts\"); "
+                "END IF; "
+                "RETURN \"_status\"; "
+            "EXCEPTION WHEN OTHERS THEN "
+                "RETURN 'sql error: ' || SQLERRM; "
+            "END "
+            "$$ LANGUAGE plpgsql";
         try {
-            const Result r = db->execSqlSync(sql);
-            if (r.empty() || !r[0].size()) {
-                std::cerr << "error: Expected one row of one column containing count.  Got something else." << std::endl;
-                std::cerr << "error: Offending SQL: " << sql << std::endl;
-                drogon::app().quit();
+            db->execSqlSync(sql);
+        } catch (const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
+            drogon::app().quit();
+        }
+    }
+}
+
+// How often the SummaryDeltas are folded into the Summary row.
+static const absl::Duration k_summary_compaction_interval = absl::Minutes(1);
+
+static void StartSummaryCompaction(const std::vector<std::shared_ptr<DbClient>>& summaries)
+{
+    // Started only once, although _resetDb upgrades the database again.
+    static bool started = false;
+    if (started) {
+        return;
+    }
+    started = true;
+    drogon::app().getLoop()->runEvery(absl::ToDoubleSeconds(k_summary_compaction_interval), [summaries]() {
+        for (const auto& summary : summaries) {
+            *summary << k_sql_compact_summary
+                >> [](const Result &r) {}
+                >> [](const DrogonDbException &e) {
+                    LogError() << e.base().what();
+                    LogError() << "Offending SQL: " << k_sql_compact_summary;
+                };
+        }
+    });
+}
+
+// With --reconcile_summary, the rows of each database's tables are counted in
+// the background, and any difference from its Summary is recorded as another
+// delta.  Both are read from the same snapshot, so the correction is exact
+// despite the changes made meanwhile.  With --audit_log, records may still be
+// waiting to be loaded into the AuditLog table, so only the mining reports and
+// unspent outputs are reconciled.
+static void ReconcileSummary(std::vector<std::shared_ptr<DbClient>> summaries)
+{
+    static const std::array<const char*, 5> k_names = {"num_reports", "num_replace", "num_burn", "num_unspent", "total_destroyed"};
+    static const std::string sql_snapshot = "SET TRANSACTION ISOLATION LEVEL REPEATABLE READ";
+    for (size_t n = 0; n < summaries.size(); ++n) {
+        const std::string* sql = &sql_snapshot;
+        std::array<int64_t, 5> diff = {};
+        bool differs = false;
+        try {
+            auto tx = summaries[n]->newTransaction();
+            tx->execSqlSync(*sql);
+            sql = &k_sql_count_summary;
+            const Result counted = tx->execSqlSync(*sql);
+            sql = &k_sql_read_summary;
+            const Result recorded = tx->execSqlSync(*sql);
+            if (counted.size() != 1 || counted[0].size() != 5 || recorded.size() != 1 || recorded[0].size() != 5) {
+                LogError() << "Expected one row of five columns containing counts.  Got something else.";
+                LogError() << "Offending SQL: " << *sql;
+                tx->rollback();
+                continue;
             }
-            unsigned num_unspent = r[0][0].as<unsigned>();
-            if (webcash::state().logging) {
-                std::stringstream ss;
-                ss << "Loaded " << num_unspent << " unspent webcash." << std::endl;
-                std::cout << ss.str();
+            for (size_t i = 0; i < diff.size(); ++i) {
+                if (webcash::audit().IsOpen() && i != 0 && i != 3) {
+                    continue;
+                }
+                diff[i] = counted[0][i].as<int64_t>() - recorded[0][i].as<int64_t>();
+                if (diff[i]) {
+                    LogWarning() << "Summary of database " << n << " has " << k_names[i] << "=" << recorded[0][i].as<int64_t>() << ", but counted " << counted[0][i].as<int64_t>() << ".";
+                    differs = true;
+                }
+            }
+            if (!differs) {
+                tx->rollback();
+                continue;
+            }
+            sql = &k_sql_record_summary;
+            tx->execSqlSync(*sql, diff[0], diff[1], diff[2], diff[3], diff[4]);
+            std::promise<bool> committed;
+            tx->setCommitCallback([&committed](bool ok) {
+                committed.set_value(ok);
+            });
+            tx.reset();
+            if (!committed.get_future().get()) {
+                LogError() << "Failed to commit correction to summary of database " << n << ".";
+                continue;
             }
-            webcash::state().num_unspent.store(num_unspent);
         } catch (const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << sql << std::endl;
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << *sql;
+            continue;
+        }
+        webcash::state().num_reports += diff[0];
+        webcash::state().num_replace += diff[1];
+        webcash::state().num_burn += diff[2];
+        webcash::state().num_unspent += diff[3];
+        webcash::state().total_destroyed += diff[4];
+    }
+    if (webcash::state().logging) {
+        LogInfo() << "Reconciled summary of " << summaries.size() << " database(s).";
+    }
+}
+
+// Loads the counters and caches from webcash::state().storage, in place of
+// the database.
+static void _loadStorage()
+{
+    Storage::Counts counts;
+    Storage::Tip last;
+    webcash::utxos().Clear();
+    webcash::utxos().SetTrackSpent(true);
+    // The preimage filter is replaced before anything is read, so that no
+    // report recorded in the meantime is missed, and resized once the number
+    // of reports is known, since nothing is recorded while the store is read.
+    webcash::state().preimages.Reset(PreimageFilterSize(0), 0.001);
+    bool sized = false;
+    const bool ok = webcash::state().storage->Load(
+        counts,
+        last,
+        [&](const uint256& hash) {
+            if (!sized && PreimageFilterSize(counts.num_reports) > PreimageFilterSize(0)) {
+                webcash::state().preimages.Reset(PreimageFilterSize(counts.num_reports), 0.001);
+            }
+            sized = true;
+            webcash::state().preimages.Insert(hash);
+        },
+        [](const uint256& hash, Amount amount) { webcash::utxos().LoadUnspent(hash, amount); },
+        [](const uint256& hash) { webcash::utxos().AddSpent(hash); });
+    if (!ok) {
+        LogError() << "Unable to load state from storage.";
+        drogon::app().quit();
+        return;
+    }
+    if (webcash::state().logging) {
+        std::stringstream ss;
+        ss << "Loaded " << counts.num_reports << " mining reports." << std::endl;
+        ss << "Loaded " << counts.num_replace << " transactions." << std::endl;
+        ss << "Loaded " << counts.num_burn << " burns." << std::endl;
+        ss << "Loaded " << counts.num_unspent << " unspent webcash." << std::endl;
+        LogInfo() << ss.str();
+    }
+    webcash::state().num_reports.store(counts.num_reports);
+    webcash::state().num_replace.store(counts.num_replace);
+    webcash::state().num_burn.store(counts.num_burn);
+    webcash::state().num_unspent.store(counts.num_unspent);
+    webcash::state().total_destroyed.store(counts.total_destroyed);
+    if (last.has_reports) {
+        webcash::state().genesis = last.genesis;
+    }
+    MiningReportTip tip; // default values, for the first report
+    tip.num_reports = counts.num_reports;
+    tip.difficulty = webcash::state().difficulty.load();
+    if (last.has_reports) {
+        tip.last_received = last.last_received;
+        tip.last_difficulty = last.last_difficulty;
+        tip.difficulty = last.next_difficulty;
+        tip.aggregate_work = last.aggregate_work;
+        if (tip.last_difficulty > 255 || tip.difficulty > 255 || tip.aggregate_work < 0.0) {
+            LogError() << "Last MiningReport record contains nonsense values.  Database corruption?";
+            LogError() << "difficulty=" << tip.last_difficulty << " next_difficulty=" << tip.difficulty << " aggregate_work=" << tip.aggregate_work;
             drogon::app().quit();
         }
     }
+    if (webcash::state().logging) {
+        std::stringstream ss;
+        ss << "Genesis epoch is " << absl::FormatTime(webcash::state().genesis, absl::UTCTimeZone()) << std::endl;
+        ss << "Current difficulty is " << tip.difficulty << std::endl;
+        LogInfo() << ss.str();
+    }
+    webcash::state().difficulty.store(tip.difficulty);
+    webcash::sequencer().reset(tip);
+    webcash::state().preimages.SetReady();
+    webcash::utxos().SetReady();
+    if (webcash::state().logging) {
+        LogInfo() << "Cached " << webcash::utxos().NumUnspent() << " unspent outputs and "
+                  << webcash::utxos().NumSpent() << " spent hashes.";
+    }
+}
+
+static void _upgradeDb()
+{
+    if (webcash::state().storage) {
+        _loadStorage();
+        return;
+    }
+    auto db = drogon::app().getDbClient();
+    assert(db);
+    _upgradeSchema(db);
+    for (size_t i = 0; i < webcash::shards().size(); ++i) {
+        _upgradeSchema(webcash::shards().getDbClient(i));
+    }
+    // Finish the transactions across shards which an earlier run left
+    // prepared, before anything is loaded from the shards.
+    webcash::shards().recover();
+
+    // Requests are served while the UTXO cache is warmed, so the changes they
+    // commit are journaled from here on, before the counters which decide
+    // whether the snapshot is current are read, and before the replica is
+    // caught up.  Every commit which isn't journaled is then in whatever the
+    // cache is loaded from.  Requests are answered from the database until
+    // the cache is marked ready.
+    webcash::utxos().Clear();
+
+    // The counters are read from the Summary of the database and of each
+    // shard, which are small enough to be read from the primary.
+    std::vector<std::shared_ptr<DbClient>> summaries = {db};
+    for (size_t i = 0; i < webcash::shards().size(); ++i) {
+        summaries.push_back(webcash::shards().getDbClient(i));
+    }
+    {
+        uint64_t num_reports = 0, num_replace = 0, num_burn = 0, num_unspent = 0, total_destroyed = 0;
+        for (const auto& summary : summaries) {
+            const std::string* sql = &k_sql_compact_summary;
+            try {
+                summary->execSqlSync(*sql);
+                sql = &k_sql_read_summary;
+                const Result r = summary->execSqlSync(*sql);
+                if (r.size() != 1 || r[0].size() != 5) {
+                    LogError() << "Expected one row of five columns containing counts.  Got something else.";
+                    LogError() << "Offending SQL: " << *sql;
+                    drogon::app().quit();
+                    return;
+                }
+                num_reports += r[0][0].as<uint64_t>();
+                num_replace += r[0][1].as<uint64_t>();
+                num_burn += r[0][2].as<uint64_t>();
+                num_unspent += r[0][3].as<uint64_t>();
+                total_destroyed += r[0][4].as<uint64_t>();
+            } catch (const DrogonDbException &e) {
+                LogError() << e.base().what();
+                LogError() << "Offending SQL: " << *sql;
+                drogon::app().quit();
+                return;
+            }
+        }
+        if (webcash::state().logging) {
+            std::stringstream ss;
+            ss << "Loaded " << num_reports << " mining reports." << std::endl;
+            ss << "Loaded " << num_replace << " transactions." << std::endl;
+            ss << "Loaded " << num_burn << " burns." << std::endl;
+            ss << "Loaded " << num_unspent << " unspent webcash." << std::endl;
+            LogInfo() << ss.str();
+        }
+        webcash::state().num_reports.store(num_reports);
+        webcash::state().num_replace.store(num_replace);
+        webcash::state().num_burn.store(num_burn);
+        webcash::state().num_unspent.store(num_unspent);
+        webcash::state().total_destroyed.store(total_destroyed);
+    }
+    StartSummaryCompaction(summaries);
+    if (webcash::state().reconcile_summary) {
+        std::thread(ReconcileSummary, summaries).detach();
+    }
+
+    // Likewise, the preimage filter is replaced before the replica is caught
+    // up, so that every report which isn't inserted into the new filter is
+    // read from the replica.  Until then the database is asked.
+    webcash::state().preimages.Reset(PreimageFilterSize(webcash::state().num_reports.load()), 0.001);
+
+    // The rest is read from a replica, if one catches up with the primary, to
+    // spare the primary the scans of every table.  It is caught up to a
+    // position taken now, after journaling has started.
+    auto read_db = webcash::replicas().getCaughtUpDbClient(absl::Seconds(10));
+    assert(read_db);
+    // The tables which are split across the shards, with --shards, are read
+    // from every shard instead.
+    std::vector<std::shared_ptr<DbClient>> stores;
+    for (size_t i = 0; i < webcash::shards().size(); ++i) {
+        stores.push_back(webcash::shards().getDbClient(i));
+    }
+    if (stores.empty()) {
+        stores.push_back(read_db);
+    }
     {
         static const std::string sql = "SELECT \"received\" FROM \"MiningReports\" ORDER BY \"id\" ASC LIMIT 1";
         try {
-            const Result r = db->execSqlSync(sql);
+            const Result r = read_db->execSqlSync(sql);
             absl::Time genesis = webcash::state().genesis; // default value
             if (!r.empty() && r[0].size()) {
                 genesis = absl::FromUnixNanos(r[0][0].as<uint64_t>());
             }
             if (webcash::state().logging) {
-                std::stringstream ss;
-                ss << "Genesis epoch is " << absl::FormatTime(genesis, absl::UTCTimeZone()) << std::endl;
-                std::cout << ss.str();
+                LogInfo() << "Genesis epoch is " << absl::FormatTime(genesis, absl::UTCTimeZone());
             }
             webcash::state().genesis = genesis;
         } catch (const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << sql << std::endl;
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
             drogon::app().quit();
         }
     }
     {
-        static const std::string sql = "SELECT \"next_difficulty\" FROM \"MiningReports\" ORDER BY \"id\" DESC LIMIT 1";
+        static const std::string sql = "SELECT \"received\", \"difficulty\", \"next_difficulty\", \"aggregate_work\" FROM \"MiningReports\" ORDER BY \"id\" DESC LIMIT 1";
         try {
-            const Result r = db->execSqlSync(sql);
-            unsigned difficulty = webcash::state().difficulty.load(); // default value
-            if (!r.empty() && r[0].size()) {
-                difficulty = r[0][0].as<unsigned>();
+            const Result r = read_db->execSqlSync(sql);
+            MiningReportTip tip; // default values, for the first report
+            tip.num_reports = webcash::state().num_reports.load();
+            tip.difficulty = webcash::state().difficulty.load();
+            if (!r.empty() && r[0].size() == 4) {
+                tip.last_received = absl::FromUnixNanos(r[0][0].as<int64_t>());
+                tip.last_difficulty = r[0][1].as<unsigned>();
+                tip.difficulty = r[0][2].as<unsigned>();
+                tip.aggregate_work = r[0][3].as<double>();
+                if (tip.last_difficulty > 255 || tip.difficulty > 255 || tip.aggregate_work < 0.0) {
+                    LogError() << "Last MiningReport record contains nonsense values.  Database corruption?";
+                    LogError() << "difficulty=" << tip.last_difficulty << " next_difficulty=" << tip.difficulty << " aggregate_work=" << tip.aggregate_work;
+                    drogon::app().quit();
+                }
             }
             if (webcash::state().logging) {
-                std::stringstream ss;
-                ss << "Current difficulty is " << difficulty << std::endl;
-                std::cout << ss.str();
+                LogInfo() << "Current difficulty is " << tip.difficulty;
+            }
+            webcash::state().difficulty.store(tip.difficulty);
+            webcash::sequencer().reset(tip);
+        } catch (const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
+            drogon::app().quit();
+        }
+    }
+    {
+        static const std::string sql = "SELECT \"preimage_hash\" FROM \"MiningReports\"";
+        try {
+            const Result r = read_db->execSqlSync(sql);
+            for (const auto& row : r) {
+                if (row.size() != 1 || row[0].length() != 32) {
+                    LogError() << "Expected 32-byte hash in each row.  Got something else.";
+                    LogError() << "Offending SQL: " << sql;
+                    drogon::app().quit();
+                    return;
+                }
+                std::string hash_bytes = row[0].as<std::string>();
+                uint256 hash;
+                std::copy((unsigned char*)hash_bytes.c_str(),
+                          (unsigned char*)hash_bytes.c_str() + 32,
+                          hash.data());
+                webcash::state().preimages.Insert(hash);
             }
-            webcash::state().difficulty.store(difficulty);
+            webcash::state().preimages.SetReady();
         } catch (const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << sql << std::endl;
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
             drogon::app().quit();
+            return;
+        }
+    }
+    // Warm the UTXO cache.  A snapshot is only used if nothing had changed
+    // since it was taken when the counters were read.  Each change to the
+    // tables it holds counts a replacement, burn or mining report, so
+    // matching counters mean matching tables, and anything since is in the
+    // journal.
+    UtxoSnapshot snapshot;
+    bool from_snapshot = false;
+    if (!webcash::state().utxo_snapshot.empty() && snapshot.Open(webcash::state().utxo_snapshot)) {
+        const UtxoSnapshot::Counts& counts = snapshot.GetCounts();
+        from_snapshot = counts.num_reports == webcash::state().num_reports.load()
+            && counts.num_replace == webcash::state().num_replace.load()
+            && counts.num_burn == webcash::state().num_burn.load()
+            && counts.num_unspent == webcash::state().num_unspent.load()
+            && counts.total_destroyed == webcash::state().total_destroyed.load();
+        if (!from_snapshot) {
+            LogWarning() << "UTXO snapshot " << webcash::state().utxo_snapshot << " is out of date.  Reading the tables instead.";
+        } else if (webcash::state().logging) {
+            LogInfo() << "Warming the UTXO cache from snapshot " << webcash::state().utxo_snapshot;
+        }
+    }
+    webcash::utxos().SetTrackSpent(!webcash::state().redis);
+    if (from_snapshot) {
+        snapshot.LoadInto(webcash::utxos());
+    } else {
+        static const std::string sql = "SELECT \"hash\", \"amount\" FROM \"UnspentOutputs\"";
+        for (const auto& store : stores) {
+            try {
+                const Result r = store->execSqlSync(sql);
+                for (const auto& row : r) {
+                    if (row.size() != 2 || row[0].length() != 32) {
+                        LogError() << "Expected 32-byte hash and amount in each row.  Got something else.";
+                        LogError() << "Offending SQL: " << sql;
+                        drogon::app().quit();
+                        return;
+                    }
+                    std::string hash_bytes = row[0].as<std::string>();
+                    uint256 hash;
+                    std::copy((unsigned char*)hash_bytes.c_str(),
+                              (unsigned char*)hash_bytes.c_str() + 32,
+                              hash.data());
+                    webcash::utxos().LoadUnspent(hash, Amount(row[1].as<int64_t>()));
+                }
+            } catch (const DrogonDbException &e) {
+                LogError() << e.base().what();
+                LogError() << "Offending SQL: " << sql;
+                drogon::app().quit();
+                return;
+            }
+        }
+    }
+    if (webcash::state().redis) {
+        // The spent hashes are kept in Redis, so only the unspent outputs are
+        // cached.  Any rows left in the SpentHashes table from running without
+        // --redis are moved there first.
+        static const std::string sql = "SELECT \"id\", \"hash\" FROM \"SpentHashes\" ORDER BY \"id\"";
+        for (size_t n = 0; n < stores.size(); ++n) {
+            // The rows are deleted from the primary, rather than the replica.
+            auto primary = webcash::shards().size() ? stores[n] : db;
+            int64_t max_id = 0;
+            std::vector<uint256> hashes;
+            try {
+                const Result r = stores[n]->execSqlSync(sql);
+                for (const auto& row : r) {
+                    if (row.size() != 2 || row[1].length() != 32) {
+                        LogError() << "Expected id and 32-byte hash in each row.  Got something else.";
+                        LogError() << "Offending SQL: " << sql;
+                        drogon::app().quit();
+                        return;
+                    }
+                    max_id = row[0].as<int64_t>();
+                    std::string hash_bytes = row[1].as<std::string>();
+                    uint256 hash;
+                    std::copy((unsigned char*)hash_bytes.c_str(),
+                              (unsigned char*)hash_bytes.c_str() + 32,
+                              hash.data());
+                    hashes.push_back(hash);
+                }
+            } catch (const DrogonDbException &e) {
+                LogError() << e.base().what();
+                LogError() << "Offending SQL: " << sql;
+                drogon::app().quit();
+                return;
+            }
+            static const size_t k_chunk_size = 1024;
+            for (size_t i = 0; i < hashes.size(); i += k_chunk_size) {
+                const std::vector<uint256> chunk(hashes.begin() + i, hashes.begin() + std::min(i + k_chunk_size, hashes.size()));
+                const std::string cmd = RedisSpentHashesCommand("SADD", chunk);
+                try {
+                    webcash::state().redis->execCommandSync<long long>(
+                        [](const RedisResult& r) { return r.asInteger(); },
+                        cmd);
+                } catch (const RedisException &e) {
+                    LogError() << e.what();
+                    LogError() << "Offending Redis command: SADD " << k_redis_spent_hashes << " ...";
+                    drogon::app().quit();
+                    return;
+                }
+            }
+            if (!hashes.empty()) {
+                static const std::string sql_delete = "DELETE FROM \"SpentHashes\" WHERE \"id\" <= $1";
+                try {
+                    primary->execSqlSync(sql_delete, max_id);
+                } catch (const DrogonDbException &e) {
+                    LogError() << e.base().what();
+                    LogError() << "Offending SQL: " << sql_delete;
+                    drogon::app().quit();
+                    return;
+                }
+                if (webcash::state().logging) {
+                    LogInfo() << "Moved " << hashes.size() << " spent hashes to Redis.";
+                }
+            }
+        }
+    } else if (!from_snapshot) {
+        static const std::string sql = "SELECT \"hash\" FROM \"SpentHashes\"";
+        for (const auto& store : stores) {
+            try {
+                const Result r = store->execSqlSync(sql);
+                for (const auto& row : r) {
+                    if (row.size() != 1 || row[0].length() != 32) {
+                        LogError() << "Expected 32-byte hash in each row.  Got something else.";
+                        LogError() << "Offending SQL: " << sql;
+                        drogon::app().quit();
+                        return;
+                    }
+                    std::string hash_bytes = row[0].as<std::string>();
+                    uint256 hash;
+                    std::copy((unsigned char*)hash_bytes.c_str(),
+                              (unsigned char*)hash_bytes.c_str() + 32,
+                              hash.data());
+                    webcash::utxos().AddSpent(hash);
+                }
+            } catch (const DrogonDbException &e) {
+                LogError() << e.base().what();
+                LogError() << "Offending SQL: " << sql;
+                drogon::app().quit();
+                return;
+            }
         }
     }
+    webcash::utxos().SetReady();
+    if (webcash::state().logging) {
+        LogInfo() << "Cached " << webcash::utxos().NumUnspent() << " unspent outputs and "
+                  << webcash::utxos().NumSpent() << " spent hashes.";
+    }
 }
 void upgradeDb()
 {
@@ -241,7 +876,19 @@ void upgradeDb()
 
 static void _resetDb()
 {
-    const std::array<std::string, 8> drop_tables = {
+    if (webcash::state().storage) {
+        if (!webcash::state().storage->Reset()) {
+            LogError() << "Unable to reset storage.";
+            drogon::app().quit();
+        }
+        _upgradeDb();
+        return;
+    }
+    const std::array<std::string, 12> drop_tables = {
+        "DROP TABLE IF EXISTS \"SummaryDeltas\"",
+        "DROP TABLE IF EXISTS \"Summary\"",
+        "DROP TABLE IF EXISTS \"ShardCommits\"",
+        "DROP TABLE IF EXISTS \"AuditLog\"",
         "DROP TABLE IF EXISTS \"SpentHashes\"",
         "DROP TABLE IF EXISTS \"UnspentOutputs\"",
         "DROP TABLE IF EXISTS \"BurnInputs\"",
@@ -251,20 +898,49 @@ static void _resetDb()
         "DROP TABLE IF EXISTS \"Replacements\"",
         "DROP TABLE IF EXISTS \"MiningReports\"",
     };
-    auto db = drogon::app().getDbClient();
-    // Drop tables from database
-    for (const std::string& sql : drop_tables) {
+    std::vector<std::shared_ptr<DbClient>> dbs = {drogon::app().getDbClient()};
+    for (size_t i = 0; i < webcash::shards().size(); ++i) {
+        dbs.push_back(webcash::shards().getDbClient(i));
+    }
+    // Drop tables from database, and from the shards
+    for (const auto& db : dbs) {
+        for (const std::string& sql : drop_tables) {
+            try {
+                db->execSqlSync(sql);
+            } catch (const DrogonDbException &e) {
+                LogError() << e.base().what();
+                LogError() << "Offending SQL: " << sql;
+                drogon::app().quit();
+            }
+        }
+    }
+    // Empty the spent hashes set, if it is kept in Redis
+    if (webcash::state().redis) {
         try {
-            db->execSqlSync(sql);
-        } catch (const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << sql << std::endl;
+            webcash::state().redis->execCommandSync<long long>(
+                [](const RedisResult& r) { return r.asInteger(); },
+                "DEL %s", k_redis_spent_hashes.c_str());
+        } catch (const RedisException &e) {
+            LogError() << e.what();
+            LogError() << "Offending Redis command: DEL " << k_redis_spent_hashes;
             drogon::app().quit();
         }
     }
     // Re-create (empty) tables and load defaults
     _upgradeDb();
 }
+std::shared_ptr<drogon::nosql::RedisClient> connectRedis(const std::string& addr, size_t connections)
+{
+    const size_t colon = addr.rfind(':');
+    unsigned port = 0;
+    if (colon == std::string::npos || !absl::SimpleAtoi(addr.substr(colon + 1), &port) || !port || port > 65535) {
+        return nullptr;
+    }
+    return drogon::nosql::RedisClient::newRedisClient(
+        trantor::InetAddress(addr.substr(0, colon), static_cast<uint16_t>(port)),
+        connections);
+}
+
 void resetDb()
 {
     // Create a promise which will only be fulfilled after the database is reset
@@ -274,13 +950,11 @@ void resetDb()
     drogon::app().getLoop()->queueInLoop([&p1]() {
         // Log the database wipe
         if (webcash::state().logging) {
-            std::stringstream ss;
-            ss << "Nuking database with "
-               << webcash::state().num_reports.load() << " mining reports, "
-               << webcash::state().num_replace.load() << " replacements, "
-               << webcash::state().num_burn.load()    << " burns, and "
-               << webcash::state().num_unspent.load() << " unspent outputs." << std::endl;
-            std::cout << ss.str();
+            LogInfo() << "Nuking database with "
+                      << webcash::state().num_reports.load() << " mining reports, "
+                      << webcash::state().num_replace.load() << " replacements, "
+                      << webcash::state().num_burn.load()    << " burns, and "
+                      << webcash::state().num_unspent.load() << " unspent outputs.";
         }
         // Recreate all tables and load initial values
         _resetDb();
@@ -292,6 +966,24 @@ void resetDb()
 }
 } // webcash
 
+absl::uint128 WebcashEconomy::getTotalCirculation(unsigned num_reports) const
+{
+    absl::uint128 total = 0;
+    auto count = num_reports;
+    int64_t value = k_initial_mining_amount;
+    while (k_reports_per_epoch < count) {
+        total += value * k_reports_per_epoch;
+        count -= k_reports_per_epoch;
+    }
+    total += count * value;
+    return total;
+}
+
+absl::uint128 WebcashEconomy::getExpectedCirculation(absl::Time now) const
+{
+    return getTotalCirculation(static_cast<unsigned>((now - genesis) / k_target_interval));
+}
+
 WebcashStats WebcashEconomy::getStats(absl::Time now)
 {
     WebcashStats stats;
@@ -311,23 +1003,8 @@ WebcashStats WebcashEconomy::getStats(absl::Time now)
     stats.num_unspent = num_unspent.load();
     stats.total_destroyed = total_destroyed.load();
 
-    stats.total_circulation = 0;
-    auto count = stats.num_reports;
-    int64_t value = k_initial_mining_amount;
-    while (k_reports_per_epoch < count) {
-        stats.total_circulation += value * k_reports_per_epoch;
-        count -= k_reports_per_epoch;
-    }
-    stats.total_circulation += count * value;
-
-    stats.expected_circulation = 0;
-    count = static_cast<unsigned>((stats.timestamp - genesis) / k_target_interval);
-    value = k_initial_mining_amount;
-    while (k_reports_per_epoch < count) {
-        stats.expected_circulation += value * k_reports_per_epoch;
-        count -= k_reports_per_epoch;
-    }
-    stats.expected_circulation += count * value;
+    stats.total_circulation = getTotalCirculation(stats.num_reports);
+    stats.expected_circulation = getExpectedCirculation(stats.timestamp);
 
     // Do not use the class methods because that would re-fetch num_reports,
     // which might have been updated.
@@ -349,6 +1026,12 @@ namespace webcash {
         static WebcashEconomy economy;
         return economy;
     }
+
+    ServerMetrics& metrics()
+    {
+        static ServerMetrics metrics;
+        return metrics;
+    }
 } // webcash
 
 std::shared_ptr<HttpResponse> JSONRPCError(const std::string& err)
@@ -362,1434 +1045,3943 @@ std::shared_ptr<HttpResponse> JSONRPCError(const std::string& err)
     } else {
         ret["error"] = "unknown";
     }
+    webcash::metrics().AddError(ret["error"].asString());
     auto resp = HttpResponse::newHttpJsonResponse(ret);
     resp->setStatusCode(drogon::k500InternalServerError);
     return resp;
 }
 
-bool check_legalese(
-    const Json::Value& request
-){
-    if (!request.isObject())
-        return false;
-    if (!request.isMember("legalese"))
-        return false;
-    const auto& legalese = request["legalese"];
-    if (!legalese.isObject())
-        return false;
-    if (!legalese.isMember("terms"))
-        return false;
-    const auto& terms = legalese["terms"];
-    if (!terms.isConvertibleTo(Json::booleanValue))
-        return false;
-    return terms.asBool();
+std::shared_ptr<HttpResponse> OverloadedError()
+{
+    Json::Value ret(objectValue);
+    ret["status"] = "error";
+    ret["error"] = "server busy";
+    auto resp = HttpResponse::newHttpJsonResponse(ret);
+    resp->setStatusCode(drogon::k503ServiceUnavailable);
+    resp->addHeader("Retry-After", "1");
+    return resp;
 }
 
-bool parse_secret_webcashes(
-    const Json::Value& array,
-    std::map<uint256, SecretWebcash>& _webcash
-){
-    _webcash.clear();
-    std::map<uint256, SecretWebcash> webcash;
-    if (!array.isArray()) {
-        return false; // expected array
+void AdmissionControl::setLimits(size_t _max_in_flight, size_t _max_queued)
+{
+    const std::lock_guard<std::mutex> lock(mutex);
+    max_in_flight = _max_in_flight;
+    max_queued = _max_queued;
+}
+
+bool AdmissionControl::admit(std::function<void (Ticket)> admitted)
+{
+    if (priority && priority->numQueued()) {
+        return false;
     }
-    for (unsigned int i = 0; i < array.size(); ++i) {
-        auto& secret_str = array[i];
-        if (!secret_str.isString()) {
-            return false; // must be string-encoded
-        }
-        SecretWebcash secret;
-        if (!secret.parse(secret_str.asString())) {
-            return false; // parser error
-        }
-        PublicWebcash pub(secret);
-        auto res = webcash.insert({pub.pk, secret});
-        if (!res.second) {
-            return false; // duplicate
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        if (max_in_flight && in_flight >= max_in_flight) {
+            if (queue.size() >= max_queued) {
+                return false;
+            }
+            queue.push_back(std::move(admitted));
+            return true;
         }
+        ++in_flight;
     }
-    if (webcash.size() != array.size()) {
-        return false; // duplicate
-    }
-    _webcash.swap(webcash);
+    admitted(newTicket());
     return true;
 }
 
-bool parse_public_webcashes(
-    const Json::Value& array,
-    std::vector<PublicWebcash>& _webcash
-){
-    _webcash.clear();
-    std::vector<PublicWebcash> webcash;
-    if (!array.isArray()) {
-        return false; // expected array
-    }
-    for (unsigned int i = 0; i < array.size(); ++i) {
-        auto& descriptor_str = array[i];
-        if (!descriptor_str.isString()) {
-            return false; // must be string-encoded
-        }
-        PublicWebcash descriptor;
-        if (!descriptor.parse(descriptor_str.asString())) {
-            return false; // parser error
+AdmissionControl::Ticket AdmissionControl::newTicket()
+{
+    return Ticket(static_cast<void*>(this), [this](void*) { release(); });
+}
+
+void AdmissionControl::release()
+{
+    std::function<void (Ticket)> next;
+    {
+        const std::lock_guard<std::mutex> lock(mutex);
+        if (queue.empty()) {
+            --in_flight;
+            return;
         }
-        webcash.push_back(descriptor);
-    }
-    if (webcash.size() != array.size()) {
-        return false; // duplicate
+        next = std::move(queue.front());
+        queue.pop_front();
     }
-    _webcash.swap(webcash);
-    return true;
+    // The slot passes straight to the next request, which is run from the
+    // event loop rather than from within whichever callback released it.
+    Ticket ticket = newTicket();
+    drogon::app().getLoop()->queueInLoop([next, ticket]() {
+        next(ticket);
+    });
 }
 
-//  -------------
-// | /terms      |
-// | /terms/text |
-//  -------------
+size_t AdmissionControl::numInFlight() const
+{
+    const std::lock_guard<std::mutex> lock(mutex);
+    return in_flight;
+}
 
-void TermsOfService::asyncHandleHttpRequest(
-    const HttpRequestPtr& req,
-    std::function<void (const HttpResponsePtr &)> &&callback
-){
-    HttpResponsePtr resp;
+size_t AdmissionControl::numQueued() const
+{
+    const std::lock_guard<std::mutex> lock(mutex);
+    return queue.size();
+}
+
+namespace webcash {
+    EndpointLimits& limits()
+    {
+        static EndpointLimits limits;
+        return limits;
+    }
+} // webcash
+
+void ReplicaSet::add(const std::string& name)
+{
+    replicas.emplace_back();
+    replicas.back().name = name;
+}
+
+void ReplicaSet::setMaxLag(absl::Duration max_lag)
+{
+    max_lag_nanos.store(absl::ToInt64Nanoseconds(max_lag));
+}
+
+void ReplicaSet::startPolling()
+{
+    if (replicas.empty()) {
+        return;
+    }
+    drogon::app().getLoop()->runEvery(absl::ToDoubleSeconds(k_poll_interval), [this]() {
+        poll();
+    });
+}
+
+bool ReplicaSet::isFresh(const Replica& replica, absl::Time now) const
+{
+    return absl::ToUnixNanos(now) < replica.fresh_until_nanos.load();
+}
+
+void ReplicaSet::poll()
+{
+    // Zero if the replica has replayed everything it has received, even if
+    // the primary has been idle since the last transaction it replayed.  NULL
+    // if the database isn't a replica.
+    static const std::string sql =
+        "SELECT CASE WHEN pg_last_wal_receive_lsn() = pg_last_wal_replay_lsn() THEN 0 "
+        "ELSE EXTRACT(EPOCH FROM now() - pg_last_xact_replay_timestamp()) END";
+    for (Replica& replica : replicas) {
+        auto db = drogon::app().getDbClient(replica.name);
+        if (!db) {
+            continue;
+        }
+        Replica* r = &replica;
+        *db << sql
+            >> [this, r](const Result &result) {
+                if (result.empty() || !result[0].size() || result[0][0].isNull()) {
+                    if (isFresh(*r, absl::Now())) {
+                        LogError() << "Database " << r->name << " is not a replica.  Not using it.";
+                    }
+                    r->lag_nanos.store(-1);
+                    r->fresh_until_nanos.store(0);
+                    return;
+                }
+                const absl::Duration lag = absl::Seconds(result[0][0].as<double>());
+                r->lag_nanos.store(absl::ToInt64Nanoseconds(lag));
+                if (lag <= absl::Nanoseconds(max_lag_nanos.load())) {
+                    // Allow for a poll to be late, but not for one to be
+                    // missed entirely.
+                    r->fresh_until_nanos.store(absl::ToUnixNanos(absl::Now() + 2 * k_poll_interval));
+                } else {
+                    r->fresh_until_nanos.store(0);
+                }
+            }
+            >> [this, r](const DrogonDbException &e) {
+                // Only logged once, when the replica stops being used.
+                if (isFresh(*r, absl::Now())) {
+                    LogError() << e.base().what();
+                    LogError() << "Offending SQL: " << sql;
+                }
+                r->lag_nanos.store(-1);
+                r->fresh_until_nanos.store(0);
+            };
+    }
+}
+
+std::shared_ptr<DbClient> ReplicaSet::getDbClient()
+{
+    const absl::Time now = absl::Now();
+    const size_t start = next.fetch_add(1);
+    for (size_t i = 0; i < replicas.size(); ++i) {
+        const Replica& replica = replicas[(start + i) % replicas.size()];
+        if (isFresh(replica, now)) {
+            auto db = drogon::app().getDbClient(replica.name);
+            if (db) {
+                return db;
+            }
+        }
+    }
+    return drogon::app().getDbClient();
+}
+
+std::shared_ptr<DbClient> ReplicaSet::getCaughtUpDbClient(absl::Duration timeout)
+{
+    auto primary = drogon::app().getDbClient();
+    if (replicas.empty() || !primary) {
+        return primary;
+    }
+    static const std::string sql_primary = "SELECT pg_current_wal_lsn()::TEXT";
+    std::string lsn;
+    try {
+        const Result r = primary->execSqlSync(sql_primary);
+        if (r.empty() || !r[0].size()) {
+            LogError() << "Expected one row of one column containing WAL position.  Got something else.";
+            LogError() << "Offending SQL: " << sql_primary;
+            return primary;
+        }
+        lsn = r[0][0].as<std::string>();
+    } catch (const DrogonDbException &e) {
+        LogError() << e.base().what();
+        LogError() << "Offending SQL: " << sql_primary;
+        return primary;
+    }
+
+    // NULL, and so not true, if the database isn't a replica.
+    static const std::string sql = "SELECT COALESCE(pg_last_wal_replay_lsn() >= $1::PG_LSN, FALSE)";
+    const absl::Time deadline = absl::Now() + timeout;
+    const size_t start = next.fetch_add(1);
+    do {
+        for (size_t i = 0; i < replicas.size(); ++i) {
+            const Replica& replica = replicas[(start + i) % replicas.size()];
+            auto db = drogon::app().getDbClient(replica.name);
+            if (!db) {
+                continue;
+            }
+            try {
+                const Result r = db->execSqlSync(sql, lsn);
+                if (!r.empty() && r[0].size() && r[0][0].as<bool>()) {
+                    return db;
+                }
+            } catch (const DrogonDbException &e) {
+                LogError() << e.base().what();
+                LogError() << "Offending SQL: " << sql;
+            }
+        }
+        absl::SleepFor(absl::Milliseconds(100));
+    } while (absl::Now() < deadline);
+    return primary;
+}
+
+size_t ReplicaSet::numFresh() const
+{
+    const absl::Time now = absl::Now();
+    size_t count = 0;
+    for (const Replica& replica : replicas) {
+        count += isFresh(replica, now);
+    }
+    return count;
+}
+
+namespace webcash {
+    ReplicaSet& replicas()
+    {
+        static ReplicaSet replicas;
+        return replicas;
+    }
+} // webcash
+
+ShardSet::ShardSet()
+    : gid_prefix(absl::StrCat("webcash_", absl::ToUnixMicros(absl::Now()), "_"))
+{}
+
+void ShardSet::add(const std::string& name)
+{
+    shards.push_back(name);
+}
+
+std::shared_ptr<DbClient> ShardSet::getDbClient(size_t shard) const
+{
+    return drogon::app().getDbClient(shards[shard]);
+}
+
+std::string ShardSet::newTransactionId()
+{
+    return absl::StrCat(gid_prefix, next_gid.fetch_add(1));
+}
+
+void ShardSet::commit(
+    std::vector<Part> parts,
+    std::shared_ptr<Transaction> local,
+    std::function<void (bool)> done
+){
+    if (parts.size() == 1 && !local) {
+        parts.front().tx->setCommitCallback([done](bool committed) {
+            done(committed);
+        });
+        return;
+    }
+
+    // The decision, and the response to the caller, is made once for every
+    // part has reported whether it was prepared.
+    struct Prepare {
+        std::mutex mutex;
+        size_t remaining = 0;
+        bool failed = false;
+        std::vector<size_t> prepared;
+        std::shared_ptr<Transaction> local;
+    };
+    auto prepare = std::make_shared<Prepare>();
+    prepare->remaining = parts.size();
+    prepare->local = std::move(local);
+    const std::string gid = newTransactionId();
+    std::vector<size_t> shards_touched;
+    for (const Part& part : parts) {
+        shards_touched.push_back(part.shard);
+    }
+
+    auto decide = [this, gid, shards_touched, done](bool committed) {
+        if (!committed) {
+            rollbackPrepared(gid, shards_touched);
+            return done(false);
+        }
+        commitPrepared(gid, shards_touched, done);
+    };
+    auto prepared = [this, gid, prepare, decide, done](size_t shard, bool ok) {
+        std::shared_ptr<Transaction> local;
+        {
+            const std::lock_guard<std::mutex> lock(prepare->mutex);
+            if (ok) {
+                prepare->prepared.push_back(shard);
+            } else {
+                prepare->failed = true;
+            }
+            if (--prepare->remaining) {
+                return;
+            }
+            local = std::move(prepare->local);
+        }
+        if (prepare->failed) {
+            if (local) {
+                local->rollback();
+            }
+            rollbackPrepared(gid, prepare->prepared);
+            return done(false);
+        }
+
+        // The transaction is committed once this record is: if the server
+        // stops before the parts are, recover() commits them.
+        static const std::string sql = "INSERT INTO \"ShardCommits\" (\"gid\") VALUES($1)";
+        auto decided = std::make_shared<std::atomic<bool>>(false);
+        auto decide_once = [decide, decided](bool committed) {
+            if (!decided->exchange(true)) {
+                decide(committed);
+            }
+        };
+        if (local) {
+            *local << sql
+                << gid
+                >> [](const Result &r) {}
+                >> [=](const DrogonDbException &e) {
+                    LogError() << e.base().what();
+                    LogError() << "Offending SQL: " << sql;
+                    decide_once(false);
+                };
+            local->setCommitCallback(decide_once);
+            return;
+        }
+        auto db = drogon::app().getDbClient();
+        if (!db) {
+            return decide_once(false);
+        }
+        *db << sql
+            << gid
+            >> [=](const Result &r) {
+                decide_once(true);
+            }
+            >> [=](const DrogonDbException &e) {
+                LogError() << e.base().what();
+                LogError() << "Offending SQL: " << sql;
+                decide_once(false);
+            };
+    };
+
+    // Once PREPARE TRANSACTION has succeeded, the part no longer belongs to
+    // the connection, and the COMMIT which ends the drogon transaction is a
+    // no-op.
+    const std::string sql_prepare = absl::StrCat("PREPARE TRANSACTION '", gid, "'");
+    for (Part& part : parts) {
+        const size_t shard = part.shard;
+        auto reported = std::make_shared<std::atomic<bool>>(false);
+        auto report_once = [prepared, shard, reported](bool ok) {
+            if (!reported->exchange(true)) {
+                prepared(shard, ok);
+            }
+        };
+        *part.tx << sql_prepare
+            >> [](const Result &r) {}
+            >> [=](const DrogonDbException &e) {
+                LogError() << e.base().what();
+                LogError() << "Offending SQL: " << sql_prepare;
+                report_once(false);
+            };
+        part.tx->setCommitCallback(report_once);
+    }
+}
+
+void ShardSet::commitPrepared(
+    const std::string& gid,
+    const std::vector<size_t>& parts,
+    std::function<void (bool)> done
+){
+    struct Progress {
+        std::atomic<size_t> remaining{0};
+        std::atomic<bool> failed{false};
+    };
+    auto progress = std::make_shared<Progress>();
+    progress->remaining = parts.size();
+    // The decision has been recorded, so the transaction has committed even if
+    // a part fails to, which is then left for recover() to retry.  Once every
+    // part has, the record is no longer needed.
+    auto finished = [gid, progress, done]() {
+        if (--progress->remaining) {
+            return;
+        }
+        if (!progress->failed) {
+            static const std::string sql = "DELETE FROM \"ShardCommits\" WHERE \"gid\"=$1";
+            auto db = drogon::app().getDbClient();
+            if (db) {
+                *db << sql
+                    << gid
+                    >> [](const Result &r) {}
+                    >> [=](const DrogonDbException &e) {
+                        LogError() << e.base().what();
+                        LogError() << "Offending SQL: " << sql;
+                    };
+            }
+        }
+        done(true);
+    };
+    const std::string sql = absl::StrCat("COMMIT PREPARED '", gid, "'");
+    for (size_t shard : parts) {
+        auto db = getDbClient(shard);
+        if (!db) {
+            progress->failed = true;
+            finished();
+            continue;
+        }
+        *db << sql
+            >> [=](const Result &r) {
+                finished();
+            }
+            >> [=](const DrogonDbException &e) {
+                LogError() << e.base().what();
+                LogError() << "Offending SQL: " << sql;
+                progress->failed = true;
+                finished();
+            };
+    }
+}
+
+void ShardSet::rollbackPrepared(const std::string& gid, const std::vector<size_t>& parts)
+{
+    // A part which fails to roll back is left for recover() to.
+    const std::string sql = absl::StrCat("ROLLBACK PREPARED '", gid, "'");
+    for (size_t shard : parts) {
+        auto db = getDbClient(shard);
+        if (!db) {
+            continue;
+        }
+        *db << sql
+            >> [](const Result &r) {}
+            >> [=](const DrogonDbException &e) {
+                LogError() << e.base().what();
+                LogError() << "Offending SQL: " << sql;
+            };
+    }
+}
+
+void ShardSet::recover()
+{
+    if (shards.empty()) {
+        return;
+    }
+    auto db = drogon::app().getDbClient();
+    static const std::string sql_prepared = "SELECT \"gid\" FROM pg_prepared_xacts WHERE \"database\" = current_database() AND \"gid\" LIKE 'webcash\\_%'";
+    static const std::string sql_decided = "SELECT COUNT(1) FROM \"ShardCommits\" WHERE \"gid\"=$1";
+    size_t num_committed = 0, num_rolled_back = 0;
+    bool resolved = true;
+    for (size_t shard = 0; shard < shards.size(); ++shard) {
+        try {
+            const Result r = getDbClient(shard)->execSqlSync(sql_prepared);
+            for (const auto& row : r) {
+                const std::string gid = row[0].as<std::string>();
+                if (absl::StartsWith(gid, gid_prefix)) {
+                    continue; // still being committed by this run
+                }
+                const Result decided = db->execSqlSync(sql_decided, gid);
+                const bool commit = !decided.empty() && decided[0].size() && decided[0][0].as<unsigned>();
+                getDbClient(shard)->execSqlSync(absl::StrCat(commit ? "COMMIT" : "ROLLBACK", " PREPARED '", gid, "'"));
+                ++(commit ? num_committed : num_rolled_back);
+            }
+        } catch (const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Unable to recover prepared transactions of shard " << shards[shard];
+            resolved = false;
+        }
+    }
+    // Every decision made by an earlier run has now been carried out.
+    if (resolved) {
+        static const std::string sql = "DELETE FROM \"ShardCommits\" WHERE NOT starts_with(\"gid\", $1)";
+        try {
+            db->execSqlSync(sql, gid_prefix);
+        } catch (const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
+        }
+    }
+    if (webcash::state().logging && (num_committed || num_rolled_back)) {
+        LogInfo() << "Committed " << num_committed << " and rolled back " << num_rolled_back << " transactions left prepared on the shards.";
+    }
+}
+
+namespace webcash {
+    ShardSet& shards()
+    {
+        static ShardSet shards;
+        return shards;
+    }
+} // webcash
+
+bool read_legalese(
+    JsonScanner& in,
+    bool& accepted
+){
+    accepted = false;
+    if (in.Peek() != '{') {
+        return in.SkipValue();
+    }
+    absl::string_view key;
+    in.BeginObject();
+    while (in.NextMember(key)) {
+        if (key != "terms") {
+            if (!in.SkipValue()) {
+                return false;
+            }
+            continue;
+        }
+        // The terms are accepted by true, or by any nonzero number.
+        absl::string_view number;
+        double value;
+        switch (in.Peek()) {
+            case 't':
+            case 'f':
+                if (!in.ReadBool(accepted)) {
+                    return false;
+                }
+                break;
+            case '-':
+            case '0': case '1': case '2': case '3': case '4':
+            case '5': case '6': case '7': case '8': case '9':
+                if (!in.ReadNumber(number)) {
+                    return false;
+                }
+                accepted = absl::SimpleAtod(number, &value) && value != 0.0;
+                break;
+            default:
+                accepted = false;
+                if (!in.SkipValue()) {
+                    return false;
+                }
+        }
+    }
+    return in.ok();
+}
+
+// Reads a number, or a value which converts to one as it would for
+// Json::Value::asDouble().  Returns false if the value is any other type.
+static bool read_number(
+    JsonScanner& in,
+    double& value
+){
+    absl::string_view number;
+    bool flag;
+    value = 0.0;
+    switch (in.Peek()) {
+        case 't':
+        case 'f':
+            if (!in.ReadBool(flag)) {
+                return false;
+            }
+            value = flag ? 1.0 : 0.0;
+            return true;
+        case 'n':
+            return in.ReadNull();
+        case '"':
+        case '[':
+        case '{':
+            in.SkipValue();
+            return false;
+        default:
+            return in.ReadNumber(number) && absl::SimpleAtod(number, &value);
+    }
+}
+
+bool parse_secret_webcashes(
+    JsonScanner& in,
+    std::vector<PublicWebcash>& webcash
+){
+    webcash.clear();
+    if (in.Peek() != '[') {
+        in.SkipValue();
+        return false; // expected array
+    }
+    bool ok = true;
+    std::vector<absl::string_view> secrets;
+    in.BeginArray();
+    while (in.NextElement()) {
+        absl::string_view secret;
+        if (in.Peek() != '"') {
+            ok = false; // must be string-encoded
+            if (!in.SkipValue()) {
+                return false;
+            }
+            continue;
+        }
+        if (!in.ReadString(secret)) {
+            return false;
+        }
+        secrets.push_back(secret);
+    }
+    if (!ok || !in.ok()) {
+        return false;
+    }
+    // Hash all the secrets at once, which for a large replacement is most
+    // of the work done before touching the database.
+    std::vector<PublicWebcash> pubs;
+    if (!DerivePublicWebcash(secrets, pubs)) {
+        return false; // parser error
+    }
+    std::sort(pubs.begin(), pubs.end(), [](const PublicWebcash& a, const PublicWebcash& b) {
+        return a.pk < b.pk;
+    });
+    auto dup = std::adjacent_find(pubs.begin(), pubs.end(), [](const PublicWebcash& a, const PublicWebcash& b) {
+        return a.pk == b.pk;
+    });
+    if (dup != pubs.end()) {
+        return false; // duplicate
+    }
+    webcash.swap(pubs);
+    return true;
+}
+
+bool parse_public_webcashes(
+    const Json::Value& array,
+    std::vector<PublicWebcash>& _webcash
+){
+    _webcash.clear();
+    std::vector<PublicWebcash> webcash;
+    if (!array.isArray()) {
+        return false; // expected array
+    }
+    for (unsigned int i = 0; i < array.size(); ++i) {
+        auto& descriptor_str = array[i];
+        if (!descriptor_str.isString()) {
+            return false; // must be string-encoded
+        }
+        PublicWebcash descriptor;
+        if (!descriptor.parse(descriptor_str.asString())) {
+            return false; // parser error
+        }
+        webcash.push_back(descriptor);
+    }
+    if (webcash.size() != array.size()) {
+        return false; // duplicate
+    }
+    _webcash.swap(webcash);
+    return true;
+}
+
+HttpResponsePtr CachedResponse::get(const HttpRequestPtr& req, uint64_t key)
+{
+    const absl::Time now = absl::Now();
+    std::shared_ptr<const Entry> current;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        current = entry;
+    }
+    if (!current || current->key != key || now - current->rendered >= max_age) {
+        // Render outside of the lock, so that a slow render doesn't hold up
+        // requests which can be answered with the current entry.  Two threads
+        // might render the same state at once, which is harmless.
+        auto fresh = std::make_shared<Entry>();
+        fresh->key = key;
+        fresh->rendered = now;
+        if (!render(fresh->body)) {
+            return HttpResponse::newNotFoundResponse();
+        }
+        uint256 hash;
+        CSHA256().Write((const unsigned char*)fresh->body.data(), fresh->body.size()).Finalize(hash.data());
+        fresh->etag = absl::StrCat("\"", absl::BytesToHexString(absl::string_view((const char*)hash.data(), 16)), "\"");
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            entry = fresh;
+        }
+        current = std::move(fresh);
+    }
+
+    HttpResponsePtr resp;
+    const std::string match = req ? req->getHeader("if-none-match") : std::string();
+    if (!match.empty() && (match == "*" || absl::StrContains(match, current->etag))) {
+        resp = HttpResponse::newHttpResponse();
+        resp->setStatusCode(drogon::k304NotModified);
+    } else {
+        resp = HttpResponse::newHttpResponse();
+        resp->setContentTypeCode(type);
+        resp->setBody(current->body);
+    }
+    resp->addHeader("ETag", current->etag);
+    if (max_age != absl::InfiniteDuration()) {
+        resp->addHeader("Cache-Control", absl::StrCat("max-age=", absl::ToInt64Seconds(max_age)));
+    }
+    return resp;
+}
+
+// Renders value as compact JSON, as newHttpJsonResponse would.
+static std::string RenderJson(const Json::Value& value)
+{
+    Json::StreamWriterBuilder builder;
+    builder["commentStyle"] = "None";
+    builder["indentation"] = "";
+    return Json::writeString(builder, value);
+}
+
+// Identifies the state of the economy shown by /api/v1/target and /stats,
+// which changes with each mining report.
+static uint64_t EconomyKey()
+{
+    WebcashStats stats = webcash::state().getStats(absl::Now());
+    return (static_cast<uint64_t>(stats.num_reports) << 8) | stats.difficulty;
+}
+
+//  -------------
+// | /terms      |
+// | /terms/text |
+//  -------------
+
+// Reads the file at path, which is served as is.
+static CachedResponse::Render ReadFile(std::string path)
+{
+    return [path](std::string& body) {
+        std::ifstream file(path, std::ios::binary);
+        if (!file) {
+            LogError() << "Unable to read " << path;
+            return false;
+        }
+        body.assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+        return true;
+    };
+}
+
+void TermsOfService::asyncHandleHttpRequest(
+    const HttpRequestPtr& req,
+    std::function<void (const HttpResponsePtr &)> &&callback
+){
+    // The files are read again once per k_terms_cache_expiry, so that the
+    // terms can be updated without a restart.
+    static CachedResponse html(drogon::CT_TEXT_HTML, absl::Seconds(k_terms_cache_expiry), ReadFile("terms/terms.html"));
+    static CachedResponse text(drogon::CT_TEXT_PLAIN, absl::Seconds(k_terms_cache_expiry), ReadFile("terms/terms.text"));
+
+    HttpResponsePtr resp;
     if (req && req->getPath() == "/terms") {
-        resp = HttpResponse::newFileResponse("terms/terms.html", "", drogon::CT_TEXT_HTML);
-        resp->setExpiredTime(k_terms_cache_expiry);
+        resp = html.get(req, 0);
     }
     else if (req && req->getPath() == "/terms/text") {
-        resp = HttpResponse::newFileResponse("terms/terms.text", "", drogon::CT_TEXT_PLAIN);
-        resp->setExpiredTime(k_terms_cache_expiry);
+        resp = text.get(req, 0);
     } else {
         // If we get here, our view controller is messed up.
         // Check the path definitions.
         resp = HttpResponse::newNotFoundResponse();
     }
-    callback(resp);
+    callback(resp);
+}
+
+namespace api {
+
+// The histogram on /metrics of a stage of handling requests to an endpoint.
+// Each stage looks its histogram up once, into a function-local static.
+static LatencyHistogram* Stage(const std::string& endpoint, const std::string& stage)
+{
+    return webcash::metrics().GetStage(endpoint, stage);
+}
+
+// Wraps a handler's callback, so that each response is counted by status
+// code, and its latency from receipt recorded, on /metrics.
+static std::function<void (const HttpResponsePtr &)> CountResponses(
+    ServerMetrics::Endpoint* endpoint,
+    absl::Time received,
+    std::function<void (const HttpResponsePtr &)> callback
+){
+    return [=](const HttpResponsePtr& resp) {
+        endpoint->Add(static_cast<int>(resp->statusCode()), absl::Now() - received);
+        callback(resp);
+    };
+}
+
+// The UTXO cache lags the database by at most the time it takes a commit
+// callback to run, so a request which fails these checks would (almost
+// certainly) fail the same checks made within its transaction.  Turning it
+// away here saves a round trip to the database, but the checks made in the
+// transaction remain authoritative.
+static bool CachedInputsAreUnspent(const std::vector<PublicWebcash>& inputs)
+{
+    if (!webcash::utxos().IsReady()) {
+        return true;
+    }
+    for (const auto& item : inputs) {
+        Amount amount;
+        auto status = webcash::utxos().Lookup(item.pk, amount);
+        if (status != UtxoCache::Status::UNSPENT || amount != item.amount) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool CachedOutputsExist(const std::vector<PublicWebcash>& outputs)
+{
+    if (!webcash::utxos().IsReady()) {
+        return false;
+    }
+    for (const auto& item : outputs) {
+        Amount amount;
+        if (webcash::utxos().Lookup(item.pk, amount) == UtxoCache::Status::UNSPENT) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// The statements used to check and apply replacements, burns and mining
+// reports.  Their text doesn't depend on the request, so each is planned once
+// per connection and then reused.  Sets of hashes are bound as BYTEA produced
+// by PackHashes, and the matching amounts as BIGINT[] produced by
+// PackAmounts.
+static const std::string k_sql_check_inputs = "SELECT COUNT(1) FROM \"UnspentOutputs\" INNER JOIN unnest(unpack_hashes($1), $2::BIGINT[]) AS \"InputHashAmount\"(\"hash\",\"amount\") ON \"UnspentOutputs\".\"hash\"=\"InputHashAmount\".\"hash\" AND \"UnspentOutputs\".\"amount\"=\"InputHashAmount\".\"amount\"";
+static const std::string k_sql_check_outputs = "SELECT COUNT(1) FROM \"UnspentOutputs\" WHERE \"hash\" = ANY(unpack_hashes($1))";
+static const std::string k_sql_store_spends = "INSERT INTO \"SpentHashes\" (\"hash\") SELECT unnest(unpack_hashes($1)) ON CONFLICT DO NOTHING";
+static const std::string k_sql_delete_inputs = "DELETE FROM \"UnspentOutputs\" WHERE \"hash\" = ANY(unpack_hashes($1))";
+static const std::string k_sql_insert_outputs = "INSERT INTO \"UnspentOutputs\" (\"hash\", \"amount\") SELECT * FROM unnest(unpack_hashes($1), $2::BIGINT[])";
+
+// With --redis, spent hashes are recorded in Redis from within the
+// replacement or burn's transaction, once its inputs have been found to be
+// unspent, but before it commits.  So the Redis set may run ahead of the
+// database, but never lags behind it.  If the transaction is rolled back
+// instead, its inputs remain in UnspentOutputs, which takes precedence over
+// the spent hashes when answering health checks, and marking them again when
+// they are eventually spent is a no-op.
+static void RedisRecordSpends(
+    const std::vector<PublicWebcash>& inputs,
+    std::function<void (bool)> done)
+{
+    std::vector<uint256> hashes;
+    hashes.reserve(inputs.size());
+    for (const auto& item : inputs) {
+        hashes.push_back(item.pk);
+    }
+    const std::string cmd = RedisSpentHashesCommand("SADD", hashes);
+    webcash::state().redis->execCommandAsync(
+        [done](const RedisResult &r) {
+            done(true);
+        },
+        [done](const RedisException &e) {
+            LogError() << e.what();
+            LogError() << "Offending Redis command: SADD " << k_redis_spent_hashes << " ...";
+            done(false);
+        },
+        cmd);
+}
+
+static std::vector<char> PackHashes(const std::vector<PublicWebcash>& webcash)
+{
+    std::vector<char> packed;
+    packed.reserve(32 * webcash.size());
+    for (const auto& item : webcash) {
+        packed.insert(packed.end(), (const char*)item.pk.begin(), (const char*)item.pk.end());
+    }
+    return packed;
+}
+
+static std::string PackAmounts(const std::vector<PublicWebcash>& webcash)
+{
+    std::string packed = "{";
+    for (const auto& item : webcash) {
+        if (packed.size() > 1) {
+            packed.push_back(',');
+        }
+        absl::StrAppend(&packed, item.amount.i64);
+    }
+    packed.push_back('}');
+    return packed;
+}
+
+// With --shards, the inputs and outputs of a replacement, burn or batch of
+// mining reports which fall in one shard, and the transaction in which they are
+// applied to it.
+struct ShardPart {
+    size_t shard = 0;
+    std::vector<char> input_hashes;
+    std::string input_amounts;
+    std::vector<char> output_hashes;
+    std::string output_amounts;
+    std::shared_ptr<Transaction> tx;
+};
+
+// Splits inputs and outputs by shard, with the shard of the first input, if
+// any, first.  There is always at least one part.
+static std::vector<ShardPart> SplitByShard(
+    const std::vector<PublicWebcash>& inputs,
+    const std::vector<PublicWebcash>& outputs)
+{
+    std::map<size_t, std::pair<std::vector<PublicWebcash>, std::vector<PublicWebcash>>> split;
+    for (const auto& item : inputs) {
+        split[webcash::shards().shardOf(item.pk)].first.push_back(item);
+    }
+    for (const auto& item : outputs) {
+        split[webcash::shards().shardOf(item.pk)].second.push_back(item);
+    }
+    const size_t home = inputs.empty() ? (split.empty() ? 0 : split.begin()->first) : webcash::shards().shardOf(inputs.front().pk);
+    split[home];
+    std::vector<ShardPart> parts;
+    parts.reserve(split.size());
+    for (const auto& item : split) {
+        ShardPart part;
+        part.shard = item.first;
+        part.input_hashes = PackHashes(item.second.first);
+        part.input_amounts = PackAmounts(item.second.first);
+        part.output_hashes = PackHashes(item.second.second);
+        part.output_amounts = PackAmounts(item.second.second);
+        parts.push_back(std::move(part));
+        if (item.first == home) {
+            std::swap(parts.front(), parts.back());
+        }
+    }
+    return parts;
+}
+
+// Opens a transaction on the shard of each part.  Returns false if any can't be.
+static bool BeginOnShards(std::vector<ShardPart>& parts)
+{
+    for (ShardPart& part : parts) {
+        auto db = webcash::shards().getDbClient(part.shard);
+        if (!db || !(part.tx = db->newTransaction())) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void RollbackShards(std::vector<ShardPart>& parts)
+{
+    for (ShardPart& part : parts) {
+        if (part.tx) {
+            part.tx->rollback();
+            part.tx.reset();
+        }
+    }
+}
+
+// Moves the transactions out of the parts, for ShardSet::commit.
+static std::vector<ShardSet::Part> ReleaseShards(std::vector<ShardPart>& parts)
+{
+    std::vector<ShardSet::Part> released;
+    released.reserve(parts.size());
+    for (ShardPart& part : parts) {
+        released.push_back({part.shard, std::move(part.tx)});
+    }
+    return released;
+}
+
+// Checks and applies the part of a replacement or burn held by each shard,
+// all at once, with a call to replace_webcash() in the part's transaction.
+// The replacement or burn itself is counted in the Summary of the first shard,
+// which keeps its audit records.  Calls done with "success", or the error to
+// report to the caller, once every part has been applied.
+static void ApplyToShards(
+    std::vector<ShardPart>& parts,
+    absl::Time received,
+    int64_t num_replace,
+    int64_t num_burn,
+    int64_t total_destroyed,
+    std::function<void (const std::string&)> done)
+{
+    struct Progress {
+        std::mutex mutex;
+        size_t remaining = 0;
+        std::string error;
+    };
+    auto progress = std::make_shared<Progress>();
+    progress->remaining = parts.size();
+    auto finished = [progress, done](const std::string& status) {
+        std::string error;
+        {
+            const std::lock_guard<std::mutex> lock(progress->mutex);
+            // Missing inputs are reported in preference to existing outputs,
+            // as they are checked first without --shards.
+            if (status != "success" && (progress->error.empty() || status == "input(s) not found")) {
+                progress->error = status;
+            }
+            if (--progress->remaining) {
+                return;
+            }
+            error = progress->error;
+        }
+        done(error.empty() ? "success" : error);
+    };
+    static const std::string sql = "SELECT replace_webcash($1, $2, $3, $4, $5, $6, FALSE, $7, $8, $9)";
+    for (ShardPart& part : parts) {
+        const bool first = &part == &parts.front();
+        *part.tx << sql
+            << part.input_hashes
+            << part.input_amounts
+            << part.output_hashes
+            << part.output_amounts
+            << absl::ToUnixNanos(received)
+            << !webcash::state().redis
+            << (first ? num_replace : int64_t{0})
+            << (first ? num_burn : int64_t{0})
+            << (first ? total_destroyed : int64_t{0})
+            >> [=](const Result &r) {
+                if (r.empty() || !r[0].size()) {
+                    LogError() << "Expected one row of one column containing status.  Got something else.";
+                    LogError() << "Offending SQL: " << sql;
+                    return finished("sql error");
+                }
+                const std::string status = r[0][0].as<std::string>();
+                if (status == "input(s) not found") {
+                    LogError() << "One or more specified input values not found in database.";
+                } else if (status == "output(s) already exists") {
+                    LogError() << "Replacement contains existing output.  Cowardly refusing to overwrite.";
+                } else if (status != "success") {
+                    LogError() << "Unexpected status from replace_webcash(): " << status;
+                    LogError() << "Offending SQL: " << sql;
+                    return finished("sql error");
+                }
+                finished(status);
+            }
+            >> [=](const DrogonDbException &e) {
+                LogError() << e.base().what();
+                LogError() << "Offending SQL: " << sql;
+                finished("sql error");
+            };
+    }
+}
+
+//  -----------------
+// | /api/v1/replace |
+//  -----------------
+
+// Nobody loves writing asynchronous code, and reading it is even worse.  I've
+// tried to decrease the burden here by laying things out in a logical
+// progression, keeping the code as linear as possible.
+//
+// As we go through the process of validating a replacement, all the
+// intermediate state needed is kept in a shared pointer to a ReplacementState
+// structure.  Reference-counted shared pointers are used so that when the
+// request is finished the intermediate state will naturally be cleaned up.
+// This structure is, as much as possible, filled out before a connection to the
+// database is made, so that precious time isn't spent allocating memory or
+// parsing fields while locks are held on tables or rows in the database.
+struct ReplacementState {
+    // The system clock time when the replace request was received by us.
+    absl::Time received = absl::UnixEpoch();
+    // The public webcash of the input and output secrets provided by the
+    // caller, sorted by hash.
+    std::vector<PublicWebcash> inputs;
+    std::vector<PublicWebcash> outputs;
+    // A straight summation over the inputs and outputs.
+    Amount total_in = Amount{0};
+    Amount total_out = Amount{0};
+    // The inputs and outputs, packed as statement parameters.
+    std::vector<char> input_hashes;
+    std::string input_amounts;
+    std::vector<char> output_hashes;
+    std::string output_amounts;
+    // The primary key of the Replacements record for the audit log.  Used to
+    // create records in the ReplacementInputs and ReplacementOutputs
+    // one-to-many join tables.
+    uint64_t replacement_id = 0;
+    // With --shards, the part of the replacement made on each shard it
+    // touches.  The first is the shard which keeps its audit records.
+    std::vector<ShardPart> parts;
+    // The replacement's slot in webcash::limits().replace, held until it is
+    // finished.
+    AdmissionControl::Ticket admission;
+    // Times each stage of the replacement, for /metrics.
+    StageTimer timer;
+};
+
+// Once a request has been parsed and checked, and admitted by
+// webcash::limits().replace, it is passed through a sequence of functions,
+// each of which initiates a call to the database and does something with the
+// results.  Since we want the processing of a replaement to be ACID, we pass a
+// shared pointer to a database transaction object which used to interact with
+// the database.  tx->rollback() is used if any error is encountered, which
+// terminates the replacement request and prevents further procesing.
+void StartReplacement(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state); // Calls CheckInputsExist...
+
+void CheckInputsExist(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx); // Calls CheckOutputsDoNotExist...
+
+void CheckOutputsDoNotExist(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx); // Calls RecordSpends...
+
+void RecordSpends(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx); // etc.
+
+void RemoveInputs(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx);
+
+void CreateOutputs(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx);
+
+void RecordToSummary(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx);
+
+void RecordToAuditLog(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx);
+
+void RecordToAuditLogInputs(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx);
+
+void RecordToAuditLogOutputs(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx);
+
+void ReportReplacement(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx); // Done
+
+// With --audit_log, the replacement is appended to the local audit log instead
+// of the RecordToAuditLog* steps, once it has committed, so that the log only
+// holds replacements which were made.  The reply waits for the append to be
+// synced to disk, but a failure to append can only be logged.
+void AppendToAuditLog(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state); // Calls FinishReplacement...
+
+// With --single_statement_replace, all of the above is instead done by a
+// single call to the replace_webcash() stored procedure, which saves the
+// round-trips between each step, and the time row locks are held across them.
+void ReplaceInOneStatement(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<DbClient> db); // Done
+
+// With --shards, the replacement is instead applied by each shard it touches
+// with a call to replace_webcash(), and is committed across them by
+// ShardSet::commit.
+void ReplaceOnShards(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state); // Calls RecordOnShards...
+
+void RecordOnShards(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state); // Calls CommitOnShards...
+
+void CommitOnShards(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state); // Calls FinishReplacement...
+
+// With webcash::state().storage, the replacement is instead made by it, as a
+// single unit of work.
+void ReplaceInStorage(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state); // Calls FinishReplacement...
+
+// Updates the cached state of the server and responds to the caller, once a
+// replacement has been committed.
+void FinishReplacement(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state);
+
+void V1::replace(
+    const HttpRequestPtr &req,
+    std::function<void (const HttpResponsePtr &)> &&callback
+){
+    absl::Time _received = absl::Now();
+    static ServerMetrics::Endpoint* const endpoint = webcash::metrics().GetEndpoint("replace");
+    callback = CountResponses(endpoint, _received, std::move(callback));
+    auto state = std::make_shared<ReplacementState>();
+    state->received = _received;
+    state->timer.Start(_received);
+
+    // The request is read in place, in a single pass.  Errors are reported
+    // once the whole body has been read, in the same order as if each field
+    // had been checked in turn.
+    const auto body = req->getBody();
+    JsonScanner in(absl::string_view(body.data(), body.size()));
+    bool accepted = false;
+    bool has_inputs = false, inputs_ok = false;
+    bool has_outputs = false, outputs_ok = false;
+    absl::string_view key;
+    if (in.BeginObject()) {
+        while (in.NextMember(key)) {
+            if (key == "legalese") {
+                read_legalese(in, accepted);
+            } else if (key == "webcashes") {
+                has_inputs = true;
+                inputs_ok = parse_secret_webcashes(in, state->inputs);
+            } else if (key == "new_webcashes") {
+                has_outputs = true;
+                outputs_ok = parse_secret_webcashes(in, state->outputs);
+            } else {
+                in.SkipValue();
+            }
+        }
+    }
+    if (!in.AtEnd()) {
+        return callback(JSONRPCError("no JSON body"));
+    }
+    if (!accepted) {
+        return callback(JSONRPCError("didn't accept terms"));
+    }
+
+    // Check 'inputs'
+    if (!has_inputs) {
+        return callback(JSONRPCError("no inputs"));
+    }
+    if (!inputs_ok) {
+        return callback(JSONRPCError("can't parse inputs"));
+    }
+    state->total_in = Amount(0);
+    for (const PublicWebcash& wc : state->inputs) {
+        state->total_in += wc.amount;
+        if (state->total_in < 1 || wc.amount < 1) {
+            return callback(JSONRPCError("overflow"));
+        }
+    }
+
+    // Check 'outputs'
+    if (!has_outputs) {
+        return callback(JSONRPCError("no outputs"));
+    }
+    if (!outputs_ok) {
+        return callback(JSONRPCError("can't parse inputs"));
+    }
+    state->total_out = Amount(0);
+    for (const PublicWebcash& wc : state->outputs) {
+        state->total_out += wc.amount;
+        if (state->total_out < 1 || wc.amount < 1) {
+            return callback(JSONRPCError("overflow"));
+        }
+    }
+
+    // Check inputs == outputs
+    if (state->total_in != state->total_out) {
+        return callback(JSONRPCError("inbalance"));
+    }
+
+    // Reject replacements of spent or non-existent inputs, or which would
+    // overwrite existing outputs, without opening a transaction.
+    if (!CachedInputsAreUnspent(state->inputs)) {
+        return callback(JSONRPCError("input(s) not found"));
+    }
+    if (CachedOutputsExist(state->outputs)) {
+        return callback(JSONRPCError("output(s) already exists"));
+    }
+
+    // Pack statement parameters
+    state->input_hashes = PackHashes(state->inputs);
+    state->input_amounts = PackAmounts(state->inputs);
+    state->output_hashes = PackHashes(state->outputs);
+    state->output_amounts = PackAmounts(state->outputs);
+
+    // Wait for a slot before opening a transaction, unless too many
+    // replacements are waiting already.
+    static LatencyHistogram* const parse_stage = Stage("replace", "Parse");
+    static LatencyHistogram* const admission_stage = Stage("replace", "Admission");
+    state->timer.End(parse_stage);
+    bool admitted = webcash::limits().replace.admit([=](AdmissionControl::Ticket ticket) {
+        state->timer.End(admission_stage);
+        state->admission = ticket;
+        StartReplacement(callback, state);
+    });
+    if (!admitted) {
+        return callback(OverloadedError());
+    }
+}
+
+void StartReplacement(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state
+){
+    // Now we perform checks that require access to global state.
+    if (webcash::state().storage) {
+        return ReplaceInStorage(callback, state);
+    }
+    if (webcash::shards().size()) {
+        return ReplaceOnShards(callback, state);
+    }
+    if (webcash::state().group_commit) {
+        return webcash::groupCommit().submit({state, nullptr, callback});
+    }
+    auto db = drogon::app().getDbClient();
+    if (!db) {
+        return callback(JSONRPCError("error getting connection to database"));
+    }
+    if (webcash::state().single_statement_replace) {
+        if (webcash::state().redis) {
+            // There's no point in the statement at which to record the spends
+            // in Redis, so they are recorded just before it.  The inputs have
+            // already been checked against the UTXO cache.
+            return RedisRecordSpends(state->inputs, [=](bool ok) {
+                if (!ok) {
+                    return callback(JSONRPCError("redis error"));
+                }
+                ReplaceInOneStatement(callback, state, db);
+            });
+        }
+        return ReplaceInOneStatement(callback, state, db);
+    }
+    auto tx = db->newTransaction();
+    if (!tx) {
+        return callback(JSONRPCError("error creating database transaction"));
+    }
+
+    return CheckInputsExist(callback, state, tx);
+}
+
+void CheckInputsExist(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("replace", "CheckInputsExist");
+    *tx << k_sql_check_inputs
+        << state->input_hashes
+        << state->input_amounts
+        >> [=](const Result &r) {
+            state->timer.End(stage);
+            if (r.empty() || !r[0].size()) {
+                LogError() << "Expected one row of one column containing count.  Got something else.";
+                LogError() << "Offending SQL: " << k_sql_check_inputs;
+                tx->rollback();
+                return callback(JSONRPCError("sql error"));
+            }
+
+            unsigned found = r[0][0].as<unsigned>();
+            if (found != state->inputs.size()) {
+                LogError() << "One or more specified input values not found in database.";
+                LogError() << "only " << to_string(found) << " of " << to_string(state->inputs.size()) << " inputs are valid.";
+                tx->rollback();
+                return callback(JSONRPCError("input(s) not found"));
+            }
+
+            return CheckOutputsDoNotExist(callback, state, tx);
+        }
+        >> [=](const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << k_sql_check_inputs;
+            return callback(JSONRPCError("sql error"));
+        };
+}
+
+void CheckOutputsDoNotExist(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("replace", "CheckOutputsDoNotExist");
+    *tx << k_sql_check_outputs
+        << state->output_hashes
+        >> [=](const Result &r) {
+            state->timer.End(stage);
+            if (r.empty() || !r[0].size()) {
+                LogError() << "Expected one row of one column containing count.  Got something else.";
+                LogError() << "Offending SQL: " << k_sql_check_outputs;
+                tx->rollback();
+                return callback(JSONRPCError("sql error"));
+            }
+
+            unsigned found = r[0][0].as<unsigned>();
+            if (found) {
+                LogError() << "Replacement contains existing output.  Cowardly refusing to overwrite.";
+                LogError() << to_string(found) << " outputs already exist.";
+                tx->rollback();
+                return callback(JSONRPCError("output(s) already exists"));
+            }
+
+            return RecordSpends(callback, state, tx);
+        }
+        >> [=](const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << k_sql_check_outputs;
+            return callback(JSONRPCError("sql error"));
+        };
+}
+
+void RecordSpends(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("replace", "RecordSpends");
+    if (webcash::state().redis) {
+        return RedisRecordSpends(state->inputs, [=](bool ok) {
+            state->timer.End(stage);
+            if (!ok) {
+                tx->rollback();
+                return callback(JSONRPCError("redis error"));
+            }
+            RemoveInputs(callback, state, tx);
+        });
+    }
+
+    *tx << k_sql_store_spends
+        << state->input_hashes
+        >> [=](const Result &r) {
+            state->timer.End(stage);
+            RemoveInputs(callback, state, tx);
+        }
+        >> [=](const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << k_sql_store_spends;
+            return callback(JSONRPCError("sql error"));
+        };
+}
+
+void RemoveInputs(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("replace", "RemoveInputs");
+    *tx << k_sql_delete_inputs
+        << state->input_hashes
+        >> [=](const Result &r) {
+            state->timer.End(stage);
+            CreateOutputs(callback, state, tx);
+        }
+        >> [=](const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << k_sql_delete_inputs;
+            return callback(JSONRPCError("sql error"));
+        };
+}
+
+void CreateOutputs(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("replace", "CreateOutputs");
+    *tx << k_sql_insert_outputs
+        << state->output_hashes
+        << state->output_amounts
+        >> [=](const Result &r) {
+            state->timer.End(stage);
+            RecordToSummary(callback, state, tx);
+        }
+        >> [=](const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << k_sql_insert_outputs;
+            return callback(JSONRPCError("sql error"));
+        };
+}
+
+void RecordToSummary(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("replace", "RecordToSummary");
+    *tx << k_sql_record_summary
+        << int64_t{0}
+        << int64_t{1}
+        << int64_t{0}
+        << static_cast<int64_t>(state->outputs.size()) - static_cast<int64_t>(state->inputs.size())
+        << int64_t{0}
+        >> [=](const Result &r) {
+            state->timer.End(stage);
+            if (webcash::audit().IsOpen()) {
+                return ReportReplacement(callback, state, tx);
+            }
+            RecordToAuditLog(callback, state, tx);
+        }
+        >> [=](const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << k_sql_record_summary;
+            return callback(JSONRPCError("sql error"));
+        };
+}
+
+void RecordToAuditLog(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("replace", "RecordToAuditLog");
+    static const std::string sql = absl::StrCat("INSERT INTO \"Replacements\" (\"received\") VALUES($1) RETURNING \"id\"");
+    *tx << sql
+        << absl::ToUnixNanos(state->received)
+        >> [=](const Result &r) {
+            state->timer.End(stage);
+            if (r.empty() || !r[0].size() || !(state->replacement_id = r[0][0].as<uint64_t>())) {
+                LogError() << "Expected one row of one column containing inserted id.  Got something else.";
+                LogError() << "Offending SQL: " << sql;
+                tx->rollback();
+                return callback(JSONRPCError("sql error"));
+            }
+            RecordToAuditLogInputs(callback, state, tx);
+        }
+        >> [=](const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
+            return callback(JSONRPCError("sql error"));
+        };
+}
+
+void RecordToAuditLogInputs(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("replace", "RecordToAuditLogInputs");
+    static const std::string sql = "INSERT INTO \"ReplacementInputs\" (\"replacement_id\", \"hash\", \"amount\") SELECT $1, * FROM unnest(unpack_hashes($2), $3::BIGINT[])";
+    *tx << sql
+        << state->replacement_id
+        << state->input_hashes
+        << state->input_amounts
+        >> [=](const Result &r) {
+            state->timer.End(stage);
+            RecordToAuditLogOutputs(callback, state, tx);
+        }
+        >> [=](const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
+            return callback(JSONRPCError("sql error"));
+        };
+}
+
+void RecordToAuditLogOutputs(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("replace", "RecordToAuditLogOutputs");
+    static const std::string sql = "INSERT INTO \"ReplacementOutputs\" (\"replacement_id\", \"hash\", \"amount\") SELECT $1, * FROM unnest(unpack_hashes($2), $3::BIGINT[])";
+    *tx << sql
+        << state->replacement_id
+        << state->output_hashes
+        << state->output_amounts
+        >> [=](const Result &r) {
+            state->timer.End(stage);
+            ReportReplacement(callback, state, tx);
+        }
+        >> [=](const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
+            return callback(JSONRPCError("sql error"));
+        };
+}
+
+void AppendToAuditLog(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state
+){
+    static LatencyHistogram* const stage = Stage("replace", "AppendToAuditLog");
+    AuditLog::Record record;
+    record.received = state->received;
+    record.kind = AuditLog::Kind::REPLACE;
+    record.input_hashes = state->input_hashes;
+    record.input_amounts = state->input_amounts;
+    record.output_hashes = state->output_hashes;
+    record.output_amounts = state->output_amounts;
+    webcash::audit().Append(record, [=](bool ok) {
+        state->timer.End(stage);
+        if (!ok) {
+            LogError() << "Replacement received at " << absl::ToUnixNanos(state->received) << " is missing from the audit log.";
+        }
+        FinishReplacement(callback, state);
+    });
+}
+
+void ReportReplacement(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("replace", "Commit");
+    tx->setCommitCallback([=](bool committed){
+        state->timer.End(stage);
+        // Only a committed replacement may touch the UTXO cache, or else it
+        // would hold the inputs as spent until the next restart.
+        if (!committed) {
+            LogError() << "Failed to commit replacement.";
+            return callback(JSONRPCError("sql error"));
+        }
+        if (webcash::audit().IsOpen()) {
+            return AppendToAuditLog(callback, state);
+        }
+        return FinishReplacement(callback, state);
+    });
+}
+
+void ReplaceInOneStatement(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state,
+    std::shared_ptr<DbClient> db
+){
+    static LatencyHistogram* const stage = Stage("replace", "ReplaceInOneStatement");
+    static const std::string sql = "SELECT replace_webcash($1, $2, $3, $4, $5, $6, $7, 1, 0, 0)";
+    *db << sql
+        << state->input_hashes
+        << state->input_amounts
+        << state->output_hashes
+        << state->output_amounts
+        << absl::ToUnixNanos(state->received)
+        << !webcash::state().redis
+        << !webcash::audit().IsOpen()
+        >> [=](const Result &r) {
+            state->timer.End(stage);
+            if (r.empty() || !r[0].size()) {
+                LogError() << "Expected one row of one column containing status.  Got something else.";
+                LogError() << "Offending SQL: " << sql;
+                return callback(JSONRPCError("sql error"));
+            }
+
+            const std::string status = r[0][0].as<std::string>();
+            if (status == "input(s) not found") {
+                LogError() << "One or more specified input values not found in database.";
+                return callback(JSONRPCError(status));
+            }
+            if (status == "output(s) already exists") {
+                LogError() << "Replacement contains existing output.  Cowardly refusing to overwrite.";
+                return callback(JSONRPCError(status));
+            }
+            if (status != "success") {
+                LogError() << "Unexpected status from replace_webcash(): " << status;
+                LogError() << "Offending SQL: " << sql;
+                return callback(JSONRPCError("sql error"));
+            }
+
+            // The procedure has already committed.
+            if (webcash::audit().IsOpen()) {
+                return AppendToAuditLog(callback, state);
+            }
+
+            return FinishReplacement(callback, state);
+        }
+        >> [=](const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
+            return callback(JSONRPCError("sql error"));
+        };
+}
+
+void ReplaceOnShards(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state
+){
+    static LatencyHistogram* const stage = Stage("replace", "ReplaceOnShards");
+    state->parts = SplitByShard(state->inputs, state->outputs);
+    if (!BeginOnShards(state->parts)) {
+        RollbackShards(state->parts);
+        return callback(JSONRPCError("error creating database transaction"));
+    }
+    ApplyToShards(state->parts, state->received, 1, 0, 0, [=](const std::string& status) {
+        state->timer.End(stage);
+        if (status != "success") {
+            RollbackShards(state->parts);
+            return callback(JSONRPCError(status));
+        }
+        RecordOnShards(callback, state);
+    });
+}
+
+void RecordOnShards(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state
+){
+    static LatencyHistogram* const stage = Stage("replace", "RecordOnShards");
+    // The audit records are appended to the local audit log once committed,
+    // or else written by the first shard.
+    auto record = [=]() {
+        if (webcash::audit().IsOpen()) {
+            return CommitOnShards(callback, state);
+        }
+        static const std::string sql =
+            "WITH \"Replacement\" AS (INSERT INTO \"Replacements\" (\"received\") VALUES($1) RETURNING \"id\"), "
+            "\"Inputs\" AS (INSERT INTO \"ReplacementInputs\" (\"replacement_id\", \"hash\", \"amount\") SELECT \"Replacement\".\"id\", \"Input\".* FROM \"Replacement\", unnest(unpack_hashes($2), $3::BIGINT[]) AS \"Input\") "
+            "INSERT INTO \"ReplacementOutputs\" (\"replacement_id\", \"hash\", \"amount\") SELECT \"Replacement\".\"id\", \"Output\".* FROM \"Replacement\", unnest(unpack_hashes($4), $5::BIGINT[]) AS \"Output\"";
+        *state->parts.front().tx << sql
+            << absl::ToUnixNanos(state->received)
+            << state->input_hashes
+            << state->input_amounts
+            << state->output_hashes
+            << state->output_amounts
+            >> [=](const Result &r) {
+                state->timer.End(stage);
+                CommitOnShards(callback, state);
+            }
+            >> [=](const DrogonDbException &e) {
+                LogError() << e.base().what();
+                LogError() << "Offending SQL: " << sql;
+                RollbackShards(state->parts);
+                return callback(JSONRPCError("sql error"));
+            };
+    };
+    if (webcash::state().redis) {
+        return RedisRecordSpends(state->inputs, [=](bool ok) {
+            if (!ok) {
+                RollbackShards(state->parts);
+                return callback(JSONRPCError("redis error"));
+            }
+            record();
+        });
+    }
+    record();
+}
+
+void CommitOnShards(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state
+){
+    static LatencyHistogram* const stage = Stage("replace", "Commit");
+    webcash::shards().commit(ReleaseShards(state->parts), nullptr, [=](bool committed) {
+        state->timer.End(stage);
+        if (!committed) {
+            LogError() << "Failed to commit replacement across " << state->parts.size() << " shards.";
+            return callback(JSONRPCError("sql error"));
+        }
+        if (webcash::audit().IsOpen()) {
+            return AppendToAuditLog(callback, state);
+        }
+        FinishReplacement(callback, state);
+    });
+}
+
+void ReplaceInStorage(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state
+){
+    static LatencyHistogram* const stage = Stage("replace", "ReplaceInStorage");
+    webcash::state().storage->Replace(state->received, state->inputs, state->outputs, [=](const std::string& status) {
+        state->timer.End(stage);
+        if (status != "success") {
+            return callback(JSONRPCError(status));
+        }
+        FinishReplacement(callback, state);
+    });
+}
+
+void FinishReplacement(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<ReplacementState> state
+){
+    // Note that while each of these updates are atomic, the combination is
+    // not.  It is possible for a read of the field to occur inbetween the
+    // statements.  At this time this field is informational only, so that
+    // is not a concern.
+    ++(webcash::state().num_replace);
+    webcash::state().num_unspent += state->outputs.size();
+    webcash::state().num_unspent -= state->inputs.size();
+
+    // Update the cache before responding, so that the caller sees its
+    // new outputs in any subsequent request.
+    for (const auto& item : state->inputs) {
+        webcash::utxos().Spend(item.pk);
+    }
+    for (const auto& item : state->outputs) {
+        webcash::utxos().AddUnspent(item.pk, item.amount);
+    }
+
+    if (webcash::state().logging) {
+        LogInfo() << "Replaced " << state->inputs.size()
+                  << " input for " << state->outputs.size()
+                  << " output (total: ₩" << to_string(state->total_in) << ")."
+                  << " tx=" << webcash::state().num_replace.load()
+                  << " burn=" << webcash::state().num_burn.load()
+                  << " unspent=" << webcash::state().num_unspent.load();
+    }
+
+    Json::Value ret(objectValue);
+    ret["status"] = "success";
+    auto resp = HttpResponse::newHttpJsonResponse(std::move(ret));
+    return callback(resp);
+}
+
+//  --------------
+// | /api/v1/burn |
+//  --------------
+
+struct BurnState {
+    // The system clock time when the replace request was received by us.
+    absl::Time received = absl::UnixEpoch();
+    // The public webcash of the input secrets to be burnt, as provided by the
+    // caller, sorted by hash.
+    std::vector<PublicWebcash> inputs;
+    // A straight summation over the inputs.
+    Amount total_in = Amount{0};
+    // The inputs, packed as statement parameters.
+    std::vector<char> input_hashes;
+    std::string input_amounts;
+    // The primary key of the Burns record for the audit log.  Used to
+    // create records in the BurnInputs one-to-many join table.
+    uint64_t burn_id = 0;
+    // With --shards, the part of the burn made on each shard it touches.  The
+    // first is the shard which keeps its audit records.
+    std::vector<ShardPart> parts;
+    // The burn's slot in webcash::limits().replace, held until it is finished.
+    AdmissionControl::Ticket admission;
+    // Times each stage of the burn, for /metrics.
+    StageTimer timer;
+};
+
+void StartBurn(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state); // Calls CheckInputsExist...
+
+void CheckInputsExist(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state,
+    std::shared_ptr<Transaction> tx); // Calls CheckOutputsDoNotExist...
+
+void RecordSpends(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state,
+    std::shared_ptr<Transaction> tx); // etc.
+
+void RemoveInputs(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state,
+    std::shared_ptr<Transaction> tx);
+
+void RecordToSummary(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state,
+    std::shared_ptr<Transaction> tx);
+
+void RecordToAuditLog(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state,
+    std::shared_ptr<Transaction> tx);
+
+void RecordToAuditLogInputs(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state,
+    std::shared_ptr<Transaction> tx);
+
+void AppendToAuditLog(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state); // Calls FinishBurn...
+
+void ReportBurn(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state,
+    std::shared_ptr<Transaction> tx); // Calls FinishBurn...
+
+// With --shards, the burn is instead applied by each shard it touches, as for
+// replacements.
+void BurnOnShards(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state); // Calls RecordOnShards...
+
+void RecordOnShards(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state); // Calls CommitOnShards...
+
+void CommitOnShards(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state); // Calls FinishBurn...
+
+// With webcash::state().storage, the burn is instead made by it.
+void BurnInStorage(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state); // Calls FinishBurn...
+
+// Updates the cached state of the server and responds to the caller, once a
+// burn has been committed.
+void FinishBurn(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state);
+
+void V1::burn(
+    const HttpRequestPtr &req,
+    std::function<void (const HttpResponsePtr &)> &&callback
+){
+    absl::Time _received = absl::Now();
+    static ServerMetrics::Endpoint* const endpoint = webcash::metrics().GetEndpoint("burn");
+    callback = CountResponses(endpoint, _received, std::move(callback));
+    auto state = std::make_shared<BurnState>();
+    state->received = _received;
+    state->timer.Start(_received);
+
+    // Read in place, as with replace.
+    const auto body = req->getBody();
+    JsonScanner in(absl::string_view(body.data(), body.size()));
+    bool accepted = false;
+    bool has_inputs = false, inputs_ok = false;
+    absl::string_view key;
+    if (in.BeginObject()) {
+        while (in.NextMember(key)) {
+            if (key == "legalese") {
+                read_legalese(in, accepted);
+            } else if (key == "destroy_webcash") {
+                has_inputs = true;
+                inputs_ok = parse_secret_webcashes(in, state->inputs);
+            } else {
+                in.SkipValue();
+            }
+        }
+    }
+    if (!in.AtEnd()) {
+        return callback(JSONRPCError("no JSON body"));
+    }
+    if (!accepted) {
+        return callback(JSONRPCError("didn't accept terms"));
+    }
+
+    // Check 'inputs'
+    if (!has_inputs) {
+        return callback(JSONRPCError("no inputs"));
+    }
+    if (!inputs_ok) {
+        return callback(JSONRPCError("can't parse inputs"));
+    }
+    state->total_in = Amount(0);
+    for (const PublicWebcash& wc : state->inputs) {
+        state->total_in += wc.amount;
+        if (state->total_in < 1 || wc.amount < 1) {
+            return callback(JSONRPCError("overflow"));
+        }
+    }
+
+    // Reject burns of spent or non-existent inputs without opening a
+    // transaction.
+    if (!CachedInputsAreUnspent(state->inputs)) {
+        return callback(JSONRPCError("input(s) not found"));
+    }
+
+    // Pack statement parameters
+    state->input_hashes = PackHashes(state->inputs);
+    state->input_amounts = PackAmounts(state->inputs);
+
+    // Burns share the replacements' transaction budget.
+    static LatencyHistogram* const parse_stage = Stage("burn", "Parse");
+    static LatencyHistogram* const admission_stage = Stage("burn", "Admission");
+    state->timer.End(parse_stage);
+    bool admitted = webcash::limits().replace.admit([=](AdmissionControl::Ticket ticket) {
+        state->timer.End(admission_stage);
+        state->admission = ticket;
+        StartBurn(callback, state);
+    });
+    if (!admitted) {
+        return callback(OverloadedError());
+    }
+}
+
+void StartBurn(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state
+){
+    // Now we perform checks that require access to global state.
+    if (webcash::state().storage) {
+        return BurnInStorage(callback, state);
+    }
+    if (webcash::shards().size()) {
+        return BurnOnShards(callback, state);
+    }
+    if (webcash::state().group_commit) {
+        return webcash::groupCommit().submit({nullptr, state, callback});
+    }
+    auto db = drogon::app().getDbClient();
+    if (!db) {
+        return callback(JSONRPCError("error getting connection to database"));
+    }
+    auto tx = db->newTransaction();
+    if (!tx) {
+        return callback(JSONRPCError("error creating database transaction"));
+    }
+
+    return CheckInputsExist(callback, state, tx);
+}
+
+void CheckInputsExist(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("burn", "CheckInputsExist");
+    *tx << k_sql_check_inputs
+        << state->input_hashes
+        << state->input_amounts
+        >> [=](const Result &r) {
+            state->timer.End(stage);
+            if (r.empty() || !r[0].size()) {
+                LogError() << "Expected one row of one column containing count.  Got something else.";
+                LogError() << "Offending SQL: " << k_sql_check_inputs;
+                tx->rollback();
+                return callback(JSONRPCError("sql error"));
+            }
+
+            unsigned found = r[0][0].as<unsigned>();
+            if (found != state->inputs.size()) {
+                LogError() << "One or more specified input values not found in database.";
+                LogError() << "only " << to_string(found) << " of " << to_string(state->inputs.size()) << " inputs are valid.";
+                tx->rollback();
+                return callback(JSONRPCError("input(s) not found"));
+            }
+
+            return RecordSpends(callback, state, tx);
+        }
+        >> [=](const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << k_sql_check_inputs;
+            return callback(JSONRPCError("sql error"));
+        };
+}
+
+void RecordSpends(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("burn", "RecordSpends");
+    if (webcash::state().redis) {
+        return RedisRecordSpends(state->inputs, [=](bool ok) {
+            state->timer.End(stage);
+            if (!ok) {
+                tx->rollback();
+                return callback(JSONRPCError("redis error"));
+            }
+            RemoveInputs(callback, state, tx);
+        });
+    }
+
+    *tx << k_sql_store_spends
+        << state->input_hashes
+        >> [=](const Result &r) {
+            state->timer.End(stage);
+            RemoveInputs(callback, state, tx);
+        }
+        >> [=](const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << k_sql_store_spends;
+            return callback(JSONRPCError("sql error"));
+        };
 }
 
-namespace api {
+void RemoveInputs(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("burn", "RemoveInputs");
+    *tx << k_sql_delete_inputs
+        << state->input_hashes
+        >> [=](const Result &r) {
+            state->timer.End(stage);
+            RecordToSummary(callback, state, tx);
+        }
+        >> [=](const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << k_sql_delete_inputs;
+            return callback(JSONRPCError("sql error"));
+        };
+}
 
-//  -----------------
-// | /api/v1/replace |
-//  -----------------
+void RecordToSummary(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("burn", "RecordToSummary");
+    *tx << k_sql_record_summary
+        << int64_t{0}
+        << int64_t{0}
+        << int64_t{1}
+        << -static_cast<int64_t>(state->inputs.size())
+        << state->total_in.i64
+        >> [=](const Result &r) {
+            state->timer.End(stage);
+            if (webcash::audit().IsOpen()) {
+                return ReportBurn(callback, state, tx);
+            }
+            RecordToAuditLog(callback, state, tx);
+        }
+        >> [=](const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << k_sql_record_summary;
+            return callback(JSONRPCError("sql error"));
+        };
+}
 
-// Nobody loves writing asynchronous code, and reading it is even worse.  I've
-// tried to decrease the burden here by laying things out in a logical
-// progression, keeping the code as linear as possible.
-//
-// As we go through the process of validating a replacement, all the
-// intermediate state needed is kept in a shared pointer to a ReplacementState
-// structure.  Reference-counted shared pointers are used so that when the
-// request is finished the intermediate state will naturally be cleaned up.
-// This structure is, as much as possible, filled out before a connection to the
-// database is made, so that precious time isn't spent allocating memory or
-// parsing fields while locks are held on tables or rows in the database.
-struct ReplacementState {
-    // The actual replacement request from the caller.
-    std::shared_ptr<Json::Value> msg;
-    // The system clock time when the replace request was received by us.
-    absl::Time received = absl::UnixEpoch();
-    // The input and output webcash secrets, as provided by the caller.
-    std::map<uint256, SecretWebcash> inputs;
-    std::map<uint256, SecretWebcash> outputs;
-    // A straight summation over the inputs and outputs.
-    Amount total_in = Amount{0};
-    Amount total_out = Amount{0};
-    // Pre-constructed SQL statements.
-    std::string sql_check_inputs;
-    std::string sql_check_outputs;
-    std::string sql_store_spends;
-    std::string sql_delete_inputs;
-    std::string sql_insert_outputs;
-    std::string sql_audit_log_inputs;
-    std::string sql_audit_log_outputs;
-    // The primary key of the Replacements record for the audit log.  Used to
-    // create records in the ReplacementInputs and ReplacementOutputs
-    // one-to-many join tables.
-    uint64_t replacement_id = 0;
-};
+void RecordToAuditLog(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("burn", "RecordToAuditLog");
+    static const std::string sql = absl::StrCat("INSERT INTO \"Burns\" (\"received\") VALUES($1) RETURNING \"id\"");
+    *tx << sql
+        << absl::ToUnixNanos(state->received)
+        >> [=](const Result &r) {
+            state->timer.End(stage);
+            if (r.empty() || !r[0].size() || !(state->burn_id = r[0][0].as<uint64_t>())) {
+                LogError() << "Expected one row of one column containing inserted id.  Got something else.";
+                LogError() << "Offending SQL: " << sql;
+                tx->rollback();
+                return callback(JSONRPCError("sql error"));
+            }
+            RecordToAuditLogInputs(callback, state, tx);
+        }
+        >> [=](const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
+            return callback(JSONRPCError("sql error"));
+        };
+}
 
-// Once a request is received, it is passed through a sequence of functions,
-// each of which initiates a call to the database and does something with the
-// results.  Since we want the processing of a replaement to be ACID, we pass a
-// shared pointer to a database transaction object which used to interact with
-// the database.  tx->rollback() is used if any error is encountered, which
-// terminates the replacement request and prevents further procesing.
-void CheckInputsExist(
+void RecordToAuditLogInputs(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx); // Calls CheckOutputsDoNotExist...
+    std::shared_ptr<BurnState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("burn", "RecordToAuditLogInputs");
+    static const std::string sql = "INSERT INTO \"BurnInputs\" (\"burn_id\", \"hash\", \"amount\") SELECT $1, * FROM unnest(unpack_hashes($2), $3::BIGINT[])";
+    *tx << sql
+        << state->burn_id
+        << state->input_hashes
+        << state->input_amounts
+        >> [=](const Result &r) {
+            state->timer.End(stage);
+            ReportBurn(callback, state, tx);
+        }
+        >> [=](const DrogonDbException &e) {
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
+            return callback(JSONRPCError("sql error"));
+        };
+}
 
-void CheckOutputsDoNotExist(
+void AppendToAuditLog(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx); // Calls RecordSpends...
+    std::shared_ptr<BurnState> state
+){
+    static LatencyHistogram* const stage = Stage("burn", "AppendToAuditLog");
+    AuditLog::Record record;
+    record.received = state->received;
+    record.kind = AuditLog::Kind::BURN;
+    record.input_hashes = state->input_hashes;
+    record.input_amounts = state->input_amounts;
+    webcash::audit().Append(record, [=](bool ok) {
+        state->timer.End(stage);
+        if (!ok) {
+            LogError() << "Burn received at " << absl::ToUnixNanos(state->received) << " is missing from the audit log.";
+        }
+        FinishBurn(callback, state);
+    });
+}
 
-void RecordSpends(
+void ReportBurn(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx); // etc.
+    std::shared_ptr<BurnState> state,
+    std::shared_ptr<Transaction> tx
+){
+    static LatencyHistogram* const stage = Stage("burn", "Commit");
+    tx->setCommitCallback([=](bool committed){
+        state->timer.End(stage);
+        // Only a committed burn may touch the UTXO cache, or else it
+        // would hold the inputs as spent until the next restart.
+        if (!committed) {
+            LogError() << "Failed to commit burn.";
+            return callback(JSONRPCError("sql error"));
+        }
+        if (webcash::audit().IsOpen()) {
+            return AppendToAuditLog(callback, state);
+        }
+        return FinishBurn(callback, state);
+    });
+}
 
-void RemoveInputs(
+void BurnOnShards(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx);
+    std::shared_ptr<BurnState> state
+){
+    static LatencyHistogram* const stage = Stage("burn", "BurnOnShards");
+    state->parts = SplitByShard(state->inputs, {});
+    if (!BeginOnShards(state->parts)) {
+        RollbackShards(state->parts);
+        return callback(JSONRPCError("error creating database transaction"));
+    }
+    ApplyToShards(state->parts, state->received, 0, 1, state->total_in.i64, [=](const std::string& status) {
+        state->timer.End(stage);
+        if (status != "success") {
+            RollbackShards(state->parts);
+            return callback(JSONRPCError(status));
+        }
+        RecordOnShards(callback, state);
+    });
+}
 
-void CreateOutputs(
+void RecordOnShards(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx);
+    std::shared_ptr<BurnState> state
+){
+    static LatencyHistogram* const stage = Stage("burn", "RecordOnShards");
+    // The audit records are appended to the local audit log once committed,
+    // or else written by the first shard.
+    auto record = [=]() {
+        if (webcash::audit().IsOpen()) {
+            return CommitOnShards(callback, state);
+        }
+        static const std::string sql =
+            "WITH \"Burn\" AS (INSERT INTO \"Burns\" (\"received\") VALUES($1) RETURNING \"id\") "
+            "INSERT INTO \"BurnInputs\" (\"burn_id\", \"hash\", \"amount\") SELECT \"Burn\".\"id\", \"Input\".* FROM \"Burn\", unnest(unpack_hashes($2), $3::BIGINT[]) AS \"Input\"";
+        *state->parts.front().tx << sql
+            << absl::ToUnixNanos(state->received)
+            << state->input_hashes
+            << state->input_amounts
+            >> [=](const Result &r) {
+                state->timer.End(stage);
+                CommitOnShards(callback, state);
+            }
+            >> [=](const DrogonDbException &e) {
+                LogError() << e.base().what();
+                LogError() << "Offending SQL: " << sql;
+                RollbackShards(state->parts);
+                return callback(JSONRPCError("sql error"));
+            };
+    };
+    if (webcash::state().redis) {
+        return RedisRecordSpends(state->inputs, [=](bool ok) {
+            if (!ok) {
+                RollbackShards(state->parts);
+                return callback(JSONRPCError("redis error"));
+            }
+            record();
+        });
+    }
+    record();
+}
 
-void RecordToAuditLog(
+void CommitOnShards(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx);
+    std::shared_ptr<BurnState> state
+){
+    static LatencyHistogram* const stage = Stage("burn", "Commit");
+    webcash::shards().commit(ReleaseShards(state->parts), nullptr, [=](bool committed) {
+        state->timer.End(stage);
+        if (!committed) {
+            LogError() << "Failed to commit burn across " << state->parts.size() << " shards.";
+            return callback(JSONRPCError("sql error"));
+        }
+        if (webcash::audit().IsOpen()) {
+            return AppendToAuditLog(callback, state);
+        }
+        FinishBurn(callback, state);
+    });
+}
 
-void RecordToAuditLogInputs(
+void BurnInStorage(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx);
+    std::shared_ptr<BurnState> state
+){
+    static LatencyHistogram* const stage = Stage("burn", "BurnInStorage");
+    webcash::state().storage->Burn(state->received, state->inputs, [=](const std::string& status) {
+        state->timer.End(stage);
+        if (status != "success") {
+            return callback(JSONRPCError(status));
+        }
+        FinishBurn(callback, state);
+    });
+}
+
+void FinishBurn(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<BurnState> state
+){
+    // Note that while each of these updates are atomic, the combination is
+    // not.  It is possible for a read of the field to occur inbetween the
+    // statements.  At this time this field is informational only, so that
+    // is not a concern.
+    ++(webcash::state().num_burn);
+    webcash::state().num_unspent -= state->inputs.size();
+    webcash::state().total_destroyed += state->total_in.i64;
+
+    for (const auto& item : state->inputs) {
+        webcash::utxos().Spend(item.pk);
+    }
+
+    if (webcash::state().logging) {
+        LogInfo() << "Burned " << state->inputs.size()
+                  << " input (total: ₩" << to_string(state->total_in) << ")."
+                  << " tx=" << webcash::state().num_replace.load()
+                  << " burn=" << webcash::state().num_burn.load()
+                  << " unspent=" << webcash::state().num_unspent.load();
+    }
+
+    Json::Value ret(objectValue);
+    ret["status"] = "success";
+    auto resp = HttpResponse::newHttpJsonResponse(std::move(ret));
+    return callback(resp);
+}
+
+//  ----------------
+// | /api/v1/target |
+//  ----------------
+
+void V1::target(
+    const HttpRequestPtr &req,
+    std::function<void (const HttpResponsePtr &)> &&callback
+){
+    callback(TargetResponse(req));
+}
+
+void V1::targetWait(
+    const HttpRequestPtr &req,
+    std::function<void (const HttpResponsePtr &)> &&callback
+){
+    webcash::targets().wait(req->getParameter("version"), std::move(callback));
+}
+
+} // namespace api
+
+static bool RenderTarget(std::string& body)
+{
+    WebcashStats stats = webcash::state().getStats(absl::Now());
+
+    Json::Value ret(objectValue);
+    ret["difficulty_target_bits"] = stats.difficulty;
+    ret["epoch"] = static_cast<int>(stats.epoch);
+    ret["version"] = TargetNotifier::getVersion(stats.difficulty, stats.epoch);
+    ret["mining_amount"] = to_string(stats.mining_amount);
+    ret["mining_subsidy_amount"] = to_string(stats.subsidy_amount);
+    if (stats.total_circulation > 0 && stats.expected_circulation > 0) {
+        ret["ratio"] = static_cast<double>(stats.total_circulation) / static_cast<double>(stats.expected_circulation);
+    } else {
+        ret["ratio"] = 1.0; // To avoid transient errors on startup
+    }
+
+    body = RenderJson(ret);
+    return true;
+}
+
+std::shared_ptr<HttpResponse> TargetResponse(const HttpRequestPtr& req)
+{
+    // The ratio changes with time, so it is rendered again at least once per
+    // k_target_cache_expiry, as well as with each mining report.
+    static CachedResponse target(drogon::CT_APPLICATION_JSON, absl::Seconds(k_target_cache_expiry), RenderTarget);
+    return target.get(req, EconomyKey());
+}
+
+std::string TargetNotifier::getVersion(unsigned difficulty, unsigned epoch)
+{
+    return absl::StrCat(difficulty, ":", epoch);
+}
+
+std::string TargetNotifier::getCurrentVersion()
+{
+    return getVersion(webcash::state().getDifficulty(), webcash::state().getEpoch());
+}
+
+void TargetNotifier::wait(
+    const std::string& version,
+    std::function<void (const HttpResponsePtr &)> &&callback
+){
+    uint64_t id;
+    {
+        // The version is compared with the lock held, so that a change which
+        // is made after the comparison can't be notified before the request
+        // is added to the waiting list.
+        std::lock_guard<std::mutex> lock(mutex);
+        if (version != getCurrentVersion()) {
+            id = 0;
+        } else {
+            id = ++next_id;
+            waiting.emplace(id, std::move(callback));
+        }
+    }
+    if (!id) {
+        return callback(TargetResponse());
+    }
+    drogon::app().getLoop()->runAfter(absl::ToDoubleSeconds(k_max_wait), [this, id]() {
+        expire(id);
+    });
+}
+
+void TargetNotifier::expire(uint64_t id)
+{
+    std::function<void (const HttpResponsePtr &)> callback;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto itr = waiting.find(id);
+        if (itr == waiting.end()) {
+            // Already answered by notify().
+            return;
+        }
+        callback = std::move(itr->second);
+        waiting.erase(itr);
+    }
+    callback(TargetResponse());
+}
+
+void TargetNotifier::notify()
+{
+    std::map<uint64_t, std::function<void (const HttpResponsePtr &)>> notified;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        notified.swap(waiting);
+    }
+    // Each request gets its own response object, since responses are
+    // rendered per connection.
+    for (auto& item : notified) {
+        item.second(TargetResponse());
+    }
+}
+
+size_t TargetNotifier::numWaiting() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return waiting.size();
+}
+
+namespace webcash {
+    TargetNotifier& targets()
+    {
+        static TargetNotifier notifier;
+        return notifier;
+    }
+} // webcash
+
+namespace api {
+
+//  -----------------------
+// | /api/v1/mining_report |
+//  -----------------------
 
-void RecordToAuditLogOutputs(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx);
+// Contains intermediate state for processing a MiningReport submission request.
+struct MiningReportState {
+    // The system clock time at which the request was received.
+    absl::Time received;
+    // The base64-encoded mining report as received from the caller.
+    std::string preimage;
+    // The sha256 hash of the preimage. (cached)
+    uint256 hash;
+    // The actual number of leading zero bits of the hash. (cached)
+    unsigned bits;
+    // If the parsed preimage contains a "difficulty" field, and its value.
+    bool has_difficulty = false;
+    unsigned difficulty = 0;
+    // If the parsed preimage contains a "timestamp" field, and its value.
+    bool has_timestamp = false;
+    absl::Time timestamp = absl::UnixEpoch();
+    // The public webcash of the "webcash" and "subsidy" fields of the
+    // preimage, sorted by hash.
+    std::vector<PublicWebcash> webcash;
+    std::vector<PublicWebcash> subsidy;
+    // The calculated sum of the webcash and subsidy arrays. (cached)
+    Amount webcash_sum = Amount{0};
+    Amount subsidy_sum = Amount{0};
+    // The outputs, packed as statement parameters.
+    std::vector<char> output_hashes;
+    std::string output_amounts;
+    // The fields derived from the tip of the chain of mining reports, which
+    // are filled in by the sequencer.
+    unsigned current_difficulty = 0;
+    unsigned next_difficulty = 0;
+    double aggregate_work = 0.0;
+    // The report's slot in webcash::limits().mining_report, held until it has
+    // been recorded or rejected.
+    AdmissionControl::Ticket admission;
+    // Times each stage of the report, for /metrics.
+    StageTimer timer;
+};
 
-void ReportReplacement(
+// Looks up a mining report's preimage, which the preimage filter says may have
+// been seen before, before handing the report to the sequencer.
+void CheckNewMiningReportPreimage(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx); // Done
+    std::shared_ptr<MiningReportState> state);
 
-void V1::replace(
+void V1::miningReport(
     const HttpRequestPtr &req,
     std::function<void (const HttpResponsePtr &)> &&callback
 ){
     absl::Time _received = absl::Now();
-    auto state = std::make_shared<ReplacementState>();
+    static ServerMetrics::Endpoint* const endpoint = webcash::metrics().GetEndpoint("mining_report");
+    callback = CountResponses(endpoint, _received, std::move(callback));
+    auto state = std::make_shared<MiningReportState>();
     state->received = _received;
-
-    state->msg = req->getJsonObject();
-    if (!state->msg || !state->msg->isObject()) {
+    state->timer.Start(_received);
+
+    // Read the request, and then the preimage it contains, in place.
+    const auto body = req->getBody();
+    JsonScanner in(absl::string_view(body.data(), body.size()));
+    bool accepted = false;
+    bool has_preimage = false;
+    absl::string_view key;
+    if (in.BeginObject()) {
+        while (in.NextMember(key)) {
+            if (key == "legalese") {
+                read_legalese(in, accepted);
+            } else if (key == "preimage") {
+                absl::string_view preimage;
+                has_preimage = in.Peek() == '"' && in.ReadString(preimage);
+                if (has_preimage) {
+                    state->preimage.assign(preimage.data(), preimage.size());
+                } else {
+                    in.SkipValue();
+                }
+            } else {
+                in.SkipValue();
+            }
+        }
+    }
+    if (!in.AtEnd()) {
         return callback(JSONRPCError("no JSON body"));
     }
-    if (!check_legalese(*state->msg)) {
+    if (!accepted) {
         return callback(JSONRPCError("didn't accept terms"));
     }
 
-    // Extract 'inputs'
-    if (!state->msg->isMember("webcashes")) {
-        return callback(JSONRPCError("no inputs"));
+    // Extract base64-encoded preimage
+    if (!has_preimage) {
+        return callback(JSONRPCError("missing preimage"));
     }
-    if (!parse_secret_webcashes((*state->msg)["webcashes"], state->inputs)) {
-        return callback(JSONRPCError("can't parse inputs"));
+    std::string preimage_str;
+    if (!absl::Base64Unescape(state->preimage, &preimage_str)) {
+        return callback(JSONRPCError("preimage is not base64-encoded string"));
     }
-    state->total_in = Amount(0);
-    std::vector<std::string> input_values_hash_with_amount;
-    std::vector<std::string> input_values_hash_only;
-    input_values_hash_with_amount.reserve(state->inputs.size());
-    input_values_hash_only.reserve(state->inputs.size());
-    for (const auto& item : state->inputs) {
-        const uint256& hash = item.first;
-        const SecretWebcash& wc = item.second;
-        state->total_in += wc.amount;
-        if (state->total_in < 1 || wc.amount < 1) {
-            return callback(JSONRPCError("overflow"));
+
+    JsonScanner preimage(preimage_str);
+    bool has_webcash = false, webcash_ok = false;
+    bool has_subsidy = false, subsidy_ok = false;
+    bool timestamp_ok = true, difficulty_ok = true;
+    double timestamp = 0.0, difficulty = 0.0;
+    if (preimage.BeginObject()) {
+        while (preimage.NextMember(key)) {
+            if (key == "webcash") {
+                has_webcash = true;
+                webcash_ok = parse_secret_webcashes(preimage, state->webcash);
+            } else if (key == "subsidy") {
+                has_subsidy = true;
+                subsidy_ok = parse_secret_webcashes(preimage, state->subsidy);
+            } else if (key == "timestamp") {
+                state->has_timestamp = true;
+                timestamp_ok = read_number(preimage, timestamp);
+            } else if (key == "difficulty") {
+                state->has_difficulty = true;
+                difficulty_ok = read_number(preimage, difficulty);
+            } else {
+                preimage.SkipValue();
+            }
         }
-        std::string hash_hex = absl::BytesToHexString(absl::string_view((char*)hash.data(), 32));
-        input_values_hash_with_amount.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea,", to_string(wc.amount.i64), ")"));
-        input_values_hash_only.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea)"));
+    }
+    if (!preimage.AtEnd()) {
+        return callback(JSONRPCError("couldn't parse preimage as JSON"));
     }
 
-    // Extract 'outputs'
-    if (!state->msg->isMember("new_webcashes")) {
-        return callback(JSONRPCError("no outputs"));
+    // Check 'webcash', the array of webcash claim codes generated by this
+    // miner.
+    if (!has_webcash) {
+        return callback(JSONRPCError("missing 'webcash' field in preimage"));
     }
-    if (!parse_secret_webcashes((*state->msg)["new_webcashes"], state->outputs)) {
-        return callback(JSONRPCError("can't parse inputs"));
+    if (!webcash_ok) {
+        return callback(JSONRPCError("'webcash' field in preimage needs to be array of webcash secrets"));
     }
-    state->total_out = Amount(0);
-    std::vector<std::string> output_values_hash_with_amount;
-    std::vector<std::string> output_values_hash_only;
-    output_values_hash_with_amount.reserve(state->outputs.size());
-    output_values_hash_only.reserve(state->outputs.size());
-    for (const auto& item : state->outputs) {
-        const uint256& hash = item.first;
-        const SecretWebcash& wc = item.second;
-        state->total_out += wc.amount;
-        if (state->total_out < 1 || wc.amount < 1) {
-            return callback(JSONRPCError("overflow"));
+
+    // Check 'subsidy', the array of webcash claim codes given to the server
+    if (!has_subsidy) {
+        return callback(JSONRPCError("missing 'subsidy' field in peimage"));
+    }
+    if (!subsidy_ok) {
+        return callback(JSONRPCError("'subsidy' field in preimage needs to be array of webcash secrets"));
+    }
+
+    // Check 'timestamp'
+    if (state->has_timestamp) {
+        if (!timestamp_ok) {
+            return callback(JSONRPCError("'timestamp' field in preimage must be numeric"));
         }
-        std::string hash_hex = absl::BytesToHexString(absl::string_view((char*)hash.data(), 32));
-        output_values_hash_with_amount.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea,", to_string(wc.amount.i64), ")"));
-        output_values_hash_only.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea)"));
+        state->timestamp = absl::FromUnixSeconds(static_cast<int64_t>(timestamp));
     }
 
-    // Check inputs == outputs
-    if (state->total_in != state->total_out) {
-        return callback(JSONRPCError("inbalance"));
+    // Check 'difficulty'
+    if (state->has_difficulty) {
+        if (!difficulty_ok || difficulty < 0.0 || difficulty > std::numeric_limits<unsigned>::max() || difficulty != std::trunc(difficulty)) {
+            return callback(JSONRPCError("'difficulty' field in preimage must be small positive integer"));
+        }
+        if (difficulty > 255) {
+            return callback(JSONRPCError("'difficulty' field in preimage is too high"));
+        }
+        state->difficulty = static_cast<unsigned>(difficulty);
     }
 
-    // Prepare SQL statements
-    state->sql_check_inputs = absl::StrCat("WITH \"InputHashAmount\"(\"hash\",\"amount\") AS (VALUES", absl::StrJoin(input_values_hash_with_amount, ","), ") SELECT COUNT(1) FROM \"UnspentOutputs\" INNER JOIN \"InputHashAmount\" ON \"UnspentOutputs\".\"hash\"=\"InputHashAmount\".\"hash\" AND \"UnspentOutputs\".\"amount\"=\"InputHashAmount\".\"amount\"");
-    state->sql_check_outputs = absl::StrCat("SELECT COUNT(1) FROM \"UnspentOutputs\" WHERE \"hash\" IN (", absl::StrJoin(output_values_hash_only, ","), ")");
-    state->sql_store_spends = absl::StrCat("INSERT INTO \"SpentHashes\" (\"hash\") VALUES", absl::StrJoin(input_values_hash_only, ","), "ON CONFLICT DO NOTHING");
-    state->sql_delete_inputs = absl::StrCat("DELETE FROM \"UnspentOutputs\" WHERE \"hash\" IN (SELECT * FROM (VALUES", absl::StrJoin(input_values_hash_only, ","), ") AS hashes)");
-    state->sql_insert_outputs = absl::StrCat("INSERT INTO \"UnspentOutputs\" (\"hash\", \"amount\") VALUES", absl::StrJoin(output_values_hash_with_amount, ","));
-    state->sql_audit_log_inputs = absl::StrCat("INSERT INTO \"ReplacementInputs\" (\"replacement_id\", \"hash\", \"amount\") SELECT $1, * FROM (VALUES", absl::StrJoin(input_values_hash_with_amount, ","), ") AS inputs");
-    state->sql_audit_log_outputs = absl::StrCat("INSERT INTO \"ReplacementOutputs\" (\"replacement_id\", \"hash\", \"amount\") SELECT $1, * FROM (VALUES", absl::StrJoin(output_values_hash_with_amount, ","), ") AS outputs");
+    // Check 'webcash' amounts
+    state->webcash_sum = Amount{0};
+    for (const PublicWebcash& wc : state->webcash) {
+        state->webcash_sum += wc.amount;
+        if (state->webcash_sum < 1 || wc.amount < 1) {
+            return callback(JSONRPCError("overflow"));
+        }
+    }
 
-    // Now we perform checks that require access to global state.
-    auto db = drogon::app().getDbClient();
-    if (!db) {
-        return callback(JSONRPCError("error getting connection to database"));
+    // Check 'subsidy' amounts, and that each is also in 'webcash'
+    state->subsidy_sum = Amount{0};
+    for (const PublicWebcash& wc : state->subsidy) {
+        state->subsidy_sum += wc.amount;
+        if (state->subsidy_sum < 1 || wc.amount < 1) {
+            return callback(JSONRPCError("overflow"));
+        }
+        auto itr = std::lower_bound(state->webcash.begin(), state->webcash.end(), wc, [](const PublicWebcash& a, const PublicWebcash& b) {
+            return a.pk < b.pk;
+        });
+        if (itr == state->webcash.end() || itr->pk != wc.pk) {
+            return callback(JSONRPCError("missing subsidy from webcash"));
+        }
+        if (itr->amount != wc.amount) {
+            return callback(JSONRPCError("subsidy doesn't match webcash"));
+        }
     }
-    auto tx = db->newTransaction();
-    if (!tx) {
-        return callback(JSONRPCError("error creating database transaction"));
+    if (state->webcash.size() < state->subsidy.size() || state->webcash_sum < state->subsidy_sum) {
+        return callback(JSONRPCError("internal server error")); // should have failed above
     }
 
-    return CheckInputsExist(callback, state, tx);
-}
-
-void CheckInputsExist(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx
-){
-    *tx << state->sql_check_inputs
-        >> [=](const Result &r) {
-            if (r.empty() || !r[0].size()) {
-                std::cerr << "error: Expected one row of one column containing count.  Got something else." << std::endl;
-                std::cerr << "error: Offending SQL: " << state->sql_check_inputs << std::endl;
-                tx->rollback();
-                return callback(JSONRPCError("sql error"));
-            }
-
-            unsigned found = r[0][0].as<unsigned>();
-            if (found != state->inputs.size()) {
-                std::cerr << "error: One or more specified input values not found in database." << std::endl;
-                std::cerr << "error: only " << to_string(found) << " of " << to_string(state->inputs.size()) << " inputs are valid." << std::endl;
-                tx->rollback();
-                return callback(JSONRPCError("input(s) not found"));
-            }
-
-            return CheckOutputsDoNotExist(callback, state, tx);
+    // Check 'timestamp', if present
+    if (state->has_timestamp) {
+        absl::Time min_time = state->received - absl::Hours(2);
+        absl::Time max_time = state->received + absl::Hours(2);
+        if (state->timestamp < min_time || max_time < state->timestamp) {
+            return callback(JSONRPCError("timestamp of mining report must be within 2 hours of receipt by server"));
         }
-        >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << state->sql_check_inputs << std::endl;
-            return callback(JSONRPCError("sql error"));
-        };
-}
-
-void CheckOutputsDoNotExist(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx
-){
-    *tx << state->sql_check_outputs
-        >> [=](const Result &r) {
-            if (r.empty() || !r[0].size()) {
-                std::cerr << "error: Expected one row of one column containing count.  Got something else." << std::endl;
-                std::cerr << "error: Offending SQL: " << state->sql_check_outputs << std::endl;
-                tx->rollback();
-                return callback(JSONRPCError("sql error"));
-            }
+    }
 
-            unsigned found = r[0][0].as<unsigned>();
-            if (found) {
-                std::cerr << "error: Replacement contains existing output.  Cowardly refusing to overwrite." << std::endl;
-                std::cerr << "error: " << to_string(found) << " outputs already exist." << std::endl;
-                tx->rollback();
-                return callback(JSONRPCError("output(s) already exists"));
-            }
+    // Calculate proof-of-work
+    CSHA256().Write((unsigned char*)state->preimage.c_str(), state->preimage.length()).Finalize(state->hash.data());
+    state->bits = get_apparent_difficulty(state->hash);
+    if (state->bits < 25) { // DoS prevention
+        return callback(JSONRPCError("difficulty too low"));
+    }
 
-            return RecordSpends(callback, state, tx);
+    // Check 'difficulty', if present
+    if (state->has_difficulty) {
+        if (state->bits < state->difficulty) {
+            return callback(JSONRPCError("proof-of-work doesn't match committed difficulty"));
         }
-        >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << state->sql_check_outputs << std::endl;
-            return callback(JSONRPCError("sql error"));
-        };
-}
+    }
 
-void RecordSpends(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx
-){
-    *tx << state->sql_store_spends
-        >> [=](const Result &r) {
-            RemoveInputs(callback, state, tx);
-        }
-        >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << state->sql_store_spends << std::endl;
-            return callback(JSONRPCError("sql error"));
-        };
-}
+    // Reject reports which would overwrite existing outputs without opening a
+    // transaction.
+    if (CachedOutputsExist(state->webcash)) {
+        return callback(JSONRPCError("output(s) already exists"));
+    }
 
-void RemoveInputs(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx
-){
-    *tx << state->sql_delete_inputs
-        >> [=](const Result &r) {
-            CreateOutputs(callback, state, tx);
+    // Pack statement parameters.
+    state->output_hashes = PackHashes(state->webcash);
+    state->output_amounts = PackAmounts(state->webcash);
+
+    // Bound the number of reports waiting on the database, whether to be
+    // looked up or recorded by the sequencer.
+    static LatencyHistogram* const parse_stage = Stage("mining_report", "Parse");
+    static LatencyHistogram* const admission_stage = Stage("mining_report", "Admission");
+    state->timer.End(parse_stage);
+    bool admitted = webcash::limits().mining_report.admit([=](AdmissionControl::Ticket ticket) {
+        state->timer.End(admission_stage);
+        state->admission = ticket;
+
+        // Replayed reports are turned away here, rather than causing the
+        // batch they are sequenced into to be rolled back.  Only reports
+        // which the preimage filter might have seen before need to be
+        // looked up.
+        if (webcash::state().preimages.Contains(state->hash)) {
+            return CheckNewMiningReportPreimage(callback, state);
         }
-        >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << state->sql_delete_inputs << std::endl;
-            return callback(JSONRPCError("sql error"));
-        };
-}
 
-void CreateOutputs(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx
-){
-    *tx << state->sql_insert_outputs
-        >> [=](const Result &r) {
-            RecordToAuditLog(callback, state, tx);
-        }
-        >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << state->sql_insert_outputs << std::endl;
-            return callback(JSONRPCError("sql error"));
-        };
+        // The remaining checks depend on the tip of the chain of mining
+        // reports, and so are made by the sequencer.
+        return webcash::sequencer().submit(state, callback);
+    });
+    if (!admitted) {
+        return callback(OverloadedError());
+    }
 }
 
-void RecordToAuditLog(
+void CheckNewMiningReportPreimage(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx
+    std::shared_ptr<MiningReportState> state
 ){
-    static const std::string sql = absl::StrCat("INSERT INTO \"Replacements\" (\"received\") VALUES($1) RETURNING \"id\"");
-    *tx << sql
-        << absl::ToUnixNanos(state->received)
-        >> [=](const Result &r) {
-            if (r.empty() || !r[0].size() || !(state->replacement_id = r[0][0].as<uint64_t>())) {
-                std::cerr << "error: Expected one row of one column containing inserted id.  Got something else." << std::endl;
-                std::cerr << "error: Offending SQL: " << sql << std::endl;
-                tx->rollback();
-                return callback(JSONRPCError("sql error"));
+    static LatencyHistogram* const stage = Stage("mining_report", "CheckNewMiningReportPreimage");
+    if (webcash::state().storage) {
+        return webcash::state().storage->HasPreimage(state->hash, [=](const std::string& status, bool found) {
+            state->timer.End(stage);
+            if (status != "success") {
+                return callback(JSONRPCError(status));
             }
-            RecordToAuditLogInputs(callback, state, tx);
-        }
-        >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << sql << std::endl;
-            return callback(JSONRPCError("sql error"));
-        };
-}
+            if (found) {
+                LogError() << "Received duplicate MiningReport.";
+                LogError() << "duplicate: " << state->preimage;
+                return callback(JSONRPCError("reused preimage"));
+            }
+            webcash::sequencer().submit(state, callback);
+        });
+    }
+    auto db = drogon::app().getDbClient();
+    if (!db) {
+        return callback(JSONRPCError("error getting connection to database"));
+    }
 
-void RecordToAuditLogInputs(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx
-){
-    *tx << state->sql_audit_log_inputs
-        << state->replacement_id
+    static const std::string sql = "SELECT COUNT(1) FROM \"MiningReports\" WHERE \"preimage_hash\"=$1";
+    *db << sql
+        << std::vector<char>((const char*)state->hash.begin(), (const char*)state->hash.end())
         >> [=](const Result &r) {
-            RecordToAuditLogOutputs(callback, state, tx);
-        }
-        >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << state->sql_audit_log_inputs << std::endl;
-            return callback(JSONRPCError("sql error"));
-        };
-}
+            state->timer.End(stage);
+            if (r.empty() || !r[0].size()) {
+                LogError() << "Expected one row of one column containing count.  Got something else.";
+                LogError() << "Offending SQL: " << sql;
+                return callback(JSONRPCError("sql error"));
+            }
 
-void RecordToAuditLogOutputs(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx
-){
-    *tx << state->sql_audit_log_outputs
-        << state->replacement_id
-        >> [=](const Result &r) {
-            ReportReplacement(callback, state, tx);
+            if (r[0][0].as<unsigned>()) {
+                LogError() << "Received duplicate MiningReport.";
+                LogError() << "duplicate: " << state->preimage;
+                return callback(JSONRPCError("reused preimage"));
+            }
+
+            return webcash::sequencer().submit(state, callback);
         }
         >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << state->sql_audit_log_outputs << std::endl;
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
             return callback(JSONRPCError("sql error"));
         };
 }
 
-void ReportReplacement(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<ReplacementState> state,
-    std::shared_ptr<Transaction> tx
-){
-    tx->setCommitCallback([=](bool){
-        // Note that while each of these updates are atomic, the combination is
-        // not.  It is possible for a read of the field to occur inbetween the
-        // statements.  At this time this field is informational only, so that
-        // is not a concern.
-        ++(webcash::state().num_replace);
-        webcash::state().num_unspent += state->outputs.size();
-        webcash::state().num_unspent -= state->inputs.size();
-
-        if (webcash::state().logging) {
-            std::stringstream ss;
-            ss << "Replaced " << state->inputs.size()
-               << " input for " << state->outputs.size()
-               << " output (total: ₩" << to_string(state->total_in) << ")."
-               << " tx=" << webcash::state().num_replace.load()
-               << " burn=" << webcash::state().num_burn.load()
-               << " unspent=" << webcash::state().num_unspent.load()
-               << std::endl;
-            std::cout << ss.str();
-        }
-
-        Json::Value ret(objectValue);
-        ret["status"] = "success";
-        auto resp = HttpResponse::newHttpJsonResponse(std::move(ret));
-        return callback(resp);
-    });
-}
-
-//  --------------
-// | /api/v1/burn |
-//  --------------
+//  ----------------------
+// | /api/v1/health_check |
+//  ----------------------
 
-struct BurnState {
-    // The actual replacement request from the caller.
+struct HealthCheckState {
+    // The health_check request as received from the caller.
     std::shared_ptr<Json::Value> msg;
-    // The system clock time when the replace request was received by us.
-    absl::Time received = absl::UnixEpoch();
-    // The inputs webcash secrets to be burnt, as provided by the caller.
-    std::map<uint256, SecretWebcash> inputs;
-    // A straight summation over the inputs.
-    Amount total_in = Amount{0};
-    // Pre-constructed SQL statements.
-    std::string sql_check_inputs;
-    std::string sql_store_spends;
-    std::string sql_delete_inputs;
-    std::string sql_audit_log_inputs;
-    // The primary key of the Burns record for the audit log.  Used to
-    // create records in the BurnInputs one-to-many join table.
-    uint64_t burn_id = 0;
+    // The public webcash to check, deserialized.
+    std::vector<PublicWebcash> args;
+    // The hashes of the public webcash, packed as a statement parameter.
+    std::vector<char> hashes;
+    // The results of looking up the unspent outputs and spent hashes.
+    Uint256Map<Amount> unspent;
+    Uint256Set spent;
+    // With --shards, the shards which remain to be looked up in, after the
+    // one being looked up in.
+    std::vector<std::shared_ptr<DbClient>> shards;
+    // The health check's slot in webcash::limits().health_check.
+    AdmissionControl::Ticket admission;
+    // Times each stage of the health check, for /metrics.
+    StageTimer timer;
 };
 
-void CheckInputsExist(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<BurnState> state,
-    std::shared_ptr<Transaction> tx); // Calls CheckOutputsDoNotExist...
-
-void RecordSpends(
+void StartHealthCheck(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<BurnState> state,
-    std::shared_ptr<Transaction> tx); // etc.
+    std::shared_ptr<HealthCheckState> state); // Calls CheckUnspentOutputs...
 
-void RemoveInputs(
+void CheckUnspentOutputs(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<BurnState> state,
-    std::shared_ptr<Transaction> tx);
+    std::shared_ptr<HealthCheckState> state,
+    std::shared_ptr<DbClient> db); // Calls CheckSpentOutputs...
 
-void RecordToAuditLog(
+void CheckSpentOutputs(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<BurnState> state,
-    std::shared_ptr<Transaction> tx);
+    std::shared_ptr<HealthCheckState> state,
+    std::shared_ptr<DbClient> db); // Calls ReturnResults...
 
-void RecordToAuditLogInputs(
+void CheckRedisSpentHashes(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<BurnState> state,
-    std::shared_ptr<Transaction> tx);
+    std::shared_ptr<HealthCheckState> state,
+    std::vector<uint256> hashes); // Calls ReturnResults...
 
-void ReportBurn(
+void ReturnResults(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<BurnState> state,
-    std::shared_ptr<Transaction> tx); // Done
+    std::shared_ptr<HealthCheckState> state,
+    std::shared_ptr<DbClient> db); // Done
 
-void V1::burn(
+void V1::healthCheck(
     const HttpRequestPtr &req,
     std::function<void (const HttpResponsePtr &)> &&callback
 ){
     absl::Time _received = absl::Now();
-    auto state = std::make_shared<BurnState>();
-    state->received = _received;
+    static ServerMetrics::Endpoint* const endpoint = webcash::metrics().GetEndpoint("health_check");
+    callback = CountResponses(endpoint, _received, std::move(callback));
+    std::shared_ptr<HealthCheckState> state = std::make_shared<HealthCheckState>();
+    state->timer.Start(_received);
 
     state->msg = req->getJsonObject();
-    if (!state->msg || !state->msg->isObject()) {
+    if (!state->msg) {
         return callback(JSONRPCError("no JSON body"));
     }
-    if (!check_legalese(*state->msg)) {
-        return callback(JSONRPCError("didn't accept terms"));
-    }
 
-    // Extract 'inputs'
-    if (!state->msg->isMember("destroy_webcash")) {
-        return callback(JSONRPCError("no inputs"));
+    // Read input parameters as an array of webcash public string the user wants to check.
+    if (!parse_public_webcashes(*state->msg, state->args)) {
+        return callback(JSONRPCError("arguments needs to be array of webcash public webcash strings"));
     }
-    if (!parse_secret_webcashes((*state->msg)["destroy_webcash"], state->inputs)) {
-        return callback(JSONRPCError("can't parse inputs"));
+
+    // Health checks have a budget of their own, so that bulk checks can't
+    // starve replacements of connections, and are turned away while mining
+    // reports are queued.
+    static LatencyHistogram* const parse_stage = Stage("health_check", "Parse");
+    static LatencyHistogram* const admission_stage = Stage("health_check", "Admission");
+    state->timer.End(parse_stage);
+    bool admitted = webcash::limits().health_check.admit([=](AdmissionControl::Ticket ticket) {
+        state->timer.End(admission_stage);
+        state->admission = ticket;
+        StartHealthCheck(callback, state);
+    });
+    if (!admitted) {
+        return callback(OverloadedError());
     }
-    state->total_in = Amount(0);
-    std::vector<std::string> input_values_hash_with_amount;
-    std::vector<std::string> input_values_hash_only;
-    input_values_hash_with_amount.reserve(state->inputs.size());
-    input_values_hash_only.reserve(state->inputs.size());
-    for (const auto& item : state->inputs) {
-        const uint256& hash = item.first;
-        const SecretWebcash& wc = item.second;
-        state->total_in += wc.amount;
-        if (state->total_in < 1 || wc.amount < 1) {
-            return callback(JSONRPCError("overflow"));
+}
+
+void StartHealthCheck(
+    std::function<void (const HttpResponsePtr &)> callback,
+    std::shared_ptr<HealthCheckState> state
+){
+    // Once the UTXO cache is loaded, it has everything needed to answer,
+    // except for the spent hashes when they are kept in Redis.
+    if (webcash::utxos().IsReady()) {
+        std::vector<uint256> unknown;
+        for (const auto& pk : state->args) {
+            Amount amount;
+            switch (webcash::utxos().Lookup(pk.pk, amount)) {
+                case UtxoCache::Status::UNSPENT:
+                    state->unspent[pk.pk] = amount;
+                    break;
+                case UtxoCache::Status::SPENT:
+                    state->spent.insert(pk.pk);
+                    break;
+                case UtxoCache::Status::UNKNOWN:
+                    unknown.push_back(pk.pk);
+                    break;
+            }
+        }
+        if (webcash::state().redis && !unknown.empty()) {
+            return CheckRedisSpentHashes(callback, state, std::move(unknown));
         }
-        std::string hash_hex = absl::BytesToHexString(absl::string_view((char*)hash.data(), 32));
-        input_values_hash_with_amount.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea,", to_string(wc.amount.i64), ")"));
-        input_values_hash_only.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea)"));
+        return ReturnResults(callback, state, nullptr);
     }
 
-    // Prepare SQL statements
-    state->sql_check_inputs = absl::StrCat("WITH \"InputHashAmount\"(\"hash\",\"amount\") AS (VALUES", absl::StrJoin(input_values_hash_with_amount, ","), ") SELECT COUNT(1) FROM \"UnspentOutputs\" INNER JOIN \"InputHashAmount\" ON \"UnspentOutputs\".\"hash\"=\"InputHashAmount\".\"hash\" AND \"UnspentOutputs\".\"amount\"=\"InputHashAmount\".\"amount\"");
-    state->sql_store_spends = absl::StrCat("INSERT INTO \"SpentHashes\" (\"hash\") VALUES", absl::StrJoin(input_values_hash_only, ","), "ON CONFLICT DO NOTHING");
-    state->sql_delete_inputs = absl::StrCat("DELETE FROM \"UnspentOutputs\" WHERE \"hash\" IN (SELECT * FROM (VALUES", absl::StrJoin(input_values_hash_only, ","), ") AS hashes)");
-    state->sql_audit_log_inputs = absl::StrCat("INSERT INTO \"BurnInputs\" (\"burn_id\", \"hash\", \"amount\") SELECT $1, * FROM (VALUES", absl::StrJoin(input_values_hash_with_amount, ","), ") AS inputs");
+    if (webcash::state().storage) {
+        std::vector<uint256> hashes;
+        for (const auto& pk : state->args) {
+            hashes.push_back(pk.pk);
+        }
+        return webcash::state().storage->Lookup(std::move(hashes), [=](const std::string& status, const Uint256Map<Amount>& unspent, const Uint256Set& spent) {
+            if (status != "success") {
+                return callback(JSONRPCError(status));
+            }
+            state->unspent = unspent;
+            state->spent = spent;
+            ReturnResults(callback, state, nullptr);
+        });
+    }
 
-    // Now we perform checks that require access to global state.
-    auto db = drogon::app().getDbClient();
+    // The lookups don't need to be answered by the primary.  With --shards,
+    // they are made on each shard in turn.
+    auto db = webcash::replicas().getDbClient();
+    if (webcash::shards().size()) {
+        for (size_t i = webcash::shards().size(); i-- > 0; ) {
+            state->shards.push_back(webcash::shards().getDbClient(i));
+        }
+        db = state->shards.back();
+        state->shards.pop_back();
+    }
     if (!db) {
         return callback(JSONRPCError("error getting connection to database"));
     }
-    auto tx = db->newTransaction();
-    if (!tx) {
-        return callback(JSONRPCError("error creating database transaction"));
+
+    state->hashes.reserve(32 * state->args.size());
+    for (const auto& pk : state->args) {
+        state->hashes.insert(state->hashes.end(), (const char*)pk.pk.begin(), (const char*)pk.pk.end());
     }
 
-    return CheckInputsExist(callback, state, tx);
+    CheckUnspentOutputs(callback, state, db);
 }
 
-void CheckInputsExist(
+void CheckUnspentOutputs(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<BurnState> state,
-    std::shared_ptr<Transaction> tx
+    std::shared_ptr<HealthCheckState> state,
+    std::shared_ptr<DbClient> db
 ){
-    *tx << state->sql_check_inputs
-        >> [=](const Result &r) {
-            if (r.empty() || !r[0].size()) {
-                std::cerr << "error: Expected one row of one column containing count.  Got something else." << std::endl;
-                std::cerr << "error: Offending SQL: " << state->sql_check_inputs << std::endl;
-                tx->rollback();
-                return callback(JSONRPCError("sql error"));
-            }
-
-            unsigned found = r[0][0].as<unsigned>();
-            if (found != state->inputs.size()) {
-                std::cerr << "error: One or more specified input values not found in database." << std::endl;
-                std::cerr << "error: only " << to_string(found) << " of " << to_string(state->inputs.size()) << " inputs are valid." << std::endl;
-                tx->rollback();
-                return callback(JSONRPCError("input(s) not found"));
+    static LatencyHistogram* const stage = Stage("health_check", "CheckUnspentOutputs");
+    static const std::string sql = "SELECT \"hash\", \"amount\" FROM \"UnspentOutputs\" WHERE \"hash\" = ANY(unpack_hashes($1))";
+    *db << sql
+        << state->hashes
+        >> [=](const Result &result) {
+            state->timer.End(stage);
+            for (const auto& row : result) {
+                if (row.size() != 2) {
+                    LogError() << "Expected two columns per row.  Got " << row.size() << ".";
+                    LogError() << "Offending SQL: " << sql;
+                    return callback(JSONRPCError("sql error"));
+                }
+                if (row[0].length() != 32) {
+                    LogError() << "Expected 32-byte hash in first column.  Got " << row[0].length() << " bytes.";
+                    LogError() << "Offending SQL: " << sql;
+                    return callback(JSONRPCError("sql error"));
+                }
+                std::string hash_bytes = row[0].as<std::string>();
+                uint256 hash;
+                std::copy((unsigned char*)hash_bytes.c_str(),
+                          (unsigned char*)hash_bytes.c_str() + 32,
+                          hash.data());
+                state->unspent[hash] = Amount(row[1].as<uint64_t>());
             }
-
-            return RecordSpends(callback, state, tx);
+            return CheckSpentOutputs(callback, state, db);
         }
         >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << state->sql_check_inputs << std::endl;
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
             return callback(JSONRPCError("sql error"));
         };
 }
 
-void RecordSpends(
+void CheckSpentOutputs(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<BurnState> state,
-    std::shared_ptr<Transaction> tx
+    std::shared_ptr<HealthCheckState> state,
+    std::shared_ptr<DbClient> db
 ){
-    *tx << state->sql_store_spends
-        >> [=](const Result &r) {
-            RemoveInputs(callback, state, tx);
+    static LatencyHistogram* const stage = Stage("health_check", "CheckSpentOutputs");
+    if (webcash::state().redis) {
+        if (!state->shards.empty()) {
+            auto next = state->shards.back();
+            state->shards.pop_back();
+            return CheckUnspentOutputs(callback, state, next);
         }
-        >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << state->sql_store_spends << std::endl;
-            return callback(JSONRPCError("sql error"));
-        };
-}
-
-void RemoveInputs(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<BurnState> state,
-    std::shared_ptr<Transaction> tx
-){
-    *tx << state->sql_delete_inputs
-        >> [=](const Result &r) {
-            RecordToAuditLog(callback, state, tx);
+        std::vector<uint256> hashes;
+        for (const auto& pk : state->args) {
+            if (!state->unspent.count(pk.pk)) {
+                hashes.push_back(pk.pk);
+            }
         }
-        >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << state->sql_delete_inputs << std::endl;
-            return callback(JSONRPCError("sql error"));
-        };
-}
+        if (hashes.empty()) {
+            return ReturnResults(callback, state, db);
+        }
+        return CheckRedisSpentHashes(callback, state, std::move(hashes));
+    }
 
-void RecordToAuditLog(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<BurnState> state,
-    std::shared_ptr<Transaction> tx
-){
-    static const std::string sql = absl::StrCat("INSERT INTO \"Burns\" (\"received\") VALUES($1) RETURNING \"id\"");
-    *tx << sql
-        << absl::ToUnixNanos(state->received)
-        >> [=](const Result &r) {
-            if (r.empty() || !r[0].size() || !(state->burn_id = r[0][0].as<uint64_t>())) {
-                std::cerr << "error: Expected one row of one column containing inserted id.  Got something else." << std::endl;
-                std::cerr << "error: Offending SQL: " << sql << std::endl;
-                tx->rollback();
-                return callback(JSONRPCError("sql error"));
+    static const std::string sql = "SELECT \"hash\" FROM \"SpentHashes\" WHERE \"hash\" = ANY(unpack_hashes($1))";
+    *db << sql
+        << state->hashes
+        >> [=](const Result &result) {
+            state->timer.End(stage);
+            for (const auto& row : result) {
+                if (row.size() != 1) {
+                    LogError() << "Expected one columns per row.  Got " << row.size() << ".";
+                    LogError() << "Offending SQL: " << sql;
+                    return callback(JSONRPCError("sql error"));
+                }
+                if (row[0].length() != 32) {
+                    LogError() << "Expected 32-byte hash in first column.  Got " << row[0].length() << " bytes.";
+                    LogError() << "Offending SQL: " << sql;
+                    return callback(JSONRPCError("sql error"));
+                }
+                std::string hash_bytes = row[0].as<std::string>();
+                uint256 hash;
+                std::copy((unsigned char*)hash_bytes.c_str(),
+                          (unsigned char*)hash_bytes.c_str() + 32,
+                          hash.data());
+                state->spent.insert(hash);
             }
-            RecordToAuditLogInputs(callback, state, tx);
+            if (!state->shards.empty()) {
+                auto next = state->shards.back();
+                state->shards.pop_back();
+                return CheckUnspentOutputs(callback, state, next);
+            }
+            return ReturnResults(callback, state, db);
         }
         >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << sql << std::endl;
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
             return callback(JSONRPCError("sql error"));
         };
 }
 
-void RecordToAuditLogInputs(
+void CheckRedisSpentHashes(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<BurnState> state,
-    std::shared_ptr<Transaction> tx
+    std::shared_ptr<HealthCheckState> state,
+    std::vector<uint256> hashes
 ){
-    *tx << state->sql_audit_log_inputs
-        << state->burn_id
-        >> [=](const Result &r) {
-            ReportBurn(callback, state, tx);
-        }
-        >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << state->sql_audit_log_inputs << std::endl;
-            return callback(JSONRPCError("sql error"));
-        };
+    static LatencyHistogram* const stage = Stage("health_check", "CheckRedisSpentHashes");
+    const std::string cmd = RedisSpentHashesCommand("SMISMEMBER", hashes);
+    webcash::state().redis->execCommandAsync(
+        [=](const RedisResult &r) {
+            state->timer.End(stage);
+            if (r.type() != RedisResultType::kArray) {
+                LogError() << "Expected array reply.  Got something else.";
+                LogError() << "Offending Redis command: SMISMEMBER " << k_redis_spent_hashes << " ...";
+                return callback(JSONRPCError("redis error"));
+            }
+            const std::vector<RedisResult> members = r.asArray();
+            if (members.size() != hashes.size()) {
+                LogError() << "Expected " << hashes.size() << " members in reply.  Got " << members.size() << ".";
+                LogError() << "Offending Redis command: SMISMEMBER " << k_redis_spent_hashes << " ...";
+                return callback(JSONRPCError("redis error"));
+            }
+            for (size_t i = 0; i < hashes.size(); ++i) {
+                if (members[i].type() == RedisResultType::kInteger && members[i].asInteger()) {
+                    state->spent.insert(hashes[i]);
+                }
+            }
+            return ReturnResults(callback, state, nullptr);
+        },
+        [=](const RedisException &e) {
+            LogError() << e.what();
+            LogError() << "Offending Redis command: SMISMEMBER " << k_redis_spent_hashes << " ...";
+            return callback(JSONRPCError("redis error"));
+        },
+        cmd);
 }
 
-void ReportBurn(
+void ReturnResults(
     std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<BurnState> state,
-    std::shared_ptr<Transaction> tx
-){
-    tx->setCommitCallback([=](bool){
-        // Note that while each of these updates are atomic, the combination is
-        // not.  It is possible for a read of the field to occur inbetween the
-        // statements.  At this time this field is informational only, so that
-        // is not a concern.
-        ++(webcash::state().num_burn);
-        webcash::state().num_unspent -= state->inputs.size();
-        webcash::state().total_destroyed += state->total_in.i64;
-
-        if (webcash::state().logging) {
-            std::stringstream ss;
-            ss << "Burned " << state->inputs.size()
-               << " input (total: ₩" << to_string(state->total_in) << ")."
-               << " tx=" << webcash::state().num_replace.load()
-               << " burn=" << webcash::state().num_burn.load()
-               << " unspent=" << webcash::state().num_unspent.load()
-               << std::endl;
-            std::cout << ss.str();
-        }
-
-        Json::Value ret(objectValue);
-        ret["status"] = "success";
-        auto resp = HttpResponse::newHttpJsonResponse(std::move(ret));
-        return callback(resp);
-    });
-}
-
-//  ----------------
-// | /api/v1/target |
-//  ----------------
-
-void V1::target(
-    const HttpRequestPtr &req,
-    std::function<void (const HttpResponsePtr &)> &&callback
+    std::shared_ptr<HealthCheckState> state,
+    std::shared_ptr<DbClient> db
 ){
-    WebcashStats stats = webcash::state().getStats(absl::Now());
-
-    Json::Value ret(objectValue);
-    ret["difficulty_target_bits"] = stats.difficulty;
-    ret["epoch"] = static_cast<int>(stats.epoch);
-    ret["mining_amount"] = to_string(stats.mining_amount);
-    ret["mining_subsidy_amount"] = to_string(stats.subsidy_amount);
-    if (stats.total_circulation > 0 && stats.expected_circulation > 0) {
-        ret["ratio"] = static_cast<double>(stats.total_circulation) / static_cast<double>(stats.expected_circulation);
-    } else {
-        ret["ratio"] = 1.0; // To avoid transient errors on startup
+    Json::Value results(objectValue);
+    for (size_t i = 0; i < state->args.size(); ++i) {
+        Json::Value status(objectValue);
+        auto unspent = state->unspent.find(state->args[i].pk);
+        if (unspent != state->unspent.end()) {
+            status["spent"] = false;
+            status["amount"] = to_string(unspent->second);
+        } else if (state->spent.find(state->args[i].pk) != state->spent.end()) {
+            status["spent"] = true;
+        } else {
+            // This is a bit obscure, but it matches the current server
+            // behavior.  A never-seen webcash is indicated by a nullary
+            // "spent" value.
+            status["spent"] = Json::Value(nullValue);
+        }
+        // Use the original input as the key, so that the user is able
+        // to find the record even if they sent a non-canonical encoding
+        // (e.g. different hex capitalization).
+        results[state->msg->get(i, to_string(state->args[i])).asString()] = status;
     }
 
+    Json::Value ret(objectValue);
+    ret["status"] = "success";
+    ret["results"] = results;
     auto resp = HttpResponse::newHttpJsonResponse(std::move(ret));
-    resp->setExpiredTime(k_target_cache_expiry);
     callback(resp);
 }
+} // namespace api
 
-//  -----------------------
-// | /api/v1/mining_report |
-//  -----------------------
-
-// Contains intermediate state for processing a MiningReport submission request.
-struct MiningReportState {
-    // The system clock time at which the request was received.
-    absl::Time received;
-    // The base64-encoded mining report as received from the caller.
-    std::string preimage;
-    // The sha256 hash of the preimage. (cached)
-    uint256 hash;
-    // The actual number of leading zero bits of the hash. (cached)
-    unsigned bits;
-    // If the parsed preimage contains a "difficulty" field, and its value.
-    bool has_difficulty = false;
-    unsigned difficulty = 0;
-    // If the parsed preimage contains a "timestamp" field, and its value.
-    bool has_timestamp = false;
-    absl::Time timestamp = absl::UnixEpoch();
-    // The "webcash" and "subsidy" fields of the preimage, indexed by public hash.
-    std::map<uint256, SecretWebcash> webcash;
-    std::map<uint256, SecretWebcash> subsidy;
-    // The calculated sum of the webcash and subsidy arrays. (cached)
-    Amount webcash_sum = Amount{0};
-    Amount subsidy_sum = Amount{0};
-    // Pre-constructed SQL statements.
-    std::vector<uint256> to_check;
-    std::string sql_check_outputs;
-    std::string sql_insert_outputs;
-    // The fields of the last MiningReport received by the server, which is
-    // needed for difficulty adjustment and calculating this report's aggregate
-    // fields.  Obviosuly these values can't be known until the transaction is
-    // started.
-    bool has_last_report = false;
-    unsigned num_reports = 0;
-    absl::Time last_received = absl::UnixEpoch();
-    unsigned last_difficulty = 0;
-    unsigned current_difficulty = 0;
-    double last_aggregate_work = 0.0;
+//  -------------------------------
+// | mining report sequencing      |
+//  -------------------------------
+
+struct MiningReportSequencer::Batch {
+    // The reports of the batch, in sequence.
+    std::vector<Pending> reports;
+    // The tip after the last report of the batch.
+    MiningReportTip tip;
+    // The outputs of all of the reports, packed as statement parameters.
+    std::vector<char> output_hashes;
+    std::string output_amounts;
+    // The fields of the MiningReports records, as BIGINT[], TEXT[],
+    // SMALLINT[], SMALLINT[] and DOUBLE PRECISION[] parameters.
+    std::string received;
+    std::string preimages;
+    std::vector<char> preimage_hashes;
+    std::string difficulties;
+    std::string next_difficulties;
+    std::string aggregate_works;
 };
 
-// The async function for validating and recording a mining report.  Each
-// function takes the state as input, and makes an asynchronous call to the
-// database.  It then processes the results and calls the next function in
-// sequence.
-void SelectLastMiningReport(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<MiningReportState> state,
-    std::shared_ptr<Transaction> tx); // Calls CheckNewMiningReportPreimage...
-
-void CheckNewMiningReportPreimage(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<MiningReportState> state,
-    std::shared_ptr<Transaction> tx); // Calls CheckOutputsDoNotExist...
-
-void CheckOutputsDoNotExist(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<MiningReportState> state,
-    std::shared_ptr<Transaction> tx); // etc.
-
-void CreateOutputs(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<MiningReportState> state,
-    std::shared_ptr<Transaction> tx);
-
-void RecordMiningReport(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<MiningReportState> state,
-    std::shared_ptr<Transaction> tx);
+// Append a value to a Postgres array literal under construction, which is
+// closed by EndArray.
+static void AppendToArray(std::string& array, absl::string_view value)
+{
+    array.push_back(array.empty() ? '{' : ',');
+    array.append(value.data(), value.size());
+}
 
-void ReportSolution(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<MiningReportState> state,
-    std::shared_ptr<Transaction> tx); // Done
+static void EndArray(std::string& array)
+{
+    if (array.empty()) {
+        array.push_back('{');
+    }
+    array.push_back('}');
+}
 
-void V1::miningReport(
-    const HttpRequestPtr &req,
-    std::function<void (const HttpResponsePtr &)> &&callback
+// Checks a mining report against the tip of the chain, and also against the
+// reports which precede it in the same batch, whose preimages and outputs have
+// been collected.  On success the tip is advanced past the report.  Otherwise
+// returns the error to report to the caller.
+static std::string SequenceMiningReport(
+    api::MiningReportState& state,
+    MiningReportTip& tip,
+    std::set<std::string>& preimages,
+    Uint256Set& outputs
 ){
-    absl::Time _received = absl::Now();
-    auto state = std::make_shared<MiningReportState>();
-    state->received = _received;
+    state.current_difficulty = tip.difficulty;
 
-    auto maybe_msg = req->getJsonObject();
-    if (!maybe_msg || !maybe_msg->isObject()) {
-        return callback(JSONRPCError("no JSON body"));
-    }
-    auto msg = *maybe_msg;
-    if (!check_legalese(msg)) {
-        return callback(JSONRPCError("didn't accept terms"));
+    // Check committed difficulty meets current difficulty
+    if (state.has_difficulty && state.difficulty < state.current_difficulty) {
+        LogError() << "Committed difficulty is less than current difficulty.";
+        LogError() << "difficulty=" << state.difficulty << " current_difficulty=" << state.current_difficulty;
+        return "committed difficulty is less than current difficulty";
     }
 
-    // Extract base64-encoded preimage
-    if (!msg.isMember("preimage") || !msg["preimage"].isString()) {
-        return callback(JSONRPCError("missing preimage"));
-    }
-    state->preimage = msg["preimage"].asString();
-    std::string preimage_str;
-    if (!absl::Base64Unescape(state->preimage, &preimage_str)) {
-        return callback(JSONRPCError("preimage is not base64-encoded string"));
+    // Check proof-of-work meets difficulty
+    if (state.bits < state.current_difficulty) {
+        // Not necessarily an error--perhaps the difficulty changed?
+        LogError() << "Proof of work doesn't meet current difficulty.";
+        LogError() << "bits=" << state.bits << " current_difficulty=" << state.current_difficulty;
+        return "proof of work doesn't meet current difficulty";
     }
 
-    Json::CharReaderBuilder builder {};
-    auto reader = std::unique_ptr<Json::CharReader>(builder.newCharReader());
-    Json::Value preimage;
-    std::string errors;
-    if (!reader->parse(preimage_str.c_str(), preimage_str.c_str() + preimage_str.length(), &preimage, &errors)) {
-        return callback(JSONRPCError("couldn't parse preimage as JSON"));
+    // Check outputs sum to expected value
+    Amount expected = webcash::state().getMiningAmount(tip.num_reports);
+    if (state.webcash_sum != expected) {
+        LogError() << "Webcash in mining report doesn't sum to expected amount.";
+        LogError() << "actual=" << to_string(state.webcash_sum) << " expected=" << to_string(expected);
+        return "outputs don't match allowed amount";
     }
 
-    // Read 'webcash', the array of webcash claim codes generated by this miner.
-    if (!preimage.isMember("webcash")) {
-        return callback(JSONRPCError("missing 'webcash' field in preimage"));
-    }
-    if (!parse_secret_webcashes(preimage["webcash"], state->webcash)) {
-        return callback(JSONRPCError("'webcash' field in preimage needs to be array of webcash secrets"));
+    // Check subsidy sums to expected value
+    expected = webcash::state().getSubsidyAmount(tip.num_reports);
+    if (state.subsidy_sum != expected) {
+        LogError() << "Subsidy in mining report doesn't match expected amount.";
+        LogError() << "actual=" << to_string(state.subsidy_sum) << " expected=" << to_string(expected);
+        return "subsidy doesn't match required amount";
     }
 
-    // Read 'subsidy', the array of webcash claim codes given to the server
-    if (!preimage.isMember("subsidy")) {
-        return callback(JSONRPCError("missing 'subsidy' field in peimage"));
-    }
-    if (!parse_secret_webcashes(preimage["subsidy"], state->subsidy)) {
-        return callback(JSONRPCError("'subsidy' field in preimage needs to be array of webcash secrets"));
+    // Check against the earlier reports of the batch.  Duplicates of records
+    // already in the database are found when the batch is recorded.
+    if (preimages.count(state.preimage)) {
+        LogError() << "Received duplicate MiningReport.";
+        LogError() << "duplicate: " << state.preimage;
+        return "reused preimage";
     }
-
-    // Read 'timestamp'
-    if (preimage.isMember("timestamp")) {
-        if (!preimage["timestamp"].isConvertibleTo(Json::realValue)) {
-            return callback(JSONRPCError("'timestamp' field in preimage must be numeric"));
+    for (const auto& item : state.webcash) {
+        if (outputs.count(item.pk)) {
+            LogError() << "MiningReport contains existing output.  Cowardly refusing to overwrite.";
+            return "output(s) already exists";
         }
-        state->timestamp = absl::FromUnixSeconds(static_cast<int64_t>(preimage["timestamp"].asDouble()));
-        state->has_timestamp = true;
+    }
+    preimages.insert(state.preimage);
+    for (const auto& item : state.webcash) {
+        outputs.insert(item.pk);
     }
 
-    // Read 'difficulty'
-    if (preimage.isMember("difficulty")) {
-        if (!preimage["difficulty"].isConvertibleTo(Json::uintValue)) {
-            return callback(JSONRPCError("'difficulty' field in preimage must be small positive integer"));
+    // Calculate the aggregate work and the difficulty required of the next
+    // report.
+    absl::uint128 work = 1;
+    work <<= state.current_difficulty;
+    state.aggregate_work = tip.aggregate_work + static_cast<double>(work);
+
+    state.next_difficulty = state.current_difficulty;
+    unsigned num_reports = tip.num_reports + 1;
+    if ((num_reports % WebcashEconomy::k_reports_per_interval) == 0) {
+        size_t look_back_window = WebcashEconomy::k_look_back_window;
+        if (num_reports == look_back_window) {
+            --look_back_window;
         }
-        state->difficulty = preimage["difficulty"].asUInt();
-        if (state->difficulty > 255) {
-            return callback(JSONRPCError("'difficulty' field in preimage is too high"));
+        absl::uint128 total_circulation = webcash::state().getTotalCirculation(tip.num_reports);
+        absl::uint128 expected_circulation = webcash::state().getExpectedCirculation(state.received);
+        absl::Duration expected = look_back_window * absl::Seconds(10);
+        absl::Duration actual = state.received - tip.last_received;
+        if (actual <= expected && expected_circulation <= total_circulation) {
+            // We're early and we're ahead of the issuance curve
+            ++state.next_difficulty;
+        }
+        if (expected <= actual && total_circulation <= expected_circulation) {
+            // We're late and we're behind the issuance curve
+            --state.next_difficulty;
         }
-        state->has_difficulty = true;
     }
 
-    // Check 'webcash'
-    state->webcash_sum = Amount{0};
-    std::vector<std::string> output_values_with_amount;
-    std::vector<std::string> output_values_hash_only;
-    output_values_with_amount.reserve(state->webcash.size());
-    output_values_hash_only.reserve(state->webcash.size());
-    for (const auto& item : state->webcash) {
-        state->webcash_sum += item.second.amount;
-        if (state->webcash_sum < 1 || item.second.amount < 1) {
-            return callback(JSONRPCError("overflow"));
+    tip.num_reports = num_reports;
+    tip.last_received = state.received;
+    tip.last_difficulty = state.current_difficulty;
+    tip.difficulty = state.next_difficulty;
+    tip.aggregate_work = state.aggregate_work;
+    return "";
+}
+
+void MiningReportSequencer::reset(const MiningReportTip& tip)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->tip = tip;
+}
+
+MiningReportTip MiningReportSequencer::getTip() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return tip;
+}
+
+void MiningReportSequencer::submit(
+    std::shared_ptr<api::MiningReportState> state,
+    std::function<void (const HttpResponsePtr &)> callback
+){
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back({state, callback});
+        if (busy) {
+            // Picked up by the batch after the one being recorded.
+            return;
         }
-        const std::string hash_hex = absl::BytesToHexString(absl::string_view((char*)item.first.data(), 32));
-        output_values_with_amount.push_back(absl::StrCat("('\\x", hash_hex, "'::bytea,", to_string(item.second.amount.i64), ")"));
-        output_values_hash_only.push_back(absl::StrCat("'\\x", hash_hex, "'::bytea"));
+        busy = true;
     }
+    runBatch();
+}
 
-    // Check 'subsidy'
-    state->subsidy_sum = Amount{0};
-    for (const auto& item : state->subsidy) {
-        state->subsidy_sum += item.second.amount;
-        if (state->subsidy_sum < 1 || item.second.amount < 1) {
-            return callback(JSONRPCError("overflow"));
+void MiningReportSequencer::runBatch()
+{
+    while (true) {
+        std::vector<Pending> pending;
+        MiningReportTip tip;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (queue.empty()) {
+                busy = false;
+                return;
+            }
+            while (!queue.empty() && pending.size() < k_max_batch_size) {
+                pending.push_back(std::move(queue.front()));
+                queue.pop_front();
+            }
+            tip = this->tip;
         }
-        auto itr = state->webcash.find(item.first);
-        if (itr == state->webcash.end()) {
-            return callback(JSONRPCError("missing subsidy from webcash"));
+
+        static LatencyHistogram* const stage = webcash::metrics().GetStage("mining_report", "SequenceMiningReport");
+        auto batch = std::make_shared<Batch>();
+        std::set<std::string> preimages;
+        Uint256Set outputs;
+        for (Pending& report : pending) {
+            // Charges the time spent queued for the sequencer.
+            report.state->timer.End(stage);
+            std::string error = SequenceMiningReport(*report.state, tip, preimages, outputs);
+            if (!error.empty()) {
+                report.callback(JSONRPCError(error));
+                continue;
+            }
+            batch->reports.push_back(std::move(report));
         }
-        if (itr->second.amount != item.second.amount) {
-            return callback(JSONRPCError("subsidy doesn't match webcash"));
+        if (batch->reports.empty()) {
+            continue;
         }
-    }
-    if (state->webcash.size() < state->subsidy.size() || state->webcash_sum < state->subsidy_sum) {
-        return callback(JSONRPCError("internal server error")); // should have failed above
-    }
-
-    // Check 'timestamp', if present
-    if (state->has_timestamp) {
-        absl::Time min_time = state->received - absl::Hours(2);
-        absl::Time max_time = state->received + absl::Hours(2);
-        if (state->timestamp < min_time || max_time < state->timestamp) {
-            return callback(JSONRPCError("timestamp of mining report must be within 2 hours of receipt by server"));
+        batch->tip = tip;
+
+        std::string amounts;
+        for (const Pending& report : batch->reports) {
+            const api::MiningReportState& state = *report.state;
+            batch->output_hashes.insert(batch->output_hashes.end(), state.output_hashes.begin(), state.output_hashes.end());
+            // Strip the braces from the report's BIGINT[] of amounts.
+            if (state.output_amounts.size() > 2) {
+                AppendToArray(amounts, absl::string_view(state.output_amounts).substr(1, state.output_amounts.size() - 2));
+            }
+            AppendToArray(batch->received, absl::StrCat(absl::ToUnixNanos(state.received)));
+            // Base64 contains neither quotes nor backslashes, but the preimage
+            // is only known to be accepted by the decoder.
+            std::string preimage = "\"";
+            for (char c : state.preimage) {
+                if (c == '"' || c == '\\') {
+                    preimage.push_back('\\');
+                }
+                preimage.push_back(c);
+            }
+            preimage.push_back('"');
+            AppendToArray(batch->preimages, preimage);
+            batch->preimage_hashes.insert(batch->preimage_hashes.end(), (const char*)state.hash.begin(), (const char*)state.hash.end());
+            AppendToArray(batch->difficulties, absl::StrCat(state.current_difficulty));
+            AppendToArray(batch->next_difficulties, absl::StrCat(state.next_difficulty));
+            char work[32];
+            snprintf(work, sizeof(work), "%.17g", state.aggregate_work);
+            AppendToArray(batch->aggregate_works, work);
         }
+        EndArray(amounts);
+        batch->output_amounts = std::move(amounts);
+        EndArray(batch->received);
+        EndArray(batch->preimages);
+        EndArray(batch->difficulties);
+        EndArray(batch->next_difficulties);
+        EndArray(batch->aggregate_works);
+
+        return recordBatch(batch);
     }
+}
 
-    // Calculate proof-of-work
-    CSHA256().Write((unsigned char*)state->preimage.c_str(), state->preimage.length()).Finalize(state->hash.data());
-    state->bits = get_apparent_difficulty(state->hash);
-    if (state->bits < 25) { // DoS prevention
-        return callback(JSONRPCError("difficulty too low"));
+void MiningReportSequencer::failBatch(std::shared_ptr<Batch> batch, const std::string& error)
+{
+    for (const Pending& report : batch->reports) {
+        report.callback(JSONRPCError(error));
     }
+    runBatch();
+}
 
-    // Check 'difficulty', if present
-    if (state->has_difficulty) {
-        if (state->bits < state->difficulty) {
-            return callback(JSONRPCError("proof-of-work doesn't match committed difficulty"));
+// Outputs or preimages which already exist are skipped rather than raising an
+// error, so that the reports containing them can be identified from what was
+// actually inserted.
+static const std::string k_sql_record_outputs = "INSERT INTO \"UnspentOutputs\" (\"hash\", \"amount\") SELECT * FROM unnest(unpack_hashes($1), $2::BIGINT[]) ON CONFLICT DO NOTHING RETURNING \"hash\"";
+
+// Reads the hashes returned by k_sql_record_outputs.
+static bool ReadCreatedOutputs(const Result& r, Uint256Set& created)
+{
+    for (const auto& row : r) {
+        std::string hash_bytes = row[0].as<std::string>();
+        if (hash_bytes.size() != 32) {
+            LogError() << "Expected 32-byte hash in first column.  Got " << hash_bytes.size() << " bytes.";
+            LogError() << "Offending SQL: " << k_sql_record_outputs;
+            return false;
         }
+        uint256 hash;
+        std::copy((unsigned char*)hash_bytes.c_str(),
+                  (unsigned char*)hash_bytes.c_str() + 32,
+                  hash.data());
+        created.insert(hash);
     }
+    return true;
+}
 
-    // Preconstruct SQL queries.
-    state->sql_check_outputs = absl::StrCat("SELECT COUNT(1) FROM \"UnspentOutputs\" WHERE \"hash\" IN (", absl::StrJoin(output_values_hash_only, ","), ")");
-    state->sql_insert_outputs = absl::StrCat("INSERT INTO \"UnspentOutputs\" (\"hash\", \"amount\") VALUES", absl::StrJoin(output_values_with_amount, ","));
-
-    // Now we perform checks that require access to global state.
+void MiningReportSequencer::recordBatch(std::shared_ptr<Batch> batch)
+{
+    if (webcash::state().storage) {
+        return recordBatchInStorage(batch);
+    }
     auto db = drogon::app().getDbClient();
     if (!db) {
-        return callback(JSONRPCError("error getting connection to database"));
+        return failBatch(batch, "error getting connection to database");
     }
     auto tx = db->newTransaction();
     if (!tx) {
-        return callback(JSONRPCError("error creating database transaction"));
+        return failBatch(batch, "error creating database transaction");
     }
 
-    return SelectLastMiningReport(callback, state, tx);
-}
-
-void SelectLastMiningReport(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<MiningReportState> state,
-    std::shared_ptr<Transaction> tx
-){
-    static const std::string sql = "SELECT \"received\", \"difficulty\", \"next_difficulty\", \"aggregate_work\" FROM \"MiningReports\" ORDER BY \"id\" DESC LIMIT 1";
-    *tx << sql
-        >> [=](bool is_null, int64_t received, unsigned difficulty, unsigned next_difficulty, double aggregate_work) {
-            if (!is_null) {
-                if (state->has_last_report) {
-                    std::cerr << "error: More than two rows returned?  Something is very broken." << std::endl;
-                    std::cerr << "error: Offending SQL: " << sql << std::endl;
-                    tx->rollback();
-                    return callback(JSONRPCError("logic error"));
-                }
-                if (difficulty > 255 || next_difficulty > 255 || aggregate_work < 0.0) {
-                    std::cerr << "error: Last MiningReport record contains nonsense values.  Database corruption?" << std::endl;
-                    std::cerr << "error: difficulty=" << difficulty << " next_difficulty=" << next_difficulty << " aggregate_work=" << aggregate_work << std::endl;
-                    tx->rollback();
-                    return callback(JSONRPCError("database error"));
-                }
-                state->last_received = absl::FromUnixNanos(received);
-                state->last_difficulty = difficulty;
-                state->current_difficulty = next_difficulty;
-                state->last_aggregate_work = aggregate_work;
-                state->has_last_report = true;
-            } else {
-                if (!state->has_last_report) {
-                    // No MiningReport records yet, so fill with default
-                    // values for the first report.
-                    state->last_difficulty = 0;
-                    state->current_difficulty = 28;
-                    state->last_aggregate_work = 0.0;
-                    state->has_last_report = true;
-                }
-
-                // Check committed difficulty meets current difficulty
-                if (state->has_difficulty && state->difficulty < state->current_difficulty) {
-                    std::cerr << "error: Committed difficulty is less than current difficulty." << std::endl;
-                    std::cerr << "error: difficulty=" << state->difficulty << " current_difficulty=" << state->current_difficulty << std::endl;
-                    tx->rollback();
-                    return callback(JSONRPCError("committed difficulty is less than current difficulty"));
-                }
-
-                // Check proof-of-work meets difficulty
-                if (state->bits < state->current_difficulty) {
-                    // Not necessarily an error--perhaps the difficulty changed?
-                    std::cerr << "error: Proof of work doesn't meet current difficulty." << std::endl;
-                    std::cerr << "error: bits=" << state->bits << " current_difficulty=" << state->current_difficulty << std::endl;
-                    tx->rollback();
-                    return callback(JSONRPCError("proof of work doesn't meet current difficulty"));
-                }
-
-                return CheckNewMiningReportPreimage(callback, state, tx);
+    if (webcash::shards().size()) {
+        return recordOutputsOnShards(batch, tx);
+    }
+    *tx << k_sql_record_outputs
+        << batch->output_hashes
+        << batch->output_amounts
+        >> [=](const Result &r) {
+            Uint256Set created;
+            if (r.size() != batch->output_hashes.size() / 32 && !ReadCreatedOutputs(r, created)) {
+                tx->rollback();
+                return failBatch(batch, "sql error");
             }
+            recordReports(batch, tx, {}, r.size(), created);
         }
         >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << sql << std::endl;
-            return callback(JSONRPCError("sql error"));
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << k_sql_record_outputs;
+            return failBatch(batch, "sql error");
         };
 }
 
-void SelectNumMiningReports(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<MiningReportState> state,
-    std::shared_ptr<Transaction> tx
-){
-    static const std::string sql = "SELECT COUNT(1) FROM \"MiningReports\"";
-    *tx << sql
-        >> [=](const Result& r) {
-            if (r.empty() || !r[0].size()) {
-                std::cerr << "error: Expected one row of one column containing count.  Got something else." << std::endl;
-                std::cerr << "error: Offending SQL: " << sql << std::endl;
-                tx->rollback();
-                return callback(JSONRPCError("sql error"));
-            }
-
-            // Record the number of mining reports for future use.
-            state->num_reports = r[0][0].as<unsigned>();
-            return CheckNewMiningReportPreimage(callback, state, tx);
+void MiningReportSequencer::recordBatchInStorage(std::shared_ptr<Batch> batch)
+{
+    std::vector<Storage::MiningReport> reports;
+    reports.reserve(batch->reports.size());
+    for (const Pending& pending : batch->reports) {
+        const api::MiningReportState& state = *pending.state;
+        Storage::MiningReport report;
+        report.received = state.received;
+        report.preimage = state.preimage;
+        report.preimage_hash = state.hash;
+        report.difficulty = state.current_difficulty;
+        report.next_difficulty = state.next_difficulty;
+        report.aggregate_work = state.aggregate_work;
+        report.outputs = state.webcash;
+        reports.push_back(std::move(report));
+    }
+    webcash::state().storage->RecordMiningReports(std::move(reports), [=](const std::string& status, const std::map<size_t, std::string>& rejected) {
+        if (status != "success") {
+            return failBatch(batch, status);
         }
-        >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << sql << std::endl;
-            return callback(JSONRPCError("sql error"));
-        };
+        if (!rejected.empty()) {
+            return retryBatch(batch, rejected);
+        }
+        finishBatch(batch, true);
+    });
 }
 
-void CheckNewMiningReportPreimage(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<MiningReportState> state,
-    std::shared_ptr<Transaction> tx
-){
-    static const std::string sql = "SELECT COUNT(1) FROM \"MiningReports\" WHERE \"preimage\"=$1";
-    *tx << sql
-        << state->preimage
-        >> [=](const Result &r) {
-            if (r.empty() || !r[0].size()) {
-                std::cerr << "error: Expected one row of one column containing count.  Got something else." << std::endl;
-                std::cerr << "error: Offending SQL: " << sql << std::endl;
-                tx->rollback();
-                return callback(JSONRPCError("sql error"));
-            }
-
-            if (r[0][0].as<unsigned>()) {
-                std::cerr << "error: Received duplicate MiningReport." << std::endl;
-                std::cerr << "error: duplicate: " << state->preimage << std::endl;
-                tx->rollback();
-                return callback(JSONRPCError("reused preimage"));
-            }
+void MiningReportSequencer::recordOutputsOnShards(std::shared_ptr<Batch> batch, std::shared_ptr<Transaction> tx)
+{
+    std::vector<PublicWebcash> outputs;
+    for (const Pending& report : batch->reports) {
+        outputs.insert(outputs.end(), report.state->webcash.begin(), report.state->webcash.end());
+    }
+    auto parts = std::make_shared<std::vector<api::ShardPart>>(api::SplitByShard({}, outputs));
+    if (!api::BeginOnShards(*parts)) {
+        api::RollbackShards(*parts);
+        tx->rollback();
+        return failBatch(batch, "error creating database transaction");
+    }
 
-            // Check outputs sum to expected value
-            Amount expected = webcash::state().getMiningAmount(state->num_reports);
-            if (state->webcash_sum != expected) {
-                std::cerr << "error: Webcash in mining report doesn't sum to expected amount." << std::endl;
-                std::cerr << "error: actual=" << to_string(state->webcash_sum) << " expected=" << to_string(expected) << std::endl;
-                tx->rollback();
-                return callback(JSONRPCError("outputs don't match allowed amount"));
+    // The outputs are created on each shard at once.
+    struct Progress {
+        std::mutex mutex;
+        size_t remaining = 0;
+        size_t num_created = 0;
+        Uint256Set created;
+        bool failed = false;
+    };
+    auto progress = std::make_shared<Progress>();
+    progress->remaining = parts->size();
+    auto finished = [=](const Result* r) {
+        {
+            const std::lock_guard<std::mutex> lock(progress->mutex);
+            if (!r || !ReadCreatedOutputs(*r, progress->created)) {
+                progress->failed = true;
+            } else {
+                progress->num_created += r->size();
             }
-
-            // Check subsidy sums to expected value
-            expected = webcash::state().getSubsidyAmount(state->num_reports);
-            if (state->subsidy_sum != expected) {
-                std::cerr << "error: Subsidy in mining report doesn't match expected amount." << std::endl;
-                std::cerr << "error: actual=" << to_string(state->subsidy_sum) << " expected=" << to_string(expected) << std::endl;
-                tx->rollback();
-                return callback(JSONRPCError("subsidy doesn't match required amount"));
+            if (--progress->remaining) {
+                return;
             }
-
-            return CheckOutputsDoNotExist(callback, state, tx);
         }
-        >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << sql << std::endl;
-            return callback(JSONRPCError("sql error"));
-        };
+        if (progress->failed) {
+            api::RollbackShards(*parts);
+            tx->rollback();
+            return failBatch(batch, "sql error");
+        }
+        recordReports(batch, tx, api::ReleaseShards(*parts), progress->num_created, progress->created);
+    };
+    for (api::ShardPart& part : *parts) {
+        auto part_tx = part.tx;
+        *part.tx << k_sql_record_outputs
+            << part.output_hashes
+            << part.output_amounts
+            >> [=](const Result &r) {
+                // The outputs are counted in the Summary of their shard.
+                *part_tx << k_sql_record_summary
+                    << int64_t{0}
+                    << int64_t{0}
+                    << int64_t{0}
+                    << static_cast<int64_t>(r.size())
+                    << int64_t{0}
+                    >> [=](const Result &) {
+                        finished(&r);
+                    }
+                    >> [=](const DrogonDbException &e) {
+                        LogError() << e.base().what();
+                        LogError() << "Offending SQL: " << k_sql_record_summary;
+                        finished(nullptr);
+                    };
+            }
+            >> [=](const DrogonDbException &e) {
+                LogError() << e.base().what();
+                LogError() << "Offending SQL: " << k_sql_record_outputs;
+                finished(nullptr);
+            };
+    }
 }
 
-void CheckOutputsDoNotExist(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<MiningReportState> state,
-    std::shared_ptr<Transaction> tx
+void MiningReportSequencer::recordReports(
+    std::shared_ptr<Batch> batch,
+    std::shared_ptr<Transaction> tx,
+    std::vector<ShardSet::Part> parts,
+    size_t num_created,
+    const Uint256Set& created
 ){
-        *tx << state->sql_check_outputs
-        >> [=](const Result &r) {
-            if (r.empty() || !r[0].size()) {
-                std::cerr << "error: Expected one row of one column containing count.  Got something else." << std::endl;
-                std::cerr << "error: Offending SQL: " << state->sql_check_outputs << std::endl;
-                tx->rollback();
-                return callback(JSONRPCError("sql error"));
-            }
-
-            unsigned found = r[0][0].as<unsigned>();
-            if (found) {
-                std::cerr << "error: MiningReport contains existing output.  Cowardly refusing to overwrite." << std::endl;
-                std::cerr << "error: " << to_string(found) << " outputs already exist." << std::endl;
-                tx->rollback();
-                return callback(JSONRPCError("output(s) already exists"));
+    auto rollback = [tx, &parts]() {
+        tx->rollback();
+        for (ShardSet::Part& part : parts) {
+            part.tx->rollback();
+        }
+    };
+    if (num_created != batch->output_hashes.size() / 32) {
+        std::map<size_t, std::string> rejected;
+        for (size_t i = 0; i < batch->reports.size(); ++i) {
+            for (const auto& item : batch->reports[i].state->webcash) {
+                if (!created.count(item.pk)) {
+                    LogError() << "MiningReport contains existing output.  Cowardly refusing to overwrite.";
+                    rejected[i] = "output(s) already exists";
+                    break;
+                }
             }
-
-            state->to_check.clear();
-            CreateOutputs(callback, state, tx);
         }
-        >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << state->sql_check_outputs << std::endl;
-            return callback(JSONRPCError("sql error"));
-        };
-}
+        rollback();
+        if (rejected.empty()) {
+            LogError() << "Expected " << batch->output_hashes.size() / 32 << " outputs to be created.  Got " << num_created << ".";
+            LogError() << "Offending SQL: " << k_sql_record_outputs;
+            return failBatch(batch, "sql error");
+        }
+        return retryBatch(batch, rejected);
+    }
 
-void CreateOutputs(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<MiningReportState> state,
-    std::shared_ptr<Transaction> tx
-){
-    *tx << state->sql_insert_outputs
+    // The parts are held until the reports have been recorded, and then
+    // committed along with them.
+    auto held = std::make_shared<std::vector<ShardSet::Part>>(std::move(parts));
+    auto rollback_held = [tx, held]() {
+        tx->rollback();
+        for (ShardSet::Part& part : *held) {
+            part.tx->rollback();
+        }
+    };
+    static const std::string sql_reports = "INSERT INTO \"MiningReports\" (\"received\", \"preimage\", \"preimage_hash\", \"difficulty\", \"next_difficulty\", \"aggregate_work\") SELECT * FROM unnest($1::BIGINT[], $2::TEXT[], unpack_hashes($3), $4::SMALLINT[], $5::SMALLINT[], $6::DOUBLE PRECISION[]) ON CONFLICT DO NOTHING RETURNING \"preimage_hash\"";
+    *tx << sql_reports
+        << batch->received
+        << batch->preimages
+        << batch->preimage_hashes
+        << batch->difficulties
+        << batch->next_difficulties
+        << batch->aggregate_works
         >> [=](const Result &r) {
-            RecordMiningReport(callback, state, tx);
+            if (r.size() != batch->reports.size()) {
+                std::set<std::string> created;
+                for (const auto& row : r) {
+                    created.insert(row[0].as<std::string>());
+                }
+                std::map<size_t, std::string> rejected;
+                for (size_t i = 0; i < batch->reports.size(); ++i) {
+                    const uint256& hash = batch->reports[i].state->hash;
+                    if (!created.count(std::string((const char*)hash.begin(), 32))) {
+                        LogError() << "Received duplicate MiningReport.";
+                        LogError() << "duplicate: " << batch->reports[i].state->preimage;
+                        rejected[i] = "reused preimage";
+                    }
+                }
+                rollback_held();
+                if (rejected.empty()) {
+                    LogError() << "Expected " << batch->reports.size() << " mining reports to be recorded.  Got " << r.size() << ".";
+                    LogError() << "Offending SQL: " << sql_reports;
+                    return failBatch(batch, "sql error");
+                }
+                return retryBatch(batch, rejected);
+            }
+
+            // FIXME: claim server funds?
+
+            // With --shards, the outputs have been counted by the shards.
+            *tx << k_sql_record_summary
+                << static_cast<int64_t>(batch->reports.size())
+                << int64_t{0}
+                << int64_t{0}
+                << static_cast<int64_t>(held->empty() ? num_created : 0)
+                << int64_t{0}
+                >> [=](const Result &r) {
+                    if (held->empty()) {
+                        tx->setCommitCallback([=](bool committed){
+                            finishBatch(batch, committed);
+                        });
+                        return;
+                    }
+                    // With --shards, the outputs are committed on the shards
+                    // along with the reports, the commit of which is the
+                    // decision to.
+                    std::vector<ShardSet::Part> parts = std::move(*held);
+                    webcash::shards().commit(std::move(parts), tx, [=](bool committed) {
+                        finishBatch(batch, committed);
+                    });
+                }
+                >> [=](const DrogonDbException &e) {
+                    LogError() << e.base().what();
+                    LogError() << "Offending SQL: " << k_sql_record_summary;
+                    for (ShardSet::Part& part : *held) {
+                        part.tx->rollback();
+                    }
+                    return failBatch(batch, "sql error");
+                };
         }
         >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << state->sql_insert_outputs << std::endl;
-            return callback(JSONRPCError("sql error"));
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql_reports;
+            for (ShardSet::Part& part : *held) {
+                part.tx->rollback();
+            }
+            return failBatch(batch, "sql error");
         };
 }
 
-void RecordMiningReport(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<MiningReportState> state,
-    std::shared_ptr<Transaction> tx
+void MiningReportSequencer::retryBatch(
+    std::shared_ptr<Batch> batch,
+    const std::map<size_t, std::string>& rejected
 ){
-    absl::uint128 work = 1;
-    work <<= state->current_difficulty;
-    double aggregate_work = state->last_aggregate_work + static_cast<double>(work);
-
-    unsigned next_difficulty = state->current_difficulty;
-    WebcashStats stats = webcash::state().getStats(state->received);
-    unsigned num_reports = stats.num_reports + 1;
-    if ((num_reports % WebcashEconomy::k_reports_per_interval) == 0) {
-        size_t look_back_window = WebcashEconomy::k_look_back_window;
-        if (num_reports == look_back_window) {
-            --look_back_window;
-        }
-        absl::Duration expected = look_back_window * absl::Seconds(10);
-        absl::Duration actual = state->received - state->last_received;
-        if (actual <= expected && stats.expected_circulation <= stats.total_circulation) {
-            // We're early and we're ahead of the issuance curve
-            ++next_difficulty;
+    {
+        // The remaining reports go back to the front of the queue, in order,
+        // to be sequenced again without the rejected ones.
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t i = batch->reports.size(); i-- > 0; ) {
+            if (!rejected.count(i)) {
+                queue.push_front(batch->reports[i]);
+            }
         }
-        if (expected <= actual && stats.total_circulation <= stats.expected_circulation) {
-            // We're late and we're behind the issuance curve
-            --next_difficulty;
+    }
+    for (const auto& item : rejected) {
+        batch->reports[item.first].callback(JSONRPCError(item.second));
+    }
+    runBatch();
+}
+
+void MiningReportSequencer::finishBatch(std::shared_ptr<Batch> batch, bool committed)
+{
+    if (!committed) {
+        LogError() << "Failed to commit batch of " << batch->reports.size() << " mining reports.";
+        for (const Pending& report : batch->reports) {
+            report.callback(JSONRPCError("sql error"));
         }
+        return runBatch();
     }
 
-    static const std::string sql = "INSERT INTO \"MiningReports\" (\"received\", \"preimage\", \"difficulty\", \"next_difficulty\", \"aggregate_work\") VALUES($1, $2, $3, $4, $5)";
-    *tx << sql
-        << absl::ToUnixNanos(state->received)
-        << state->preimage
-        << static_cast<int16_t>(state->current_difficulty)
-        << static_cast<int16_t>(next_difficulty)
-        << aggregate_work
-        >> [=](const Result &r) {
-            // FIXME: claim server funds?
+    static LatencyHistogram* const stage = webcash::metrics().GetStage("mining_report", "RecordMiningReport");
+    for (const Pending& report : batch->reports) {
+        report.state->timer.End(stage);
+    }
 
-            tx->setCommitCallback([=](bool){
-                // Note that while each of the following statements are atomic,
-                // the combined operation is not.  It is possible for reads to
-                // interleave between these statements.
-                auto num_reports = ++(webcash::state().num_reports);
-                webcash::state().difficulty.store(next_difficulty);
-                webcash::state().num_unspent += state->webcash.size();
-
-                // If this is the very first mining report, then we set the
-                // genesis time to the time of receipt of this first report.
-                if (num_reports == 1) {
-                    webcash::state().genesis = state->received;
-                }
+    MiningReportTip last_tip;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        last_tip = tip;
+        tip = batch->tip;
+    }
 
-                if (webcash::state().logging) {
-                    std::stringstream ss;
-                    ss << "Got BLOCK!!! " << absl::BytesToHexString(absl::string_view((const char*)state->hash.begin(), 32))
-                       << " aggregate_work=" << log2(aggregate_work)
-                       << " difficulty=" << next_difficulty
-                       << " reports=" << stats.num_reports
-                       << " tx=" << stats.num_replace
-                       << " burns=" << stats.num_burn
-                       << " unspent=" << stats.num_unspent
-                       << std::endl;
-                    std::cout << ss.str();
-                }
+    // Note that while each of the following statements are atomic, the
+    // combined operation is not.  It is possible for reads to interleave
+    // between these statements.
+    auto num_reports = (webcash::state().num_reports += batch->reports.size());
+    webcash::state().difficulty.store(batch->tip.difficulty);
+    for (const Pending& report : batch->reports) {
+        webcash::state().preimages.Insert(report.state->hash);
+        webcash::state().num_unspent += report.state->webcash.size();
+        for (const auto& item : report.state->webcash) {
+            webcash::utxos().AddUnspent(item.pk, item.amount);
+        }
+    }
 
-                Json::Value ret(objectValue);
-                ret["status"] = "success";
-                ret["difficulty_target"] = next_difficulty;
-                auto resp = HttpResponse::newHttpJsonResponse(std::move(ret));
-                return callback(resp);
-            });
+    // If this batch contains the very first mining report, then we set the
+    // genesis time to the time of receipt of that first report.
+    if (num_reports == batch->reports.size()) {
+        webcash::state().genesis = batch->reports.front().state->received;
+    }
+
+    // Wake up the miners waiting on a retarget.
+    if (batch->tip.difficulty != last_tip.difficulty
+     || webcash::state().getEpoch(batch->tip.num_reports) != webcash::state().getEpoch(last_tip.num_reports)) {
+        webcash::targets().notify();
+    }
+
+    WebcashStats stats = webcash::state().getStats(absl::Now());
+    size_t report_num = num_reports - batch->reports.size();
+    for (const Pending& report : batch->reports) {
+        const api::MiningReportState& state = *report.state;
+        if (webcash::state().logging) {
+            LogInfo() << "Got BLOCK!!! " << absl::BytesToHexString(absl::string_view((const char*)state.hash.begin(), 32))
+                      << " aggregate_work=" << log2(state.aggregate_work)
+                      << " difficulty=" << state.next_difficulty
+                      << " reports=" << report_num++
+                      << " tx=" << stats.num_replace
+                      << " burns=" << stats.num_burn
+                      << " unspent=" << stats.num_unspent;
         }
-        >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << sql << std::endl;
-            return callback(JSONRPCError("sql error"));
-        };
+
+        Json::Value ret(objectValue);
+        ret["status"] = "success";
+        ret["difficulty_target"] = state.next_difficulty;
+        auto resp = HttpResponse::newHttpJsonResponse(std::move(ret));
+        report.callback(resp);
+    }
+
+    runBatch();
 }
 
-//  ----------------------
-// | /api/v1/health_check |
-//  ----------------------
+namespace webcash {
+    MiningReportSequencer& sequencer()
+    {
+        static MiningReportSequencer sequencer;
+        return sequencer;
+    }
+} // webcash
 
-struct HealthCheckState {
-    // The health_check request as received from the caller.
-    std::shared_ptr<Json::Value> msg;
-    // The public webcash to check, deserialized.
-    std::vector<PublicWebcash> args;
-    // The generated SQL command to lookup unspent outputs and the results.
-    std::string sql_unspent;
-    std::map<uint256, Amount> unspent;
-    // The generated SQL command to lookup spent hashes and the results.
-    std::string sql_spent;
-    std::set<uint256> spent;
+//  --------------
+// | group commit |
+//  --------------
+
+struct GroupCommit::Batch {
+    // The members of the batch, in the order they were queued.
+    std::vector<Pending> members;
+    // The status of each member once it has been applied: "success" if it is
+    // to be committed, or else the error it has already been rejected with.
+    std::vector<std::string> statuses;
+    std::shared_ptr<Transaction> tx;
 };
 
-void CheckUnspentOutputs(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<HealthCheckState> state,
-    std::shared_ptr<DbClient> db); // Calls CheckSpentOutputs...
+static const std::vector<PublicWebcash>& InputsOf(const GroupCommit::Pending& pending)
+{
+    return pending.replacement ? pending.replacement->inputs : pending.burn->inputs;
+}
 
-void CheckSpentOutputs(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<HealthCheckState> state,
-    std::shared_ptr<DbClient> db); // Calls ReturnResults...
+static const std::vector<PublicWebcash>& OutputsOf(const GroupCommit::Pending& pending)
+{
+    static const std::vector<PublicWebcash> none;
+    return pending.replacement ? pending.replacement->outputs : none;
+}
 
-void ReturnResults(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<HealthCheckState> state,
-    std::shared_ptr<DbClient> db); // Done
+static StageTimer& TimerOf(const GroupCommit::Pending& pending)
+{
+    return pending.replacement ? pending.replacement->timer : pending.burn->timer;
+}
 
-void V1::healthCheck(
-    const HttpRequestPtr &req,
-    std::function<void (const HttpResponsePtr &)> &&callback
-){
-    std::shared_ptr<HealthCheckState> state = std::make_shared<HealthCheckState>();
+// Adds the hashes spent and created by pending to those claimed by a batch,
+// unless any of them are already.
+static bool ClaimHashes(const GroupCommit::Pending& pending, Uint256Set& claimed)
+{
+    for (const auto* webcash : {&InputsOf(pending), &OutputsOf(pending)}) {
+        for (const PublicWebcash& wc : *webcash) {
+            if (claimed.count(wc.pk)) {
+                return false;
+            }
+        }
+    }
+    for (const auto* webcash : {&InputsOf(pending), &OutputsOf(pending)}) {
+        for (const PublicWebcash& wc : *webcash) {
+            claimed.insert(wc.pk);
+        }
+    }
+    return true;
+}
 
-    state->msg = req->getJsonObject();
-    if (!state->msg) {
-        return callback(JSONRPCError("no JSON body"));
+void GroupCommit::setWindow(absl::Duration window)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    this->window = window;
+}
+
+void GroupCommit::submit(Pending pending)
+{
+    absl::Duration window;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(pending));
+        if (busy) {
+            // Picked up by the batch after the one in flight.
+            return;
+        }
+        busy = true;
+        window = this->window;
+    }
+    if (window > absl::ZeroDuration()) {
+        drogon::app().getLoop()->runAfter(absl::ToDoubleSeconds(window), [this]() {
+            runBatch();
+        });
+        return;
     }
+    runBatch();
+}
 
-    // Read input parameters as an array of webcash public string the user wants to check.
-    if (!parse_public_webcashes(*state->msg, state->args)) {
-        return callback(JSONRPCError("arguments needs to be array of webcash public webcash strings"));
+void GroupCommit::runBatch()
+{
+    auto batch = std::make_shared<Batch>();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (queue.empty()) {
+            busy = false;
+            return;
+        }
+        // Requests which conflict with one already taken stay queued, in
+        // order, for a later batch.
+        Uint256Set claimed;
+        for (auto it = queue.begin(); it != queue.end() && batch->members.size() < k_max_batch_size; ) {
+            if (!ClaimHashes(*it, claimed)) {
+                ++it;
+                continue;
+            }
+            batch->members.push_back(std::move(*it));
+            it = queue.erase(it);
+        }
+    }
+    batch->statuses.resize(batch->members.size());
+
+    static LatencyHistogram* const replace_stage = webcash::metrics().GetStage("replace", "QueueForGroupCommit");
+    static LatencyHistogram* const burn_stage = webcash::metrics().GetStage("burn", "QueueForGroupCommit");
+    for (const Pending& member : batch->members) {
+        TimerOf(member).End(member.replacement ? replace_stage : burn_stage);
     }
 
     auto db = drogon::app().getDbClient();
     if (!db) {
-        return callback(JSONRPCError("error getting connection to database"));
+        return failBatch(batch, "error getting connection to database");
     }
-
-    std::vector<std::string> values;
-    for (const auto& pk : state->args) {
-        values.push_back(absl::StrCat("'\\x", absl::BytesToHexString(absl::string_view((char*)pk.pk.data(), 32)), "'::bytea"));
+    batch->tx = db->newTransaction();
+    if (!batch->tx) {
+        return failBatch(batch, "error creating database transaction");
     }
-    state->sql_unspent = absl::StrCat("SELECT \"hash\", \"amount\" FROM \"UnspentOutputs\" WHERE \"hash\" IN (", absl::StrJoin(values, ","), ")");
-    state->sql_spent = absl::StrCat("SELECT \"hash\" FROM \"SpentHashes\" WHERE \"hash\" IN (", absl::StrJoin(values, ","), ")");
-
-    CheckUnspentOutputs(callback, state, db);
+    if (webcash::state().redis) {
+        // As with --single_statement_replace, the spends are recorded just
+        // before the statements which make them.
+        std::vector<PublicWebcash> inputs;
+        for (const Pending& member : batch->members) {
+            inputs.insert(inputs.end(), InputsOf(member).begin(), InputsOf(member).end());
+        }
+        return api::RedisRecordSpends(inputs, [=](bool ok) {
+            if (!ok) {
+                batch->tx->rollback();
+                return failBatch(batch, "redis error");
+            }
+            applyMember(batch, 0);
+        });
+    }
+    applyMember(batch, 0);
 }
 
-void CheckUnspentOutputs(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<HealthCheckState> state,
-    std::shared_ptr<DbClient> db
-){
-    *db << state->sql_unspent
-        >> [=](const Result &result) {
-            for (const auto& row : result) {
-                if (row.size() != 2) {
-                    std::cerr << "error: Expected two columns per row.  Got " << row.size() << "." << std::endl;
-                    std::cerr << "error: Offending SQL: " << state->sql_unspent << std::endl;
-                    return callback(JSONRPCError("sql error"));
-                }
-                if (row[0].length() != 32) {
-                    std::cerr << "error: Expected 32-byte hash in first column.  Got " << row[0].length() << " bytes." << std::endl;
-                    std::cerr << "error: Offending SQL: " << state->sql_unspent << std::endl;
-                    return callback(JSONRPCError("sql error"));
-                }
-                std::string hash_bytes = row[0].as<std::string>();
-                uint256 hash;
-                std::copy((unsigned char*)hash_bytes.c_str(),
-                          (unsigned char*)hash_bytes.c_str() + 32,
-                          hash.data());
-                state->unspent[hash] = Amount(row[1].as<uint64_t>());
+void GroupCommit::applyMember(std::shared_ptr<Batch> batch, size_t index)
+{
+    if (index == batch->members.size()) {
+        return commitBatch(batch);
+    }
+    static const std::vector<char> no_hashes;
+    static const std::string no_amounts = "{}";
+    const Pending& member = batch->members[index];
+    const bool is_burn = !member.replacement;
+    const absl::Time received = is_burn ? member.burn->received : member.replacement->received;
+    static const std::string sql = "SELECT try_replace_webcash($1, $2, $3, $4, $5, $6, $7, $8, $9, $10, $11)";
+    *batch->tx << sql
+        << (is_burn ? member.burn->input_hashes : member.replacement->input_hashes)
+        << (is_burn ? member.burn->input_amounts : member.replacement->input_amounts)
+        << (is_burn ? no_hashes : member.replacement->output_hashes)
+        << (is_burn ? no_amounts : member.replacement->output_amounts)
+        << absl::ToUnixNanos(received)
+        << !webcash::state().redis
+        << !webcash::audit().IsOpen()
+        << int64_t{is_burn ? 0 : 1}
+        << int64_t{is_burn ? 1 : 0}
+        << (is_burn ? member.burn->total_in.i64 : int64_t{0})
+        << is_burn
+        >> [=](const Result &r) {
+            std::string status;
+            if (r.empty() || !r[0].size()) {
+                LogError() << "Expected one row of one column containing status.  Got something else.";
+                LogError() << "Offending SQL: " << sql;
+                status = "sql error";
+            } else {
+                status = r[0][0].as<std::string>();
             }
-            return CheckSpentOutputs(callback, state, db);
+            static const std::string sql_error = "sql error: ";
+            if (status == "input(s) not found") {
+                LogError() << "One or more specified input values not found in database.";
+            } else if (status == "output(s) already exists") {
+                LogError() << "Replacement contains existing output.  Cowardly refusing to overwrite.";
+            } else if (absl::StartsWith(status, sql_error)) {
+                LogError() << status.substr(sql_error.size());
+                LogError() << "Offending SQL: " << sql;
+                status = "sql error";
+            } else if (status != "success" && status != "sql error") {
+                LogError() << "Unexpected status from try_replace_webcash(): " << status;
+                LogError() << "Offending SQL: " << sql;
+                status = "sql error";
+            }
+            // A member which failed has been rolled back to its savepoint,
+            // and is answered at once.
+            batch->statuses[index] = status;
+            if (status != "success") {
+                batch->members[index].callback(JSONRPCError(status));
+            }
+            applyMember(batch, index + 1);
         }
         >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << state->sql_unspent << std::endl;
-            return callback(JSONRPCError("sql error"));
+            LogError() << e.base().what();
+            LogError() << "Offending SQL: " << sql;
+            failBatch(batch, "sql error");
         };
 }
 
-void CheckSpentOutputs(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<HealthCheckState> state,
-    std::shared_ptr<DbClient> db
-){
-    *db << state->sql_spent
-        >> [=](const Result &result) {
-            for (const auto& row : result) {
-                if (row.size() != 1) {
-                    std::cerr << "error: Expected one columns per row.  Got " << row.size() << "." << std::endl;
-                    std::cerr << "error: Offending SQL: " << state->sql_spent << std::endl;
-                    return callback(JSONRPCError("sql error"));
-                }
-                if (row[0].length() != 32) {
-                    std::cerr << "error: Expected 32-byte hash in first column.  Got " << row[0].length() << " bytes." << std::endl;
-                    std::cerr << "error: Offending SQL: " << state->sql_spent << std::endl;
-                    return callback(JSONRPCError("sql error"));
-                }
-                std::string hash_bytes = row[0].as<std::string>();
-                uint256 hash;
-                std::copy((unsigned char*)hash_bytes.c_str(),
-                          (unsigned char*)hash_bytes.c_str() + 32,
-                          hash.data());
-                state->spent.insert(hash);
-            }
-            return ReturnResults(callback, state, db);
+void GroupCommit::commitBatch(std::shared_ptr<Batch> batch)
+{
+    if (std::find(batch->statuses.begin(), batch->statuses.end(), "success") == batch->statuses.end()) {
+        batch->tx->rollback();
+        return runBatch();
+    }
+    batch->tx->setCommitCallback([this, batch](bool committed) {
+        finishBatch(batch, committed);
+    });
+    batch->tx.reset();
+}
+
+void GroupCommit::failBatch(std::shared_ptr<Batch> batch, const std::string& error)
+{
+    for (size_t i = 0; i < batch->members.size(); ++i) {
+        if (batch->statuses[i].empty() || batch->statuses[i] == "success") {
+            batch->members[i].callback(JSONRPCError(error));
         }
-        >> [=](const DrogonDbException &e) {
-            std::cerr << "error: " << e.base().what() << std::endl;
-            std::cerr << "error: Offending SQL: " << state->sql_spent << std::endl;
-            return callback(JSONRPCError("sql error"));
-        };
+    }
+    runBatch();
 }
 
-void ReturnResults(
-    std::function<void (const HttpResponsePtr &)> callback,
-    std::shared_ptr<HealthCheckState> state,
-    std::shared_ptr<DbClient> db
-){
-    Json::Value results(objectValue);
-    for (size_t i = 0; i < state->args.size(); ++i) {
-        Json::Value status(objectValue);
-        auto unspent = state->unspent.find(state->args[i].pk);
-        if (unspent != state->unspent.end()) {
-            status["spent"] = false;
-            status["amount"] = to_string(unspent->second);
-        } else if (state->spent.find(state->args[i].pk) != state->spent.end()) {
-            status["spent"] = true;
-        } else {
-            // This is a bit obscure, but it matches the current server
-            // behavior.  A never-seen webcash is indicated by a nullary
-            // "spent" value.
-            status["spent"] = Json::Value(nullValue);
+void GroupCommit::finishBatch(std::shared_ptr<Batch> batch, bool committed)
+{
+    if (!committed) {
+        LogError() << "Failed to commit batch of " << batch->members.size() << " replacements and burns.";
+        for (size_t i = 0; i < batch->members.size(); ++i) {
+            if (batch->statuses[i] == "success") {
+                batch->members[i].callback(JSONRPCError("sql error"));
+            }
         }
-        // Use the original input as the key, so that the user is able
-        // to find the record even if they sent a non-canonical encoding
-        // (e.g. different hex capitalization).
-        results[state->msg->get(i, to_string(state->args[i])).asString()] = status;
+        return runBatch();
     }
 
-    Json::Value ret(objectValue);
-    ret["status"] = "success";
-    ret["results"] = results;
-    auto resp = HttpResponse::newHttpJsonResponse(std::move(ret));
-    callback(resp);
+    static LatencyHistogram* const replace_stage = webcash::metrics().GetStage("replace", "GroupCommit");
+    static LatencyHistogram* const burn_stage = webcash::metrics().GetStage("burn", "GroupCommit");
+    for (size_t i = 0; i < batch->members.size(); ++i) {
+        if (batch->statuses[i] != "success") {
+            continue;
+        }
+        // With --audit_log, each member is appended to the local audit log
+        // now that it has committed.  The appends are made at once, and so
+        // are synced together.
+        const Pending& member = batch->members[i];
+        if (member.replacement) {
+            member.replacement->timer.End(replace_stage);
+            if (webcash::audit().IsOpen()) {
+                api::AppendToAuditLog(member.callback, member.replacement);
+            } else {
+                api::FinishReplacement(member.callback, member.replacement);
+            }
+        } else {
+            member.burn->timer.End(burn_stage);
+            if (webcash::audit().IsOpen()) {
+                api::AppendToAuditLog(member.callback, member.burn);
+            } else {
+                api::FinishBurn(member.callback, member.burn);
+            }
+        }
+    }
+    runBatch();
 }
-} // namespace api
+
+namespace webcash {
+    GroupCommit& groupCommit()
+    {
+        static GroupCommit group_commit;
+        return group_commit;
+    }
+} // webcash
 
 //  --------
 // | /stats |
 //  --------
 
-void EconomyStats::asyncHandleHttpRequest(
-    const HttpRequestPtr& req,
-    std::function<void (const HttpResponsePtr &)> &&callback
-){
+static bool RenderStats(std::string& body)
+{
     WebcashStats stats = webcash::state().getStats(absl::Now());
 
     Json::Value ret(objectValue);
@@ -1817,8 +5009,59 @@ void EconomyStats::asyncHandleHttpRequest(
     ret["mining_amount"] = to_string(stats.mining_amount);
     ret["mining_subsidy_amount"] = to_string(stats.subsidy_amount);
 
-    auto resp = HttpResponse::newHttpJsonResponse(std::move(ret));
-    resp->setExpiredTime(k_stats_cache_expiry);
+    body = RenderJson(ret);
+    return true;
+}
+
+void EconomyStats::asyncHandleHttpRequest(
+    const HttpRequestPtr& req,
+    std::function<void (const HttpResponsePtr &)> &&callback
+){
+    // The ratio changes with time, so it is rendered again at least once per
+    // k_stats_cache_expiry, as well as with each mining report.
+    static CachedResponse stats(drogon::CT_APPLICATION_JSON, absl::Seconds(k_stats_cache_expiry), RenderStats);
+    callback(stats.get(req, EconomyKey()));
+}
+
+//  ----------
+// | /metrics |
+//  ----------
+
+void PrometheusMetrics::asyncHandleHttpRequest(
+    const HttpRequestPtr& req,
+    std::function<void (const HttpResponsePtr &)> &&callback
+){
+    std::string out = webcash::metrics().Render();
+    auto gauge = [&](const char* name, const char* help, const std::string& labels, double value) {
+        absl::StrAppend(&out, "# HELP ", name, " ", help, "\n# TYPE ", name, " gauge\n");
+        absl::StrAppend(&out, name, labels, " ", value, "\n");
+    };
+    gauge("webcashd_mining_reports", "Mining reports recorded.", "", webcash::state().num_reports.load());
+    gauge("webcashd_replacements", "Total number of replacements.", "", webcash::state().num_replace.load());
+    gauge("webcashd_burns", "Total number of burns.", "", webcash::state().num_burn.load());
+    gauge("webcashd_unspent_outputs", "Unspent outputs.", "", webcash::state().num_unspent.load());
+    gauge("webcashd_difficulty", "Difficulty required of the next mining report, in leading zero bits.", "", webcash::state().getDifficulty());
+    gauge("webcashd_target_waiting", "Requests held by /api/v1/target/wait.", "", webcash::targets().numWaiting());
+    gauge("webcashd_read_replicas", "Read replicas configured.", "", webcash::replicas().size());
+    gauge("webcashd_fresh_read_replicas", "Read replicas within --max_replica_lag of the database.", "", webcash::replicas().numFresh());
+    const std::pair<const char*, const AdmissionControl*> limits[] = {
+        {"replace", &webcash::limits().replace},
+        {"mining_report", &webcash::limits().mining_report},
+        {"health_check", &webcash::limits().health_check},
+    };
+    absl::StrAppend(&out, "# HELP webcashd_in_flight Requests being processed against the database, by admission control budget.\n# TYPE webcashd_in_flight gauge\n");
+    for (const auto& limit : limits) {
+        absl::StrAppend(&out, "webcashd_in_flight{budget=\"", limit.first, "\"} ", limit.second->numInFlight(), "\n");
+    }
+    absl::StrAppend(&out, "# HELP webcashd_queued Requests waiting for admission, by admission control budget.\n# TYPE webcashd_queued gauge\n");
+    for (const auto& limit : limits) {
+        absl::StrAppend(&out, "webcashd_queued{budget=\"", limit.first, "\"} ", limit.second->numQueued(), "\n");
+    }
+    RenderLockStats(out, "webcashd");
+
+    auto resp = HttpResponse::newHttpResponse();
+    resp->setContentTypeString("text/plain; version=0.0.4");
+    resp->setBody(std::move(out));
     callback(resp);
 }
 
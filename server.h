@@ -10,8 +10,10 @@
 #include <stdint.h>
 
 #include <atomic>
+#include <deque>
 #include <functional>
 #include <map>
+#include <memory>
 #include <mutex>
 #include <set>
 #include <string>
@@ -25,11 +27,18 @@
 
 #include <drogon/HttpController.h>
 #include <drogon/HttpSimpleController.h>
+#include <drogon/nosql/RedisClient.h>
+#include <drogon/orm/DbClient.h>
 
 #include <json/json.h>
 
+#include "bloom.h"
+#include "jsonscan.h"
+#include "metrics.h"
 #include "sync.h"
+#include "storage.h"
 #include "uint256.h"
+#include "uint256map.h"
 #include "webcash.h"
 
 namespace webcash {
@@ -42,6 +51,11 @@ void upgradeDb();
 // is a synchronous operation and must be called after the main event loop is
 // running.
 void resetDb();
+
+// Connects to the Redis server at addr, given as "ip:port", to keep the set of
+// spent hashes in (see WebcashEconomy::redis).  Returns nullptr if addr can't
+// be parsed.
+std::shared_ptr<drogon::nosql::RedisClient> connectRedis(const std::string& addr, size_t connections);
 } // webcash
 
 struct MiningReport {
@@ -52,13 +66,13 @@ struct MiningReport {
 };
 
 struct Replacement {
-    std::map<uint256, Amount> inputs;
-    std::map<uint256, Amount> outputs;
+    Uint256Map<Amount> inputs;
+    Uint256Map<Amount> outputs;
     absl::Time received;
 };
 
 struct Burn {
-    std::map<uint256, Amount> coins;
+    Uint256Map<Amount> coins;
     absl::Time received;
 };
 
@@ -91,9 +105,30 @@ public: // should be protected:
     std::atomic<size_t> num_replace = 0; // cached
     std::atomic<size_t> num_burn = 0; // cached
     std::atomic<size_t> num_unspent = 0; // cached
+    // The hashes of the preimages of every mining report, loaded at startup
+    BloomFilter preimages;
     // treated as constant
     absl::Time genesis = absl::Now();
     bool logging = true;
+    // Whether replacements are made with a single call to a stored procedure,
+    // rather than a sequence of statements within a transaction.
+    bool single_statement_replace = false;
+    // Whether concurrent replacements and burns are committed together, in
+    // batches (see GroupCommit), rather than each in its own transaction.
+    bool group_commit = false;
+    // Whether the counters kept in the Summary table are checked against the
+    // tables themselves in the background, at startup.
+    bool reconcile_summary = false;
+    // If set (--redis), the set of spent hashes is kept in this Redis server
+    // rather than in the SpentHashes table.
+    std::shared_ptr<drogon::nosql::RedisClient> redis;
+    // If set (--sqlite), everything is stored by this backend rather than in
+    // Postgres.
+    std::shared_ptr<Storage> storage;
+    // If set (--utxo_snapshot), the path of a snapshot to warm the UTXO cache
+    // from at startup, rather than reading the tables, if its counters match
+    // those of the database.
+    std::string utxo_snapshot;
 
 public:
     WebcashEconomy() = default;
@@ -126,18 +161,455 @@ public:
             : Amount{k_initial_subsidy_amount >> epoch};
     }
 
+    // The amount of webcash issued by the first num_reports mining reports.
+    absl::uint128 getTotalCirculation(unsigned num_reports) const;
+
+    // The amount of webcash which should have been issued by now, given the
+    // target interval between mining reports.
+    absl::uint128 getExpectedCirculation(absl::Time now) const;
+
     WebcashStats getStats(absl::Time now);
 };
 
 namespace webcash {
     WebcashEconomy& state();
+    // The request latencies and outcomes exposed on /metrics.
+    ServerMetrics& metrics();
+} // webcash
+
+// Splits the tables of unspent outputs and spent hashes across the databases
+// given by --shards, by the leading bits of each hash, so that the writes of
+// replacements, burns and mining reports are spread across them.  The audit
+// records of a replacement or burn are kept by the shard of its first input,
+// and the database itself keeps the mining reports.
+//
+// A transaction which touches a single shard is committed as usual.  One which
+// touches more than one (including mining reports, which also write to the
+// database itself) is committed with PostgreSQL's two-phase commit, which
+// requires max_prepared_transactions to be set on the shards: see commit.
+class ShardSet {
+public:
+    // A shard's part of a transaction.
+    struct Part {
+        size_t shard = 0;
+        std::shared_ptr<drogon::orm::Transaction> tx;
+    };
+
+    ShardSet();
+    // Non-copyable:
+    ShardSet(const ShardSet&) = delete;
+    ShardSet& operator=(const ShardSet&) = delete;
+
+    // Adds the database client created with this name as the next shard.
+    // Must be called before the server is running.
+    void add(const std::string& name);
+    // The number of shards, or zero if the tables aren't sharded.
+    size_t size() const { return shards.size(); }
+
+    // The shard holding hash, by its first byte, so that each shard holds a
+    // contiguous range of hashes.
+    size_t shardOf(const uint256& hash) const {
+        return static_cast<size_t>(hash.data()[0]) * shards.size() / 256;
+    }
+
+    std::shared_ptr<drogon::orm::DbClient> getDbClient(size_t shard) const;
+
+    // Commits the parts of a transaction, and local, a transaction of the
+    // database itself, if given, calling done with whether they were
+    // committed.  The callers' references to the transactions have to have
+    // been released (or moved in), so that they are committed here.
+    //
+    // With a single part and no local, this is an ordinary commit.  Otherwise
+    // each part is prepared with PREPARE TRANSACTION, and then the decision to
+    // commit them is recorded in the ShardCommits table of the database, by
+    // local if given.  Only then are the parts committed, with COMMIT
+    // PREPARED.  If any part fails to prepare, they are all rolled back
+    // instead.
+    void commit(
+        std::vector<Part> parts,
+        std::shared_ptr<drogon::orm::Transaction> local,
+        std::function<void (bool)> done);
+
+    // Commits the transactions which an earlier run of the server prepared on
+    // the shards and recorded the decision to commit, and rolls back the rest.
+    // Blocks, and so is only for use at startup.
+    void recover();
+
+protected:
+    std::string newTransactionId();
+    void commitPrepared(const std::string& gid, const std::vector<size_t>& parts, std::function<void (bool)> done);
+    void rollbackPrepared(const std::string& gid, const std::vector<size_t>& parts);
+
+    std::vector<std::string> shards;
+    // The transaction ids of this run begin with this, so that they aren't
+    // mistaken for those left prepared by an earlier run.
+    std::string gid_prefix;
+    std::atomic<uint64_t> next_gid{0};
+};
+
+namespace webcash {
+    ShardSet& shards();
+} // webcash
+
+namespace api {
+struct MiningReportState;
+struct ReplacementState;
+struct BurnState;
+} // namespace api
+
+// The fields of the most recent mining report which are needed to validate
+// and record the next one.
+struct MiningReportTip {
+    unsigned num_reports = 0;
+    absl::Time last_received = absl::UnixEpoch();
+    unsigned last_difficulty = 0;
+    // The difficulty required of the next mining report.
+    unsigned difficulty = 28;
+    double aggregate_work = 0.0;
+};
+
+// Mining reports are admitted by a single sequencer, which owns the tip of the
+// chain of reports.  Validated reports are checked against the tip in the order
+// they were received, and each batch of them is then recorded with a single
+// transaction.  The tip only advances once that transaction has committed, so
+// every report's difficulty and aggregate work are derived from its actual
+// predecessor, and the tip never has to be read back from the database.
+class MiningReportSequencer {
+public:
+    static const size_t k_max_batch_size = 32;
+
+    MiningReportSequencer() = default;
+    // Non-copyable:
+    MiningReportSequencer(const MiningReportSequencer&) = delete;
+    MiningReportSequencer& operator=(const MiningReportSequencer&) = delete;
+
+    // Sets the tip, as loaded from the database.  Must not be called while
+    // mining reports are being processed.
+    void reset(const MiningReportTip& tip);
+
+    MiningReportTip getTip() const;
+
+    // Queues a mining report which has passed every check that doesn't depend
+    // on the tip or the database.  The callback is called once it has either
+    // been recorded or rejected.
+    void submit(
+        std::shared_ptr<api::MiningReportState> state,
+        std::function<void (const drogon::HttpResponsePtr &)> callback);
+
+protected:
+    struct Pending {
+        std::shared_ptr<api::MiningReportState> state;
+        std::function<void (const drogon::HttpResponsePtr &)> callback;
+    };
+
+    struct Batch;
+
+    // Sequences and records the next batch of queued reports, or marks the
+    // sequencer as idle if there are none.
+    void runBatch();
+    void recordBatch(std::shared_ptr<Batch> batch);
+    // With --shards, the outputs are created on the shards instead, within
+    // transactions which are prepared and committed along with tx.
+    void recordOutputsOnShards(std::shared_ptr<Batch> batch, std::shared_ptr<drogon::orm::Transaction> tx);
+    // Records the reports of a batch, once num_created of its outputs (those
+    // in created, unless all of them were) have been.
+    void recordReports(
+        std::shared_ptr<Batch> batch,
+        std::shared_ptr<drogon::orm::Transaction> tx,
+        std::vector<ShardSet::Part> parts,
+        size_t num_created,
+        const Uint256Set& created);
+    // With webcash::state().storage, the batch is recorded by it instead.
+    void recordBatchInStorage(std::shared_ptr<Batch> batch);
+    void failBatch(std::shared_ptr<Batch> batch, const std::string& error);
+    void finishBatch(std::shared_ptr<Batch> batch, bool committed);
+    // Rejects the reports of a rolled back batch which were found to be
+    // duplicates of existing records, and requeues the rest to be sequenced
+    // again.
+    void retryBatch(std::shared_ptr<Batch> batch, const std::map<size_t, std::string>& rejected);
+
+    mutable std::mutex mutex;
+    MiningReportTip tip;
+    std::deque<Pending> queue;
+    bool busy = false;
+};
+
+namespace webcash {
+    MiningReportSequencer& sequencer();
+} // webcash
+
+// With --group_commit, replacements and burns which have been admitted are
+// queued here, and those which don't spend or create any of the same hashes
+// are committed together in a single transaction, so that the cost of each
+// commit (and its WAL flush) is shared among them.  Each is applied with a
+// call to try_replace_webcash(), which runs within a savepoint of its own, so
+// that one which fails is rolled back and reported to its own caller without
+// aborting the rest.  Only one batch is in flight at a time: requests which
+// arrive meanwhile, or which conflict with one already in the batch, wait for
+// the next.
+class GroupCommit {
+public:
+    static const size_t k_max_batch_size = 64;
+
+    // A queued replacement or burn; exactly one of the two is set.
+    struct Pending {
+        std::shared_ptr<api::ReplacementState> replacement;
+        std::shared_ptr<api::BurnState> burn;
+        std::function<void (const drogon::HttpResponsePtr &)> callback;
+    };
+
+    GroupCommit() = default;
+    // Non-copyable:
+    GroupCommit(const GroupCommit&) = delete;
+    GroupCommit& operator=(const GroupCommit&) = delete;
+
+    // How long a request which finds no batch in flight waits for others to
+    // join it, before its batch is started.
+    void setWindow(absl::Duration window);
+
+    // Queues a replacement or burn which has been parsed, checked and
+    // admitted.  The callback is called once it has either been committed or
+    // rejected.
+    void submit(Pending pending);
+
+protected:
+    struct Batch;
+
+    // Starts the next batch of queued requests, or marks the group commit as
+    // idle if there are none.
+    void runBatch();
+    // Applies the member of a batch at index, and then each after it.
+    void applyMember(std::shared_ptr<Batch> batch, size_t index);
+    // Writes the audit records of the members which were applied, with
+    // --audit_log, and commits the batch.
+    void commitBatch(std::shared_ptr<Batch> batch);
+    // Rejects every member of a batch which hasn't been already.
+    void failBatch(std::shared_ptr<Batch> batch, const std::string& error);
+    void finishBatch(std::shared_ptr<Batch> batch, bool committed);
+
+    mutable std::mutex mutex;
+    absl::Duration window = absl::ZeroDuration();
+    std::deque<Pending> queue;
+    bool busy = false;
+};
+
+namespace webcash {
+    GroupCommit& groupCommit();
+} // webcash
+
+// Holds /api/v1/target/wait requests until the difficulty or epoch changes, so
+// that miners learn of a retarget as soon as it happens without polling for
+// it.  Targets are identified by a version token, which is the difficulty and
+// epoch, so that tokens held by miners remain meaningful across restarts.
+class TargetNotifier {
+public:
+    // The longest time a request is held before being answered with the
+    // unchanged target.
+    const absl::Duration k_max_wait = absl::Seconds(60);
+
+    TargetNotifier() = default;
+    // Non-copyable:
+    TargetNotifier(const TargetNotifier&) = delete;
+    TargetNotifier& operator=(const TargetNotifier&) = delete;
+
+    static std::string getVersion(unsigned difficulty, unsigned epoch);
+    static std::string getCurrentVersion();
+
+    // Answers immediately if the current target isn't the one identified by
+    // version, or otherwise once it changes or k_max_wait passes.
+    void wait(
+        const std::string& version,
+        std::function<void (const drogon::HttpResponsePtr &)> &&callback);
+
+    // Answers every held request.  Called after the difficulty or epoch has
+    // changed.
+    void notify();
+
+    size_t numWaiting() const;
+
+protected:
+    void expire(uint64_t id);
+
+    mutable std::mutex mutex;
+    uint64_t next_id = 0;
+    std::map<uint64_t, std::function<void (const drogon::HttpResponsePtr &)>> waiting;
+};
+
+namespace webcash {
+    TargetNotifier& targets();
+} // webcash
+
+// Bounds the number of requests to an endpoint which are being processed
+// against the database at once, so that a slow database sheds load rather
+// than accumulating open transactions.  Requests beyond max_in_flight wait in
+// a queue, in the order they were received, and requests beyond max_queued
+// more are turned away immediately (see OverloadedError).  A max_in_flight of
+// zero is no limit.
+class AdmissionControl {
+public:
+    // Holds a slot until the last copy of it is destroyed, which passes the
+    // slot on to the next queued request, if any.
+    using Ticket = std::shared_ptr<void>;
+
+    // If priority is given, requests to this endpoint are also turned away
+    // while any are queued for that one, so that it yields to it.
+    explicit AdmissionControl(const AdmissionControl* priority = nullptr) : priority(priority) {}
+    // Non-copyable:
+    AdmissionControl(const AdmissionControl&) = delete;
+    AdmissionControl& operator=(const AdmissionControl&) = delete;
+
+    void setLimits(size_t max_in_flight, size_t max_queued);
+
+    // Calls admitted with the ticket for a slot, immediately if one is free
+    // or otherwise from the event loop once one is.  Returns false, without
+    // calling admitted, if the request is turned away instead.
+    bool admit(std::function<void (Ticket)> admitted);
+
+    size_t numInFlight() const;
+    size_t numQueued() const;
+
+protected:
+    Ticket newTicket();
+    void release();
+
+    const AdmissionControl* priority;
+    mutable std::mutex mutex;
+    size_t max_in_flight = 0;
+    size_t max_queued = 0;
+    size_t in_flight = 0;
+    std::deque<std::function<void (Ticket)>> queue;
+};
+
+// The admission control of each endpoint which uses the database.  Burns share
+// the budget of replacements, and health checks yield to mining reports.
+struct EndpointLimits {
+    AdmissionControl replace;
+    AdmissionControl mining_report;
+    AdmissionControl health_check{&mining_report};
+};
+
+namespace webcash {
+    EndpointLimits& limits();
+} // webcash
+
+// The read replicas of the database (--read_replicas), to which read-only
+// queries are sent instead of the primary: the lookups of health checks made
+// before the UTXO cache is loaded, and the bulk loads which warm up the caches
+// and statistics at startup.  The replication lag of each replica is polled,
+// and a replica which is further behind than max_lag, or which hasn't answered
+// a poll recently, is passed over until it catches up.  Without a fresh
+// replica, queries go to the primary.
+class ReplicaSet {
+public:
+    // How often each replica's replication lag is polled.
+    const absl::Duration k_poll_interval = absl::Seconds(1);
+
+    ReplicaSet() = default;
+    // Non-copyable:
+    ReplicaSet(const ReplicaSet&) = delete;
+    ReplicaSet& operator=(const ReplicaSet&) = delete;
+
+    // Adds the database client created with this name.  Must be called before
+    // the server is running.
+    void add(const std::string& name);
+    void setMaxLag(absl::Duration max_lag);
+    size_t size() const { return replicas.size(); }
+
+    // Polls the replicas every k_poll_interval, from the event loop.
+    void startPolling();
+
+    // A replica within max_lag of the primary, taking turns between them, or
+    // else the primary.
+    std::shared_ptr<drogon::orm::DbClient> getDbClient();
+
+    // A replica which has replayed everything committed to the primary as of
+    // the call, waiting up to timeout for one to catch up, or else the
+    // primary.  For loading state which has to be exact.  Blocks, and so is
+    // only for use at startup.
+    std::shared_ptr<drogon::orm::DbClient> getCaughtUpDbClient(absl::Duration timeout);
+
+    size_t numFresh() const;
+
+protected:
+    struct Replica {
+        std::string name;
+        // The replication lag as of the last poll, or -1 if unknown.
+        std::atomic<int64_t> lag_nanos{-1};
+        // The replica is used until then, as of the last successful poll.
+        std::atomic<int64_t> fresh_until_nanos{0};
+    };
+
+    void poll();
+    bool isFresh(const Replica& replica, absl::Time now) const;
+
+    // A deque, so that the atomics don't move as replicas are added.
+    std::deque<Replica> replicas;
+    std::atomic<int64_t> max_lag_nanos{absl::ToInt64Nanoseconds(absl::Seconds(1))};
+    std::atomic<size_t> next{0};
+};
+
+namespace webcash {
+    ReplicaSet& replicas();
 } // webcash
 
 std::shared_ptr<drogon::HttpResponse> JSONRPCError(const std::string& err);
-bool check_legalese(const Json::Value& request);
-bool parse_secret_webcashes(const Json::Value& array, std::map<uint256, SecretWebcash>& webcash);
+// A 503 Service Unavailable response, with Retry-After, for requests turned
+// away by admission control.
+std::shared_ptr<drogon::HttpResponse> OverloadedError();
+// How long the response to /api/v1/target is reused.  This is purely for DoS
+// prevention purposes.  The target API is expected to deliver reliable,
+// up-to-date information.
+const ssize_t k_target_cache_expiry = 1 /* 1 second */;
+// The response to /api/v1/target, for the current state of the economy.  If
+// req is given and already has it, the response is 304 Not Modified instead.
+std::shared_ptr<drogon::HttpResponse> TargetResponse(const drogon::HttpRequestPtr& req = nullptr);
+// Reads the value of a request's "legalese" member, setting accepted if it
+// accepts the terms.  Returns false on a syntax error.
+bool read_legalese(JsonScanner& in, bool& accepted);
+// Reads an array of secret webcash into their public webcash, sorted by hash.
+// The array is read to its end even if it can't be used, so that the caller
+// can continue reading the request; in.ok() distinguishes syntax errors.
+// Returns false on any error, including duplicate secrets.
+bool parse_secret_webcashes(JsonScanner& in, std::vector<PublicWebcash>& webcash);
 bool parse_public_webcashes(const Json::Value& array, std::vector<PublicWebcash>& webcash);
 
+// A response whose body is the same for every request, kept serialized along
+// with an ETag of it, so that it is only rendered again once what it shows has
+// changed, and requests which already have it (If-None-Match) are answered
+// with 304 Not Modified.  What it shows is identified by a key, such as the
+// number of mining reports, and it is also rendered again once older than
+// max_age, for the parts of it which change with time.
+class CachedResponse {
+public:
+    // Sets the body, returning false if it can't be rendered, which is
+    // answered with 404 Not Found.
+    using Render = std::function<bool (std::string& body)>;
+
+    CachedResponse(drogon::ContentType type, absl::Duration max_age, Render render)
+        : type(type), max_age(max_age), render(std::move(render)) {}
+    // Non-copyable:
+    CachedResponse(const CachedResponse&) = delete;
+    CachedResponse& operator=(const CachedResponse&) = delete;
+
+    // The response to req (which may be null), for the state identified by
+    // key.
+    drogon::HttpResponsePtr get(const drogon::HttpRequestPtr& req, uint64_t key);
+
+protected:
+    struct Entry {
+        uint64_t key = 0;
+        absl::Time rendered = absl::InfinitePast();
+        std::string body;
+        std::string etag;
+    };
+
+    const drogon::ContentType type;
+    const absl::Duration max_age;
+    const Render render;
+    mutable std::mutex mutex;
+    std::shared_ptr<const Entry> entry;
+};
+
 class TermsOfService
     : public drogon::HttpSimpleController<TermsOfService>
 {
@@ -160,16 +632,12 @@ namespace api {
 class V1
     : public drogon::HttpController<V1>
 {
-protected:
-    // This is purely for DoS prevention purposes.  The target API is expected
-    // to deliver reliable, up-to-date information.
-    const ssize_t k_target_cache_expiry = 1 /* 1 second */;
-
 public:
     METHOD_LIST_BEGIN
         METHOD_ADD(V1::replace, "/replace", drogon::Post);
         METHOD_ADD(V1::burn, "/burn", drogon::Post);
         METHOD_ADD(V1::target, "/target", drogon::Get);
+        METHOD_ADD(V1::targetWait, "/target/wait", drogon::Get);
         METHOD_ADD(V1::miningReport, "/mining_report", drogon::Post);
         METHOD_ADD(V1::healthCheck, "/health_check", drogon::Post);
     METHOD_LIST_END
@@ -186,6 +654,10 @@ public:
         const drogon::HttpRequestPtr &req,
         std::function<void (const drogon::HttpResponsePtr &)> &&callback);
 
+    void targetWait(
+        const drogon::HttpRequestPtr &req,
+        std::function<void (const drogon::HttpResponsePtr &)> &&callback);
+
     void miningReport(
         const drogon::HttpRequestPtr &req,
         std::function<void (const drogon::HttpResponsePtr &)> &&callback);
@@ -213,6 +685,22 @@ public:
         ) override;
 };
 
+// Exposes webcash::metrics(), and gauges of the state of the server, in the
+// Prometheus text format.
+class PrometheusMetrics
+    : public drogon::HttpSimpleController<PrometheusMetrics>
+{
+public:
+    PATH_LIST_BEGIN
+        PATH_ADD("/metrics", drogon::Get);
+    PATH_LIST_END
+
+    virtual void asyncHandleHttpRequest(
+            const drogon::HttpRequestPtr& req,
+            std::function<void (const drogon::HttpResponsePtr &)> &&callback
+        ) override;
+};
+
 #endif // SERVER_H
 
 // End of File
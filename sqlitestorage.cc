@@ -0,0 +1,640 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "sqlitestorage.h"
+
+#include <array>
+#include <future>
+#include <utility>
+
+#include "logger.h"
+#include "sqlite3.h"
+
+// A prepared statement whose parameters are bound in order, and which is
+// reset for reuse when it goes out of scope.  Errors are logged, and leave the
+// statement not ok(), after which it does nothing.
+class SqliteStorage::Statement {
+public:
+    Statement(SqliteStorage& store, const std::string& sql)
+        : m_db(store.m_db), m_sql(sql), m_stmt(store.Prepare(sql)), m_ok(m_stmt != nullptr) {}
+
+    ~Statement() {
+        if (m_stmt) {
+            sqlite3_reset(m_stmt);
+            sqlite3_clear_bindings(m_stmt);
+        }
+    }
+
+    // Non-copyable:
+    Statement(const Statement&) = delete;
+    Statement& operator=(const Statement&) = delete;
+
+    bool ok() const { return m_ok; }
+
+    Statement& Bind(const uint256& hash) {
+        return Check(m_ok ? sqlite3_bind_blob(m_stmt, ++m_index, hash.begin(), 32, SQLITE_TRANSIENT) : SQLITE_OK);
+    }
+    Statement& Bind(int64_t value) {
+        return Check(m_ok ? sqlite3_bind_int64(m_stmt, ++m_index, value) : SQLITE_OK);
+    }
+    Statement& Bind(double value) {
+        return Check(m_ok ? sqlite3_bind_double(m_stmt, ++m_index, value) : SQLITE_OK);
+    }
+    Statement& Bind(const std::string& text) {
+        return Check(m_ok ? sqlite3_bind_text(m_stmt, ++m_index, text.data(), text.size(), SQLITE_TRANSIENT) : SQLITE_OK);
+    }
+
+    // Returns whether another row was produced.
+    bool Step() {
+        if (!m_ok) {
+            return false;
+        }
+        const int res = sqlite3_step(m_stmt);
+        if (res == SQLITE_ROW) {
+            return true;
+        }
+        Check(res == SQLITE_DONE ? SQLITE_OK : res);
+        return false;
+    }
+
+    // Runs a statement which returns no rows, returning whether it succeeded.
+    bool Exec() {
+        Step();
+        return m_ok;
+    }
+
+    int64_t Int(int col) const { return sqlite3_column_int64(m_stmt, col); }
+    double Real(int col) const { return sqlite3_column_double(m_stmt, col); }
+    std::string Text(int col) const {
+        return std::string((const char*)sqlite3_column_text(m_stmt, col), sqlite3_column_bytes(m_stmt, col));
+    }
+    bool Hash(int col, uint256& hash) {
+        if (sqlite3_column_bytes(m_stmt, col) != 32) {
+            LogError() << "Expected 32-byte hash in column " << col << ".  Got something else.";
+            LogError() << "Offending SQL: " << m_sql;
+            m_ok = false;
+            return false;
+        }
+        const unsigned char* data = (const unsigned char*)sqlite3_column_blob(m_stmt, col);
+        std::copy(data, data + 32, hash.begin());
+        return true;
+    }
+
+private:
+    Statement& Check(int res) {
+        if (res != SQLITE_OK) {
+            LogError() << sqlite3_errmsg(m_db) << " (" << res << ")";
+            LogError() << "Offending SQL: " << m_sql;
+            m_ok = false;
+        }
+        return *this;
+    }
+
+    sqlite3* m_db;
+    const std::string& m_sql;
+    sqlite3_stmt* m_stmt;
+    bool m_ok;
+    int m_index = 0;
+};
+
+SqliteStorage::~SqliteStorage()
+{
+    Close();
+}
+
+bool SqliteStorage::Open(const std::string& path)
+{
+    if (m_db) {
+        return false;
+    }
+    int res = sqlite3_open_v2(path.c_str(), &m_db, SQLITE_OPEN_READWRITE | SQLITE_OPEN_CREATE | SQLITE_OPEN_NOMUTEX, nullptr);
+    if (res != SQLITE_OK) {
+        LogError() << "Unable to open database " << path << ": " << sqlite3_errstr(res);
+        sqlite3_close(m_db);
+        m_db = nullptr;
+        return false;
+    }
+    m_path = path;
+    // With WAL, a commit is a single append to the log, and readers don't
+    // block the writer.  Each commit is still synced, as it is acknowledged
+    // to the caller.
+    if (!Exec("PRAGMA journal_mode=WAL") || !Exec("PRAGMA synchronous=FULL")) {
+        sqlite3_close(m_db);
+        m_db = nullptr;
+        return false;
+    }
+    m_stop = false;
+    m_thread = std::thread(&SqliteStorage::ThreadLoop, this);
+    return true;
+}
+
+void SqliteStorage::Close()
+{
+    if (!m_db) {
+        return;
+    }
+    {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        m_stop = true;
+    }
+    m_cv.notify_all();
+    m_thread.join();
+    for (auto& item : m_statements) {
+        sqlite3_finalize(item.second);
+    }
+    m_statements.clear();
+    sqlite3_close(m_db);
+    m_db = nullptr;
+}
+
+void SqliteStorage::Run(std::function<void ()> job)
+{
+    {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        m_jobs.push_back(std::move(job));
+    }
+    m_cv.notify_one();
+}
+
+bool SqliteStorage::RunAndWait(std::function<bool ()> job)
+{
+    std::promise<bool> done;
+    Run([&]() {
+        done.set_value(job());
+    });
+    return done.get_future().get();
+}
+
+void SqliteStorage::ThreadLoop()
+{
+    while (true) {
+        std::function<void ()> job;
+        {
+            std::unique_lock<std::mutex> lock(m_mutex);
+            m_cv.wait(lock, [this] { return m_stop || !m_jobs.empty(); });
+            if (m_jobs.empty()) {
+                return;
+            }
+            job = std::move(m_jobs.front());
+            m_jobs.pop_front();
+        }
+        job();
+    }
+}
+
+bool SqliteStorage::Exec(const std::string& sql)
+{
+    char* errmsg = nullptr;
+    if (sqlite3_exec(m_db, sql.c_str(), nullptr, nullptr, &errmsg) != SQLITE_OK) {
+        LogError() << (errmsg ? errmsg : sqlite3_errmsg(m_db));
+        LogError() << "Offending SQL: " << sql;
+        sqlite3_free(errmsg);
+        return false;
+    }
+    return true;
+}
+
+sqlite3_stmt* SqliteStorage::Prepare(const std::string& sql)
+{
+    auto itr = m_statements.find(sql);
+    if (itr != m_statements.end()) {
+        return itr->second;
+    }
+    sqlite3_stmt* stmt = nullptr;
+    const int res = sqlite3_prepare_v2(m_db, sql.c_str(), sql.size(), &stmt, nullptr);
+    if (res != SQLITE_OK) {
+        LogError() << sqlite3_errmsg(m_db) << " (" << res << ")";
+        LogError() << "Offending SQL: " << sql;
+        return nullptr;
+    }
+    m_statements.emplace(sql, stmt);
+    return stmt;
+}
+
+bool SqliteStorage::CreateTables()
+{
+    // The same tables as the Postgres schema, less those only used by its
+    // options, with the hashes of unspent outputs and spent hashes as their
+    // primary keys.
+    static const std::array<std::string, 10> create_tables = {
+        "CREATE TABLE IF NOT EXISTS \"MiningReports\"("
+            "\"id\" INTEGER PRIMARY KEY NOT NULL,"
+            "\"received\" INTEGER NOT NULL,"
+            "\"preimage\" TEXT NOT NULL,"
+            "\"preimage_hash\" BLOB UNIQUE NOT NULL,"
+            "\"difficulty\" INTEGER NOT NULL,"
+            "\"next_difficulty\" INTEGER NOT NULL,"
+            "\"aggregate_work\" REAL NOT NULL)",
+        "CREATE TABLE IF NOT EXISTS \"Replacements\"("
+            "\"id\" INTEGER PRIMARY KEY NOT NULL,"
+            "\"received\" INTEGER NOT NULL)",
+        "CREATE TABLE IF NOT EXISTS \"ReplacementInputs\"("
+            "\"id\" INTEGER PRIMARY KEY NOT NULL,"
+            "\"replacement_id\" INTEGER NOT NULL REFERENCES \"Replacements\"(\"id\"),"
+            "\"hash\" BLOB NOT NULL,"
+            "\"amount\" INTEGER NOT NULL)",
+        "CREATE TABLE IF NOT EXISTS \"ReplacementOutputs\"("
+            "\"id\" INTEGER PRIMARY KEY NOT NULL,"
+            "\"replacement_id\" INTEGER NOT NULL REFERENCES \"Replacements\"(\"id\"),"
+            "\"hash\" BLOB NOT NULL,"
+            "\"amount\" INTEGER NOT NULL)",
+        "CREATE TABLE IF NOT EXISTS \"Burns\"("
+            "\"id\" INTEGER PRIMARY KEY NOT NULL,"
+            "\"received\" INTEGER NOT NULL)",
+        "CREATE TABLE IF NOT EXISTS \"BurnInputs\"("
+            "\"id\" INTEGER PRIMARY KEY NOT NULL,"
+            "\"burn_id\" INTEGER NOT NULL REFERENCES \"Burns\"(\"id\"),"
+            "\"hash\" BLOB NOT NULL,"
+            "\"amount\" INTEGER NOT NULL)",
+        "CREATE TABLE IF NOT EXISTS \"UnspentOutputs\"("
+            "\"hash\" BLOB PRIMARY KEY NOT NULL,"
+            "\"amount\" INTEGER NOT NULL) WITHOUT ROWID",
+        "CREATE TABLE IF NOT EXISTS \"SpentHashes\"("
+            "\"hash\" BLOB PRIMARY KEY NOT NULL) WITHOUT ROWID",
+        // There is a single writer, so the counters are updated in place.
+        "CREATE TABLE IF NOT EXISTS \"Summary\"("
+            "\"num_reports\" INTEGER NOT NULL,"
+            "\"num_replace\" INTEGER NOT NULL,"
+            "\"num_burn\" INTEGER NOT NULL,"
+            "\"num_unspent\" INTEGER NOT NULL,"
+            "\"total_destroyed\" INTEGER NOT NULL)",
+        "INSERT INTO \"Summary\" SELECT 0, 0, 0, 0, 0 WHERE NOT EXISTS (SELECT 1 FROM \"Summary\")",
+    };
+    for (const std::string& sql : create_tables) {
+        if (!Exec(sql)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string SqliteStorage::Transact(const std::function<std::string ()>& apply)
+{
+    if (!Exec("BEGIN IMMEDIATE")) {
+        return "sql error";
+    }
+    std::string status = apply();
+    if (status != "success") {
+        Exec("ROLLBACK");
+        return status;
+    }
+    if (!Exec("COMMIT")) {
+        Exec("ROLLBACK");
+        return "sql error";
+    }
+    return status;
+}
+
+std::string SqliteStorage::CheckInputsExist(const std::vector<PublicWebcash>& inputs)
+{
+    static const std::string sql = "SELECT \"amount\" FROM \"UnspentOutputs\" WHERE \"hash\" = ?";
+    for (const PublicWebcash& input : inputs) {
+        Statement stmt(*this, sql);
+        const bool found = stmt.Bind(input.pk).Step();
+        if (!stmt.ok()) {
+            return "sql error";
+        }
+        if (!found || stmt.Int(0) != input.amount.i64) {
+            LogError() << "One or more specified input values not found in database.";
+            return "input(s) not found";
+        }
+    }
+    return "success";
+}
+
+std::string SqliteStorage::CheckOutputsDoNotExist(const std::vector<PublicWebcash>& outputs)
+{
+    static const std::string sql = "SELECT 1 FROM \"UnspentOutputs\" WHERE \"hash\" = ?";
+    for (const PublicWebcash& output : outputs) {
+        Statement stmt(*this, sql);
+        const bool found = stmt.Bind(output.pk).Step();
+        if (!stmt.ok()) {
+            return "sql error";
+        }
+        if (found) {
+            return "output(s) already exists";
+        }
+    }
+    return "success";
+}
+
+std::string SqliteStorage::SpendInputs(const std::vector<PublicWebcash>& inputs)
+{
+    static const std::string sql_spend = "INSERT OR IGNORE INTO \"SpentHashes\" (\"hash\") VALUES(?)";
+    static const std::string sql_delete = "DELETE FROM \"UnspentOutputs\" WHERE \"hash\" = ?";
+    for (const PublicWebcash& input : inputs) {
+        if (!Statement(*this, sql_spend).Bind(input.pk).Exec() || !Statement(*this, sql_delete).Bind(input.pk).Exec()) {
+            return "sql error";
+        }
+    }
+    return "success";
+}
+
+std::string SqliteStorage::CreateOutputs(const std::vector<PublicWebcash>& outputs)
+{
+    static const std::string sql = "INSERT INTO \"UnspentOutputs\" (\"hash\", \"amount\") VALUES(?, ?)";
+    for (const PublicWebcash& output : outputs) {
+        if (!Statement(*this, sql).Bind(output.pk).Bind(output.amount.i64).Exec()) {
+            return "sql error";
+        }
+    }
+    return "success";
+}
+
+std::string SqliteStorage::UpdateSummary(int64_t num_reports, int64_t num_replace, int64_t num_burn, int64_t num_unspent, int64_t total_destroyed)
+{
+    static const std::string sql = "UPDATE \"Summary\" SET \"num_reports\" = \"num_reports\" + ?, \"num_replace\" = \"num_replace\" + ?, \"num_burn\" = \"num_burn\" + ?, \"num_unspent\" = \"num_unspent\" + ?, \"total_destroyed\" = \"total_destroyed\" + ?";
+    Statement stmt(*this, sql);
+    if (!stmt.Bind(num_reports).Bind(num_replace).Bind(num_burn).Bind(num_unspent).Bind(total_destroyed).Exec()) {
+        return "sql error";
+    }
+    return "success";
+}
+
+bool SqliteStorage::Load(
+    Counts& counts,
+    Tip& tip,
+    const std::function<void (const uint256& hash)>& preimage,
+    const std::function<void (const uint256& hash, Amount amount)>& unspent,
+    const std::function<void (const uint256& hash)>& spent
+){
+    return RunAndWait([&]() {
+        if (!CreateTables()) {
+            return false;
+        }
+        {
+            Statement stmt(*this, "SELECT \"num_reports\", \"num_replace\", \"num_burn\", \"num_unspent\", \"total_destroyed\" FROM \"Summary\"");
+            if (!stmt.Step()) {
+                return false;
+            }
+            counts.num_reports = stmt.Int(0);
+            counts.num_replace = stmt.Int(1);
+            counts.num_burn = stmt.Int(2);
+            counts.num_unspent = stmt.Int(3);
+            counts.total_destroyed = stmt.Int(4);
+        }
+        tip = Tip();
+        {
+            Statement stmt(*this, "SELECT \"received\" FROM \"MiningReports\" ORDER BY \"id\" ASC LIMIT 1");
+            if (stmt.Step()) {
+                tip.has_reports = true;
+                tip.genesis = absl::FromUnixNanos(stmt.Int(0));
+            }
+            if (!stmt.ok()) {
+                return false;
+            }
+        }
+        if (tip.has_reports) {
+            Statement stmt(*this, "SELECT \"received\", \"difficulty\", \"next_difficulty\", \"aggregate_work\" FROM \"MiningReports\" ORDER BY \"id\" DESC LIMIT 1");
+            if (!stmt.Step()) {
+                return false;
+            }
+            tip.last_received = absl::FromUnixNanos(stmt.Int(0));
+            tip.last_difficulty = stmt.Int(1);
+            tip.next_difficulty = stmt.Int(2);
+            tip.aggregate_work = stmt.Real(3);
+        }
+        uint256 hash;
+        {
+            Statement stmt(*this, "SELECT \"preimage_hash\" FROM \"MiningReports\"");
+            while (stmt.Step() && stmt.Hash(0, hash)) {
+                preimage(hash);
+            }
+            if (!stmt.ok()) {
+                return false;
+            }
+        }
+        {
+            Statement stmt(*this, "SELECT \"hash\", \"amount\" FROM \"UnspentOutputs\"");
+            while (stmt.Step() && stmt.Hash(0, hash)) {
+                unspent(hash, Amount(stmt.Int(1)));
+            }
+            if (!stmt.ok()) {
+                return false;
+            }
+        }
+        {
+            Statement stmt(*this, "SELECT \"hash\" FROM \"SpentHashes\"");
+            while (stmt.Step() && stmt.Hash(0, hash)) {
+                spent(hash);
+            }
+            if (!stmt.ok()) {
+                return false;
+            }
+        }
+        return true;
+    });
+}
+
+bool SqliteStorage::Reset()
+{
+    return RunAndWait([this]() {
+        // The statements are prepared again against the new tables.
+        for (auto& item : m_statements) {
+            sqlite3_finalize(item.second);
+        }
+        m_statements.clear();
+        static const std::array<std::string, 9> drop_tables = {
+            "DROP TABLE IF EXISTS \"Summary\"",
+            "DROP TABLE IF EXISTS \"SpentHashes\"",
+            "DROP TABLE IF EXISTS \"UnspentOutputs\"",
+            "DROP TABLE IF EXISTS \"BurnInputs\"",
+            "DROP TABLE IF EXISTS \"Burns\"",
+            "DROP TABLE IF EXISTS \"ReplacementOutputs\"",
+            "DROP TABLE IF EXISTS \"ReplacementInputs\"",
+            "DROP TABLE IF EXISTS \"Replacements\"",
+            "DROP TABLE IF EXISTS \"MiningReports\"",
+        };
+        for (const std::string& sql : drop_tables) {
+            if (!Exec(sql)) {
+                return false;
+            }
+        }
+        return CreateTables();
+    });
+}
+
+void SqliteStorage::Replace(
+    absl::Time received,
+    std::vector<PublicWebcash> inputs,
+    std::vector<PublicWebcash> outputs,
+    Done done
+){
+    Run([this, received, inputs = std::move(inputs), outputs = std::move(outputs), done = std::move(done)]() {
+        done(Transact([&]() -> std::string {
+            std::string status = CheckInputsExist(inputs);
+            if (status != "success") {
+                return status;
+            }
+            status = CheckOutputsDoNotExist(outputs);
+            if (status != "success") {
+                LogError() << "Replacement contains existing output.  Cowardly refusing to overwrite.";
+                return status;
+            }
+            status = SpendInputs(inputs);
+            if (status != "success") {
+                return status;
+            }
+            status = CreateOutputs(outputs);
+            if (status != "success") {
+                return status;
+            }
+            if (!Statement(*this, "INSERT INTO \"Replacements\" (\"received\") VALUES(?)").Bind(absl::ToUnixNanos(received)).Exec()) {
+                return "sql error";
+            }
+            const int64_t replacement_id = sqlite3_last_insert_rowid(m_db);
+            static const std::string sql_inputs = "INSERT INTO \"ReplacementInputs\" (\"replacement_id\", \"hash\", \"amount\") VALUES(?, ?, ?)";
+            for (const PublicWebcash& input : inputs) {
+                if (!Statement(*this, sql_inputs).Bind(replacement_id).Bind(input.pk).Bind(input.amount.i64).Exec()) {
+                    return "sql error";
+                }
+            }
+            static const std::string sql_outputs = "INSERT INTO \"ReplacementOutputs\" (\"replacement_id\", \"hash\", \"amount\") VALUES(?, ?, ?)";
+            for (const PublicWebcash& output : outputs) {
+                if (!Statement(*this, sql_outputs).Bind(replacement_id).Bind(output.pk).Bind(output.amount.i64).Exec()) {
+                    return "sql error";
+                }
+            }
+            return UpdateSummary(0, 1, 0, static_cast<int64_t>(outputs.size()) - static_cast<int64_t>(inputs.size()), 0);
+        }));
+    });
+}
+
+void SqliteStorage::Burn(
+    absl::Time received,
+    std::vector<PublicWebcash> inputs,
+    Done done
+){
+    Run([this, received, inputs = std::move(inputs), done = std::move(done)]() {
+        done(Transact([&]() -> std::string {
+            std::string status = CheckInputsExist(inputs);
+            if (status != "success") {
+                return status;
+            }
+            status = SpendInputs(inputs);
+            if (status != "success") {
+                return status;
+            }
+            if (!Statement(*this, "INSERT INTO \"Burns\" (\"received\") VALUES(?)").Bind(absl::ToUnixNanos(received)).Exec()) {
+                return "sql error";
+            }
+            const int64_t burn_id = sqlite3_last_insert_rowid(m_db);
+            static const std::string sql_inputs = "INSERT INTO \"BurnInputs\" (\"burn_id\", \"hash\", \"amount\") VALUES(?, ?, ?)";
+            int64_t total = 0;
+            for (const PublicWebcash& input : inputs) {
+                if (!Statement(*this, sql_inputs).Bind(burn_id).Bind(input.pk).Bind(input.amount.i64).Exec()) {
+                    return "sql error";
+                }
+                total += input.amount.i64;
+            }
+            return UpdateSummary(0, 0, 1, -static_cast<int64_t>(inputs.size()), total);
+        }));
+    });
+}
+
+void SqliteStorage::RecordMiningReports(
+    std::vector<MiningReport> reports,
+    std::function<void (const std::string& status, const std::map<size_t, std::string>& rejected)> done
+){
+    Run([this, reports = std::move(reports), done = std::move(done)]() {
+        std::map<size_t, std::string> rejected;
+        const std::string status = Transact([&]() -> std::string {
+            static const std::string sql_preimage = "SELECT 1 FROM \"MiningReports\" WHERE \"preimage_hash\" = ?";
+            for (size_t i = 0; i < reports.size(); ++i) {
+                Statement stmt(*this, sql_preimage);
+                const bool found = stmt.Bind(reports[i].preimage_hash).Step();
+                if (!stmt.ok()) {
+                    return "sql error";
+                }
+                if (found) {
+                    LogError() << "Received duplicate MiningReport.";
+                    LogError() << "duplicate: " << reports[i].preimage;
+                    rejected[i] = "reused preimage";
+                    continue;
+                }
+                const std::string status = CheckOutputsDoNotExist(reports[i].outputs);
+                if (status == "output(s) already exists") {
+                    LogError() << "MiningReport contains existing output.  Cowardly refusing to overwrite.";
+                    rejected[i] = status;
+                } else if (status != "success") {
+                    return status;
+                }
+            }
+            if (!rejected.empty()) {
+                return "rejected";
+            }
+            static const std::string sql_report = "INSERT INTO \"MiningReports\" (\"received\", \"preimage\", \"preimage_hash\", \"difficulty\", \"next_difficulty\", \"aggregate_work\") VALUES(?, ?, ?, ?, ?, ?)";
+            int64_t num_outputs = 0;
+            for (const MiningReport& report : reports) {
+                Statement stmt(*this, sql_report);
+                stmt.Bind(absl::ToUnixNanos(report.received))
+                    .Bind(report.preimage)
+                    .Bind(report.preimage_hash)
+                    .Bind(static_cast<int64_t>(report.difficulty))
+                    .Bind(static_cast<int64_t>(report.next_difficulty))
+                    .Bind(report.aggregate_work);
+                if (!stmt.Exec()) {
+                    return "sql error";
+                }
+                const std::string status = CreateOutputs(report.outputs);
+                if (status != "success") {
+                    return status;
+                }
+                num_outputs += report.outputs.size();
+            }
+            return UpdateSummary(reports.size(), 0, 0, num_outputs, 0);
+        });
+        // The rejected reports are reported in place of the status.
+        done(rejected.empty() ? status : "success", rejected);
+    });
+}
+
+void SqliteStorage::HasPreimage(
+    const uint256& hash,
+    std::function<void (const std::string& status, bool found)> done
+){
+    Run([this, hash, done = std::move(done)]() {
+        Statement stmt(*this, "SELECT 1 FROM \"MiningReports\" WHERE \"preimage_hash\" = ?");
+        const bool found = stmt.Bind(hash).Step();
+        done(stmt.ok() ? "success" : "sql error", found);
+    });
+}
+
+void SqliteStorage::Lookup(
+    std::vector<uint256> hashes,
+    std::function<void (const std::string& status, const Uint256Map<Amount>& unspent, const Uint256Set& spent)> done
+){
+    Run([this, hashes = std::move(hashes), done = std::move(done)]() {
+        Uint256Map<Amount> unspent;
+        Uint256Set spent;
+        static const std::string sql_unspent = "SELECT \"amount\" FROM \"UnspentOutputs\" WHERE \"hash\" = ?";
+        static const std::string sql_spent = "SELECT 1 FROM \"SpentHashes\" WHERE \"hash\" = ?";
+        // Read from a single snapshot of the database.
+        if (!Exec("BEGIN")) {
+            return done("sql error", unspent, spent);
+        }
+        bool ok = true;
+        for (const uint256& hash : hashes) {
+            Statement stmt(*this, sql_unspent);
+            if (stmt.Bind(hash).Step()) {
+                unspent[hash] = Amount(stmt.Int(0));
+                continue;
+            }
+            Statement stmt_spent(*this, sql_spent);
+            if (stmt_spent.Bind(hash).Step()) {
+                spent.insert(hash);
+            }
+            if (!stmt.ok() || !stmt_spent.ok()) {
+                ok = false;
+                break;
+            }
+        }
+        Exec("COMMIT");
+        done(ok ? "success" : "sql error", unspent, spent);
+    });
+}
+
+// End of File
@@ -0,0 +1,126 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef SQLITESTORAGE_H
+#define SQLITESTORAGE_H
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "storage.h"
+
+// From sqlite3.h
+struct sqlite3;
+struct sqlite3_stmt;
+
+/**
+ * A storage backend which keeps the server's state in an embedded SQLite
+ * database (--sqlite), for single-node test networks, tests and benchmarks
+ * which would rather not run Postgres.
+ *
+ * The database is opened in WAL mode, and is only ever used by a single
+ * thread, to which every operation is queued.  SQLite allows one writer at a
+ * time anyway, so this costs no concurrency, and saves both the locking of a
+ * connection pool and SQLITE_BUSY retries.  Callbacks are called from that
+ * thread too, once their transaction has committed.
+ */
+class SqliteStorage : public Storage {
+public:
+    SqliteStorage() = default;
+    ~SqliteStorage();
+    // Non-copyable:
+    SqliteStorage(const SqliteStorage&) = delete;
+    SqliteStorage& operator=(const SqliteStorage&) = delete;
+
+    /** Opens (or creates) the database at path, and starts the thread which
+     *  uses it.  Returns false if it can't be opened. */
+    bool Open(const std::string& path);
+
+    /** Finishes whatever has been queued, then closes the database. */
+    void Close();
+
+    bool Load(
+        Counts& counts,
+        Tip& tip,
+        const std::function<void (const uint256& hash)>& preimage,
+        const std::function<void (const uint256& hash, Amount amount)>& unspent,
+        const std::function<void (const uint256& hash)>& spent) override;
+
+    bool Reset() override;
+
+    void Replace(
+        absl::Time received,
+        std::vector<PublicWebcash> inputs,
+        std::vector<PublicWebcash> outputs,
+        Done done) override;
+
+    void Burn(
+        absl::Time received,
+        std::vector<PublicWebcash> inputs,
+        Done done) override;
+
+    void RecordMiningReports(
+        std::vector<MiningReport> reports,
+        std::function<void (const std::string& status, const std::map<size_t, std::string>& rejected)> done) override;
+
+    void HasPreimage(
+        const uint256& hash,
+        std::function<void (const std::string& status, bool found)> done) override;
+
+    void Lookup(
+        std::vector<uint256> hashes,
+        std::function<void (const std::string& status, const Uint256Map<Amount>& unspent, const Uint256Set& spent)> done) override;
+
+private:
+    class Statement;
+
+    /** Queues job to be run by the database thread. */
+    void Run(std::function<void ()> job);
+    /** Runs job on the database thread, and waits for it to finish. */
+    bool RunAndWait(std::function<bool ()> job);
+    void ThreadLoop();
+
+    /** Creates the tables, if they don't exist yet. */
+    bool CreateTables();
+    /** Runs sql, which takes no parameters and returns no rows. */
+    bool Exec(const std::string& sql);
+    /** The prepared statement for sql, which is kept for reuse. */
+    sqlite3_stmt* Prepare(const std::string& sql);
+
+    /** Each returns "success", or the error to report to the caller. */
+    std::string CheckInputsExist(const std::vector<PublicWebcash>& inputs);
+    std::string CheckOutputsDoNotExist(const std::vector<PublicWebcash>& outputs);
+    std::string SpendInputs(const std::vector<PublicWebcash>& inputs);
+    std::string CreateOutputs(const std::vector<PublicWebcash>& outputs);
+    /** Adds to the counters in the Summary table. */
+    std::string UpdateSummary(int64_t num_reports, int64_t num_replace, int64_t num_burn, int64_t num_unspent, int64_t total_destroyed);
+    /** Runs apply within a transaction, which is committed if it returns
+     *  "success", and otherwise rolled back.  Returns apply's status, or the
+     *  error committing it. */
+    std::string Transact(const std::function<std::string ()>& apply);
+
+    std::string m_path;
+    sqlite3* m_db = nullptr;
+    /** Prepared statements by SQL.  Used by the database thread only. */
+    std::map<std::string, sqlite3_stmt*> m_statements;
+
+    /** Guards m_jobs and m_stop, and wakes up the database thread. */
+    std::mutex m_mutex;
+    std::condition_variable m_cv;
+    std::deque<std::function<void ()>> m_jobs;
+    bool m_stop = false;
+    std::thread m_thread;
+};
+
+#endif // SQLITESTORAGE_H
+
+// End of File
@@ -0,0 +1,121 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stdint.h>
+
+#include <functional>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "absl/time/time.h"
+
+#include "uint256.h"
+#include "uint256map.h"
+#include "webcash.h"
+
+/**
+ * The state of the server, as kept by a storage backend.  By default the
+ * request handlers talk to Postgres themselves, through drogon's database
+ * client, as a chain of statements within each transaction.  Other backends
+ * implement this interface instead, and are used when one is set in
+ * webcash::state().storage, e.g. the embedded SQLite backend (--sqlite).
+ *
+ * Each operation is a whole unit of work, which either commits or changes
+ * nothing, and calls its callback once it has, possibly from another thread.
+ * The status passed to the callback is "success", or else the error to report
+ * to the caller, as with the replace_webcash() stored procedure.
+ */
+class Storage {
+public:
+    /** The counters reported by /stats. */
+    struct Counts {
+        uint64_t num_reports = 0;
+        uint64_t num_replace = 0;
+        uint64_t num_burn = 0;
+        uint64_t num_unspent = 0;
+        uint64_t total_destroyed = 0;
+    };
+
+    /** The first and last of the mining reports, if there are any. */
+    struct Tip {
+        bool has_reports = false;
+        absl::Time genesis = absl::UnixEpoch();
+        absl::Time last_received = absl::UnixEpoch();
+        unsigned last_difficulty = 0;
+        unsigned next_difficulty = 0;
+        double aggregate_work = 0.0;
+    };
+
+    /** A mining report, as sequenced, and the outputs it creates. */
+    struct MiningReport {
+        absl::Time received;
+        std::string preimage;
+        uint256 preimage_hash;
+        unsigned difficulty = 0;
+        unsigned next_difficulty = 0;
+        double aggregate_work = 0.0;
+        std::vector<PublicWebcash> outputs;
+    };
+
+    using Done = std::function<void (const std::string& status)>;
+
+    virtual ~Storage() = default;
+
+    /** Creates or upgrades the store, and then reads back everything which
+     *  the server caches, passing each preimage hash, unspent output and
+     *  spent hash to the matching callback.  The counts are filled in
+     *  before any callback is called, and nothing else is recorded until
+     *  Load returns.  Returns false on error. */
+    virtual bool Load(
+        Counts& counts,
+        Tip& tip,
+        const std::function<void (const uint256& hash)>& preimage,
+        const std::function<void (const uint256& hash, Amount amount)>& unspent,
+        const std::function<void (const uint256& hash)>& spent) = 0;
+
+    /** Deletes everything. */
+    virtual bool Reset() = 0;
+
+    /** Spends the inputs and creates the outputs, which must balance, if every
+     *  input is unspent and none of the outputs exist. */
+    virtual void Replace(
+        absl::Time received,
+        std::vector<PublicWebcash> inputs,
+        std::vector<PublicWebcash> outputs,
+        Done done) = 0;
+
+    /** Spends the inputs, which are destroyed, if every one is unspent. */
+    virtual void Burn(
+        absl::Time received,
+        std::vector<PublicWebcash> inputs,
+        Done done) = 0;
+
+    /** Records a batch of mining reports, in order, and creates their outputs.
+     *  If any report's preimage was recorded before, or any of its outputs
+     *  exist, nothing is recorded, and rejected says why for each such report
+     *  (by index), so that the others can be sequenced again. */
+    virtual void RecordMiningReports(
+        std::vector<MiningReport> reports,
+        std::function<void (const std::string& status, const std::map<size_t, std::string>& rejected)> done) = 0;
+
+    /** Whether a mining report with this preimage hash has been recorded. */
+    virtual void HasPreimage(
+        const uint256& hash,
+        std::function<void (const std::string& status, bool found)> done) = 0;
+
+    /** Looks up which of the hashes are unspent outputs, and which spent. */
+    virtual void Lookup(
+        std::vector<uint256> hashes,
+        std::function<void (const std::string& status, const Uint256Map<Amount>& unspent, const Uint256Set& spent)> done) = 0;
+};
+
+#endif // STORAGE_H
+
+// End of File
@@ -42,7 +42,7 @@ struct secure_allocator : public std::allocator<T> {
 
     T* allocate(std::size_t n, const void* hint = 0)
     {
-        T* allocation = static_cast<T*>(LockedPoolManager::Instance().alloc(sizeof(T) * n));
+        T* allocation = static_cast<T*>(LockedPoolManager::Instance().alloc_cached(sizeof(T) * n));
         if (!allocation) {
             throw std::bad_alloc();
         }
@@ -54,7 +54,7 @@ struct secure_allocator : public std::allocator<T> {
         if (p != nullptr) {
             memory_cleanse(p, sizeof(T) * n);
         }
-        LockedPoolManager::Instance().free(p);
+        LockedPoolManager::Instance().free_cached(p, sizeof(T) * n);
     }
 };
 
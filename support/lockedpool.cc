@@ -7,6 +7,7 @@
 
 #include "support/lockedpool.h"
 #include "support/cleanse.h"
+#include "util/lockstats.h"
 
 #if defined(HAVE_CONFIG_H)
 #include <config/bitcoin-config.h>
@@ -296,7 +297,7 @@ LockedPool::~LockedPool()
 }
 void* LockedPool::alloc(size_t size)
 {
-    std::lock_guard<std::mutex> lock(mutex);
+    LOCK_GUARD(mutex);
 
     // Don't handle impossible sizes
     if (size == 0 || size > ARENA_SIZE)
@@ -318,7 +319,7 @@ void* LockedPool::alloc(size_t size)
 
 void LockedPool::free(void *ptr)
 {
-    std::lock_guard<std::mutex> lock(mutex);
+    LOCK_GUARD(mutex);
     // TODO we can do better than this linear search by keeping a map of arena
     // extents to arena, and looking up the address.
     for (auto &arena: arenas) {
@@ -332,7 +333,7 @@ void LockedPool::free(void *ptr)
 
 LockedPool::Stats LockedPool::stats() const
 {
-    std::lock_guard<std::mutex> lock(mutex);
+    LOCK_GUARD(mutex);
     LockedPool::Stats r{0, 0, 0, cumulative_bytes_locked, 0, 0};
     for (const auto &arena: arenas) {
         Arena::Stats i = arena.stats();
@@ -397,6 +398,118 @@ bool LockedPoolManager::LockingFailed()
     return true;
 }
 
+// Set once the calling thread's cache has been destroyed, as the thread exits,
+// after which whatever it frees or allocates goes through the depot.
+static thread_local bool t_cache_destroyed = false;
+
+struct LockedPoolManager::ThreadCache
+{
+    FreeList lists[NUM_SIZE_CLASSES];
+
+    ~ThreadCache()
+    {
+        t_cache_destroyed = true;
+        LockedPoolManager& manager = LockedPoolManager::Instance();
+        for (size_t index = 0; index < NUM_SIZE_CLASSES; ++index) {
+            manager.spill(lists[index], index, 0);
+        }
+    }
+};
+
+LockedPoolManager::ThreadCache* LockedPoolManager::thread_cache()
+{
+    if (t_cache_destroyed) {
+        return nullptr;
+    }
+    static thread_local ThreadCache cache;
+    return &cache;
+}
+
+void* LockedPoolManager::alloc_cached(size_t size)
+{
+    if (size == 0 || size > MAX_CACHED_SIZE) {
+        return alloc(size);
+    }
+    const size_t index = (size - 1) / ARENA_ALIGN;
+    ThreadCache* cache = thread_cache();
+    if (!cache) {
+        FreeList list;
+        if (!refill(list, index)) {
+            return nullptr;
+        }
+        FreeChunk* chunk = list.pop();
+        spill(list, index, 0);
+        return chunk;
+    }
+    FreeList& list = cache->lists[index];
+    if (!list.head && !refill(list, index)) {
+        return nullptr;
+    }
+    return list.pop();
+}
+
+void LockedPoolManager::free_cached(void *ptr, size_t size)
+{
+    if (ptr == nullptr) {
+        return;
+    }
+    if (size == 0 || size > MAX_CACHED_SIZE) {
+        free(ptr);
+        return;
+    }
+    const size_t index = (size - 1) / ARENA_ALIGN;
+    FreeChunk* chunk = static_cast<FreeChunk*>(ptr);
+    ThreadCache* cache = thread_cache();
+    if (!cache) {
+        LOCK_GUARD(depot_mutex);
+        depot[index].push(chunk);
+        return;
+    }
+    FreeList& list = cache->lists[index];
+    list.push(chunk);
+    // Keep half, so that alternating frees and allocations don't move chunks
+    // back and forth.
+    if (list.count > MAX_CACHED_CHUNKS) {
+        spill(list, index, MAX_CACHED_CHUNKS / 2);
+    }
+}
+
+bool LockedPoolManager::refill(FreeList& list, size_t index)
+{
+    {
+        LOCK_GUARD(depot_mutex);
+        FreeList& shared = depot[index];
+        while (shared.head && list.count < MAX_CACHED_CHUNKS / 2) {
+            list.push(shared.pop());
+        }
+    }
+    if (list.head) {
+        return true;
+    }
+    // Only now, when the depot is empty too, is the pool itself locked.
+    char* slab = static_cast<char*>(alloc(SLAB_SIZE));
+    if (!slab) {
+        return false;
+    }
+    const size_t size = (index + 1) * ARENA_ALIGN;
+    for (size_t offset = 0; offset + size <= SLAB_SIZE; offset += size) {
+        list.push(reinterpret_cast<FreeChunk*>(slab + offset));
+    }
+    return true;
+}
+
+void LockedPoolManager::spill(FreeList& list, size_t index, size_t keep)
+{
+    if (list.count <= keep) {
+        return;
+    }
+    LOCK_GUARD(depot_mutex);
+    FreeList& shared = depot[index];
+    while (list.count > keep) {
+        shared.push(list.pop());
+    }
+}
+
 void LockedPoolManager::CreateInstance()
 {
     // Using a local static instance guarantees that the object is initialized
@@ -217,10 +217,26 @@ private:
  * LockedPoolManager instance exists before any other STL-based objects that use
  * secure_allocator are created. So instead of having LockedPoolManager also be
  * static-initialized, it is created on demand.
+ *
+ * Small chunks, such as those of SecureString, are handed out by per-thread free
+ * lists of fixed size classes (see alloc_cached), so that threads allocating
+ * secrets concurrently don't serialize on the pool's mutex.  The lists are
+ * carved from slabs of the pool, which are never returned to it.
  */
 class LockedPoolManager : public LockedPool
 {
 public:
+    /** Chunks of up to this size are served from per-thread caches. */
+    static const size_t MAX_CACHED_SIZE = 256;
+    /** Size classes of the caches, one per multiple of ARENA_ALIGN. */
+    static const size_t NUM_SIZE_CLASSES = MAX_CACHED_SIZE / ARENA_ALIGN;
+    /** Size of the slabs taken from the pool to split into small chunks. */
+    static const size_t SLAB_SIZE = 4096;
+    /** Most free chunks of each size class a thread keeps, beyond which half
+     * are moved to the shared depot, for other threads to use.
+     */
+    static const size_t MAX_CACHED_CHUNKS = 64;
+
     /** Return the current instance, or create it once */
     static LockedPoolManager& Instance()
     {
@@ -229,9 +245,56 @@ public:
         return *LockedPoolManager::_instance;
     }
 
+    /** Allocate size bytes, as with alloc.  Small sizes are served from a free
+     * list of the calling thread, without taking any lock, which is refilled
+     * from the shared depot, or from a new slab of the pool, when it runs
+     * out.  The chunk must be freed with free_cached, with the same size.
+     */
+    void* alloc_cached(size_t size);
+
+    /** Free a chunk allocated with alloc_cached(size).  Small chunks are kept
+     * by the calling thread, for reuse.  Freeing the zero pointer has no
+     * effect.
+     */
+    void free_cached(void *ptr, size_t size);
+
 private:
     explicit LockedPoolManager(std::unique_ptr<LockedPageAllocator> allocator);
 
+    /** A free chunk, linked through its first bytes. */
+    struct FreeChunk
+    {
+        FreeChunk* next;
+    };
+
+    /** A list of free chunks of one size class. */
+    struct FreeList
+    {
+        FreeChunk* head = nullptr;
+        size_t count = 0;
+
+        void push(FreeChunk* chunk) { chunk->next = head; head = chunk; ++count; }
+        FreeChunk* pop() { FreeChunk* chunk = head; head = chunk->next; --count; return chunk; }
+    };
+
+    /** The free lists of a thread, which returns them to the depot when it
+     * exits.
+     */
+    struct ThreadCache;
+    /** The calling thread's cache, or nullptr once it has been destroyed. */
+    static ThreadCache* thread_cache();
+
+    /** Refill list, of size class index, from the depot or a new slab.
+     * Returns false if no memory is left.
+     */
+    bool refill(FreeList& list, size_t index);
+    /** Move chunks from list to the depot, until at most keep are left. */
+    void spill(FreeList& list, size_t index, size_t keep);
+
+    /** Free chunks given up by threads, by size class. */
+    FreeList depot[NUM_SIZE_CLASSES];
+    std::mutex depot_mutex;
+
     /** Create a new LockedPoolManager specialized to the OS */
     static void CreateInstance();
     /** Called when locking fails, warn the user here */
@@ -10,6 +10,7 @@
 #define BITCOIN_SYNC_H
 
 #include "threadsafety.h"
+#include "util/lockstats.h"
 #include "util/macros.h"
 
 #include <iostream>
@@ -136,9 +137,16 @@ template <typename Mutex, typename Base = typename Mutex::UniqueLock>
 class SCOPED_LOCKABLE UniqueLock : public Base
 {
 private:
+    LockSite* m_site = nullptr;
+    int64_t m_acquired = 0;
+
     void Enter(const char* pszName, const char* pszFile, int nLine)
     {
         EnterCritical(pszName, pszFile, nLine, Base::mutex());
+        if (m_site) {
+            m_acquired = m_site->Lock(static_cast<Base&>(*this));
+            return;
+        }
         if (Base::try_lock()) return;
 #if DEBUG
         std::cerr << "lock contention " << pszName << ", " << pszFile << ":" << nLine << std::endl;
@@ -152,12 +160,14 @@ private:
         Base::try_lock();
         if (!Base::owns_lock()) {
             LeaveCritical();
+        } else if (m_site) {
+            m_acquired = m_site->Locked();
         }
         return Base::owns_lock();
     }
 
 public:
-    UniqueLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) EXCLUSIVE_LOCK_FUNCTION(mutexIn) : Base(mutexIn, std::defer_lock)
+    UniqueLock(Mutex& mutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false, LockSite* site = nullptr) EXCLUSIVE_LOCK_FUNCTION(mutexIn) : Base(mutexIn, std::defer_lock), m_site(site)
     {
         if (fTry)
             TryEnter(pszName, pszFile, nLine);
@@ -165,7 +175,7 @@ public:
             Enter(pszName, pszFile, nLine);
     }
 
-    UniqueLock(Mutex* pmutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false) EXCLUSIVE_LOCK_FUNCTION(pmutexIn)
+    UniqueLock(Mutex* pmutexIn, const char* pszName, const char* pszFile, int nLine, bool fTry = false, LockSite* site = nullptr) EXCLUSIVE_LOCK_FUNCTION(pmutexIn) : m_site(site)
     {
         if (!pmutexIn) return;
 
@@ -178,8 +188,11 @@ public:
 
     ~UniqueLock() UNLOCK_FUNCTION()
     {
-        if (Base::owns_lock())
+        if (Base::owns_lock()) {
+            if (m_site)
+                m_site->Unlocked(m_acquired);
             LeaveCritical();
+        }
     }
 
     operator bool()
@@ -228,12 +241,12 @@ public:
 template<typename MutexArg>
 using DebugLock = UniqueLock<typename std::remove_reference<typename std::remove_pointer<MutexArg>::type>::type>;
 
-#define LOCK(cs) DebugLock<decltype(cs)> PASTE2(criticalblock, __COUNTER__)(cs, #cs, __FILE__, __LINE__)
-#define LOCK2(cs1, cs2)                                               \
-    DebugLock<decltype(cs1)> criticalblock1(cs1, #cs1, __FILE__, __LINE__); \
-    DebugLock<decltype(cs2)> criticalblock2(cs2, #cs2, __FILE__, __LINE__);
-#define TRY_LOCK(cs, name) DebugLock<decltype(cs)> name(cs, #cs, __FILE__, __LINE__, true)
-#define WAIT_LOCK(cs, name) DebugLock<decltype(cs)> name(cs, #cs, __FILE__, __LINE__)
+#define LOCK(cs) DebugLock<decltype(cs)> PASTE2(criticalblock, __COUNTER__)(cs, #cs, __FILE__, __LINE__, false, LOCK_SITE(cs))
+#define LOCK2(cs1, cs2)                                                                         \
+    DebugLock<decltype(cs1)> criticalblock1(cs1, #cs1, __FILE__, __LINE__, false, LOCK_SITE(cs1)); \
+    DebugLock<decltype(cs2)> criticalblock2(cs2, #cs2, __FILE__, __LINE__, false, LOCK_SITE(cs2));
+#define TRY_LOCK(cs, name) DebugLock<decltype(cs)> name(cs, #cs, __FILE__, __LINE__, true, LOCK_SITE(cs))
+#define WAIT_LOCK(cs, name) DebugLock<decltype(cs)> name(cs, #cs, __FILE__, __LINE__, false, LOCK_SITE(cs))
 
 #define ENTER_CRITICAL_SECTION(cs)                            \
     {                                                         \
@@ -6,11 +6,22 @@
 
 #include <gtest/gtest.h>
 
+#include <stdio.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <future>
+#include <thread>
+
 #include <httplib.h>
 
 #include "async.h"
 #include "random.h"
 #include "server.h"
+#include "sqlitestorage.h"
+#include "sync.h"
+#include "utxocache.h"
+#include "utxosnapshot.h"
 
 // This code is copied from the server benchmarking setup and teardown code,
 // with minimal changes.  We should merge the two somehow.
@@ -33,22 +44,32 @@ static void SetupServer() {
     g_event_loop_thread = std::thread([&]() {
         // Disable logging
         webcash::state().logging = false;
-        // Create the database connection
         int num_workers = get_num_workers();
-        drogon::app().createDbClient(
-            "postgresql", // dbType
-            "localhost", // host
-            5432,        // port
-            "postgres",  // databaseName
-            "postgres",  // username
-            "mysecretpassword",  // password
-            num_workers, // connectionNum
-            "server_test", // filename
-            "default",   // name
-            false,       // isFast
-            "utf8",      // characterSet
-            10.0         // timeout
-        );
+        // Keep the server's state in an embedded SQLite database, so that no
+        // database server is needed, unless WEBCASHD_POSTGRES is set.
+        if (!std::getenv("WEBCASHD_POSTGRES")) {
+            auto storage = std::make_shared<SqliteStorage>();
+            if (!storage->Open(testing::TempDir() + "server_test.db")) {
+                std::abort();
+            }
+            webcash::state().storage = storage;
+        } else {
+            // Create the database connection
+            drogon::app().createDbClient(
+                "postgresql", // dbType
+                "localhost", // host
+                5432,        // port
+                "postgres",  // databaseName
+                "postgres",  // username
+                "mysecretpassword",  // password
+                num_workers, // connectionNum
+                "server_test", // filename
+                "default",   // name
+                false,       // isFast
+                "utf8",      // characterSet
+                10.0         // timeout
+            );
+        }
         // Setup the database
         webcash::upgradeDb();
         // Configure the number of worker threads
@@ -95,6 +116,88 @@ TEST(server, connection) {
     EXPECT_EQ(r->status, 200);
 }
 
+TEST(server, target_wait) {
+    // Setup server and begin listening
+    SetupServer();
+    // Setup RPC client to communicate with server
+    httplib::Client cli("http://localhost:8000");
+    cli.set_read_timeout(60, 0); // 60 seconds
+    cli.set_write_timeout(60, 0); // 60 seconds
+    // A stale version is answered immediately, with the current target.
+    const std::string version = TargetNotifier::getCurrentVersion();
+    auto r = cli.Get("/api/v1/target/wait?version=0:0");
+    ASSERT_NE(r, nullptr);
+    EXPECT_EQ(r->status, 200);
+    EXPECT_NE(r->body.find("\"" + version + "\""), std::string::npos);
+    // The current version is held until the target changes.
+    auto f = std::async(std::launch::async, [&]() {
+        return cli.Get(("/api/v1/target/wait?version=" + version).c_str());
+    });
+    while (!webcash::targets().numWaiting()) {
+        absl::SleepFor(absl::Milliseconds(10));
+    }
+    webcash::targets().notify();
+    r = f.get();
+    ASSERT_NE(r, nullptr);
+    EXPECT_EQ(r->status, 200);
+    EXPECT_EQ(webcash::targets().numWaiting(), 0);
+}
+
+TEST(server, cached_response) {
+    // Setup server and begin listening
+    SetupServer();
+    // Setup RPC client to communicate with server
+    httplib::Client cli("http://localhost:8000");
+    cli.set_read_timeout(60, 0); // 60 seconds
+    cli.set_write_timeout(60, 0); // 60 seconds
+    // The target is sent with its ETag.
+    auto r = cli.Get("/api/v1/target");
+    ASSERT_NE(r, nullptr);
+    EXPECT_EQ(r->status, 200);
+    const std::string etag = r->get_header_value("ETag");
+    EXPECT_EQ(etag.size(), 34);
+    // A request which already has it gets 304 Not Modified, with no body.
+    r = cli.Get("/api/v1/target", {{"If-None-Match", etag}});
+    ASSERT_NE(r, nullptr);
+    EXPECT_EQ(r->status, 304);
+    EXPECT_TRUE(r->body.empty());
+    // Any other ETag gets the whole response again.
+    r = cli.Get("/api/v1/target", {{"If-None-Match", "\"0\""}});
+    ASSERT_NE(r, nullptr);
+    EXPECT_EQ(r->status, 200);
+    EXPECT_FALSE(r->body.empty());
+}
+
+TEST(server, admission_control) {
+    // Setup server, whose event loop admits queued requests
+    SetupServer();
+    AdmissionControl high;
+    AdmissionControl low(&high);
+    high.setLimits(1, 1);
+    // The first request is admitted immediately, and the second is queued.
+    AdmissionControl::Ticket first;
+    EXPECT_TRUE(high.admit([&](AdmissionControl::Ticket ticket) { first = ticket; }));
+    EXPECT_NE(first, nullptr);
+    std::promise<AdmissionControl::Ticket> p;
+    auto f = p.get_future();
+    EXPECT_TRUE(high.admit([&](AdmissionControl::Ticket ticket) { p.set_value(ticket); }));
+    EXPECT_EQ(high.numInFlight(), 1);
+    EXPECT_EQ(high.numQueued(), 1);
+    // Once the queue is full requests are turned away, and the lower
+    // priority endpoint yields while anything is queued.
+    EXPECT_FALSE(high.admit([](AdmissionControl::Ticket) {}));
+    EXPECT_FALSE(low.admit([](AdmissionControl::Ticket) {}));
+    // Releasing the first slot admits the queued request.
+    first.reset();
+    AdmissionControl::Ticket second = f.get();
+    EXPECT_EQ(high.numInFlight(), 1);
+    EXPECT_EQ(high.numQueued(), 0);
+    EXPECT_TRUE(low.admit([](AdmissionControl::Ticket) {}));
+    EXPECT_EQ(low.numInFlight(), 0);
+    second.reset();
+    EXPECT_EQ(high.numInFlight(), 0);
+}
+
 TEST(server, stats) {
     // Setup server and begin listening
     SetupServer();
@@ -568,4 +671,377 @@ TEST(server, drop_webcash) {
     EXPECT_EQ(stats.total_destroyed, 19000000000000ULL);
 }
 
+TEST(server, utxo_cache_journal) {
+    uint256 a, b, c;
+    a.data()[0] = 1;
+    b.data()[0] = 2;
+    c.data()[0] = 3;
+    UtxoCache cache;
+    cache.Clear();
+    // A replacement of a for b commits while the load is reading a stale
+    // copy of the tables, in which a is still unspent.
+    cache.Spend(a);
+    cache.AddUnspent(b, Amount(100));
+    cache.LoadUnspent(a, Amount(100));
+    cache.LoadUnspent(c, Amount(300));
+    EXPECT_FALSE(cache.IsReady());
+    cache.SetReady();
+    EXPECT_TRUE(cache.IsReady());
+    Amount amount;
+    EXPECT_EQ(cache.Lookup(a, amount), UtxoCache::Status::SPENT);
+    EXPECT_EQ(cache.Lookup(b, amount), UtxoCache::Status::UNSPENT);
+    EXPECT_EQ(amount, Amount(100));
+    EXPECT_EQ(cache.Lookup(c, amount), UtxoCache::Status::UNSPENT);
+    EXPECT_EQ(amount, Amount(300));
+    // Once ready, changes are applied straight away.
+    cache.Spend(b);
+    EXPECT_EQ(cache.Lookup(b, amount), UtxoCache::Status::SPENT);
+}
+
+TEST(server, group_commit) {
+    // Setup server and begin listening
+    SetupServer();
+    // Without --sqlite, replacements and burns are committed in batches.
+    webcash::state().group_commit = true;
+
+    // Submit an initial solution to generate some webcash for use.
+    httplib::Client cli("http://localhost:8000");
+    cli.set_read_timeout(60, 0); // 60 seconds
+    cli.set_write_timeout(60, 0); // 60 seconds
+    static const std::string preimage = absl::Base64Escape("{\"legalese\": {\"terms\": true}, \"webcash\": [\"e190000:secret:b0e7525b420bc6efa5c356d0bb707d96a9d599c5c218134bd0f1dc5cf107e213\", \"e10000:secret:301b4fe3587ac6a871c6c7d4e06595d4eab9572a0515fe7295067d4e52772ed2\"], \"subsidy\": [\"e10000:secret:301b4fe3587ac6a871c6c7d4e06595d4eab9572a0515fe7295067d4e52772ed2\"], \"difficulty\": 28, \"nonce\":      1366624}");
+    auto r = cli.Post(
+        "/api/v1/mining_report",
+        absl::StrCat("{"
+            "\"preimage\": \"", preimage, "\","
+            "\"legalese\": {"
+                "\"terms\": true"
+            "}"
+        "}"),
+        "application/json");
+    ASSERT_NE(r, nullptr);
+    EXPECT_EQ(r->status, 200);
+
+    // Two replacements of the same input, and a burn of the other, all at
+    // once.  The replacements conflict, so can't share a batch, and only the
+    // first to be committed succeeds.
+    auto post = [](std::string path, std::string body) {
+        httplib::Client cli("http://localhost:8000");
+        cli.set_read_timeout(60, 0); // 60 seconds
+        cli.set_write_timeout(60, 0); // 60 seconds
+        auto r = cli.Post(path.c_str(), body, "application/json");
+        return r ? r->status : 0;
+    };
+    auto split = std::async(std::launch::async, post, "/api/v1/replace",
+        "{"
+            "\"legalese\": {\"terms\": true},"
+            "\"webcashes\": [\"e190000:secret:b0e7525b420bc6efa5c356d0bb707d96a9d599c5c218134bd0f1dc5cf107e213\"],"
+            "\"new_webcashes\": ["
+                "\"e95000:secret:312e701fc5cd1f0db431812c5c995d9a69d707bb0d653c5afe6cb024b5257e0b\","
+                "\"e95000:secret:ca978112ca1bbdcafac231b39a23dc4da786eff8147c4e72b9807785afee48bb\""
+            "]"
+        "}");
+    auto move = std::async(std::launch::async, post, "/api/v1/replace",
+        "{"
+            "\"legalese\": {\"terms\": true},"
+            "\"webcashes\": [\"e190000:secret:b0e7525b420bc6efa5c356d0bb707d96a9d599c5c218134bd0f1dc5cf107e213\"],"
+            "\"new_webcashes\": [\"e190000:secret:3e23e8160039594a33894f6564e1b1348bbd7a0088d42c4acb73eeaed59c009d\"]"
+        "}");
+    auto burn = std::async(std::launch::async, post, "/api/v1/burn",
+        "{"
+            "\"legalese\": {\"terms\": true},"
+            "\"destroy_webcash\": [\"e10000:secret:301b4fe3587ac6a871c6c7d4e06595d4eab9572a0515fe7295067d4e52772ed2\"]"
+        "}");
+    const int split_status = split.get();
+    const int move_status = move.get();
+    EXPECT_EQ(burn.get(), 200);
+    EXPECT_TRUE((split_status == 200 && move_status == 500) || (split_status == 500 && move_status == 200));
+    EXPECT_EQ(webcash::state().num_replace, 1);
+    EXPECT_EQ(webcash::state().num_burn, 1);
+    WebcashStats stats = webcash::state().getStats(absl::Now());
+    EXPECT_EQ(stats.total_destroyed, 1000000000000ULL);
+
+    // Spending an output of the batch then works as usual.
+    const std::string input = split_status == 200
+        ? "e95000:secret:312e701fc5cd1f0db431812c5c995d9a69d707bb0d653c5afe6cb024b5257e0b"
+        : "e190000:secret:3e23e8160039594a33894f6564e1b1348bbd7a0088d42c4acb73eeaed59c009d";
+    EXPECT_EQ(post("/api/v1/burn", absl::StrCat("{\"legalese\": {\"terms\": true}, \"destroy_webcash\": [\"", input, "\"]}")), 200);
+    EXPECT_EQ(webcash::state().num_burn, 2);
+
+    webcash::state().group_commit = false;
+}
+
+TEST(server, metrics) {
+    // Setup server and begin listening
+    SetupServer();
+    // Setup RPC client to communicate with server
+    httplib::Client cli("http://localhost:8000");
+    cli.set_read_timeout(60, 0); // 60 seconds
+    cli.set_write_timeout(60, 0); // 60 seconds
+    // A request without legalese is counted as an error, and by its message.
+    auto r = cli.Post("/api/v1/burn", "{\"destroy_webcash\": []}", "application/json");
+    ASSERT_NE(r, nullptr);
+    EXPECT_EQ(r->status, 500);
+    r = cli.Get("/metrics");
+    ASSERT_NE(r, nullptr);
+    EXPECT_EQ(r->status, 200);
+    EXPECT_NE(r->body.find("webcashd_requests_total{endpoint=\"burn\",code=\"500\"}"), std::string::npos);
+    EXPECT_NE(r->body.find("webcashd_errors_total{error=\"didn't accept terms\"}"), std::string::npos);
+    EXPECT_NE(r->body.find("webcashd_stage_seconds_count{endpoint=\"mining_report\",stage=\"RecordMiningReport\"}"), std::string::npos);
+}
+
+TEST(server, lock_stats) {
+    Mutex mutex;
+    auto take = [&](int64_t hold) {
+        LOCK(mutex);
+        std::this_thread::sleep_for(std::chrono::milliseconds(hold));
+    };
+    // Nothing is accounted until profiling is switched on.
+    take(0);
+    std::string out;
+    RenderLockStats(out, "test");
+    EXPECT_EQ(out.find("lock=\"mutex\""), std::string::npos);
+    SetLockProfiling(true);
+    std::thread holder(take, 50);
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    take(0);
+    holder.join();
+    SetLockProfiling(false);
+    // Both acquisitions share the one site, in take, and one waited for the
+    // other to release it.
+    const LockSite* site = LockSite::First();
+    while (site && std::string(site->name) != "mutex") {
+        site = site->next;
+    }
+    ASSERT_NE(site, nullptr);
+    EXPECT_EQ(site->acquisitions.load(), 2);
+    EXPECT_EQ(site->waits.load(), 1);
+    EXPECT_GT(site->max_wait_nanos.load(), 0);
+    EXPECT_GE(site->max_hold_nanos.load(), 50000000);
+    out.clear();
+    RenderLockStats(out, "test");
+    EXPECT_NE(out.find("test_lock_waits_total{lock=\"mutex\",site=\"server.cc:"), std::string::npos);
+}
+
+TEST(server, shard_of) {
+    ShardSet shards;
+    for (const char* name : {"shard0", "shard1", "shard2", "shard3"}) {
+        shards.add(name);
+    }
+    EXPECT_EQ(shards.size(), 4);
+    uint256 hash;
+    const std::pair<unsigned char, size_t> cases[] = {
+        {0x00, 0}, {0x3f, 0}, {0x40, 1}, {0x7f, 1}, {0x80, 2}, {0xbf, 2}, {0xc0, 3}, {0xff, 3},
+    };
+    for (const auto& item : cases) {
+        hash.data()[0] = item.first;
+        EXPECT_EQ(shards.shardOf(hash), item.second);
+    }
+    // Only the first byte matters.
+    hash.data()[31] = 0x00;
+    EXPECT_EQ(shards.shardOf(hash), 3);
+}
+
+TEST(server, sqlite_storage) {
+    const std::string path = testing::TempDir() + "webcashd_sqlite_storage.db";
+    for (const char* suffix : {"", "-wal", "-shm"}) {
+        std::remove((path + suffix).c_str());
+    }
+    auto wc = [](const char* secret, int64_t amount) {
+        SecretWebcash sk;
+        sk.parse(absl::StrCat("e", amount, ":secret:", secret));
+        return PublicWebcash(sk);
+    };
+    auto load = [](SqliteStorage& storage, Storage::Counts& counts, Storage::Tip& tip, Uint256Map<Amount>& unspent, Uint256Set& spent) {
+        unspent.clear();
+        spent.clear();
+        return storage.Load(
+            counts,
+            tip,
+            [](const uint256& hash) {},
+            [&](const uint256& hash, Amount amount) { unspent[hash] = amount; },
+            [&](const uint256& hash) { spent.insert(hash); });
+    };
+    // Waits for the callback of an operation, and returns its status.
+    struct Waiter {
+        std::promise<std::string> promise;
+        Storage::Done done() { return [this](const std::string& status) { promise.set_value(status); }; }
+        std::string get() { return promise.get_future().get(); }
+    };
+
+    Storage::Counts counts;
+    Storage::Tip tip;
+    Uint256Map<Amount> unspent;
+    Uint256Set spent;
+    {
+        SqliteStorage storage;
+        ASSERT_TRUE(storage.Open(path));
+        ASSERT_TRUE(load(storage, counts, tip, unspent, spent));
+        EXPECT_FALSE(tip.has_reports);
+        EXPECT_EQ(counts.num_reports, 0);
+
+        Storage::MiningReport report;
+        report.received = absl::FromUnixSeconds(1000);
+        report.preimage = "preimage";
+        report.preimage_hash = wc("preimage", 1).pk;
+        report.difficulty = 28;
+        report.next_difficulty = 29;
+        report.aggregate_work = 1.5;
+        report.outputs = {wc("a", 2)};
+        std::promise<std::map<size_t, std::string>> recorded;
+        storage.RecordMiningReports({report}, [&](const std::string& status, const std::map<size_t, std::string>& rejected) {
+            EXPECT_EQ(status, "success");
+            recorded.set_value(rejected);
+        });
+        EXPECT_TRUE(recorded.get_future().get().empty());
+
+        // The same preimage is rejected the second time.
+        std::promise<std::map<size_t, std::string>> duplicate;
+        storage.RecordMiningReports({report}, [&](const std::string& status, const std::map<size_t, std::string>& rejected) {
+            duplicate.set_value(rejected);
+        });
+        const auto rejected = duplicate.get_future().get();
+        ASSERT_EQ(rejected.size(), 1);
+        EXPECT_EQ(rejected.at(0), "reused preimage");
+
+        Waiter replaced;
+        storage.Replace(absl::Now(), {wc("a", 2)}, {wc("b", 1), wc("c", 1)}, replaced.done());
+        EXPECT_EQ(replaced.get(), "success");
+        Waiter respent;
+        storage.Replace(absl::Now(), {wc("a", 2)}, {wc("d", 2)}, respent.done());
+        EXPECT_EQ(respent.get(), "input(s) not found");
+        Waiter overwritten;
+        storage.Replace(absl::Now(), {wc("b", 1)}, {wc("c", 1)}, overwritten.done());
+        EXPECT_EQ(overwritten.get(), "output(s) already exists");
+        Waiter burned;
+        storage.Burn(absl::Now(), {wc("b", 1)}, burned.done());
+        EXPECT_EQ(burned.get(), "success");
+
+        std::promise<void> looked_up;
+        storage.Lookup({wc("a", 2).pk, wc("c", 1).pk, wc("d", 2).pk}, [&](const std::string& status, const Uint256Map<Amount>& unspent, const Uint256Set& spent) {
+            EXPECT_EQ(status, "success");
+            EXPECT_EQ(unspent.size(), 1);
+            EXPECT_EQ(unspent.count(wc("c", 1).pk), 1);
+            EXPECT_EQ(spent.size(), 1);
+            EXPECT_EQ(spent.count(wc("a", 2).pk), 1);
+            looked_up.set_value();
+        });
+        looked_up.get_future().get();
+    }
+
+    // Everything is read back once the database is opened again.
+    SqliteStorage storage;
+    ASSERT_TRUE(storage.Open(path));
+    ASSERT_TRUE(load(storage, counts, tip, unspent, spent));
+    EXPECT_EQ(counts.num_reports, 1);
+    EXPECT_EQ(counts.num_replace, 1);
+    EXPECT_EQ(counts.num_burn, 1);
+    EXPECT_EQ(counts.num_unspent, 1);
+    EXPECT_EQ(counts.total_destroyed, wc("b", 1).amount.i64);
+    EXPECT_TRUE(tip.has_reports);
+    EXPECT_EQ(tip.genesis, absl::FromUnixSeconds(1000));
+    EXPECT_EQ(tip.next_difficulty, 29);
+    EXPECT_EQ(tip.aggregate_work, 1.5);
+    EXPECT_EQ(unspent.size(), 1);
+    EXPECT_EQ(spent.size(), 2);
+
+    ASSERT_TRUE(storage.Reset());
+    ASSERT_TRUE(load(storage, counts, tip, unspent, spent));
+    EXPECT_FALSE(tip.has_reports);
+    EXPECT_EQ(counts.num_unspent, 0);
+    EXPECT_TRUE(unspent.empty());
+    EXPECT_TRUE(spent.empty());
+}
+
+TEST(server, utxo_snapshot) {
+    const std::string path = testing::TempDir() + "utxo_snapshot.bin";
+    uint256 a, b, c;
+    a.data()[0] = 1;
+    b.data()[0] = 2;
+    c.data()[0] = 3;
+    UtxoSnapshot::Counts counts;
+    counts.num_reports = 1;
+    counts.num_replace = 2;
+    counts.num_unspent = 2;
+    {
+        UtxoSnapshotWriter writer;
+        ASSERT_TRUE(writer.Open(path, counts));
+        EXPECT_TRUE(writer.AddUnspent(a, Amount(100)));
+        EXPECT_TRUE(writer.AddUnspent(c, Amount(300)));
+        // Hashes have to be added in order.
+        EXPECT_FALSE(writer.AddUnspent(b, Amount(200)));
+        EXPECT_TRUE(writer.AddSpent(b));
+        EXPECT_FALSE(writer.AddUnspent(b, Amount(200)));
+        ASSERT_TRUE(writer.Commit());
+    }
+
+    UtxoSnapshot snapshot;
+    ASSERT_TRUE(snapshot.Open(path));
+    EXPECT_EQ(snapshot.GetCounts().num_reports, 1);
+    EXPECT_EQ(snapshot.GetCounts().num_replace, 2);
+    EXPECT_EQ(snapshot.GetCounts().num_unspent, 2);
+    EXPECT_EQ(snapshot.NumUnspent(), 2);
+    EXPECT_EQ(snapshot.NumSpent(), 1);
+    Amount amount;
+    EXPECT_EQ(snapshot.Lookup(c, amount), UtxoCache::Status::UNSPENT);
+    EXPECT_EQ(amount, Amount(300));
+    EXPECT_EQ(snapshot.Lookup(b, amount), UtxoCache::Status::SPENT);
+    EXPECT_EQ(snapshot.Lookup(uint256(), amount), UtxoCache::Status::UNKNOWN);
+
+    UtxoCache cache;
+    snapshot.LoadInto(cache);
+    EXPECT_EQ(cache.NumUnspent(), 2);
+    EXPECT_EQ(cache.NumSpent(), 1);
+    EXPECT_EQ(cache.Lookup(a, amount), UtxoCache::Status::UNSPENT);
+    EXPECT_EQ(amount, Amount(100));
+
+    // A corrupt snapshot fails its checksum.
+    FILE* file = fopen(path.c_str(), "r+b");
+    ASSERT_NE(file, nullptr);
+    fseek(file, UtxoSnapshot::k_header_size + 32, SEEK_SET);
+    fputc(0xff, file);
+    fclose(file);
+    UtxoSnapshot corrupt;
+    EXPECT_FALSE(corrupt.Open(path));
+    remove(path.c_str());
+}
+
+TEST(server, parse_secret_webcashes) {
+    std::vector<PublicWebcash> webcash;
+    {
+        JsonScanner in("[\"e1:secret:b\", \"e2:secret:a\", \"e3:secret:\\u0063\"]");
+        EXPECT_TRUE(parse_secret_webcashes(in, webcash));
+        EXPECT_TRUE(in.AtEnd());
+    }
+    ASSERT_EQ(webcash.size(), 3);
+    EXPECT_TRUE(std::is_sorted(webcash.begin(), webcash.end(), [](const PublicWebcash& a, const PublicWebcash& b) {
+        return a.pk < b.pk;
+    }));
+    SecretWebcash sk;
+    ASSERT_TRUE(sk.parse("e3:secret:c"));
+    EXPECT_NE(std::find(webcash.begin(), webcash.end(), PublicWebcash(sk)), webcash.end());
+
+    // Duplicates, and elements which aren't secrets, are rejected, but the
+    // rest of the request can still be read.
+    for (const char* array : {"[\"e1:secret:a\", \"e2:secret:a\"]", "[\"e1:secret:a\", 1]", "[\"e1:public:a\"]", "{}"}) {
+        const std::string body = absl::StrCat("{\"webcashes\": ", array, ", \"x\": 1}");
+        JsonScanner in(body);
+        absl::string_view key;
+        ASSERT_TRUE(in.BeginObject());
+        ASSERT_TRUE(in.NextMember(key));
+        EXPECT_FALSE(parse_secret_webcashes(in, webcash));
+        EXPECT_TRUE(webcash.empty());
+        EXPECT_TRUE(in.ok());
+        ASSERT_TRUE(in.NextMember(key));
+        EXPECT_EQ(key, "x");
+        EXPECT_TRUE(in.SkipValue());
+        EXPECT_FALSE(in.NextMember(key));
+        EXPECT_TRUE(in.AtEnd());
+    }
+
+    // A syntax error is reported by the scanner.
+    JsonScanner in("[\"e1:secret:a\",]");
+    EXPECT_FALSE(parse_secret_webcashes(in, webcash));
+    EXPECT_FALSE(in.ok());
+}
+
 // End of File
@@ -6,6 +6,9 @@
 
 #include <gtest/gtest.h>
 
+#include <thread>
+#include <vector>
+
 #include "wallet.h"
 
 TEST(amount, parse) {
@@ -71,4 +74,29 @@ TEST(amount, to_string) {
     EXPECT_EQ(to_string(Amount(3000000300)), "30.000003");
 }
 
+TEST(secure_allocator, threads) {
+    // Secrets freed by another thread than allocated them are reused by it.
+    std::vector<SecureString*> secrets;
+    std::thread([&]() {
+        for (int i = 0; i < 1000; ++i) {
+            secrets.push_back(new SecureString(64 + i % 64, 's'));
+        }
+    }).join();
+    const size_t used = LockedPoolManager::Instance().stats().used;
+    std::thread([&]() {
+        for (SecureString* sk : secrets) {
+            EXPECT_EQ((*sk)[0], 's');
+            delete sk;
+        }
+        for (int i = 0; i < 1000; ++i) {
+            SecureString sk(64 + i % 64, 't');
+            EXPECT_EQ(sk.back(), 't');
+        }
+    }).join();
+    EXPECT_EQ(LockedPoolManager::Instance().stats().used, used);
+    // Allocations too large to cache still come from the pool itself.
+    SecureString big(LockedPoolManager::MAX_CACHED_SIZE * 2, 'b');
+    EXPECT_GT(LockedPoolManager::Instance().stats().used, used);
+}
+
 // End of File
@@ -0,0 +1,44 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef UINT256MAP_H
+#define UINT256MAP_H
+
+#include <stddef.h>
+
+#include "absl/container/flat_hash_map.h"
+#include "absl/container/flat_hash_set.h"
+
+#include "uint256.h"
+
+/**
+ * Hashes a uint256 which is itself the output of SHA256, such as the hash of a
+ * webcash secret, by taking 8 of its bytes, since any 8 bytes are as good as
+ * any other.  Bytes 8 to 15 are used, as the first and last bytes pick the
+ * shard of a hash in ShardSet and UtxoCache, and so are shared by the hashes
+ * of a shard.
+ */
+struct Uint256Hasher {
+    size_t operator()(const uint256& hash) const {
+        return static_cast<size_t>(hash.GetUint64(1));
+    }
+};
+
+/**
+ * Unordered maps and sets keyed by such hashes.  These are open-addressing
+ * (Swiss) tables, which store their entries inline rather than allocating a
+ * node for each, and probe a group of slots at a time with SIMD, so that a
+ * lookup usually compares a single key.  Iteration order is unspecified, so
+ * use std::map where the entries are read back in order.
+ */
+template <typename T>
+using Uint256Map = absl::flat_hash_map<uint256, T, Uint256Hasher>;
+
+using Uint256Set = absl::flat_hash_set<uint256, Uint256Hasher>;
+
+#endif // UINT256MAP_H
+
+// End of File
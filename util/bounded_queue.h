@@ -0,0 +1,118 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef UTIL_BOUNDED_QUEUE_H
+#define UTIL_BOUNDED_QUEUE_H
+
+#include <stddef.h>
+
+#include <atomic>
+#include <memory>
+#include <utility>
+
+/**
+ * A fixed-capacity FIFO queue which any number of threads can push to and
+ * pop from without taking a lock.  Neither operation ever waits: TryPush()
+ * fails if the queue is full, and TryPop() if it is empty.
+ *
+ * This is Dmitry Vyukov's bounded MPMC queue.  Each slot carries a sequence
+ * number which tells producers and consumers whose turn it is, so that
+ * claiming a slot is a single compare-and-swap on the head or tail index.
+ */
+template <typename T>
+class BoundedQueue {
+public:
+    /** The capacity is rounded up to a power of two. */
+    explicit BoundedQueue(size_t capacity)
+    {
+        size_t size = 1;
+        while (size < capacity) {
+            size <<= 1;
+        }
+        m_mask = size - 1;
+        m_slots.reset(new Slot[size]);
+        for (size_t i = 0; i < size; ++i) {
+            m_slots[i].seq.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    BoundedQueue(const BoundedQueue&) = delete;
+    BoundedQueue& operator=(const BoundedQueue&) = delete;
+
+    /** Move value into the queue if there is room.  On failure value is
+     *  left untouched. */
+    bool TryPush(T&& value)
+    {
+        size_t pos = m_tail.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &m_slots[pos & m_mask];
+            const size_t seq = slot->seq.load(std::memory_order_acquire);
+            const ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)pos;
+            if (diff == 0) {
+                if (m_tail.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // The slot still holds the value from a lap ago.
+                return false;
+            } else {
+                pos = m_tail.load(std::memory_order_relaxed);
+            }
+        }
+        slot->value = std::move(value);
+        slot->seq.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** Move the oldest value out of the queue, if there is one. */
+    bool TryPop(T& value)
+    {
+        size_t pos = m_head.load(std::memory_order_relaxed);
+        Slot* slot;
+        while (true) {
+            slot = &m_slots[pos & m_mask];
+            const size_t seq = slot->seq.load(std::memory_order_acquire);
+            const ptrdiff_t diff = (ptrdiff_t)seq - (ptrdiff_t)(pos + 1);
+            if (diff == 0) {
+                if (m_head.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    break;
+                }
+            } else if (diff < 0) {
+                // Not yet written.
+                return false;
+            } else {
+                pos = m_head.load(std::memory_order_relaxed);
+            }
+        }
+        value = std::move(slot->value);
+        slot->value = T();
+        slot->seq.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    /** A snapshot, which may already be out of date when it returns. */
+    bool Empty() const
+    {
+        return m_head.load(std::memory_order_relaxed) == m_tail.load(std::memory_order_relaxed);
+    }
+
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> m_slots;
+    size_t m_mask;
+    // Producers and consumers each get a cache line of their own.
+    alignas(64) std::atomic<size_t> m_head{0};
+    alignas(64) std::atomic<size_t> m_tail{0};
+};
+
+#endif // UTIL_BOUNDED_QUEUE_H
+
+// End of File
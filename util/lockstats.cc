@@ -0,0 +1,90 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "util/lockstats.h"
+
+#include <stdio.h>
+
+std::atomic<bool> g_lock_profiling{false};
+
+// The registered sites, as a list which is only ever pushed onto, so that it
+// can be walked without locking.
+static std::atomic<const LockSite*> g_lock_sites{nullptr};
+
+LockSite::LockSite(const char* name_in, const char* file_in, int line_in)
+    : name(name_in), file(file_in), line(line_in)
+{
+    const LockSite* head = g_lock_sites.load(std::memory_order_relaxed);
+    do {
+        next = head;
+    } while (!g_lock_sites.compare_exchange_weak(head, this, std::memory_order_release, std::memory_order_relaxed));
+}
+
+const LockSite* LockSite::First()
+{
+    return g_lock_sites.load(std::memory_order_acquire);
+}
+
+static void UpdateMax(std::atomic<int64_t>& max, int64_t value)
+{
+    int64_t current = max.load(std::memory_order_relaxed);
+    while (value > current && !max.compare_exchange_weak(current, value, std::memory_order_relaxed)) {
+    }
+}
+
+void LockSite::AddWait(int64_t nanos)
+{
+    waits.fetch_add(1, std::memory_order_relaxed);
+    wait_nanos.fetch_add(nanos, std::memory_order_relaxed);
+    UpdateMax(max_wait_nanos, nanos);
+}
+
+void LockSite::AddHold(int64_t nanos)
+{
+    hold_nanos.fetch_add(nanos, std::memory_order_relaxed);
+    UpdateMax(max_hold_nanos, nanos);
+}
+
+void RenderLockStats(std::string& out, const std::string& prefix)
+{
+    struct Series {
+        const char* name;
+        const char* type;
+        const char* help;
+        double (*value)(const LockSite& site);
+    };
+    static const Series series[] = {
+        {"lock_acquisitions_total", "counter", "Locks taken at each site, while lock profiling is on.",
+            [](const LockSite& site) { return static_cast<double>(site.acquisitions.load()); }},
+        {"lock_waits_total", "counter", "Locks taken at each site which had to wait for another thread to release them.",
+            [](const LockSite& site) { return static_cast<double>(site.waits.load()); }},
+        {"lock_wait_seconds_total", "counter", "Time spent waiting for locks at each site.",
+            [](const LockSite& site) { return site.wait_nanos.load() * 1e-9; }},
+        {"lock_max_wait_seconds", "gauge", "Longest wait for a lock at each site.",
+            [](const LockSite& site) { return site.max_wait_nanos.load() * 1e-9; }},
+        {"lock_hold_seconds_total", "counter", "Time locks taken at each site were held.",
+            [](const LockSite& site) { return site.hold_nanos.load() * 1e-9; }},
+        {"lock_max_hold_seconds", "gauge", "Longest a lock taken at each site was held.",
+            [](const LockSite& site) { return site.max_hold_nanos.load() * 1e-9; }},
+    };
+    for (const Series& s : series) {
+        out += "# HELP " + prefix + "_" + s.name + " " + s.help + "\n";
+        out += "# TYPE " + prefix + "_" + s.name + " " + s.type + "\n";
+        for (const LockSite* site = LockSite::First(); site; site = site->next) {
+            if (!site->acquisitions.load(std::memory_order_relaxed)) {
+                continue;
+            }
+            // Only the file name, rather than the path it was compiled as.
+            std::string file = site->file;
+            file = file.substr(file.rfind('/') + 1);
+            char value[32];
+            snprintf(value, sizeof(value), "%.9g", s.value(*site));
+            out += prefix + "_" + s.name + "{lock=\"" + site->name + "\",site=\"" + file + ":" + std::to_string(site->line) + "\"} " + value + "\n";
+        }
+    }
+}
+
+// End of File
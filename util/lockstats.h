@@ -0,0 +1,148 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef UTIL_LOCKSTATS_H
+#define UTIL_LOCKSTATS_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <chrono>
+#include <string>
+#include <type_traits>
+
+#include "util/macros.h"
+
+/**
+ * Runtime lock contention accounting.  Every LOCK (and TRY_LOCK, WAIT_LOCK
+ * and LOCK_GUARD) site has a LockSite, created the first time it is reached,
+ * which counts how often the lock was taken there, how often and for how long
+ * the caller had to wait for it, and how long it was then held.
+ *
+ * Accounting is off by default, and is switched on and off at runtime with
+ * SetLockProfiling.  While off, the only cost of a lock is one relaxed
+ * atomic load.
+ */
+
+/** Whether lock sites are being accounted. */
+extern std::atomic<bool> g_lock_profiling;
+inline bool LockProfilingEnabled() { return g_lock_profiling.load(std::memory_order_relaxed); }
+inline void SetLockProfiling(bool enabled) { g_lock_profiling.store(enabled); }
+
+/** The clock which waits and holds are timed by, in nanoseconds. */
+inline int64_t LockClockNanos()
+{
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+class LockSite
+{
+public:
+    /** Registers the site, which must live as long as the process. */
+    LockSite(const char* name, const char* file, int line);
+
+    LockSite(const LockSite&) = delete;
+    LockSite& operator=(const LockSite&) = delete;
+
+    /** Locks mutex (or a std::unique_lock of it), returning the time it was
+     * acquired, or 0 if profiling is off.
+     */
+    template <typename MutexType>
+    int64_t Lock(MutexType& mutex)
+    {
+        if (!LockProfilingEnabled()) {
+            mutex.lock();
+            return 0;
+        }
+        acquisitions.fetch_add(1, std::memory_order_relaxed);
+        if (mutex.try_lock()) {
+            return LockClockNanos();
+        }
+        const int64_t start = LockClockNanos();
+        mutex.lock();
+        const int64_t acquired = LockClockNanos();
+        AddWait(acquired - start);
+        return acquired;
+    }
+
+    /** Records a successful try_lock. */
+    int64_t Locked()
+    {
+        if (!LockProfilingEnabled()) {
+            return 0;
+        }
+        acquisitions.fetch_add(1, std::memory_order_relaxed);
+        return LockClockNanos();
+    }
+
+    /** Records the release of a lock acquired at the given time, as returned
+     * by Lock or Locked.
+     */
+    void Unlocked(int64_t acquired)
+    {
+        if (acquired) {
+            AddHold(LockClockNanos() - acquired);
+        }
+    }
+
+    void AddWait(int64_t nanos);
+    void AddHold(int64_t nanos);
+
+    /** The first registered site, each of which links to the next. */
+    static const LockSite* First();
+
+    const char* const name;
+    const char* const file;
+    const int line;
+
+    std::atomic<int64_t> acquisitions{0};
+    /** Acquisitions which found the lock taken, and waited for it. */
+    std::atomic<int64_t> waits{0};
+    std::atomic<int64_t> wait_nanos{0};
+    std::atomic<int64_t> max_wait_nanos{0};
+    std::atomic<int64_t> hold_nanos{0};
+    std::atomic<int64_t> max_hold_nanos{0};
+
+    const LockSite* next = nullptr;
+};
+
+/** The site of a lock, created the first time the expression is evaluated. */
+#define LOCK_SITE(cs) ([]() -> LockSite* { static LockSite site(#cs, __FILE__, __LINE__); return &site; }())
+
+/** Appends the accounting of every lock site which has been taken while
+ * profiling, as Prometheus series named prefix_lock_*, labelled by the name
+ * and source location of the site.
+ */
+void RenderLockStats(std::string& out, const std::string& prefix);
+
+/** Like std::lock_guard, for a mutex which isn't a Mutex (e.g. one in a
+ * library which can't depend on sync.h), accounted to a lock site.
+ */
+template <typename MutexType>
+class ProfiledLockGuard
+{
+public:
+    ProfiledLockGuard(MutexType& mutex, LockSite* site) : m_mutex(mutex), m_site(site), m_acquired(site->Lock(mutex)) {}
+    ~ProfiledLockGuard()
+    {
+        m_site->Unlocked(m_acquired);
+        m_mutex.unlock();
+    }
+
+    ProfiledLockGuard(const ProfiledLockGuard&) = delete;
+    ProfiledLockGuard& operator=(const ProfiledLockGuard&) = delete;
+
+private:
+    MutexType& m_mutex;
+    LockSite* const m_site;
+    const int64_t m_acquired;
+};
+
+#define LOCK_GUARD(cs) ProfiledLockGuard<std::remove_reference<decltype(cs)>::type> PASTE2(lockguard, __COUNTER__)(cs, LOCK_SITE(cs))
+
+#endif // UTIL_LOCKSTATS_H
+
+// End of File
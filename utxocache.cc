@@ -0,0 +1,150 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "utxocache.h"
+
+#include <assert.h>
+
+void UtxoCache::Clear()
+{
+    m_ready.store(false);
+    {
+        // Started before the entries are dropped, so that no change is lost
+        // in between.
+        LOCK(m_journal_mutex);
+        m_loading.store(true);
+        m_journal.clear();
+    }
+    for (Shard& shard : m_shards) {
+        LOCK(shard.mutex);
+        shard.unspent.clear();
+        shard.spent.clear();
+    }
+}
+
+void UtxoCache::SetReady()
+{
+    LOCK(m_journal_mutex);
+    // In commit order, and over whatever the load read.
+    for (const Change& change : m_journal) {
+        if (change.spent) {
+            ApplySpend(change.hash);
+        } else {
+            ApplyUnspent(change.hash, change.amount);
+        }
+    }
+    m_journal.clear();
+    m_journal.shrink_to_fit();
+    m_loading.store(false);
+    m_ready.store(true);
+}
+
+bool UtxoCache::Journal(const uint256& hash, Amount amount, bool spent)
+{
+    if (!m_loading.load()) {
+        return false;
+    }
+    LOCK(m_journal_mutex);
+    // Re-checked, since SetReady() may have finished in the meantime.
+    if (!m_loading.load()) {
+        return false;
+    }
+    m_journal.push_back(Change{hash, amount, spent});
+    return true;
+}
+
+void UtxoCache::AddUnspent(const uint256& hash, Amount amount)
+{
+    if (!Journal(hash, amount, false)) {
+        ApplyUnspent(hash, amount);
+    }
+}
+
+void UtxoCache::Spend(const uint256& hash)
+{
+    if (!Journal(hash, Amount(), true)) {
+        ApplySpend(hash);
+    }
+}
+
+void UtxoCache::LoadUnspent(const uint256& hash, Amount amount)
+{
+    assert(m_loading.load());
+    ApplyUnspent(hash, amount);
+}
+
+void UtxoCache::AddSpent(const uint256& hash)
+{
+    assert(m_loading.load());
+    if (!m_track_spent.load()) {
+        return;
+    }
+    Shard& shard = GetShard(hash);
+    LOCK(shard.mutex);
+    shard.spent.insert(hash);
+}
+
+void UtxoCache::ApplyUnspent(const uint256& hash, Amount amount)
+{
+    Shard& shard = GetShard(hash);
+    LOCK(shard.mutex);
+    shard.unspent[hash] = amount;
+}
+
+void UtxoCache::ApplySpend(const uint256& hash)
+{
+    Shard& shard = GetShard(hash);
+    LOCK(shard.mutex);
+    shard.unspent.erase(hash);
+    if (m_track_spent.load()) {
+        shard.spent.insert(hash);
+    }
+}
+
+UtxoCache::Status UtxoCache::Lookup(const uint256& hash, Amount& amount) const
+{
+    const Shard& shard = GetShard(hash);
+    LOCK(shard.mutex);
+    auto itr = shard.unspent.find(hash);
+    if (itr != shard.unspent.end()) {
+        amount = itr->second;
+        return Status::UNSPENT;
+    }
+    if (shard.spent.count(hash)) {
+        return Status::SPENT;
+    }
+    return Status::UNKNOWN;
+}
+
+size_t UtxoCache::NumUnspent() const
+{
+    size_t total = 0;
+    for (const Shard& shard : m_shards) {
+        LOCK(shard.mutex);
+        total += shard.unspent.size();
+    }
+    return total;
+}
+
+size_t UtxoCache::NumSpent() const
+{
+    size_t total = 0;
+    for (const Shard& shard : m_shards) {
+        LOCK(shard.mutex);
+        total += shard.spent.size();
+    }
+    return total;
+}
+
+namespace webcash {
+    UtxoCache& utxos()
+    {
+        static UtxoCache cache;
+        return cache;
+    }
+} // webcash
+
+// End of File
@@ -0,0 +1,139 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef UTXOCACHE_H
+#define UTXOCACHE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <array>
+#include <atomic>
+#include <vector>
+
+#include "sync.h"
+#include "uint256.h"
+#include "uint256map.h"
+#include "webcash.h"
+
+/**
+ * An in-memory copy of the UnspentOutputs and SpentHashes tables, so that
+ * balance lookups and the validity checks on replacements don't have to wait
+ * on the database.
+ *
+ * The database remains the source of truth.  The cache is loaded from it at
+ * startup, and is only written to after a transaction has committed, so it
+ * can lag behind the database (but never run ahead of it) for as long as it
+ * takes a commit callback to run.  This assumes that there is a single server
+ * process writing to the database.
+ *
+ * Requests are served while the cache is loading, so the changes they commit
+ * in the meantime are journaled, and applied over the loaded state by
+ * SetReady().  Otherwise a load which read the tables before such a commit
+ * would bring back spent outputs.
+ *
+ * Once ready, a lookup which misses is taken to mean that the output doesn't
+ * exist, without asking the database.  So the source the cache is loaded
+ * from must hold every commit which isn't journaled: it has to be read, or
+ * a replica caught up, after Clear() has started the journal, and Clear()
+ * must not be called again until SetReady().
+ *
+ * The hash space is split across independently locked shards, so that
+ * concurrent requests rarely contend with each other.
+ */
+class UtxoCache {
+public:
+    static const size_t NUM_SHARDS = 64;
+
+    enum class Status {
+        UNKNOWN,
+        UNSPENT,
+        SPENT,
+    };
+
+    UtxoCache() = default;
+    // Non-copyable:
+    UtxoCache(const UtxoCache&) = delete;
+    UtxoCache& operator=(const UtxoCache&) = delete;
+
+    /** Drop all entries and mark the cache as not ready, journaling changes
+     *  until it is loaded again. */
+    void Clear();
+
+    /** Whether the cache has been loaded from the database.  Until it has, it
+     *  must not be used to answer or reject requests. */
+    bool IsReady() const { return m_ready.load(); }
+    /** Apply the changes journaled during the load, and mark the cache as
+     *  ready. */
+    void SetReady();
+
+    /** Whether spent hashes are kept, or only unspent outputs.  When the
+     *  spent hashes are stored elsewhere (--redis), Lookup returns UNKNOWN for
+     *  them and the caller has to look there. */
+    bool IsTrackingSpent() const { return m_track_spent.load(); }
+    void SetTrackSpent(bool track_spent) { m_track_spent.store(track_spent); }
+
+    /** Record the creation of an unspent output by a committed
+     *  transaction. */
+    void AddUnspent(const uint256& hash, Amount amount);
+
+    /** Record the spending of an output by a committed transaction: it is
+     *  removed from the unspent outputs and added to the spent hashes. */
+    void Spend(const uint256& hash);
+
+    /** Load an unspent output, or a spent hash without touching the unspent
+     *  outputs, from the UnspentOutputs and SpentHashes tables.  Never
+     *  journaled, and so only allowed between Clear() and SetReady(). */
+    void LoadUnspent(const uint256& hash, Amount amount);
+    void AddSpent(const uint256& hash);
+
+    /** Look up the state of hash.  If the result is UNSPENT, amount is set to
+     *  the value of the output. */
+    Status Lookup(const uint256& hash, Amount& amount) const;
+
+    size_t NumUnspent() const;
+    size_t NumSpent() const;
+
+private:
+    struct Shard {
+        mutable Mutex mutex;
+        Uint256Map<Amount> unspent GUARDED_BY(mutex);
+        Uint256Set spent GUARDED_BY(mutex);
+    };
+
+    Shard& GetShard(const uint256& hash) { return m_shards[hash.data()[31] % NUM_SHARDS]; }
+    const Shard& GetShard(const uint256& hash) const { return m_shards[hash.data()[31] % NUM_SHARDS]; }
+
+    /** A change committed while loading. */
+    struct Change {
+        uint256 hash;
+        Amount amount;
+        bool spent;
+    };
+
+    /** Journals the change and returns true if the cache is loading. */
+    bool Journal(const uint256& hash, Amount amount, bool spent);
+    void ApplyUnspent(const uint256& hash, Amount amount);
+    void ApplySpend(const uint256& hash);
+
+    std::array<Shard, NUM_SHARDS> m_shards;
+    std::atomic<bool> m_ready{false};
+    std::atomic<bool> m_track_spent{true};
+
+    /** Set from Clear() until SetReady(), and during construction. */
+    std::atomic<bool> m_loading{true};
+    Mutex m_journal_mutex;
+    std::vector<Change> m_journal GUARDED_BY(m_journal_mutex);
+};
+
+namespace webcash {
+    /** The cache in front of the database tables of the running server. */
+    UtxoCache& utxos();
+} // webcash
+
+#endif // UTXOCACHE_H
+
+// End of File
@@ -0,0 +1,249 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "utxosnapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "crypto/common.h"
+#include "logger.h"
+
+// The first eight bytes of every snapshot, and the version of its layout.
+static const char k_magic[8] = {'W', 'C', 'U', 'T', 'X', 'O', '\r', '\n'};
+static const uint32_t k_version = 1;
+
+UtxoSnapshot::~UtxoSnapshot()
+{
+    if (m_data) {
+        munmap(const_cast<unsigned char*>(m_data), m_size);
+    }
+}
+
+bool UtxoSnapshot::Open(const std::string& path, bool verify)
+{
+    const int fd = open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+        LogError() << "Unable to open UTXO snapshot " << path << ": " << strerror(errno);
+        return false;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+        LogError() << "Unable to stat UTXO snapshot " << path << ": " << strerror(errno);
+        close(fd);
+        return false;
+    }
+    m_size = st.st_size;
+    if (m_size < k_header_size + k_footer_size) {
+        LogError() << "UTXO snapshot " << path << " is truncated.";
+        close(fd);
+        return false;
+    }
+    void* addr = mmap(nullptr, m_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (addr == MAP_FAILED) {
+        LogError() << "Unable to map UTXO snapshot " << path << ": " << strerror(errno);
+        return false;
+    }
+    m_data = static_cast<const unsigned char*>(addr);
+    // The records are read in order, and only once, to warm the cache.
+    madvise(addr, m_size, MADV_SEQUENTIAL);
+
+    if (memcmp(m_data, k_magic, sizeof(k_magic)) != 0 || ReadLE32(m_data + 8) != k_version) {
+        LogError() << path << " is not a UTXO snapshot, or is of an unknown version.";
+        return false;
+    }
+    m_counts.num_reports = ReadLE64(m_data + 16);
+    m_counts.num_replace = ReadLE64(m_data + 24);
+    m_counts.num_burn = ReadLE64(m_data + 32);
+    m_counts.num_unspent = ReadLE64(m_data + 40);
+    m_counts.total_destroyed = ReadLE64(m_data + 48);
+
+    const unsigned char* footer = m_data + m_size - k_footer_size;
+    m_num_unspent = ReadLE64(footer);
+    m_num_spent = ReadLE64(footer + 8);
+    // Checked in this order so that nonsense counts can't overflow.
+    const size_t records = m_size - k_header_size - k_footer_size;
+    if (m_num_unspent > records / k_unspent_size
+            || m_num_spent > (records - m_num_unspent * k_unspent_size) / k_spent_size
+            || m_num_unspent * k_unspent_size + m_num_spent * k_spent_size != records) {
+        LogError() << "UTXO snapshot " << path << " is truncated, or its record counts are corrupt.";
+        return false;
+    }
+
+    if (verify) {
+        unsigned char checksum[CSHA256::OUTPUT_SIZE];
+        CSHA256().Write(m_data, m_size - CSHA256::OUTPUT_SIZE).Finalize(checksum);
+        if (memcmp(checksum, footer + 16, sizeof(checksum)) != 0) {
+            LogError() << "UTXO snapshot " << path << " fails its checksum.";
+            return false;
+        }
+    }
+    return true;
+}
+
+uint256 UtxoSnapshot::UnspentHash(size_t i) const
+{
+    uint256 hash;
+    memcpy(hash.data(), UnspentRecord(i), 32);
+    return hash;
+}
+
+Amount UtxoSnapshot::UnspentAmount(size_t i) const
+{
+    return Amount(static_cast<int64_t>(ReadLE64(UnspentRecord(i) + 32)));
+}
+
+uint256 UtxoSnapshot::SpentHash(size_t i) const
+{
+    uint256 hash;
+    memcpy(hash.data(), SpentRecord(i), 32);
+    return hash;
+}
+
+UtxoCache::Status UtxoSnapshot::Lookup(const uint256& hash, Amount& amount) const
+{
+    size_t lo = 0, hi = m_num_unspent;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        const int cmp = memcmp(UnspentRecord(mid), hash.data(), 32);
+        if (cmp == 0) {
+            amount = UnspentAmount(mid);
+            return UtxoCache::Status::UNSPENT;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    lo = 0, hi = m_num_spent;
+    while (lo < hi) {
+        const size_t mid = lo + (hi - lo) / 2;
+        const int cmp = memcmp(SpentRecord(mid), hash.data(), 32);
+        if (cmp == 0) {
+            return UtxoCache::Status::SPENT;
+        }
+        if (cmp < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return UtxoCache::Status::UNKNOWN;
+}
+
+void UtxoSnapshot::LoadInto(UtxoCache& cache) const
+{
+    for (size_t i = 0; i < m_num_unspent; ++i) {
+        cache.LoadUnspent(UnspentHash(i), UnspentAmount(i));
+    }
+    if (cache.IsTrackingSpent()) {
+        for (size_t i = 0; i < m_num_spent; ++i) {
+            cache.AddSpent(SpentHash(i));
+        }
+    }
+}
+
+UtxoSnapshotWriter::~UtxoSnapshotWriter()
+{
+    if (m_file) {
+        // Never committed, so the partial snapshot is discarded.
+        fclose(m_file);
+        unlink((m_path + ".tmp").c_str());
+    }
+}
+
+bool UtxoSnapshotWriter::Open(const std::string& path, const UtxoSnapshot::Counts& counts)
+{
+    m_path = path;
+    m_file = fopen((m_path + ".tmp").c_str(), "wb");
+    if (!m_file) {
+        LogError() << "Unable to create UTXO snapshot " << m_path << ".tmp: " << strerror(errno);
+        return false;
+    }
+    unsigned char header[UtxoSnapshot::k_header_size] = {};
+    memcpy(header, k_magic, sizeof(k_magic));
+    WriteLE32(header + 8, k_version);
+    WriteLE64(header + 16, counts.num_reports);
+    WriteLE64(header + 24, counts.num_replace);
+    WriteLE64(header + 32, counts.num_burn);
+    WriteLE64(header + 40, counts.num_unspent);
+    WriteLE64(header + 48, counts.total_destroyed);
+    return Append(header, sizeof(header));
+}
+
+bool UtxoSnapshotWriter::InOrder(const uint256& hash)
+{
+    if (m_has_last && !(m_last < hash)) {
+        LogError() << "Hashes added to UTXO snapshot out of order: " << hash.GetHex() << " after " << m_last.GetHex();
+        return false;
+    }
+    m_last = hash;
+    m_has_last = true;
+    return true;
+}
+
+bool UtxoSnapshotWriter::AddUnspent(const uint256& hash, Amount amount)
+{
+    if (m_num_spent || !InOrder(hash)) {
+        return false;
+    }
+    unsigned char record[UtxoSnapshot::k_unspent_size];
+    memcpy(record, hash.data(), 32);
+    WriteLE64(record + 32, static_cast<uint64_t>(amount.i64));
+    ++m_num_unspent;
+    return Append(record, sizeof(record));
+}
+
+bool UtxoSnapshotWriter::AddSpent(const uint256& hash)
+{
+    if (!m_num_spent) {
+        // The spent hashes are ordered among themselves.
+        m_has_last = false;
+    }
+    if (!InOrder(hash)) {
+        return false;
+    }
+    ++m_num_spent;
+    return Append(hash.data(), UtxoSnapshot::k_spent_size);
+}
+
+bool UtxoSnapshotWriter::Append(const unsigned char* data, size_t len)
+{
+    m_hasher.Write(data, len);
+    if (fwrite(data, 1, len, m_file) != len) {
+        LogError() << "Unable to write UTXO snapshot " << m_path << ".tmp: " << strerror(errno);
+        return false;
+    }
+    return true;
+}
+
+bool UtxoSnapshotWriter::Commit()
+{
+    unsigned char footer[UtxoSnapshot::k_footer_size];
+    WriteLE64(footer, m_num_unspent);
+    WriteLE64(footer + 8, m_num_spent);
+    m_hasher.Write(footer, 16).Finalize(footer + 16);
+    const std::string tmp = m_path + ".tmp";
+    const bool ok = fwrite(footer, 1, sizeof(footer), m_file) == sizeof(footer)
+        && fflush(m_file) == 0
+        && fsync(fileno(m_file)) == 0;
+    fclose(m_file);
+    m_file = nullptr;
+    if (!ok || rename(tmp.c_str(), m_path.c_str()) != 0) {
+        LogError() << "Unable to write UTXO snapshot " << m_path << ": " << strerror(errno);
+        unlink(tmp.c_str());
+        return false;
+    }
+    return true;
+}
+
+// End of File
@@ -0,0 +1,131 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef UTXOSNAPSHOT_H
+#define UTXOSNAPSHOT_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#include <string>
+
+#include "crypto/sha256.h"
+#include "uint256.h"
+#include "utxocache.h"
+#include "webcash.h"
+
+/**
+ * A snapshot of the UnspentOutputs and SpentHashes tables, and of the counters
+ * in the Summary table, as a compact binary file which can be loaded into a
+ * new database, or memory-mapped to warm the UTXO cache, without replaying
+ * history (see webcashd_snapshot).
+ *
+ * The file is a 64-byte header, holding the counters; the unspent outputs, as
+ * 40-byte records of the hash and little-endian amount; the spent hashes, as
+ * 32-byte records; and a 48-byte footer, holding the number of each and the
+ * SHA256 of everything before the checksum itself.  Both kinds of record are
+ * sorted by hash, so that one can be looked up in place.
+ */
+class UtxoSnapshot {
+public:
+    static const size_t k_header_size = 64;
+    static const size_t k_unspent_size = 40;
+    static const size_t k_spent_size = 32;
+    static const size_t k_footer_size = 48;
+
+    /** The counters of the Summary table, as of the snapshot. */
+    struct Counts {
+        uint64_t num_reports = 0;
+        uint64_t num_replace = 0;
+        uint64_t num_burn = 0;
+        uint64_t num_unspent = 0;
+        uint64_t total_destroyed = 0;
+    };
+
+    UtxoSnapshot() = default;
+    ~UtxoSnapshot();
+    // Non-copyable:
+    UtxoSnapshot(const UtxoSnapshot&) = delete;
+    UtxoSnapshot& operator=(const UtxoSnapshot&) = delete;
+
+    /** Maps the snapshot at path into memory, and checks that it is well
+     *  formed.  Unless verify is false, the checksum is also checked, which
+     *  reads the whole file.  Returns false, logging why, if it isn't. */
+    bool Open(const std::string& path, bool verify = true);
+
+    const Counts& GetCounts() const { return m_counts; }
+    size_t NumUnspent() const { return m_num_unspent; }
+    size_t NumSpent() const { return m_num_spent; }
+
+    /** The records, in order of hash, read in place from the mapping. */
+    uint256 UnspentHash(size_t i) const;
+    Amount UnspentAmount(size_t i) const;
+    uint256 SpentHash(size_t i) const;
+
+    /** Looks up hash by binary search, as with UtxoCache::Lookup. */
+    UtxoCache::Status Lookup(const uint256& hash, Amount& amount) const;
+
+    /** Adds every unspent output, and each spent hash if cache is tracking
+     *  them, to cache. */
+    void LoadInto(UtxoCache& cache) const;
+
+private:
+    const unsigned char* UnspentRecord(size_t i) const { return m_data + k_header_size + i * k_unspent_size; }
+    const unsigned char* SpentRecord(size_t i) const { return m_data + k_header_size + m_num_unspent * k_unspent_size + i * k_spent_size; }
+
+    const unsigned char* m_data = nullptr;
+    size_t m_size = 0;
+    Counts m_counts;
+    size_t m_num_unspent = 0;
+    size_t m_num_spent = 0;
+};
+
+/**
+ * Writes a UtxoSnapshot, streaming the records to disk as they are added,
+ * which must be in increasing order of hash: every unspent output, and then
+ * every spent hash.  The file is written to path.tmp and renamed into place by
+ * Commit, so a snapshot interrupted part way is never mistaken for a whole
+ * one.
+ */
+class UtxoSnapshotWriter {
+public:
+    UtxoSnapshotWriter() = default;
+    ~UtxoSnapshotWriter();
+    // Non-copyable:
+    UtxoSnapshotWriter(const UtxoSnapshotWriter&) = delete;
+    UtxoSnapshotWriter& operator=(const UtxoSnapshotWriter&) = delete;
+
+    /** Starts a snapshot to be written to path, of the given counters. */
+    bool Open(const std::string& path, const UtxoSnapshot::Counts& counts);
+
+    /** Each returns false if the hash is out of order, or on I/O error. */
+    bool AddUnspent(const uint256& hash, Amount amount);
+    bool AddSpent(const uint256& hash);
+
+    /** Writes the footer, syncs the file to disk and renames it into place. */
+    bool Commit();
+
+    size_t NumUnspent() const { return m_num_unspent; }
+    size_t NumSpent() const { return m_num_spent; }
+
+private:
+    bool Append(const unsigned char* data, size_t len);
+    /** Whether hash comes strictly after the last one added. */
+    bool InOrder(const uint256& hash);
+
+    std::string m_path;
+    FILE* m_file = nullptr;
+    CSHA256 m_hasher;
+    uint256 m_last;
+    bool m_has_last = false;
+    size_t m_num_unspent = 0;
+    size_t m_num_spent = 0;
+};
+
+#endif // UTXOSNAPSHOT_H
+
+// End of File
@@ -8,6 +8,7 @@
 
 #include "webcash.h"
 
+#include <deque>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
@@ -39,7 +40,11 @@ ABSL_DECLARE_FLAG(std::string, server);
 
 #include <univalue.h>
 
+#include "crypto/common.h"
+#include "logger.h"
+
 #include "random.h"
+#include "util/lockstats.h"
 
 // We group outputs based on their use.  There are currently four categories of
 // webcash recognized by the wallet:
@@ -118,45 +123,107 @@ std::string to_string(const SqlValue& v)
     return "unknown";
 }
 
-bool Wallet::ExecuteSql(const std::string& sql, const SqlParams& params)
+bool Wallet::PrepareNextStatement(const std::string& sql, CachedSql& cached)
 {
-    const char* head = sql.c_str();
-    const char* tail = sql.c_str() + sql.size();
-    while (head != tail) {
-        // Parse next SQL statment
+    while (cached.prepared < sql.size()) {
         sqlite3_stmt* stmt;
-        size_t size = tail - head;
-        int res = sqlite3_prepare_v2(m_db, head, size, &stmt, &tail);
-        size = tail - head; // tail is set to the end of the current statement
+        const char* head = sql.c_str() + cached.prepared;
+        const char* tail = nullptr;
+        int res = sqlite3_prepare_v2(m_db, head, sql.size() - cached.prepared, &stmt, &tail);
         if (res != SQLITE_OK) {
-            std::cerr << "Unable to prepare SQL statement [\"" << head << "\"]: " << sqlite3_errstr(res) << " (" << std::to_string(res) << ")" << std::endl;
+            LogError() << "Unable to prepare SQL statement [\"" << head << "\"]: " << sqlite3_errstr(res) << " (" << std::to_string(res) << ")";
             return false;
         }
-        // Bind parameters
-        for (const auto& bind : params) {
-            const std::string key(":" + bind.first);
-            int index = sqlite3_bind_parameter_index(stmt, key.c_str());
-            if (index) {
-                res = std::visit(BindParameterVisitor(stmt, index), bind.second);
-                if (res != SQLITE_OK) {
-                    std::cerr << "Unable to bind ':" << bind.first << "' in SQL statement [\"" << sqlite3_sql(stmt) << "\"] to " << to_string(bind.second) << ": " << sqlite3_errstr(res) << " (" << to_string(res) << ")" << std::endl;
-                    sqlite3_finalize(stmt);
-                    return false;
-                }
+        cached.prepared = tail - sql.c_str();
+        // Trailing whitespace or comments prepare to no statement at all.
+        if (!stmt) {
+            continue;
+        }
+        // Look up the parameters once, rather than on every execution.
+        CachedStatement entry;
+        entry.stmt = stmt;
+        const int count = sqlite3_bind_parameter_count(stmt);
+        for (int i = 1; i <= count; ++i) {
+            const char* name = sqlite3_bind_parameter_name(stmt, i);
+            // Skip the ':' prefix.
+            entry.params.push_back(name ? name + 1 : "");
+        }
+        cached.stmts.push_back(std::move(entry));
+        break;
+    }
+    return true;
+}
+
+Wallet::CachedStatement* Wallet::GetCachedStatement(const std::string& sql)
+{
+    CachedSql& cached = m_stmts[sql];
+    if (cached.stmts.empty() && (!PrepareNextStatement(sql, cached) || cached.stmts.empty())) {
+        return nullptr;
+    }
+    return &cached.stmts.front();
+}
+
+bool Wallet::BindParameters(const CachedStatement& cached, const SqlParams& params)
+{
+    for (size_t i = 0; i < cached.params.size(); ++i) {
+        auto bind = params.find(cached.params[i]);
+        if (bind == params.end()) {
+            continue;
+        }
+        int res = std::visit(BindParameterVisitor(cached.stmt, i + 1), bind->second);
+        if (res != SQLITE_OK) {
+            LogError() << "Unable to bind ':" << bind->first << "' in SQL statement [\"" << sqlite3_sql(cached.stmt) << "\"] to " << to_string(bind->second) << ": " << sqlite3_errstr(res) << " (" << to_string(res) << ")";
+            ResetStatement(cached.stmt);
+            return false;
+        }
+    }
+    return true;
+}
+
+void Wallet::FinalizeStatements()
+{
+    for (auto& item : m_stmts) {
+        for (CachedStatement& cached : item.second.stmts) {
+            sqlite3_finalize(cached.stmt);
+        }
+    }
+    m_stmts.clear();
+}
+
+void Wallet::ResetStatement(sqlite3_stmt* stmt)
+{
+    // The error code of the last step, if any, has already been reported.
+    sqlite3_reset(stmt);
+    sqlite3_clear_bindings(stmt);
+}
+
+bool Wallet::ExecuteSql(const std::string& sql, const SqlParams& params)
+{
+    CachedSql& cached = m_stmts[sql];
+    // Statements are prepared as execution first reaches them, since each
+    // may depend on schema changes made by those before it.
+    for (size_t i = 0; ; ++i) {
+        if (i == cached.stmts.size()) {
+            if (!PrepareNextStatement(sql, cached)) {
+                return false;
+            }
+            if (i == cached.stmts.size()) {
+                break; // end of the SQL text
             }
         }
+        const CachedStatement& stmt = cached.stmts[i];
+        // Bind parameters
+        if (!BindParameters(stmt, params)) {
+            return false;
+        }
         // Execute statement
-        res = sqlite3_step(stmt);
+        int res = sqlite3_step(stmt.stmt);
         if (res != SQLITE_DONE) {
-            std::cerr << "Running SQL statement [\"" << sqlite3_expanded_sql(stmt) << "\"] returned unexpected status code: " << sqlite3_errstr(res) << " (" << to_string(res) << ")" << std::endl;;
-            sqlite3_finalize(stmt);
+            LogError() << "Running SQL statement [\"" << sqlite3_expanded_sql(stmt.stmt) << "\"] returned unexpected status code: " << sqlite3_errstr(res) << " (" << to_string(res) << ")";
+            ResetStatement(stmt.stmt);
             return false;
         }
-        sqlite3_finalize(stmt);
-        // Set [head, tail) to point past the last statement executed before
-        // continuing the loop:
-        head = tail;
-        tail = sql.c_str() + sql.size();
+        ResetStatement(stmt.stmt);
     }
     return true;
 }
@@ -222,13 +289,13 @@ void Wallet::GetOrCreateHDRoot()
         int res = sqlite3_prepare_v2(m_db, sql.c_str(), sql.size(), &stmt, nullptr);
         if (res != SQLITE_OK) {
             std::string msg(absl::StrCat("Unable to prepare SQL statement [\"", sql, "\"]: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
-            std::cerr << msg << std::endl;
+            LogError() << msg;
             throw std::runtime_error(msg);
         }
         res = sqlite3_step(stmt);
         if (res != SQLITE_ROW) {
             std::string msg(absl::StrCat("Running SQL statement [\"", sql, "\"] returned unexpected status code: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
-            std::cerr << msg << std::endl;
+            LogError() << msg;
             sqlite3_finalize(stmt);
             throw std::runtime_error(msg);
         }
@@ -237,7 +304,7 @@ void Wallet::GetOrCreateHDRoot()
     }
 
     if (count == 0) {
-        std::cout << "Generating master secret for wallet." << std::endl;
+        LogInfo() << "Generating master secret for wallet.";
         const int64_t timestamp = absl::ToUnixSeconds(absl::Now());
         GetStrongRandBytes(m_hdroot.begin(), 32);
 
@@ -246,7 +313,7 @@ void Wallet::GetOrCreateHDRoot()
             boost::filesystem::ofstream bak(m_logfile.string(), boost::filesystem::ofstream::app);
             if (!bak) {
                 std::string msg("Unable to open/create wallet recovery file to save wallet master key.");
-                std::cerr << msg << std::endl;
+                LogError() << msg;
                 throw std::runtime_error(msg);
             } else {
                 bak << line << std::endl;
@@ -277,20 +344,20 @@ void Wallet::GetOrCreateHDRoot()
 
     if (count == 0 || count == 1) {
         if (count == 1) {
-            std::cout << "Loading master secret from wallet." << std::endl;
+            LogInfo() << "Loading master secret from wallet.";
         }
         const std::string sql = "SELECT id,version,secret FROM 'hdroot' LIMIT 1;";
         sqlite3_stmt* stmt;
         int res = sqlite3_prepare_v2(m_db, sql.c_str(), sql.size(), &stmt, nullptr);
         if (res != SQLITE_OK) {
             std::string msg(absl::StrCat("Unable to prepare SQL statement [\"", sql, "\"]: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
-            std::cerr << msg << std::endl;
+            LogError() << msg;
             throw std::runtime_error(msg);
         }
         res = sqlite3_step(stmt);
         if (res != SQLITE_ROW) {
             std::string msg(absl::StrCat("Running SQL statement [\"", sql, "\"] returned unexpected status code: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
-            std::cerr << msg << std::endl;
+            LogError() << msg;
             sqlite3_finalize(stmt);
             throw std::runtime_error(msg);
         }
@@ -298,21 +365,21 @@ void Wallet::GetOrCreateHDRoot()
         int version = sqlite3_column_int(stmt, 1);
         if (version != 1) {
             std::string msg(absl::StrCat("Wallet contains HD root with unrecognized version(", to_string(version), "  Not sure what to do."));
-            std::cerr << msg << std::endl;
+            LogError() << msg;
             sqlite3_finalize(stmt);
             throw std::runtime_error(msg);
         }
         size_t len = sqlite3_column_bytes(stmt, 2);
         if (len < 16 || 32 < len) {
             std::string msg(absl::StrCat("Expected between 16-32 bytes for HD root secret value.  Got ", to_string(len), " bytes.  Not sure what to do."));
-            std::cerr << msg << std::endl;
+            LogError() << msg;
             sqlite3_finalize(stmt);
             throw std::runtime_error(msg);
         }
         const unsigned char* data = (const unsigned char*)sqlite3_column_blob(stmt, 2);
         if (!data) {
             std::string msg("Expected data pointer for HD root secret value.  Got NULL instead.  Not sure what to do.");
-            std::cerr << msg << std::endl;
+            LogError() << msg;
             sqlite3_finalize(stmt);
             throw std::runtime_error(msg);
         }
@@ -326,9 +393,60 @@ void Wallet::GetOrCreateHDRoot()
 
     else {
         std::string msg("Wallet contains more than one HD root secret.  Not sure what to do.");
-        std::cerr << msg << std::endl;
+        LogError() << msg;
+        throw std::runtime_error(msg);
+    }
+}
+
+void Wallet::LoadUnspentOutputs()
+{
+    const std::string sql = "SELECT id,hash,amount FROM 'output' WHERE spent=FALSE AND secret_id IS NOT NULL;";
+    CachedStatement* cached = GetCachedStatement(sql);
+    if (!cached) {
+        throw std::runtime_error("Unable to load unspent outputs from wallet database.  See error log for details.");
+    }
+    sqlite3_stmt* stmt = cached->stmt;
+    int res;
+    while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+        const int id = sqlite3_column_int(stmt, 0);
+        const unsigned char* data = (const unsigned char*)sqlite3_column_blob(stmt, 1);
+        if (!data || sqlite3_column_bytes(stmt, 1) != 32) {
+            LogWarning() << "Wallet output " << id << " has an invalid hash; ignoring.";
+            continue;
+        }
+        PublicWebcash pk;
+        std::copy(data, data + 32, pk.pk.begin());
+        pk.amount = Amount(sqlite3_column_int64(stmt, 2));
+        AddUnspent(pk, id);
+    }
+    if (res != SQLITE_DONE) {
+        std::string msg = absl::StrCat("Running SQL statement [\"", sql, "\"] returned unexpected status code: ", sqlite3_errstr(res), " (", std::to_string(res), ")");
+        LogError() << msg;
+        ResetStatement(stmt);
         throw std::runtime_error(msg);
     }
+    ResetStatement(stmt);
+}
+
+void Wallet::AddUnspent(const PublicWebcash& pk, int output_id)
+{
+    if (!m_unspent.emplace(pk.pk, WalletUnspent{output_id, pk.amount}).second) {
+        // Already indexed, e.g. because the same hash was received twice.
+        return;
+    }
+    m_unspent_by_amount.insert(pk);
+    m_balance += pk.amount;
+}
+
+void Wallet::RemoveUnspent(const uint256& hash)
+{
+    auto itr = m_unspent.find(hash);
+    if (itr == m_unspent.end()) {
+        return;
+    }
+    m_unspent_by_amount.erase(PublicWebcash(hash, itr->second.amount));
+    m_balance = m_balance - itr->second.amount;
+    m_unspent.erase(itr);
 }
 
 Wallet::Wallet(const boost::filesystem::path& path)
@@ -351,7 +469,7 @@ Wallet::Wallet(const boost::filesystem::path& path)
     m_db_lock = boost::interprocess::file_lock(dbfile.c_str());
     if (!m_db_lock.try_lock()) {
         std::string msg("Unable to lock wallet database; wallet is in use by another process.");
-        std::cerr << msg << std::endl;
+        LogError() << msg;
         throw std::runtime_error(msg);
     }
 
@@ -359,11 +477,13 @@ Wallet::Wallet(const boost::filesystem::path& path)
     if (error != SQLITE_OK) {
         m_db_lock.unlock();
         std::string msg(absl::StrCat("Unable to open/create wallet database file: ", sqlite3_errstr(error), " (", std::to_string(error), ")"));
-        std::cerr << msg << std::endl;
+        LogError() << msg;
         throw std::runtime_error(msg);
     }
     UpgradeDatabase();
     GetOrCreateHDRoot();
+    LoadUnspentOutputs();
+    LoadMiningChain();
 
     // Touch the wallet file, which will create it if it doesn't already exist.
     // The file locking primitives assume that the file exists, so we need to
@@ -375,10 +495,11 @@ Wallet::Wallet(const boost::filesystem::path& path)
         // didn't exist in the first place.
         boost::filesystem::ofstream bak(m_logfile.string(), boost::filesystem::ofstream::app);
         if (!bak) {
+            FinalizeStatements();
             sqlite3_close_v2(m_db); m_db = nullptr;
             m_db_lock.unlock();
             std::string msg(absl::StrCat("Unable to open/create wallet recovery file"));
-            std::cerr << msg << std::endl;
+            LogError() << msg;
             throw std::runtime_error(msg);
         }
         bak.flush();
@@ -388,18 +509,25 @@ Wallet::Wallet(const boost::filesystem::path& path)
 Wallet::~Wallet()
 {
     // Wait for other threads using the wallet to finish up.
-    const std::lock_guard<std::mutex> lock(m_mut);
+    LOCK_GUARD(m_mut);
+    FinalizeStatements();
     // No errors are expected when closing the database file, but if there is
     // then that might be an indication of a serious bug or data loss the user
     // should know about.
     int error = sqlite3_close_v2(m_db); m_db = nullptr;
     if (error != SQLITE_OK) {
-        std::cerr << "WARNING: sqlite3 returned error code " << sqlite3_errstr(error) << " (" << std::to_string(error) << ") when attempting to close database file of wallet.  Data loss may have occured." << std::endl;
+        LogWarning() << "sqlite3 returned error code " << sqlite3_errstr(error) << " (" << std::to_string(error) << ") when attempting to close database file of wallet.  Data loss may have occured.";
     }
     // Release our filesystem lock on the wallet.
     m_db_lock.unlock();
     // Secure-erase the master secret from memory
     memory_cleanse(m_hdroot.begin(), m_hdroot.size());
+    // And the secrets derived from it which were never used
+    for (auto& pool : m_keypool) {
+        for (WalletSecret& wsecret : pool.second.secrets) {
+            memory_cleanse(wsecret.secret.data(), wsecret.secret.size());
+        }
+    }
 }
 
 std::string to_string(HashType type)
@@ -439,15 +567,68 @@ static HashType get_hash_type(bool mine, bool sweep)
     return HashType::UNUSED;
 }
 
-WalletSecret Wallet::ReserveSecret(absl::Time _timestamp, bool mine, bool sweep)
+// The low 2 bits of an HD chain's chaincode, which select its use.
+static int get_chain_bits(bool mine, bool sweep)
 {
-    const int64_t chaincode = 0;
+    if (!mine && sweep) {
+        return 0;
+    }
+    if (!mine && !sweep) {
+        return 1;
+    }
+    if (mine && !sweep) {
+        return 2;
+    }
+    return 3;
+}
 
-    // Timestamps in the database are recorded as seconds since the UNIX epoch.
-    const int64_t timestamp = absl::ToUnixSeconds(_timestamp);
+int Wallet::GetSecretId(const std::string& secret)
+{
+    const std::string sql = "SELECT id FROM 'secret' WHERE secret=:secret;";
+    CachedStatement* cached = GetCachedStatement(sql);
+    SqlParams params;
+    params["secret"] = SqlText(secret);
+    if (!cached || !BindParameters(*cached, params)) {
+        return 0;
+    }
+    int id = 0;
+    int res = sqlite3_step(cached->stmt);
+    if (res == SQLITE_ROW) {
+        id = sqlite3_column_int(cached->stmt, 0);
+    } else {
+        LogError() << "Unable to look up id of secret in wallet database: " << sqlite3_errstr(res) << " (" << std::to_string(res) << ")";
+    }
+    ResetStatement(cached->stmt);
+    return id;
+}
+
+Wallet::KeyPool& Wallet::GetKeyPool(int64_t chaincode, bool mine, bool sweep)
+{
+    using std::to_string;
+
+    const int64_t chaincode_bits = (chaincode << 2) | get_chain_bits(mine, sweep);
+    auto itr = m_keypool.find(chaincode_bits);
+    if (itr != m_keypool.end()) {
+        return itr->second;
+    }
+
+    // Chains other than the four made with the master secret, such as the
+    // mining chain, are added on first use.
+    {
+        const std::string sql =
+            "INSERT OR IGNORE INTO hdchain ('hdroot_id','chaincode','mine','sweep','mindepth','maxdepth')"
+            "VALUES(:hdroot_id,:chaincode,:mine,:sweep,0,0);";
+        SqlParams params;
+        params["hdroot_id"] = SqlInteger(m_hdroot_id);
+        params["chaincode"] = SqlInteger(chaincode);
+        params["mine"] = SqlBool(mine);
+        params["sweep"] = SqlBool(sweep);
+        if (!ExecuteSql(sql, params)) {
+            throw std::runtime_error("Unable to add HD chain to wallet database.  See error log for details.");
+        }
+    }
 
-    int hdchain_id = -1;
-    int64_t depth = -1;
+    KeyPool pool;
     {
         const std::string sql =
             "SELECT id,maxdepth "
@@ -457,152 +638,245 @@ WalletSecret Wallet::ReserveSecret(absl::Time _timestamp, bool mine, bool sweep)
                "AND mine=:mine "
                "AND sweep=:sweep "
             "LIMIT 1;";
-        sqlite3_stmt* stmt;
-        int res = sqlite3_prepare_v2(m_db, sql.c_str(), sql.size(), &stmt, nullptr);
-        if (res != SQLITE_OK) {
-            std::string msg(absl::StrCat("Unable to prepare SQL statement [\"", sql, "\"]: ", sqlite3_errstr(res), " (", to_string(res), ")"));
-            std::cerr << msg << std::endl;
-            throw std::runtime_error(msg);
-        }
-        res = sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":hdroot_id"), m_hdroot_id);
-        if (res != SQLITE_OK) {
-            std::string msg(absl::StrCat("Unable to bind ':hdroot_id' in SQL statement [\"", sqlite3_sql(stmt), "\"] to ", m_hdroot_id, ": ", sqlite3_errstr(res), " (", to_string(res), ")"));
-            std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
-            throw std::runtime_error(msg);
-        }
-        res = sqlite3_bind_int64(stmt, sqlite3_bind_parameter_index(stmt, ":chaincode"), chaincode);
-        if (res != SQLITE_OK) {
-            std::string msg(absl::StrCat("Unable to bind ':hdroot_id' in SQL statement [\"", sqlite3_sql(stmt), "\"] to ", to_string(chaincode), ": ", sqlite3_errstr(res), " (", to_string(res), ")"));
-            std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
-            throw std::runtime_error(msg);
-        }
-        res = sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":mine"), !!mine);
-        if (res != SQLITE_OK) {
-            std::string msg(absl::StrCat("Unable to bind ':mine' in SQL statement [\"", sqlite3_sql(stmt), "\"] to ", (mine ? "TRUE" : "FALSE"), ": ", sqlite3_errstr(res), " (", to_string(res), ")"));
-            std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
-            throw std::runtime_error(msg);
-        }
-        res = sqlite3_bind_int(stmt, sqlite3_bind_parameter_index(stmt, ":sweep"), !!sweep);
-        if (res != SQLITE_OK) {
-            std::string msg(absl::StrCat("Unable to bind ':sweep' in SQL statement [\"", sqlite3_sql(stmt), "\"] to ", (mine ? "TRUE" : "FALSE"), ": ", sqlite3_errstr(res), " (", to_string(res), ")"));
-            std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
-            throw std::runtime_error(msg);
+        SqlParams params;
+        params["hdroot_id"] = SqlInteger(m_hdroot_id);
+        params["chaincode"] = SqlInteger(chaincode);
+        params["mine"] = SqlBool(mine);
+        params["sweep"] = SqlBool(sweep);
+        CachedStatement* cached = GetCachedStatement(sql);
+        if (!cached || !BindParameters(*cached, params)) {
+            throw std::runtime_error("Unable to look up HD chain in wallet database.  See error log for details.");
         }
-        res = sqlite3_step(stmt);
+        sqlite3_stmt* stmt = cached->stmt;
+        int res = sqlite3_step(stmt);
         if (res != SQLITE_ROW) {
             std::string msg = absl::StrCat("Running SQL statement [\"", sqlite3_expanded_sql(stmt), "\"] returned unexpected status code: ", sqlite3_errstr(res), " (", to_string(res), ")");
-            std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
+            LogError() << msg;
+            ResetStatement(stmt);
             throw std::runtime_error(msg);
         }
-        hdchain_id = sqlite3_column_int(stmt, 0);
-        if (hdchain_id < 0) {
+        pool.hdchain_id = sqlite3_column_int(stmt, 0);
+        if (pool.hdchain_id < 0) {
             std::string msg(absl::StrCat("Current HD chain id is negative.  Not sure what to do."));
-            std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
+            LogError() << msg;
+            ResetStatement(stmt);
             throw std::runtime_error(msg);
         }
-        depth = sqlite3_column_int64(stmt, 1);
-        if (depth < 0) {
+        pool.depth = sqlite3_column_int64(stmt, 1);
+        if (pool.depth < 0) {
             std::string msg(absl::StrCat("Current HD chain depth is negative.  Not sure what to do."));
-            std::cerr << msg << std::endl;
-            sqlite3_finalize(stmt);
+            LogError() << msg;
+            ResetStatement(stmt);
             throw std::runtime_error(msg);
         }
-        sqlite3_finalize(stmt);
+        ResetStatement(stmt);
     }
+    return m_keypool.emplace(chaincode_bits, std::move(pool)).first->second;
+}
 
+std::vector<std::string> Wallet::DeriveSecrets(int64_t chaincode, bool mine, bool sweep, int64_t depth, size_t count)
+{
+    // Each secret is the tagged hash of the master secret, the chaincode
+    // and the depth.  The tag fills the first block, and the rest fits in
+    // the second, so all of the secrets are derived with a single transform
+    // each, in parallel.
     const std::string tag_str = "webcashwalletv1";
     uint256 tag;
     CSHA256()
         .Write((const unsigned char*)tag_str.c_str(), tag_str.size())
         .Finalize(tag.begin());
-    std::array<unsigned char, 8> chaincode_bytes = {
-        static_cast<unsigned char>((chaincode >> 54) & 0xff),
-        static_cast<unsigned char>((chaincode >> 46) & 0xff),
-        static_cast<unsigned char>((chaincode >> 38) & 0xff),
-        static_cast<unsigned char>((chaincode >> 30) & 0xff),
-        static_cast<unsigned char>((chaincode >> 22) & 0xff),
-        static_cast<unsigned char>((chaincode >> 14) & 0xff),
-        static_cast<unsigned char>((chaincode >> 6) & 0xff),
-        static_cast<unsigned char>((chaincode << 2) & 0xfc),
-    };
-    if (!mine && sweep) {
-        chaincode_bytes.back() |= 0;
-    } else
-    if (!mine && !sweep) {
-        chaincode_bytes.back() |= 1;
-    } else
-    if (mine && !sweep) {
-        chaincode_bytes.back() |= 2;
-    } else
-    if (mine && sweep) {
-        chaincode_bytes.back() |= 3;
-    }
-    std::array<unsigned char, 8> depth_bytes = {
-        static_cast<unsigned char>((depth >> 56) & 0xff),
-        static_cast<unsigned char>((depth >> 48) & 0xff),
-        static_cast<unsigned char>((depth >> 40) & 0xff),
-        static_cast<unsigned char>((depth >> 32) & 0xff),
-        static_cast<unsigned char>((depth >> 24) & 0xff),
-        static_cast<unsigned char>((depth >> 16) & 0xff),
-        static_cast<unsigned char>((depth >> 8) & 0xff),
-        static_cast<unsigned char>(depth & 0xff),
-    };
-    uint256 secret;
+    const int64_t chaincode_bits = (chaincode << 2) | get_chain_bits(mine, sweep);
+    const size_t SUFFIX_SIZE = 32 + 8 + 8;
+    std::vector<unsigned char> suffixes(SUFFIX_SIZE * count);
+    for (size_t i = 0; i < count; ++i) {
+        unsigned char* suffix = suffixes.data() + SUFFIX_SIZE * i;
+        std::copy(m_hdroot.begin(), m_hdroot.end(), suffix);
+        WriteBE64(suffix + 32, chaincode_bits);
+        WriteBE64(suffix + 40, depth + i);
+    }
+    std::vector<unsigned char> hashes(32 * count);
     CSHA256()
         .Write(tag.begin(), 32)
         .Write(tag.begin(), 32)
-        .Write(m_hdroot.begin(), 32)
-        .Write(chaincode_bytes.data(), chaincode_bytes.size())
-        .Write(depth_bytes.data(), depth_bytes.size())
-        .Finalize(secret.begin());
-    SecureString sk(absl::BytesToHexString(absl::string_view((const char*)secret.begin(), secret.size())));
-    memory_cleanse(secret.begin(), secret.size());
-
-    int secret_id = -1;
-    {
-        const std::string sql =
-            "BEGIN TRANSACTION;"
-            ""
-            "INSERT OR IGNORE INTO secret ('timestamp','secret','mine','sweep')"
-            "VALUES(:timestamp,:secret,:mine,:sweep);"
-            "UPDATE secret SET mine = mine & :mine WHERE secret = :secret;"
-            "UPDATE secret SET sweep = sweep | :sweep WHERE secret = :secret;"
-            ""
-            "INSERT OR IGNORE INTO hdkey ('hdchain_id','depth','secret_id')"
-            "VALUES(:hdchain_id,:depth,(SELECT id FROM 'secret' WHERE secret = :secret));"
-            ""
-            "UPDATE 'hdchain' SET maxdepth = maxdepth + 1 "
-            "WHERE id = :hdchain_id;"
-            ""
-            "COMMIT;";
-        SqlParams params;
-        params["timestamp"] = SqlInteger(timestamp);
-        params["secret"] = SqlText(sk);
-        params["mine"] = SqlBool(mine);
-        params["sweep"] = SqlBool(sweep);
-        params["hdchain_id"] = SqlInteger(hdchain_id);
-        params["depth"] = SqlInteger(depth);
-        if (!ExecuteSql(sql, params)) {
-            throw std::runtime_error("Unable to insert secret into database.  See error log for details.");
-        }
+        .FinalizeSuffixes(suffixes.data(), SUFFIX_SIZE, count, hashes.data());
+    memory_cleanse(suffixes.data(), suffixes.size());
+
+    std::vector<std::string> secrets(count);
+    for (size_t i = 0; i < count; ++i) {
+        secrets[i] = absl::BytesToHexString(absl::string_view((const char*)hashes.data() + 32 * i, 32));
     }
+    memory_cleanse(hashes.data(), hashes.size());
+    return secrets;
+}
 
-    WalletSecret wsecret;
-    wsecret.id = secret_id;
-    wsecret.timestamp = _timestamp;
-    wsecret.secret = sk;
-    wsecret.mine = mine;
-    wsecret.sweep = sweep;
+void Wallet::RefillKeyPool(int64_t chaincode, bool mine, bool sweep, size_t count)
+{
+    KeyPool& pool = GetKeyPool(chaincode, mine, sweep);
+    std::vector<std::string> secrets = DeriveSecrets(chaincode, mine, sweep, pool.depth + pool.secrets.size(), count);
+    for (std::string& secret : secrets) {
+        WalletSecret wsecret;
+        wsecret.id = 0;
+        wsecret.timestamp = absl::Now();
+        wsecret.secret = std::move(secret);
+        wsecret.mine = mine;
+        wsecret.sweep = sweep;
+        pool.secrets.push_back(std::move(wsecret));
+    }
+}
+
+int Wallet::RecordDepth(KeyPool& pool, int64_t depth, const WalletSecret& wsecret)
+{
+    // Timestamps in the database are recorded as seconds since the UNIX epoch.
+    const int64_t timestamp = absl::ToUnixSeconds(wsecret.timestamp);
+
+    const std::string sql =
+        "BEGIN TRANSACTION;"
+        ""
+        "INSERT OR IGNORE INTO secret ('timestamp','secret','mine','sweep')"
+        "VALUES(:timestamp,:secret,:mine,:sweep);"
+        "UPDATE secret SET mine = mine & :mine WHERE secret = :secret;"
+        "UPDATE secret SET sweep = sweep | :sweep WHERE secret = :secret;"
+        ""
+        "INSERT OR IGNORE INTO hdkey ('hdchain_id','depth','secret_id')"
+        "VALUES(:hdchain_id,:depth,(SELECT id FROM 'secret' WHERE secret = :secret));"
+        ""
+        "UPDATE 'hdchain' SET maxdepth = MAX(maxdepth, :depth + 1) "
+        "WHERE id = :hdchain_id;"
+        ""
+        "COMMIT;";
+    SqlParams params;
+    params["timestamp"] = SqlInteger(timestamp);
+    params["secret"] = SqlText(wsecret.secret);
+    params["mine"] = SqlBool(wsecret.mine);
+    params["sweep"] = SqlBool(wsecret.sweep);
+    params["hdchain_id"] = SqlInteger(pool.hdchain_id);
+    params["depth"] = SqlInteger(depth);
+    if (!ExecuteSql(sql, params)) {
+        ExecuteSql("ROLLBACK;", {});
+        return 0;
+    }
+    pool.depth = std::max(pool.depth, depth + 1);
+    return GetSecretId(wsecret.secret);
+}
 
+WalletSecret Wallet::ReserveSecret(absl::Time timestamp, bool mine, bool sweep)
+{
+    KeyPool& pool = GetKeyPool(0, mine, sweep);
+    if (pool.secrets.empty()) {
+        RefillKeyPool(0, mine, sweep, KEYPOOL_SIZE);
+    }
+    WalletSecret wsecret = std::move(pool.secrets.front());
+    pool.secrets.pop_front();
+    wsecret.timestamp = timestamp;
+    if (!(wsecret.id = RecordDepth(pool, pool.depth, wsecret))) {
+        // Put back, since it is the secret for the chain's next depth.
+        pool.secrets.push_front(std::move(wsecret));
+        throw std::runtime_error("Unable to insert secret into database.  See error log for details.");
+    }
     return wsecret;
 }
 
+void Wallet::LoadMiningChain()
+{
+    using std::to_string;
+
+    KeyPool& pool = GetKeyPool(MINING_CHAINCODE, /* mine = */ true, /* sweep = */ true);
+    for (int64_t depth = 0; depth < pool.depth; ++depth) {
+        m_mining_free.insert(depth);
+    }
+    const std::string sql = "SELECT depth FROM 'hdkey' WHERE hdchain_id=:hdchain_id;";
+    SqlParams params;
+    params["hdchain_id"] = SqlInteger(pool.hdchain_id);
+    CachedStatement* cached = GetCachedStatement(sql);
+    if (!cached || !BindParameters(*cached, params)) {
+        throw std::runtime_error("Unable to load mining chain from wallet database.  See error log for details.");
+    }
+    sqlite3_stmt* stmt = cached->stmt;
+    int res;
+    while ((res = sqlite3_step(stmt)) == SQLITE_ROW) {
+        m_mining_free.erase(sqlite3_column_int64(stmt, 0));
+    }
+    if (res != SQLITE_DONE) {
+        std::string msg = absl::StrCat("Running SQL statement [\"", sql, "\"] returned unexpected status code: ", sqlite3_errstr(res), " (", to_string(res), ")");
+        LogError() << msg;
+        ResetStatement(stmt);
+        throw std::runtime_error(msg);
+    }
+    ResetStatement(stmt);
+}
+
+std::optional<SecureString> Wallet::ReserveMiningSecret()
+{
+    LOCK_GUARD(m_mut);
+    if (m_mining_reserved.size() >= MINING_GAP_LIMIT) {
+        return std::nullopt;
+    }
+    KeyPool& pool = GetKeyPool(MINING_CHAINCODE, /* mine = */ true, /* sweep = */ true);
+    // Released depths are handed out again before the chain is extended.
+    const bool reuse = !m_mining_free.empty();
+    WalletSecret wsecret;
+    int64_t depth;
+    if (reuse) {
+        depth = *m_mining_free.begin();
+        wsecret.id = 0;
+        wsecret.secret = DeriveSecrets(MINING_CHAINCODE, true, true, depth, 1)[0];
+        wsecret.mine = true;
+        wsecret.sweep = true;
+    } else {
+        if (pool.secrets.empty()) {
+            RefillKeyPool(MINING_CHAINCODE, true, true, KEYPOOL_SIZE);
+        }
+        depth = pool.depth;
+        wsecret = std::move(pool.secrets.front());
+        pool.secrets.pop_front();
+    }
+    wsecret.timestamp = absl::Now();
+    if (!RecordDepth(pool, depth, wsecret)) {
+        LogError() << "Unable to reserve mining secret in wallet database.  See error log for details.";
+        if (reuse) {
+            memory_cleanse(wsecret.secret.data(), wsecret.secret.size());
+        } else {
+            pool.secrets.push_front(std::move(wsecret));
+        }
+        return std::nullopt;
+    }
+    m_mining_free.erase(depth);
+    m_mining_reserved.emplace(wsecret.secret, depth);
+    SecureString sk(wsecret.secret);
+    memory_cleanse(wsecret.secret.data(), wsecret.secret.size());
+    return sk;
+}
+
+void Wallet::ReleaseMiningSecret(const SecureString& sk)
+{
+    LOCK_GUARD(m_mut);
+    auto itr = m_mining_reserved.find(std::string(sk));
+    if (itr == m_mining_reserved.end()) {
+        return;
+    }
+    KeyPool& pool = GetKeyPool(MINING_CHAINCODE, /* mine = */ true, /* sweep = */ true);
+    const std::string sql =
+        "BEGIN TRANSACTION;"
+        ""
+        "DELETE FROM hdkey WHERE hdchain_id = :hdchain_id AND depth = :depth;"
+        "DELETE FROM secret WHERE secret = :secret "
+            "AND NOT EXISTS (SELECT 1 FROM output WHERE output.secret_id = secret.id);"
+        ""
+        "COMMIT;";
+    SqlParams params;
+    params["hdchain_id"] = SqlInteger(pool.hdchain_id);
+    params["depth"] = SqlInteger(itr->second);
+    params["secret"] = SqlText(itr->first);
+    if (!ExecuteSql(sql, params)) {
+        // Still recorded as in use, so the depth is just skipped.
+        ExecuteSql("ROLLBACK;", {});
+        LogError() << "Unable to release mining secret in wallet database.  See error log for details.";
+    } else {
+        m_mining_free.insert(itr->second);
+    }
+    m_mining_reserved.erase(itr);
+}
+
 int Wallet::AddSecretToWallet(absl::Time _timestamp, const SecretWebcash &sk, bool mine, bool sweep)
 {
     using std::to_string;
@@ -616,6 +890,8 @@ int Wallet::AddSecretToWallet(absl::Time _timestamp, const SecretWebcash &sk, bo
         std::string line = absl::StrCat(to_string(timestamp), " ", to_string(get_hash_type(mine, sweep)), " ", to_string(sk));
         boost::filesystem::ofstream bak(m_logfile.string(), boost::filesystem::ofstream::app);
         if (!bak) {
+            // Written directly, rather than logged, so that the key can't be
+            // dropped or rate limited.
             std::cerr << "WARNING: Unable to open/create wallet recovery file to save key prior to insertion: \"" << line << "\".  BACKUP THIS KEY NOW TO AVOID DATA LOSS!" << std::endl;
             // We do not return 0 here even though there was an error writing to
             // the recovery log, because we can still attempt to save the key to
@@ -645,7 +921,9 @@ int Wallet::AddSecretToWallet(absl::Time _timestamp, const SecretWebcash &sk, bo
     params["sweep"] = SqlBool(sweep);
     result = ExecuteSql(sql, params) && result;
 
-    return result ? sqlite3_last_insert_rowid(m_db) : 0;
+    // Look the id up, since the secret may already have been in the wallet
+    // (e.g. from the key pool), in which case nothing was inserted.
+    return result ? GetSecretId(std::string(sk.sk)) : 0;
 }
 
 int Wallet::AddOutputToWallet(absl::Time _timestamp, const PublicWebcash& pk, int secret_id, bool spent)
@@ -673,7 +951,11 @@ int Wallet::AddOutputToWallet(absl::Time _timestamp, const PublicWebcash& pk, in
         return 0;
     }
 
-    return sqlite3_last_insert_rowid(m_db);
+    const int id = sqlite3_last_insert_rowid(m_db);
+    if (!spent && secret_id) {
+        AddUnspent(pk, id);
+    }
+    return id;
 }
 
 std::vector<std::pair<WalletSecret, int>> Wallet::ReplaceWebcash(absl::Time timestamp, std::vector<WalletOutput>& inputs, const std::vector<std::pair<WalletSecret, Amount>>& outputs)
@@ -683,19 +965,19 @@ std::vector<std::pair<WalletSecret, int>> Wallet::ReplaceWebcash(absl::Time time
     Amount total_in = 0;
     UniValue in(UniValue::VARR);
     if (inputs.empty()) {
-        std::cerr << "No inputs provided for replacement." << std::endl;
+        LogError() << "No inputs provided for replacement.";
         return {};
     }
     for (const WalletOutput& webcash : inputs) {
         if (!webcash.secret) {
-            std::cerr << "Unable to replace output without corresponding secret: " << to_string(PublicWebcash(webcash.hash, webcash.amount)) << std::endl;
+            LogError() << "Unable to replace output without corresponding secret: " << to_string(PublicWebcash(webcash.hash, webcash.amount));
             return {};
         }
         if (webcash.amount.i64 < 1) {
-            std::cerr << "Invalid amount for replacement intput: " << to_string(PublicWebcash(webcash.hash, webcash.amount)) << std::endl;
+            LogError() << "Invalid amount for replacement intput: " << to_string(PublicWebcash(webcash.hash, webcash.amount));
         }
         if (webcash.spent) {
-            std::cerr << "Replacement intput already spent: " << to_string(PublicWebcash(webcash.hash, webcash.amount)) << std::endl;
+            LogError() << "Replacement intput already spent: " << to_string(PublicWebcash(webcash.hash, webcash.amount));
             return {};
         }
         in.push_back(std::string(to_string(SecretWebcash(webcash.secret->secret, webcash.amount)).c_str()));
@@ -705,12 +987,12 @@ std::vector<std::pair<WalletSecret, int>> Wallet::ReplaceWebcash(absl::Time time
     Amount total_out = 0;
     UniValue out(UniValue::VARR);
     if (outputs.empty()) {
-        std::cerr << "No outputs provided for replacement." << std::endl;
+        LogError() << "No outputs provided for replacement.";
         return {};
     }
     for (const std::pair<WalletSecret, Amount>& webcash : outputs) {
         if (webcash.second.i64 < 1) {
-            std::cerr << "Invalid amount for replacement output: " << to_string(PublicWebcash(SecretWebcash(webcash.first.secret, webcash.second))) << std::endl;
+            LogError() << "Invalid amount for replacement output: " << to_string(PublicWebcash(SecretWebcash(webcash.first.secret, webcash.second)));
             return {};
         }
         out.push_back(std::string(to_string(SecretWebcash(webcash.first.secret, webcash.second)).c_str()));
@@ -718,7 +1000,7 @@ std::vector<std::pair<WalletSecret, int>> Wallet::ReplaceWebcash(absl::Time time
     }
 
     if (total_in != total_out) {
-        std::cerr << "Invalid replacement: sum(inputs) != sum(outputs) [" << to_string(total_in) << " != " << to_string(total_out) << "]" << std::endl;
+        LogError() << "Invalid replacement: sum(inputs) != sum(outputs) [" << to_string(total_in) << " != " << to_string(total_out) << "]";
         return {};
     }
 
@@ -733,19 +1015,21 @@ std::vector<std::pair<WalletSecret, int>> Wallet::ReplaceWebcash(absl::Time time
     replace.push_back(std::make_pair("legalese", legalese));
 
     // Submit replacement
-    const std::string server = absl::GetFlag(FLAGS_server);
-    httplib::Client cli(server);
-    cli.set_read_timeout(60, 0); // 60 seconds
-    cli.set_write_timeout(60, 0); // 60 seconds
-    auto r = cli.Post(
+    if (!m_client) {
+        m_client = std::make_unique<httplib::Client>(absl::GetFlag(FLAGS_server));
+        m_client->set_keep_alive(true);
+        m_client->set_read_timeout(60, 0); // 60 seconds
+        m_client->set_write_timeout(60, 0); // 60 seconds
+    }
+    auto r = m_client->Post(
         "/api/v1/replace",
         replace.write(),
         "application/json");
 
     // Handle network errors by aborting further processing
     if (!r) {
-        std::cerr << "Error: returned invalid response to Replace request: " << r.error() << std::endl;
-        std::cerr << "Possible transient error, or server timeout?  Cannot proceed." << std::endl;
+        LogError() << "returned invalid response to Replace request: " << r.error();
+        LogError() << "Possible transient error, or server timeout?  Cannot proceed.";
         return {};
     }
 
@@ -755,10 +1039,14 @@ std::vector<std::pair<WalletSecret, int>> Wallet::ReplaceWebcash(absl::Time time
 
     // Report server rejection to the user.
     if (r->status != 200) {
-        std::cerr << "Error: returned invalid response to Replace request: status_code=" << r->status << ", text='" << r->body << "'" << std::endl;
+        LogError() << "returned invalid response to Replace request: status_code=" << r->status << ", text='" << r->body << "'";
         return {};
     }
 
+    // Record the replacement in a single transaction, so that it costs one
+    // sync of the database file however many inputs and outputs it has.
+    const bool in_transaction = ExecuteSql("BEGIN TRANSACTION;", {});
+
     // Mark each input as spent in the database.
     {
         for (WalletOutput& webcash : inputs) {
@@ -770,19 +1058,27 @@ std::vector<std::pair<WalletSecret, int>> Wallet::ReplaceWebcash(absl::Time time
             SqlParams params;
             params["output_id"] = SqlInteger(webcash.id);
             if (!ExecuteSql(sql, params)) {
-                std::cerr << "Unable to mark output as spent.  See error log for details." << std::endl;
+                LogError() << "Unable to mark output as spent.  See error log for details.";
                 continue;
             }
+            RemoveUnspent(webcash.hash);
         }
     }
 
     // Create record for each output.
-    std::vector<std::pair<WalletSecret, int>> ret;
+    std::vector<SecretWebcash> sks;
+    sks.reserve(outputs.size());
     for (const std::pair<WalletSecret, Amount>& webcash : outputs) {
+        sks.emplace_back(webcash.first.secret, webcash.second);
+    }
+    const std::vector<PublicWebcash> pks = DerivePublicWebcash(sks);
+    std::vector<std::pair<WalletSecret, int>> ret;
+    for (size_t i = 0; i < outputs.size(); ++i) {
+        const std::pair<WalletSecret, Amount>& webcash = outputs[i];
         // Create database record.
-        int id = AddOutputToWallet(timestamp, PublicWebcash(SecretWebcash(webcash.first.secret, webcash.second)), webcash.first.id, false);
+        int id = AddOutputToWallet(timestamp, pks[i], webcash.first.id, false);
         if (!id) {
-            std::cerr << "Error creating database record for replacement output: " << to_string(PublicWebcash(SecretWebcash(webcash.first.secret, webcash.second))) << std::endl;
+            LogError() << "Error creating database record for replacement output: " << to_string(pks[i]);
             continue;
         }
 
@@ -790,13 +1086,17 @@ std::vector<std::pair<WalletSecret, int>> Wallet::ReplaceWebcash(absl::Time time
         ret.push_back(std::make_pair(webcash.first, id));
     }
 
+    if (in_transaction && !ExecuteSql("COMMIT;", {})) {
+        LogError() << "Unable to commit replacement to wallet database.  See error log for details.";
+    }
+
     return ret;
 }
 
 bool Wallet::Insert(const SecretWebcash& sk, bool mine)
 {
     using std::to_string;
-    const std::lock_guard<std::mutex> lock(m_mut);
+    LOCK_GUARD(m_mut);
 
     // The database records the timestamp of an insertion
     const absl::Time now = absl::Now();
@@ -804,9 +1104,11 @@ bool Wallet::Insert(const SecretWebcash& sk, bool mine)
     // Insert secret into the wallet db.
     int secret_id = AddSecretToWallet(now, sk, mine, true);
     if (!secret_id) {
-        std::cerr << "Error adding secret to wallet; unable to proceed with insertion." << std::endl;
+        LogError() << "Error adding secret to wallet; unable to proceed with insertion.";
         return false;
     }
+    // A claimed mining secret keeps its depth.
+    m_mining_reserved.erase(std::string(sk.sk));
 
     WalletSecret wsecret;
     wsecret.id = secret_id;
@@ -819,7 +1121,7 @@ bool Wallet::Insert(const SecretWebcash& sk, bool mine)
     PublicWebcash pk(sk);
     int output_id = AddOutputToWallet(now, pk, secret_id, false);
     if (!output_id) {
-        std::cerr << "Error adding output to wallet; unable to proceed with insertion." << std::endl;
+        LogError() << "Error adding output to wallet; unable to proceed with insertion.";
         return false;
     }
 
@@ -844,9 +1146,12 @@ bool Wallet::Insert(const SecretWebcash& sk, bool mine)
     //        when replacing secrets.  This is not what the HashType::MINING
     //        chain code is meant to be used for.  It is meant to be the way in
     //        which mining payload secrets are generated, hence why sweep=true.
-    //        However webminer currently uses random secrets for the mining
-    //        payload, and until a proper wallet is implemented this at least
-    //        achieves domain separation from webminer and webcasa.
+    //        Mining payloads are therefore drawn from a chain of the same
+    //        type with a different chaincode (MINING_CHAINCODE), so that the
+    //        change outputs aren't spread out among the depths of work which
+    //        never found a solution.  Until a proper wallet is implemented
+    //        this at least achieves domain separation from webminer and
+    //        webcasa.
     //
     //                                                         should be false <==>
     WalletSecret wchange = ReserveSecret(now, /* mine = */ true, /* sweep = */ true);
@@ -860,28 +1165,186 @@ bool Wallet::Insert(const SecretWebcash& sk, bool mine)
 
     std::vector<std::pair<WalletSecret, int>> res = ReplaceWebcash(now, inputs, outputs);
     if (res.size() != 1) {
-        std::cerr << "Error executing replacement on server; keys are secured in wallet, but assuming replacement did not go through." << std::endl;
+        LogError() << "Error executing replacement on server; keys are secured in wallet, but assuming replacement did not go through.";
         return false;
     }
 
     return true;
 }
 
+bool Wallet::Insert(const std::vector<SecretWebcash>& sks, bool mine)
+{
+    using std::to_string;
+    if (sks.empty()) {
+        return true;
+    }
+    if (sks.size() == 1) {
+        return Insert(sks.front(), mine);
+    }
+    LOCK_GUARD(m_mut);
+
+    // The database records the timestamp of an insertion
+    const absl::Time now = absl::Now();
+    const int64_t timestamp = absl::ToUnixSeconds(now);
+
+    // First write all the keys to the wallet recovery file.
+    {
+        boost::filesystem::ofstream bak(m_logfile.string(), boost::filesystem::ofstream::app);
+        if (!bak) {
+            // Written directly, as above.
+            std::cerr << "WARNING: Unable to open/create wallet recovery file to save keys prior to insertion.  BACKUP THESE KEYS NOW TO AVOID DATA LOSS!" << std::endl;
+            for (const SecretWebcash& sk : sks) {
+                std::cerr << to_string(sk) << std::endl;
+            }
+        } else {
+            for (const SecretWebcash& sk : sks) {
+                bak << to_string(timestamp) << " " << to_string(get_hash_type(mine, true)) << " " << to_string(sk) << std::endl;
+            }
+            bak.flush();
+        }
+    }
+
+    // Then add every secret and its output to the database in one
+    // transaction.  The output is linked to its secret by lookup rather than
+    // by the last insert id, in case the secret was already in the wallet.
+    std::vector<WalletOutput> inputs;
+    Amount total = 0;
+    {
+        if (!ExecuteSql("BEGIN TRANSACTION;", {})) {
+            LogError() << "Error starting wallet database transaction; unable to proceed with insertion.";
+            return false;
+        }
+        const std::string sql =
+            "INSERT OR IGNORE INTO secret ('timestamp','secret','mine','sweep')"
+            "VALUES(:timestamp,:secret,:mine,TRUE);"
+            ""
+            "UPDATE secret SET mine = mine & :mine, sweep = TRUE WHERE secret = :secret;"
+            ""
+            "INSERT INTO output ('timestamp','hash','secret_id','amount','spent')"
+            "VALUES(:timestamp,:hash,(SELECT id FROM 'secret' WHERE secret = :secret),:amount,FALSE);";
+        const std::vector<PublicWebcash> pks = DerivePublicWebcash(sks);
+        for (size_t i = 0; i < sks.size(); ++i) {
+            const SecretWebcash& sk = sks[i];
+            const PublicWebcash& pk = pks[i];
+            SqlParams params;
+            params["timestamp"] = SqlInteger(timestamp);
+            params["secret"] = SqlText(sk.sk);
+            params["mine"] = SqlBool(mine);
+            params["hash"] = SqlBlob(pk.pk.begin(), pk.pk.end());
+            params["amount"] = SqlInteger(pk.amount.i64);
+            if (!ExecuteSql(sql, params)) {
+                LogError() << "Error adding secret to wallet; unable to proceed with insertion.";
+                ExecuteSql("ROLLBACK;", {});
+                return false;
+            }
+
+            WalletOutput woutput;
+            woutput.id = sqlite3_last_insert_rowid(m_db);
+            woutput.timestamp = now;
+            woutput.hash = pk.pk;
+            woutput.secret = std::make_unique<WalletSecret>();
+            woutput.secret->id = 0;
+            woutput.secret->timestamp = now;
+            woutput.secret->secret = sk.sk;
+            woutput.secret->mine = mine;
+            woutput.secret->sweep = true;
+            woutput.amount = pk.amount;
+            woutput.spent = false;
+            inputs.emplace_back(std::move(woutput));
+
+            total += pk.amount;
+            if (total.i64 < 1) {
+                LogError() << "overflow summing webcash to be inserted.";
+                ExecuteSql("ROLLBACK;", {});
+                return false;
+            }
+        }
+        if (!ExecuteSql("COMMIT;", {})) {
+            LogError() << "Error committing secrets to wallet; unable to proceed with insertion.";
+            return false;
+        }
+        for (const WalletOutput& woutput : inputs) {
+            AddUnspent(PublicWebcash(woutput.hash, woutput.amount), woutput.id);
+            // A claimed mining secret keeps its depth.
+            m_mining_reserved.erase(woutput.secret->secret);
+        }
+    }
+
+    // Sweep all of them into a single change output.  See the comment in
+    // Insert() above regarding the choice of chain for change.
+    WalletSecret wchange = ReserveSecret(now, /* mine = */ true, /* sweep = */ true);
+
+    std::vector<std::pair<WalletSecret, Amount>> outputs;
+    outputs.emplace_back(wchange, total);
+
+    std::vector<std::pair<WalletSecret, int>> res = ReplaceWebcash(now, inputs, outputs);
+    if (res.size() != 1) {
+        LogError() << "Error executing replacement on server; keys are secured in wallet, but assuming replacement did not go through.";
+        return false;
+    }
+
+    return true;
+}
+
+Amount Wallet::GetBalance()
+{
+    LOCK_GUARD(m_mut);
+    return m_balance;
+}
+
+size_t Wallet::GetNumUnspent()
+{
+    LOCK_GUARD(m_mut);
+    return m_unspent.size();
+}
+
+std::vector<PublicWebcash> Wallet::SelectOutputs(Amount target)
+{
+    LOCK_GUARD(m_mut);
+    std::vector<PublicWebcash> ret;
+    if (target.i64 < 1 || m_balance < target) {
+        return ret;
+    }
+    // The index is ordered by amount and then hash, so this is the first
+    // output worth at least target.
+    auto itr = m_unspent_by_amount.lower_bound(PublicWebcash(uint256(), target));
+    if (itr != m_unspent_by_amount.end()) {
+        ret.push_back(*itr);
+        return ret;
+    }
+    Amount total = 0;
+    for (auto r = m_unspent_by_amount.rbegin(); r != m_unspent_by_amount.rend() && total < target; ++r) {
+        ret.push_back(*r);
+        total += r->amount;
+    }
+    return ret;
+}
+
+std::vector<PublicWebcash> Wallet::GetSmallestOutputs(size_t count)
+{
+    LOCK_GUARD(m_mut);
+    std::vector<PublicWebcash> ret;
+    for (auto itr = m_unspent_by_amount.begin(); itr != m_unspent_by_amount.end() && ret.size() < count; ++itr) {
+        ret.push_back(*itr);
+    }
+    return ret;
+}
+
 bool Wallet::HaveAcceptedTerms()
 {
-    const std::lock_guard<std::mutex> lock(m_mut);
+    LOCK_GUARD(m_mut);
     static const std::string stmt = "SELECT EXISTS(SELECT 1 FROM 'terms')";
     sqlite3_stmt* have_any_terms;
     int res = sqlite3_prepare_v2(m_db, stmt.c_str(), stmt.size(), &have_any_terms, nullptr);
     if (res != SQLITE_OK) {
         std::string msg(absl::StrCat("Unable to prepare SQL statement [\"", stmt, "\"]: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
-        std::cerr << msg << std::endl;
+        LogError() << msg;
         throw std::runtime_error(msg);
     }
     res = sqlite3_step(have_any_terms);
     if (res != SQLITE_ROW) {
         std::string msg(absl::StrCat("Expected a result from executing SQL statement [\"", sqlite3_expanded_sql(have_any_terms), "\"] not: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
-        std::cerr << msg << std::endl;
+        LogError() << msg;
         sqlite3_finalize(have_any_terms);
         throw std::runtime_error(msg);
     }
@@ -892,26 +1355,26 @@ bool Wallet::HaveAcceptedTerms()
 
 bool Wallet::AreTermsAccepted(const std::string& terms)
 {
-    const std::lock_guard<std::mutex> lock(m_mut);
+    LOCK_GUARD(m_mut);
     static const std::string stmt = "SELECT EXISTS(SELECT 1 FROM 'terms' WHERE body=?)";
     sqlite3_stmt* have_terms;
     int res = sqlite3_prepare_v2(m_db, stmt.c_str(), stmt.size(), &have_terms, nullptr);
     if (res != SQLITE_OK) {
         std::string msg(absl::StrCat("Unable to prepare SQL statement [\"", stmt, "\"]: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
-        std::cerr << msg << std::endl;
+        LogError() << msg;
         throw std::runtime_error(msg);
     }
     res = sqlite3_bind_text(have_terms, 1, terms.c_str(), terms.size(), SQLITE_STATIC);
     if (res != SQLITE_OK) {
         std::string msg(absl::StrCat("Unable to bind parameter 1 in SQL statement [\"", stmt, "\"]: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
-        std::cerr << msg << std::endl;
+        LogError() << msg;
         sqlite3_finalize(have_terms);
         throw std::runtime_error(msg);
     }
     res = sqlite3_step(have_terms);
     if (res != SQLITE_ROW) {
         std::string msg(absl::StrCat("Expected a result from executing SQL statement [\"", sqlite3_expanded_sql(have_terms), "\"] not: ", sqlite3_errstr(res), " (", std::to_string(res), ")"));
-        std::cerr << msg << std::endl;
+        LogError() << msg;
         sqlite3_finalize(have_terms);
         throw std::runtime_error(msg);
     }
@@ -923,7 +1386,7 @@ bool Wallet::AreTermsAccepted(const std::string& terms)
 void Wallet::AcceptTerms(const std::string& terms)
 {
     if (!AreTermsAccepted(terms)) {
-        const std::lock_guard<std::mutex> lock(m_mut);
+        LOCK_GUARD(m_mut);
         static const std::string sql =
             "INSERT OR IGNORE INTO terms ('body','timestamp')"
             "VALUES(:body,:timestamp)";
@@ -9,8 +9,14 @@
 
 #include "webcash.h"
 
+#include <deque>
+#include <map>
+#include <memory>
 #include <mutex>
+#include <optional>
+#include <set>
 #include <string>
+#include <unordered_map>
 #include <utility>
 #include <variant>
 #include <vector>
@@ -21,6 +27,11 @@
 #include "boost/interprocess/sync/file_lock.hpp"
 
 #include "sqlite3.h"
+#include "uint256map.h"
+
+namespace httplib {
+class Client;
+}
 
 struct SqlNull {
 };
@@ -80,6 +91,13 @@ struct WalletOutput {
     bool spent;
 };
 
+// An unspent output of the wallet, as kept in its in-memory index.  The
+// secret is left in the database until the output is spent.
+struct WalletUnspent {
+    int id;
+    Amount amount;
+};
+
 class Wallet {
 protected:
     std::mutex m_mut;
@@ -88,15 +106,95 @@ protected:
     boost::interprocess::file_lock m_db_lock;
     sqlite3* m_db;
 
+    struct CachedStatement {
+        sqlite3_stmt* stmt;
+        // The name of each parameter, without its ':' prefix, in order of
+        // index, so that binding needn't look them up by name.
+        std::vector<std::string> params;
+    };
+    struct CachedSql {
+        // The statements of the SQL text, in order.
+        std::vector<CachedStatement> stmts;
+        // How much of the SQL text is prepared.
+        size_t prepared = 0;
+    };
+    // Prepared statements are kept for reuse, keyed by their SQL text.
+    // Guarded by m_mut, except during construction.
+    std::unordered_map<std::string, CachedSql> m_stmts;
+
+    bool PrepareNextStatement(const std::string& sql, CachedSql& cached);
+    // Returns the cached statement for a single-statement SQL text,
+    // preparing it if necessary, or nullptr on error.
+    CachedStatement* GetCachedStatement(const std::string& sql);
+    bool BindParameters(const CachedStatement& cached, const SqlParams& params);
+    // Makes a cached statement ready for reuse.  Must be called after each
+    // execution.
+    static void ResetStatement(sqlite3_stmt* stmt);
+    // Must be called before the database is closed, which otherwise stays
+    // open for as long as it has statements.
+    void FinalizeStatements();
+
     bool ExecuteSql(const std::string& sql, const SqlParams& params);
 
     int m_hdroot_id;
     uint256 m_hdroot;
 
+    // Kept open between replacements, to save the TCP and TLS handshakes.
+    // Created on first use, and guarded by m_mut.
+    std::unique_ptr<httplib::Client> m_client;
+
+    // The unspent outputs of the wallet, by hash, and the same outputs
+    // ordered by amount, for coin selection.  Loaded from the database on
+    // open and kept up to date as outputs are added and spent, along with
+    // their total.  Guarded by m_mut.
+    Uint256Map<WalletUnspent> m_unspent;
+    std::set<PublicWebcash> m_unspent_by_amount;
+    Amount m_balance;
+
+    void AddUnspent(const PublicWebcash& pk, int output_id);
+    void RemoveUnspent(const uint256& hash);
+
     void UpgradeDatabase();
     void GetOrCreateHDRoot();
+    void LoadUnspentOutputs();
+
+    // Secrets derived ahead of time for each HD chain, by its full
+    // chaincode.  Derived KEYPOOL_SIZE at a time, in parallel, when empty.
+    // A depth is only recorded in the database as it is handed out, so
+    // that the rest of the pool isn't lost on restart.  Guarded by m_mut.
+    static const size_t KEYPOOL_SIZE = 64;
+    struct KeyPool {
+        int hdchain_id;
+        // The chain's maxdepth, which is the depth of secrets.front().
+        int64_t depth;
+        std::deque<WalletSecret> secrets;
+    };
+    std::map<int64_t, KeyPool> m_keypool;
+
+    KeyPool& GetKeyPool(int64_t chaincode, bool mine, bool sweep);
+    std::vector<std::string> DeriveSecrets(int64_t chaincode, bool mine, bool sweep, int64_t depth, size_t count);
+    void RefillKeyPool(int64_t chaincode, bool mine, bool sweep, size_t count);
+    // Record that the secret at depth of the pool's chain is in use.
+    // Returns its id in the database, or 0 on error.
+    int RecordDepth(KeyPool& pool, int64_t depth, const WalletSecret& wsecret);
+    int GetSecretId(const std::string& secret);
 
     WalletSecret ReserveSecret(absl::Time timestamp, bool mine, bool sweep);
+
+    // Mining payloads have a chain of their own, apart from the change
+    // outputs which use the chain of the same type (see Insert()), and
+    // only use up a depth if a solution is found with it: depths which
+    // are released are handed out again, lowest first.  Those are the
+    // depths below the chain's maxdepth with no hdkey record, and are
+    // loaded on open.  Depths left reserved by a crash still have theirs,
+    // and so are skipped rather than reused, since a solution found with
+    // one may yet be submitted from the spill file.
+    static const int64_t MINING_CHAINCODE = 1;
+    std::set<int64_t> m_mining_free;
+    // The depths of the mining secrets which are reserved, by secret.
+    std::map<std::string, int64_t> m_mining_reserved;
+
+    void LoadMiningChain();
     int AddSecretToWallet(absl::Time timestamp, const SecretWebcash& sk, bool mine, bool sweep);
     int AddOutputToWallet(absl::Time timestamp, const PublicWebcash& pk, int secret_id, bool spent);
 
@@ -107,6 +205,37 @@ public:
     ~Wallet();
 
     bool Insert(const SecretWebcash& sk, bool mine);
+    // Like Insert(), but for many secrets at once: they are added to the
+    // database in one transaction and swept into a single change output by
+    // one replacement, rather than paying for each separately.  On failure,
+    // none of the secrets are known to have been swept.
+    bool Insert(const std::vector<SecretWebcash>& sks, bool mine);
+
+    // At most this many mining secrets are reserved at once, and so at
+    // most this many depths are skipped between two used ones, plus as
+    // many for each time the miner didn't exit cleanly.  Recovery from the
+    // master secret has to scan at least this far past the last depth in
+    // use before giving up.
+    static const size_t MINING_GAP_LIMIT = 256;
+
+    // A fresh secret from the wallet's mining chain, for the payload of a
+    // mining report, so that mined webcash can be recovered from the
+    // wallet's master secret.  Returns nothing if MINING_GAP_LIMIT secrets
+    // are already reserved.  The reservation ends when the secret is
+    // claimed by Insert(), or released if no solution was found with it.
+    std::optional<SecureString> ReserveMiningSecret();
+    void ReleaseMiningSecret(const SecureString& sk);
+
+    // The total value of the wallet's unspent outputs.
+    Amount GetBalance();
+    size_t GetNumUnspent();
+    // Choose unspent outputs worth at least target in total, for a payment:
+    // the smallest single output that is enough if there is one, or else
+    // the fewest of the largest outputs.  Returns nothing if the balance is
+    // too small.
+    std::vector<PublicWebcash> SelectOutputs(Amount target);
+    // The count smallest unspent outputs, to be consolidated.
+    std::vector<PublicWebcash> GetSmallestOutputs(size_t count);
 
     // Have *any* terms of service been accepted?
     bool HaveAcceptedTerms();
@@ -0,0 +1,482 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include "walletd.h"
+
+#include <iostream>
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "support/cleanse.h"
+#include "wallet.h"
+
+#include "absl/strings/str_split.h"
+
+namespace {
+
+/** Large enough for a batch of a few thousand claim codes, or a long terms
+ *  of service document. */
+const uint32_t MAX_MESSAGE_SIZE = 16 * 1024 * 1024;
+
+void put_uint32(std::string& out, uint32_t v)
+{
+    for (int i = 3; i >= 0; --i) {
+        out.push_back((char)(v >> (8 * i)));
+    }
+}
+
+uint32_t get_uint32(const std::string& in, size_t pos)
+{
+    uint32_t v = 0;
+    for (size_t i = 0; i < 4; ++i) {
+        v = (v << 8) | (unsigned char)in[pos + i];
+    }
+    return v;
+}
+
+bool write_all(int fd, const char* data, size_t len)
+{
+    while (len) {
+        const ssize_t n = send(fd, data, len, MSG_NOSIGNAL);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool read_all(int fd, char* data, size_t len)
+{
+    while (len) {
+        const ssize_t n = recv(fd, data, len, 0);
+        if (n <= 0) {
+            return false;
+        }
+        data += n;
+        len -= n;
+    }
+    return true;
+}
+
+bool send_message(int fd, WalletMessage type, const std::string& payload)
+{
+    std::string msg;
+    msg.reserve(5 + payload.size());
+    put_uint32(msg, 1 + payload.size());
+    msg.push_back((char)type);
+    msg += payload;
+    const bool ok = write_all(fd, msg.data(), msg.size());
+    // Messages carry secrets in both directions.
+    memory_cleanse(&msg[0], msg.size());
+    return ok;
+}
+
+bool recv_message(int fd, WalletMessage& type, std::string& payload)
+{
+    std::string header(5, '\0');
+    if (!read_all(fd, &header[0], header.size())) {
+        return false;
+    }
+    const uint32_t len = get_uint32(header, 0);
+    if (len < 1 || len > MAX_MESSAGE_SIZE) {
+        return false;
+    }
+    type = (WalletMessage)header[4];
+    payload.resize(len - 1);
+    return payload.empty() || read_all(fd, &payload[0], payload.size());
+}
+
+/** Fills in addr for path.  Returns false if path is too long. */
+bool make_address(const std::string& path, struct sockaddr_un& addr)
+{
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path)) {
+        return false;
+    }
+    memcpy(addr.sun_path, path.data(), path.size());
+    return true;
+}
+
+std::string serialize_claims(const std::vector<SecretWebcash>& sks, bool mine)
+{
+    std::string out(1, (char)mine);
+    for (const SecretWebcash& sk : sks) {
+        const SecureString line = to_string(sk);
+        out.append(line.data(), line.size());
+        out.push_back('\n');
+    }
+    return out;
+}
+
+bool parse_claims(const std::string& in, std::vector<SecretWebcash>& sks, bool& mine)
+{
+    if (in.empty()) {
+        return false;
+    }
+    mine = in[0] != 0;
+    for (absl::string_view line : absl::StrSplit(absl::string_view(in).substr(1), '\n', absl::SkipEmpty())) {
+        SecretWebcash sk;
+        if (!sk.parse(line)) {
+            return false;
+        }
+        sks.push_back(std::move(sk));
+    }
+    return !sks.empty();
+}
+
+} // namespace
+
+WalletServer::WalletServer(Wallet& wallet)
+    : m_wallet(wallet)
+{
+}
+
+WalletServer::~WalletServer()
+{
+    Stop();
+}
+
+bool WalletServer::Listen(const std::string& path)
+{
+    struct sockaddr_un addr;
+    if (!make_address(path, addr)) {
+        std::cerr << "Error: wallet socket path '" << path << "' is too long" << std::endl;
+        return false;
+    }
+    const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        std::cerr << "Error: unable to create wallet socket" << std::endl;
+        return false;
+    }
+    // A socket left behind by a process which didn't shut down cleanly
+    // would otherwise make bind() fail.  A live server is detected first,
+    // so that two processes can't both serve the wallet.
+    const int probe = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (probe >= 0 && connect(probe, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+        close(probe);
+        close(fd);
+        std::cerr << "Error: a wallet is already being served at " << path << std::endl;
+        return false;
+    }
+    if (probe >= 0) {
+        close(probe);
+    }
+    unlink(path.c_str());
+    // Anyone who can connect can spend from the wallet, so the socket is
+    // only accessible to its owner.  Its mode is set before listen(), until
+    // which no client can connect, rather than by changing the umask, which
+    // is shared with every other thread of the process.
+    if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) != 0
+            || chmod(path.c_str(), S_IRUSR | S_IWUSR) != 0
+            || listen(fd, SOMAXCONN) != 0) {
+        close(fd);
+        std::cerr << "Error: unable to serve the wallet at " << path << std::endl;
+        return false;
+    }
+    m_path = path;
+    m_listen_fd = fd;
+    m_insert_thread = std::thread(&WalletServer::InsertLoop, this);
+    m_accept_thread = std::thread(&WalletServer::AcceptLoop, this);
+    return true;
+}
+
+void WalletServer::AcceptLoop()
+{
+    while (!m_stop) {
+        const int fd = accept(m_listen_fd, nullptr, nullptr);
+        if (fd < 0) {
+            continue;
+        }
+        if (m_stop) {
+            close(fd);
+            break;
+        }
+        std::shared_ptr<Client> client = std::make_shared<Client>();
+        client->fd = fd;
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        Reap();
+        client->thread = std::thread(&WalletServer::Serve, this, client);
+        m_clients.push_back(client);
+    }
+}
+
+void WalletServer::Serve(std::shared_ptr<Client> client)
+{
+    WalletMessage type;
+    std::string payload;
+    while (!m_stop && recv_message(client->fd, type, payload)) {
+        std::string reply;
+        try {
+            if (type == WalletMessage::INSERT) {
+                std::vector<SecretWebcash> sks;
+                bool mine;
+                if (!parse_claims(payload, sks, mine)) {
+                    std::cerr << "Error: malformed claim from wallet client; disconnecting" << std::endl;
+                    break;
+                }
+                reply.push_back((char)Insert(std::move(sks), mine));
+            } else if (type == WalletMessage::RESERVE_MINING_SECRET && payload.empty()) {
+                const std::optional<SecureString> sk = m_wallet.ReserveMiningSecret();
+                if (sk) {
+                    reply.assign(sk->data(), sk->size());
+                }
+            } else if (type == WalletMessage::RELEASE_MINING_SECRET) {
+                m_wallet.ReleaseMiningSecret(SecureString(payload.data(), payload.size()));
+                reply.push_back((char)true);
+            } else if (type == WalletMessage::HAVE_ACCEPTED_TERMS && payload.empty()) {
+                reply.push_back((char)m_wallet.HaveAcceptedTerms());
+            } else if (type == WalletMessage::ARE_TERMS_ACCEPTED) {
+                reply.push_back((char)m_wallet.AreTermsAccepted(payload));
+            } else if (type == WalletMessage::ACCEPT_TERMS) {
+                m_wallet.AcceptTerms(payload);
+                reply.push_back((char)true);
+            } else {
+                std::cerr << "Error: protocol violation by wallet client; disconnecting" << std::endl;
+                break;
+            }
+        } catch (const std::exception& e) {
+            // The wallet has logged the details.  An empty reply tells the
+            // client that the request failed.
+            reply.clear();
+        }
+        memory_cleanse(&payload[0], payload.size());
+        if (!send_message(client->fd, type, reply)) {
+            break;
+        }
+    }
+    memory_cleanse(&payload[0], payload.size());
+    close(client->fd);
+    client->done = true;
+}
+
+bool WalletServer::Insert(std::vector<SecretWebcash> sks, bool mine)
+{
+    std::shared_ptr<PendingInsert> pending = std::make_shared<PendingInsert>();
+    pending->sks = std::move(sks);
+    pending->mine = mine;
+    std::future<bool> claimed = pending->claimed.get_future();
+    {
+        const std::lock_guard<std::mutex> lock(m_insert_mutex);
+        if (m_stop) {
+            return false;
+        }
+        m_inserts.push_back(pending);
+    }
+    m_insert_cv.notify_one();
+    return claimed.get();
+}
+
+void WalletServer::InsertLoop()
+{
+    while (true) {
+        // Take every claim of the same kind as the oldest that arrived
+        // while the last batch was being claimed, so that a burst from many
+        // miners costs a single replacement.
+        std::vector<std::shared_ptr<PendingInsert>> batch;
+        {
+            std::unique_lock<std::mutex> lock(m_insert_mutex);
+            m_insert_cv.wait(lock, [this] { return m_stop || !m_inserts.empty(); });
+            if (m_inserts.empty()) {
+                return;
+            }
+            const bool mine = m_inserts.front()->mine;
+            for (auto it = m_inserts.begin(); it != m_inserts.end();) {
+                if ((*it)->mine == mine) {
+                    batch.push_back(std::move(*it));
+                    it = m_inserts.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+
+        std::vector<SecretWebcash> sks;
+        for (const std::shared_ptr<PendingInsert>& pending : batch) {
+            sks.insert(sks.end(), pending->sks.begin(), pending->sks.end());
+        }
+        bool claimed = false;
+        try {
+            claimed = m_wallet.Insert(sks, batch.front()->mine);
+        } catch (const std::exception& e) {
+            std::cerr << "Error: unable to claim webcash for wallet clients: " << e.what() << std::endl;
+        }
+        if (claimed || batch.size() == 1) {
+            for (const std::shared_ptr<PendingInsert>& pending : batch) {
+                pending->claimed.set_value(claimed);
+            }
+            continue;
+        }
+        // One client's claim can fail the whole replacement, so each is
+        // retried on its own, and answered with its own result.
+        for (const std::shared_ptr<PendingInsert>& pending : batch) {
+            bool claimed = false;
+            try {
+                claimed = m_wallet.Insert(pending->sks, pending->mine);
+            } catch (const std::exception& e) {
+                std::cerr << "Error: unable to claim webcash for wallet client: " << e.what() << std::endl;
+            }
+            pending->claimed.set_value(claimed);
+        }
+    }
+}
+
+void WalletServer::Reap()
+{
+    for (auto it = m_clients.begin(); it != m_clients.end();) {
+        if ((*it)->done) {
+            (*it)->thread.join();
+            it = m_clients.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void WalletServer::Stop()
+{
+    if (m_stop.exchange(true)) {
+        return;
+    }
+    if (m_listen_fd >= 0) {
+        // Wakes up the accept() call.
+        shutdown(m_listen_fd, SHUT_RDWR);
+        m_accept_thread.join();
+        close(m_listen_fd);
+        m_listen_fd = -1;
+        unlink(m_path.c_str());
+    }
+    {
+        const std::lock_guard<std::mutex> lock(m_mutex);
+        for (const std::shared_ptr<Client>& client : m_clients) {
+            if (!client->done) {
+                shutdown(client->fd, SHUT_RDWR);
+            }
+        }
+    }
+    // Claims already queued are still made, and their clients told of the
+    // outcome if they're still listening.
+    if (m_insert_thread.joinable()) {
+        {
+            const std::lock_guard<std::mutex> lock(m_insert_mutex);
+            m_insert_cv.notify_all();
+        }
+        m_insert_thread.join();
+    }
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    for (const std::shared_ptr<Client>& client : m_clients) {
+        client->thread.join();
+    }
+    m_clients.clear();
+}
+
+WalletClient::WalletClient(const std::string& path)
+    : m_path(path)
+{
+}
+
+WalletClient::~WalletClient()
+{
+    if (m_fd >= 0) {
+        close(m_fd);
+    }
+}
+
+bool WalletClient::Call(WalletMessage type, const std::string& request, std::string& reply)
+{
+    const std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_fd < 0) {
+        struct sockaddr_un addr;
+        if (!make_address(m_path, addr)) {
+            return false;
+        }
+        m_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (m_fd < 0) {
+            return false;
+        }
+        if (connect(m_fd, (struct sockaddr*)&addr, sizeof(addr)) != 0) {
+            close(m_fd);
+            m_fd = -1;
+            std::cerr << "Error: unable to connect to the wallet served at " << m_path << std::endl;
+            return false;
+        }
+    }
+    WalletMessage reply_type;
+    if (!send_message(m_fd, type, request) || !recv_message(m_fd, reply_type, reply) || reply_type != type) {
+        close(m_fd);
+        m_fd = -1;
+        std::cerr << "Error: lost connection to the wallet served at " << m_path << std::endl;
+        return false;
+    }
+    return true;
+}
+
+bool WalletClient::CallForFlag(WalletMessage type, const std::string& request)
+{
+    std::string reply;
+    if (!Call(type, request, reply) || reply.size() != 1) {
+        throw std::runtime_error("Unable to reach the wallet served at " + m_path + ".");
+    }
+    return reply[0] != 0;
+}
+
+bool WalletClient::Insert(const std::vector<SecretWebcash>& sks, bool mine)
+{
+    std::string request = serialize_claims(sks, mine);
+    std::string reply;
+    const bool ok = Call(WalletMessage::INSERT, request, reply);
+    memory_cleanse(&request[0], request.size());
+    return ok && reply.size() == 1 && reply[0] != 0;
+}
+
+std::optional<SecureString> WalletClient::ReserveMiningSecret()
+{
+    std::string reply;
+    if (!Call(WalletMessage::RESERVE_MINING_SECRET, std::string(), reply) || reply.empty()) {
+        return std::nullopt;
+    }
+    SecureString sk(reply.data(), reply.size());
+    memory_cleanse(&reply[0], reply.size());
+    return sk;
+}
+
+void WalletClient::ReleaseMiningSecret(const SecureString& sk)
+{
+    std::string request(sk.data(), sk.size());
+    std::string reply;
+    Call(WalletMessage::RELEASE_MINING_SECRET, request, reply);
+    memory_cleanse(&request[0], request.size());
+}
+
+bool WalletClient::HaveAcceptedTerms()
+{
+    return CallForFlag(WalletMessage::HAVE_ACCEPTED_TERMS, std::string());
+}
+
+bool WalletClient::AreTermsAccepted(const std::string& terms)
+{
+    return CallForFlag(WalletMessage::ARE_TERMS_ACCEPTED, terms);
+}
+
+void WalletClient::AcceptTerms(const std::string& terms)
+{
+    if (!CallForFlag(WalletMessage::ACCEPT_TERMS, terms)) {
+        throw std::runtime_error("Unable to accept terms of service in the wallet served at " + m_path + ".");
+    }
+}
+
+// End of File
@@ -0,0 +1,161 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#ifndef WALLETD_H
+#define WALLETD_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <future>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "support/allocators/secure.h"
+#include "webcash.h"
+
+class Wallet;
+
+/**
+ * The protocol spoken between a process which owns a wallet (webminer
+ * --servewallet) and the miners on the same host which use it (webminer
+ * --remotewallet), over a Unix domain socket.  Framing is as for the
+ * coordinator protocol: a 4-byte big-endian length, counting the type byte
+ * and the payload, followed by the type byte and the payload.  Each request
+ * is answered by a single reply of the same type, in order.
+ */
+enum class WalletMessage : uint8_t {
+    /** Request: a byte which is nonzero if the webcash was mined, then the
+     *  secret webcash claim codes, each followed by a newline.  Reply: a
+     *  byte which is nonzero if they were all claimed. */
+    INSERT = 1,
+    /** Request: no payload.  Reply: a secret from the wallet's mining
+     *  chain, or no payload on failure. */
+    RESERVE_MINING_SECRET = 2,
+    /** Request: no payload.  Reply: a byte which is nonzero if any terms of
+     *  service have been accepted. */
+    HAVE_ACCEPTED_TERMS = 3,
+    /** Request: the terms of service.  Reply: a byte which is nonzero if
+     *  they have been accepted. */
+    ARE_TERMS_ACCEPTED = 4,
+    /** Request: the terms of service.  Reply: a byte which is nonzero on
+     *  success. */
+    ACCEPT_TERMS = 5,
+    /** Request: a reserved mining secret which found no solution.  Reply:
+     *  a byte which is nonzero on success. */
+    RELEASE_MINING_SECRET = 6,
+};
+
+/**
+ * Serves a wallet to the other processes on the host, with one thread per
+ * client.  Claims from all the clients are handed to a single thread, which
+ * sweeps whatever has queued up into the wallet with one replacement.
+ */
+class WalletServer {
+public:
+    /** The wallet must outlive the server. */
+    explicit WalletServer(Wallet& wallet);
+    ~WalletServer();
+
+    WalletServer(const WalletServer&) = delete;
+    WalletServer& operator=(const WalletServer&) = delete;
+
+    /** Start accepting clients on the Unix socket at path, replacing any
+     *  stale socket left there.  Returns false if it can't be listened on. */
+    bool Listen(const std::string& path);
+
+    /** Disconnect all clients, stop listening and remove the socket. */
+    void Stop();
+
+private:
+    struct Client {
+        int fd;
+        std::atomic<bool> done{false};
+        std::thread thread;
+    };
+
+    struct PendingInsert {
+        std::vector<SecretWebcash> sks;
+        bool mine;
+        std::promise<bool> claimed;
+    };
+
+    void AcceptLoop();
+    void Serve(std::shared_ptr<Client> client);
+    void InsertLoop();
+    /** Blocks until the inserter thread has claimed sks. */
+    bool Insert(std::vector<SecretWebcash> sks, bool mine);
+    /** Joins the threads of disconnected clients.  Requires m_mutex. */
+    void Reap();
+
+    Wallet& m_wallet;
+    std::string m_path;
+
+    int m_listen_fd = -1;
+    std::atomic<bool> m_stop{false};
+    std::thread m_accept_thread;
+    std::thread m_insert_thread;
+
+    std::mutex m_mutex;
+    std::list<std::shared_ptr<Client>> m_clients;
+
+    /** Guards m_inserts, and wakes up the inserter thread. */
+    std::mutex m_insert_mutex;
+    std::condition_variable m_insert_cv;
+    std::deque<std::shared_ptr<PendingInsert>> m_inserts;
+};
+
+/**
+ * A wallet served by another process.  Each call is a round trip over a
+ * connection which is (re)established on demand, so that the miner keeps
+ * working across a restart of the serving process.  Thread-safe, although
+ * calls are serialized.
+ */
+class WalletClient {
+public:
+    explicit WalletClient(const std::string& path);
+    ~WalletClient();
+
+    WalletClient(const WalletClient&) = delete;
+    WalletClient& operator=(const WalletClient&) = delete;
+
+    /** As Wallet::Insert.  Returns false if the wallet can't be reached. */
+    bool Insert(const std::vector<SecretWebcash>& sks, bool mine);
+
+    /** As Wallet::ReserveMiningSecret, or std::nullopt if the wallet can't
+     *  be reached. */
+    std::optional<SecureString> ReserveMiningSecret();
+    /** As Wallet::ReleaseMiningSecret.  Should the wallet be unreachable,
+     *  the secret's depth is left unused. */
+    void ReleaseMiningSecret(const SecureString& sk);
+
+    /** As their Wallet counterparts, except that these throw
+     *  std::runtime_error if the wallet can't be reached. */
+    bool HaveAcceptedTerms();
+    bool AreTermsAccepted(const std::string& terms);
+    void AcceptTerms(const std::string& terms);
+
+private:
+    /** Send a request and wait for its reply.  Returns false, dropping the
+     *  connection, on any failure. */
+    bool Call(WalletMessage type, const std::string& request, std::string& reply);
+    bool CallForFlag(WalletMessage type, const std::string& request);
+
+    const std::string m_path;
+    std::mutex m_mutex;
+    int m_fd = -1;
+};
+
+#endif // WALLETD_H
+
+// End of File
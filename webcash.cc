@@ -6,18 +6,148 @@
 
 #include "webcash.h"
 
+#include <algorithm>
+#include <iterator>
+#include <limits>
 #include <string>
+#include <vector>
 
 #include <stdint.h>
+#include <string.h>
+
+#include "support/cleanse.h"
 
 #include "absl/numeric/int128.h"
 
-#include "absl/strings/escaping.h"
-#include "absl/strings/str_cat.h"
-#include "absl/strings/str_join.h"
-#include "absl/strings/str_split.h"
+#include "absl/strings/ascii.h"
 #include "absl/strings/string_view.h"
 
+#if defined(__x86_64__) || defined(__amd64__)
+#include <emmintrin.h>
+#endif
+
+namespace {
+
+#if !(defined(__x86_64__) || defined(__amd64__))
+int hex_digit_value(char c)
+{
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c |= 0x20; // lowercase
+    if (c >= 'a' && c <= 'f') {
+        return c - 'a' + 10;
+    }
+    return -1;
+}
+#endif
+
+/** Decode the 64 hex digits at hex, in either case, into the 32 bytes at
+ *  out.  Returns false if any of them isn't a hex digit, in which case out
+ *  holds garbage. */
+bool decode_hex32(const char* hex, unsigned char* out)
+{
+#if defined(__x86_64__) || defined(__amd64__)
+    // Sixteen digits at a time: classify each as a decimal digit or a
+    // letter, take its value accordingly, and then pack each pair of values
+    // into a byte.  SSE2 is part of x86-64, so needs no detection.
+    const __m128i below_zero = _mm_set1_epi8('0' - 1);
+    const __m128i above_nine = _mm_set1_epi8('9' + 1);
+    const __m128i below_a = _mm_set1_epi8('a' - 1);
+    const __m128i above_f = _mm_set1_epi8('f' + 1);
+    const __m128i lowercase = _mm_set1_epi8(0x20);
+    const __m128i low_bytes = _mm_set1_epi16(0x00ff);
+    int valid = 0xffff;
+    for (int i = 0; i < 2; ++i) {
+        __m128i pairs[2];
+        for (int j = 0; j < 2; ++j) {
+            const __m128i c = _mm_loadu_si128((const __m128i*)(hex + 32*i + 16*j));
+            const __m128i l = _mm_or_si128(c, lowercase);
+            const __m128i is_digit = _mm_and_si128(_mm_cmpgt_epi8(c, below_zero), _mm_cmplt_epi8(c, above_nine));
+            const __m128i is_letter = _mm_and_si128(_mm_cmpgt_epi8(l, below_a), _mm_cmplt_epi8(l, above_f));
+            valid &= _mm_movemask_epi8(_mm_or_si128(is_digit, is_letter));
+            const __m128i v = _mm_or_si128(
+                _mm_and_si128(is_digit, _mm_sub_epi8(c, _mm_set1_epi8('0'))),
+                _mm_andnot_si128(is_digit, _mm_sub_epi8(l, _mm_set1_epi8('a' - 10))));
+            // Each 16-bit lane holds the high nibble of a byte in its low
+            // half, and the low nibble in its high half.
+            pairs[j] = _mm_or_si128(_mm_slli_epi16(_mm_and_si128(v, low_bytes), 4), _mm_srli_epi16(v, 8));
+        }
+        _mm_storeu_si128((__m128i*)(out + 16*i), _mm_packus_epi16(pairs[0], pairs[1]));
+    }
+    return valid == 0xffff;
+#else
+    for (int i = 0; i < 32; ++i) {
+        const int hi = hex_digit_value(hex[2*i]);
+        const int lo = hex_digit_value(hex[2*i + 1]);
+        if (hi < 0 || lo < 0) {
+            return false;
+        }
+        out[i] = (hi << 4) | lo;
+    }
+    return true;
+#endif
+}
+
+/** Encode the 32 bytes at in as 64 lowercase hex digits at hex. */
+void encode_hex32(const unsigned char* in, char* hex)
+{
+#if defined(__x86_64__) || defined(__amd64__)
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i zero = _mm_set1_epi8('0');
+    const __m128i letter = _mm_set1_epi8('a' - '0' - 10);
+    for (int i = 0; i < 2; ++i) {
+        const __m128i b = _mm_loadu_si128((const __m128i*)(in + 16*i));
+        const __m128i hi = _mm_and_si128(_mm_srli_epi16(b, 4), nibble);
+        const __m128i lo = _mm_and_si128(b, nibble);
+        for (int j = 0; j < 2; ++j) {
+            const __m128i n = j ? _mm_unpackhi_epi8(hi, lo) : _mm_unpacklo_epi8(hi, lo);
+            const __m128i c = _mm_add_epi8(_mm_add_epi8(n, zero), _mm_and_si128(_mm_cmpgt_epi8(n, nine), letter));
+            _mm_storeu_si128((__m128i*)(hex + 32*i + 16*j), c);
+        }
+    }
+#else
+    static const char digits[] = "0123456789abcdef";
+    for (int i = 0; i < 32; ++i) {
+        hex[2*i] = digits[in[i] >> 4];
+        hex[2*i + 1] = digits[in[i] & 0x0f];
+    }
+#endif
+}
+
+/** Split "AMOUNT:TYPE:REST" at its first two colons. */
+bool split_webcash(const absl::string_view& str, absl::string_view& amount, absl::string_view& type, absl::string_view& rest)
+{
+    const size_t first = str.find(':');
+    if (first == absl::string_view::npos) {
+        return false;
+    }
+    const size_t second = str.find(':', first + 1);
+    if (second == absl::string_view::npos) {
+        return false;
+    }
+    amount = str.substr(0, first);
+    type = str.substr(first + 1, second - first - 1);
+    rest = str.substr(second + 1);
+    return true;
+}
+
+char* write_webcash(char* out, Amount amount, const absl::string_view& type)
+{
+    if (amount.i64 < 0) {
+        amount.i64 = 0;
+    }
+    *out++ = 'e';
+    out = to_chars(out, amount);
+    *out++ = ':';
+    out = std::copy(type.begin(), type.end(), out);
+    *out++ = ':';
+    return out;
+}
+
+} // namespace
+
 // Requires an input that is a fractional-precision decimal with no more than 8
 // digits past the decimal point, with a leading minus sign if the value is
 // negative.  Extremely ficky parser that only values that could be output by
@@ -27,6 +157,21 @@ bool Amount::parse(const absl::string_view& str) {
     if (str.empty()) {
         return false;
     }
+
+    // Fast path for a whole number of webcash, as in all mining amounts,
+    // with few enough digits that it can't overflow.
+    if (str.size() <= 10 && (str.size() == 1 || str[0] != '0')) {
+        int64_t whole = 0;
+        size_t n = 0;
+        for (; n < str.size() && absl::ascii_isdigit(str[n]); ++n) {
+            whole = 10 * whole + (str[n] - '0');
+        }
+        if (n == str.size()) {
+            i64 = whole * 100000000LL;
+            return true;
+        }
+    }
+
     // Sanity: no embedded NUL characters allowed.
     if (str.size() != strnlen(str.data(), str.size())) {
         return false;
@@ -120,87 +265,187 @@ bool Amount::parse(const absl::string_view& str) {
 // and including the decimal place itself are not output.
 //     e.g. 3000000 is rendered as "0.03"
 std::string to_string(const Amount& amt) {
-    using std::to_string;
-    std::lldiv_t div = std::lldiv(std::abs(amt.i64), 100000000LL);
-    std::string res = (amt.i64 < 0) ? "-" : "";
-    res += to_string(div.quot);
-    if (div.rem) {
-        std::string frac = to_string(div.rem);
-        res.push_back('.');
-        res.insert(res.end(), 8 - frac.length(), '0');
-        res += frac;
-        while (res.back() == '0') {
-            res.pop_back();
+    char buf[MAX_AMOUNT_CHARS];
+    return std::string(buf, to_chars(buf, amt));
+}
+
+char* to_chars(char* out, const Amount& amt) {
+    uint64_t abs = amt.i64;
+    if (amt.i64 < 0) {
+        *out++ = '-';
+        abs = -abs;
+    }
+    uint64_t quot = abs / 100000000;
+    uint64_t rem = abs % 100000000;
+    char digits[20];
+    char* pos = std::end(digits);
+    do {
+        *--pos = '0' + (quot % 10);
+        quot /= 10;
+    } while (quot);
+    out = std::copy(pos, std::end(digits), out);
+    if (rem) {
+        *out++ = '.';
+        for (int i = 7; i >= 0; --i) {
+            out[i] = '0' + (rem % 10);
+            rem /= 10;
+        }
+        out += 8;
+        while (out[-1] == '0') {
+            --out;
         }
     }
-    return res;
+    return out;
 }
 
 bool SecretWebcash::parse(
     const absl::string_view& str
 ){
-    std::vector<std::string> parts = absl::StrSplit(str, ':');
-    if (parts.size() < 3 || parts[1] != "secret") {
+    // The secret is everything after the second colon, colons and all.
+    absl::string_view amount_str, type, secret;
+    if (!split_webcash(str, amount_str, type, secret) || type != "secret") {
         return false;
     }
-    if (!parts[0].empty() && parts[0][0] == 'e') {
+    if (!amount_str.empty() && amount_str[0] == 'e') {
         // Remove leading 'e', if present
-        parts[0].erase(parts[0].begin());
+        amount_str.remove_prefix(1);
     }
-    if (!amount.parse(parts[0])) {
+    if (!amount.parse(amount_str)) {
         return false;
     }
-    sk = absl::StrJoin(parts.begin() + 2, parts.end(), ":");
+    sk.assign(secret.data(), secret.size());
     return true;
 }
 
 bool PublicWebcash::parse(
     const absl::string_view& str
 ){
-    std::vector<std::string> parts = absl::StrSplit(str, ':');
-    if (parts.size() != 3 || parts[1] != "public") {
+    absl::string_view amount_str, type, hash;
+    if (!split_webcash(str, amount_str, type, hash) || type != "public" || hash.size() != 64) {
         return false;
     }
     Amount _amount;
-    if (!parts[0].empty() && parts[0][0] == 'e') {
+    if (!amount_str.empty() && amount_str[0] == 'e') {
         // Remove leading 'e', if present
-        parts[0].erase(0, 1);
-    } else if (parts[0].size() >= 3 && parts[0][0] == '\xe2' && parts[0][1] == '\x82' && parts[0][3] == '\xa9') {
+        amount_str.remove_prefix(1);
+    } else if (amount_str.size() >= 3 && amount_str[0] == '\xe2' && amount_str[1] == '\x82' && amount_str[2] == '\xa9') {
         // Remove leading '₩', if present
-        parts[0].erase(0, 3);
+        amount_str.remove_prefix(3);
     }
-    if (!_amount.parse(parts[0])) {
+    if (!_amount.parse(amount_str)) {
         return false;
     }
-    if (!is_uint256(parts[2])) {
+    uint256 _pk;
+    if (!decode_hex32(hash.data(), _pk.begin())) {
         return false;
     }
-    std::string pk_str = absl::HexStringToBytes(parts[2]);
-    std::copy(pk_str.begin(), pk_str.end(), pk.begin());
+    pk = _pk;
     amount = _amount;
     return true;
 }
 
-template<class Str>
-static Str webcash_string(Amount amount, const absl::string_view& type, const Str& hex)
+SecureString to_string(const SecretWebcash& esk)
 {
-    using std::to_string;
-    if (amount.i64 < 0) {
-        amount.i64 = 0;
-    }
-    return Str(absl::StrCat("e", to_string(amount), ":", type, ":", hex));
+    SecureString str(max_chars(esk), '\0');
+    str.resize(to_chars(&str[0], esk) - str.data());
+    return str;
 }
 
-SecureString to_string(const SecretWebcash& esk)
+char* to_chars(char* out, const SecretWebcash& esk)
 {
-    return webcash_string(esk.amount, "secret", esk.sk);
+    out = write_webcash(out, esk.amount, "secret");
+    return std::copy(esk.sk.begin(), esk.sk.end(), out);
 }
 
 std::string to_string(const PublicWebcash& epk)
 {
-    std::string hex = absl::BytesToHexString(absl::string_view((const char*)epk.pk.data(), epk.pk.size()));
-    return webcash_string(epk.amount, "public", hex);
+    char buf[MAX_PUBLIC_WEBCASH_CHARS];
+    return std::string(buf, to_chars(buf, epk));
+}
+
+char* to_chars(char* out, const PublicWebcash& epk)
+{
+    out = write_webcash(out, epk.amount, "public");
+    encode_hex32(epk.pk.data(), out);
+    return out + 64;
+}
+
+std::vector<PublicWebcash> DerivePublicWebcash(const std::vector<SecretWebcash>& sks)
+{
+    std::vector<PublicWebcash> pks(sks.size());
+    std::vector<size_t> batched;
+    batched.reserve(sks.size());
+    for (size_t i = 0; i < sks.size(); ++i) {
+        pks[i].amount = sks[i].amount;
+        if (sks[i].sk.size() == 64) {
+            batched.push_back(i);
+        } else {
+            pks[i] = PublicWebcash(sks[i]);
+        }
+    }
+    if (batched.empty()) {
+        return pks;
+    }
+
+    std::vector<unsigned char> in(64 * batched.size());
+    std::vector<unsigned char> out(32 * batched.size());
+    for (size_t j = 0; j < batched.size(); ++j) {
+        const SecureString& sk = sks[batched[j]].sk;
+        std::copy(sk.begin(), sk.end(), in.begin() + 64*j);
+    }
+    SHA256Hash64(out.data(), in.data(), batched.size());
+    memory_cleanse(in.data(), in.size());
+    for (size_t j = 0; j < batched.size(); ++j) {
+        std::copy(out.begin() + 32*j, out.begin() + 32*(j+1), pks[batched[j]].pk.begin());
+    }
+    return pks;
 }
 
+bool DerivePublicWebcash(const std::vector<absl::string_view>& sks, std::vector<PublicWebcash>& _pks)
+{
+    std::vector<PublicWebcash> pks(sks.size());
+    std::vector<absl::string_view> secrets(sks.size());
+    size_t num_batched = 0;
+    for (size_t i = 0; i < sks.size(); ++i) {
+        absl::string_view amount_str, type;
+        if (!split_webcash(sks[i], amount_str, type, secrets[i]) || type != "secret") {
+            return false;
+        }
+        if (!amount_str.empty() && amount_str[0] == 'e') {
+            // Remove leading 'e', if present
+            amount_str.remove_prefix(1);
+        }
+        if (!pks[i].amount.parse(amount_str)) {
+            return false;
+        }
+        if (secrets[i].size() == 64) {
+            ++num_batched;
+        } else {
+            CSHA256()
+                .Write((const unsigned char*)secrets[i].data(), secrets[i].size())
+                .Finalize(pks[i].pk.data());
+        }
+    }
+
+    if (num_batched) {
+        std::vector<unsigned char> in(64 * num_batched);
+        std::vector<unsigned char> out(32 * num_batched);
+        for (size_t i = 0, j = 0; i < sks.size(); ++i) {
+            if (secrets[i].size() == 64) {
+                std::copy(secrets[i].begin(), secrets[i].end(), in.begin() + 64*j++);
+            }
+        }
+        SHA256Hash64(out.data(), in.data(), num_batched);
+        memory_cleanse(in.data(), in.size());
+        for (size_t i = 0, j = 0; i < sks.size(); ++i) {
+            if (secrets[i].size() == 64) {
+                std::copy(out.begin() + 32*j, out.begin() + 32*(j+1), pks[i].pk.begin());
+                ++j;
+            }
+        }
+    }
+    _pks.swap(pks);
+    return true;
+}
 
 // End of File
@@ -8,6 +8,7 @@
 #define WEBCASH_H
 
 #include <string>
+#include <vector>
 
 #include <stdint.h>
 
@@ -43,6 +44,15 @@ inline Amount operator+(const Amount& lhs, const Amount& rhs) { return Amount(lh
 
 std::string to_string(const Amount& amt);
 
+/** Room enough for any amount written by to_chars(), e.g.
+ *  "-92233720368.54775808". */
+static const size_t MAX_AMOUNT_CHARS = 21;
+
+/** Write amt as to_string() would, into out, which must have room for
+ *  MAX_AMOUNT_CHARS.  No terminating NUL is written.  Returns a pointer past
+ *  the last character written. */
+char* to_chars(char* out, const Amount& amt);
+
 struct SecretWebcash {
     SecureString sk;
     Amount amount;
@@ -63,6 +73,14 @@ inline bool operator>(const SecretWebcash& lhs, const SecretWebcash& rhs) { retu
 
 SecureString to_string(const SecretWebcash& esk);
 
+/** The most characters to_chars() can write for esk. */
+inline size_t max_chars(const SecretWebcash& esk) { return 1 + MAX_AMOUNT_CHARS + 8 + esk.sk.size(); }
+
+/** Write esk as to_string() would, into out, which must have room for
+ *  max_chars(esk), without allocating.  Returns a pointer past the last
+ *  character written. */
+char* to_chars(char* out, const SecretWebcash& esk);
+
 struct PublicWebcash {
     uint256 pk;
     Amount amount;
@@ -90,6 +108,25 @@ inline bool operator>(const PublicWebcash& lhs, const PublicWebcash& rhs) { retu
 
 std::string to_string(const PublicWebcash& epk);
 
+/** The most characters to_chars() can write for any public webcash. */
+static const size_t MAX_PUBLIC_WEBCASH_CHARS = 1 + MAX_AMOUNT_CHARS + 8 + 64;
+
+/** Write epk as to_string() would, into out, which must have room for
+ *  MAX_PUBLIC_WEBCASH_CHARS, without allocating.  Returns a pointer past the
+ *  last character written. */
+char* to_chars(char* out, const PublicWebcash& epk);
+
+/** Derive the public webcash of each secret, exactly as PublicWebcash(sk)
+ *  would, but hashing the 64-character secrets which are all but universal
+ *  several at a time with the multi-way SHA256 transforms. */
+std::vector<PublicWebcash> DerivePublicWebcash(const std::vector<SecretWebcash>& sks);
+
+/** Parse each string as SecretWebcash::parse() would, and derive its public
+ *  webcash as DerivePublicWebcash() would, hashing the secrets where they lie
+ *  rather than first copying each into a SecretWebcash.  Returns false if any
+ *  of the strings fails to parse. */
+bool DerivePublicWebcash(const std::vector<absl::string_view>& sks, std::vector<PublicWebcash>& pks);
+
 #endif // WEBCASH_H
 
 // End of File
@@ -4,25 +4,80 @@
 // License, v. 2.0. If a copy of the MPL was not distributed with this
 // file, You can obtain one at http://mozilla.org/MPL/2.0/.
 
+#include "absl/flags/flag.h"
+#include "absl/flags/reflection.h"
 #include "absl/flags/parse.h"
 #include "absl/flags/usage.h"
 
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_split.h"
 
 #include "boost/filesystem.hpp"
 
 #include <drogon/HttpAppFramework.h>
 
 #include "async.h"
+#include "auditlog.h"
 #include "crypto/sha256.h"
 #include "server.h"
+#include "sqlitestorage.h"
+#include "util/lockstats.h"
+
+ABSL_FLAG(bool, single_statement_replace, false, "validate and apply each replacement with a single call to a stored procedure, rather than a sequence of statements in a transaction");
+ABSL_FLAG(bool, group_commit, false, "commit concurrent replacements and burns which don't touch the same hashes together, in a single transaction with a savepoint for each, rather than each in its own transaction");
+ABSL_FLAG(double, group_commit_window, 0.002, "with --group_commit, seconds a replacement or burn which finds no batch being committed waits for others to join it");
+ABSL_FLAG(std::string, audit_log, "", "path of a local log to append the audit records of replacements and burns to, which is loaded into the database in the background, rather than writing them within each transaction");
+ABSL_FLAG(std::string, redis, "", "address (ip:port) of a Redis server to keep the set of spent hashes in, rather than the database");
+ABSL_FLAG(size_t, max_replace_in_flight, 64, "most replacements and burns to process against the database at once, or 0 for no limit");
+ABSL_FLAG(size_t, max_replace_queued, 1024, "most replacements and burns to queue once max_replace_in_flight is reached, beyond which they are turned away");
+ABSL_FLAG(size_t, max_mining_report_in_flight, 64, "most mining reports to process against the database at once, or 0 for no limit");
+ABSL_FLAG(size_t, max_mining_report_queued, 1024, "most mining reports to queue once max_mining_report_in_flight is reached, beyond which they are turned away");
+ABSL_FLAG(size_t, max_health_check_in_flight, 16, "most health checks to process against the database at once, or 0 for no limit");
+ABSL_FLAG(size_t, max_health_check_queued, 256, "most health checks to queue once max_health_check_in_flight is reached, beyond which they are turned away");
+ABSL_FLAG(std::string, shards, "", "comma-separated list of the addresses (host or host:port) of databases to split the unspent outputs and spent hashes across, by hash");
+ABSL_FLAG(std::string, read_replicas, "", "comma-separated list of the addresses (host or host:port) of read replicas of the database, to send read-only queries to");
+ABSL_FLAG(double, max_replica_lag, 1.0, "most seconds a read replica can fall behind the database before queries are sent back to the database");
+ABSL_FLAG(std::string, sqlite, "", "path of an embedded SQLite database to keep everything in, rather than Postgres, for running a single node without a database server");
+ABSL_FLAG(std::string, utxo_snapshot, "", "path of a snapshot written by webcashd_snapshot, to warm the cache of unspent outputs and spent hashes from at startup, if the database hasn't changed since");
+ABSL_FLAG(bool, profile_locks, false, "account how often, and for how long, each lock site waits for and holds its lock, and report it at /metrics");
+ABSL_FLAG(bool, reconcile_summary, false, "count the rows of every table in the background at startup, and correct the counters kept in the Summary table if they differ");
+
+// Parses the address of a database, as host or host:port.
+static bool ParseDbAddress(absl::string_view addr, std::string& host, int& port)
+{
+    host = std::string(addr);
+    port = 5432;
+    const size_t colon = addr.rfind(':');
+    if (colon != absl::string_view::npos) {
+        host = std::string(addr.substr(0, colon));
+        if (!absl::SimpleAtoi(addr.substr(colon + 1), &port) || port <= 0 || port > 65535) {
+            return false;
+        }
+    }
+    return !host.empty();
+}
 
 int main(int argc, char **argv)
 {
     absl::SetProgramUsageMessage(absl::StrCat("Webcash server process.\n", argv[0]));
     absl::ParseCommandLine(argc, argv);
+    SetLockProfiling(absl::GetFlag(FLAGS_profile_locks));
     auto& app = drogon::app();
 
+    webcash::state().single_statement_replace = absl::GetFlag(FLAGS_single_statement_replace);
+    webcash::state().group_commit = absl::GetFlag(FLAGS_group_commit);
+    webcash::groupCommit().setWindow(absl::Seconds(absl::GetFlag(FLAGS_group_commit_window)));
+    webcash::state().reconcile_summary = absl::GetFlag(FLAGS_reconcile_summary);
+    webcash::state().utxo_snapshot = absl::GetFlag(FLAGS_utxo_snapshot);
+
+    // Requests beyond these limits are queued, and then turned away with 503
+    // Service Unavailable, rather than piling up open transactions when the
+    // database slows down.
+    webcash::limits().replace.setLimits(absl::GetFlag(FLAGS_max_replace_in_flight), absl::GetFlag(FLAGS_max_replace_queued));
+    webcash::limits().mining_report.setLimits(absl::GetFlag(FLAGS_max_mining_report_in_flight), absl::GetFlag(FLAGS_max_mining_report_queued));
+    webcash::limits().health_check.setLimits(absl::GetFlag(FLAGS_max_health_check_in_flight), absl::GetFlag(FLAGS_max_health_check_queued));
+
     const std::string algo = SHA256AutoDetect();
     std::cout << "Using SHA256 algorithm '" << algo << "'." << std::endl;
 
@@ -30,21 +85,132 @@ int main(int argc, char **argv)
     int num_workers = get_num_workers();
     app.setThreadNum(num_workers);
 
-    // Create the database connection
-    app.createDbClient(
-        "postgresql", // dbType
-        "localhost", // host
-        5432,        // port
-        "postgres",  // databaseName
-        "postgres",  // username
-        "mysecretpassword", // password
-        num_workers, // connectionNum
-        "webcashd",  // filename
-        "default",   // name
-        false,       // isFast
-        "utf8",      // characterSet
-        10.0         // timeout
-    );
+    // Open the embedded database, if requested, or else create the
+    // connection to Postgres.  The options which only make sense with Postgres
+    // are refused with --sqlite.
+    const std::string sqlite = absl::GetFlag(FLAGS_sqlite);
+    if (!sqlite.empty()) {
+        for (const char* flag : {"shards", "read_replicas", "audit_log", "redis", "utxo_snapshot", "group_commit"}) {
+            const absl::CommandLineFlag* f = absl::FindCommandLineFlag(flag);
+            if (f && f->CurrentValue() != f->DefaultValue()) {
+                std::cerr << "Error: --" << flag << " can't be used with --sqlite" << std::endl;
+                return 1;
+            }
+        }
+        if (webcash::state().single_statement_replace) {
+            std::cerr << "Error: --single_statement_replace can't be used with --sqlite" << std::endl;
+            return 1;
+        }
+        auto storage = std::make_shared<SqliteStorage>();
+        if (!storage->Open(sqlite)) {
+            return 1;
+        }
+        webcash::state().storage = storage;
+        std::cout << "Storing everything in SQLite database at " << sqlite << std::endl;
+    } else {
+        app.createDbClient(
+            "postgresql", // dbType
+            "localhost", // host
+            5432,        // port
+            "postgres",  // databaseName
+            "postgres",  // username
+            "mysecretpassword", // password
+            num_workers, // connectionNum
+            "webcashd",  // filename
+            "default",   // name
+            false,       // isFast
+            "utf8",      // characterSet
+            10.0         // timeout
+        );
+    }
+
+    // Create a connection to each shard, if requested.
+    size_t num_shards = 0;
+    for (absl::string_view addr : absl::StrSplit(absl::GetFlag(FLAGS_shards), ',', absl::SkipWhitespace())) {
+        std::string host;
+        int port;
+        if (!ParseDbAddress(addr, host, port)) {
+            std::cerr << "Error: invalid address '" << addr << "' in --shards" << std::endl;
+            return 1;
+        }
+        const std::string name = absl::StrCat("shard", num_shards++);
+        app.createDbClient(
+            "postgresql", // dbType
+            host,        // host
+            port,        // port
+            "postgres",  // databaseName
+            "postgres",  // username
+            "mysecretpassword", // password
+            num_workers, // connectionNum
+            "webcashd",  // filename
+            name,        // name
+            false,       // isFast
+            "utf8",      // characterSet
+            10.0         // timeout
+        );
+        webcash::shards().add(name);
+        std::cout << "Storing shard " << num_shards - 1 << " of unspent outputs at " << host << ":" << port << std::endl;
+    }
+    if (num_shards > 256) {
+        std::cerr << "Error: at most 256 databases can be given in --shards" << std::endl;
+        return 1;
+    }
+    if (num_shards && webcash::state().group_commit) {
+        std::cerr << "Error: --group_commit can't be used with --shards" << std::endl;
+        return 1;
+    }
+
+    // Create a connection to each read replica, if requested.  They are
+    // polled for how far behind the database they are from the event loop.
+    size_t num_replicas = 0;
+    for (absl::string_view addr : absl::StrSplit(absl::GetFlag(FLAGS_read_replicas), ',', absl::SkipWhitespace())) {
+        std::string host;
+        int port;
+        if (!ParseDbAddress(addr, host, port)) {
+            std::cerr << "Error: invalid address '" << addr << "' in --read_replicas" << std::endl;
+            return 1;
+        }
+        const std::string name = absl::StrCat("replica", num_replicas++);
+        app.createDbClient(
+            "postgresql", // dbType
+            host,        // host
+            port,        // port
+            "postgres",  // databaseName
+            "postgres",  // username
+            "mysecretpassword", // password
+            num_workers, // connectionNum
+            "webcashd",  // filename
+            name,        // name
+            false,       // isFast
+            "utf8",      // characterSet
+            10.0         // timeout
+        );
+        webcash::replicas().add(name);
+        std::cout << "Sending read-only queries to replica at " << host << ":" << port << std::endl;
+    }
+    webcash::replicas().setMaxLag(absl::Seconds(absl::GetFlag(FLAGS_max_replica_lag)));
+    webcash::replicas().startPolling();
+
+    // Open the local audit log, if requested.  It is loaded into the same
+    // database, over a connection of its own.
+    const std::string audit_log = absl::GetFlag(FLAGS_audit_log);
+    if (!audit_log.empty()) {
+        if (!webcash::audit().Open(audit_log, "host=localhost port=5432 dbname=postgres user=postgres password=mysecretpassword")) {
+            return 1;
+        }
+        std::cout << "Writing audit log to " << audit_log << std::endl;
+    }
+
+    // Connect to Redis, if requested
+    const std::string redis = absl::GetFlag(FLAGS_redis);
+    if (!redis.empty()) {
+        webcash::state().redis = webcash::connectRedis(redis, num_workers);
+        if (!webcash::state().redis) {
+            std::cerr << "Error: invalid Redis address '" << redis << "' in --redis" << std::endl;
+            return 1;
+        }
+        std::cout << "Keeping spent hashes in Redis at " << redis << std::endl;
+    }
 
     // Create/upgrade the database tables
     webcash::upgradeDb();
@@ -60,6 +226,12 @@ int main(int argc, char **argv)
     // Run HTTP server
     app.run();
 
+    // Load whatever remains of the audit log
+    webcash::audit().Close();
+
+    // Finish whatever writes remain queued
+    webcash::state().storage.reset();
+
     return 0;
 }
 
@@ -0,0 +1,418 @@
+// Copyright (c) 2022 Mark Friedenbach
+//
+// This Source Code Form is subject to the terms of the Mozilla Public
+// License, v. 2.0. If a copy of the MPL was not distributed with this
+// file, You can obtain one at http://mozilla.org/MPL/2.0/.
+
+#include <stdint.h>
+#include <string.h>
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "absl/flags/flag.h"
+#include "absl/flags/parse.h"
+#include "absl/flags/usage.h"
+
+#include "absl/strings/numbers.h"
+#include "absl/strings/str_cat.h"
+#include "absl/strings/string_view.h"
+
+#include <libpq-fe.h>
+
+#include "crypto/common.h"
+#include "logger.h"
+#include "uint256.h"
+#include "utxosnapshot.h"
+#include "webcash.h"
+
+ABSL_FLAG(std::string, export, "", "path to write a snapshot of the unspent outputs, spent hashes and summary counters of the database to");
+ABSL_FLAG(std::string, import, "", "path of a snapshot to load into the database, which must have been created by webcashd and hold no webcash yet");
+ABSL_FLAG(std::string, conninfo, "host=localhost port=5432 dbname=postgres user=postgres password=mysecretpassword", "libpq connection string of the database");
+
+// The signature, flags and header extension length which start every COPY in
+// binary format.
+static const char k_copy_header[19] = {'P', 'G', 'C', 'O', 'P', 'Y', '\n', '\377', '\r', '\n', '\0', 0, 0, 0, 0, 0, 0, 0, 0};
+
+// Runs sql, returning its result if it has the expected status, and
+// otherwise logging the error and returning null.
+static PGresult* Query(PGconn* conn, const std::string& sql, ExecStatusType expected = PGRES_TUPLES_OK)
+{
+    PGresult* res = PQexec(conn, sql.c_str());
+    if (PQresultStatus(res) != expected) {
+        LogError() << PQerrorMessage(conn);
+        LogError() << "Offending SQL: " << sql;
+        PQclear(res);
+        return nullptr;
+    }
+    return res;
+}
+
+static bool Exec(PGconn* conn, const std::string& sql)
+{
+    PGresult* res = Query(conn, sql, PGRES_COMMAND_OK);
+    PQclear(res);
+    return res != nullptr;
+}
+
+// Waits for the result of a COPY which has ended.
+static bool FinishCopy(PGconn* conn, const std::string& sql)
+{
+    bool ok = true;
+    PGresult* res;
+    while ((res = PQgetResult(conn))) {
+        if (PQresultStatus(res) != PGRES_COMMAND_OK) {
+            LogError() << PQerrorMessage(conn);
+            LogError() << "Offending SQL: " << sql;
+            ok = false;
+        }
+        PQclear(res);
+    }
+    return ok;
+}
+
+// Runs sql, a COPY ... TO STDOUT (FORMAT binary) of num_fields non-null
+// columns, passing the fields of each row to row, which returns false to
+// abort.  Rows are parsed as they arrive, rather than after the whole table.
+static bool CopyOut(
+    PGconn* conn,
+    const std::string& sql,
+    size_t num_fields,
+    const std::function<bool (const absl::string_view* fields)>& row
+){
+    PGresult* res = Query(conn, sql, PGRES_COPY_OUT);
+    if (!res) {
+        return false;
+    }
+    PQclear(res);
+
+    std::string pending;
+    size_t pos = 0;
+    bool header = false, trailer = false, ok = true;
+    std::vector<absl::string_view> fields(num_fields);
+    char* buf;
+    int len;
+    while ((len = PQgetCopyData(conn, &buf, 0)) > 0) {
+        if (ok && !trailer) {
+            pending.append(buf, len);
+        }
+        PQfreemem(buf);
+        if (!ok || trailer) {
+            continue; // Drain the rest of the COPY.
+        }
+        if (!header) {
+            if (pending.size() < sizeof(k_copy_header)) {
+                continue;
+            }
+            if (memcmp(pending.data(), k_copy_header, 11) != 0) {
+                LogError() << "Unexpected header of binary COPY.";
+                ok = false;
+                continue;
+            }
+            const uint32_t extension = ReadBE32((const unsigned char*)pending.data() + 15);
+            if (pending.size() < sizeof(k_copy_header) + extension) {
+                continue;
+            }
+            pos = sizeof(k_copy_header) + extension;
+            header = true;
+        }
+        // Each row is its number of fields, and then the length and bytes of
+        // each field, all in network byte order.
+        while (ok && pending.size() - pos >= 2) {
+            const unsigned char* p = (const unsigned char*)pending.data() + pos;
+            const int16_t count = static_cast<int16_t>(ReadBE16(p));
+            if (count == -1) {
+                trailer = true;
+                break;
+            }
+            if (count != static_cast<int16_t>(num_fields)) {
+                LogError() << "Expected " << num_fields << " fields in each row of COPY.  Got " << count << ".";
+                ok = false;
+                break;
+            }
+            size_t at = pos + 2;
+            bool complete = true;
+            for (size_t i = 0; i < num_fields; ++i) {
+                if (pending.size() - at < 4) {
+                    complete = false;
+                    break;
+                }
+                const int32_t field = static_cast<int32_t>(ReadBE32((const unsigned char*)pending.data() + at));
+                if (field < 0) {
+                    LogError() << "Unexpected NULL in COPY.";
+                    ok = false;
+                    break;
+                }
+                if (pending.size() - at - 4 < static_cast<size_t>(field)) {
+                    complete = false;
+                    break;
+                }
+                fields[i] = absl::string_view(pending.data() + at + 4, field);
+                at += 4 + field;
+            }
+            if (!ok || !complete) {
+                break;
+            }
+            if (!row(fields.data())) {
+                ok = false;
+                break;
+            }
+            pos = at;
+        }
+        pending.erase(0, pos);
+        pos = 0;
+    }
+    if (len == -2) {
+        LogError() << PQerrorMessage(conn);
+        ok = false;
+    }
+    if (!FinishCopy(conn, sql) || !ok) {
+        return false;
+    }
+    if (!trailer) {
+        LogError() << "Binary COPY ended without its trailer.";
+        return false;
+    }
+    return true;
+}
+
+// Streams rows to a COPY ... FROM STDIN (FORMAT binary), in large chunks.
+class CopyIn {
+public:
+    CopyIn(PGconn* conn, const std::string& sql) : m_conn(conn), m_sql(sql) {}
+
+    bool Start()
+    {
+        PGresult* res = Query(m_conn, m_sql, PGRES_COPY_IN);
+        if (!res) {
+            return false;
+        }
+        PQclear(res);
+        m_buf.assign(k_copy_header, sizeof(k_copy_header));
+        return true;
+    }
+
+    void BeginRow(uint16_t num_fields)
+    {
+        unsigned char count[2] = {static_cast<unsigned char>(num_fields >> 8), static_cast<unsigned char>(num_fields)};
+        m_buf.append((const char*)count, 2);
+    }
+
+    void Field(const void* data, uint32_t len)
+    {
+        unsigned char size[4];
+        WriteBE32(size, len);
+        m_buf.append((const char*)size, 4);
+        m_buf.append((const char*)data, len);
+    }
+
+    bool EndRow()
+    {
+        return m_buf.size() < k_chunk_size || Flush();
+    }
+
+    bool Finish()
+    {
+        // The trailer is a row of -1 fields.
+        m_buf.append("\377\377", 2);
+        if (!Flush() || PQputCopyEnd(m_conn, nullptr) != 1) {
+            LogError() << PQerrorMessage(m_conn);
+            FinishCopy(m_conn, m_sql);
+            return false;
+        }
+        return FinishCopy(m_conn, m_sql);
+    }
+
+private:
+    static const size_t k_chunk_size = 1 << 20;
+
+    bool Flush()
+    {
+        if (PQputCopyData(m_conn, m_buf.data(), static_cast<int>(m_buf.size())) != 1) {
+            LogError() << PQerrorMessage(m_conn);
+            LogError() << "Offending SQL: " << m_sql;
+            return false;
+        }
+        m_buf.clear();
+        return true;
+    }
+
+    PGconn* m_conn;
+    const std::string m_sql;
+    std::string m_buf;
+};
+
+static bool ExportSnapshot(PGconn* conn, const std::string& path)
+{
+    // Everything is read within one snapshot of the database, so that the
+    // counters match the tables, even while webcashd is running.
+    if (!Exec(conn, "BEGIN ISOLATION LEVEL REPEATABLE READ READ ONLY")) {
+        return false;
+    }
+    static const std::string sql_summary =
+        "SELECT \"Summary\".\"num_reports\" + COALESCE(SUM(\"SummaryDeltas\".\"num_reports\"), 0), "
+            "\"Summary\".\"num_replace\" + COALESCE(SUM(\"SummaryDeltas\".\"num_replace\"), 0), "
+            "\"Summary\".\"num_burn\" + COALESCE(SUM(\"SummaryDeltas\".\"num_burn\"), 0), "
+            "\"Summary\".\"num_unspent\" + COALESCE(SUM(\"SummaryDeltas\".\"num_unspent\"), 0), "
+            "\"Summary\".\"total_destroyed\" + COALESCE(SUM(\"SummaryDeltas\".\"total_destroyed\"), 0) "
+        "FROM \"Summary\" LEFT JOIN \"SummaryDeltas\" ON TRUE "
+        "GROUP BY \"Summary\".\"num_reports\", \"Summary\".\"num_replace\", \"Summary\".\"num_burn\", \"Summary\".\"num_unspent\", \"Summary\".\"total_destroyed\"";
+    PGresult* res = Query(conn, sql_summary);
+    if (!res) {
+        return false;
+    }
+    UtxoSnapshot::Counts counts;
+    const bool ok = PQntuples(res) == 1 && PQnfields(res) == 5
+        && absl::SimpleAtoi(PQgetvalue(res, 0, 0), &counts.num_reports)
+        && absl::SimpleAtoi(PQgetvalue(res, 0, 1), &counts.num_replace)
+        && absl::SimpleAtoi(PQgetvalue(res, 0, 2), &counts.num_burn)
+        && absl::SimpleAtoi(PQgetvalue(res, 0, 3), &counts.num_unspent)
+        && absl::SimpleAtoi(PQgetvalue(res, 0, 4), &counts.total_destroyed);
+    PQclear(res);
+    if (!ok) {
+        LogError() << "Expected one row of five columns containing counts.  Got something else.";
+        LogError() << "Offending SQL: " << sql_summary;
+        return false;
+    }
+
+    UtxoSnapshotWriter writer;
+    if (!writer.Open(path, counts)) {
+        return false;
+    }
+    // Both tables are uniquely indexed by hash, so the rows come out of the
+    // index already sorted.
+    static const std::string sql_unspent = "COPY (SELECT \"hash\", \"amount\" FROM \"UnspentOutputs\" ORDER BY \"hash\") TO STDOUT (FORMAT binary)";
+    bool copied = CopyOut(conn, sql_unspent, 2, [&](const absl::string_view* fields) {
+        if (fields[0].size() != 32 || fields[1].size() != 8) {
+            LogError() << "Expected 32-byte hash and amount in each row.  Got something else.";
+            return false;
+        }
+        uint256 hash;
+        memcpy(hash.data(), fields[0].data(), 32);
+        return writer.AddUnspent(hash, Amount(static_cast<int64_t>(ReadBE64((const unsigned char*)fields[1].data()))));
+    });
+    if (!copied) {
+        return false;
+    }
+    static const std::string sql_spent = "COPY (SELECT \"hash\" FROM \"SpentHashes\" ORDER BY \"hash\") TO STDOUT (FORMAT binary)";
+    copied = CopyOut(conn, sql_spent, 1, [&](const absl::string_view* fields) {
+        if (fields[0].size() != 32) {
+            LogError() << "Expected 32-byte hash in each row.  Got something else.";
+            return false;
+        }
+        uint256 hash;
+        memcpy(hash.data(), fields[0].data(), 32);
+        return writer.AddSpent(hash);
+    });
+    if (!copied || !Exec(conn, "COMMIT") || !writer.Commit()) {
+        return false;
+    }
+    if (writer.NumUnspent() != counts.num_unspent) {
+        LogWarning() << "Summary counts " << counts.num_unspent << " unspent outputs, but the table has " << writer.NumUnspent() << ".  Run webcashd with --reconcile_summary to correct it.";
+    }
+    LogInfo() << "Wrote " << writer.NumUnspent() << " unspent outputs and " << writer.NumSpent() << " spent hashes to " << path;
+    return true;
+}
+
+static bool ImportSnapshot(PGconn* conn, const std::string& path)
+{
+    UtxoSnapshot snapshot;
+    if (!snapshot.Open(path)) {
+        return false;
+    }
+    if (!Exec(conn, "BEGIN")) {
+        return false;
+    }
+    // Loading into a database which already has webcash would mix two
+    // histories, so only a new one is accepted.
+    static const std::string sql_empty = "SELECT EXISTS (SELECT 1 FROM \"UnspentOutputs\") OR EXISTS (SELECT 1 FROM \"SpentHashes\")";
+    PGresult* res = Query(conn, sql_empty);
+    if (!res) {
+        LogError() << "Run webcashd once against the database, to create its tables, before importing.";
+        return false;
+    }
+    const bool empty = PQntuples(res) == 1 && strcmp(PQgetvalue(res, 0, 0), "f") == 0;
+    PQclear(res);
+    if (!empty) {
+        LogError() << "The database already has unspent outputs or spent hashes.  Refusing to import.";
+        return false;
+    }
+
+    CopyIn unspent(conn, "COPY \"UnspentOutputs\" (\"hash\", \"amount\") FROM STDIN (FORMAT binary)");
+    if (!unspent.Start()) {
+        return false;
+    }
+    for (size_t i = 0; i < snapshot.NumUnspent(); ++i) {
+        unsigned char amount[8];
+        WriteBE64(amount, static_cast<uint64_t>(snapshot.UnspentAmount(i).i64));
+        unspent.BeginRow(2);
+        unspent.Field(snapshot.UnspentHash(i).data(), 32);
+        unspent.Field(amount, 8);
+        if (!unspent.EndRow()) {
+            return false;
+        }
+    }
+    if (!unspent.Finish()) {
+        return false;
+    }
+    CopyIn spent(conn, "COPY \"SpentHashes\" (\"hash\") FROM STDIN (FORMAT binary)");
+    if (!spent.Start()) {
+        return false;
+    }
+    for (size_t i = 0; i < snapshot.NumSpent(); ++i) {
+        spent.BeginRow(1);
+        spent.Field(snapshot.SpentHash(i).data(), 32);
+        if (!spent.EndRow()) {
+            return false;
+        }
+    }
+    if (!spent.Finish()) {
+        return false;
+    }
+
+    // The counters are those of the snapshot, rather than counted from the
+    // tables, which don't hold the history they count.
+    const UtxoSnapshot::Counts& counts = snapshot.GetCounts();
+    const std::string sql_summary = absl::StrCat(
+        "UPDATE \"Summary\" SET "
+            "\"num_reports\" = ", counts.num_reports, ", "
+            "\"num_replace\" = ", counts.num_replace, ", "
+            "\"num_burn\" = ", counts.num_burn, ", "
+            "\"num_unspent\" = ", counts.num_unspent, ", "
+            "\"total_destroyed\" = ", counts.total_destroyed);
+    if (!Exec(conn, "DELETE FROM \"SummaryDeltas\"") || !Exec(conn, sql_summary) || !Exec(conn, "COMMIT")) {
+        return false;
+    }
+    LogInfo() << "Loaded " << snapshot.NumUnspent() << " unspent outputs and " << snapshot.NumSpent() << " spent hashes from " << path;
+    return true;
+}
+
+int main(int argc, char **argv)
+{
+    absl::SetProgramUsageMessage(absl::StrCat(
+        "Exports the unspent outputs and spent hashes of a webcashd database to a\n"
+        "snapshot, or imports one into a new database.\n",
+        argv[0], " --export=FILE | --import=FILE"));
+    absl::ParseCommandLine(argc, argv);
+
+    const std::string export_path = absl::GetFlag(FLAGS_export);
+    const std::string import_path = absl::GetFlag(FLAGS_import);
+    if (export_path.empty() == import_path.empty()) {
+        LogError() << "Exactly one of --export or --import is required.";
+        return 1;
+    }
+
+    PGconn* conn = PQconnectdb(absl::GetFlag(FLAGS_conninfo).c_str());
+    if (PQstatus(conn) != CONNECTION_OK) {
+        LogError() << "Unable to connect to database: " << PQerrorMessage(conn);
+        PQfinish(conn);
+        return 1;
+    }
+    const bool ok = export_path.empty() ? ImportSnapshot(conn, import_path) : ExportSnapshot(conn, export_path);
+    // Closing the connection rolls back whatever transaction failed.
+    PQfinish(conn);
+    return ok ? 0 : 1;
+}
+
+// End of File
@@ -6,7 +6,10 @@
 
 #include <iostream>
 
+#include <algorithm>
 #include <deque>
+#include <map>
+#include <set>
 #include <string>
 #include <vector>
 
@@ -14,12 +17,19 @@
 #include <mutex>
 #include <thread>
 
+#include <csignal>
+#include <cstdio>
+#include <pthread.h>
+
 #include "absl/flags/flag.h"
 #include "absl/flags/parse.h"
 #include "absl/flags/usage.h"
 
 #include "absl/strings/escaping.h"
+#include "absl/strings/numbers.h"
 #include "absl/strings/str_cat.h"
+#include "absl/strings/str_join.h"
+#include "absl/strings/str_split.h"
 #include "absl/strings/string_view.h"
 
 #include "absl/time/clock.h"
@@ -33,11 +43,21 @@
 #include <univalue.h>
 
 #include "async.h"
+#include "coordinator.h"
 #include "crypto/sha256.h"
+#include "engine.h"
+#include "logger.h"
+#include "metrics.h"
+#if defined(ENABLE_OPENCL)
+#include "gpu.h"
+#endif
 #include "random.h"
 #include "support/cleanse.h"
 #include "uint256.h"
+#include "util/bounded_queue.h"
+#include "util/lockstats.h"
 #include "wallet.h"
+#include "walletd.h"
 
 struct ProtocolSettings {
     // The amount the miner is allowed to claim.
@@ -49,6 +69,9 @@ struct ProtocolSettings {
     // The number of leading bits which must be zero for a work candidate to be
     // accepted by the server.
     unsigned difficulty;
+    // Identifies the difficulty and epoch, for waiting on a change to them.
+    // Empty if the server doesn't support /api/v1/target/wait.
+    std::string version;
 };
 
 std::optional<std::string> get_terms_of_service(const std::string& server)
@@ -58,11 +81,11 @@ std::optional<std::string> get_terms_of_service(const std::string& server)
     cli.set_write_timeout(60, 0); // 60 seconds
     auto r = cli.Get("/terms/text");
     if (!r) {
-        std::cerr << "Error: returned invalid response to terms of service request: " << r.error() << std::endl;
+        LogError() << "returned invalid response to terms of service request: " << r.error();
         return std::nullopt;
     }
     if (r->status != 200) {
-        std::cerr << "Error: returned invalid response to terms of service request: status_code=" << r->status << ", text='" << r->body << "'" << std::endl;
+        LogError() << "returned invalid response to terms of service request: status_code=" << r->status << ", text='" << r->body << "'";
         return std::nullopt;
     }
     return r->body;
@@ -77,25 +100,13 @@ static std::string amount_to_string(const UniValue& val)
     }
 }
 
-bool get_protocol_settings(const std::string& server, ProtocolSettings& settings)
+bool parse_protocol_settings(const std::string& body, ProtocolSettings& settings)
 {
-    httplib::Client cli(server);
-    cli.set_read_timeout(60, 0); // 60 seconds
-    cli.set_write_timeout(60, 0); // 60 seconds
-    auto r = cli.Get("/api/v1/target");
-    if (!r) {
-        std::cerr << "Error: returned invalid response to ProtocolSettings request: " << r.error() << std::endl;
-        return false;
-    }
-    if (r->status != 200) {
-        std::cerr << "Error: returned invalid response to ProtocolSettings request: status_code=" << r->status << ", text='" << r->body << "'" << std::endl;
-        return false;
-    }
     UniValue o;
-    o.read(r->body);
+    o.read(body);
     const UniValue& difficulty = o["difficulty_target_bits"];
     if (!difficulty.isNum()) {
-        std::cerr << "Error: expected integer for 'difficulty' field of ProtocolSettings response, got '" << difficulty.write() << "' instead." << std::endl;
+        LogError() << "expected integer for 'difficulty' field of ProtocolSettings response, got '" << difficulty.write() << "' instead.";
         return false;
     }
     const UniValue& ratio_field = o["ratio"];
@@ -104,29 +115,48 @@ bool get_protocol_settings(const std::string& server, ProtocolSettings& settings
         ratio = ratio_field.get_real();
     } else {
         if (!absl::SimpleAtof(ratio_field.get_str(), &ratio)) {
-            std::cerr << "Error: expected real number for 'ratio' field of ProtocolSettings response, got '" << ratio_field.write() << "' instead." << std::endl;
+            LogError() << "expected real number for 'ratio' field of ProtocolSettings response, got '" << ratio_field.write() << "' instead.";
             return false;
         }
     }
     const std::string mining_amount_str = amount_to_string(o["mining_amount"]);
     Amount mining_amount = -1;
     if (!mining_amount.parse(mining_amount_str) || mining_amount < 0) {
-        std::cerr << "Error: expected fractional-precision numeric value for 'mining_amount' field of ProtocolSettings response, got '" << mining_amount_str << "' instead." << std::endl;
+        LogError() << "expected fractional-precision numeric value for 'mining_amount' field of ProtocolSettings response, got '" << mining_amount_str << "' instead.";
         return false;
     }
     const std::string subsidy_amount_str = amount_to_string(o["mining_subsidy_amount"]);
     Amount subsidy_amount = -1;
     if (!subsidy_amount.parse(subsidy_amount_str) || subsidy_amount < 0) {
-        std::cerr << "Error: expected fractional-precision numeric value for 'subsidy_amount' field of ProtocolSettings response, got '" << subsidy_amount_str << "' instead." << std::endl;
+        LogError() << "expected fractional-precision numeric value for 'subsidy_amount' field of ProtocolSettings response, got '" << subsidy_amount_str << "' instead.";
         return false;
     }
+    const UniValue& version = o["version"];
     settings.difficulty = difficulty.get_int();
     settings.ratio = ratio;
     settings.mining_amount = mining_amount;
     settings.subsidy_amount = subsidy_amount;
+    settings.version = version.isStr() ? version.get_str() : "";
     return true;
 }
 
+bool get_protocol_settings(const std::string& server, ProtocolSettings& settings)
+{
+    httplib::Client cli(server);
+    cli.set_read_timeout(60, 0); // 60 seconds
+    cli.set_write_timeout(60, 0); // 60 seconds
+    auto r = cli.Get("/api/v1/target");
+    if (!r) {
+        LogError() << "returned invalid response to ProtocolSettings request: " << r.error();
+        return false;
+    }
+    if (r->status != 200) {
+        LogError() << "returned invalid response to ProtocolSettings request: status_code=" << r->status << ", text='" << r->body << "'";
+        return false;
+    }
+    return parse_protocol_settings(r->body, settings);
+}
+
 bool check_proof_of_work(const uint256& hash, int difficulty)
 {
     const unsigned char* ptr = hash.begin();
@@ -187,6 +217,8 @@ std::string get_expect_string(int64_t attempts, absl::Time begin, absl::Time end
 
 std::condition_variable g_update_thread_cv;
 std::atomic<bool> g_shutdown{false};
+// Set by --benchmark, in which case solutions are only counted.
+bool g_benchmark = false;
 
 struct Solution
 {
@@ -195,36 +227,555 @@ struct Solution
     SecretWebcash webcash;
 
     Solution() = default;
-    Solution(const uint256& hashIn, const std::string& preimageIn, const SecretWebcash& webcashIn) : hash(hashIn), preimage(preimageIn), webcash(webcashIn) {}
+    Solution(const uint256& hashIn, std::string preimageIn, const SecretWebcash& webcashIn) : hash(hashIn), preimage(std::move(preimageIn)), webcash(webcashIn) {}
 };
 
+/** The number of solutions which can wait for submission in memory.  Any
+ *  more are spilled to disk. */
+static const size_t SOLUTION_QUEUE_SIZE = 1024;
+
 std::mutex g_state_mutex;
 std::unique_ptr<Wallet> g_wallet;
-std::deque<Solution> g_solutions;
+// Solved proof-of-works waiting to be reported to the server.  The mining
+// threads push to it without ever blocking, and the submission threads wait
+// on g_solutions_cv for it to be non-empty.  g_solutions_mutex guards
+// nothing but the wait, so that wake-ups aren't lost.
+BoundedQueue<Solution> g_solutions(SOLUTION_QUEUE_SIZE);
+std::mutex g_solutions_mutex;
+std::condition_variable g_solutions_cv;
+// Set while the spill file (--solutionspill) may hold solutions which have
+// yet to be queued.  Spilled solutions stay in the file until they have been
+// submitted, so that they survive a crash: g_unspilled holds the preimages
+// of those moved to the queue, and g_spill_done those of the ones since
+// submitted, whose lines are dropped the next time the file is rewritten.
+// The file and both sets are guarded by g_spill_mutex.
+std::atomic<bool> g_spilled{false};
+std::mutex g_spill_mutex;
+std::set<std::string> g_unspilled;
+std::set<std::string> g_spill_done;
+// Reported webcash waiting to be claimed by the wallet.  Drained by its own
+// thread, so that a slow replace doesn't hold up the next mining report.
+// Guarded by g_state_mutex.
+std::deque<SecretWebcash> g_claims;
+std::condition_variable g_claims_cv;
+// The most claims swept into the wallet by a single replacement.
+const size_t MAX_CLAIM_BATCH = 100;
+// Set when serving work to agents (--serve), or when mining as an agent of
+// another webminer (--coordinator).
+std::unique_ptr<CoordinatorServer> g_coordinator_server;
+std::unique_ptr<CoordinatorClient> g_coordinator_client;
+// Set when serving our wallet to other miners on this host
+// (--servewallet), or when using a wallet served by another (--remotewallet)
+// instead of g_wallet.
+std::unique_ptr<WalletServer> g_wallet_server;
+std::unique_ptr<WalletClient> g_wallet_client;
 std::atomic<unsigned> g_difficulty{16};
 std::atomic<Amount> g_mining_amount{20000};
 std::atomic<Amount> g_subsidy_amount{1000};
-std::atomic<int64_t> g_attempts{0};
+MinerMetrics g_metrics;
+// Set while the server is pushing changes to the protocol settings to the
+// target thread, in which case the update thread stops polling for them and
+// reports the most recently pushed settings instead.  g_target_client is the
+// connection the target thread is waiting on, so that it can be interrupted
+// at shutdown.  Both are guarded by g_target_mutex.
+std::mutex g_target_mutex;
+bool g_target_pushed = false;
+ProtocolSettings g_target_settings;
+httplib::Client* g_target_client = nullptr;
 absl::Time g_last_rng_update{absl::UnixEpoch()};
 absl::Time g_next_rng_update{absl::UnixEpoch()};
 absl::Time g_last_settings_fetch{absl::UnixEpoch()};
 absl::Time g_next_settings_fetch{absl::UnixEpoch()};
 
+// Incremented whenever the protocol settings change, so that the mining
+// threads know to stop working on prefixes generated under the old settings.
+// Paused mining threads wait on g_work_cv for the difficulty to drop.
+std::atomic<uint64_t> g_work_epoch{0};
+std::mutex g_work_mutex;
+std::condition_variable g_work_cv;
+// Signalled when a mining thread takes work from its queue, or the queued
+// work goes stale.
+std::mutex g_work_queue_mutex;
+std::condition_variable g_work_queue_cv;
+
+/** Invalidate the current work of every mining thread, and wake up any that
+ *  are paused so they can re-check the difficulty. */
+void new_work_epoch()
+{
+    uint64_t epoch;
+    {
+        const std::lock_guard<std::mutex> lock(g_work_mutex);
+        epoch = ++g_work_epoch;
+    }
+    g_work_cv.notify_all();
+    {
+        // Queued work is now stale, so have the producer replace it.
+        const std::lock_guard<std::mutex> lock(g_work_queue_mutex);
+        g_work_queue_cv.notify_all();
+    }
+    if (g_coordinator_server) {
+        g_coordinator_server->Broadcast(epoch, g_difficulty);
+    }
+}
+
+/** Like new_work_epoch(), but for agents, which follow the coordinator's
+ *  epochs instead of counting their own. */
+void set_work_epoch(uint64_t epoch)
+{
+    {
+        const std::lock_guard<std::mutex> lock(g_work_mutex);
+        g_work_epoch = epoch;
+    }
+    g_work_cv.notify_all();
+    const std::lock_guard<std::mutex> lock(g_work_queue_mutex);
+    g_work_queue_cv.notify_all();
+}
+
+/** Block until the difficulty is no more than max_difficulty.  Returns
+ *  false if the miner is shutting down instead. */
+bool wait_for_mining_allowed(unsigned max_difficulty)
+{
+    std::unique_lock<std::mutex> lock(g_work_mutex);
+    g_work_cv.wait(lock, [&] { return g_shutdown || g_difficulty <= max_difficulty; });
+    return !g_shutdown;
+}
+
 ABSL_FLAG(bool, acceptterms, false, "auto-accept initial or updated terms of service");
 ABSL_FLAG(std::string, server, "https://webcash.tech", "server endpoint");
 ABSL_FLAG(std::string, webcashlog, "webcash.log", "filename to place generated webcash claim codes");
 ABSL_FLAG(std::string, orphanlog, "orphans.log", "filename to place solved proof-of-works the server rejects, and their associated webcash claim codes");
 ABSL_FLAG(std::string, walletfile, "default_wallet", "base filename of wallet files");
 ABSL_FLAG(unsigned, maxdifficulty, 80, "disable mining above this difficulty");
+ABSL_FLAG(unsigned, benchmark, 0, "if nonzero, hash offline for this many seconds, without a wallet or server, and print the hashrate as JSON");
+ABSL_FLAG(unsigned, benchmarkdifficulty, 24, "difficulty of the solutions counted by --benchmark");
+ABSL_FLAG(std::string, serve, "", "address and port on which to hand out work to mining agents, e.g. \"0.0.0.0:8420\", or empty to disable");
+ABSL_FLAG(std::string, coordinator, "", "address and port of a webminer running with --serve, to mine for as an agent instead of using a wallet and server of our own");
+ABSL_FLAG(std::string, servewallet, "", "path of a Unix socket on which to serve our wallet to other webminer processes on this host, or empty to disable");
+ABSL_FLAG(std::string, remotewallet, "", "path of the Unix socket of a webminer running with --servewallet, whose wallet to use instead of opening --walletfile");
+ABSL_FLAG(std::string, solutionspill, "solutions.spill", "filename to hold solved proof-of-works which don't fit in the submission queue, or which are unsubmitted on shutdown, until they can be submitted");
+ABSL_FLAG(unsigned, submitthreads, 2, "maximum number of mining reports submitted to the server concurrently");
+ABSL_FLAG(std::string, metrics, "", "address and port on which to serve Prometheus metrics at /metrics, e.g. \"127.0.0.1:9100\", or empty to disable");
+ABSL_FLAG(bool, profile_locks, false, "account how often, and for how long, each lock site waits for and holds its lock, and report it with the metrics");
+#if defined(ENABLE_OPENCL)
+ABSL_FLAG(std::string, gpus, "", "comma-separated indices of OpenCL devices to mine with, or \"all\"");
+ABSL_FLAG(unsigned, gpubatch, 16, "number of prefix nonces hashed per OpenCL kernel launch (at most 1000)");
+#endif
+
+/** How long a submission thread waits before retrying after a network
+ *  error, doubling after each consecutive failure. */
+const absl::Duration SUBMIT_RETRY_MIN = absl::Seconds(1);
+const absl::Duration SUBMIT_RETRY_MAX = absl::Seconds(60);
+
+void write_orphan_log(const std::string& filename, const Solution& soln, int difficulty)
+{
+    using std::to_string;
 
-void update_thread_func()
+    std::ofstream orphan_log(filename, std::ofstream::app);
+    orphan_log << soln.preimage << ' ' << absl::BytesToHexString(absl::string_view((const char*)soln.hash.begin(), 32)) << ' ' << to_string(soln.webcash) << " difficulty=" << difficulty << std::endl;
+    orphan_log.flush();
+}
+
+/** Append a solution to the spill file, for the submission threads to pick
+ *  up when there is room in the queue. */
+void spill_solution(const Solution& soln)
 {
     using std::to_string;
 
+    const std::lock_guard<std::mutex> lock(g_spill_mutex);
+    if (g_unspilled.count(soln.preimage)) {
+        // Taken from the spill file, where it still is.
+        return;
+    }
+    std::ofstream spill(absl::GetFlag(FLAGS_solutionspill), std::ofstream::app);
+    spill << soln.preimage << ' ' << to_string(soln.webcash) << std::endl;
+    spill.flush();
+    if (!spill) {
+        LogError() << "unable to write solution to spill file; saving to orphan log instead";
+        write_orphan_log(absl::GetFlag(FLAGS_orphanlog), soln, get_apparent_difficulty(soln.hash));
+    }
+    g_spilled = true;
+}
+
+/** Hand a solution to the submission threads.  Never blocks on them. */
+void queue_solution(Solution&& soln)
+{
+    if (!g_solutions.TryPush(std::move(soln))) {
+        spill_solution(soln);
+    }
+    {
+        // Taking the lock orders the push before the check of a submission
+        // thread which is about to wait.  It's only held for that check.
+        const std::lock_guard<std::mutex> lock(g_solutions_mutex);
+    }
+    g_solutions_cv.notify_one();
+}
+
+/** Drop the lines of submitted solutions from the spill file.  The file is
+ *  replaced by renaming, so that a crash leaves either the old or the new
+ *  one.  Must be called with g_spill_mutex held. */
+void compact_spill_file()
+{
+    if (g_spill_done.empty()) {
+        return;
+    }
+    const std::string filename = absl::GetFlag(FLAGS_solutionspill);
+    const std::string tmpname = filename + ".tmp";
+    {
+        std::ifstream spill(filename);
+        std::ofstream tmp(tmpname, std::ofstream::trunc);
+        std::string line;
+        while (std::getline(spill, line)) {
+            if (!g_spill_done.count(line.substr(0, line.find(' ')))) {
+                tmp << line << std::endl;
+            }
+        }
+        tmp.flush();
+        if (!tmp) {
+            // Keep the old file, and with it the submitted solutions, which
+            // the server will recognize as already reported.
+            LogError() << "unable to rewrite solution spill file";
+            return;
+        }
+    }
+    if (std::rename(tmpname.c_str(), filename.c_str()) != 0) {
+        LogError() << "unable to replace solution spill file";
+        return;
+    }
+    g_spill_done.clear();
+}
+
+/** Move as many spilled solutions into the queue as fit.  They are left in
+ *  the spill file until finish_solution() is called for them. */
+void unspill_solutions()
+{
+    const std::lock_guard<std::mutex> lock(g_spill_mutex);
+    compact_spill_file();
+    bool remaining = false;
+    std::ifstream spill(absl::GetFlag(FLAGS_solutionspill));
+    std::string line;
+    while (!remaining && std::getline(spill, line)) {
+        std::vector<std::string> fields = absl::StrSplit(line, ' ');
+        Solution soln;
+        if (fields.size() != 2 || !soln.webcash.parse(fields[1])) {
+            LogWarning() << "skipping unparseable line in solution spill file: " << line;
+            continue;
+        }
+        soln.preimage = fields[0];
+        if (g_unspilled.count(soln.preimage) || g_spill_done.count(soln.preimage)) {
+            continue;
+        }
+        CSHA256().Write((const unsigned char*)soln.preimage.data(), soln.preimage.size()).Finalize(soln.hash.begin());
+        if (g_solutions.TryPush(Solution(soln))) {
+            g_unspilled.insert(soln.preimage);
+        } else {
+            remaining = true;
+        }
+    }
+    g_spilled = remaining;
+}
+
+/** Called once a solution has been submitted, or given up on, so that it
+ *  is no longer kept in the spill file. */
+void finish_solution(const Solution& soln)
+{
+    const std::lock_guard<std::mutex> lock(g_spill_mutex);
+    if (!g_unspilled.erase(soln.preimage)) {
+        return;
+    }
+    g_spill_done.insert(soln.preimage);
+    // Rewritten once everything taken from the file is done with, rather
+    // than for every solution.  A crash in between only means reporting
+    // those solutions again, which the server recognizes.
+    if (g_unspilled.empty()) {
+        compact_spill_file();
+    }
+}
+
+/** A mining report which failed with a network error. */
+struct PendingReport
+{
+    Solution soln;
+    /** How long to wait after the next failure. */
+    absl::Duration backoff;
+};
+
+void submit_thread_func()
+{
     const std::string server = absl::GetFlag(FLAGS_server);
-    const std::string webcash_log_filename = absl::GetFlag(FLAGS_webcashlog);
     const std::string orphan_log_filename = absl::GetFlag(FLAGS_orphanlog);
 
+    // The connection is kept open between reports, to save the TCP and TLS
+    // handshakes.  The client reconnects if the server closes it.
+    httplib::Client cli(server);
+    cli.set_keep_alive(true);
+    cli.set_read_timeout(60, 0); // 60 seconds
+    cli.set_write_timeout(60, 0); // 60 seconds
+
+    // Reports waiting to be retried, by the time of the next attempt.  New
+    // solutions are still submitted in the meantime.
+    std::multimap<absl::Time, PendingReport> retries;
+
+    while (true) {
+        if (g_spilled && g_solutions.Empty()) {
+            unspill_solutions();
+        }
+
+        // Fetch a report which is due for a retry, or else the next solved
+        // proof-of-work in FIFO order.
+        PendingReport report;
+        {
+            std::unique_lock<std::mutex> lock(g_solutions_mutex);
+            bool have_report = false;
+            auto ready = [&] {
+                if (!retries.empty() && retries.begin()->first <= absl::Now()) {
+                    report = std::move(retries.begin()->second);
+                    retries.erase(retries.begin());
+                    have_report = true;
+                } else if (g_solutions.TryPop(report.soln)) {
+                    report.backoff = SUBMIT_RETRY_MIN;
+                    have_report = true;
+                }
+                return have_report || g_shutdown;
+            };
+            if (retries.empty()) {
+                g_solutions_cv.wait(lock, ready);
+            } else {
+                g_solutions_cv.wait_until(lock, absl::ToChronoTime(retries.begin()->first), ready);
+            }
+            if (!have_report) {
+                if (!g_shutdown) {
+                    continue;
+                }
+                // Leave the unsubmitted solutions for the next run.
+                lock.unlock();
+                for (const auto& retry : retries) {
+                    spill_solution(retry.second.soln);
+                }
+                Solution soln;
+                while (g_solutions.TryPop(soln)) {
+                    spill_solution(soln);
+                }
+                return;
+            }
+        }
+        const Solution& soln = report.soln;
+
+        // Don't submit work that is less than the current difficulty,
+        // which is re-checked before each retry.
+        const int current_difficulty = g_difficulty;
+        const int apparent_difficulty = get_apparent_difficulty(soln.hash);
+        if (apparent_difficulty < current_difficulty) {
+            // difficulty changed against us
+            LogWarning() << "Stale mining report detected (" << apparent_difficulty << " < " << current_difficulty << "); skipping";
+            ++g_metrics.stale;
+            // Save the solution to the orphan log
+            write_orphan_log(orphan_log_filename, soln, apparent_difficulty);
+            finish_solution(soln);
+            continue;
+        }
+
+        // Convert hash to decimal notation
+        BIGNUM bn;
+        BN_init(&bn);
+        BN_bin2bn((const uint8_t*)soln.hash.begin(), 32, &bn);
+        char* work = BN_bn2dec(&bn);
+        BN_free(&bn);
+
+        // Submit the solved proof-of-work
+        const absl::Time submit_time = absl::Now();
+        // Acceptance of terms of service is hard-coded here because it is
+        // checked for on startup.
+        auto r = cli.Post(
+            "/api/v1/mining_report",
+            absl::StrCat("{\"preimage\": \"", soln.preimage, "\", \"work\": ", work, ", \"legalese\": {\"terms\": true}}"),
+            "application/json");
+        g_metrics.AddSubmitLatency(absl::Now() - submit_time);
+
+        // Handle network errors by retrying with backoff
+        if (!r) {
+            LogError() << "returned invalid response to MiningReport request: " << r.error();
+            LogError() << "Possible transient error, or server timeout?  Re-attempting in " << absl::FormatDuration(report.backoff) << ".";
+            ++g_metrics.submit_errors;
+            const absl::Time next_attempt = absl::Now() + report.backoff;
+            report.backoff = std::min(2 * report.backoff, SUBMIT_RETRY_MAX);
+            retries.emplace(next_attempt, std::move(report));
+            continue;
+        }
+
+        // Parse response
+        UniValue o;
+        o.read(r->body);
+
+        // Handle server rejection by saving the proof-of-work
+        // solution to the orphan log.
+        if (r->status != 200 && !(r->status == 400 && o.isObject() && o.exists("error") && o["error"].get_str() == "Didn't use a new secret value.")) {
+            // server error, or difficulty changed against us
+            LogError() << "returned invalid response to MiningReport request: status_code=" << r->status << ", text='" << r->body << "'";
+            {
+                // Have the update thread re-fetch the settings now.
+                LOCK_GUARD(g_state_mutex);
+                g_next_settings_fetch = absl::Now();
+            }
+            g_update_thread_cv.notify_all();
+            ++g_metrics.orphans;
+            // Save the solution to the orphan log
+            write_orphan_log(orphan_log_filename, soln, apparent_difficulty);
+            finish_solution(soln);
+            continue;
+        }
+
+        ++g_metrics.submissions;
+
+        // Update difficulty
+        const UniValue& difficulty = o["difficulty_target"];
+        if (difficulty.isNum()) {
+            int bits = difficulty.get_int();
+            int old_bits = g_difficulty.exchange(bits);
+            if (bits != old_bits) {
+                LogInfo() << "Difficulty adjustment occured! Server says difficulty=" << bits;
+                new_work_epoch();
+            }
+        }
+
+        // Hand the coin over to be claimed by the wallet
+        {
+            LOCK_GUARD(g_state_mutex);
+            g_claims.push_back(soln.webcash);
+        }
+        g_claims_cv.notify_one();
+        finish_solution(soln);
+    }
+}
+
+void claim_thread_func()
+{
+    using std::to_string;
+
+    const std::string webcash_log_filename = absl::GetFlag(FLAGS_webcashlog);
+
+    while (true) {
+        // Take everything that arrived while the last batch was being
+        // claimed, so that a burst of solutions costs a single replacement.
+        std::vector<SecretWebcash> batch;
+        {
+            std::unique_lock<std::mutex> lock(g_state_mutex, std::defer_lock);
+            LOCK_SITE(g_state_mutex)->Lock(lock);
+            g_claims_cv.wait(lock, [] { return g_shutdown || !g_claims.empty(); });
+            if (g_claims.empty()) {
+                return;
+            }
+            while (!g_claims.empty() && batch.size() < MAX_CLAIM_BATCH) {
+                batch.push_back(std::move(g_claims.front()));
+                g_claims.pop_front();
+            }
+        }
+
+        // Claim the coins with our wallet
+        auto insert = [](const std::vector<SecretWebcash>& claims) {
+            return g_wallet ? g_wallet->Insert(claims, true) : g_wallet_client->Insert(claims, true);
+        };
+        std::vector<SecretWebcash> unclaimed;
+        if (!insert(batch)) {
+            // The batch is claimed in a single replacement, so one bad claim
+            // fails all of them.  Each is retried on its own, so that only
+            // those which fail again are left unclaimed.
+            if (batch.size() > 1) {
+                for (const SecretWebcash& webcash : batch) {
+                    if (!insert({webcash})) {
+                        unclaimed.push_back(webcash);
+                    }
+                }
+            } else {
+                unclaimed = batch;
+            }
+        }
+        if (!unclaimed.empty()) {
+            // Save the successfully submitted webcash to the log, since we
+            // were unable to add it to the wallet.
+            std::ofstream webcash_log(webcash_log_filename, std::ofstream::app);
+            for (const SecretWebcash& webcash : unclaimed) {
+                webcash_log << to_string(webcash) << std::endl;
+            }
+            webcash_log.flush();
+        }
+    }
+}
+
+// Makes the mining threads start over if the protocol settings have changed.
+void apply_protocol_settings(const ProtocolSettings& settings)
+{
+    const bool changed = settings.difficulty != g_difficulty
+                      || settings.mining_amount != g_mining_amount
+                      || settings.subsidy_amount != g_subsidy_amount;
+    g_difficulty = settings.difficulty;
+    g_mining_amount = settings.mining_amount;
+    g_subsidy_amount = settings.subsidy_amount;
+    if (changed) {
+        new_work_epoch();
+    }
+}
+
+// Waits on the server for changes to the protocol settings, which it answers
+// as soon as the difficulty or epoch changes.  Exits if the server doesn't
+// support waiting, leaving the update thread to poll for them.
+void target_thread_func(ProtocolSettings settings)
+{
+    const std::string server = absl::GetFlag(FLAGS_server);
+
+    httplib::Client cli(server);
+    // The server holds each request for up to a minute.
+    cli.set_read_timeout(90, 0); // 90 seconds
+    cli.set_write_timeout(60, 0); // 60 seconds
+    {
+        const std::lock_guard<std::mutex> lock(g_target_mutex);
+        if (g_shutdown) {
+            return;
+        }
+        g_target_client = &cli;
+    }
+
+    while (!g_shutdown && !settings.version.empty()) {
+        auto r = cli.Get(("/api/v1/target/wait?version=" + settings.version).c_str());
+        if (g_shutdown) {
+            break;
+        }
+        ProtocolSettings pushed;
+        if (!r || r->status != 200 || !parse_protocol_settings(r->body, pushed)) {
+            if (r && r->status == 404) {
+                LogWarning() << "server does not support waiting for protocol settings; polling instead";
+                break;
+            }
+            // Fall back to polling until the server can be reached again.
+            {
+                const std::lock_guard<std::mutex> lock(g_target_mutex);
+                g_target_pushed = false;
+            }
+            std::unique_lock<std::mutex> lock(g_state_mutex, std::defer_lock);
+            LOCK_SITE(g_state_mutex)->Lock(lock);
+            g_update_thread_cv.wait_for(lock, std::chrono::seconds(15));
+            continue;
+        }
+        if (pushed.difficulty != settings.difficulty) {
+            LogInfo() << "server says difficulty=" << pushed.difficulty;
+        }
+        apply_protocol_settings(pushed);
+        settings = pushed;
+        const std::lock_guard<std::mutex> lock(g_target_mutex);
+        g_target_pushed = true;
+        g_target_settings = pushed;
+    }
+
+    const std::lock_guard<std::mutex> lock(g_target_mutex);
+    g_target_pushed = false;
+    g_target_client = nullptr;
+}
+
+void update_thread_func()
+{
+    using std::to_string;
+
+    const std::string server = absl::GetFlag(FLAGS_server);
+
     bool update_rng = true;
     bool fetch_settings = true;
     bool first_run = true;
@@ -247,252 +798,487 @@ void update_thread_func()
             // Fetch updated protocol settings, and report changes + current
             // hash speed to the user.
             current_time = absl::Now();
-            int64_t attempts = g_attempts.exchange(0);
+            int64_t attempts = g_metrics.Sample(current_time);
             ProtocolSettings settings;
-            if (get_protocol_settings(server, settings)) {
+            bool pushed;
+            {
+                const std::lock_guard<std::mutex> lock(g_target_mutex);
+                pushed = g_target_pushed;
+                settings = g_target_settings;
+            }
+            if (pushed || get_protocol_settings(server, settings)) {
                 if (!first_run) {
-                    std::cout << "server says"
+                    LogInfo() << "server says"
                               << " difficulty=" << settings.difficulty
                               << " ratio=" << settings.ratio
                               << " speed=" << get_speed_string(attempts, g_last_settings_fetch, current_time)
-                              << " expect=" << get_expect_string(attempts, g_last_settings_fetch, current_time, settings.difficulty)
-                              << std::endl;
+                              << " expect=" << get_expect_string(attempts, g_last_settings_fetch, current_time, settings.difficulty);
                 }
                 first_run = false;
-                g_difficulty = settings.difficulty;
-                g_mining_amount = settings.mining_amount;
-                g_subsidy_amount = settings.subsidy_amount;
+                if (!pushed) {
+                    apply_protocol_settings(settings);
+                }
             }
             // Schedule next update
+            LOCK_GUARD(g_state_mutex);
             g_last_settings_fetch = current_time;
             g_next_settings_fetch = current_time + absl::Seconds(15);
         }
 
-        while (true) {
-            // Fetch a solved proof-of-work in FIFO order
-            Solution soln;
-            {
-                const std::lock_guard<std::mutex> lock(g_state_mutex);
-                if (g_solutions.empty()) {
-                    break;
-                }
-                soln = std::move(g_solutions.front());
-                g_solutions.pop_front();
-            }
+        std::unique_lock<std::mutex> lock(g_state_mutex, std::defer_lock);
+        LOCK_SITE(g_state_mutex)->Lock(lock);
+        g_update_thread_cv.wait_until(lock, absl::ToChronoTime(std::min(g_next_rng_update, g_next_settings_fetch)));
 
-            // Don't submit work that is less than the current difficulty
-            int current_difficulty = g_difficulty;
-            int apparent_difficulty = get_apparent_difficulty(soln.hash);
-            if (apparent_difficulty < current_difficulty) {
-                // difficulty changed against us
-                std::cerr << "Stale mining report detected (" << apparent_difficulty << " < " << current_difficulty << "); skipping" << std::endl;
-                // Save the solution to the orphan log
-                std::ofstream orphan_log(orphan_log_filename, std::ofstream::app);
-                orphan_log << soln.preimage << ' ' << absl::BytesToHexString(absl::string_view((const char*)soln.hash.begin(), 32)) << ' ' << to_string(soln.webcash) << " difficulty=" << apparent_difficulty << std::endl;
-                orphan_log.flush();
-                continue;
-            }
+        current_time = absl::Now();
+        if (current_time >= g_next_rng_update) {
+            update_rng = true;
+        }
+        if (current_time >= g_next_settings_fetch) {
+            fetch_settings = true;
+        }
+    }
+}
 
-            // Convert hash to decimal notation
-            BIGNUM bn;
-            BN_init(&bn);
-            BN_bin2bn((const uint8_t*)soln.hash.begin(), 32, &bn);
-            char* work = BN_bn2dec(&bn);
-            BN_free(&bn);
-
-            // Submit the solved proof-of-work
-            httplib::Client cli(server);
-            cli.set_read_timeout(60, 0); // 60 seconds
-            cli.set_write_timeout(60, 0); // 60 seconds
-            // Acceptance of terms of service is hard-coded here because it is
-            // checked for on startup.
-            auto r = cli.Post(
-                "/api/v1/mining_report",
-                absl::StrCat("{\"preimage\": \"", soln.preimage, "\", \"work\": ", work, ", \"legalese\": {\"terms\": true}}"),
-                "application/json");
-
-            // Handle network errors by aborting further processing
-            if (!r) {
-                std::cerr << "Error: returned invalid response to MiningReport request: " << r.error() << std::endl;
-                std::cerr << "Possible transient error, or server timeout?  Waiting to re-attempt." << std::endl;
-                const std::lock_guard<std::mutex> lock(g_state_mutex);
-                g_solutions.push_front(soln);
-                break;
-            }
+// The 1000 four-character base64 encodings of "000" through "999", which are
+// used as the two nonces at the end of the proof-of-work preimage.
+static const char nonces[] =
+    "MDAwMDAxMDAyMDAzMDA0MDA1MDA2MDA3MDA4MDA5MDEwMDExMDEyMDEzMDE0MDE1MDE2MDE3MDE4MDE5"
+    "MDIwMDIxMDIyMDIzMDI0MDI1MDI2MDI3MDI4MDI5MDMwMDMxMDMyMDMzMDM0MDM1MDM2MDM3MDM4MDM5"
+    "MDQwMDQxMDQyMDQzMDQ0MDQ1MDQ2MDQ3MDQ4MDQ5MDUwMDUxMDUyMDUzMDU0MDU1MDU2MDU3MDU4MDU5"
+    "MDYwMDYxMDYyMDYzMDY0MDY1MDY2MDY3MDY4MDY5MDcwMDcxMDcyMDczMDc0MDc1MDc2MDc3MDc4MDc5"
+    "MDgwMDgxMDgyMDgzMDg0MDg1MDg2MDg3MDg4MDg5MDkwMDkxMDkyMDkzMDk0MDk1MDk2MDk3MDk4MDk5"
+    "MTAwMTAxMTAyMTAzMTA0MTA1MTA2MTA3MTA4MTA5MTEwMTExMTEyMTEzMTE0MTE1MTE2MTE3MTE4MTE5"
+    "MTIwMTIxMTIyMTIzMTI0MTI1MTI2MTI3MTI4MTI5MTMwMTMxMTMyMTMzMTM0MTM1MTM2MTM3MTM4MTM5"
+    "MTQwMTQxMTQyMTQzMTQ0MTQ1MTQ2MTQ3MTQ4MTQ5MTUwMTUxMTUyMTUzMTU0MTU1MTU2MTU3MTU4MTU5"
+    "MTYwMTYxMTYyMTYzMTY0MTY1MTY2MTY3MTY4MTY5MTcwMTcxMTcyMTczMTc0MTc1MTc2MTc3MTc4MTc5"
+    "MTgwMTgxMTgyMTgzMTg0MTg1MTg2MTg3MTg4MTg5MTkwMTkxMTkyMTkzMTk0MTk1MTk2MTk3MTk4MTk5"
+    "MjAwMjAxMjAyMjAzMjA0MjA1MjA2MjA3MjA4MjA5MjEwMjExMjEyMjEzMjE0MjE1MjE2MjE3MjE4MjE5"
+    "MjIwMjIxMjIyMjIzMjI0MjI1MjI2MjI3MjI4MjI5MjMwMjMxMjMyMjMzMjM0MjM1MjM2MjM3MjM4MjM5"
+    "MjQwMjQxMjQyMjQzMjQ0MjQ1MjQ2MjQ3MjQ4MjQ5MjUwMjUxMjUyMjUzMjU0MjU1MjU2MjU3MjU4MjU5"
+    "MjYwMjYxMjYyMjYzMjY0MjY1MjY2MjY3MjY4MjY5MjcwMjcxMjcyMjczMjc0Mjc1Mjc2Mjc3Mjc4Mjc5"
+    "MjgwMjgxMjgyMjgzMjg0Mjg1Mjg2Mjg3Mjg4Mjg5MjkwMjkxMjkyMjkzMjk0Mjk1Mjk2Mjk3Mjk4Mjk5"
+    "MzAwMzAxMzAyMzAzMzA0MzA1MzA2MzA3MzA4MzA5MzEwMzExMzEyMzEzMzE0MzE1MzE2MzE3MzE4MzE5"
+    "MzIwMzIxMzIyMzIzMzI0MzI1MzI2MzI3MzI4MzI5MzMwMzMxMzMyMzMzMzM0MzM1MzM2MzM3MzM4MzM5"
+    "MzQwMzQxMzQyMzQzMzQ0MzQ1MzQ2MzQ3MzQ4MzQ5MzUwMzUxMzUyMzUzMzU0MzU1MzU2MzU3MzU4MzU5"
+    "MzYwMzYxMzYyMzYzMzY0MzY1MzY2MzY3MzY4MzY5MzcwMzcxMzcyMzczMzc0Mzc1Mzc2Mzc3Mzc4Mzc5"
+    "MzgwMzgxMzgyMzgzMzg0Mzg1Mzg2Mzg3Mzg4Mzg5MzkwMzkxMzkyMzkzMzk0Mzk1Mzk2Mzk3Mzk4Mzk5"
+    "NDAwNDAxNDAyNDAzNDA0NDA1NDA2NDA3NDA4NDA5NDEwNDExNDEyNDEzNDE0NDE1NDE2NDE3NDE4NDE5"
+    "NDIwNDIxNDIyNDIzNDI0NDI1NDI2NDI3NDI4NDI5NDMwNDMxNDMyNDMzNDM0NDM1NDM2NDM3NDM4NDM5"
+    "NDQwNDQxNDQyNDQzNDQ0NDQ1NDQ2NDQ3NDQ4NDQ5NDUwNDUxNDUyNDUzNDU0NDU1NDU2NDU3NDU4NDU5"
+    "NDYwNDYxNDYyNDYzNDY0NDY1NDY2NDY3NDY4NDY5NDcwNDcxNDcyNDczNDc0NDc1NDc2NDc3NDc4NDc5"
+    "NDgwNDgxNDgyNDgzNDg0NDg1NDg2NDg3NDg4NDg5NDkwNDkxNDkyNDkzNDk0NDk1NDk2NDk3NDk4NDk5"
+    "NTAwNTAxNTAyNTAzNTA0NTA1NTA2NTA3NTA4NTA5NTEwNTExNTEyNTEzNTE0NTE1NTE2NTE3NTE4NTE5"
+    "NTIwNTIxNTIyNTIzNTI0NTI1NTI2NTI3NTI4NTI5NTMwNTMxNTMyNTMzNTM0NTM1NTM2NTM3NTM4NTM5"
+    "NTQwNTQxNTQyNTQzNTQ0NTQ1NTQ2NTQ3NTQ4NTQ5NTUwNTUxNTUyNTUzNTU0NTU1NTU2NTU3NTU4NTU5"
+    "NTYwNTYxNTYyNTYzNTY0NTY1NTY2NTY3NTY4NTY5NTcwNTcxNTcyNTczNTc0NTc1NTc2NTc3NTc4NTc5"
+    "NTgwNTgxNTgyNTgzNTg0NTg1NTg2NTg3NTg4NTg5NTkwNTkxNTkyNTkzNTk0NTk1NTk2NTk3NTk4NTk5"
+    "NjAwNjAxNjAyNjAzNjA0NjA1NjA2NjA3NjA4NjA5NjEwNjExNjEyNjEzNjE0NjE1NjE2NjE3NjE4NjE5"
+    "NjIwNjIxNjIyNjIzNjI0NjI1NjI2NjI3NjI4NjI5NjMwNjMxNjMyNjMzNjM0NjM1NjM2NjM3NjM4NjM5"
+    "NjQwNjQxNjQyNjQzNjQ0NjQ1NjQ2NjQ3NjQ4NjQ5NjUwNjUxNjUyNjUzNjU0NjU1NjU2NjU3NjU4NjU5"
+    "NjYwNjYxNjYyNjYzNjY0NjY1NjY2NjY3NjY4NjY5NjcwNjcxNjcyNjczNjc0Njc1Njc2Njc3Njc4Njc5"
+    "NjgwNjgxNjgyNjgzNjg0Njg1Njg2Njg3Njg4Njg5NjkwNjkxNjkyNjkzNjk0Njk1Njk2Njk3Njk4Njk5"
+    "NzAwNzAxNzAyNzAzNzA0NzA1NzA2NzA3NzA4NzA5NzEwNzExNzEyNzEzNzE0NzE1NzE2NzE3NzE4NzE5"
+    "NzIwNzIxNzIyNzIzNzI0NzI1NzI2NzI3NzI4NzI5NzMwNzMxNzMyNzMzNzM0NzM1NzM2NzM3NzM4NzM5"
+    "NzQwNzQxNzQyNzQzNzQ0NzQ1NzQ2NzQ3NzQ4NzQ5NzUwNzUxNzUyNzUzNzU0NzU1NzU2NzU3NzU4NzU5"
+    "NzYwNzYxNzYyNzYzNzY0NzY1NzY2NzY3NzY4NzY5NzcwNzcxNzcyNzczNzc0Nzc1Nzc2Nzc3Nzc4Nzc5"
+    "NzgwNzgxNzgyNzgzNzg0Nzg1Nzg2Nzg3Nzg4Nzg5NzkwNzkxNzkyNzkzNzk0Nzk1Nzk2Nzk3Nzk4Nzk5"
+    "ODAwODAxODAyODAzODA0ODA1ODA2ODA3ODA4ODA5ODEwODExODEyODEzODE0ODE1ODE2ODE3ODE4ODE5"
+    "ODIwODIxODIyODIzODI0ODI1ODI2ODI3ODI4ODI5ODMwODMxODMyODMzODM0ODM1ODM2ODM3ODM4ODM5"
+    "ODQwODQxODQyODQzODQ0ODQ1ODQ2ODQ3ODQ4ODQ5ODUwODUxODUyODUzODU0ODU1ODU2ODU3ODU4ODU5"
+    "ODYwODYxODYyODYzODY0ODY1ODY2ODY3ODY4ODY5ODcwODcxODcyODczODc0ODc1ODc2ODc3ODc4ODc5"
+    "ODgwODgxODgyODgzODg0ODg1ODg2ODg3ODg4ODg5ODkwODkxODkyODkzODk0ODk1ODk2ODk3ODk4ODk5"
+    "OTAwOTAxOTAyOTAzOTA0OTA1OTA2OTA3OTA4OTA5OTEwOTExOTEyOTEzOTE0OTE1OTE2OTE3OTE4OTE5"
+    "OTIwOTIxOTIyOTIzOTI0OTI1OTI2OTI3OTI4OTI5OTMwOTMxOTMyOTMzOTM0OTM1OTM2OTM3OTM4OTM5"
+    "OTQwOTQxOTQyOTQzOTQ0OTQ1OTQ2OTQ3OTQ4OTQ5OTUwOTUxOTUyOTUzOTU0OTU1OTU2OTU3OTU4OTU5"
+    "OTYwOTYxOTYyOTYzOTY0OTY1OTY2OTY3OTY4OTY5OTcwOTcxOTcyOTczOTc0OTc1OTc2OTc3OTc4OTc5"
+    "OTgwOTgxOTgyOTgzOTg0OTg1OTg2OTg3OTg4OTg5OTkwOTkxOTkyOTkzOTk0OTk1OTk2OTk3OTk4OTk5"
+;
+static const char final[] = "fQ==";
+
+/** A secret reserved from the wallet's mining chain for a work unit.  It is
+ *  handed back once the last copy of the work is dropped, unless a solution
+ *  was found with it, so that the chain's depths are only used up by
+ *  solutions. */
+struct MiningReservation
+{
+    SecureString sk;
+    std::atomic<bool> used{false};
 
-            // Parse response
-            UniValue o;
-            o.read(r->body);
+    explicit MiningReservation(SecureString skIn) : sk(std::move(skIn)) {}
+    ~MiningReservation()
+    {
+        if (used) {
+            return;
+        }
+        if (g_wallet) {
+            g_wallet->ReleaseMiningSecret(sk);
+        } else if (g_wallet_client) {
+            g_wallet_client->ReleaseMiningSecret(sk);
+        }
+    }
+};
 
-            // Handle server rejection by saving the proof-of-work
-            // solution to the orphan log.
-            if (r->status != 200 && !(r->status == 400 && o.isObject() && o.exists("error") && o["error"].get_str() == "Didn't use a new secret value.")) {
-                // server error, or difficulty changed against us
-                std::cerr << "Error: returned invalid response to MiningReport request: status_code=" << r->status << ", text='" << r->body << "'" << std::endl;
-                g_next_settings_fetch = absl::Now();
-                // Save the solution to the orphan log
-                std::ofstream orphan_log(orphan_log_filename, std::ofstream::app);
-                orphan_log << soln.preimage << ' ' << absl::BytesToHexString(absl::string_view((const char*)soln.hash.begin(), 32)) << ' ' << to_string(soln.webcash) << " difficulty=" << apparent_difficulty << std::endl;
-                orphan_log.flush();
-                continue;
-            }
+/**
+ * The webcash secrets being mined for, and the preimage prefix committing to
+ * them.  The last four characters of the base64-encoded prefix are a third
+ * nonce, the "prefix nonce", which like the other two takes the values
+ * "000" through "999" (base64-encoded).  Together the three nonces give
+ * 10^9 attempts per prefix, and changing the prefix nonce only requires
+ * hashing the last block of the prefix again.
+ */
+struct MiningWork
+{
+    /** The value of g_work_epoch when the work was made. */
+    uint64_t epoch;
+    /** The coordinator's id for the work, if mining as an agent. */
+    uint64_t id = 0;
+    /** The secret paid by the work, which is part of the prefix, and so is
+     *  also seen by the agents it is handed out to. */
+    SecretWebcash keep;
+    /** Set if keep.sk was reserved from the wallet. */
+    std::shared_ptr<MiningReservation> reservation;
+    /** The base64-encoded prefix, with a prefix nonce of zero. */
+    std::string prefix_b64;
+    /** The hash state after all but the last block of the prefix. */
+    CSHA256 base;
+
+    /** Set the prefix, which must be a multiple of 64 bytes long. */
+    void SetPrefix(std::string prefix)
+    {
+        prefix_b64 = std::move(prefix);
+        // Only the last block contains the prefix nonce.
+        base = CSHA256();
+        base.Write((unsigned char*)prefix_b64.data(), prefix_b64.size() - 64);
+    }
 
-            // Update difficulty
-            const UniValue& difficulty = o["difficulty_target"];
-            if (difficulty.isNum()) {
-                int bits = difficulty.get_int();
-                int old_bits = g_difficulty.exchange(bits);
-                if (bits != old_bits) {
-                    std::cout << "Difficulty adjustment occured! Server says difficulty=" << bits << std::endl;
-                }
-            }
+    /** The base64-encoded prefix with the given prefix nonce. */
+    std::string GetPrefix(int h) const
+    {
+        std::string prefix = prefix_b64;
+        prefix.replace(prefix.size() - 4, 4, nonces + 4*h, 4);
+        return prefix;
+    }
 
-            // Claim the coin with our wallet
-            if (!g_wallet->Insert(soln.webcash, true)) {
-                // Save the successfully submitted webcash to the log, since we
-                // were unable to add it to the wallet.
-                std::ofstream webcash_log(webcash_log_filename, std::ofstream::app);
-                webcash_log << to_string(soln.webcash) << std::endl;
-                webcash_log.flush();
-            }
+    /** The hash state after the prefix with the given prefix nonce. */
+    CSHA256 GetMidstate(int h) const
+    {
+        unsigned char block[64];
+        std::copy(prefix_b64.end() - 64, prefix_b64.end() - 4, block);
+        std::copy(nonces + 4*h, nonces + 4*h + 4, block + 60);
+        CSHA256 midstate(base);
+        midstate.Write(block, 64);
+        return midstate;
+    }
+};
+
+MiningWork make_mining_work()
+{
+    using std::to_string;
+
+    MiningWork work;
+    // Agents mine the coordinator's prefixes instead of their own.
+    if (g_coordinator_client) {
+        std::optional<CoordinatorWork> remote = g_coordinator_client->GetWork();
+        if (!remote) {
+            // The client is stopped, which only happens on shutdown once
+            // the mining threads have exited.  The work is never used.
+            work.epoch = 0;
+            return work;
         }
+        work.epoch = remote->epoch;
+        work.id = remote->id;
+        work.SetPrefix(std::move(remote->prefix_b64));
+        return work;
+    }
 
-        std::unique_lock<std::mutex> lock(g_state_mutex);
-        g_update_thread_cv.wait_until(lock, absl::ToChronoTime(std::min(g_next_rng_update, g_next_settings_fetch)));
+    // Read before the settings, so that a concurrent change marks this work
+    // as stale rather than going unnoticed.
+    work.epoch = g_work_epoch;
+
+    // The secret we keep comes from the wallet's mining chain, so that it
+    // can be recovered along with the wallet.  The subsidy goes to the
+    // server, and so is just random, as is everything when there's no
+    // wallet to draw from.  Both random secrets are drawn at once, from
+    // this thread's DRBG.
+    unsigned char sk[64];
+    GetBulkRandBytes(sk, sizeof(sk));
+    work.keep.amount = g_mining_amount - g_subsidy_amount;
+    std::optional<SecureString> keep;
+    if (g_wallet && !g_benchmark) {
+        keep = g_wallet->ReserveMiningSecret();
+    } else if (g_wallet_client) {
+        // Should the wallet be unreachable, the claim ends up in the
+        // webcash log instead.
+        keep = g_wallet_client->ReserveMiningSecret();
+    }
+    if (keep) {
+        work.keep.sk = *keep;
+        work.reservation = std::make_shared<MiningReservation>(std::move(*keep));
+    } else {
+        work.keep.sk = absl::BytesToHexString(absl::string_view((const char*)sk, 32));
+    }
 
-        current_time = absl::Now();
-        if (current_time >= g_next_rng_update) {
-            update_rng = true;
+    SecretWebcash subsidy;
+    subsidy.amount = g_subsidy_amount;
+    subsidy.sk = absl::BytesToHexString(absl::string_view((const char*)sk + 32, 32));
+    memory_cleanse(sk, sizeof(sk));
+
+    std::string subsidy_str = std::string(to_string(subsidy).c_str());
+    // The miner won't get this far if the terms of service aren't agreed
+    // to, so we can safely hard-code acceptance here.
+    std::string prefix = absl::StrCat("{\"legalese\": {\"terms\": true}, \"webcash\": [\"", to_string(work.keep), "\", \"", subsidy_str, "\"], \"subsidy\": [\"", subsidy_str, "\"], \"difficulty\": ", to_string(g_difficulty), ", \"timestamp\": ", to_string(absl::ToDoubleSeconds(absl::Now() - absl::UnixEpoch())), ", \"nonce\": ");
+    // Extend the prefix to be a multiple of 48 in size, ending with a
+    // leading '1' for the nonce and three digits (initially "000") which
+    // encode to the prefix nonce...
+    prefix.resize(48 * (1 + (prefix.size() + 3) / 48), ' ');
+    prefix.replace(prefix.size() - 4, 4, "1000");
+    // ...which becomes 64 bytes when base64 encoded.  And 64 bytes is the
+    // SHA256 block size.
+    work.SetPrefix(absl::Base64Escape(prefix));
+
+    return work;
+}
+
+/** The number of work units kept ready for each mining thread. */
+static const size_t WORK_QUEUE_DEPTH = 2;
+
+// Work units made ahead of time by work_producer_thread_func(), one queue
+// per mining thread, so that the mining threads don't have to stop hashing
+// to draw random secrets and build prefixes.  Guarded by g_work_queue_mutex.
+std::vector<std::deque<MiningWork>> g_work_queues;
+
+/** Fill the mining threads' work queues as they are drained. */
+void work_producer_thread_func()
+{
+    while (!g_shutdown) {
+        // Find the queues that need topping up.
+        std::vector<size_t> wanted;
+        {
+            std::unique_lock<std::mutex> lock(g_work_queue_mutex);
+            auto need_work = [&] {
+                wanted.clear();
+                for (size_t i = 0; i < g_work_queues.size(); ++i) {
+                    // Stale work is dropped, and replaced.
+                    std::deque<MiningWork>& queue = g_work_queues[i];
+                    while (!queue.empty() && queue.front().epoch != g_work_epoch) {
+                        queue.pop_front();
+                    }
+                    if (queue.size() < WORK_QUEUE_DEPTH) {
+                        wanted.push_back(i);
+                    }
+                }
+                return g_shutdown || !wanted.empty();
+            };
+            g_work_queue_cv.wait(lock, need_work);
         }
-        if (current_time >= g_next_settings_fetch) {
-            fetch_settings = true;
+
+        // Make the work without holding the lock, then hand it out.
+        std::vector<MiningWork> works;
+        works.reserve(wanted.size());
+        for (size_t i = 0; i < wanted.size(); ++i) {
+            works.push_back(make_mining_work());
+        }
+        const std::lock_guard<std::mutex> lock(g_work_queue_mutex);
+        for (size_t i = 0; i < wanted.size(); ++i) {
+            g_work_queues[wanted[i]].push_back(std::move(works[i]));
+        }
+    }
+}
+
+/** Take the next work unit for the given mining thread from its queue,
+ *  skipping stale work, or make one if the queue is empty. */
+MiningWork get_mining_work(int id)
+{
+    {
+        const std::lock_guard<std::mutex> lock(g_work_queue_mutex);
+        std::deque<MiningWork>& queue = g_work_queues[id];
+        while (!queue.empty() && queue.front().epoch != g_work_epoch) {
+            queue.pop_front();
+        }
+        if (!queue.empty()) {
+            MiningWork work = std::move(queue.front());
+            queue.pop_front();
+            g_work_queue_cv.notify_one();
+            return work;
         }
+        g_work_queue_cv.notify_one();
+    }
+    // The producer has fallen behind, e.g. at startup.
+    return make_mining_work();
+}
+
+/**
+ * Compute the full hash of a candidate which passed a mining kernel's filter,
+ * and if it meets the current difficulty add it to the queue of solutions.
+ * Returns true if the candidate was a solution.
+ */
+bool check_candidate(const MiningWork& work, int h, int i, int j)
+{
+    using std::to_string;
+
+    ++g_metrics.candidates;
+    uint256 hash;
+    work.GetMidstate(h)
+        .Write((const unsigned char*)nonces + 4*i, 4)
+        .Write((const unsigned char*)nonces + 4*j, 4)
+        .Write((const unsigned char*)final, 4)
+        .Finalize(hash.begin());
+    if (!check_proof_of_work(hash, g_difficulty)) {
+        return false;
+    }
+    if (g_benchmark) {
+        ++g_metrics.solutions;
+        return true;
+    }
+
+    std::string preimage = absl::StrCat(work.GetPrefix(h), absl::string_view(nonces + 4*i, 4), absl::string_view(nonces + 4*j, 4), final);
+    if (g_coordinator_client) {
+        // The coordinator has the secrets, and submits the solution.
+        // Written directly, rather than logged, so that the user's record of
+        // the solution can't be dropped, rate limited or truncated.
+        std::cout << absl::StrCat("GOT SOLUTION!!! ", preimage, " 0x", absl::BytesToHexString(absl::string_view((const char*)hash.begin(), 32))) << std::endl;
+        g_coordinator_client->SubmitSolution(work.id, preimage);
+        ++g_metrics.solutions;
+        return true;
+    }
+    // Written directly, as above: until the solution is claimed, this line
+    // holds the only record of its preimage and secret.
+    std::cout << absl::StrCat("GOT SOLUTION!!! ", preimage, " 0x", absl::BytesToHexString(absl::string_view((const char*)hash.begin(), 32)), " ", to_string(work.keep)) << std::endl;
+
+    // Add solution to the queue, and wake up a submission thread.
+    ++g_metrics.solutions;
+    if (work.reservation) {
+        work.reservation->used = true;
+    }
+    queue_solution(Solution(hash, std::move(preimage), work.keep));
+
+    return true;
+}
+
+/** The maximum number of work units handed out to agents which are
+ *  remembered, so that their solutions can be matched to the secrets.  Each
+ *  holds a reservation on the wallet's mining chain, so this is kept well
+ *  within the wallet's gap limit, leaving the rest to the local workers.
+ *  Agents are handed new work as they finish the old, so only the solutions
+ *  of more agent threads than this could be forgotten. */
+static const size_t MAX_AGENT_WORK = Wallet::MINING_GAP_LIMIT / 2;
+
+// Work handed out to agents, by id.  Guarded by g_agent_work_mutex.
+std::mutex g_agent_work_mutex;
+std::map<uint64_t, MiningWork> g_agent_work;
+uint64_t g_next_agent_work_id = 1;
+
+CoordinatorWork make_agent_work()
+{
+    MiningWork work = make_mining_work();
+    const std::lock_guard<std::mutex> lock(g_agent_work_mutex);
+    const uint64_t id = g_next_agent_work_id++;
+    // Work from an earlier epoch is stale, and agents drop it.  Ids are
+    // increasing, so this forgets the oldest work first.  Either way the
+    // reservation of the work is released.
+    while (!g_agent_work.empty() && (g_agent_work.size() >= MAX_AGENT_WORK || g_agent_work.begin()->second.epoch < work.epoch)) {
+        g_agent_work.erase(g_agent_work.begin());
     }
+    CoordinatorWork remote{id, work.epoch, work.prefix_b64};
+    g_agent_work.emplace(id, std::move(work));
+    return remote;
 }
 
-void mining_thread_func(int id)
+void handle_agent_solution(uint64_t id, const std::string& preimage)
 {
     using std::to_string;
 
+    SecretWebcash keep;
+    uint256 hash;
+    {
+        const std::lock_guard<std::mutex> lock(g_agent_work_mutex);
+        auto it = g_agent_work.find(id);
+        if (it == g_agent_work.end()) {
+            LogWarning() << "ignoring agent solution for unknown or already solved work " << id;
+            return;
+        }
+        // Agents are only trusted to hash, so check that the preimage is
+        // the prefix (up to the prefix nonce) with nonces appended, and that
+        // it really is a solution.
+        const std::string& prefix = it->second.prefix_b64;
+        if (preimage.size() != prefix.size() + 12 || preimage.compare(0, prefix.size() - 4, prefix, 0, prefix.size() - 4) != 0) {
+            LogWarning() << "ignoring agent solution which doesn't match its work " << id;
+            return;
+        }
+        CSHA256().Write((const unsigned char*)preimage.data(), preimage.size()).Finalize(hash.begin());
+        if (!check_proof_of_work(hash, g_difficulty)) {
+            LogWarning() << "ignoring agent solution below the current difficulty for work " << id;
+            return;
+        }
+        // Each set of secrets can only be claimed once.
+        keep = it->second.keep;
+        if (it->second.reservation) {
+            it->second.reservation->used = true;
+        }
+        g_agent_work.erase(it);
+    }
+    // Written directly, rather than logged, as for solutions found here.
+    std::cout << absl::StrCat("GOT SOLUTION FROM AGENT!!! ", preimage, " 0x", absl::BytesToHexString(absl::string_view((const char*)hash.begin(), 32)), " ", to_string(keep)) << std::endl;
+
+    ++g_metrics.solutions;
+    queue_solution(Solution(hash, preimage, keep));
+}
+
+void mining_thread_func(int id, MiningEngine engine, int cpu)
+{
     const unsigned max_difficulty = absl::GetFlag(FLAGS_maxdifficulty);
 
-    static const char nonces[] =
-        "MDAwMDAxMDAyMDAzMDA0MDA1MDA2MDA3MDA4MDA5MDEwMDExMDEyMDEzMDE0MDE1MDE2MDE3MDE4MDE5"
-        "MDIwMDIxMDIyMDIzMDI0MDI1MDI2MDI3MDI4MDI5MDMwMDMxMDMyMDMzMDM0MDM1MDM2MDM3MDM4MDM5"
-        "MDQwMDQxMDQyMDQzMDQ0MDQ1MDQ2MDQ3MDQ4MDQ5MDUwMDUxMDUyMDUzMDU0MDU1MDU2MDU3MDU4MDU5"
-        "MDYwMDYxMDYyMDYzMDY0MDY1MDY2MDY3MDY4MDY5MDcwMDcxMDcyMDczMDc0MDc1MDc2MDc3MDc4MDc5"
-        "MDgwMDgxMDgyMDgzMDg0MDg1MDg2MDg3MDg4MDg5MDkwMDkxMDkyMDkzMDk0MDk1MDk2MDk3MDk4MDk5"
-        "MTAwMTAxMTAyMTAzMTA0MTA1MTA2MTA3MTA4MTA5MTEwMTExMTEyMTEzMTE0MTE1MTE2MTE3MTE4MTE5"
-        "MTIwMTIxMTIyMTIzMTI0MTI1MTI2MTI3MTI4MTI5MTMwMTMxMTMyMTMzMTM0MTM1MTM2MTM3MTM4MTM5"
-        "MTQwMTQxMTQyMTQzMTQ0MTQ1MTQ2MTQ3MTQ4MTQ5MTUwMTUxMTUyMTUzMTU0MTU1MTU2MTU3MTU4MTU5"
-        "MTYwMTYxMTYyMTYzMTY0MTY1MTY2MTY3MTY4MTY5MTcwMTcxMTcyMTczMTc0MTc1MTc2MTc3MTc4MTc5"
-        "MTgwMTgxMTgyMTgzMTg0MTg1MTg2MTg3MTg4MTg5MTkwMTkxMTkyMTkzMTk0MTk1MTk2MTk3MTk4MTk5"
-        "MjAwMjAxMjAyMjAzMjA0MjA1MjA2MjA3MjA4MjA5MjEwMjExMjEyMjEzMjE0MjE1MjE2MjE3MjE4MjE5"
-        "MjIwMjIxMjIyMjIzMjI0MjI1MjI2MjI3MjI4MjI5MjMwMjMxMjMyMjMzMjM0MjM1MjM2MjM3MjM4MjM5"
-        "MjQwMjQxMjQyMjQzMjQ0MjQ1MjQ2MjQ3MjQ4MjQ5MjUwMjUxMjUyMjUzMjU0MjU1MjU2MjU3MjU4MjU5"
-        "MjYwMjYxMjYyMjYzMjY0MjY1MjY2MjY3MjY4MjY5MjcwMjcxMjcyMjczMjc0Mjc1Mjc2Mjc3Mjc4Mjc5"
-        "MjgwMjgxMjgyMjgzMjg0Mjg1Mjg2Mjg3Mjg4Mjg5MjkwMjkxMjkyMjkzMjk0Mjk1Mjk2Mjk3Mjk4Mjk5"
-        "MzAwMzAxMzAyMzAzMzA0MzA1MzA2MzA3MzA4MzA5MzEwMzExMzEyMzEzMzE0MzE1MzE2MzE3MzE4MzE5"
-        "MzIwMzIxMzIyMzIzMzI0MzI1MzI2MzI3MzI4MzI5MzMwMzMxMzMyMzMzMzM0MzM1MzM2MzM3MzM4MzM5"
-        "MzQwMzQxMzQyMzQzMzQ0MzQ1MzQ2MzQ3MzQ4MzQ5MzUwMzUxMzUyMzUzMzU0MzU1MzU2MzU3MzU4MzU5"
-        "MzYwMzYxMzYyMzYzMzY0MzY1MzY2MzY3MzY4MzY5MzcwMzcxMzcyMzczMzc0Mzc1Mzc2Mzc3Mzc4Mzc5"
-        "MzgwMzgxMzgyMzgzMzg0Mzg1Mzg2Mzg3Mzg4Mzg5MzkwMzkxMzkyMzkzMzk0Mzk1Mzk2Mzk3Mzk4Mzk5"
-        "NDAwNDAxNDAyNDAzNDA0NDA1NDA2NDA3NDA4NDA5NDEwNDExNDEyNDEzNDE0NDE1NDE2NDE3NDE4NDE5"
-        "NDIwNDIxNDIyNDIzNDI0NDI1NDI2NDI3NDI4NDI5NDMwNDMxNDMyNDMzNDM0NDM1NDM2NDM3NDM4NDM5"
-        "NDQwNDQxNDQyNDQzNDQ0NDQ1NDQ2NDQ3NDQ4NDQ5NDUwNDUxNDUyNDUzNDU0NDU1NDU2NDU3NDU4NDU5"
-        "NDYwNDYxNDYyNDYzNDY0NDY1NDY2NDY3NDY4NDY5NDcwNDcxNDcyNDczNDc0NDc1NDc2NDc3NDc4NDc5"
-        "NDgwNDgxNDgyNDgzNDg0NDg1NDg2NDg3NDg4NDg5NDkwNDkxNDkyNDkzNDk0NDk1NDk2NDk3NDk4NDk5"
-        "NTAwNTAxNTAyNTAzNTA0NTA1NTA2NTA3NTA4NTA5NTEwNTExNTEyNTEzNTE0NTE1NTE2NTE3NTE4NTE5"
-        "NTIwNTIxNTIyNTIzNTI0NTI1NTI2NTI3NTI4NTI5NTMwNTMxNTMyNTMzNTM0NTM1NTM2NTM3NTM4NTM5"
-        "NTQwNTQxNTQyNTQzNTQ0NTQ1NTQ2NTQ3NTQ4NTQ5NTUwNTUxNTUyNTUzNTU0NTU1NTU2NTU3NTU4NTU5"
-        "NTYwNTYxNTYyNTYzNTY0NTY1NTY2NTY3NTY4NTY5NTcwNTcxNTcyNTczNTc0NTc1NTc2NTc3NTc4NTc5"
-        "NTgwNTgxNTgyNTgzNTg0NTg1NTg2NTg3NTg4NTg5NTkwNTkxNTkyNTkzNTk0NTk1NTk2NTk3NTk4NTk5"
-        "NjAwNjAxNjAyNjAzNjA0NjA1NjA2NjA3NjA4NjA5NjEwNjExNjEyNjEzNjE0NjE1NjE2NjE3NjE4NjE5"
-        "NjIwNjIxNjIyNjIzNjI0NjI1NjI2NjI3NjI4NjI5NjMwNjMxNjMyNjMzNjM0NjM1NjM2NjM3NjM4NjM5"
-        "NjQwNjQxNjQyNjQzNjQ0NjQ1NjQ2NjQ3NjQ4NjQ5NjUwNjUxNjUyNjUzNjU0NjU1NjU2NjU3NjU4NjU5"
-        "NjYwNjYxNjYyNjYzNjY0NjY1NjY2NjY3NjY4NjY5NjcwNjcxNjcyNjczNjc0Njc1Njc2Njc3Njc4Njc5"
-        "NjgwNjgxNjgyNjgzNjg0Njg1Njg2Njg3Njg4Njg5NjkwNjkxNjkyNjkzNjk0Njk1Njk2Njk3Njk4Njk5"
-        "NzAwNzAxNzAyNzAzNzA0NzA1NzA2NzA3NzA4NzA5NzEwNzExNzEyNzEzNzE0NzE1NzE2NzE3NzE4NzE5"
-        "NzIwNzIxNzIyNzIzNzI0NzI1NzI2NzI3NzI4NzI5NzMwNzMxNzMyNzMzNzM0NzM1NzM2NzM3NzM4NzM5"
-        "NzQwNzQxNzQyNzQzNzQ0NzQ1NzQ2NzQ3NzQ4NzQ5NzUwNzUxNzUyNzUzNzU0NzU1NzU2NzU3NzU4NzU5"
-        "NzYwNzYxNzYyNzYzNzY0NzY1NzY2NzY3NzY4NzY5NzcwNzcxNzcyNzczNzc0Nzc1Nzc2Nzc3Nzc4Nzc5"
-        "NzgwNzgxNzgyNzgzNzg0Nzg1Nzg2Nzg3Nzg4Nzg5NzkwNzkxNzkyNzkzNzk0Nzk1Nzk2Nzk3Nzk4Nzk5"
-        "ODAwODAxODAyODAzODA0ODA1ODA2ODA3ODA4ODA5ODEwODExODEyODEzODE0ODE1ODE2ODE3ODE4ODE5"
-        "ODIwODIxODIyODIzODI0ODI1ODI2ODI3ODI4ODI5ODMwODMxODMyODMzODM0ODM1ODM2ODM3ODM4ODM5"
-        "ODQwODQxODQyODQzODQ0ODQ1ODQ2ODQ3ODQ4ODQ5ODUwODUxODUyODUzODU0ODU1ODU2ODU3ODU4ODU5"
-        "ODYwODYxODYyODYzODY0ODY1ODY2ODY3ODY4ODY5ODcwODcxODcyODczODc0ODc1ODc2ODc3ODc4ODc5"
-        "ODgwODgxODgyODgzODg0ODg1ODg2ODg3ODg4ODg5ODkwODkxODkyODkzODk0ODk1ODk2ODk3ODk4ODk5"
-        "OTAwOTAxOTAyOTAzOTA0OTA1OTA2OTA3OTA4OTA5OTEwOTExOTEyOTEzOTE0OTE1OTE2OTE3OTE4OTE5"
-        "OTIwOTIxOTIyOTIzOTI0OTI1OTI2OTI3OTI4OTI5OTMwOTMxOTMyOTMzOTM0OTM1OTM2OTM3OTM4OTM5"
-        "OTQwOTQxOTQyOTQzOTQ0OTQ1OTQ2OTQ3OTQ4OTQ5OTUwOTUxOTUyOTUzOTU0OTU1OTU2OTU3OTU4OTU5"
-        "OTYwOTYxOTYyOTYzOTY0OTY1OTY2OTY3OTY4OTY5OTcwOTcxOTcyOTczOTc0OTc1OTc2OTc3OTc4OTc5"
-        "OTgwOTgxOTgyOTgzOTg0OTg1OTg2OTg3OTg4OTg5OTkwOTkxOTkyOTkzOTk0OTk1OTk2OTk3OTk4OTk5"
-    ;
-    static const char final[] = "fQ==";
-
-    bool done = false;
-    while (!done) {
+    if (cpu >= 0 && !pin_current_thread(cpu)) {
+        LogWarning() << "unable to pin worker thread " << id << " to CPU " << cpu;
+    }
+
+    HashCounter* const counter = g_metrics.AddThread(absl::StrCat("cpu", id));
+
+    // Allocated after pinning, so that the pages are first touched, and
+    // therefore placed, on this thread's NUMA node.
+    std::vector<uint32_t> words(engine.batch);
+    SHA256NoncePrecomp pre;
+
+    while (!g_shutdown) {
         // Suspend mining until the difficulty drops below the user-configured
         // maximum.
-        if (g_difficulty > max_difficulty) {
-            // FIXME: would be best to have a mutex to wait on
-            absl::SleepFor(absl::Seconds(5));
-            continue;
+        if (!wait_for_mining_allowed(max_difficulty)) {
+            break;
         }
 
-        uint256 sk;
-        SecretWebcash keep;
-        keep.amount = g_mining_amount - g_subsidy_amount;
-        GetStrongRandBytes(sk.begin(), 32);
-        keep.sk = absl::BytesToHexString(absl::string_view((const char*)sk.begin(), sk.size()));
-
-        SecretWebcash subsidy;
-        subsidy.amount = g_subsidy_amount;
-        GetStrongRandBytes(sk.begin(), 32);
-        subsidy.sk = absl::BytesToHexString(absl::string_view((const char*)sk.begin(), sk.size()));
-        memory_cleanse(sk.begin(), 32);
-
-        std::string subsidy_str = std::string(to_string(subsidy).c_str());
-        // The miner won't get this far if the terms of service aren't agreed
-        // to, so we can safely hard-code acceptance here.
-        std::string prefix = absl::StrCat("{\"legalese\": {\"terms\": true}, \"webcash\": [\"", to_string(keep), "\", \"", subsidy_str, "\"], \"subsidy\": [\"", subsidy_str, "\"], \"difficulty\": ", to_string(g_difficulty), ", \"timestamp\": ", to_string(absl::ToDoubleSeconds(absl::Now() - absl::UnixEpoch())), ", \"nonce\": ");
-        // Extend the prefix to be a multiple of 48 in size...
-        prefix.resize(48 * (1 + prefix.size() / 48), ' ');
-        prefix.back() = '1';
-        // ...which becomes 64 bytes when base64 encoded.
-        std::string prefix_b64 = absl::Base64Escape(prefix);
-        // And 64 bytes is the SHA256 block size.
-        CSHA256 midstate;
-        midstate.Write((unsigned char*)prefix_b64.data(), prefix_b64.size());
-
-        const int W = 25*8;
-        unsigned char hashes[W*32] = {0};
-        for (int i = 0; i < 1000; ++i) {
-            for (int j = 0; j < 1000; j += W) {
-                g_attempts += W;
-
-                for (int k = 0; k < W; k += 8) {
-                    midstate.WriteAndFinalize8((const unsigned char*)nonces + 4*i, (const unsigned char*)nonces + 4*(j+k), (const unsigned char*)final, hashes + k*32);
+        const MiningWork work = get_mining_work(id);
+
+        bool rebuild = false;
+        for (int h = 0; h < 1000 && !rebuild; ++h) {
+            const CSHA256 midstate = work.GetMidstate(h);
+            for (int i = 0; i < 1000 && !rebuild; ++i) {
+                // Drop the work as soon as the settings change, rather than
+                // finishing the remaining nonces and producing stale reports.
+                // This is one uncontended load per thousand hashes.
+                if (g_work_epoch.load(std::memory_order_relaxed) != work.epoch) {
+                    rebuild = true;
+                    break;
                 }
 
-                for (int k = 0; k < W; ++k) {
-                    if (!(*(const uint16_t*)(hashes + k*32))) {
-                        uint256 hash({hashes + k*32, hashes + k*32 + 32});
-                        if (check_proof_of_work(hash, g_difficulty)) {
-                            std::string work = absl::StrCat(prefix_b64, absl::string_view(nonces + 4*i, 4), absl::string_view(nonces + 4*j + 4*k, 4), final);
-                            std::cout << "GOT SOLUTION!!! " << work << " " << absl::StrCat("0x" + absl::BytesToHexString(absl::string_view((const char*)hash.begin(), 32))) << " " << to_string(keep) << std::endl;
-
-                            // Add solution to the queue, and wake up the server
-                            // communication thread.
-                            {
-                                const std::lock_guard<std::mutex> lock(g_state_mutex);
-                                g_solutions.emplace_back(hash, work, keep);
-                            }
-                            g_update_thread_cv.notify_all();
-
+                // Everything which doesn't depend on the second nonce is
+                // only computed once per value of the first.
+                midstate.PrecomputeNonce1((const unsigned char*)nonces + 4*i, (const unsigned char*)final, pre);
+                for (int j = 0; j < 1000 && !rebuild; j += engine.batch) {
+                    const int n = std::min<int>(engine.batch, 1000 - j);
+                    counter->Add(n);
+
+                    // Only the first word of each hash is computed here,
+                    // which is enough to reject nearly all candidates.
+                    SHA256Nonce2FirstWord(engine.kernel, words.data(), pre, (const unsigned char*)nonces + 4*j, n);
+
+                    for (int k = 0; k < n; ++k) {
+                        // Recompute the full hash for the rare candidate
+                        // which passes the filter.
+                        if (!(words[k] >> 16) && check_candidate(work, h, i, j+k)) {
                             // Generate new Webcash secrets, so that we don't
                             // reuse a secret if we happen to generate two
                             // solutions back-to-back.
+                            rebuild = true;
                             break;
                         }
                     }
@@ -502,58 +1288,138 @@ void mining_thread_func(int id)
     }
 }
 
-int main(int argc, char **argv)
+#if defined(ENABLE_OPENCL)
+void gpu_thread_func(unsigned index, GpuMiner* gpu)
 {
-    absl::SetProgramUsageMessage(absl::StrCat("Webcash mining daemon.\n", argv[0]));
-    absl::ParseCommandLine(argc, argv);
+    HashCounter* const counter = g_metrics.AddThread(absl::StrCat("gpu", index));
+    const unsigned max_difficulty = absl::GetFlag(FLAGS_maxdifficulty);
+    const size_t batch = std::clamp(absl::GetFlag(FLAGS_gpubatch), 1u, 1000u);
 
-    const std::string server = absl::GetFlag(FLAGS_server);
+    std::vector<SHA256NoncePrecomp> pre(batch * 1000);
+    MiningWork work;
+    // The next prefix nonce of work, or 1000 if new work is needed.
+    size_t next_h = 1000;
+    while (!g_shutdown) {
+        // Suspend mining until the difficulty drops below the user-configured
+        // maximum.
+        if (!wait_for_mining_allowed(max_difficulty)) {
+            break;
+        }
 
-    // The random subsystem must be initialized before the wallet is created on
-    // first use, or else generated secrets may not be secure.  The random
-    // subsystem will auto-initialize itself on first invocation, but we do so
-    // explicitly here to make sure we don't rely on this behavior.
-    RandomInit();
-    if (!Random_SanityCheck()) {
-        std::cerr << "Error: RNG sanity check failed. RNG is not secure." << std::endl;
-        return 1;
+        // Each kernel launch hashes every nonce combination of several
+        // prefix nonces, to amortize the launch overhead.
+        if (next_h + batch > 1000 || work.epoch != g_work_epoch) {
+            work = make_mining_work();
+            next_h = 0;
+        }
+        const size_t first_h = next_h;
+        next_h += batch;
+        for (size_t p = 0; p < batch; ++p) {
+            const CSHA256 midstate = work.GetMidstate(first_h + p);
+            for (int i = 0; i < 1000; ++i) {
+                midstate.PrecomputeNonce1((const unsigned char*)nonces + 4*i, (const unsigned char*)final, pre[1000*p + i]);
+            }
+        }
+
+        std::vector<GpuCandidate> candidates;
+        try {
+            candidates = gpu->Search(pre, (const unsigned char*)nonces, 1000, std::min(32u, g_difficulty.load()));
+        } catch (const std::runtime_error& e) {
+            LogError() << e.what() << "; stopping mining on " << gpu->GetName();
+            return;
+        }
+        counter->Add(batch * 1000 * 1000);
+
+        for (const GpuCandidate& c : candidates) {
+            // Don't reuse the secrets of a prefix which already has a
+            // solution.
+            if (check_candidate(work, first_h + c.nonce1 / 1000, c.nonce1 % 1000, c.nonce2)) {
+                next_h = 1000;
+                break;
+            }
+        }
     }
+}
+#endif
 
-    // Open the wallet file, which will throw an error if the walletfile
-    // parameter is unusable.
-    g_wallet = std::unique_ptr<Wallet>(new Wallet(absl::GetFlag(FLAGS_walletfile)));
-    if (!g_wallet) {
-        std::cerr << "Error: Unable to open wallet." << std::endl;
-        return 1;
+/** Serve the current metrics at /metrics until svr.stop() is called. */
+void metrics_thread_func(httplib::Server* svr, std::string host, int port)
+{
+    svr->Get("/metrics", [](const httplib::Request&, httplib::Response& res) {
+        g_metrics.difficulty = g_difficulty.load();
+        std::string out = g_metrics.Render();
+        RenderLockStats(out, "webminer");
+        res.set_content(out, "text/plain; version=0.0.4");
+    });
+    if (!svr->listen(host.c_str(), port)) {
+        LogError() << "unable to serve metrics on " << host << ":" << port;
     }
+}
 
+/** Have the user accept the server's terms of service, if they haven't
+ *  already, in either a Wallet or a WalletClient. */
+template <typename W>
+bool accept_terms_of_service(W& wallet, const std::string& server)
+{
     std::cout << "Fetching current terms of service from server." << std::endl;
     std::optional<std::string> terms = get_terms_of_service(server);
     if (!terms) {
         std::cerr << "Error: Unable to fetch terms of service from server." << std::endl;
-        return 1;
+        return false;
     }
-    bool accepted = g_wallet->AreTermsAccepted(*terms);
+    bool accepted = wallet.AreTermsAccepted(*terms);
     if (!accepted) {
         if (absl::GetFlag(FLAGS_acceptterms)) {
-            std::cout << "Auto-accepting" << (g_wallet->HaveAcceptedTerms() ? " updated" : "") << " terms of service." << std::endl;
+            std::cout << "Auto-accepting" << (wallet.HaveAcceptedTerms() ? " updated" : "") << " terms of service." << std::endl;
         } else {
             std::cout << std::endl
                       << absl::StripAsciiWhitespace(*terms) << std::endl
                       << std::endl
                       << std::endl
-                      << "Do you accept these" << (g_wallet->HaveAcceptedTerms() ? " updated" : "") << " terms of service? (y/N): ";
+                      << "Do you accept these" << (wallet.HaveAcceptedTerms() ? " updated" : "") << " terms of service? (y/N): ";
             std::string line;
             std::getline(std::cin, line);
             absl::string_view input = absl::StripLeadingAsciiWhitespace(line);
             if (input.empty() || (absl::ascii_tolower(input[0]) != 'y')) {
                 std::cerr << "Error: Terms of service not accepted by user." << std::endl;
-                return 1;
+                return false;
             }
         }
-        g_wallet->AcceptTerms(*terms);
+        wallet.AcceptTerms(*terms);
     }
     std::cout << "Terms of service" << (accepted ? " already" : "") << " accepted." << std::endl;
+    return true;
+}
+
+/** Open the wallet, or connect to the one served at --remotewallet, and
+ *  have the user accept the server's terms of service if they haven't
+ *  already. */
+bool init_wallet(const std::string& server)
+{
+    const std::string remote_wallet = absl::GetFlag(FLAGS_remotewallet);
+    if (!remote_wallet.empty()) {
+        std::cout << "Using the wallet served at " << remote_wallet << std::endl;
+        g_wallet_client = std::make_unique<WalletClient>(remote_wallet);
+        try {
+            if (!accept_terms_of_service(*g_wallet_client, server)) {
+                return false;
+            }
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return false;
+        }
+    } else {
+        // Open the wallet file, which will throw an error if the walletfile
+        // parameter is unusable.
+        g_wallet = std::unique_ptr<Wallet>(new Wallet(absl::GetFlag(FLAGS_walletfile)));
+        if (!g_wallet) {
+            std::cerr << "Error: Unable to open wallet." << std::endl;
+            return false;
+        }
+        if (!accept_terms_of_service(*g_wallet, server)) {
+            return false;
+        }
+    }
 
     {
         // Touch the wallet file, which will create it if it doesn't
@@ -570,47 +1436,418 @@ int main(int argc, char **argv)
         orphan_log.flush();
     }
 
+    return true;
+}
+
+/**
+ * Mine for the given number of seconds with num_workers threads, without
+ * submitting anything, and print the results as a line of JSON.
+ */
+int run_benchmark(const MiningEngine& engine, const std::string& algo, int num_workers, unsigned seconds)
+{
+    g_benchmark = true;
+    g_difficulty = absl::GetFlag(FLAGS_benchmarkdifficulty);
+
+    g_work_queues.resize(num_workers);
+    std::thread work_producer_thread(work_producer_thread_func);
+    std::vector<std::thread> mining_threads;
+    const std::vector<int> cpus = get_affinity_cpus();
+    for (int i = 0; i < num_workers; ++i) {
+        mining_threads.emplace_back(mining_thread_func, i, engine, cpus.empty() ? -1 : cpus[i % cpus.size()]);
+    }
+
+    // Exclude the thread startup from the measurement.
+    absl::SleepFor(absl::Milliseconds(100));
+    const absl::Time begin = absl::Now();
+    g_metrics.Sample(begin);
+    const int64_t candidates_begin = g_metrics.candidates;
+    const int64_t solutions_begin = g_metrics.solutions;
+    absl::SleepFor(absl::Seconds(seconds));
+    const absl::Time end = absl::Now();
+    const int64_t hashes = g_metrics.Sample(end);
+    const int64_t candidates = g_metrics.candidates - candidates_begin;
+    const int64_t solutions = g_metrics.solutions - solutions_begin;
+
+    // Have the mining threads drop their work and exit.
+    g_shutdown = true;
+    new_work_epoch();
+    for (std::thread& thread : mining_threads) {
+        thread.join();
+    }
+    {
+        const std::lock_guard<std::mutex> lock(g_work_queue_mutex);
+        g_work_queue_cv.notify_all();
+    }
+    work_producer_thread.join();
+
+    const double elapsed = absl::ToDoubleSeconds(end - begin);
+    UniValue threads(UniValue::VARR);
+    for (const auto& thread : g_metrics.GetThreadHashrates()) {
+        UniValue t(UniValue::VOBJ);
+        t.pushKV("name", thread.first);
+        t.pushKV("hashrate", thread.second);
+        threads.push_back(t);
+    }
+    UniValue o(UniValue::VOBJ);
+    o.pushKV("sha256", algo);
+    o.pushKV("engine", to_string(engine));
+    o.pushKV("seconds", elapsed);
+    o.pushKV("difficulty", (int)g_difficulty);
+    o.pushKV("hashes", hashes);
+    o.pushKV("hashrate", g_metrics.GetHashrate());
+    o.pushKV("candidates", candidates);
+    o.pushKV("candidate_rate", candidates / elapsed);
+    o.pushKV("solutions", solutions);
+    o.pushKV("solution_rate", solutions / elapsed);
+    o.pushKV("threads", threads);
+    std::cout << o.write() << std::endl;
+    return 0;
+}
+
+/** Split an address of the form HOST:PORT. */
+bool parse_address(const std::string& addr, std::string& host, int& port)
+{
+    const size_t colon = addr.rfind(':');
+    if (colon == std::string::npos || !absl::SimpleAtoi(addr.substr(colon + 1), &port)) {
+        return false;
+    }
+    host = addr.substr(0, colon);
+    return true;
+}
+
+// Set by main() once every thread has been launched, after which a shutdown
+// request is handled by the threads winding down.
+std::atomic<bool> g_started{false};
+
+/** Have every thread finish what it is doing and exit, waking up any that
+ *  are waiting. */
+void request_shutdown()
+{
+    g_shutdown = true;
+    // Wakes the mining threads, whether paused or working, and the producer.
+    new_work_epoch();
+    {
+        const std::lock_guard<std::mutex> lock(g_solutions_mutex);
+        g_solutions_cv.notify_all();
+    }
+    {
+        LOCK_GUARD(g_state_mutex);
+        g_claims_cv.notify_all();
+        g_update_thread_cv.notify_all();
+    }
+    {
+        const std::lock_guard<std::mutex> lock(g_target_mutex);
+        if (g_target_client) {
+            g_target_client->stop();
+        }
+    }
+    if (g_coordinator_client) {
+        // Mining threads may be waiting on it for work.
+        g_coordinator_client->Stop();
+    }
+}
+
+/** Wait for SIGINT or SIGTERM, which every other thread blocks.  The first
+ *  shuts the miner down cleanly, so that unsubmitted solutions are spilled
+ *  to disk.  A second, or one during startup, exits straight away. */
+void signal_thread_func(sigset_t signals)
+{
+    int sig;
+    if (sigwait(&signals, &sig) != 0) {
+        return;
+    }
+    if (g_started) {
+        std::cout << "Shutting down; signal again to exit immediately." << std::endl;
+        request_shutdown();
+        if (sigwait(&signals, &sig) != 0) {
+            return;
+        }
+    }
+    std::cout << std::flush;
+    std::_Exit(128 + sig);
+}
+
+int main(int argc, char **argv)
+{
+    absl::SetProgramUsageMessage(absl::StrCat("Webcash mining daemon.\n", argv[0]));
+    absl::ParseCommandLine(argc, argv);
+    SetLockProfiling(absl::GetFlag(FLAGS_profile_locks));
+
+    // Blocked before any other thread is launched, so that all of them
+    // inherit the mask and the signals are only seen by the signal thread.
+    sigset_t signals;
+    sigemptyset(&signals);
+    sigaddset(&signals, SIGINT);
+    sigaddset(&signals, SIGTERM);
+    pthread_sigmask(SIG_BLOCK, &signals, nullptr);
+    std::thread(signal_thread_func, signals).detach();
+
+    const std::string server = absl::GetFlag(FLAGS_server);
+
+    // The random subsystem must be initialized before the wallet is created on
+    // first use, or else generated secrets may not be secure.  The random
+    // subsystem will auto-initialize itself on first invocation, but we do so
+    // explicitly here to make sure we don't rely on this behavior.
+    RandomInit();
+    if (!Random_SanityCheck()) {
+        std::cerr << "Error: RNG sanity check failed. RNG is not secure." << std::endl;
+        return 1;
+    }
+
+    const std::string metrics_addr = absl::GetFlag(FLAGS_metrics);
+    const std::string serve_addr = absl::GetFlag(FLAGS_serve);
+    const std::string coordinator_addr = absl::GetFlag(FLAGS_coordinator);
+    std::string metrics_host, serve_host, coordinator_host;
+    int metrics_port, serve_port, coordinator_port;
+    if (!metrics_addr.empty() && !parse_address(metrics_addr, metrics_host, metrics_port)) {
+        std::cerr << "Error: --metrics must be of the form ADDRESS:PORT" << std::endl;
+        return 1;
+    }
+    if (!serve_addr.empty() && !parse_address(serve_addr, serve_host, serve_port)) {
+        std::cerr << "Error: --serve must be of the form ADDRESS:PORT" << std::endl;
+        return 1;
+    }
+    if (!coordinator_addr.empty() && !parse_address(coordinator_addr, coordinator_host, coordinator_port)) {
+        std::cerr << "Error: --coordinator must be of the form ADDRESS:PORT" << std::endl;
+        return 1;
+    }
+    const bool agent = !coordinator_addr.empty();
+    if (agent && !serve_addr.empty()) {
+        std::cerr << "Error: --serve and --coordinator are mutually exclusive" << std::endl;
+        return 1;
+    }
+    const std::string serve_wallet = absl::GetFlag(FLAGS_servewallet);
+    if (!serve_wallet.empty() && !absl::GetFlag(FLAGS_remotewallet).empty()) {
+        std::cerr << "Error: --servewallet and --remotewallet are mutually exclusive" << std::endl;
+        return 1;
+    }
+    if (agent && !serve_wallet.empty()) {
+        std::cerr << "Error: --servewallet and --coordinator are mutually exclusive" << std::endl;
+        return 1;
+    }
+
+    // Agents have no wallet of their own, and never talk to the server.
+    // Nor do benchmarks.
+    const unsigned benchmark_seconds = absl::GetFlag(FLAGS_benchmark);
+    if (!agent && !benchmark_seconds && !init_wallet(server)) {
+        return 1;
+    }
+    if (g_wallet && !serve_wallet.empty()) {
+        g_wallet_server = std::make_unique<WalletServer>(*g_wallet);
+        if (!g_wallet_server->Listen(serve_wallet)) {
+            return 1;
+        }
+        std::cout << "Serving the wallet to other miners at " << serve_wallet << std::endl;
+    }
+
     int num_workers = get_num_workers();
 
     const std::string algo = SHA256AutoDetect();
     std::cout << "Using SHA256 algorithm '" << algo << "'." << std::endl;
 
+    const std::optional<MiningEngine> engine = select_mining_engine(num_workers);
+    if (!engine) {
+        return 1;
+    }
+    std::cout << "Using mining engine '" << to_string(*engine) << "'." << std::endl;
+
+    if (benchmark_seconds) {
+        return run_benchmark(*engine, algo, num_workers, benchmark_seconds);
+    }
+
     // Inform the user of the maximum difficulty setting.
     std::cout << "Setting maximum difficulty to " << absl::GetFlag(FLAGS_maxdifficulty) << "." << std::endl;
 
-    ProtocolSettings settings;
-    if (!get_protocol_settings(server, settings)) {
-        std::cerr << "Error: could not fetch protocol settings from server; exiting" << std::endl;
-        return 1;
+#if defined(ENABLE_OPENCL)
+    // Set up each GPU before any thread is started, so that a bad --gpus
+    // index, or a device which fails to initialise, can still exit cleanly.
+    std::vector<std::unique_ptr<GpuMiner>> gpus;
+    const std::string gpus_flag = absl::GetFlag(FLAGS_gpus);
+    const std::vector<std::string> devices = GpuMiner::ListDevices();
+    for (size_t i = 0; i < devices.size(); ++i) {
+        std::cout << "Found OpenCL device " << i << ": " << devices[i] << std::endl;
     }
-    std::cout << "server says"
-              << " difficulty=" << settings.difficulty
-              << " ratio=" << settings.ratio
-              << std::endl;
-    g_difficulty = settings.difficulty;
-    g_mining_amount = settings.mining_amount;
-    g_subsidy_amount = settings.subsidy_amount;
+    std::vector<unsigned> gpu_indices;
+    if (gpus_flag == "all") {
+        for (size_t i = 0; i < devices.size(); ++i) {
+            gpu_indices.push_back(i);
+        }
+    } else if (!gpus_flag.empty()) {
+        for (absl::string_view index : absl::StrSplit(gpus_flag, ',')) {
+            unsigned i;
+            if (!absl::SimpleAtoi(index, &i) || i >= devices.size()) {
+                std::cerr << "Error: invalid OpenCL device index '" << index << "' in --gpus" << std::endl;
+                return 1;
+            }
+            gpu_indices.push_back(i);
+        }
+    }
+    for (unsigned i : gpu_indices) {
+        try {
+            gpus.emplace_back(new GpuMiner(i));
+        } catch (const std::runtime_error& e) {
+            std::cerr << "Error: " << e.what() << std::endl;
+            return 1;
+        }
+        std::cout << "Mining with OpenCL device " << i << ": " << gpus.back()->GetName() << std::endl;
+    }
+#endif
+
+    std::thread update_thread;
+    std::thread target_thread;
+    std::vector<std::thread> submit_threads;
+    std::thread claim_thread;
+    if (agent) {
+        // The coordinator sends its settings as soon as we connect, and
+        // whenever they change.
+        std::cout << "Mining as an agent of the coordinator at " << coordinator_addr << std::endl;
+        g_coordinator_client = std::make_unique<CoordinatorClient>(coordinator_host, coordinator_port, [](uint64_t epoch, unsigned difficulty) {
+            if (difficulty != g_difficulty) {
+                std::cout << "coordinator says difficulty=" << difficulty << std::endl;
+            }
+            g_difficulty = difficulty;
+            set_work_epoch(epoch);
+        });
+    } else {
+        ProtocolSettings settings;
+        if (!get_protocol_settings(server, settings)) {
+            std::cerr << "Error: could not fetch protocol settings from server; exiting" << std::endl;
+            return 1;
+        }
+        std::cout << "server says"
+                  << " difficulty=" << settings.difficulty
+                  << " ratio=" << settings.ratio
+                  << std::endl;
+        g_difficulty = settings.difficulty;
+        g_mining_amount = settings.mining_amount;
+        g_subsidy_amount = settings.subsidy_amount;
+
+        // Hand out work to agents, if requested.
+        if (!serve_addr.empty()) {
+            g_coordinator_server = std::make_unique<CoordinatorServer>(make_agent_work, handle_agent_solution);
+            g_coordinator_server->Broadcast(g_work_epoch, g_difficulty);
+            if (!g_coordinator_server->Listen(serve_host, serve_port)) {
+                return 1;
+            }
+            std::cout << "Serving work to mining agents on " << serve_addr << std::endl;
+        }
 
-    // Launch thread to update RNG and protocol settings, and to
-    // submit work in the background.
-    std::thread update_thread(update_thread_func);
+        // Launch thread to update RNG and protocol settings in the
+        // background, and another to have changes to the protocol settings
+        // pushed to us as soon as they happen.
+        update_thread = std::thread(update_thread_func);
+        target_thread = std::thread(target_thread_func, settings);
+
+        // Launch the threads which submit solutions and claim the webcash,
+        // starting with any solutions left over from the last run.
+        {
+            std::ifstream spill(absl::GetFlag(FLAGS_solutionspill));
+            g_spilled = spill.peek() != std::ifstream::traits_type::eof();
+        }
+        for (unsigned i = 0; i < std::max(1u, absl::GetFlag(FLAGS_submitthreads)); ++i) {
+            submit_threads.emplace_back(submit_thread_func);
+        }
+        claim_thread = std::thread(claim_thread_func);
+    }
+
+    // Launch the metrics server, if requested.
+    httplib::Server metrics_server;
+    std::thread metrics_thread;
+    if (!metrics_addr.empty()) {
+        std::cout << "Serving metrics at http://" << metrics_addr << "/metrics" << std::endl;
+        metrics_thread = std::thread(metrics_thread_func, &metrics_server, metrics_host, metrics_port);
+    }
+
+    // Launch the thread that prepares work for the mining threads.
+    g_work_queues.resize(num_workers);
+    std::thread work_producer_thread(work_producer_thread_func);
 
     // Launch worker threads
     std::vector<std::thread> mining_threads;
     mining_threads.reserve(num_workers);
+    const std::vector<int> cpus = get_affinity_cpus();
     std::cout << "Spawning " << num_workers << " worker threads" << std::endl;
+    if (!cpus.empty()) {
+        std::cout << "Pinning worker threads to CPUs " << absl::StrJoin(cpus, ",") << std::endl;
+        if (num_workers > (int)cpus.size()) {
+            std::cerr << "Warning: more workers than CPUs selected by --affinity; some CPUs will run more than one worker" << std::endl;
+        }
+    }
     for (int i = 0; i < num_workers; ++i) {
-        mining_threads.emplace_back(mining_thread_func, i);
+        mining_threads.emplace_back(mining_thread_func, i, *engine, cpus.empty() ? -1 : cpus[i % cpus.size()]);
     }
 
-    // Wait for mining threads to exit
+#if defined(ENABLE_OPENCL)
+    // Launch a thread for each GPU, which run alongside the CPU workers.
+    for (size_t i = 0; i < gpus.size(); ++i) {
+        mining_threads.emplace_back(gpu_thread_func, gpu_indices[i], gpus[i].get());
+    }
+#endif
+    g_started = true;
+
+    // Wait for mining threads to exit, which they do once a signal has
+    // requested shutdown.
     while (!mining_threads.empty()) {
         mining_threads.back().join();
         mining_threads.pop_back();
     }
 
-    // Wait for server communication thread to finish
-    update_thread.join();
+    // Wait for server communication threads to finish
+    if (g_coordinator_server) {
+        g_coordinator_server->Stop();
+    }
+    if (update_thread.joinable()) {
+        update_thread.join();
+    }
+    {
+        const std::lock_guard<std::mutex> lock(g_target_mutex);
+        if (g_target_client) {
+            g_target_client->stop();
+        }
+    }
+    if (target_thread.joinable()) {
+        target_thread.join();
+    }
+    {
+        const std::lock_guard<std::mutex> lock(g_solutions_mutex);
+        g_solutions_cv.notify_all();
+    }
+    {
+        LOCK_GUARD(g_state_mutex);
+        g_claims_cv.notify_all();
+    }
+    for (std::thread& thread : submit_threads) {
+        thread.join();
+    }
+    if (claim_thread.joinable()) {
+        claim_thread.join();
+    }
+    if (g_wallet_server) {
+        // Other miners may still be claiming into our wallet.
+        g_wallet_server->Stop();
+    }
+
+    if (g_coordinator_client) {
+        // Wakes up the producer if it's waiting for work.
+        g_coordinator_client->Stop();
+    }
+    {
+        const std::lock_guard<std::mutex> lock(g_work_queue_mutex);
+        g_work_queue_cv.notify_all();
+    }
+    work_producer_thread.join();
+
+    // Hand the mining secrets of unfinished work back to the wallet.
+    g_work_queues.clear();
+    {
+        const std::lock_guard<std::mutex> lock(g_agent_work_mutex);
+        g_agent_work.clear();
+    }
+
+    if (metrics_thread.joinable()) {
+        metrics_server.stop();
+        metrics_thread.join();
+    }
 
     return 0;
 }